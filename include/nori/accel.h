@@ -0,0 +1,388 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ACCEL_H)
+#define __ACCEL_H
+
+#include <nori/mesh.h>
+#include <nori/bbox.h>
+
+/// Number of rays that are traced together by \ref Accelerator::rayIntersectPacket()
+#define NORI_PACKET_SIZE 4
+
+/// Number of grid cells per axis used to sort ray origins in \ref sortRays()
+#define NORI_RAYSORT_GRID 1024
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Abstract interface of a ray intersection acceleration
+ * data structure over a set of triangle meshes
+ *
+ * The meshes registered via \ref addMesh() are concatenated into
+ * a single primitive index space. The acceleration data structure
+ * takes ownership of them and releases them when it is destroyed
+ * (unless disabled via \ref setOwnsMeshes()).
+ *
+ * Besides the built-in kd-tree and BVH, implementations may be provided
+ * by plug-ins (e.g. wrappers of an external ray tracing kernel library),
+ * which register themselves with the \ref AcceleratorFactory. Such an 
+ * implementation copies the triangles of the registered meshes into its
+ * own representation in \ref build(), and reports hits by setting the
+ * \c t, \c mesh and \c bary fields of the \ref Intersection and calling
+ * \ref fillIntersectionRecord() with the triangle index within the mesh
+ * (see \ref findMesh() for the conversion from the global index space).
+ */
+class Accelerator {
+public:
+	typedef uint32_t SizeType;
+	typedef uint32_t IndexType;
+
+	/**
+	 * \brief Traversal work done by the queries of one thread (see
+	 * \ref collectTraversalStatistics())
+	 */
+	struct TraversalStatistics {
+		/// Number of \ref rayIntersect() and \ref rayOccluded() calls
+		uint64_t queries;
+		/// Number of visited interior nodes
+		uint64_t nodes;
+		/// Number of visited leaf nodes
+		uint64_t leaves;
+		/// Number of ray-triangle tests (a block of four counts as four)
+		uint64_t triangles;
+		/// Number of queries that found an intersection
+		uint64_t hits;
+
+		inline TraversalStatistics() : queries(0), nodes(0), leaves(0),
+			triangles(0), hits(0) { }
+
+		inline TraversalStatistics &operator+=(const TraversalStatistics &stats) {
+			queries += stats.queries; nodes += stats.nodes;
+			leaves += stats.leaves; triangles += stats.triangles;
+			hits += stats.hits;
+			return *this;
+		}
+
+		/// Return the total number of node visits and triangle tests
+		inline uint64_t getCost() const { return nodes + leaves + triangles; }
+
+		/// Return a human-readable summary (averages per query)
+		QString toString() const;
+	};
+
+	/**
+	 * \brief Traversal state shared by the camera rays of an image block,
+	 * which start at a common origin (see \ref prepareCameraRays())
+	 */
+	struct CameraRaySeed {
+		/// Accelerator that prepared the seed (\c NULL = none)
+		const Accelerator *accel;
+		/// Common origin of the rays
+		Point3f origin;
+		/// Region that must contain the point where a ray enters the structure
+		BoundingBox3f region;
+		/// Implementation-specific traversal state
+		std::vector<uint32_t> nodes;
+
+		inline CameraRaySeed() : accel(NULL) { }
+	};
+
+	/// Release all memory (including the registered meshes)
+	virtual ~Accelerator();
+
+	/**
+	 * \brief Register a triangle mesh for inclusion in the acceleration
+	 * data structure.
+	 *
+	 * This function can only be used before \ref build() is called
+	 */
+	void addMesh(Mesh *mesh);
+
+	/**
+	 * \brief Should the registered meshes be released along with the 
+	 * acceleration data structure? (\c true by default)
+	 *
+	 * Disable this for additional structures over meshes that are
+	 * owned by another one (e.g. replicas or previews).
+	 */
+	inline void setOwnsMeshes(bool value) { m_ownsMeshes = value; }
+
+	/**
+	 * \brief Build the acceleration data structure
+	 *
+	 * When called again, the data structure is rebuilt from scratch
+	 * using the current vertex positions of the registered meshes.
+	 */
+	virtual void build() = 0;
+
+	/**
+	 * \brief Update the data structure after the vertex positions of 
+	 * registered meshes have changed (see \ref Mesh::setVertexPositions())
+	 *
+	 * The default implementation simply calls \ref build() again.
+	 * Implementations may override this with a cheaper incremental update.
+	 *
+	 * \return \c true if the existing data structure could be updated
+	 *    incrementally, and \c false if it had to be rebuilt
+	 */
+	virtual bool update();
+
+	/**
+	 * \brief Intersect a ray against all triangle meshes registered
+	 * with the acceleration data structure
+	 *
+	 * A hit record (distance, mesh, triangle index and barycentric
+	 * coordinates) will be stored in the provided \ref Intersection
+	 * data record. Call \ref Intersection::computeDifferentialGeometry()
+	 * to obtain its position and frames.
+	 *
+	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
+	 * information is really needed. When set to \c true, the 
+	 * function just checks whether or not there is occlusion, but without
+	 * providing any more detail (i.e. \c its will not be filled with
+	 * contents). This is usually much faster.
+	 *
+	 * \return \c true If an intersection was found
+	 */
+	virtual bool rayIntersect(const Ray3f &ray, Intersection &its, 
+		bool shadowRay = false) const = 0;
+
+	/**
+	 * \brief Determine whether a ray segment intersects any triangle
+	 *
+	 * This any-hit query never touches an intersection record. The
+	 * default implementation calls \ref rayIntersect() with 
+	 * <tt>shadowRay=true</tt>; implementations may override it with a
+	 * dedicated occlusion traversal.
+	 *
+	 * \return \c true if the segment is occluded
+	 */
+	virtual bool rayOccluded(const Ray3f &ray) const;
+
+	/**
+	 * \brief Intersect a packet of \ref NORI_PACKET_SIZE rays against
+	 * all triangle meshes
+	 *
+	 * The default implementation simply calls \ref rayIntersect() for
+	 * each ray. Implementations may override this with a faster
+	 * coherent traversal.
+	 *
+	 * \return A bit mask, whose i-th bit is set when ray \c i
+	 *    intersected a triangle.
+	 */
+	virtual int rayIntersectPacket(const Ray3f *rays, Intersection *its,
+		bool shadowRay = false) const;
+
+	/**
+	 * \brief Intersect a whole batch of (incoherent) rays
+	 *
+	 * This is the query issued by the wavefront integrators, which
+	 * shade while nothing else traces, so that a backend may process the
+	 * batch asynchronously or on another device (e.g. a GPU). The default
+	 * implementation calls \ref rayIntersect() for each ray in order.
+	 *
+	 * \param indices
+	 *    Indices of the rays to be traced in the order given (or \c NULL 
+	 *    to trace the first \c count rays). Intersection records and 
+	 *    results are stored at the same indices.
+	 * \param hit
+	 *    Receives \c true for the rays that intersected a triangle
+	 */
+	virtual void rayIntersectBatch(const Ray3f *rays, const uint32_t *indices,
+		uint32_t count, Intersection *its, bool *hit) const;
+
+	/**
+	 * \brief Determine whether each ray segment of a batch is occluded
+	 *
+	 * The occlusion counterpart of \ref rayIntersectBatch() (same
+	 * conventions). The default implementation calls \ref rayOccluded()
+	 * for each ray in order.
+	 */
+	virtual void rayOccludedBatch(const Ray3f *rays, const uint32_t *indices,
+		uint32_t count, bool *occluded) const;
+
+	/**
+	 * \brief Precompute the part of the traversal that is shared by all
+	 * rays from \c origin whose directions lie in the convex hull of
+	 * the four directions \c corners (e.g. the camera rays of a block)
+	 *
+	 * The default implementation prepares nothing and returns \c false.
+	 *
+	 * \return \c true if \c seed can be passed to \ref rayIntersectSeeded()
+	 */
+	virtual bool prepareCameraRays(const Point3f &origin, const Vector3f *corners,
+		CameraRaySeed &seed) const;
+
+	/**
+	 * \brief Intersect a ray that was covered by \ref prepareCameraRays(),
+	 * starting from the precomputed traversal state
+	 *
+	 * Returns the same result as \ref rayIntersect(), which the default
+	 * implementation calls (as do others for a ray that doesn't start
+	 * at the seed's origin).
+	 */
+	virtual bool rayIntersectSeeded(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed &seed) const;
+
+	/// Return an axis-aligned bounding box containing all meshes
+	virtual const BoundingBox3f &getBoundingBox() const = 0;
+
+	/// Return the amount of memory used by the built data structure (in bytes)
+	virtual size_t getMemoryUsage() const = 0;
+
+	/**
+	 * \brief Add the memory used by the built data structure to a report
+	 *
+	 * The default implementation adds \ref getMemoryUsage() to the
+	 * \c accel category.
+	 */
+	virtual void reportMemory(MemoryReport &report) const;
+
+	/// Return the time spent in \ref build() in milliseconds
+	virtual qint64 getBuildTime() const = 0;
+
+	/// Return a short name of the acceleration data structure type
+	virtual QString getName() const = 0;
+
+	/**
+	 * \brief Return the traversal work done by the calling thread's
+	 * queries since the previous call, and reset it
+	 *
+	 * Counting slows down the traversal and is hence only compiled in
+	 * when \c NORI_TRAVERSAL_STATISTICS is defined (<tt>qmake
+	 * CONFIG+=travstats</tt>), and only by data structures that support
+	 * it. The default implementation returns \c false.
+	 *
+	 * \return \c true if \c stats was filled in
+	 */
+	virtual bool collectTraversalStatistics(TraversalStatistics &stats) const;
+
+	/// Return the total number of internally represented triangles 
+	inline SizeType getPrimitiveCount() const { return m_primitiveCount; }
+
+	/// Return the total number of meshes registered
+	inline SizeType getMeshCount() const { return (SizeType) m_meshes.size(); }
+
+	/// Return one of the registered meshes
+	inline Mesh *getMesh(IndexType idx) { return m_meshes[idx]; }
+	
+	/// Return one of the registered meshes (const version)
+	inline const Mesh *getMesh(IndexType idx) const { return m_meshes[idx]; }
+
+protected:
+	/// Create an empty acceleration data structure
+	Accelerator();
+
+	/**
+	 * \brief Compute the mesh and triangle indices corresponding to 
+	 * a primitive index in the global primitive index space
+	 */
+	IndexType findMesh(IndexType &idx) const {
+		std::vector<IndexType>::const_iterator it = std::lower_bound(
+				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
+		idx -= *it;
+		return (IndexType) (it - m_sizeMap.begin());
+	}
+
+	/**
+	 * \brief Finish the hit record of an intersection, whose \c t,
+	 * \c mesh and \c bary fields have already been set by the traversal
+	 * code. The differential geometry is computed lazily.
+	 */
+	inline void fillIntersectionRecord(IndexType primIndex, Intersection &its) const {
+		its.primIndex = primIndex;
+		its.toWorldTrafo = NULL;
+		its.hasDifferentials = false;
+	}
+
+protected:
+	std::vector<Mesh *> m_meshes;
+	std::vector<SizeType> m_sizeMap;
+	bool m_ownsMeshes;
+	SizeType m_primitiveCount;
+};
+
+/**
+ * \brief Factory of the acceleration data structures provided by
+ * plug-ins, which scenes select by name (\c accel property)
+ *
+ * The constructor receives the property list of the scene, so that a
+ * plug-in can read its own parameters from it. The built-in types
+ * (\c kdtree, \c bvh and \c bvh4) are created by the scene itself.
+ */
+class AcceleratorFactory {
+public:
+	typedef boost::function<Accelerator *(const PropertyList &)> Constructor;
+
+	/**
+	 * \brief Register the constructor of an acceleration data structure
+	 * (called by the macro \ref NORI_REGISTER_ACCELERATOR)
+	 */
+	static void registerAccelerator(const QString &name, const Constructor &constr);
+
+	/// Is there an acceleration data structure with the given name?
+	static bool isRegistered(const QString &name);
+
+	/// Return the names of all registered types, separated by commas
+	static QString getNames();
+
+	/**
+	 * \brief Construct an (empty) acceleration data structure of the
+	 * given type. Throws an exception if it isn't registered.
+	 */
+	static Accelerator *createInstance(const QString &name, const PropertyList &propList);
+private:
+	static std::map<QString, Constructor> *m_constructors;
+};
+
+/// Macro for registering an acceleration data structure with the \ref AcceleratorFactory
+#define NORI_REGISTER_ACCELERATOR(cls, name) \
+	Accelerator *cls ##_createAccel(const PropertyList &list) { \
+		return new cls(list); \
+	} \
+	static struct cls ##_accel_{ \
+		cls ##_accel_() { \
+			AcceleratorFactory::registerAccelerator(name, cls ##_createAccel); \
+		} \
+	} cls ##__accel;
+
+/**
+ * \brief Compute an order in which a batch of incoherent rays (e.g.
+ * ambient occlusion or path tracing rays) should be traced
+ *
+ * Tracing rays that start close to each other and point in similar
+ * directions one after the other lets them reuse the nodes and 
+ * triangles that previous rays have brought into the cache. This
+ * function sorts the rays along a Morton (Z-order) curve through a grid
+ * of \ref NORI_RAYSORT_GRID^3 cells over \c bbox based on their origins,
+ * and groups the rays within each cell by the octant of their direction.
+ *
+ * \param rays
+ *    Array of \c count rays
+ * \param bbox
+ *    Bounding box of the scene
+ * \param order
+ *    Used to return a permutation of <tt>[0, count)</tt>
+ */
+extern void sortRays(const Ray3f *rays, uint32_t count, 
+	const BoundingBox3f &bbox, std::vector<uint32_t> &order);
+
+NORI_NAMESPACE_END
+
+#endif /* __ACCEL_H */
@@ -0,0 +1,114 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ALBEDO_H)
+#define __ALBEDO_H
+
+#include <nori/common.h>
+
+/// Version of the albedo table format (increase when changing the layout)
+#define NORI_ALBEDO_TABLE_VERSION 1
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tabulated directional albedo of a BSDF over the cosine of the
+ * incident angle and a roughness parameter
+ *
+ * The directional albedo \f$E(\mu, r)\f$ is the fraction of the light
+ * arriving from a direction with \f$\cos\theta_i = \mu\f$ that is
+ * scattered into the upper hemisphere, i.e. the integral of the BSDF
+ * times \f$\cos\theta_o\f$ over all outgoing directions. Such tables
+ * are needed e.g. for energy compensation of microfacet models and for
+ * choosing between the components of a BSDF. They are computed by the
+ * \c albedotable tool (which uses \ref NDIntegrator) and stored as a
+ * small binary file, which BSDFs load instead of estimating the albedo
+ * at runtime.
+ *
+ * The entries lie at the centers of \c cosThetaResolution intervals of
+ * \f$[0, 1]\f$ and at \c roughnessResolution equidistant roughness
+ * values from \c minRoughness to \c maxRoughness (inclusive). Lookups
+ * interpolate bilinearly and clamp to the table. The table also
+ * provides the average albedo \f$E_{avg}(r) = 2\int_0^1 E(\mu, r)\,\mu
+ * \,\mathrm{d}\mu\f$ for diffuse illumination.
+ */
+class AlbedoTable {
+public:
+	/// Create an empty table
+	AlbedoTable();
+
+	/// Create a table with the given resolution (all entries are zero)
+	AlbedoTable(int cosThetaResolution, int roughnessResolution,
+		float minRoughness, float maxRoughness);
+
+	/// Load a table from a file (throws a \ref NoriException on failure)
+	void load(const QString &filename);
+
+	/// Write the table to a file (throws a \ref NoriException on failure)
+	void save(const QString &filename) const;
+
+	/// Does the table have any entries?
+	inline bool isValid() const { return !m_data.empty(); }
+
+	/// Return the number of entries along the \f$\cos\theta\f$ axis
+	inline int getCosThetaResolution() const { return m_cosThetaResolution; }
+
+	/// Return the number of entries along the roughness axis
+	inline int getRoughnessResolution() const { return m_roughnessResolution; }
+
+	/// Return the cosine of the incident angle of an entry
+	inline float getCosTheta(int i) const {
+		return (i + 0.5f) / m_cosThetaResolution;
+	}
+
+	/// Return the roughness of an entry
+	inline float getRoughness(int j) const {
+		return m_roughnessResolution > 1 ? m_minRoughness + (m_maxRoughness - m_minRoughness)
+			* j / (float) (m_roughnessResolution - 1) : m_minRoughness;
+	}
+
+	/// Access an entry
+	inline float &coeff(int i, int j) { return m_data[j * m_cosThetaResolution + i]; }
+
+	/// Access an entry
+	inline float coeff(int i, int j) const { return m_data[j * m_cosThetaResolution + i]; }
+
+	/// Recompute the average albedos (after changing entries with \ref coeff())
+	void computeAverages();
+
+	/// Look up the directional albedo
+	float eval(float cosTheta, float roughness) const;
+
+	/// Look up the average albedo
+	float evalAverage(float roughness) const;
+
+	/// Return a human-readable summary
+	QString toString() const;
+protected:
+	/// Find the roughness entries enclosing a value and the interpolation weight
+	void findRoughness(float roughness, int &j, float &t) const;
+private:
+	int m_cosThetaResolution, m_roughnessResolution;
+	float m_minRoughness, m_maxRoughness;
+	std::vector<float> m_data;
+	std::vector<float> m_averages;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __ALBEDO_H */
@@ -0,0 +1,161 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__AOV_H)
+#define __AOV_H
+
+#include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <QStringList>
+
+/* Floats per pixel in the AOV buffer of an image block: sample count, 
+   depth, normal (3), albedo (3), luminance and its square, traversal
+   cost, render time of the samples and of their blocks, and mesh ID 
+   (which must come last) */
+#define NORI_AOV_CHANNELS 14
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Arbitrary output variables (AOVs), i.e. auxiliary images that 
+ * are rendered along with the radiance
+ *
+ * Used as flags by the \c aovs property of the scene
+ */
+enum EAOV {
+	/// Distance to the first surface seen by the camera rays
+	EAOVDepth = 0x01,
+	/// World-space shading normal of the first surface
+	EAOVNormal = 0x02,
+	/// Reflectance of the first surface (see \ref BSDF::getAlbedo())
+	EAOVAlbedo = 0x04,
+	/// Index of the first mesh (see \ref Mesh::getID())
+	EAOVMeshID = 0x08,
+	/// Number of samples taken in each pixel
+	EAOVSampleCount = 0x10,
+	/// Variance of the pixel's luminance estimate
+	EAOVVariance = 0x20,
+	/**
+	 * Average traversal work per sample (see \ref AOVRecord::cost), 
+	 * as a false-colour heat map
+	 */
+	EAOVCost = 0x40,
+	/**
+	 * Wall-clock render time in microseconds: the total of the pixel, 
+	 * the average per sample, and the average per sample of the blocks 
+	 * that contained the pixel (see \ref AOVRecord::time)
+	 */
+	EAOVRenderTime = 0x80,
+	/// Bit mask covering all AOVs
+	EAOVAll = 0xFF
+};
+
+/// Return the name of an AOV (as used by the \c aovs scene property)
+inline const char *getAOVName(EAOV aov) {
+	switch (aov) {
+		case EAOVDepth:       return "depth";
+		case EAOVNormal:      return "normal";
+		case EAOVAlbedo:      return "albedo";
+		case EAOVMeshID:      return "meshID";
+		case EAOVSampleCount: return "sampleCount";
+		case EAOVVariance:    return "variance";
+		case EAOVCost:        return "traversalCost";
+		case EAOVRenderTime:  return "renderTime";
+		default:              return "unknown";
+	}
+}
+
+/// Return the channel names of an AOV when it is written to an OpenEXR file
+inline QStringList getAOVChannels(EAOV aov) {
+	QStringList channels;
+	switch (aov) {
+		case EAOVDepth:       channels << "Z"; break;
+		case EAOVNormal:      channels << "X" << "Y" << "Z"; break;
+		case EAOVAlbedo:      channels << "R" << "G" << "B"; break;
+		case EAOVMeshID:      channels << "id"; break;
+		case EAOVSampleCount: channels << "count"; break;
+		case EAOVVariance:    channels << "Y"; break;
+		case EAOVCost:        channels << "R" << "G" << "B"; break;
+		case EAOVRenderTime:  channels << "pixel" << "sample" << "block"; break;
+		default:              break;
+	}
+	return channels;
+}
+
+/**
+ * \brief Describes the first surface seen by a camera ray
+ *
+ * Integrators fill in such a record when \ref RenderContext::aov 
+ * is set, which happens when the scene requests AOVs. Hence all
+ * auxiliary images are produced by the same rays as the radiance.
+ */
+struct AOVRecord {
+	/// Distance to the surface (zero if the ray escaped)
+	float depth;
+	/// World-space shading normal
+	Normal3f normal;
+	/// Reflectance of the surface
+	Color3f albedo;
+	/// Index of the mesh, or -1 if the ray escaped
+	int meshID;
+	/**
+	 * \brief Interior nodes, leaves and triangle tests visited by all 
+	 * queries of the sample (see \ref Accelerator::TraversalStatistics)
+	 *
+	 * Filled in by the renderer rather than the integrator, and only
+	 * in builds with \c NORI_TRAVERSAL_STATISTICS.
+	 */
+	float cost;
+	/**
+	 * \brief Wall-clock time spent on the sample in nanoseconds
+	 *
+	 * Filled in by the renderer when the scene requests the
+	 * \ref EAOVRenderTime AOV. In wavefront mode, where the samples
+	 * of a batch are traced together, this is the batch average.
+	 */
+	float time;
+
+	/// Create a record for a ray that didn't hit anything
+	inline AOVRecord() { clear(); }
+
+	/// Reset the record to the values of a ray that didn't hit anything
+	inline void clear() {
+		depth = 0.0f;
+		normal = Normal3f(0.0f);
+		albedo = Color3f(0.0f);
+		meshID = -1;
+		cost = 0.0f;
+		time = 0.0f;
+	}
+
+	/**
+	 * \brief Record the surface found by an intersection query
+	 *
+	 * Requires \ref Intersection::computeDifferentialGeometry()
+	 */
+	inline void set(const Intersection &its) {
+		depth = its.t;
+		normal = its.shFrame.n;
+		albedo = its.mesh->getBSDF() ? its.mesh->getBSDF()->getAlbedo() : Color3f(0.0f);
+		meshID = (int) its.mesh->getID();
+	}
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __AOV_H */
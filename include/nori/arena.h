@@ -0,0 +1,119 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ARENA_H)
+#define __ARENA_H
+
+#include <nori/common.h>
+#include <new>
+
+#define NORI_ARENA_BLOCK_SIZE 65536 /* Size of the memory chunks requested by MemoryArena */
+#define NORI_ARENA_ALIGNMENT 16 /* Alignment of the returned allocations */
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bump allocator for short-lived temporaries
+ *
+ * Allocations simply advance a pointer within a large chunk of memory
+ * and are never freed individually. Instead, the whole arena is
+ * reset once its contents are no longer needed (the render threads do
+ * this after every block). The chunks are kept for reuse, hence a
+ * warmed-up arena doesn't touch the global heap at all.
+ *
+ * An arena must only be used by one thread at a time. Each thread's
+ * \ref Sampler provides one via \ref Sampler::getArena().
+ */
+class MemoryArena {
+public:
+	/// Create an empty arena
+	inline MemoryArena() : m_block(0), m_offset(0) { }
+
+	/// Release all memory
+	inline ~MemoryArena() {
+		for (size_t i=0; i<m_blocks.size(); ++i)
+			freeAligned(m_blocks[i].first);
+	}
+
+	/// Allocate \c size bytes of uninitialized memory
+	inline void *alloc(size_t size) {
+		size = (size + NORI_ARENA_ALIGNMENT - 1) & ~((size_t) NORI_ARENA_ALIGNMENT - 1);
+		if (m_block < m_blocks.size() && m_offset + size <= m_blocks[m_block].second) {
+			void *ptr = m_blocks[m_block].first + m_offset;
+			m_offset += size;
+			return ptr;
+		}
+		return allocSlow(size);
+	}
+
+	/**
+	 * \brief Allocate and default-construct an array of \c count instances of \c T
+	 *
+	 * Destructors are never run, hence \c T should not own any resources.
+	 */
+	template <typename T> inline T *alloc(size_t count) {
+		T *ptr = static_cast<T *>(alloc(sizeof(T) * count));
+		for (size_t i=0; i<count; ++i)
+			new (ptr + i) T();
+		return ptr;
+	}
+
+	/// Make all memory available again (invalidates previous allocations)
+	inline void reset() {
+		m_block = 0;
+		m_offset = 0;
+	}
+
+	/// Return the total amount of memory held by the arena (in bytes)
+	inline size_t getCapacity() const {
+		size_t capacity = 0;
+		for (size_t i=0; i<m_blocks.size(); ++i)
+			capacity += m_blocks[i].second;
+		return capacity;
+	}
+private:
+	/// Move on to the next chunk that has space for \c size bytes
+	void *allocSlow(size_t size) {
+		/* Skip chunks that are too small for this request */
+		if (m_block < m_blocks.size())
+			++m_block;
+		while (m_block < m_blocks.size() && m_blocks[m_block].second < size)
+			++m_block;
+
+		if (m_block == m_blocks.size()) {
+			size_t blockSize = std::max(size, (size_t) NORI_ARENA_BLOCK_SIZE);
+			m_blocks.push_back(std::make_pair(
+				static_cast<uint8_t *>(allocAligned(blockSize)), blockSize));
+		}
+
+		m_offset = size;
+		return m_blocks[m_block].first;
+	}
+
+	/// Memory chunks and their sizes
+	std::vector<std::pair<uint8_t *, size_t> > m_blocks;
+	size_t m_block, m_offset;
+
+	/* Arenas are tied to one thread and can't be copied */
+	MemoryArena(const MemoryArena &);
+	MemoryArena &operator=(const MemoryArena &);
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __ARENA_H */
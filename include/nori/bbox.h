@@ -316,6 +316,31 @@ template <typename _PointType> struct TBoundingBox {
 		return result + "]";
 	}
 
+	/**
+	 * \brief Clip the ray segment [mint, maxt] against the bounding box
+	 *
+	 * A branch-free slab test, which picks the near and far plane of each
+	 * axis using the direction signs precomputed by \ref TRay::update().
+	 * Rays that lie within one of the planes produce NaNs, which are
+	 * ignored. The far distance is enlarged slightly, so that grazing
+	 * intersections are not lost due to rounding.
+	 *
+	 * \return \c true if the clipped segment [nearT, farT] is not empty
+	 */
+	inline bool rayIntersect(const TRay<PointType, VectorType> &ray, Scalar mint, Scalar maxt,
+			Scalar &nearT, Scalar &farT) const {
+		nearT = mint; farT = maxt;
+		for (int i=0; i<Dimension; ++i) {
+			const int neg = ray.dirIsNeg[i];
+			Scalar t0 = ((neg ? max[i] : min[i]) - ray.o[i]) * ray.dRcp[i],
+			       t1 = ((neg ? min[i] : max[i]) - ray.o[i]) * ray.dRcp[i];
+			t1 *= (Scalar) 1.0000005f;
+			nearT = t0 > nearT ? t0 : nearT;
+			farT  = t1 < farT  ? t1 : farT;
+		}
+		return nearT <= farT;
+	}
+
 	/** \brief Calculate the near and far ray-box intersection
 	 * points (if they exist).
 	 *
@@ -21,9 +21,34 @@
 
 #include <nori/color.h>
 #include <nori/vector.h>
+#include <QThread>
+#include <QStringList>
+#include <half.h>
 
 NORI_NAMESPACE_BEGIN
 
+/// Controls the precision, compression and layout of written EXR files
+struct BitmapSaveOptions {
+	/// Store half instead of single precision channels
+	bool half;
+	/// Compression method (see \ref Bitmap::isSupportedCompression())
+	QString compression;
+	/// Edge length of the tiles of a tiled file (0 = scanline file)
+	int tileSize;
+	/**
+	 * \brief Format of an additional 8-bit sRGB preview next to the EXR
+	 * file (\c png or \c jpg), or an empty string for no preview
+	 */
+	QString preview;
+	/// Exposure of the preview (in stops)
+	float previewExposure;
+
+	BitmapSaveOptions() : half(false), compression("zip"), tileSize(0),
+		previewExposure(0.0f) { }
+};
+
+struct BitmapLayer;
+
 /**
  * \brief Stores a RGB high dynamic-range bitmap
  *
@@ -46,7 +71,178 @@ public:
 	Bitmap(const QString &filename);
 
 	/// Save the bitmap as an EXR file with the specified filename
-	void save(const QString &filename);
+	void save(const QString &filename,
+		const BitmapSaveOptions &options = BitmapSaveOptions());
+
+	/**
+	 * \brief Save several bitmaps of the same size as the parts
+	 * of a multi-part EXR file (e.g. the radiance and its AOVs)
+	 */
+	static void saveLayers(const QString &filename, const std::vector<BitmapLayer> &layers,
+		const BitmapSaveOptions &options = BitmapSaveOptions());
+
+	/**
+	 * \brief Is the given compression method supported by the 
+	 * linked OpenEXR library?
+	 *
+	 * Known methods are \c none, \c rle, \c zips, \c zip, \c piz, 
+	 * \c pxr24, \c b44, \c b44a, and (OpenEXR >= 2.2) \c dwaa and \c dwab
+	 */
+	static bool isSupportedCompression(const QString &name);
+
+	/**
+	 * \brief Return the OpenEXR compression method (an \c Imf::Compression 
+	 * value) with the given name, or -1 if it is not supported
+	 */
+	static int getExrCompression(const QString &name);
+
+	/**
+	 * \brief Replace the pixels by a false-colour heat map of their 
+	 * first component (e.g. to visualize a per-pixel cost)
+	 *
+	 * The colours run from blue over green and yellow to red, which
+	 * corresponds to \c maxValue (larger values are clamped). Pixels
+	 * whose value is zero or less turn black. When \c maxValue is
+	 * zero, the 99th percentile of the positive values is used, so 
+	 * that a few extreme pixels don't wash out the rest.
+	 */
+	void toHeatMap(float maxValue = 0.0f);
+
+	/**
+	 * \brief Save a tonemapped 8-bit sRGB image (e.g. a PNG or JPEG
+	 * file, depending on the extension) for a quick preview
+	 *
+	 * \param exposure
+	 *     Scales the pixels by 2^exposure before clamping them to [0, 1]
+	 */
+	void savePreview(const QString &filename, float exposure = 0.0f) const;
+
+	/**
+	 * \brief Convert linear colors to 8-bit sRGB values (three bytes
+	 * per color), after scaling them by \c scale
+	 *
+	 * This uses the same transfer function as \ref Color3f::toSRGB() and
+	 * the preview shader of the GUI, but reads it from a table that is
+	 * indexed by the quantized linear value (so that four values at a
+	 * time are scaled, clamped, and quantized using SSE).
+	 */
+	static void toSRGB8(const Color3f *source, uint8_t *target, size_t count, float scale = 1.0f);
+};
+
+/**
+ * \brief RGB bitmap with an optionally half precision storage and a
+ * pyramid of prefiltered levels (e.g. for large environment maps)
+ *
+ * Level 0 holds the pixels of the file, and every further level averages
+ * blocks of 2x2 pixels of the previous one (repeating the last row or 
+ * column at odd sizes), down to a single pixel. The pyramid adds a third
+ * to the memory of the image, while half precision halves it compared to
+ * a \ref Bitmap.
+ */
+class MipBitmap {
+public:
+	/// Create an empty bitmap
+	MipBitmap() : m_half(false) { }
+
+	/**
+	 * \brief Load an OpenEXR file, and build the pyramid
+	 *
+	 * \param halfPrecision
+	 *     Store all levels with half precision (values above 65504 
+	 *     become infinite)
+	 */
+	MipBitmap(const QString &filename, bool halfPrecision = false);
+
+	/// Return the number of levels
+	inline int getLevelCount() const { return (int) m_levels.size(); }
+
+	/// Return the width of a level (in pixels)
+	inline int getWidth(int level = 0) const { return m_levels[level].width; }
+
+	/// Return the height of a level (in pixels)
+	inline int getHeight(int level = 0) const { return m_levels[level].height; }
+
+	/// Return a pixel of a level
+	inline Color3f lookup(int level, int row, int col) const {
+		const Level &l = m_levels[level];
+		size_t i = 3 * ((size_t) row * l.width + col);
+		if (m_half)
+			return Color3f(l.halves[i], l.halves[i+1], l.halves[i+2]);
+		return Color3f(l.values[i], l.values[i+1], l.values[i+2]);
+	}
+
+	/// Are the pixels stored with half precision?
+	inline bool isHalfPrecision() const { return m_half; }
+
+	/// Return the memory used by all levels (in bytes)
+	size_t getMemoryUsage() const;
+private:
+	/// Pixels of a level (only one of the arrays is used)
+	struct Level {
+		int width, height;
+		std::vector<float> values;
+		std::vector<half> halves;
+
+		Level() : width(0), height(0) { }
+	};
+
+	/// Compute the levels after the first one
+	void buildPyramid();
+
+	std::vector<Level> m_levels;
+	bool m_half;
+};
+
+/// A bitmap that is stored as one part of a multi-part EXR file
+struct BitmapLayer {
+	/// Name of the part
+	QString name;
+	/// The pixels of the layer
+	Bitmap *bitmap;
+	/// Names of the channels, which store the first 1-3 color components
+	QStringList channels;
+
+	BitmapLayer(const QString &name, Bitmap *bitmap, const QStringList &channels)
+		: name(name), bitmap(bitmap), channels(channels) { }
+};
+
+/**
+ * \brief Writes a bitmap to disk in a background thread
+ *
+ * Encoding and compressing a large frame can take a while. The writer 
+ * takes ownership of the bitmap, so that the caller may continue 
+ * (e.g. tear down the scene) while the file is being written.
+ * The destructor waits for the write to complete.
+ */
+class BitmapWriter : public QThread {
+public:
+	/// Write a single bitmap
+	BitmapWriter(Bitmap *bitmap, const QString &filename,
+		const BitmapSaveOptions &options = BitmapSaveOptions())
+		: m_filename(filename), m_options(options) {
+		m_layers.push_back(BitmapLayer("", bitmap, QStringList() << "R" << "G" << "B"));
+	}
+
+	/// Write a multi-part file (see \ref Bitmap::saveLayers())
+	BitmapWriter(const std::vector<BitmapLayer> &layers, const QString &filename,
+		const BitmapSaveOptions &options = BitmapSaveOptions())
+		: m_layers(layers), m_filename(filename), m_options(options) { }
+
+	virtual ~BitmapWriter() {
+		wait();
+		for (size_t i=0; i<m_layers.size(); ++i)
+			delete m_layers[i].bitmap;
+	}
+
+	/// Return the error message of a failed write (empty on success)
+	inline const QString &getError() const { return m_error; }
+protected:
+	void run();
+private:
+	std::vector<BitmapLayer> m_layers;
+	QString m_filename;
+	BitmapSaveOptions m_options;
+	QString m_error;
 };
 
 NORI_NAMESPACE_END
@@ -25,14 +25,30 @@
 
 #include <nori/color.h>
 #include <nori/vector.h>
+#include <nori/aov.h>
 #include <QMutex>
 #include <QThread>
+#include <QAtomicInt>
 #include <QElapsedTimer>
+#include <QWaitCondition>
+#include <QStringList>
 
-#define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define NORI_BLOCK_SIZE 32 /* Default block size used for parallelization */
+#define NORI_MIN_BLOCK_SIZE 8 /* Smallest block handed out at the end of a rendering */
+#define NORI_MAX_BLOCK_SIZE 128 /* Largest block size chosen automatically */
+#define NORI_BLOCKS_PER_CORE 16 /* Target number of blocks per core (automatic block size) */
+#define NORI_BLOCK_SPLIT_FACTOR 4 /* Split blocks that take longer than this times the median */
+#define NORI_RAY_BATCH_SIZE 4096 /* Rays per batch in wavefront mode */
+#define NORI_MAX_DIRTY_REGIONS 256 /* Beyond this, the whole image block counts as modified */
+#define NORI_SUBPIXEL_MOMENTS 9 /* Moments of the subpixel offsets per pixel (deferred filtering) */
+#define NORI_TIME_BUDGET_MARGIN 0.9f /* Fraction of the remaining time budget that passes are planned to use */
 
 NORI_NAMESPACE_BEGIN
 
+class Integrator;
+class Scene;
+class RenderCache;
+
 /**
  * \brief Weighted pixel storage for a rectangular subregion of an image
  *
@@ -46,9 +62,35 @@ NORI_NAMESPACE_BEGIN
  * this region. For that reason, this class also stores information about
  * a small border region around the rectangle, whose size depends on the
  * properties of the reconstruction filter.
+ *
+ * Optionally, the block also accumulates arbitrary output variables
+ * (AOVs, see \ref setAOVs()). These are not filtered: every sample 
+ * only contributes to the pixel that contains it.
+ *
+ * With a deferred filter (see \ref ReconstructionFilter::isDeferred()),
+ * samples are also only added to the pixel that contains them, along
+ * with the moments of their subpixel offsets \f$(f_x, f_y)\f$ (the 
+ * sums of \f$c f_x^i f_y^j\f$ for \f$i, j \le 2\f$). The filter is 
+ * fitted by a quadratic polynomial over the subpixel offsets of every
+ * pixel it covers, so that \ref toBitmap() can apply it to these moments
+ * in two separable passes. This costs the same per sample regardless
+ * of the filter radius. The block has no border in this mode, and its
+ * pixels (e.g. in a \ref snapshot()) are box-filtered.
+ *
+ * With an importance sampled filter (see 
+ * \ref ReconstructionFilter::isSampled()), the filter is already 
+ * accounted for by the distribution of the samples. They are recorded
+ * at the centers of the pixels they belong to, which are the only 
+ * pixels they touch, hence the block has no border either.
  */
 class ImageBlock : public Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> {
 public:
+	/// Offset and size of a rectangular region of pixels (see \ref snapshot())
+	typedef std::pair<Point2i, Vector2i> Region;
+
+	/// Pixels of a snapshot (see \ref snapshot())
+	typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Snapshot;
+
 	/**
 	 * Create a new image block of the specified maximum size
 	 * \param size
@@ -77,116 +119,752 @@ public:
 	/// Return the border size in pixels
 	inline int getBorderSize() const { return m_borderSize; }
 
+	/// Is the filter applied once the image is done (see \ref ImageBlock)?
+	inline bool isDeferred() const { return m_deferred; }
+
+	/**
+	 * \brief Return the subpixel moments of a block with a deferred filter
+	 * (empty otherwise)
+	 *
+	 * Stores <tt>NORI_SUBPIXEL_MOMENTS-1</tt> moments of 4 floats per 
+	 * pixel; the first moment is the pixel itself.
+	 */
+	inline std::vector<float> &getSubpixelMoments() { return m_subpixel; }
+
 	/**
 	 * \brief Turn the block into a proper bitmap
 	 * 
 	 * This entails normalizing all pixels and discarding
-	 * the border region.
+	 * the border region (or applying a deferred filter).
 	 */
 	Bitmap *toBitmap() const;
 
 	/// Clear all contents
-	void clear() { setConstant(Color4f()); }
+	void clear() {
+		setConstant(Color4f());
+		std::fill(m_aovs.begin(), m_aovs.end(), 0.0f);
+		std::fill(m_subpixel.begin(), m_subpixel.end(), 0.0f);
+		markDirty();
+	}
+
+	/// Enable or disable the accumulation of AOVs (clears them)
+	void setAOVs(bool enabled);
+
+	/// Does the block accumulate AOVs?
+	inline bool hasAOVs() const { return !m_aovs.empty(); }
+
+	/**
+	 * \brief Return the memory that a block of the given size would use
+	 * (in bytes), e.g. to predict the memory of a rendering
+	 */
+	static size_t estimateMemoryUsage(const Vector2i &size,
+		const ReconstructionFilter *filter, bool aovs);
+
+	/**
+	 * \brief Turn the accumulated values of an AOV into a bitmap
+	 *
+	 * Depth, normal and albedo are averaged over the samples of each 
+	 * pixel. The mesh ID is the one seen by the first sample of the 
+	 * pixel (-1 if none), and the sample count is stored as is. The
+	 * variance is that of the pixel's mean luminance (i.e. the sample
+	 * variance divided by the sample count). The bitmap stores the 
+	 * value in all three components (normals and albedo in the
+	 * respective components, the render times in the order of
+	 * \ref getAOVChannels()).
+	 */
+	Bitmap *toAOVBitmap(EAOV aov) const;
+
+	/**
+	 * \brief Save the unnormalized contents of the block (including the
+	 * border region) to a file, so that it can be merged with the blocks
+	 * rendered by other machines using \ref merge()
+	 *
+	 * Not supported with a deferred filter.
+	 *
+	 * \param imageSize
+	 *     Size of the complete image the block belongs to
+	 */
+	void save(const QString &filename, const Vector2i &imageSize) const;
+
+	/**
+	 * \brief Combine blocks written by \ref save() into a bitmap
+	 *
+	 * The blocks are added including their borders before normalizing
+	 * the pixels, hence the result matches a rendering on one machine.
+	 * Pixels that none of the blocks covered are black.
+	 */
+	static Bitmap *merge(const QStringList &filenames);
+
+	/// Formats of \ref serialize() (combined using bitwise OR)
+	enum ESerializationFlags {
+		/**
+		 * Store the pixels and subpixel moments as half floats (scaled by
+		 * a power of two to fit their range). The colors keep a relative
+		 * precision of about 1e-3; the AOVs remain exact
+		 */
+		ESerializeHalf = 1,
+		/// Compress the data losslessly (byte planes and zlib)
+		ESerializeCompressed = 2
+	};
+
+	/**
+	 * \brief Return the unnormalized contents of the block (including
+	 * the border, AOVs and subpixel moments) along with its offset and
+	 * size, e.g. to send it to another machine (see \ref ClusterMaster)
+	 *
+	 * Floats are stored in the byte order of the machine. Without any
+	 * \c flags, this takes 16 bytes per pixel (plus the AOVs), and 
+	 * \ref deserialize() copies them straight into place.
+	 *
+	 * \param flags
+	 *     Format of the data (see \ref ESerializationFlags)
+	 */
+	QByteArray serialize(int flags = 0) const;
+
+	/**
+	 * \brief Replace the contents, offset and size of the block by
+	 * those written by \ref serialize() (in any format)
+	 *
+	 * The serialized block must have been created with the same maximum
+	 * size, reconstruction filter and AOV setting as this one. Throws a
+	 * \ref NoriException otherwise.
+	 */
+	void deserialize(const QByteArray &serialized);
+
+	/**
+	 * \brief Record a sample with the given position and radiance value
+	 *
+	 * This function doesn't modify any state besides the affected 
+	 * pixels, hence several threads may call it concurrently as long as
+	 * their samples are far enough apart that the filter footprints
+	 * don't overlap (e.g. when each thread works on its own rows).
+	 *
+	 * \param weight
+	 *     Weight of the sample in the pixels it contributes to, e.g. the
+	 *     sign of an importance sampled filter (see 
+	 *     \ref ReconstructionFilter::isSampled())
+	 */
+	void put(const Point2f &pos, const Color3f &value, float weight = 1.0f);
+
+	/**
+	 * \brief Record a sample using atomic additions
+	 *
+	 * Slower than \ref put(), but safe to call from any number of threads
+	 * for arbitrary positions, e.g. to splat scattered samples (such as
+	 * those of a light tracer) directly into a shared image.
+	 */
+	void putAtomic(const Point2f &pos, const Color3f &value);
+
+	/**
+	 * \brief Atomically splat a contribution that doesn't count as a 
+	 * sample of the pixels it touches
+	 *
+	 * Unlike \ref putAtomic(), the weights of the pixels (their alpha
+	 * channel) are left unchanged. This is used for the contributions
+	 * of light paths, which are added to the image via \ref addSplats().
+	 */
+	void putSplat(const Point2f &pos, const Color3f &value);
 
-	/// Record a sample with the given position and radiance value
-	void put(const Point2f &pos, const Color3f &value);
+	/**
+	 * \brief Add the colors of a block with the same size and offset
+	 * that contains splatted contributions (see \ref putSplat()), 
+	 * multiplied by \c scale
+	 *
+	 * The weights of the pixels are left unchanged. Not thread-safe.
+	 */
+	void addSplats(const ImageBlock &b, float scale);
+
+	/**
+	 * \brief Record the AOVs of a sample at the given position
+	 *
+	 * The radiance \c value of the sample (also passed to \ref put())
+	 * is used to estimate the per-pixel variance. Only has an effect
+	 * when AOVs are enabled (see \ref setAOVs())
+	 */
+	void putAOV(const Point2f &pos, const Color3f &value, const AOVRecord &aov);
+
+	/**
+	 * \brief Attribute the wall-clock time of rendering the block to
+	 * the samples recorded using \ref putAOV() since the last \ref clear()
+	 *
+	 * \param sampleTime
+	 *     Time per pixel sample of the block in nanoseconds
+	 */
+	void putAOVBlockTime(float sampleTime);
 
 	/**
 	 * \brief Merge another image block into this one
 	 *
-	 * During the merge operation, this function locks 
-	 * the destination block using a mutex.
+	 * This function is thread-safe as long as the merged blocks
+	 * don't overlap (not counting their borders), which is the case
+	 * for the blocks created by \ref BlockGenerator. Only the pixels
+	 * close to the block boundary, which neighboring blocks may also 
+	 * touch, are added while holding a per-row lock; the rest is 
+	 * written directly. AOVs (which have no border) are added
+	 * if both blocks have them.
 	 */
 	void put(ImageBlock &b);
 
-	/// Lock the image block (using an internal mutex)
-	inline void lock() const { m_mutex.lock(); }
-	
-	/// Unlock the image block
-	inline void unlock() const { m_mutex.unlock(); }
+	/**
+	 * \brief Copy the pixels (without the border region) into \c target 
+	 *
+	 * This does not block threads that are concurrently merging
+	 * blocks via \ref put(), hence the copy may contain pixels
+	 * from slightly different points in time. It is meant for
+	 * displaying a preview while rendering.
+	 */
+	void snapshot(Snapshot &target) const;
+
+	/**
+	 * \brief Bring a previous snapshot up to date, copying only the
+	 * regions that were modified since then
+	 *
+	 * The regions are merged blocks recorded by \ref put() (clipped
+	 * to the pixels without the border). When \c target doesn't have
+	 * the right size, or the whole block was modified (e.g. by 
+	 * \ref clear()), everything is copied and \c regions contains
+	 * a single region covering the block. Meant for a single consumer
+	 * such as the preview window; like \ref snapshot(), it doesn't
+	 * block the render threads.
+	 *
+	 * \param regions
+	 *     Returns the regions that were copied (relative to the
+	 *     pixels without the border, or to the pixels of \c target)
+	 * \param factor
+	 *     Maintain a downsampled mirror instead of a copy: every pixel
+	 *     of \c target holds the sum of a block of \c factor x \c factor
+	 *     pixels (clipped to the image), which is their weighted average
+	 *     once it is divided by its weight. Modified regions are widened
+	 *     to whole blocks.
+	 */
+	void snapshot(Snapshot &target, std::vector<Region> &regions, int factor = 1) const;
+
+	/**
+	 * \brief Copy a crop of the pixels (without the border region) into
+	 * \c target, downsampled by \c factor like the mirror of \ref snapshot()
+	 *
+	 * Like the other snapshots, this doesn't block the render threads.
+	 */
+	void snapshot(Snapshot &target, const Point2i &offset, const Vector2i &size,
+		int factor = 1) const;
+
+	/**
+	 * \brief Record that the whole block was modified (see 
+	 * \ref snapshot()), e.g. after writing its pixels directly
+	 */
+	void markDirty();
 
 	/// Return a human-readable string summary
 	QString toString() const;
 protected:
+	/**
+	 * \brief Store the sums of blocks of \c factor x \c factor pixels,
+	 * starting at \c source and clipped to \c end, in a region of \c target
+	 */
+	void sumPixels(Snapshot &target, const Point2i &targetOffset, const Vector2i &targetSize,
+		const Point2i &source, const Point2i &end, int factor) const;
+
+	/**
+	 * \brief Implementation of \ref put(), \ref putAtomic() and 
+	 * \ref putSplat(): add \c value with the given \c alpha (which
+	 * counts the sample towards the pixel weights), both multiplied 
+	 * by \c weight
+	 */
+	template <bool Atomic> void splat(const Point2f &pos, const Color3f &value, float alpha,
+		float weight);
+
+	/// Apply a deferred filter to the subpixel moments (unnormalized)
+	void resolve(Snapshot &target) const;
+
 	Point2i  m_offset;
 	Vector2i m_size;
 	int m_borderSize;
-	float *m_filter, m_filterRadius;
-	float *m_weightsX, *m_weightsY;
-	float m_lookupFactor;
-	mutable QMutex m_mutex;
+	float m_filterRadius;
+
+	/* Filter weights of the pixels in a sample's footprint (one row of
+	   2*m_filterExtent+1 entries per quantized subpixel offset) */
+	float *m_weights;
+	int m_filterExtent;
+
+	/* Filters whose support is at most one pixel wide only touch the 
+	   nearest pixel, using the constant weight m_pixelWeight */
+	bool m_singlePixel;
+	float m_pixelWeight;
+
+	/* Deferred filtering: coefficients of the quadratic fit of the filter
+	   (3 per offset between a pixel and the sample's pixel), and the 
+	   subpixel moments besides the pixels themselves. Empty otherwise */
+	bool m_deferred;
+	std::vector<float> m_filterFit, m_subpixel;
+
+	/* Per-pixel AOV sums (NORI_AOV_CHANNELS floats each, laid out like
+	   the pixels including the border). Empty if AOVs are disabled */
+	std::vector<float> m_aovs;
+
+	QMutex *m_rowLocks;
+
+	/* Regions modified since the last incremental snapshot, or a flag 
+	   that marks the whole block as modified */
+	mutable QMutex m_dirtyMutex;
+	mutable std::vector<Region> m_dirtyRegions;
+	mutable bool m_allDirty;
 };
 
 /**
- * \brief Spiraling block generator
+ * \brief Block generator
  *
  * This class can be used to chop up an image into many small
- * rectangular blocks suitable for parallel rendering. The blocks
- * are ordered in spiraling pattern so that the center is
- * rendered first.
+ * rectangular blocks suitable for parallel rendering. By default, the 
+ * blocks are ordered in spiraling pattern so that the center is
+ * rendered first. Other orders (see \ref EBlockOrder) favor locality:
+ * consecutive blocks of a Hilbert or Morton curve are neighbors, so 
+ * that they mostly trace through the same nodes of the acceleration
+ * data structure and read the same texels.
+ *
+ * To keep such neighbors on the same thread (and in its private 
+ * caches), render threads may reserve runs of consecutive blocks at
+ * once (see \ref setRunLength() and \ref Run). Runs shrink towards the
+ * end of a pass, so that the remaining blocks are still spread over all
+ * threads.
+ *
+ * The order is computed ahead of time, so that render threads can
+ * fetch blocks using a single atomic increment. To keep all cores
+ * busy until the very end, the last few blocks are subdivided into 
+ * smaller ones (down to \ref NORI_MIN_BLOCK_SIZE pixels).
+ *
+ * Render threads report the time spent on each block via \ref finished().
+ * A block that takes much longer than the median (e.g. a region with
+ * caustics or dense fog) can hand its unrendered part back using
+ * \ref split(), which queues it as several smaller blocks.
+ *
+ * In progressive mode (see \ref setProgressive()), the generator makes
+ * several passes over all blocks, each of which takes a few samples
+ * per pixel. A pass only starts once the previous one is complete, so 
+ * that no two threads ever work on the same pixels.
+ *
+ * Adaptive sampling (see \ref setAdaptive()) builds on the passes: 
+ * after each pass, pixels whose estimated error is below a target are
+ * marked as converged and receive no further samples. A time budget
+ * (see \ref setTimeBudget()) also decides between passes how much of
+ * the image the next pass can cover.
+ *
+ * Between two passes, no block is in flight. This is where checkpoints
+ * of a progressive rendering are written (see \ref setCheckpoint()),
+ * and where integrators prepare the next pass (see \ref setPreprocess()).
  */
 class BlockGenerator {
 public:
+	/// Order in which the blocks are handed out
+	enum EBlockOrder {
+		/// Spiral that starts in the center of the image (default)
+		ESpiral = 0,
+		/// Rows from top to bottom
+		EScanline,
+		/// Hilbert curve, whose consecutive blocks (nearly) always share an edge
+		EHilbert,
+		/// Morton (Z-order) curve
+		EMorton
+	};
+
+	/**
+	 * \brief Blocks that a render thread has reserved (see \ref next())
+	 *
+	 * Each thread keeps its own instance across calls to \ref next().
+	 */
+	struct Run {
+		const BlockGenerator *generator;
+		int next, end;
+
+		inline Run() : generator(NULL), next(0), end(0) { }
+	};
+
+	/// Snapshot of the progress of a rendering (see \ref getProgress())
+	struct Progress {
+		/// Index of the current pass and number of passes (an upper bound in adaptive mode)
+		int pass, passCount;
+		/// Number of finished blocks (in all passes, including split-off ones)
+		int finishedBlocks;
+		/// Number of blocks that are in flight or yet to be rendered (in all passes)
+		int remainingBlocks;
+		/// Time since the block generator was created in milliseconds
+		qint64 elapsed;
+		/// Time limit in milliseconds (0 = none)
+		qint64 timeLimit;
+		/// Has the whole image been rendered (or the rendering stopped)?
+		bool done;
+	};
+
 	/**
 	 * \brief Create a block generator with
 	 * \param size
 	 *      Size of the image that should be split into blocks
 	 * \param blockSize
 	 *      Maximum size of the individual blocks
+	 * \param sampleCount
+	 *      Number of samples per pixel
+	 * \param offset
+	 *      Offset of the blocks (when rendering a region of the image)
+	 * \param order
+	 *      Order of the blocks (see \ref EBlockOrder)
+	 */
+	BlockGenerator(const Vector2i &size, int blockSize, uint32_t sampleCount,
+		const Point2i &offset = Point2i(0, 0), EBlockOrder order = ESpiral);
+
+	/// Parse the name of a block order ("spiral", "scanline", "hilbert" or "morton")
+	static EBlockOrder parseBlockOrder(const QString &name);
+
+	/**
+	 * \brief Let each thread that passes a \ref Run to \ref next() reserve
+	 * up to \c length consecutive blocks at once (1 = disabled, the default)
+	 *
+	 * Must be called before the first call to \ref next(). Has no effect
+	 * with adaptive sampling, which skips converged blocks.
 	 */
-	BlockGenerator(const Vector2i &size, int blockSize);
+	inline void setRunLength(int length) { m_runLength = std::max(length, 1); }
+
+	/**
+	 * \brief Only render the blocks whose index (in the block order)
+	 * modulo \c count equals \c index
+	 *
+	 * This splits a frame into \c count disjoint sets of blocks, e.g. for
+	 * rendering on several machines. Must be called before the first 
+	 * call to \ref next().
+	 */
+	void selectTiles(int index, int count);
+
+	/**
+	 * \brief Only render the blocks that overlap a part of the image
+	 * that the render cache can't provide (see \ref RenderCache::isDirty())
+	 *
+	 * Must be called before \ref setAdaptive() and before the first call
+	 * to \ref next().
+	 */
+	void selectDirty(const RenderCache &cache);
+
+	/**
+	 * \brief Render the image progressively in several passes
+	 *
+	 * Must be called before the first call to \ref next().
+	 *
+	 * \param samplesPerPass
+	 *      Number of samples per pixel taken in each pass. The
+	 *      number of passes follows from the total sample count.
+	 * \param timeLimit
+	 *      Stop handing out blocks after this many seconds 
+	 *      (0 = no limit)
+	 * \param targetNoise
+	 *      Stop after the first pass where the estimated relative 
+	 *      standard error (averaged over all pixels) drops below 
+	 *      this value (0 = never)
+	 */
+	void setProgressive(uint32_t samplesPerPass, float timeLimit, float targetNoise);
+
+	/**
+	 * \brief Stop sampling pixels once their estimated relative standard
+	 * error drops below \c targetError
+	 *
+	 * Requires progressive mode, and must be called after 
+	 * \ref setProgressive() and before the first call to \ref next().
+	 * The sample budget (the sample count times the number of pixels)
+	 * is spent on the remaining pixels, in passes that continue until 
+	 * the budget is exhausted, every pixel has converged, or received
+	 * \c maxSampleCount samples.
+	 */
+	void setAdaptive(float targetError, uint32_t maxSampleCount);
+
+	/**
+	 * \brief Fit the rendering into a wall-clock budget of \c seconds
+	 *
+	 * Requires progressive mode, and must be called after 
+	 * \ref setProgressive() and \ref setAdaptive() (if used), and before
+	 * the first call to \ref next(). The sample count becomes an upper
+	 * bound. After every pass, the time of the next one is predicted 
+	 * from the measured time per pixel of the previous one, and a pass
+	 * only starts when it is expected to finish within the budget (see
+	 * \ref NORI_TIME_BUDGET_MARGIN). When a full pass no longer fits,
+	 * a last pass visits as many of the blocks with the highest 
+	 * estimated error as fit in the remaining time. No blocks are 
+	 * handed out after the budget has been used up.
+	 */
+	void setTimeBudget(float seconds);
+
+	/**
+	 * \brief Periodically save the state of a progressive rendering,
+	 * so that it can be continued using \ref resume()
+	 *
+	 * The checkpoint contains the unnormalized pixels of \c output
+	 * (including the border), the index of the next pass, and the
+	 * statistics of progressive and adaptive rendering. Since the 
+	 * samplers derive their state from the pixel and sample index, 
+	 * nothing else is needed to continue the sample sequences.
+	 *
+	 * Must be called after \ref setProgressive() and \ref setAdaptive().
+	 *
+	 * \param output
+	 *      Image block that receives the rendered blocks
+	 * \param filename
+	 *      The checkpoint is written to this file (atomically replacing
+	 *      the previous one)
+	 * \param interval
+	 *      Minimum time between two checkpoints in seconds. They are
+	 *      written at the end of the first pass after this much time
+	 *      has passed
+	 * \param key
+	 *      Identifies the remaining configuration (e.g. the sampler
+	 *      seed). A checkpoint with a different key can't be resumed
+	 */
+	void setCheckpoint(ImageBlock *output, const QString &filename,
+		float interval, uint64_t key);
+
+	/**
+	 * \brief Continue from the checkpoint file given to \ref setCheckpoint()
+	 *
+	 * Restores the output and statistics, and continues with the next 
+	 * pass. Must be called before the first call to \ref next().
+	 *
+	 * \return \c false if there is no checkpoint file
+	 */
+	bool resume();
+
+	/**
+	 * \brief Call \ref Integrator::preprocess() before every pass after
+	 * the current one
+	 *
+	 * The call happens in the render thread that finished the last
+	 * block of a pass, with no block in flight.
+	 */
+	void setPreprocess(Integrator *integrator, const Scene *scene);
+
+	/// Return the index of the current pass
+	inline int getPass() const { return m_pass; }
+
+	/**
+	 * \brief Has the pixel at the given (integer) position converged?
+	 *
+	 * Render threads skip such pixels. Always \c false unless adaptive
+	 * sampling is enabled. The result only changes between passes.
+	 */
+	inline bool isConverged(const Point2i &pos) const {
+		if (m_converged.empty())
+			return false;
+		return m_converged[(pos.y() - m_offset.y()) * m_size.x() 
+			+ (pos.x() - m_offset.x())] != 0;
+	}
 	
+	/**
+	 * \brief Choose a block size for the given image size, 
+	 * number of cores, and samples per pixel
+	 *
+	 * Aims for around \ref NORI_BLOCKS_PER_CORE blocks per core while 
+	 * keeping enough samples in each block to amortize the per-block
+	 * overheads. The result is a power of two between
+	 * \ref NORI_MIN_BLOCK_SIZE and \ref NORI_MAX_BLOCK_SIZE.
+	 */
+	static int autoBlockSize(const Vector2i &size, int coreCount, 
+		size_t sampleCount);
+
 	/**
 	 * \brief Return the next block to be rendered
 	 *
-	 * This function is thread-safe
+	 * This function is thread-safe. When the precomputed blocks have
+	 * run out but other threads are still working, it waits until they
+	 * either finish or split off more work (or the next pass begins).
+	 *
+	 * \param sampleCount
+	 *      Returns the number of samples per pixel to be taken
+	 * \param firstSample
+	 *      Returns the index of the first of these samples within
+	 *      each pixel (nonzero in later passes of a progressive rendering)
+	 * \param wait
+	 *      When set to \c false, the function returns right away
+	 *      if there is no block available at the moment
+	 * \param run
+	 *      Blocks reserved by the calling thread (see \ref setRunLength()),
+	 *      or \c NULL. A thread that passes a run must keep calling
+	 *      \ref next() until it returns \c false, since the other
+	 *      threads wait for the blocks it has reserved.
 	 *
 	 * \return \c false if there were no more blocks
 	 */
-	bool next(ImageBlock &block);
+	bool next(ImageBlock &block, uint32_t &sampleCount, uint32_t &firstSample,
+		bool wait = true, Run *run = NULL);
+
+	/// Has the whole image been rendered?
+	inline bool isDone() const { return m_done; }
+
+	/**
+	 * \brief Stop handing out blocks (thread-safe)
+	 *
+	 * The rendering finishes once the blocks in flight are released.
+	 */
+	void stop();
+
+	/// Was the rendering stopped (by \ref stop() or the time limit)?
+	inline bool isStopped() const { return m_stop; }
+
+	/**
+	 * \brief Report that a block obtained from \ref next() is done
+	 *
+	 * \param sampleCount
+	 *      Number of pixel samples that were actually rendered
+	 * \param nsecs
+	 *      Time taken by the block in nanoseconds
+	 */
+	void finished(int sampleCount, qint64 nsecs);
+
+	/**
+	 * \brief Queue the specified region (the unrendered part of an
+	 * expensive block) for rendering as several smaller blocks
+	 *
+	 * This function is thread-safe
+	 */
+	void split(const Point2i &offset, const Vector2i &size, uint32_t sampleCount);
+
+	/**
+	 * \brief Return the median time per pixel sample (in nanoseconds) 
+	 * of the blocks finished so far, or zero if there are not enough samples
+	 */
+	inline float getMedianSampleTime() const { return m_medianSampleTime; }
+
+	/**
+	 * \brief Record the luminance of a pixel sample for estimating 
+	 * the noise level in progressive mode
+	 *
+	 * Only the thread rendering the block that contains \c pos may call this.
+	 */
+	inline void recordSample(const Point2f &pos, const Color3f &value) {
+		if (m_moments.empty())
+			return;
+		int x = std::min(std::max((int) pos.x() - m_offset.x(), 0), m_size.x() - 1),
+		    y = std::min(std::max((int) pos.y() - m_offset.y(), 0), m_size.y() - 1);
+		float lum = value.getLuminance();
+		Vector3f &moments = m_moments[y * m_size.x() + x];
+		moments += Vector3f(lum, lum*lum, 1.0f);
+	}
+
+	/// Return the maximum block size
+	inline int getBlockSize() const { return m_blockSize; }
+
+	/// Return the total number of blocks (including subdivided ones)
+	inline int getBlockCount() const { return (int) m_blocks.size(); }
+
+	/// Return a snapshot of the progress (thread-safe)
+	Progress getProgress() const;
 protected:
 	enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-	Point2i m_block;
-	Vector2i m_numBlocks;
-	Vector2i m_size;
-	int m_blockSize;
-	int m_numSteps;
-	int m_blocksLeft;
-	int m_stepsLeft;
-	int m_direction;
-	QMutex m_mutex;
-	QElapsedTimer m_timer;
-};
+	/// Append the grid positions of the blocks in spiral order
+	static void spiralOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions);
+
+	/// Append the grid positions of the blocks along a Hilbert curve
+	static void hilbertOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions);
+
+	/// Append the grid positions of the blocks along a Morton curve
+	static void mortonOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions);
+
+	/// Block offset and size
+	typedef std::pair<Point2i, Vector2i> Block;
+
+	/// A block that was split off at render time, and its sample count
+	typedef std::pair<Block, uint32_t> SplitBlock;
+
+	/// Split the last \c count blocks into pieces of size \c blockSize
+	void subdivideTail(int count, int blockSize);
+
+	/// Append the pieces of size \c blockSize that cover a block to \c target
+	static void subdivide(const Block &block, int blockSize, std::vector<Block> &target);
 
-/**
- * \brief Render thread
- *
- * This class implements the main rendering logic, which consists of
- * fetching work from a scheduler (in the form of rectangular image
- * blocks to be rendered), processing it, and writing the output
- * to a target buffer.
- */
-class BlockRenderThread : public QThread {
-public:
 	/**
-	 * \brief Create a new rendering thread that fetches blocks from
-	 * the specified block generator and writes output to a big
-	 * \ref ImageBlock instance that represents the entire image
+	 * \brief Mark a block as no longer active, and begin the next
+	 * pass when it was the last one (requires \c m_mutex to be held)
 	 */
-	BlockRenderThread(const Scene *scene, Sampler *sampler,
-		BlockGenerator *blockGenerator, ImageBlock *output);
+	void release();
 
-	/// Release all memory
-	virtual ~BlockRenderThread();
+	/// Write a checkpoint (requires \c m_mutex to be held, with no blocks in flight)
+	void saveCheckpoint();
+
+	/// Return the mean relative standard error of all pixels
+	float estimateNoise() const;
+
+	/// Return the relative standard error of a pixel given its moments
+	static float pixelError(const Vector3f &moments);
+
+	/**
+	 * \brief Plan the next pass within the time budget (requires 
+	 * \c m_mutex to be held, with no blocks in flight)
+	 *
+	 * \return \c false if no further pass fits
+	 */
+	bool fitTimeBudget();
+
+	/// Return the mean relative standard error of the pixels of a block
+	float blockError(const Block &block) const;
 
-	/// Main rendering thread loop
-	void run();
-private:
+	/**
+	 * \brief Mark the pixels that reached the target error as converged
+	 * (adaptive sampling only, requires \c m_mutex to be held)
+	 *
+	 * \return \c true if there are pixels that need further samples
+	 */
+	bool updateConvergence();
+
+	/// Return the number of samples per pixel taken in the current pass
+	inline uint32_t getPassSampleCount() const {
+		return std::min(m_samplesPerPass, m_sampleCount - m_pass * m_samplesPerPass);
+	}
+
+	/// Return the index of the first pixel sample taken in the current pass
+	inline uint32_t getPassFirstSample() const { return m_pass * m_samplesPerPass; }
+
+	std::vector<Block> m_blocks;
+	QAtomicInt m_nextBlock;
+	int m_runLength;
+	QElapsedTimer m_timer;
+	Vector2i m_size;
+	Point2i m_offset;
+	int m_blockSize;
+
+	/* Progressive rendering */
+	uint32_t m_sampleCount, m_samplesPerPass;
+	int m_passCount;
+	volatile int m_pass;
+	volatile bool m_stop;
+	float m_timeLimit, m_targetNoise;
+	std::vector<Vector3f> m_moments;
+
+	/* Adaptive sampling: per-pixel and per-block convergence flags, 
+	   and the total number of samples that may be taken */
+	float m_targetError;
+	std::vector<uint8_t> m_converged, m_blockConverged;
+	uint64_t m_sampleBudget;
+
+	/* Time budget (ms), start of the current pass (ms), and the
+	   number of pixels that the current pass visits */
+	qint64 m_timeBudget, m_passStart;
+	uint64_t m_passPixels;
+
+	/* Checkpoints: the output, file, interval (ms), configuration key, 
+	   and the time of the last checkpoint */
+	ImageBlock *m_checkpointOutput;
+	QString m_checkpointFilename;
+	qint64 m_checkpointInterval, m_lastCheckpoint;
+	uint64_t m_checkpointKey;
+
+	/// Integrator that prepares every pass (or \c NULL) and its scene
+	Integrator *m_integrator;
 	const Scene *m_scene;
-	BlockGenerator *m_blockGenerator;
-	ImageBlock *m_output;
-	Sampler *m_sampler;
+
+	/* Blocks split off at render time, the number of blocks in flight, 
+	   and per-sample block timings (m_activeBlocks is only decremented 
+	   while holding m_mutex) */
+	mutable QMutex m_mutex;
+	QWaitCondition m_cond;
+	std::vector<SplitBlock> m_splitBlocks;
+	QAtomicInt m_activeBlocks;
+	int m_finishedBlocks;
+	volatile bool m_done;
+	std::vector<float> m_sampleTimes;
+	volatile float m_medianSampleTime;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,108 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__BOXACCEL_H)
+#define __BOXACCEL_H
+
+#include <nori/bbox.h>
+
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Up to four axis-aligned boxes in a structure-of-arrays layout,
+ * which a ray is tested against at once (e.g. the children of a node
+ * of a 4-wide BVH)
+ *
+ * The near and far planes of each axis are picked using the direction
+ * signs precomputed by \ref TRay::update(), so that the SSE version
+ * of the slab test needs no comparisons or selects per axis. Unused
+ * entries are empty boxes, which are never reported as a hit. Like
+ * \ref TriAccel4, arrays of these records must be 16-byte aligned
+ * (see \ref allocAligned()).
+ */
+struct BoxAccel4 {
+	/// Minimum (<tt>bounds[0]</tt>) and maximum (<tt>bounds[1]</tt>) of each axis
+	float bounds[2][3][4];
+
+	/// Store a box in one of the four entries
+	inline void set(int lane, const BoundingBox3f &bbox) {
+		for (int k=0; k<3; ++k) {
+			bounds[0][k][lane] = bbox.min[k];
+			bounds[1][k][lane] = bbox.max[k];
+		}
+	}
+
+	/// Mark one of the entries as unused
+	inline void clear(int lane) {
+		for (int k=0; k<3; ++k) {
+			bounds[0][k][lane] =  std::numeric_limits<float>::infinity();
+			bounds[1][k][lane] = -std::numeric_limits<float>::infinity();
+		}
+	}
+
+	/**
+	 * \brief Intersect a ray against all four boxes
+	 *
+	 * \return A bit mask of the boxes that overlap the ray segment
+	 * [mint, maxt]. The entry distances (clamped to \c mint) are
+	 * returned via \c nearT.
+	 */
+	inline int rayIntersect(const Ray3f &ray, float mint, float maxt, float *nearT) const {
+#if defined(NORI_SSE)
+		__m128 tNear = _mm_set1_ps(mint), tFar = _mm_set1_ps(maxt);
+		for (int k=0; k<3; ++k) {
+			const int neg = ray.dirIsNeg[k];
+			const __m128 o = _mm_set1_ps(ray.o[k]), dRcp = _mm_set1_ps(ray.dRcp[k]);
+			const __m128
+				t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[neg][k]), o), dRcp),
+				t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[1 - neg][k]), o), dRcp);
+
+			/* The operand order makes max/min return the second operand
+			   (i.e. ignore) NaNs due to rays within a slab plane */
+			tNear = _mm_max_ps(t0, tNear);
+			tFar = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(1.0000005f)), tFar);
+		}
+		_mm_storeu_ps(nearT, tNear);
+		return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+#else
+		int result = 0;
+		for (int i=0; i<4; ++i) {
+			float tNear = mint, tFar = maxt;
+			for (int k=0; k<3; ++k) {
+				const int neg = ray.dirIsNeg[k];
+				float t0 = (bounds[neg][k][i] - ray.o[k]) * ray.dRcp[k],
+				      t1 = (bounds[1 - neg][k][i] - ray.o[k]) * ray.dRcp[k] * 1.0000005f;
+				tNear = t0 > tNear ? t0 : tNear;
+				tFar  = t1 < tFar  ? t1 : tFar;
+			}
+			nearT[i] = tNear;
+			if (tNear <= tFar)
+				result |= 1 << i;
+		}
+		return result;
+#endif
+	}
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __BOXACCEL_H */
@@ -38,14 +38,23 @@ struct BSDFQueryRecord {
 	/// Measure associated with the sample
 	EMeasure measure;
 
+	/// Texture coordinates of the surface interaction (see \ref Texture)
+	Point2f uv;
+
+	/// Width of the footprint in texture space (see \ref Intersection::uvWidth)
+	float uvWidth;
+
+	/// Create an uninitialized record (e.g. for arrays of queries)
+	inline BSDFQueryRecord() : measure(EUnknownMeasure), uv(0.0f, 0.0f), uvWidth(0.0f) { }
+
 	/// Create a new record for sampling the BSDF
 	inline BSDFQueryRecord(const Vector3f &wi)
-		: wi(wi), measure(EUnknownMeasure) { }
+		: wi(wi), measure(EUnknownMeasure), uv(0.0f, 0.0f), uvWidth(0.0f) { }
 
 	/// Create a new record for querying the BSDF
 	inline BSDFQueryRecord(const Vector3f &wi,
 			const Vector3f &wo, EMeasure measure) 
-		: wi(wi), wo(wo), measure(measure) { }
+		: wi(wi), wo(wo), measure(measure), uv(0.0f, 0.0f), uvWidth(0.0f) { }
 };
 
 /**
@@ -69,6 +78,28 @@ public:
 	 */
 	virtual Color3f sample(BSDFQueryRecord &bRec, const Point2f &sample) const = 0;
 
+	/**
+	 * \brief Sample the BSDF for a batch of queries
+	 *
+	 * The counterpart of the batched \ref eval(). The default
+	 * implementation simply calls \ref sample() for each query.
+	 *
+	 * \param bRecs
+	 *     An array of \c count queries, whose \c wo and \c measure
+	 *     fields are set to the sampled directions
+	 * \param samples
+	 *     An array of \c count uniformly distributed samples on \f$[0,1]^2\f$
+	 * \param result
+	 *     Used to return the sample weight of each query
+	 * \param count
+	 *     The number of queries
+	 */
+	virtual void sample(BSDFQueryRecord *bRecs, const Point2f *samples,
+			Color3f *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = sample(bRecs[i], samples[i]);
+	}
+
 	/**
 	 * \brief Evaluate the BSDF for a pair of directions and measure
 	 * specified in \code bRec
@@ -80,6 +111,26 @@ public:
 	 */
 	virtual Color3f eval(const BSDFQueryRecord &bRec) const = 0;
 
+	/**
+	 * \brief Evaluate the BSDF for a batch of direction pairs
+	 *
+	 * This is used by integrators in wavefront mode, which shade the
+	 * interactions with the same material together. The default
+	 * implementation simply calls \ref eval() for each query.
+	 *
+	 * \param bRecs
+	 *     An array of \c count queries
+	 * \param result
+	 *     Used to return the value of the BSDF for each query
+	 * \param count
+	 *     The number of queries
+	 */
+	virtual void eval(const BSDFQueryRecord *bRecs, Color3f *result,
+			uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = eval(bRecs[i]);
+	}
+
 	/**
 	 * \brief Compute the probability of sampling \c bRec.wo
 	 * (conditioned on \c bRec.wi).
@@ -96,6 +147,44 @@ public:
 	 */
 
 	virtual float pdf(const BSDFQueryRecord &bRec) const = 0;
+
+	/**
+	 * \brief Compute the sampling densities of a batch of queries
+	 *
+	 * The counterpart of the batched \ref eval(). The default
+	 * implementation simply calls \ref pdf() for each query.
+	 */
+	virtual void pdf(const BSDFQueryRecord *bRecs, float *result,
+			uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = pdf(bRecs[i]);
+	}
+
+	/**
+	 * \brief Return the (approximate) hemispherical reflectance of the
+	 * material, e.g. for the albedo buffer of a rendering
+	 *
+	 * The default implementation assumes a perfectly white material.
+	 */
+	virtual Color3f getAlbedo() const { return Color3f(1.0f); }
+
+	/**
+	 * \brief Does the BSDF only consist of discrete components (e.g. an
+	 * ideal mirror), so that \ref eval() and \ref pdf() are always zero?
+	 */
+	virtual bool isDiscrete() const { return false; }
+
+	/**
+	 * \brief Is this the BSDF of an invisible surface, which light
+	 * passes without being scattered (e.g. a medium boundary)?
+	 */
+	virtual bool isNull() const { return false; }
+
+	/**
+	 * \brief Return the diffusion profile of a translucent material,
+	 * whose transmitted light leaves it at another point (or \c NULL)
+	 */
+	virtual const DiffusionProfile *getDiffusionProfile() const { return NULL; }
 	
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
@@ -0,0 +1,128 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__BSSRDF_H)
+#define __BSSRDF_H
+
+#include <nori/bsdf.h>
+#include <nori/mesh.h>
+
+/// Maximum number of surface points that a probe ray records (see \ref DiffusionProfile::sampleExit())
+#define NORI_SSS_MAX_HITS 8
+
+/// Number of steps of the integration that finds the radius of the profile tables
+#define NORI_SSS_SEARCH_STEPS 4096
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Radially symmetric diffusion profile of a translucent material,
+ * which turns the subsurface transport into a BSSRDF (see \ref BSDF::getDiffusionProfile())
+ *
+ * Light that is transmitted through the smooth boundary (with the
+ * probability 1 - \ref fresnel()) leaves the material at a nearby point
+ * of the same mesh, weighted by the profile at their distance, and in a
+ * direction given by the \ref getExitBSDF(). This replaces the hundreds
+ * of scattering events that a random walk through a dense medium takes,
+ * at the cost of the bias of the diffusion approximation (which assumes
+ * a flat, semi-infinite material).
+ *
+ * Exit points are sampled as in PBRT: a radius is sampled from the
+ * tabulated profile of a random color channel around the entry point,
+ * on the plane perpendicular to one of the axes of its frame, and a probe
+ * ray along the axis finds the points of the mesh below it. The density
+ * of the chosen point combines all channels and axes.
+ *
+ * The profile is truncated at the radius that contains a given fraction
+ * of its reflectance, which bounds the length of the probe rays.
+ */
+class DiffusionProfile {
+public:
+	DiffusionProfile();
+
+	virtual ~DiffusionProfile();
+
+	/// Fresnel reflectance of the boundary for light arriving from outside
+	virtual float fresnel(float cosTheta) const = 0;
+
+	/// Evaluate the profile (reflectance per unit area) at a distance from the entry point
+	virtual Color3f evalProfile(float r) const = 0;
+
+	/**
+	 * \brief Sample the point where light that entered the material at
+	 * \c its leaves it again
+	 *
+	 * \param time
+	 *     Time of the path (for moving geometry)
+	 * \param its
+	 *     The entry point, which is replaced by the exit point (with its
+	 *     differential geometry)
+	 * \param weight
+	 *     Receives the profile divided by the density of the exit point
+	 * \param rayCount
+	 *     Incremented by the number of probe rays
+	 * \return
+	 *     \c false if no exit point was found
+	 */
+	bool sampleExit(const Scene *scene, Sampler *sampler, float time,
+		Intersection &its, Color3f &weight, uint64_t &rayCount) const;
+
+	/**
+	 * \brief Return the BSDF of the exit point, which transmits light
+	 * through the boundary with a Fresnel-weighted cosine distribution
+	 */
+	inline const BSDF *getExitBSDF() const { return m_exitBSDF; }
+
+	/// Return the radius at which the profile of a color channel is truncated
+	inline float getMaxRadius(int channel) const { return m_maxRadius[channel]; }
+protected:
+	/**
+	 * \brief Tabulate the profile for sampling (called by the material
+	 * once its parameters are known)
+	 *
+	 * \param extent
+	 *     Radii (per channel) beyond which the profile is negligible
+	 * \param quantile
+	 *     Fraction of the reflectance of each channel that is kept
+	 * \param resolution
+	 *     Number of entries of each table
+	 */
+	void buildTables(const float *extent, float quantile, int resolution);
+
+	/// Sample a radius from the table of a channel (negative if it is empty)
+	float sampleRadius(int channel, float sample) const;
+
+	/// Density of \ref sampleRadius() wrt. area on the sampling plane
+	float pdfRadius(int channel, float r) const;
+
+	/// Return a human-readable summary of the tables
+	QString toString() const;
+private:
+	/**
+	 * Cumulative distribution of the reflectance over the radius per
+	 * channel, at radii that grow quadratically up to the maximum one
+	 */
+	std::vector<float> m_cdf[3];
+	float m_maxRadius[3];
+	int m_resolution;
+	BSDF *m_exitBSDF;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __BSSRDF_H */
@@ -0,0 +1,188 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__BVH_H)
+#define __BVH_H
+
+#include <nori/accel.h>
+
+/// Maximum depth of the bounding volume hierarchy
+#define NORI_BVH_MAXDEPTH  64
+
+/// Number of bins used to evaluate split candidates
+#define NORI_BVH_BINS      16
+
+/// Nodes with this many triangles or fewer always become leaves
+#define NORI_BVH_MINLEAF    4
+
+NORI_NAMESPACE_BEGIN
+
+struct TriAccel4;
+struct BoxAccel4;
+
+/**
+ * \brief Bounding volume hierarchy over a set of triangle meshes
+ *
+ * The hierarchy is built top-down using the surface area heuristic,
+ * which is evaluated using \ref NORI_BVH_BINS bins per axis. Unlike
+ * the \ref KDTree, primitives are never referenced more than once, 
+ * which bounds the memory usage and makes the construction considerably
+ * faster. The price is a somewhat slower traversal, since the bounding 
+ * boxes of sibling nodes can overlap.
+ *
+ * The triangles of each leaf are stored in precomputed \ref TriAccel4
+ * blocks so that traversal doesn't have to look up the original meshes.
+ *
+ * When the vertices of the meshes move (e.g. in an animation), 
+ * \ref update() refits the existing hierarchy instead of building a new
+ * one. Since the topology was chosen for the original geometry, the 
+ * quality of a refitted hierarchy gradually degrades. It is therefore
+ * rebuilt once its SAH cost exceeds that of the last full build by the
+ * factor set via \ref setRefitThreshold().
+ *
+ * Optionally (see \ref setWide()), the binary hierarchy is collapsed into
+ * a 4-wide one after every build or refit: each of its nodes stores the
+ * boxes of up to four descendants in a \ref BoxAccel4, which a ray is
+ * tested against at once. This roughly halves the depth of the tree and
+ * the number of nodes that are visited during traversal.
+ */
+class BVH : public Accelerator {
+public:
+	/// Create a new and empty BVH
+	BVH();
+
+	/// Release all memory
+	virtual ~BVH();
+
+	/// Build the hierarchy
+	void build();
+
+	/**
+	 * \brief Refit the bounding boxes and triangle blocks to the current
+	 * vertex positions, or rebuild when the quality degraded too much
+	 *
+	 * \return \c true if the hierarchy was refitted
+	 */
+	bool update();
+
+	/**
+	 * \brief Set the allowed growth of the SAH cost relative to the 
+	 * last full build before \ref update() rebuilds the hierarchy
+	 *
+	 * The default is 1.5. Pass infinity to always refit.
+	 */
+	inline void setRefitThreshold(float threshold) { m_refitThreshold = threshold; }
+
+	/// Return the allowed growth of the SAH cost before the hierarchy is rebuilt
+	inline float getRefitThreshold() const { return m_refitThreshold; }
+
+	/// Traverse a 4-wide version of the hierarchy? (default: no)
+	inline void setWide(bool wide) { m_wide = wide; }
+
+	/// Is a 4-wide version of the hierarchy traversed?
+	inline bool isWide() const { return m_wide; }
+
+	/**
+	 * \brief Return the SAH cost of the hierarchy (with unit traversal
+	 * and intersection costs) relative to the surface area of its root
+	 */
+	float getCost() const;
+
+	/// Intersect a ray against the BVH (see \ref Accelerator::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its, 
+		bool shadowRay = false) const;
+
+	/// Return an axis-aligned bounding box containing all meshes
+	inline const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/// Return the memory used by the nodes and precomputed triangles 
+	size_t getMemoryUsage() const;
+
+	/// Report the nodes and precomputed triangles separately
+	void reportMemory(MemoryReport &report) const;
+
+	/// Return the time spent to build the hierarchy in milliseconds
+	inline qint64 getBuildTime() const { return m_buildTime; }
+
+	/// Return the name of this acceleration data structure
+	QString getName() const { return m_wide ? "BVH4" : "BVH"; }
+
+protected:
+	/// Compact BVH node data structure (32 bytes)
+	struct BVHNode {
+		/// Bounding box of all triangles below this node
+		BoundingBox3f bbox;
+		/**
+		 * \brief For inner nodes, the index of the second child (the first
+		 * child immediately follows its parent). For leaves, the index
+		 * of the first \ref TriAccel4 block
+		 */
+		uint32_t offset;
+		/// Number of triangles (leaf) or zero (inner node), shifted by two bits
+		uint32_t data;
+
+		/// Is this a leaf node?
+		inline bool isLeaf() const { return (data >> 2) != 0; }
+
+		/// Return the number of triangles in a leaf node
+		inline uint32_t getPrimCount() const { return data >> 2; }
+
+		/// Return the split axis of an inner node
+		inline int getAxis() const { return (int) (data & 3); }
+	};
+
+	/// Node of the 4-wide hierarchy (128 bytes)
+	struct WideNode;
+
+	/// Temporary per-triangle record used during construction
+	struct BuildPrimitive {
+		BoundingBox3f bbox;
+		Point3f centroid;
+		IndexType index;
+	};
+
+	/**
+	 * \brief Recursively construct the subtree for the given range of
+	 * primitives and return the index of its root node
+	 */
+	uint32_t buildRecursive(std::vector<BuildPrimitive> &prims,
+		uint32_t start, uint32_t end, int depth, std::vector<TriAccel4> &blocks);
+
+	/// Collapse the binary hierarchy into \ref m_wideNodes
+	void buildWide();
+
+	/// Traversal of the 4-wide hierarchy (see \ref rayIntersect())
+	bool rayIntersectWide(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+
+private:
+	std::vector<BVHNode> m_nodes;
+	TriAccel4 *m_triAccel;
+	SizeType m_triAccelCount;
+	WideNode *m_wideNodes;
+	SizeType m_wideNodeCount;
+	bool m_wide;
+	BoundingBox3f m_bbox;
+	qint64 m_buildTime;
+	float m_refitThreshold;
+	/// SAH cost after the last full build
+	float m_buildCost;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __BVH_H */
@@ -35,6 +35,9 @@ NORI_NAMESPACE_BEGIN
  */
 class Camera : public NoriObject {
 public:
+	/// Create a camera whose shutter opens and closes at time zero
+	inline Camera() : m_shutterOpen(0.0f), m_shutterClose(0.0f) { }
+
  	/**
 	 * \brief Importance sample a ray according to the camera's response function
 	 *
@@ -59,12 +62,96 @@ public:
 		const Point2f &samplePosition,
 		const Point2f &apertureSample) const = 0;
 
+	/**
+	 * \brief Sample several rays at once (e.g. the camera rays of a 
+	 * batch in wavefront mode)
+	 *
+	 * Equivalent to calling \ref sampleRay() for each of the \c count 
+	 * film positions and aperture samples, which is what the default 
+	 * implementation does. Cameras can override it to share work 
+	 * between the rays.
+	 */
+	virtual void sampleRays(uint32_t count, const Point2f *samplePositions,
+			const Point2f *apertureSamples, Ray3f *rays, Color3f *weights) const {
+		for (uint32_t i=0; i<count; ++i)
+			weights[i] = sampleRay(rays[i], samplePositions[i], apertureSamples[i]);
+	}
+
+	/**
+	 * \brief Sample a position on the aperture that sees a point \c ref
+	 * in the scene (used to connect light paths to the camera)
+	 *
+	 * \param ref
+	 *    A point in the scene
+	 * \param apertureSample
+	 *    A uniformly distributed 2D vector that is used to sample
+	 *    a position on the aperture of the sensor if necessary
+	 * \param samplePosition
+	 *    Used to return the position of \c ref on the film, expressed
+	 *    in fractional pixel coordinates
+	 * \param d
+	 *    Used to return the (normalized) direction from \c ref to the
+	 *    sampled aperture position
+	 * \param dist
+	 *    Used to return the distance between the two
+	 *
+	 * \return
+	 *    The importance emitted towards \c ref, times the cosine at
+	 *    the aperture, divided by the squared distance and the density 
+	 *    of the aperture position. The importance is normalized so that
+	 *    it integrates to one over the whole film. Zero if \c ref isn't
+	 *    visible on the film.
+	 */
+	virtual Color3f sampleImportance(const Point3f &ref, const Point2f &apertureSample,
+		Point2f &samplePosition, Vector3f &d, float &dist) const {
+		throw NoriException("Camera::sampleImportance(): not supported by this camera!");
+	}
+
+	/**
+	 * \brief Return the origin that all rays through a rectangle of the
+	 * film share, and four directions whose convex hull contains theirs
+	 *
+	 * \param min, max
+	 *    Corners of the rectangle in fractional pixel coordinates
+	 * \param corners
+	 *    Array of four world space directions
+	 * \return
+	 *    \c false if the rays don't start at a common origin (this is
+	 *    what the default implementation returns)
+	 */
+	virtual bool getFrustum(const Point2f &min, const Point2f &max,
+			Point3f &origin, Vector3f *corners) const {
+		return false;
+	}
+
+	/// Does the shutter stay open for a nonzero amount of time (i.e. motion blur)?
+	inline bool hasMotionBlur() const { return m_shutterClose > m_shutterOpen; }
+
+	/// Return the time at which the shutter opens
+	inline float getShutterOpen() const { return m_shutterOpen; }
+
+	/// Return the time at which the shutter closes
+	inline float getShutterClose() const { return m_shutterClose; }
+
+	/// Map a uniformly distributed sample to a time within the shutter interval
+	inline float sampleTime(float sample) const {
+		return m_shutterOpen + sample * (m_shutterClose - m_shutterOpen);
+	}
+
 	/// Return the size of the output image in pixels
 	inline const Vector2i &getOutputSize() const { return m_outputSize; }
 
 	/// Return the camera's reconstruction filter in image space
 	inline const ReconstructionFilter *getReconstructionFilter() const { return m_rfilter; }
 
+	/**
+	 * \brief Return the name of the view rendered by this camera (e.g. 
+	 * \c left), which names its part of a multi-view output file
+	 *
+	 * Given by the \c name property; empty unless specified.
+	 */
+	inline const QString &getName() const { return m_name; }
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/Camera/etc.) 
 	 * provided by this instance
@@ -73,6 +160,8 @@ public:
 protected:
 	Vector2i m_outputSize;
 	ReconstructionFilter *m_rfilter;
+	float m_shutterOpen, m_shutterClose;
+	QString m_name;
 };
 
 NORI_NAMESPACE_END
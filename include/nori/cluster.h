@@ -0,0 +1,243 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__CLUSTER_H)
+#define __CLUSTER_H
+
+#include <nori/block.h>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QByteArray>
+#include <csignal>
+
+#define NORI_CLUSTER_UNIT_SIZE 128 /* Default size of the work units of a cluster rendering */
+#define NORI_CLUSTER_UNITS_IN_FLIGHT 2 /* Work units queued on a worker at the same time */
+
+NORI_NAMESPACE_BEGIN
+
+class Scene;
+class ClusterConnection;
+
+/**
+ * \brief Distributes the rendering of one image over several machines
+ * (<tt>nori --master</tt>)
+ *
+ * The master listens on a TCP port for workers (see \ref ClusterWorker),
+ * which may connect and disconnect at any time during the rendering.
+ * Every worker receives the scene file, and then work units: square
+ * regions of the image (\ref NORI_CLUSTER_UNIT_SIZE pixels wide), which
+ * it renders with all of its cores and sends back as an unnormalized
+ * \ref ImageBlock. The master adds them to its output, including their
+ * borders, hence the result matches a rendering on one machine.
+ *
+ * Each worker has \ref NORI_CLUSTER_UNITS_IN_FLIGHT units queued, so
+ * that it moves on to the next one without waiting for the network.
+ * When no unit is left to be handed out, an idle worker steals one that
+ * is still being rendered by another worker (preferring units that the
+ * fewest workers are busy with). The first result wins, and the other
+ * workers are told to drop the unit, so that a slow or overloaded
+ * machine doesn't hold up the end of the rendering. Units of a worker
+ * that disconnects are handed out again.
+ *
+ * The scene file itself is sent to the workers, but the files it
+ * references (meshes, textures, includes) are loaded by every worker,
+ * relative to its working directory, so they must be available under
+ * the same paths (e.g. on a shared file system). Images are exchanged
+ * in the byte order of the machines, which must therefore agree.
+ *
+ * Integrators that splat light paths anywhere on the image (see
+ * \ref Integrator::usesSplatting()) or that need a pass over the whole
+ * image (see \ref Integrator::usesPasses()) are not supported.
+ */
+class ClusterMaster : public QThread {
+public:
+	/// Snapshot of the progress of a rendering (see \ref getProgress())
+	struct Progress {
+		/// Number of work units in total, and those that were rendered
+		int unitCount, finishedUnits;
+		/// Number of connected workers
+		int workerCount;
+	};
+
+	/**
+	 * \brief Start listening for workers
+	 *
+	 * \param port
+	 *     TCP port on which workers connect (on all interfaces). Throws
+	 *     a \ref NoriException when the port can't be opened.
+	 * \param sceneFile
+	 *     Scene file that is sent to the workers
+	 * \param scene
+	 *     The loaded scene (must stay alive while the master exists)
+	 * \param offset
+	 *     Offset of the region to be rendered
+	 * \param size
+	 *     Size of the region to be rendered (zero = up to the
+	 *     end of the camera's output image)
+	 * \param unitSize
+	 *     Size of the work units in pixels
+	 * \param blockFormat
+	 *     Format in which the workers send their results (see
+	 *     \ref ImageBlock::serialize()). Compression takes a few 
+	 *     milliseconds per unit and shrinks the results to about
+	 *     40%; half floats are lossy but save another fifth or so.
+	 */
+	ClusterMaster(int port, const QString &sceneFile, const Scene *scene,
+		const Point2i &offset = Point2i(0, 0), const Vector2i &size = Vector2i(0, 0),
+		int unitSize = NORI_CLUSTER_UNIT_SIZE,
+		int blockFormat = ImageBlock::ESerializeCompressed);
+
+	/// Tell the workers to stop, close all connections and release the output
+	virtual ~ClusterMaster();
+
+	/**
+	 * \brief Return the image block that receives the output
+	 *
+	 * Its pixels are only complete once the rendering is done
+	 * (see \ref waitDone()).
+	 */
+	inline ImageBlock *getOutput() { return m_output; }
+
+	/**
+	 * \brief Stop handing out work units. Units that weren't rendered
+	 * by then remain black
+	 */
+	void cancel();
+
+	/// Was the rendering stopped by \ref cancel()?
+	bool isCancelled() const;
+
+	/**
+	 * \brief Wait until all work units were rendered, or the rendering
+	 * was cancelled
+	 *
+	 * \return \c false if this didn't happen within \c msecs milliseconds
+	 */
+	bool waitDone(unsigned long msecs);
+
+	/// Return the progress of the rendering
+	Progress getProgress() const;
+
+	/// Loop that accepts the connections of workers
+	void run();
+protected:
+	friend class ClusterConnection;
+
+	/// A region of the image that is rendered by one worker
+	struct Unit {
+		Point2i offset;
+		Vector2i size;
+		/// Identifiers of the workers that are rendering the unit
+		std::vector<int> workers;
+		/// When the unit was last handed out (see \ref m_assignmentCount)
+		uint64_t assigned;
+		bool finished;
+	};
+
+	/**
+	 * \brief Pick a unit for a worker: one that wasn't handed out yet,
+	 * or else one that other workers are rendering (-1 = none)
+	 */
+	int assign(int worker);
+
+	/// Hand the unit of a worker back (e.g. when it disconnects)
+	void release(int worker, int unit);
+
+	/**
+	 * \brief Add the rendered pixels of a unit to the output
+	 *
+	 * Results for units that were already rendered by another worker
+	 * are ignored.
+	 */
+	void finish(int worker, int unit, const QByteArray &block);
+
+	/// Has the unit been rendered (or the rendering stopped)?
+	bool isObsolete(int unit) const;
+
+	/// Is the rendering done (all units rendered, or cancelled)?
+	bool isDone() const;
+
+	/// Remove connections whose thread has ended (requires \c m_mutex)
+	void reapConnections();
+private:
+	int m_blockFormat;
+	QByteArray m_sceneName, m_sceneContents;
+	const Scene *m_scene;
+	ImageBlock *m_output;
+	std::vector<Unit> m_units;
+	int m_finishedUnits;
+	/// Number of times a unit was handed out
+	uint64_t m_assignmentCount;
+	bool m_cancelled;
+	/// Listening socket (a \c SOCKET on Windows, a file descriptor elsewhere)
+	intptr_t m_socket;
+	std::vector<ClusterConnection *> m_connections;
+	int m_nextWorker;
+	mutable QMutex m_mutex;
+	QWaitCondition m_doneCond;
+	volatile bool m_shutdown;
+};
+
+/**
+ * \brief Renders work units for a \ref ClusterMaster (<tt>nori --worker</tt>)
+ *
+ * The worker connects to the master, renders the units it receives
+ * using a \ref RenderEngine with one thread per core, and sends the
+ * results back. Once the master is done (or goes away), the worker
+ * waits for the next rendering, keeping the last scene loaded in case
+ * it is rendered again (e.g. with a different sample count).
+ */
+class ClusterWorker {
+public:
+	/**
+	 * \brief Create a worker
+	 *
+	 * \param host
+	 *     Host name or IPv4 address of the master
+	 * \param port
+	 *     TCP port of the master
+	 * \param loadFlags
+	 *     Flags used to load scenes (see \ref loadScene())
+	 */
+	ClusterWorker(const QString &host, int port, int loadFlags = 0);
+
+	/// Release the loaded scene
+	~ClusterWorker();
+
+	/**
+	 * \brief Serve renderings until \c *stop becomes nonzero (e.g. in
+	 * a signal handler)
+	 */
+	void run(const volatile sig_atomic_t *stop);
+protected:
+	/// Render the units of one session with the master
+	void serve(intptr_t connection, const volatile sig_atomic_t *stop);
+
+	/// Return the scene with the given contents, loading it if necessary
+	Scene *getScene(const QString &name, const QByteArray &contents);
+private:
+	QString m_host;
+	int m_port;
+	int m_loadFlags;
+	Scene *m_scene;
+	QByteArray m_sceneHash;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __CLUSTER_H */
@@ -58,23 +58,42 @@
 #define INV_FOURPI   0.07957747154594766788f
 #define SQRT_TWO     1.41421356237309504880f
 #define INV_SQRT_TWO 0.70710678118654752440f
+#define OneMinusEpsilon 0.99999994f /* Largest float below 1 */
 
 /* Optimization-related macros */
 #if defined(__GNUC__)
 #define EXPECT_TAKEN(a)        __builtin_expect(a, true)
 #define EXPECT_NOT_TAKEN(a)    __builtin_expect(a, false)
+#define PREFETCH(addr)         __builtin_prefetch(addr)
 #if defined(__linux) 
 #define __restrict             __restrict__
 #endif
+#elif defined(_MSC_VER)
+#define EXPECT_TAKEN(a)        a
+#define EXPECT_NOT_TAKEN(a)    a
+#define PREFETCH(addr)         _mm_prefetch((const char *) (addr), _MM_HINT_T0)
 #else
 #define EXPECT_TAKEN(a)        a
 #define EXPECT_NOT_TAKEN(a)    a
+#define PREFETCH(addr)         ((void) 0)
+#endif
+
+/// Size of a cache line in bytes (the granularity of \ref PREFETCH)
+#define NORI_CACHE_LINE_SIZE 64
+
+/* Enable hand-vectorized code paths when Eigen was able to detect SSE2 */
+#if defined(EIGEN_VECTORIZE_SSE2)
+#define NORI_SSE 1
 #endif
 
+/// Number of samples that the batched sampling routines of BSDFs and phase functions warp at once
+#define NORI_WARP_BATCH_SIZE 64
+
 /* MSVC is missing a few C99 functions */
 #if defined(_MSC_VER)
 	/// No nextafterf()! -- an implementation is provided in support_win32.cpp
 	extern float nextafterf(float x, float y);
+	#include <intrin.h>
 #endif
 
 #if !defined(_GNU_SOURCE)
@@ -141,17 +160,24 @@ class NoriObject;
 class NoriObjectFactory;
 class Mesh;
 class BSDF;
+class DiffusionProfile;
+class Texture;
 class Bitmap;
 class BlockGenerator;
 class ImageBlock;
 class Camera;
 class Integrator;
 class Sampler;
+class Accelerator;
 class KDTree;
+class BVH;
+class Instance;
+class InstanceAccelerator;
 class Scene;
 class ReconstructionFilter;
 class PhaseFunction;
 class Medium;
+class Luminaire;
 
 /// Import cout, cerr, endl for debugging purposes
 using std::cout;
@@ -203,6 +229,19 @@ inline float lerp(float t, float v1, float v2) {
     return ((float) 1 - t) * v1 + t * v2;
 }
 
+/// Atomically add \c delta to a floating point value (using a compare-and-swap loop)
+inline void atomicAdd(volatile float *dst, float delta) {
+	union { float f; int32_t i; } oldValue, newValue;
+	do {
+		oldValue.f = *dst;
+		newValue.f = oldValue.f + delta;
+#if defined(_MSC_VER)
+	} while (_InterlockedCompareExchange((volatile long *) dst, newValue.i, oldValue.i) != oldValue.i);
+#else
+	} while (!__sync_bool_compare_and_swap((volatile int32_t *) dst, oldValue.i, newValue.i));
+#endif
+}
+
 /// Uniformly sample a vector on the unit sphere with respect to solid angles
 extern Vector3f squareToUniformSphere(const Point2f &sample);
 
@@ -212,6 +251,22 @@ extern Vector3f squareToUniformHemisphere(const Point2f &sample);
 /// Uniformly sample a vector on the unit hemisphere with respect to projected solid angles
 extern Vector3f squareToCosineHemisphere(const Point2f &sample);
 
+/**
+ * \brief Warp a batch of samples with \ref squareToUniformSphere()
+ *
+ * Processes four samples at a time using SSE when available (the
+ * results match the scalar version up to rounding).
+ */
+extern void squareToUniformSphere(const Point2f *samples, Vector3f *result, uint32_t count);
+
+/**
+ * \brief Warp a batch of samples with \ref squareToCosineHemisphere()
+ *
+ * Processes four samples at a time using SSE when available (the
+ * results match the scalar version up to rounding).
+ */
+extern void squareToCosineHemisphere(const Point2f *samples, Vector3f *result, uint32_t count);
+
 /// Uniformly sample a vector on a 2D disk
 extern Point2f squareToUniformDisk(const Point2f &sample);
 
@@ -227,18 +282,81 @@ extern Vector3f sphericalDirection(float theta, float phi);
 /// Compute a direction for the given coordinates in spherical coordinates
 extern Point2f sphericalCoordinates(const Vector3f &dir);
 
+/**
+ * \brief Unpolarized Fresnel reflection coefficient of a dielectric
+ * interface
+ *
+ * \param cosThetaI
+ *     Cosine of the angle between the normal and the incident ray
+ *     (negative when the ray arrives from the interior)
+ * \param extIOR
+ *     Refractive index of the side that the normal points into
+ * \param intIOR
+ *     Refractive index of the other side
+ */
+extern float fresnel(float cosThetaI, float extIOR, float intIOR);
+
 /// Indent a complete string (except for the first line) by the requested number of spaces
 extern QString indent(const QString &string, int amount = 2);
 
+/// Quote a string for a JSON file (as UTF-8, dropping control characters)
+extern std::string toJSONString(const QString &string);
+
 /// Allocate an aligned region of memory
 extern void *allocAligned(size_t size);
 
 /// Free an aligned region of memory
 extern void freeAligned(void *ptr);
 
+/**
+ * \brief Allocate a large, cache line-aligned region of memory that is 
+ * accessed at random (e.g. kd-tree nodes and mesh buffers)
+ *
+ * On Linux, regions of 2 MiB and more are backed by huge pages when
+ * possible, which saves TLB misses: first by pages that were reserved 
+ * for this purpose (<tt>vm.nr_hugepages</tt>; 1 GiB pages for regions 
+ * of a gigabyte and more), and otherwise by transparent huge pages. 
+ * When neither is available (and on other platforms), this falls back
+ * to \ref allocAligned().
+ */
+extern void *allocLarge(size_t size);
+
+/// Free a region of memory that was allocated with \ref allocLarge()
+extern void freeLarge(void *ptr);
+
+/// Enable or disable huge pages for \ref allocLarge() (enabled by default)
+extern void setHugePagesEnabled(bool enabled);
+
+/// Are huge pages used by \ref allocLarge()?
+extern bool getHugePagesEnabled();
+
 /// Return the number of cores (real and virtual)
 extern int getCoreCount();
 
+/// Return the peak resident memory of the process in bytes (0 if unknown)
+extern size_t getPeakMemoryUsage();
+
+/// Return the number of NUMA nodes (1 when there is no topology information)
+extern int getNodeCount();
+
+/// Return the indices of the cores that belong to a NUMA node
+extern std::vector<int> getNodeCores(int node);
+
+/**
+ * \brief Restrict the calling thread to the specified set of cores
+ *
+ * Threads started by the calling thread inherit the restriction (on Linux).
+ *
+ * \return \c false if this is not supported or failed
+ */
+extern bool setThreadAffinity(const std::vector<int> &cores);
+
+/// Return the NUMA node that the calling thread was assigned to (0 by default)
+extern int getThreadNode();
+
+/// Record the NUMA node that the calling thread runs on (see \ref getThreadNode())
+extern void setThreadNode(int node);
+
 NORI_NAMESPACE_END
 
 #endif /* __COMMON_H */
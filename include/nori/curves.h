@@ -0,0 +1,145 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__CURVES_H)
+#define __CURVES_H
+
+#include <nori/procedural.h>
+
+/// Maximum number of recursive subdivisions of a segment during intersection
+#define NORI_CURVES_MAXSUBDIV 10
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Set of hair strands, each of which is a chain of cubic Bezier
+ * segments with a tapering width
+ *
+ * The strands are loaded from a text file, each line of which lists the
+ * control points of one strand as <tt>x y z</tt> triples. Consecutive
+ * segments share their end points, hence a strand with \f$n\f$ segments
+ * has \f$3n+1\f$ control points. Lines starting with \c # are ignored.
+ * Each strand tapers linearly from the \c radius at its root to the
+ * \c tipRadius at its last control point.
+ *
+ * A segment is intersected as a flat ribbon that always faces the ray
+ * (following "Ray tracing for curves primitive" by Nakamaru and Ohno,
+ * as in pbrt-v3), which is much cheaper than a true swept surface and
+ * looks the same for thin hair. With <tt>type="cylinder"</tt>, the
+ * shading normal varies across the ribbon so that it is shaded like a
+ * cylinder; <tt>type="flat"</tt> keeps the ribbon's normal.
+ *
+ * Curves are a \ref ProceduralMesh, so that BSDFs are attached and
+ * intersections are reported like for triangle meshes. Their segments
+ * are stored in the hierarchy of a \ref ProceduralAccelerator. Curves
+ * can't be luminaires, have no interior medium, and can't be instanced.
+ */
+class Curves : public ProceduralMesh {
+public:
+	enum ECurveType {
+		EFlat = 0,
+		ECylinder
+	};
+
+	Curves(const PropertyList &propList);
+
+	/// Release all memory
+	virtual ~Curves();
+
+	/// Check the configuration and assign a default BSDF
+	void activate();
+
+	/// Return the total number of Bezier segments
+	inline uint32_t getSegmentCount() const { return (uint32_t) m_segments.size(); }
+
+	/// Return the total number of Bezier segments
+	uint32_t getShapeCount() const { return getSegmentCount(); }
+
+	/// Return the number of strands
+	inline uint32_t getStrandCount() const { return m_strandCount; }
+
+	/// Return an axis-aligned bounding box containing the given segment
+	BoundingBox3f getBoundingBox(uint32_t index) const;
+
+	/**
+	 * \brief Return the axis-aligned bounding box of the part of a
+	 * segment that lies within another given bounding box
+	 *
+	 * This is the counterpart of \ref Mesh::getClippedBoundingBox() for
+	 * curves: the segment is subdivided a few times, and the (widened)
+	 * control point hulls of the pieces are clipped individually. The
+	 * result is usually much tighter than the hull of the whole segment.
+	 */
+	BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const;
+
+	/**
+	 * \brief Intersect a ray against a segment
+	 *
+	 * \param index
+	 *    Index of the segment
+	 * \param ray
+	 *    The ray segment to be used for the intersection query
+	 * \param maxt
+	 *    Only intersections closer than this are reported
+	 * \param t
+	 *    Upon success, the distance along the ray
+	 * \param uv
+	 *    Upon success, the curve parameter of the intersection within
+	 *    the segment (first component, the second one is zero)
+	 * \return
+	 *   \c true if an intersection has been detected
+	 */
+	bool rayIntersect(uint32_t index, const Ray3f &ray, float maxt,
+		float &t, Point2f &uv) const;
+
+	/**
+	 * \brief Compute the differential geometry of an intersection found
+	 * by \ref rayIntersect() (which depends on the ray, since the ribbon
+	 * faces it)
+	 *
+	 * Expects \c its.t, \c its.primIndex and the curve parameter
+	 * (in the first component of \c its.bary).
+	 */
+	void computeDifferentialGeometry(const Ray3f &ray, Intersection &its) const;
+
+	/// Return a human-readable summary of this instance
+	QString toString() const;
+
+protected:
+	/// Subdivide and intersect the segment whose control points are given in ray space
+	bool recursiveIntersect(const Point3f *cp, float u0, float u1, int depth,
+		float width0, float width1, float zMin, float &zMax, float &u) const;
+
+private:
+	/// Per-segment record: first control point and the widths at both ends
+	struct Segment {
+		uint32_t offset;
+		float width0, width1;
+	};
+
+	QString m_filename;
+	ECurveType m_type;
+	std::vector<Point3f> m_points;
+	std::vector<Segment> m_segments;
+	uint32_t m_strandCount;
+	float m_radius, m_tipRadius;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __CURVES_H */
@@ -0,0 +1,85 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__DENOISER_H)
+#define __DENOISER_H
+
+#include <nori/bitmap.h>
+
+NORI_NAMESPACE_BEGIN
+
+class ImageBlock;
+
+/**
+ * \brief Joint (cross) bilateral denoiser guided by AOVs
+ *
+ * Every output pixel is a weighted average of its neighbors within
+ * a square window. The weights combine a spatial Gaussian with edge
+ * stopping terms on the normal and albedo AOVs, which don't suffer
+ * from Monte Carlo noise, and a term on the color difference that
+ * is normalized by the per-pixel variance estimate: pixels whose
+ * colors differ by more than their noise level explains don't get
+ * mixed. To preserve texture detail, the filter operates on the
+ * color divided by the albedo and multiplies it back afterwards.
+ *
+ * The rows of the image are processed in parallel.
+ */
+class Denoiser {
+public:
+	/**
+	 * \brief Create a denoiser
+	 *
+	 * \param radius
+	 *    Half the edge length of the filter window in pixels
+	 * \param strength
+	 *    Scales the color tolerance in units of the standard
+	 *    deviation (larger values blur more aggressively)
+	 * \param threadCount
+	 *    Number of threads (0 = one per core)
+	 */
+	Denoiser(int radius = 3, float strength = 1.0f, int threadCount = 0);
+
+	/**
+	 * \brief Denoise the radiance of an image block
+	 *
+	 * The block must store AOVs (see \ref ImageBlock::setAOVs()).
+	 * Returns a new bitmap that is owned by the caller.
+	 */
+	Bitmap *denoise(const ImageBlock &block) const;
+
+	/**
+	 * \brief Denoise a bitmap using the given guide images
+	 *
+	 * All bitmaps must have the same size. \c variance stores the
+	 * variance of each pixel's estimate in all three components.
+	 * Returns a new bitmap that is owned by the caller.
+	 */
+	Bitmap *denoise(const Bitmap &color, const Bitmap &albedo,
+		const Bitmap &normal, const Bitmap &variance) const;
+
+	/// Return a human-readable summary
+	QString toString() const;
+private:
+	int m_radius;
+	float m_strength;
+	int m_threadCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __DENOISER_H */
@@ -0,0 +1,125 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__DISPLACED_H)
+#define __DISPLACED_H
+
+#include <nori/procedural.h>
+#include <nori/geocache.h>
+
+/// Maximum subdivision level of a \ref DisplacedMesh
+#define NORI_DISPLACED_MAXLEVEL 7
+
+NORI_NAMESPACE_BEGIN
+
+class Texture;
+
+/**
+ * \brief Smooth and displaced surface, which is tessellated on demand
+ *
+ * The surface is defined by a triangle mesh with vertex normals (the
+ * "cage", which is given as a nested mesh). Every triangle of the cage
+ * is a patch, which is refined into \f$4^L\f$ triangles (where \f$L\f$
+ * is the \c subdivisions property). The new vertices are placed on the
+ * curved surface of Phong tessellation (Boubekeur and Alexa 2008) and
+ * then moved along the interpolated normal by the luminance of the
+ * \c displacement texture, multiplied by \c scale. Unlike e.g. Loop
+ * subdivision, Phong tessellation only needs the vertices of the patch
+ * itself, hence the patches can be tessellated independently. Since
+ * the positions along an edge only depend on its two vertices, there
+ * are no cracks between patches (unless the texture coordinates have
+ * a seam there).
+ *
+ * The patches are only tessellated when a ray first hits their bounding
+ * box, and they are kept in the \ref GeometryCache, whose memory budget
+ * bounds the size of the tessellated geometry. The bounding box of a
+ * patch contains the control points of the Phong surface, enlarged by
+ * the largest displacement. This is the \c bound property, which
+ * defaults to \c scale (i.e. it assumes texture values in [0, 1]);
+ * displacements are clamped to it.
+ *
+ * Like \ref Curves, displaced meshes can't be luminaires, have no
+ * interior medium, and can't be instanced. The vertex normals of the
+ * tessellated surface are averaged within each patch only, which can
+ * make the cage edges visible for strong displacements.
+ */
+class DisplacedMesh : public ProceduralMesh {
+public:
+	DisplacedMesh(const PropertyList &propList);
+
+	/// Release all memory
+	virtual ~DisplacedMesh();
+
+	/// Check the configuration and compute the bounding boxes of the patches
+	void activate();
+
+	/// Register a child object (the cage, a displacement texture, or a BSDF)
+	void addChild(NoriObject *child);
+
+	/// Return the number of patches (i.e. the triangles of the cage)
+	uint32_t getShapeCount() const { return m_cage->getTriangleCount(); }
+
+	/// Return an axis-aligned bounding box containing the given patch
+	BoundingBox3f getBoundingBox(uint32_t index) const { return m_bboxes[index]; }
+
+	/**
+	 * \brief Intersect a ray against a patch, tessellating it if necessary
+	 *
+	 * Returns the barycentric coordinates of the intersection within
+	 * the cage triangle via \c uv.
+	 */
+	bool rayIntersect(uint32_t index, const Ray3f &ray, float maxt,
+		float &t, Point2f &uv) const;
+
+	/// Compute the differential geometry of an intersection found by \ref rayIntersect()
+	void computeDifferentialGeometry(const Ray3f &ray, Intersection &its) const;
+
+	/// Tessellate a patch (called by the \ref GeometryCache)
+	TessellatedPatch *tessellate(uint32_t index) const;
+
+	/// Return the ID of the mesh within the \ref GeometryCache
+	inline uint32_t getCacheID() const { return m_cacheID; }
+
+	/// Return a human-readable summary of this instance
+	QString toString() const;
+
+protected:
+	/// Return the position on the Phong surface and the interpolated normal of a patch
+	Point3f evalBase(uint32_t index, const Point2f &bary, Normal3f &n) const;
+
+	/// Return the texture coordinates of a point of a patch
+	Point2f evalTexCoords(uint32_t index, const Point2f &bary) const;
+
+	/// Return the index of the vertex in column \c i and row \c j of a tessellated patch
+	inline uint32_t vertexIndex(uint32_t i, uint32_t j) const {
+		return j * (m_resolution + 1) - j * (j - 1) / 2 + i;
+	}
+
+private:
+	Mesh *m_cage;
+	Texture *m_displacement;
+	float m_scale, m_bound, m_shapeFactor;
+	int m_level;
+	uint32_t m_resolution;
+	uint32_t m_cacheID;
+	std::vector<BoundingBox3f> m_bboxes;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __DISPLACED_H */
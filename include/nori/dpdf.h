@@ -28,6 +28,11 @@ NORI_NAMESPACE_BEGIN
  * 
  * This data structure can be used to transform uniformly distributed
  * samples to a stored discrete probability distribution.
+ *
+ * Once normalized, sampling uses an alias table (Walker's method, built
+ * using Vose's algorithm) and takes constant time regardless of the 
+ * number of entries. Unlike inversion of the CDF, this mapping from 
+ * samples to entries is not monotonic.
  * 
  * \ingroup libcore
  */
@@ -43,6 +48,7 @@ public:
 	inline void clear() {
 		m_cdf.clear();
 		m_cdf.push_back(0.0f);
+		m_alias.clear();
 		m_normalized = false;
 	}
 
@@ -56,6 +62,27 @@ public:
 		m_cdf.push_back(m_cdf[m_cdf.size()-1] + pdfValue);
 	}
 
+	/**
+	 * \brief Set the number of entries, whose running sums the caller
+	 * then writes to \ref getCDF() (e.g. using several threads) before
+	 * calling \ref normalize()
+	 */
+	inline void resize(size_t nEntries) {
+		m_cdf.resize(nEntries+1);
+		m_cdf[0] = 0.0f;
+		m_alias.clear();
+		m_normalized = false;
+	}
+
+	/// Return the running sums of the entries (starting with a zero)
+	inline float *getCDF() { return &m_cdf[0]; }
+
+	/// Return the number of entries so far
+	/// Return the memory used by the tables (in bytes)
+	inline size_t getMemoryUsage() const {
+		return m_cdf.capacity() * sizeof(float) + m_alias.capacity() * sizeof(AliasEntry);
+	}
+
 	/// Return the number of entries so far
 	inline size_t size() const {
 		return m_cdf.size()-1;
@@ -66,6 +93,23 @@ public:
 		return m_cdf[entry+1] - m_cdf[entry];
 	}
 
+	/**
+	 * \brief Return a cell of the alias table
+	 *
+	 * With probability \c prob, a sample falling into cell \c index
+	 * returns \c index, and \c alias otherwise. This assumes that
+	 * \ref normalize() has previously been called.
+	 */
+	inline void getAliasEntry(size_t index, float &prob, uint32_t &alias) const {
+		if (m_alias.empty()) {
+			prob = 1.0f;
+			alias = (uint32_t) index;
+		} else {
+			prob = m_alias[index].prob;
+			alias = m_alias[index].alias;
+		}
+	}
+
 	/// Have the probability densities been normalized?
 	inline bool isNormalized() const {
 		return m_normalized;
@@ -102,6 +146,7 @@ public:
 				m_cdf[i] *= m_normalization;
 			m_cdf[m_cdf.size()-1] = 1.0f;
 			m_normalized = true;
+			buildAliasTable();
 		} else {
 			m_normalization = 0.0f;
 		}
@@ -117,10 +162,12 @@ public:
 	 *     The discrete index associated with the sample
 	 */
 	inline size_t sample(float sampleValue) const {
-		std::vector<float>::const_iterator entry = 
-				std::lower_bound(m_cdf.begin(), m_cdf.end(), sampleValue);
-		size_t index = (size_t) std::max((ptrdiff_t) 0, entry - m_cdf.begin() - 1);
-		return std::min(index, m_cdf.size()-2);
+		if (m_alias.empty())
+			return sampleCDF(sampleValue);
+		size_t index;
+		float remainder = scaleSample(sampleValue, index);
+		const AliasEntry &entry = m_alias[index];
+		return remainder < entry.prob ? index : entry.alias;
 	}
 
 	/**
@@ -150,10 +197,24 @@ public:
 	 *     The discrete index associated with the sample
 	 */
 	inline size_t sampleReuse(float &sampleValue) const {
-		size_t index = sample(sampleValue);
-		sampleValue = (sampleValue - m_cdf[index])
-			/ (m_cdf[index + 1] - m_cdf[index]);
-		return index;
+		if (m_alias.empty()) {
+			size_t index = sampleCDF(sampleValue);
+			sampleValue = (sampleValue - m_cdf[index])
+				/ (m_cdf[index + 1] - m_cdf[index]);
+			return index;
+		}
+
+		size_t index;
+		float remainder = scaleSample(sampleValue, index);
+		const AliasEntry &entry = m_alias[index];
+		if (remainder < entry.prob) {
+			sampleValue = remainder / entry.prob;
+			return index;
+		} else {
+			sampleValue = std::min((remainder - entry.prob) 
+				/ (1.0f - entry.prob), OneMinusEpsilon);
+			return entry.alias;
+		}
 	}
 
 	/**
@@ -169,9 +230,8 @@ public:
 	 *     The discrete index associated with the sample
 	 */
 	inline size_t sampleReuse(float &sampleValue, float &pdf) const {
-		size_t index = sample(sampleValue, pdf);
-		sampleValue = (sampleValue - m_cdf[index])
-			/ (m_cdf[index + 1] - m_cdf[index]);
+		size_t index = sampleReuse(sampleValue);
+		pdf = operator[](index);
 		return index;
 	}
 
@@ -191,7 +251,69 @@ public:
 		return result + QString("}]");
 	}
 private:
+	/// One cell of the alias table
+	struct AliasEntry {
+		/// Probability of returning the cell's own index
+		float prob;
+		/// Index that is returned otherwise
+		uint32_t alias;
+	};
+
+	/// Binary search in the CDF (used before \ref normalize() was called)
+	inline size_t sampleCDF(float sampleValue) const {
+		std::vector<float>::const_iterator entry = 
+				std::lower_bound(m_cdf.begin(), m_cdf.end(), sampleValue);
+		size_t index = (size_t) std::max((ptrdiff_t) 0, entry - m_cdf.begin() - 1);
+		return std::min(index, m_cdf.size()-2);
+	}
+
+	/// Split a sample into a table cell and a uniform remainder on [0,1)
+	inline float scaleSample(float sampleValue, size_t &index) const {
+		float scaled = sampleValue * m_alias.size();
+		index = std::min((size_t) std::max(scaled, 0.0f), m_alias.size() - 1);
+		return std::min(std::max(scaled - index, 0.0f), OneMinusEpsilon);
+	}
+
+	/// Build the alias table from the normalized CDF (Vose's algorithm)
+	void buildAliasTable() {
+		size_t n = size();
+		m_alias.resize(n);
+		std::vector<uint32_t> small, large;
+		std::vector<float> scaled(n);
+		for (size_t i=0; i<n; ++i) {
+			scaled[i] = operator[](i) * n;
+			if (scaled[i] < 1.0f)
+				small.push_back((uint32_t) i);
+			else
+				large.push_back((uint32_t) i);
+		}
+
+		/* Fill each underfull cell with probability mass of an overfull one */
+		while (!small.empty() && !large.empty()) {
+			uint32_t s = small.back(), l = large.back();
+			small.pop_back();
+			m_alias[s].prob = scaled[s];
+			m_alias[s].alias = l;
+			scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+			if (scaled[l] < 1.0f) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+
+		/* The remaining cells are full (up to roundoff errors) */
+		for (size_t i=0; i<large.size(); ++i) {
+			m_alias[large[i]].prob = 1.0f;
+			m_alias[large[i]].alias = large[i];
+		}
+		for (size_t i=0; i<small.size(); ++i) {
+			m_alias[small[i]].prob = 1.0f;
+			m_alias[small[i]].alias = small[i];
+		}
+	}
+
 	std::vector<float> m_cdf;
+	std::vector<AliasEntry> m_alias;
 	float m_sum, m_normalization;
 	bool m_normalized;
 };
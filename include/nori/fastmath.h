@@ -0,0 +1,137 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__FASTMATH_H)
+#define __FASTMATH_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/* ===================================================================
+    Fast single precision transcendental functions for the sampling
+    and shading code. They use Cody-Waite range reduction followed by
+    the minimax polynomials of the Cephes library, and use selects
+    instead of branches (so that loops calling them can be vectorized
+    by the compiler). Their errors, measured against double precision
+    over the stated domains, are:
+
+      fastSinCos:  absolute error <= 1e-7 for |x| <= 8192, and
+                   <= 2 ulp for results of magnitude >= 1e-3
+      fastExp:     <= 1 ulp for x in [-87, 88]
+      fastLog:     <= 1 ulp for normalized positive x
+      fastPow:     relative error <= (2 + |y log2 x|) * 2^-23 for x > 0
+
+    Arguments outside of these domains are not handled (e.g. fastLog(0)
+    returns a large negative finite value instead of -inf). Defining
+    NORI_LIBM (qmake CONFIG+=libm) replaces all of them with the C
+    library functions, e.g. to validate a rendering.
+ * =================================================================== */
+
+#if !defined(NORI_LIBM)
+
+/// Reinterpret the bits of a float as an integer
+inline int32_t floatToBits(float f) {
+	union { float f; int32_t i; } u;
+	u.f = f;
+	return u.i;
+}
+
+/// Reinterpret the bits of an integer as a float
+inline float bitsToFloat(int32_t i) {
+	union { float f; int32_t i; } u;
+	u.i = i;
+	return u.f;
+}
+
+/// Compute the sine and cosine of \c x
+inline void fastSinCos(float x, float *sin, float *cos) {
+	/* Reduce to [-pi/4, pi/4] using the nearest multiple of pi/2 */
+	float q = std::floor(x * (float) (2 / M_PI) + 0.5f);
+	int quadrant = (int) q;
+	float r = ((x - q * 1.5703125f) - q * 4.837512969970703125e-4f)
+		- q * 7.54978995489188216e-8f;
+	float r2 = r * r;
+
+	float s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f
+		+ r2 * -1.9515295891e-4f));
+	float c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f
+		+ r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+
+	/* Rotate by the quadrant */
+	float sinR = (quadrant & 1) ? c : s,
+	      cosR = (quadrant & 1) ? s : c;
+	*sin = (quadrant & 2) ? -sinR : sinR;
+	*cos = ((quadrant + 1) & 2) ? -cosR : cosR;
+}
+
+/// Compute the exponential function
+inline float fastExp(float x) {
+	x = std::min(std::max(x, -87.0f), 88.0f);
+
+	/* exp(x) = 2^n exp(r), where |r| <= log(2)/2 */
+	float n = std::floor(x * 1.44269504088896341f + 0.5f);
+	float r = (x - n * 0.693359375f) + n * 2.12194440e-4f;
+
+	float p = ((((1.9875691500e-4f * r + 1.3981999507e-3f) * r
+		+ 8.3334519073e-3f) * r + 4.1665795894e-2f) * r
+		+ 1.6666665459e-1f) * r + 5.0000001201e-1f;
+	p = p * r * r + r + 1.0f;
+
+	return p * bitsToFloat(((int32_t) n + 127) << 23);
+}
+
+/// Compute the natural logarithm (for positive, normalized arguments)
+inline float fastLog(float x) {
+	/* Split into x = m 2^e, where m lies in [sqrt(1/2), sqrt(2)) */
+	int32_t bits = floatToBits(x);
+	int32_t e = ((bits >> 23) & 0xFF) - 126;
+	float m = bitsToFloat((bits & 0x007FFFFF) | 0x3F000000);
+	bool lower = m < 0.70710678118654752440f;
+	m = lower ? m + m : m;
+	float fe = (float) (lower ? e - 1 : e);
+	m -= 1.0f;
+	float z = m * m;
+
+	float y = ((((((((7.0376836292e-2f * m - 1.1514610310e-1f) * m
+		+ 1.1676998740e-1f) * m - 1.2420140846e-1f) * m
+		+ 1.4249322787e-1f) * m - 1.6668057665e-1f) * m
+		+ 2.0000714765e-1f) * m - 2.4999993993e-1f) * m
+		+ 3.3333331174e-1f) * m * z;
+
+	y += -2.12194440e-4f * fe - 0.5f * z;
+	return m + y + 0.693359375f * fe;
+}
+
+/// Compute \c x raised to the power \c y (for positive \c x)
+inline float fastPow(float x, float y) {
+	return fastExp(y * fastLog(x));
+}
+
+#else
+
+inline void fastSinCos(float x, float *sin, float *cos) { sincosf(x, sin, cos); }
+inline float fastExp(float x) { return std::exp(x); }
+inline float fastLog(float x) { return std::log(x); }
+inline float fastPow(float x, float y) { return std::pow(x, y); }
+
+#endif
+
+NORI_NAMESPACE_END
+
+#endif /* __FASTMATH_H */
@@ -0,0 +1,111 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__FILM_H)
+#define __FILM_H
+
+#include <nori/bitmap.h>
+#include <QMutex>
+
+#define NORI_STREAM_TILE_SIZE 64 /* Default EXR tile size of a streamed image */
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Writes finished image blocks straight into a tiled OpenEXR file
+ *
+ * Rendering a very large image into a single \ref ImageBlock needs 16 
+ * bytes per pixel, plus a second copy when converting it into a 
+ * \ref Bitmap. This class instead accumulates the blocks into the
+ * tiles of the output file, and writes and releases each tile as soon
+ * as all blocks that reach into it (including the border region of the
+ * reconstruction filter) were added. Only the tiles along the front of
+ * the block spiral are kept in memory.
+ *
+ * This requires that every pixel is rendered by exactly one block, 
+ * hence it can't be used with progressive or adaptive rendering.
+ */
+class StreamingFilm {
+public:
+	/**
+	 * \brief Create the output file
+	 *
+	 * \param filename
+	 *     Name of the OpenEXR file
+	 * \param size
+	 *     Size of the image (or rendered region)
+	 * \param offset
+	 *     Offset of the region within the camera's output image
+	 * \param borderSize
+	 *     Border size of the image blocks (see \ref ImageBlock::getBorderSize())
+	 * \param options
+	 *     Precision and compression of the file. The tile size defaults
+	 *     to \ref NORI_STREAM_TILE_SIZE when \c options.tileSize is zero
+	 */
+	StreamingFilm(const QString &filename, const Vector2i &size,
+		const Point2i &offset, int borderSize, const BitmapSaveOptions &options);
+
+	/// Write any remaining tiles and close the file
+	~StreamingFilm();
+
+	/**
+	 * \brief Add a finished image block, and write the tiles that it 
+	 * completes
+	 *
+	 * This function is thread-safe. Tiles are written while other 
+	 * threads continue to add blocks.
+	 */
+	void put(const ImageBlock &block);
+protected:
+	typedef std::vector<Color4f> TilePixels;
+
+	/// Accumulated pixels of a tile that hasn't been written yet
+	struct Tile {
+		/// Pixel storage (empty until the first block reaches into the tile)
+		TilePixels pixels;
+		/// Number of pixels whose blocks still affect this tile
+		int64_t pending;
+		/// Has the tile been handed to the writer?
+		bool written;
+	};
+
+	/// Normalize a tile's pixels and write them to the file
+	void writeTile(int index, const TilePixels &pixels);
+
+	/// Return the pixel region of tile \c index (clipped to the image)
+	void getTileRegion(int index, Point2i &min, Point2i &max) const;
+private:
+	struct ExrFile;
+
+	QString m_filename;
+	Vector2i m_size;
+	Point2i m_offset;
+	int m_borderSize, m_tileSize;
+	Vector2i m_tileCount;
+	std::vector<Tile> m_tiles;
+	size_t m_residentTiles, m_peakResidentTiles;
+	QMutex m_mutex;
+
+	/* The OpenEXR file (m_writeMutex serializes the writes) */
+	ExrFile *m_file;
+	QMutex m_writeMutex;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __FILM_H */
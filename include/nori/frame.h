@@ -19,7 +19,7 @@
 #if !defined(__FRAME_H)
 #define __FRAME_H
 
-#include <nori/vector.h>
+#include <nori/simd.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -52,14 +52,26 @@ struct Frame {
 
 	/// Convert from world coordinates to local coordinates
 	inline Vector3f toLocal(const Vector3f &v) const {
+#if defined(NORI_SIMD4_ENABLED)
+		/* Multiply by the transposed basis, one column at a time */
+		return (Float4(s.x(), t.x(), n.x(), 0.0f) * v.x()
+			  + Float4(s.y(), t.y(), n.y(), 0.0f) * v.y()
+			  + Float4(s.z(), t.z(), n.z(), 0.0f) * v.z()).toVector();
+#else
 		return Vector3f(
 			v.dot(s), v.dot(t), v.dot(n)
 		);
+#endif
 	}
 
 	/// Convert from local coordinates to world coordinates
 	inline Vector3f toWorld(const Vector3f &v) const {
+#if defined(NORI_SIMD4_ENABLED)
+		return (Float4::load(s) * v.x() + Float4::load(t) * v.y()
+			  + Float4::load(n) * v.z()).toVector();
+#else
 		return s * v.x() + t * v.y() + n * v.z();
+#endif
 	}
 
 	/** \brief Assuming that the given direction is in the local coordinate 
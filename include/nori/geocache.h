@@ -0,0 +1,165 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__GEOCACHE_H)
+#define __GEOCACHE_H
+
+#include <nori/triaccel.h>
+#include <nori/boxaccel.h>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThreadStorage>
+#include <map>
+
+/// Number of independently locked parts of the \ref GeometryCache
+#define NORI_GEOCACHE_SHARDS 16
+
+/// Number of patches in the lookup cache of each thread (a power of two)
+#define NORI_GEOCACHE_THREAD_PATCHES 64
+
+/// Default memory budget of the \ref GeometryCache (in MiB)
+#define NORI_GEOCACHE_DEFAULT_BUDGET 256
+
+NORI_NAMESPACE_BEGIN
+
+class DisplacedMesh;
+
+/**
+ * \brief Patch of a \ref DisplacedMesh that was tessellated into the
+ * \ref GeometryCache
+ *
+ * The triangles are stored in blocks of four for the intersection code,
+ * and the bounding boxes of these blocks are grouped by four as well.
+ * Like \ref TextureTile, patches are reference counted: the cache holds
+ * one reference while the patch is resident, and the lookup cache of
+ * every thread that recently used it holds another one.
+ */
+struct TessellatedPatch {
+	/// Key of the patch (mesh and patch index)
+	uint64_t key;
+	/// Number of vertices, triangle blocks and groups of blocks
+	uint32_t vertexCount, blockCount, groupCount;
+	/// Displaced vertex positions
+	Point3f *positions;
+	/// Vertex normals of the displaced surface
+	Normal3f *normals;
+	/// Triangles (16-byte aligned)
+	TriAccel4 *blocks;
+	/// Bounding boxes of the triangle blocks (16-byte aligned)
+	BoxAccel4 *groups;
+	/// Number of references
+	QAtomicInt refs;
+	/// Neighbors in the LRU list of the owning shard of the cache
+	TessellatedPatch *prev, *next;
+
+	TessellatedPatch(uint32_t vertexCount, uint32_t triangleCount);
+
+	~TessellatedPatch();
+
+	/// Return the memory used by the patch (in bytes)
+	inline size_t getMemoryUsage() const {
+		return sizeof(TessellatedPatch) + vertexCount * (sizeof(Point3f) + sizeof(Normal3f))
+			+ blockCount * sizeof(TriAccel4) + groupCount * sizeof(BoxAccel4);
+	}
+
+	/// Release a reference, and free the patch when it was the last one
+	inline void release() {
+		if (!refs.deref())
+			delete this;
+	}
+};
+
+/**
+ * \brief Cache of the tessellated patches of all \ref DisplacedMesh
+ * instances, which keeps their total size within a memory budget
+ *
+ * Patches are tessellated when they are first hit by a ray and evicted
+ * in least recently used order. This works just like the \ref TextureCache:
+ * the resident patches are spread over \c NORI_GEOCACHE_SHARDS parts with
+ * separate locks and budgets, patches are tessellated without holding
+ * any lock, and every thread has a small direct-mapped cache of the
+ * patches that it used last.
+ */
+class GeometryCache {
+public:
+	/// Return the cache that is shared by all meshes
+	static GeometryCache *getInstance();
+
+	/// Set the memory budget for resident patches (in bytes)
+	void setMemoryBudget(size_t bytes);
+
+	/// Return the memory budget for resident patches (in bytes)
+	inline size_t getMemoryBudget() const { return m_budget; }
+
+	/// Return the memory that is currently used by resident patches (in bytes)
+	size_t getMemoryUsage() const;
+
+	/// Return the ID that identifies the patches of a new mesh
+	uint32_t registerMesh();
+
+	/**
+	 * \brief Return a patch of a mesh, tessellating it if necessary
+	 *
+	 * The patch remains valid until the calling thread requests
+	 * another patch, which may replace it in its lookup cache.
+	 */
+	const TessellatedPatch *getPatch(const DisplacedMesh *mesh, uint32_t index);
+private:
+	/// Independently locked part of the cache
+	struct Shard {
+		QMutex mutex;
+		std::map<uint64_t, TessellatedPatch *> patches;
+		/// Most and least recently used patches
+		TessellatedPatch *head, *tail;
+		size_t memory;
+
+		Shard() : head(NULL), tail(NULL), memory(0) { }
+	};
+
+	/// Lookup cache of one thread
+	struct ThreadPatches {
+		TessellatedPatch *patches[NORI_GEOCACHE_THREAD_PATCHES];
+
+		ThreadPatches() { memset(patches, 0, sizeof(patches)); }
+		~ThreadPatches() {
+			for (int i=0; i<NORI_GEOCACHE_THREAD_PATCHES; ++i)
+				if (patches[i])
+					patches[i]->release();
+		}
+	};
+
+	GeometryCache();
+
+	/// Find or tessellate a patch, and return it with a reference for the caller
+	TessellatedPatch *fetch(const DisplacedMesh *mesh, uint64_t key, uint32_t index);
+
+	/// Unlink a patch from the LRU list of a shard
+	static void unlink(Shard &shard, TessellatedPatch *patch);
+
+	/// Insert a patch at the front of the LRU list of a shard
+	static void pushFront(Shard &shard, TessellatedPatch *patch);
+
+	Shard m_shards[NORI_GEOCACHE_SHARDS];
+	QThreadStorage<ThreadPatches *> m_threadPatches;
+	size_t m_budget;
+	QAtomicInt m_nextID;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __GEOCACHE_H */
@@ -33,11 +33,16 @@
 #include <nori/bbox.h>
 #include <boost/static_assert.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
 #include <QElapsedTimer>
 #include <QWaitCondition>
+#include <QAtomicInt>
 #include <QMutex>
+#include <QMutexLocker>
 #include <QThread>
 #include <stack>
+#include <deque>
 #include <map>
 
 /** Compile-time KD-tree depth limit. Allows to put certain
@@ -54,6 +59,19 @@
 #define NORI_KD_BLOCKSIZE_KD  (512*1024/sizeof(KDNode))
 #define NORI_KD_BLOCKSIZE_IDX (512*1024/sizeof(uint32_t))
 
+/// Parallel build: don't hand subtrees with fewer primitives to other threads
+#define NORI_KD_MIN_TASK_PRIMS 4096
+
+/// Parallel build: minimum number of primitives per chunk of a binning/partitioning sweep
+#define NORI_KD_PARALLEL_GRAIN 32768
+
+/// Edge event lists with fewer entries are sorted using std::sort instead of a radix sort
+#define NORI_KD_RADIX_SORT_THRESHOLD 8192
+
+/// Radix sort: bits per digit (four passes cover the 36-bit event keys)
+#define NORI_KD_RADIX_BITS 9
+#define NORI_KD_RADIX_PASSES 4
+
 /**
  * \brief To avoid numerical issues, the size of the scene 
  * bounding box is increased by this amount
@@ -62,6 +80,88 @@
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Keeps track of the temporary memory allocated during a 
+ * kd-tree build, broken down by component
+ *
+ * Unlike the allocators that report to it, this class is thread-safe.
+ */
+class BuildMemoryTracker {
+public:
+	/// Consumers of temporary memory during a kd-tree build
+	enum EComponent {
+		/// Index and edge event lists (see \ref OrderedChunkAllocator)
+		EChunkLists = 0,
+		/// Nodes of the unfinished tree
+		ENodeStorage,
+		/// Primitive indices of the unfinished tree's leaves
+		EIndexStorage,
+		/// Primitive classification tables (see \ref ClassificationStorage)
+		EClassification,
+		/// Inputs of subtrees waiting to be built by another thread
+		ETaskInputs,
+		EComponentCount
+	};
+
+	inline BuildMemoryTracker() {
+		reset();
+	}
+
+	/// Reset all counters
+	void reset() {
+		QMutexLocker locker(&m_mutex);
+		for (int i=0; i<EComponentCount; ++i)
+			m_current[i] = m_peak[i] = 0;
+		m_total = m_totalPeak = 0;
+	}
+
+	/// Record an allocation of \c size bytes
+	inline void allocate(EComponent component, size_t size) {
+		QMutexLocker locker(&m_mutex);
+		m_current[component] += size;
+		m_total += size;
+		m_peak[component] = std::max(m_peak[component], m_current[component]);
+		m_totalPeak = std::max(m_totalPeak, m_total);
+	}
+
+	/// Record that \c size bytes were released
+	inline void release(EComponent component, size_t size) {
+		QMutexLocker locker(&m_mutex);
+		m_current[component] -= size;
+		m_total -= size;
+	}
+
+	/// Return the amount of memory that is currently allocated
+	inline size_t getCurrent() const {
+		QMutexLocker locker(&m_mutex);
+		return m_total;
+	}
+
+	/// Return the largest amount of memory that was allocated at any time
+	inline size_t getPeak() const {
+		QMutexLocker locker(&m_mutex);
+		return m_totalPeak;
+	}
+
+	/// Return the largest amount of memory used by one of the components
+	inline size_t getPeak(EComponent component) const {
+		QMutexLocker locker(&m_mutex);
+		return m_peak[component];
+	}
+
+	/// Return a human-readable name of a component
+	static const char *getComponentName(EComponent component) {
+		static const char *names[] = { "index/event lists", "nodes", 
+			"leaf indices", "classification", "queued subtrees" };
+		return names[component];
+	}
+private:
+	mutable QMutex m_mutex;
+	size_t m_current[EComponentCount];
+	size_t m_peak[EComponentCount];
+	size_t m_total, m_totalPeak;
+};
+
 /**
  * \brief Special "ordered" memory allocator
  *
@@ -81,10 +181,15 @@ NORI_NAMESPACE_BEGIN
 class OrderedChunkAllocator {
 public:
 	inline OrderedChunkAllocator(size_t minAllocation = NORI_KD_MIN_ALLOC)
-			: m_minAllocation(minAllocation) {
+			: m_minAllocation(minAllocation), m_tracker(NULL) {
 		m_chunks.reserve(16);
 	}
 
+	/// Report all chunk allocations to a memory tracker
+	inline void setTracker(BuildMemoryTracker *tracker) {
+		m_tracker = tracker;
+	}
+
 	~OrderedChunkAllocator() {
 		cleanup();
 	}
@@ -93,9 +198,11 @@ public:
 	 * \brief Release all memory used by the allocator
 	 */
 	void cleanup() {
+		if (m_tracker)
+			m_tracker->release(BuildMemoryTracker::EChunkLists, size());
 		for (std::vector<Chunk>::iterator it = m_chunks.begin();
 				it != m_chunks.end(); ++it)
-			freeAligned((*it).start);
+			freeLarge((*it).start);
 		m_chunks.clear();
 	}
 
@@ -140,10 +247,12 @@ public:
 			m_minAllocation);
 
 		Chunk chunk;
-		chunk.start = (uint8_t *) allocAligned(allocSize);
+		chunk.start = (uint8_t *) allocLarge(allocSize);
 		chunk.cur = chunk.start + size;
 		chunk.size = allocSize;
 		m_chunks.push_back(chunk);
+		if (m_tracker)
+			m_tracker->allocate(BuildMemoryTracker::EChunkLists, allocSize);
 
 		return reinterpret_cast<T *>(chunk.start);
 	}
@@ -215,6 +324,7 @@ private:
 
 	size_t m_minAllocation;
 	std::vector<Chunk> m_chunks;
+	BuildMemoryTracker *m_tracker;
 };
 
 /**
@@ -229,12 +339,19 @@ private:
  */
 template <typename T, size_t BlockSize> class BlockedVector {
 public:
-	BlockedVector() : m_pos(0) {}
+	BlockedVector() : m_pos(0), m_tracker(NULL) {}
 
 	~BlockedVector() {
 		clear();
 	}
 
+	/// Report all block allocations to a memory tracker
+	inline void setTracker(BuildMemoryTracker *tracker, 
+			BuildMemoryTracker::EComponent component) {
+		m_tracker = tracker;
+		m_component = component;
+	}
+
 	/**
 	 * \brief Append an element to the end
 	 */
@@ -242,7 +359,7 @@ public:
 		size_t blockIdx = m_pos / BlockSize;
 		size_t offset = m_pos % BlockSize;
 		if (blockIdx == m_blocks.size())
-			m_blocks.push_back(new T[BlockSize]);
+			addBlock();
 		m_blocks[blockIdx][offset] = value;
 		m_pos++;
 	}
@@ -262,13 +379,13 @@ public:
 		T *result;
 		if (EXPECT_TAKEN(offset + size <= BlockSize)) {
 			if (blockIdx == m_blocks.size())
-				m_blocks.push_back(new T[BlockSize]);
+				addBlock();
 			result = m_blocks[blockIdx] + offset;
 			m_pos += size;
 		} else {
 			++blockIdx;
 			if (blockIdx == m_blocks.size())
-				m_blocks.push_back(new T[BlockSize]);
+				addBlock();
 			result = m_blocks[blockIdx];
 			m_pos += BlockSize - offset + size;
 		}
@@ -325,12 +442,22 @@ public:
 		for (typename std::vector<T *>::iterator it = m_blocks.begin(); 
 				it != m_blocks.end(); ++it)
 			delete[] *it;
+		if (m_tracker)
+			m_tracker->release(m_component, capacity() * sizeof(T));
 		m_blocks.clear();
 		m_pos = 0;
 	}
+private:
+	inline void addBlock() {
+		m_blocks.push_back(new T[BlockSize]);
+		if (m_tracker)
+			m_tracker->allocate(m_component, BlockSize * sizeof(T));
+	}
 private:
 	std::vector<T *> m_blocks;
 	size_t m_pos;
+	BuildMemoryTracker *m_tracker;
+	BuildMemoryTracker::EComponent m_component;
 };
 
 /**
@@ -664,6 +791,10 @@ public:
 		m_retract = true;
 		m_parallelBuild = true;
 		m_minMaxBins = 128;
+		m_heuristicCost = 0;
+		m_buildTime = 0;
+		m_indirectionCount = 0;
+		m_maxBuildMemory = 0;
 	}
 
 	/**
@@ -671,9 +802,9 @@ public:
 	 */
 	virtual ~GenericKDTree() {
 		if (m_indices)
-			delete[] m_indices;
+			freeLarge(m_indices);
 		if (m_nodes)
-			freeAligned(m_nodes-1); // undo alignment shift
+			freeLarge(m_nodes-1); // undo alignment shift
 	}
 
 	/**
@@ -847,6 +978,48 @@ public:
 	inline SizeType getExactPrimitiveThreshold() const {
 		return m_exactPrimThreshold;
 	}
+
+	/**
+	 * \brief Limit the amount of temporary memory used during tree 
+	 * construction (in bytes, 0 means unlimited)
+	 *
+	 * The builder then uses fewer threads, stops handing subtrees to other
+	 * threads while close to the limit, and keeps using min-max binning
+	 * instead of switching to the O(n log n) method when the edge event
+	 * lists would not fit. The index lists required by min-max binning
+	 * are never refused, hence the limit can still be exceeded slightly.
+	 */
+	inline void setMaxBuildMemory(size_t maxBuildMemory) {
+		m_maxBuildMemory = maxBuildMemory;
+	}
+
+	/// Return the limit on the temporary memory used during tree construction
+	inline size_t getMaxBuildMemory() const {
+		return m_maxBuildMemory;
+	}
+
+	/// Return the memory statistics of the last tree construction
+	inline const BuildMemoryTracker &getBuildMemoryTracker() const {
+		return m_memoryTracker;
+	}
+
+	/**
+	 * \brief Return the expected cost of a ray query according to the
+	 * tree construction heuristic (only valid after the tree was built)
+	 */
+	inline float getHeuristicCost() const {
+		return m_heuristicCost;
+	}
+
+	/// Return the time spent building the tree in milliseconds
+	inline qint64 getBuildTime() const {
+		return m_buildTime;
+	}
+
+	/// Return the number of indirection nodes that the last build needed
+	inline SizeType getIndirectionCount() const {
+		return m_indirectionCount;
+	}
 protected:
 	/**
 	 * \brief Build a KD-tree over the supplied geometry
@@ -867,18 +1040,20 @@ protected:
 			throw NoriException("The number of min-max bins must be > 2");
 		
 		SizeType primCount = cast()->getPrimitiveCount();
+		m_indirectionCount = 0;
 		if (primCount == 0) {
 			cout << "Warning: kd-tree contains no geometry!" << endl;
 			// +1 shift is for alignment purposes (see KDNode::getSibling)
-			m_nodes = static_cast<KDNode *>(allocAligned(sizeof(KDNode) * 2))+1;
+			m_nodes = static_cast<KDNode *>(allocLarge(sizeof(KDNode) * 2))+1;
 			m_nodes[0].initLeafNode(0, 0);
 			return;
 		}
 
-		if (primCount <= m_exactPrimThreshold)
+		if (primCount < 2 * NORI_KD_MIN_TASK_PRIMS) 
 			m_parallelBuild = false;
 
-		BuildContext ctx(primCount, m_minMaxBins);
+		m_memoryTracker.reset();
+		BuildContext ctx(primCount, m_minMaxBins, &m_memoryTracker);
 
 		/* Establish an ad-hoc depth cutoff value (Formula from PBRT) */
 		if (m_maxDepth == 0)
@@ -891,12 +1066,47 @@ protected:
 		QElapsedTimer timer;
 		timer.start();
 
+		SizeType procCount = getCoreCount();
+		if (m_maxBuildMemory > 0 && m_parallelBuild) {
+			/* Every thread needs a classification table and a few chunks.
+			   Don't let these take up more than a quarter of the budget */
+			size_t perThread = ctx.classStorage.size() + 4 * NORI_KD_MIN_ALLOC;
+			SizeType maxThreads = (SizeType) std::max((size_t) 1, 
+				m_maxBuildMemory / (4 * perThread));
+			if (maxThreads < procCount) {
+				cout << "Using " << maxThreads << " of " << procCount << " threads to "
+					 "stay within the kd-tree memory budget" << endl;
+				procCount = maxThreads;
+			}
+		}
+		if (procCount == 1)
+			m_parallelBuild = false;
+
+		if (m_parallelBuild) {
+			/* Start the builder threads. The main thread uses queue 0 and
+			   participates in the build until all tasks have finished */
+			m_scheduler.done = false;
+			m_scheduler.queues.resize(procCount);
+			for (SizeType i=0; i<procCount; ++i)
+				m_scheduler.queues[i] = new TaskQueue();
+			m_builders.resize(procCount-1);
+			for (SizeType i=0; i<procCount-1; ++i) {
+				m_builders[i] = new TreeBuilder(i+1, this);
+				m_builders[i]->start();
+			}
+		}
+
 		BoundingBoxType &bbox = m_bbox;
 		bbox.reset();
-		for (IndexType i=0; i<primCount; ++i) {
-			bbox.expandBy(cast()->getBoundingBox(i));
-			indices[i] = i;
-		}
+		SizeType chunkCount = getChunkCount(primCount);
+		std::vector<BoundingBoxType> chunkBBoxes(chunkCount);
+		if (chunkCount > 1)
+			parallelFor(ctx, primCount, chunkCount, boost::bind(
+				&GenericKDTree::initializeChunk, this, indices, &chunkBBoxes[0], _1, _2, _3));
+		else
+			initializeChunk(indices, &chunkBBoxes[0], 0, primCount, 0);
+		for (SizeType i=0; i<chunkCount; ++i)
+			bbox.expandBy(chunkBBoxes[i]);
 
 		#if NORI_KD_VERBOSE == 1
 			cout << "kd-tree configuration" << endl
@@ -914,41 +1124,30 @@ protected:
 				<< "  Build tree in parallel     : " << m_parallelBuild << endl << endl;
 		#endif
 
-		SizeType procCount = getCoreCount();
-		if (procCount == 1)
-			m_parallelBuild = false;
-
-		if (m_parallelBuild) {
-			m_builders.resize(procCount);
-			for (SizeType i=0; i<procCount; ++i) {
-				m_builders[i] = new TreeBuilder(i, this);
-				m_builders[i]->start();
-			}
-		}
-
 		KDNode *prelimRoot = ctx.nodes.allocate(1);
 		buildTreeMinMax(ctx, 1, prelimRoot, bbox, bbox, 
 				indices, primCount, true, 0);
 		ctx.leftAlloc.release(indices);
 
 		if (m_parallelBuild) {
-			m_interface.mutex.lock();
-			m_interface.done = true;
-			m_interface.cond.wakeAll();
-			m_interface.mutex.unlock();
+			/* Help with the remaining subtrees, then shut down the builders */
+			processTasks(ctx, true);
+			m_scheduler.mutex.lock();
+			m_scheduler.done = true;
+			m_scheduler.cond.wakeAll();
+			m_scheduler.mutex.unlock();
 			for (SizeType i=0; i<m_builders.size(); ++i) 
 				m_builders[i]->wait();
+			for (SizeType i=0; i<m_scheduler.queues.size(); ++i)
+				delete m_scheduler.queues[i];
+			m_scheduler.queues.clear();
 		}
 
-		size_t totalUsage = m_indirections.capacity() 
-			* sizeof(KDNode *) + ctx.size();
-
 		/// Clean up event lists and print statistics
 		ctx.leftAlloc.cleanup();
 		ctx.rightAlloc.cleanup();
 		for (SizeType i=0; i<m_builders.size(); ++i) {
 			BuildContext &subCtx = m_builders[i]->getContext();
-			totalUsage += subCtx.size();
 			subCtx.leftAlloc.cleanup();
 			subCtx.rightAlloc.cleanup();
 			ctx.accumulateStatisticsFrom(subCtx);
@@ -971,9 +1170,9 @@ protected:
 		m_indexCount = ctx.primIndexCount;
 
 		// +1 shift is for alignment purposes (see KDNode::getSibling)
-		m_nodes = static_cast<KDNode *> (allocAligned(
+		m_nodes = static_cast<KDNode *> (allocLarge(
 				sizeof(KDNode) * (m_nodeCount+1)))+1;
-		m_indices = new IndexType[m_indexCount];
+		m_indices = static_cast<IndexType *>(allocLarge(sizeof(IndexType) * m_indexCount));
 
 		/* The following code rewrites all tree nodes with proper relative 
 		   indices. It also computes the final tree cost and some other
@@ -986,11 +1185,11 @@ protected:
 			const BuildContext *context = boost::get<2>(stack.top());
 			BoundingBoxType bbox = boost::get<3>(stack.top());
 			stack.pop();
-			typename std::map<const KDNode *, IndexType>::const_iterator it 
-				= m_interface.threadMap.find(node);
-			// Check if we're switching to a subtree built by a worker thread
-			if (it != m_interface.threadMap.end()) 
-				context = &m_builders[(*it).second]->getContext();
+			typename std::map<const KDNode *, const BuildContext *>::const_iterator it 
+				= m_scheduler.threadMap.find(node);
+			// Check if we're switching to a subtree built by another thread
+			if (it != m_scheduler.threadMap.end()) 
+				context = (*it).second;
 
 			if (node->isLeaf()) {
 				SizeType primStart = node->getPrimStart(),
@@ -1050,6 +1249,7 @@ protected:
 			subCtx.nodes.clear();
 			subCtx.indices.clear();
 		}
+		m_indirectionCount = (SizeType) m_indirections.size();
 		std::vector<KDNode *>().swap(m_indirections);
 
 		if (m_builders.size() > 0) {
@@ -1075,7 +1275,7 @@ protected:
 
 		#if NORI_KD_VERBOSE == 1
 			cout << "Structural kd-tree statistics" << endl
-				<< "  Parallel work units         : " << m_interface.threadMap.size() << endl
+				<< "  Parallel work units         : " << m_scheduler.threadMap.size() << endl
 				<< "  Node storage cost           : " << (nodePtr * sizeof(KDNode)) / 1024 << " KiB" << endl
 				<< "  Index storage cost          : " << (indexPtr * sizeof(IndexType)) / 1024 << " KiB" << endl
 				<< "  Inner nodes                 : " << ctx.innerNodeCount << endl
@@ -1093,10 +1293,28 @@ protected:
 				<< "  Final cost                  : " << heuristicCost << endl << endl;
 		#endif
 
-		cout << "Finished after " << timer.elapsed() << " ms (used "  
-			<< totalUsage/1024 << " KiB of temp. memory)" << endl 
-			<< "The final kd-tree requires " << (nodePtr*sizeof(KDNode) + 
-			indexPtr * sizeof(IndexType)) / 1024 << " KiB of memory" << endl;
+		m_heuristicCost = heuristicCost;
+		m_buildTime = timer.elapsed();
+
+		cout << "Finished after " << m_buildTime << " ms (used "  
+			<< m_memoryTracker.getPeak()/1024 << " KiB of temp. memory";
+		if (m_maxBuildMemory > 0)
+			cout << " of a " << m_maxBuildMemory/1024 << " KiB budget";
+		cout << ", SAH cost " << heuristicCost << ")" << endl;
+		if (ctx.budgetFallbacks > 0)
+			cout << "Used min-max binning instead of the O(n log n) method for "
+				 << ctx.budgetFallbacks << " nodes to respect the memory budget" << endl;
+
+		cout << "Peak temp. memory per component:";
+		for (int i=0; i<BuildMemoryTracker::EComponentCount; ++i) {
+			BuildMemoryTracker::EComponent component = (BuildMemoryTracker::EComponent) i;
+			cout << (i > 0 ? ", " : " ") << BuildMemoryTracker::getComponentName(component)
+				 << " " << m_memoryTracker.getPeak(component) / 1024 << " KiB";
+		}
+		cout << endl << "The final kd-tree requires " << (nodePtr*sizeof(KDNode) + 
+			indexPtr * sizeof(IndexType)) / 1024 << " KiB of memory (nodes "
+			<< (nodePtr*sizeof(KDNode)) / 1024 << " KiB, indices "
+			<< (indexPtr*sizeof(IndexType)) / 1024 << " KiB)" << endl;
 	}
 
 protected:
@@ -1182,22 +1400,43 @@ protected:
 		ClassificationStorage classStorage;
 		MinMaxBins minMaxBins;
 
+		/// Index of the associated thread's queue in the \ref BuildScheduler
+		SizeType threadIndex;
+		/// Number of subtrees handed to other threads from this context
+		SizeType spawnedTasks;
+
 		SizeType leafNodeCount;
 		SizeType nonemptyLeafNodeCount;
 		SizeType innerNodeCount;
 		SizeType primIndexCount;
 		SizeType retractedSplits;
 		SizeType pruned;
+		/// Number of nodes that didn't switch to the O(n log n) method due to the memory budget
+		SizeType budgetFallbacks;
 
-		BuildContext(SizeType primCount, SizeType binCount)
-			: minMaxBins(binCount) {
+		BuildMemoryTracker *tracker;
+
+		BuildContext(SizeType primCount, SizeType binCount, BuildMemoryTracker *tracker)
+			: minMaxBins(binCount), tracker(tracker) {
 			classStorage.setPrimitiveCount(primCount);
+			tracker->allocate(BuildMemoryTracker::EClassification, classStorage.size());
+			leftAlloc.setTracker(tracker);
+			rightAlloc.setTracker(tracker);
+			nodes.setTracker(tracker, BuildMemoryTracker::ENodeStorage);
+			indices.setTracker(tracker, BuildMemoryTracker::EIndexStorage);
+			threadIndex = 0;
+			spawnedTasks = 0;
 			leafNodeCount = 0;
 			nonemptyLeafNodeCount = 0;
 			innerNodeCount = 0;
 			primIndexCount = 0;
 			retractedSplits = 0;
 			pruned = 0;
+			budgetFallbacks = 0;
+		}
+
+		~BuildContext() {
+			tracker->release(BuildMemoryTracker::EClassification, classStorage.size());
 		}
 
 		size_t size() {
@@ -1214,32 +1453,115 @@ protected:
 			primIndexCount += ctx.primIndexCount;
 			retractedSplits += ctx.retractedSplits;
 			pruned += ctx.pruned;
+			budgetFallbacks += ctx.budgetFallbacks;
 		}
 	};
 
 	/**
-	 * \brief Communication data structure used to pass jobs to
-	 * kd-tree builder threads
+	 * \brief Unit of work that is processed by one of the threads 
+	 * participating in a parallel kd-tree build
 	 */
-	struct BuildInterface {
-		/* Communcation */
-		QMutex mutex;
-		QWaitCondition cond, condJobTaken;
-		std::map<const KDNode *, IndexType> threadMap;
-		bool done;
+	struct BuildTask {
+		virtual ~BuildTask() { }
+
+		/// Run the task using the build context of the executing thread
+		virtual void execute(BuildContext &ctx) = 0;
+
+		/// Is this a chunk of a parallel loop (see \ref parallelFor())?
+		virtual bool isLoopChunk() const { return false; }
+	};
 
-		/* Job description for building a subtree */
-		int depth;
+	/// Builds the subtree below a node using min-max binning
+	struct MinMaxTask : public BuildTask {
+		GenericKDTree *tree;
+		unsigned int depth;
+		KDNode *node;
+		BoundingBoxType nodeBoundingBox, tightBBox;
+		IndexType *indices; ///< Heap-allocated copy owned by the task
+		SizeType primCount, badRefines;
+
+		void execute(BuildContext &ctx) {
+			tree->registerTask(node, ctx);
+			IndexType *localIndices = ctx.leftAlloc.template allocate<IndexType>(primCount);
+			memcpy(localIndices, indices, primCount * sizeof(IndexType));
+			delete[] indices;
+			ctx.tracker->release(BuildMemoryTracker::ETaskInputs, primCount * sizeof(IndexType));
+			tree->buildTreeMinMax(ctx, depth, node, nodeBoundingBox, tightBBox,
+				localIndices, primCount, true, badRefines);
+			ctx.leftAlloc.release(localIndices);
+		}
+	};
+
+	/// Builds the subtree below a node using the O(n log n) optimization
+	struct SubtreeTask : public BuildTask {
+		GenericKDTree *tree;
+		unsigned int depth;
 		KDNode *node;
 		BoundingBoxType nodeBoundingBox;
-		EdgeEvent *eventStart, *eventEnd;
-		SizeType primCount;
-		int badRefines;
+		EdgeEvent *events; ///< Heap-allocated, sorted copy owned by the task
+		size_t eventCount;
+		SizeType primCount, badRefines;
+
+		void execute(BuildContext &ctx) {
+			tree->registerTask(node, ctx);
+			EdgeEvent *eventStart = ctx.leftAlloc.template allocate<EdgeEvent>(eventCount),
+					  *eventEnd = eventStart + eventCount;
+			memcpy(eventStart, events, eventCount * sizeof(EdgeEvent));
+			delete[] events;
+			ctx.tracker->release(BuildMemoryTracker::ETaskInputs, eventCount * sizeof(EdgeEvent));
+			tree->buildTree(ctx, depth, node, nodeBoundingBox, eventStart,
+				eventEnd, primCount, true, badRefines);
+			ctx.leftAlloc.release(eventStart);
+		}
+	};
+
+	/// Contiguous chunk of a parallel loop
+	struct LoopChunk : public BuildTask {
+		boost::function<void (SizeType, SizeType, SizeType)> func;
+		SizeType start, end, index;
+		QAtomicInt *remaining;
 
-		inline BuildInterface() {
-			node = NULL;
-			done = false;
+		void execute(BuildContext &) {
+			func(start, end, index);
+			remaining->deref();
 		}
+
+		bool isLoopChunk() const { return true; }
+	};
+
+	/// Task queue of a single thread
+	struct TaskQueue {
+		QMutex mutex;
+		std::deque<BuildTask *> tasks;
+	};
+
+	/**
+	 * \brief Work-stealing scheduler shared by all threads that 
+	 * participate in a parallel kd-tree build
+	 *
+	 * Every thread pushes the tasks it creates onto the front of its own
+	 * queue and takes work from there. Threads that run out of work steal
+	 * from the back of the other queues, where the oldest (and usually 
+	 * largest) tasks are located.
+	 */
+	struct BuildScheduler {
+		/// One queue per thread (index 0 belongs to the main thread)
+		std::vector<TaskQueue *> queues;
+		/// Number of queued tasks that have not been taken yet
+		QAtomicInt pending;
+		/// Number of queued tasks that have not finished yet
+		QAtomicInt outstanding;
+		/// Number of threads waiting for work
+		QAtomicInt idle;
+		/// Used to put idle threads to sleep
+		QMutex mutex;
+		QWaitCondition cond;
+		bool done;
+		/// Records which build context was used to create each task's subtree
+		std::map<const KDNode *, const BuildContext *> threadMap;
+		QMutex threadMapLock;
+
+		inline BuildScheduler() : done(false) { }
 	};
 
 	/**
@@ -1248,43 +1570,14 @@ protected:
 	class TreeBuilder : public QThread {
 	public:
 		TreeBuilder(IndexType id, GenericKDTree *parent) 
-			: QThread(), m_id(id),
-			m_parent(parent),
+			: QThread(), m_parent(parent),
 			m_context(parent->cast()->getPrimitiveCount(),
-					  parent->getMinMaxBins()),
-			m_interface(parent->m_interface) {
+					  parent->getMinMaxBins(), &parent->m_memoryTracker) {
+			m_context.threadIndex = id;
 		}
 
 		void run() {
-			OrderedChunkAllocator &leftAlloc = m_context.leftAlloc;
-			while (true) {
-				m_interface.mutex.lock();
-				while (!m_interface.done && !m_interface.node)
-					m_interface.cond.wait(&m_interface.mutex);
-				if (m_interface.done) {
-					m_interface.mutex.unlock();
-					break;
-				}
-				int depth = m_interface.depth;
-				KDNode *node = m_interface.node;
-				BoundingBoxType nodeBoundingBox = m_interface.nodeBoundingBox;
-				size_t eventCount = m_interface.eventEnd - m_interface.eventStart;
-				SizeType primCount = m_interface.primCount;
-				int badRefines = m_interface.badRefines;
-				EdgeEvent *eventStart = leftAlloc.allocate<EdgeEvent>(eventCount),
-						  *eventEnd = eventStart + eventCount;
-				memcpy(eventStart, m_interface.eventStart, 
-						eventCount * sizeof(EdgeEvent));
-				m_interface.threadMap[node] = m_id;
-				m_interface.node = NULL;
-				m_interface.condJobTaken.wakeOne();
-				m_interface.mutex.unlock();
-
-				std::sort(eventStart, eventEnd, EdgeEventOrdering());
-				m_parent->buildTree(m_context, depth, node,
-					nodeBoundingBox, eventStart, eventEnd, primCount, true, badRefines);
-				leftAlloc.release(eventStart);
-			}
+			m_parent->processTasks(m_context, false);
 		}
 
 		inline BuildContext &getContext() {
@@ -1292,12 +1585,234 @@ protected:
 		}
 
 	private:
-		IndexType m_id;
 		GenericKDTree *m_parent;
 		BuildContext m_context;
-		BuildInterface &m_interface;
 	};
 
+	/// Record that the subtree below \c node is built using \c ctx
+	inline void registerTask(const KDNode *node, const BuildContext &ctx) {
+		m_scheduler.threadMapLock.lock();
+		m_scheduler.threadMap[node] = &ctx;
+		m_scheduler.threadMapLock.unlock();
+	}
+
+	/// Push a task onto the queue of the calling thread and wake up an idle thread
+	void pushTask(BuildContext &ctx, BuildTask *task) {
+		TaskQueue *queue = m_scheduler.queues[ctx.threadIndex];
+		m_scheduler.outstanding.ref();
+		queue->mutex.lock();
+		queue->tasks.push_front(task);
+		queue->mutex.unlock();
+		m_scheduler.pending.ref();
+
+		m_scheduler.mutex.lock();
+		if ((int) m_scheduler.idle > 0)
+			m_scheduler.cond.wakeOne();
+		m_scheduler.mutex.unlock();
+	}
+
+	/**
+	 * \brief Take a task from the calling thread's queue, or steal 
+	 * one from another thread if it is empty
+	 *
+	 * \param loopChunksOnly
+	 *    Only accept chunks of parallel loops from the own queue
+	 *    (used while waiting for a parallel loop to finish)
+	 */
+	BuildTask *fetchTask(BuildContext &ctx, bool loopChunksOnly) {
+		if ((int) m_scheduler.pending == 0)
+			return NULL;
+
+		const SizeType queueCount = (SizeType) m_scheduler.queues.size();
+		TaskQueue *queue = m_scheduler.queues[ctx.threadIndex];
+		BuildTask *task = NULL;
+
+		queue->mutex.lock();
+		if (!queue->tasks.empty() && (!loopChunksOnly 
+				|| queue->tasks.front()->isLoopChunk())) {
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		}
+		queue->mutex.unlock();
+
+		for (SizeType i=1; i<queueCount && !task && !loopChunksOnly; ++i) {
+			TaskQueue *victim = m_scheduler.queues[(ctx.threadIndex + i) % queueCount];
+			victim->mutex.lock();
+			if (!victim->tasks.empty()) {
+				task = victim->tasks.back();
+				victim->tasks.pop_back();
+			}
+			victim->mutex.unlock();
+		}
+
+		if (task)
+			m_scheduler.pending.deref();
+		return task;
+	}
+
+	/// Execute a task and signal when the last outstanding task has finished
+	void runTask(BuildContext &ctx, BuildTask *task) {
+		task->execute(ctx);
+		delete task;
+		if (!m_scheduler.outstanding.deref()) {
+			m_scheduler.mutex.lock();
+			m_scheduler.cond.wakeAll();
+			m_scheduler.mutex.unlock();
+		}
+	}
+
+	/**
+	 * \brief Process tasks until the scheduler is shut down
+	 *
+	 * \param untilIdle
+	 *    Return as soon as there are no more outstanding tasks 
+	 *    (used by the main thread) 
+	 */
+	void processTasks(BuildContext &ctx, bool untilIdle) {
+		while (true) {
+			BuildTask *task = fetchTask(ctx, false);
+			if (task) {
+				runTask(ctx, task);
+				continue;
+			}
+
+			m_scheduler.mutex.lock();
+			while (!m_scheduler.done && (int) m_scheduler.pending == 0
+					&& !(untilIdle && (int) m_scheduler.outstanding == 0)) {
+				m_scheduler.idle.ref();
+				m_scheduler.cond.wait(&m_scheduler.mutex);
+				m_scheduler.idle.deref();
+			}
+			bool finished = m_scheduler.done ||
+				(untilIdle && (int) m_scheduler.outstanding == 0);
+			m_scheduler.mutex.unlock();
+
+			if (finished)
+				break;
+		}
+	}
+
+	/**
+	 * \brief Can \c size additional bytes of temporary memory be allocated
+	 * without exceeding the budget (see \ref setMaxBuildMemory())?
+	 */
+	inline bool withinBudget(size_t size) const {
+		return m_maxBuildMemory == 0 || 
+			m_memoryTracker.getCurrent() + size <= m_maxBuildMemory;
+	}
+
+	/**
+	 * \brief Determine whether a child node with the given number of 
+	 * primitives should be handed to another thread
+	 *
+	 * \param inputSize
+	 *    Size of the child's index or event list in bytes. The task, the
+	 *    thread that builds it and the child's own children hold about
+	 *    one copy each, which must fit into the memory budget.
+	 */
+	inline bool shouldSpawn(SizeType primCount, size_t inputSize) const {
+		return m_parallelBuild && primCount >= NORI_KD_MIN_TASK_PRIMS
+			&& (int) m_scheduler.idle > (int) m_scheduler.pending
+			&& withinBudget(3 * inputSize);
+	}
+
+	/**
+	 * \brief Return the number of chunks that a sweep over \c count 
+	 * primitives should be split into (1 means: run serially)
+	 *
+	 * \param itemSize
+	 *    Temporary memory needed per primitive by the parallel version
+	 *    of the sweep. It runs serially if this exceeds the memory budget.
+	 */
+	inline SizeType getChunkCount(SizeType count, size_t itemSize = 0) const {
+		if (!m_parallelBuild || !withinBudget(count * itemSize))
+			return 1;
+		SizeType maxChunks = 4 * (SizeType) m_scheduler.queues.size();
+		return std::max((SizeType) 1, std::min(maxChunks, 
+			count / (SizeType) NORI_KD_PARALLEL_GRAIN));
+	}
+
+	/**
+	 * \brief Split the range <tt>[0, count)</tt> into \c chunkCount
+	 * contiguous chunks and call <tt>func(start, end, chunkIndex)</tt>
+	 * for each of them. Other threads may help with the chunks while 
+	 * the calling thread works on its share.
+	 */
+	void parallelFor(BuildContext &ctx, SizeType count, SizeType chunkCount,
+			const boost::function<void (SizeType, SizeType, SizeType)> &func) {
+		QAtomicInt remaining((int) chunkCount - 1);
+
+		for (SizeType i=chunkCount-1; i>0; --i) {
+			LoopChunk *chunk = new LoopChunk();
+			chunk->func = func;
+			chunk->start = (SizeType) (((uint64_t) count * i) / chunkCount);
+			chunk->end = (SizeType) (((uint64_t) count * (i+1)) / chunkCount);
+			chunk->index = i;
+			chunk->remaining = &remaining;
+			pushTask(ctx, chunk);
+		}
+
+		func(0, (SizeType) (count / chunkCount), 0);
+
+		/* Process the remaining chunks, or wait for other threads to finish them */
+		while ((int) remaining > 0) {
+			BuildTask *task = fetchTask(ctx, true);
+			if (task)
+				runTask(ctx, task);
+			else
+				QThread::yieldCurrentThread();
+		}
+	}
+
+	/// Hand the min-max binning build of a subtree to another thread
+	void spawnMinMaxTask(BuildContext &ctx, unsigned int depth, KDNode *node,
+			const BoundingBoxType &nodeBoundingBox, const BoundingBoxType &tightBBox,
+			const IndexType *indices, SizeType primCount, SizeType badRefines) {
+		MinMaxTask *task = new MinMaxTask();
+		task->tree = this;
+		task->depth = depth;
+		task->node = node;
+		task->nodeBoundingBox = nodeBoundingBox;
+		task->tightBBox = tightBBox;
+		task->indices = new IndexType[primCount];
+		memcpy(task->indices, indices, primCount * sizeof(IndexType));
+		m_memoryTracker.allocate(BuildMemoryTracker::ETaskInputs, primCount * sizeof(IndexType));
+		task->primCount = primCount;
+		task->badRefines = badRefines;
+		ctx.spawnedTasks++;
+		pushTask(ctx, task);
+	}
+
+	/// Hand the O(n log n) build of a subtree to another thread
+	void spawnSubtreeTask(BuildContext &ctx, unsigned int depth, KDNode *node,
+			const BoundingBoxType &nodeBoundingBox, const EdgeEvent *eventStart,
+			const EdgeEvent *eventEnd, SizeType primCount, SizeType badRefines) {
+		SubtreeTask *task = new SubtreeTask();
+		task->tree = this;
+		task->depth = depth;
+		task->node = node;
+		task->nodeBoundingBox = nodeBoundingBox;
+		task->eventCount = eventEnd - eventStart;
+		task->events = new EdgeEvent[task->eventCount];
+		memcpy(task->events, eventStart, task->eventCount * sizeof(EdgeEvent));
+		m_memoryTracker.allocate(BuildMemoryTracker::ETaskInputs, task->eventCount * sizeof(EdgeEvent));
+		task->primCount = primCount;
+		task->badRefines = badRefines;
+		ctx.spawnedTasks++;
+		pushTask(ctx, task);
+	}
+
+	/// Compute the bounds of a range of primitives and initialize their indices
+	void initializeChunk(IndexType *indices, BoundingBoxType *bboxes,
+			SizeType start, SizeType end, SizeType chunk) {
+		BoundingBoxType bbox;
+		for (SizeType i=start; i<end; ++i) {
+			bbox.expandBy(cast()->getBoundingBox(i));
+			indices[i] = i;
+		}
+		bboxes[chunk] = bbox;
+	}
+
 	/// Cast to the derived class
 	inline Derived *cast() {
 		return static_cast<Derived *>(this);
@@ -1355,6 +1870,118 @@ protected:
 		return boost::make_tuple(eventStart, eventEnd, actualPrimCount);
 	}
 
+	/**
+	 * \brief Return an integer key of an edge event, whose order matches
+	 * that of \ref EdgeEventOrdering
+	 *
+	 * The axis occupies the top two bits, followed by the position (with
+	 * the sign bit flipped, or all bits for negative numbers) and the
+	 * event type.
+	 */
+	static inline uint64_t getRadixKey(const EdgeEvent &event) {
+		union { float f; uint32_t i; } pos;
+		pos.f = event.pos;
+		if (pos.f == 0) /* -0 and +0 compare equal */
+			pos.i = 0;
+		pos.i = (pos.i & 0x80000000u) ? ~pos.i : (pos.i | 0x80000000u);
+		return ((uint64_t) event.axis << 34) | ((uint64_t) pos.i << 2) 
+			| (uint64_t) event.type;
+	}
+
+	/// Shared arguments of a parallel radix sort pass (see \ref sortEvents())
+	struct RadixSortJob {
+		EdgeEvent *input, *output;
+		int shift;
+		/// Per-chunk digit histograms, which are then turned into output offsets
+		SizeType *counts;
+	};
+
+	/// Count the digits of the events in a chunk
+	void radixCountChunk(RadixSortJob *job, SizeType start, SizeType end, SizeType index) {
+		SizeType *counts = job->counts + index * (1 << NORI_KD_RADIX_BITS);
+		memset(counts, 0, sizeof(SizeType) * (1 << NORI_KD_RADIX_BITS));
+		for (SizeType i=start; i<end; ++i)
+			counts[(getRadixKey(job->input[i]) >> job->shift) 
+				& ((1 << NORI_KD_RADIX_BITS) - 1)]++;
+	}
+
+	/// Move the events of a chunk to their positions in the output
+	void radixScatterChunk(RadixSortJob *job, SizeType start, SizeType end, SizeType index) {
+		SizeType *offsets = job->counts + index * (1 << NORI_KD_RADIX_BITS);
+		for (SizeType i=start; i<end; ++i) {
+			const EdgeEvent &event = job->input[i];
+			job->output[offsets[(getRadixKey(event) >> job->shift) 
+				& ((1 << NORI_KD_RADIX_BITS) - 1)]++] = event;
+		}
+	}
+
+	/**
+	 * \brief Sort an edge event list using \ref EdgeEventOrdering
+	 *
+	 * Long lists are sorted using a least significant digit radix sort on
+	 * the keys from \ref getRadixKey(), whose passes are split into chunks
+	 * that other threads can help with during a parallel build. The scratch
+	 * buffer is temporarily taken from \c alloc. Short lists, and lists whose
+	 * scratch buffer would exceed the memory budget, use \c std::sort.
+	 */
+	void sortEvents(BuildContext &ctx, OrderedChunkAllocator &alloc,
+			EdgeEvent *eventStart, EdgeEvent *eventEnd) {
+		const SizeType count = (SizeType) (eventEnd - eventStart);
+		if (count < NORI_KD_RADIX_SORT_THRESHOLD || !withinBudget(count * sizeof(EdgeEvent))) {
+			std::sort(eventStart, eventEnd, EdgeEventOrdering());
+			return;
+		}
+
+		const SizeType bucketCount = 1 << NORI_KD_RADIX_BITS,
+		               chunkCount = getChunkCount(count);
+		std::vector<SizeType> counts(chunkCount * bucketCount);
+		RadixSortJob job;
+		job.input = eventStart;
+		job.output = alloc.allocate<EdgeEvent>(count);
+		job.counts = &counts[0];
+		EdgeEvent *scratch = job.output;
+
+		for (int pass=0; pass<NORI_KD_RADIX_PASSES; ++pass) {
+			job.shift = pass * NORI_KD_RADIX_BITS;
+			if (chunkCount > 1)
+				parallelFor(ctx, count, chunkCount, boost::bind(
+					&GenericKDTree::radixCountChunk, this, &job, _1, _2, _3));
+			else
+				radixCountChunk(&job, 0, count, 0);
+
+			/* Compute the output offsets (ordered by digit and then by chunk,
+			   which keeps the sort stable). Skip passes where all events 
+			   share the same digit */
+			SizeType offset = 0;
+			bool trivial = false;
+			for (SizeType bucket=0; bucket<bucketCount; ++bucket) {
+				SizeType total = 0;
+				for (SizeType chunk=0; chunk<chunkCount; ++chunk) {
+					SizeType &entry = counts[chunk * bucketCount + bucket];
+					SizeType n = entry;
+					entry = offset + total;
+					total += n;
+				}
+				if (total == count)
+					trivial = true;
+				offset += total;
+			}
+			if (trivial)
+				continue;
+
+			if (chunkCount > 1)
+				parallelFor(ctx, count, chunkCount, boost::bind(
+					&GenericKDTree::radixScatterChunk, this, &job, _1, _2, _3));
+			else
+				radixScatterChunk(&job, 0, count, 0);
+			std::swap(job.input, job.output);
+		}
+
+		if (job.input != eventStart)
+			memcpy(eventStart, job.input, count * sizeof(EdgeEvent));
+		alloc.release(scratch);
+	}
+
 	/**
 	 * \brief Leaf node creation helper function
 	 *
@@ -1496,33 +2123,11 @@ protected:
 				? ctx.leftAlloc : ctx.rightAlloc;
 		boost::tuple<EdgeEvent *, EdgeEvent *, SizeType> events  
 				= createEventList(alloc, nodeBoundingBox, indices, primCount);
-		float cost;
-		if (m_parallelBuild) {
-			m_interface.mutex.lock();
-			m_interface.depth = depth;
-			m_interface.node = node;
-			m_interface.nodeBoundingBox = nodeBoundingBox;
-			m_interface.eventStart = boost::get<0>(events);
-			m_interface.eventEnd = boost::get<1>(events);
-			m_interface.primCount = boost::get<2>(events);
-			m_interface.badRefines = badRefines;
-			m_interface.cond.wakeOne();
-
-			/* Wait for a worker thread to take this job */
-			while (m_interface.node)
-				m_interface.condJobTaken.wait(&m_interface.mutex);
-			m_interface.mutex.unlock();
-
-			// Never tear down this subtree (return a cost of -infinity)
-			cost = -std::numeric_limits<float>::infinity();
-		} else {
-			std::sort(boost::get<0>(events), boost::get<1>(events), 
-					EdgeEventOrdering());
+		sortEvents(ctx, alloc, boost::get<0>(events), boost::get<1>(events));
 
-			cost = buildTree(ctx, depth, node, nodeBoundingBox,
-				boost::get<0>(events), boost::get<1>(events), 
-				boost::get<2>(events), isLeftChild, badRefines);
-		}
+		float cost = buildTree(ctx, depth, node, nodeBoundingBox,
+			boost::get<0>(events), boost::get<1>(events), 
+			boost::get<2>(events), isLeftChild, badRefines);
 		alloc.release(boost::get<0>(events));
 		return cost;
 	}
@@ -1566,16 +2171,23 @@ protected:
 			return leafCost;
 		}
 
-		if (primCount <= m_exactPrimThreshold) 
-			return transitionToNLogN(ctx, depth, node, nodeBoundingBox, indices,
-				primCount, isLeftChild, badRefines);
+		if (primCount <= m_exactPrimThreshold) {
+			/* The sorted event lists of the node and its children need 
+			   about twice the size of the initial list */
+			size_t eventListSize = 2 * sizeof(EdgeEvent) 
+				* primCount * 2 * PointType::Dimension;
+			if (withinBudget(eventListSize))
+				return transitionToNLogN(ctx, depth, node, nodeBoundingBox, indices,
+					primCount, isLeftChild, badRefines);
+			ctx.budgetFallbacks++;
+		}
 
 		/* ==================================================================== */
 	    /*                              Binning                                 */
 	    /* ==================================================================== */
 
 		ctx.minMaxBins.setBoundingBox(tightBBox);
-		ctx.minMaxBins.bin(cast(), indices, primCount);
+		ctx.minMaxBins.bin(this, ctx, indices, primCount);
 
 		/* ==================================================================== */
 	    /*                        Split candidate search                        */
@@ -1611,7 +2223,7 @@ protected:
 	    /* ==================================================================== */
 
 		boost::tuple<BoundingBoxType, IndexType *, BoundingBoxType, IndexType *> partition = 
-			ctx.minMaxBins.partition(ctx, cast(), indices, bestSplit, 
+			ctx.minMaxBins.partition(this, ctx, indices, bestSplit, 
 				isLeftChild, m_traversalCost, m_queryCost);
 
 		/* ==================================================================== */
@@ -1625,6 +2237,7 @@ protected:
 		SizeType leafNodeCountBeforeSplit = ctx.leafNodeCount;
 		SizeType nonemptyLeafNodeCountBeforeSplit = ctx.nonemptyLeafNodeCount;
 		SizeType innerNodeCountBeforeSplit = ctx.innerNodeCount;
+		SizeType spawnedTasksBeforeSplit = ctx.spawnedTasks;
 
 		if (!node->initInnerNode(bestSplit.axis, bestSplit.pos, children-node)) {
 			m_indirectionLock.lock();
@@ -1638,18 +2251,25 @@ protected:
 		}
 		ctx.innerNodeCount++;
 
-		BoundingBoxType childBoundingBox(nodeBoundingBox);
-		childBoundingBox.max[bestSplit.axis] = bestSplit.pos;
+		BoundingBoxType leftNodeBoundingBox(nodeBoundingBox), 
+						rightNodeBoundingBox(nodeBoundingBox);
+		leftNodeBoundingBox.max[bestSplit.axis] = bestSplit.pos;
+		rightNodeBoundingBox.min[bestSplit.axis] = bestSplit.pos;
+
+		/* Let an idle thread build the right subtree */
+		bool spawnRight = shouldSpawn(bestSplit.numRight, 
+			bestSplit.numRight * sizeof(IndexType));
+		if (spawnRight)
+			spawnMinMaxTask(ctx, depth+1, children + 1, rightNodeBoundingBox, 
+				boost::get<2>(partition), boost::get<3>(partition),
+				bestSplit.numRight, badRefines);
 
 		float leftCost = buildTreeMinMax(ctx, depth+1, children,
-				childBoundingBox, boost::get<0>(partition), boost::get<1>(partition), 
+				leftNodeBoundingBox, boost::get<0>(partition), boost::get<1>(partition), 
 				bestSplit.numLeft, true, badRefines);
 
-		childBoundingBox.min[bestSplit.axis] = bestSplit.pos;
-		childBoundingBox.max[bestSplit.axis] = nodeBoundingBox.max[bestSplit.axis];
-
-		float rightCost = buildTreeMinMax(ctx, depth+1, children + 1,
-				childBoundingBox, boost::get<2>(partition), boost::get<3>(partition), 
+		float rightCost = spawnRight ? 0.0f : buildTreeMinMax(ctx, depth+1, children + 1,
+				rightNodeBoundingBox, boost::get<2>(partition), boost::get<3>(partition), 
 				bestSplit.numRight, false, badRefines);
 
 		TreeConstructionHeuristic tch(nodeBoundingBox);
@@ -1672,7 +2292,11 @@ protected:
 	    /*                           Final decision                             */
 	    /* ==================================================================== */
 
-		if (!m_retract || finalCost < primCount * m_queryCost) {
+		if (ctx.spawnedTasks != spawnedTasksBeforeSplit) {
+			/* Part of this subtree is built by another thread -- never
+			   tear it down (return a cost of -infinity) */
+			return -std::numeric_limits<float>::infinity();
+		} else if (!m_retract || finalCost < primCount * m_queryCost) {
 			return finalCost;
 		} else {
 			/* In the end, splitting didn't help to reduce the cost.
@@ -2016,8 +2640,8 @@ protected:
 			ctx.pruned += prunedLeft + prunedRight;
 
 			/* Sort the events from overlapping prims */
-			std::sort(newEventsLeftStart, newEventsLeftEnd, EdgeEventOrdering());
-			std::sort(newEventsRightStart, newEventsRightEnd, EdgeEventOrdering());
+			sortEvents(ctx, leftAlloc, newEventsLeftStart, newEventsLeftEnd);
+			sortEvents(ctx, rightAlloc, newEventsRightStart, newEventsRightEnd);
 
 			/* Merge the left list */
 			leftEventsEnd = std::merge(leftEventsTempStart, 
@@ -2072,6 +2696,7 @@ protected:
 		SizeType leafNodeCountBeforeSplit = ctx.leafNodeCount;
 		SizeType nonemptyLeafNodeCountBeforeSplit = ctx.nonemptyLeafNodeCount;
 		SizeType innerNodeCountBeforeSplit = ctx.innerNodeCount;
+		SizeType spawnedTasksBeforeSplit = ctx.spawnedTasks;
 
 		if (!node->initInnerNode(bestSplit.axis, bestSplit.pos, children-node)) {
 			m_indirectionLock.lock();
@@ -2085,11 +2710,19 @@ protected:
 		}
 		ctx.innerNodeCount++;
 
+		/* Let an idle thread build the right subtree */
+		bool spawnRight = shouldSpawn(bestSplit.numRight - prunedRight,
+			(rightEventsEnd - rightEventsStart) * sizeof(EdgeEvent));
+		if (spawnRight)
+			spawnSubtreeTask(ctx, depth+1, children+1, rightNodeBoundingBox, 
+				rightEventsStart, rightEventsEnd, 
+				bestSplit.numRight - prunedRight, badRefines);
+
 		float leftCost = buildTree(ctx, depth+1, children,
 				leftNodeBoundingBox, leftEventsStart, leftEventsEnd,
 				bestSplit.numLeft - prunedLeft, true, badRefines);
 
-		float rightCost = buildTree(ctx, depth+1, children+1,
+		float rightCost = spawnRight ? 0.0f : buildTree(ctx, depth+1, children+1,
 				rightNodeBoundingBox, rightEventsStart, rightEventsEnd,
 				bestSplit.numRight - prunedRight, false, badRefines);
 
@@ -2112,7 +2745,11 @@ protected:
 	    /*                           Final decision                             */
 	    /* ==================================================================== */
 		
-		if (!m_retract || finalCost < primCount * m_queryCost) {
+		if (ctx.spawnedTasks != spawnedTasksBeforeSplit) {
+			/* Part of this subtree is built by another thread -- never
+			   tear it down (return a cost of -infinity) */
+			return -std::numeric_limits<float>::infinity();
+		} else if (!m_retract || finalCost < primCount * m_queryCost) {
 			return finalCost;
 		} else {
 			/* In the end, splitting didn't help to reduce the SAH cost.
@@ -2137,13 +2774,12 @@ protected:
 	 */
 	struct MinMaxBins {
 		MinMaxBins(SizeType nBins) : m_binCount(nBins) {
-			m_minBins = new SizeType[m_binCount*PointType::Dimension];
-			m_maxBins = new SizeType[m_binCount*PointType::Dimension];
+			m_minBins = new SizeType[2*m_binCount*PointType::Dimension];
+			m_maxBins = m_minBins + m_binCount*PointType::Dimension;
 		}
 
 		~MinMaxBins() {
 			delete[] m_minBins;
-			delete[] m_maxBins;
 		}
 
 		/**
@@ -2159,28 +2795,60 @@ protected:
 		/**
 		 * \brief Run min-max binning
 		 *
-		 * \param derived Derived class to be used to determine the BoundingBox for
-		 *     a given list of primitives
+		 * Large primitive lists are split into chunks that are binned 
+		 * in parallel when the tree is built using multiple threads.
+		 *
+		 * \param tree kd-tree under construction
+		 * \param ctx Build context of the calling thread
 		 * \param indices Primitive indirection list
 		 * \param primCount Specifies the length of \a indices
 		 */
-		void bin(const Derived *derived, IndexType *indices, 
+		void bin(GenericKDTree *tree, BuildContext &ctx, IndexType *indices, 
 				SizeType primCount) {
+			const SizeType binTotal = 2 * m_binCount * PointType::Dimension;
+			const SizeType chunkCount = tree->getChunkCount(primCount);
 			m_primCount = primCount;
-			memset(m_minBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
-			memset(m_maxBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
+
+			if (chunkCount == 1) {
+				binChunk(tree->cast(), indices, m_minBins, 0, primCount, 0);
+				return;
+			}
+
+			std::vector<SizeType> chunkBins(binTotal * chunkCount);
+			tree->parallelFor(ctx, primCount, chunkCount, boost::bind(
+				&MinMaxBins::binChunk, this, tree->cast(), indices,
+				&chunkBins[0], _1, _2, _3));
+
+			memcpy(m_minBins, &chunkBins[0], sizeof(SizeType) * binTotal);
+			for (SizeType chunk=1; chunk<chunkCount; ++chunk) {
+				const SizeType *bins = &chunkBins[chunk * binTotal];
+				for (SizeType i=0; i<binTotal; ++i)
+					m_minBins[i] += bins[i];
+			}
+		}
+
+		/**
+		 * \brief Bin the primitives <tt>indices[start..end-1]</tt> into 
+		 * the \c chunk-th set of min and max bins stored in \c bins
+		 */
+		void binChunk(const Derived *derived, const IndexType *indices, SizeType *bins,
+				SizeType start, SizeType end, SizeType chunk) const {
+			const SizeType binCount = m_binCount * PointType::Dimension;
+			SizeType *minBins = bins + 2 * binCount * chunk,
+					 *maxBins = minBins + binCount;
+			memset(minBins, 0, sizeof(SizeType) * 2 * binCount);
 			const int64_t maxBin = m_binCount-1;
 
-			for (SizeType i=0; i<m_primCount; ++i) {
+			for (SizeType i=start; i<end; ++i) {
 				const BoundingBoxType bbox = derived->getBoundingBox(indices[i]);
 				for (int axis=0; axis<PointType::Dimension; ++axis) {
 					int64_t minIdx = (int64_t) ((bbox.min[axis] - m_bbox.min[axis]) 
 							* m_invBinSize[axis]);
 					int64_t maxIdx = (int64_t) ((bbox.max[axis] - m_bbox.min[axis]) 
 							* m_invBinSize[axis]);
-					m_maxBins[axis * m_binCount 
+					maxBins[axis * m_binCount 
 						+ std::max((int64_t) 0, std::min(maxIdx, maxBin))]++;
-					m_minBins[axis * m_binCount 
+					minBins[axis * m_binCount 
 						+ std::max((int64_t) 0, std::min(minIdx, maxBin))]++;
 				}
 			}
@@ -2302,9 +2970,10 @@ protected:
 		 * primitive lists.
 		 */
 		boost::tuple<BoundingBoxType, IndexType *, BoundingBoxType, IndexType *> partition(
-				BuildContext &ctx, const Derived *derived, IndexType *primIndices,
+				GenericKDTree *tree, BuildContext &ctx, IndexType *primIndices,
 				SplitCandidate &split, bool isLeftChild, float traversalCost, 
 				float queryCost) {
+			const Derived *derived = tree->cast();
 			const float splitPos = split.pos;
 			const int axis = split.axis;
 			SizeType numLeft = 0, numRight = 0;
@@ -2321,22 +2990,56 @@ protected:
 				rightIndices = primIndices;
 			}
 
-			for (SizeType i=0; i<m_primCount; ++i) {
-				const IndexType primIndex = primIndices[i];
-				const BoundingBoxType bbox = derived->getBoundingBox(primIndex);
-
-				if (bbox.max[axis] <= splitPos) {
-					leftBounds.expandBy(bbox);
-					leftIndices[numLeft++] = primIndex;
-				} else if (bbox.min[axis] > splitPos) {
-					rightBounds.expandBy(bbox);
-					rightIndices[numRight++] = primIndex;
-				} else {
-					leftBounds.expandBy(bbox);
-					rightBounds.expandBy(bbox);
-					leftIndices[numLeft++] = primIndex;
-					rightIndices[numRight++] = primIndex;
+			const SizeType chunkCount = tree->getChunkCount(m_primCount, sizeof(IndexType));
+			if (chunkCount == 1) {
+				for (SizeType i=0; i<m_primCount; ++i) {
+					const IndexType primIndex = primIndices[i];
+					const BoundingBoxType bbox = derived->getBoundingBox(primIndex);
+
+					if (bbox.max[axis] <= splitPos) {
+						leftBounds.expandBy(bbox);
+						leftIndices[numLeft++] = primIndex;
+					} else if (bbox.min[axis] > splitPos) {
+						rightBounds.expandBy(bbox);
+						rightIndices[numRight++] = primIndex;
+					} else {
+						leftBounds.expandBy(bbox);
+						rightBounds.expandBy(bbox);
+						leftIndices[numLeft++] = primIndex;
+						rightIndices[numRight++] = primIndex;
+					}
+				}
+			} else {
+				/* Parallel version: first count the primitives of each chunk 
+				   (working on a copy, since one of the output lists overlaps 
+				   the input), then write them to their final positions */
+				std::vector<IndexType> inputCopy(m_primCount);
+				std::vector<PartitionChunk> chunks(chunkCount);
+				PartitionJob job;
+				job.derived = derived;
+				job.input = primIndices;
+				job.inputCopy = &inputCopy[0];
+				job.leftIndices = leftIndices;
+				job.rightIndices = rightIndices;
+				job.splitPos = splitPos;
+				job.axis = axis;
+				job.chunks = &chunks[0];
+
+				tree->parallelFor(ctx, m_primCount, chunkCount, boost::bind(
+					&MinMaxBins::classifyChunk, this, &job, _1, _2, _3));
+
+				for (SizeType i=0; i<chunkCount; ++i) {
+					PartitionChunk &chunk = chunks[i];
+					leftBounds.expandBy(chunk.leftBounds);
+					rightBounds.expandBy(chunk.rightBounds);
+					chunk.leftOffset = numLeft;
+					chunk.rightOffset = numRight;
+					numLeft += chunk.numLeft;
+					numRight += chunk.numRight;
 				}
+
+				tree->parallelFor(ctx, m_primCount, chunkCount, boost::bind(
+					&MinMaxBins::distributeChunk, this, &job, _1, _2, _3));
 			}
 
 			leftBounds.clip(m_bbox);
@@ -2385,6 +3088,79 @@ protected:
 			return boost::make_tuple(leftBounds, leftIndices,
 					rightBounds, rightIndices);
 		}
+
+		/// Per-chunk results of a parallel \ref partition() step
+		struct PartitionChunk {
+			SizeType numLeft, numRight;
+			SizeType leftOffset, rightOffset;
+			BoundingBoxType leftBounds, rightBounds;
+		};
+
+		/// Shared arguments of a parallel \ref partition() step
+		struct PartitionJob {
+			const Derived *derived;
+			const IndexType *input;
+			IndexType *inputCopy;
+			IndexType *leftIndices, *rightIndices;
+			float splitPos;
+			int axis;
+			PartitionChunk *chunks;
+		};
+
+		/// Count and bound the primitives of a chunk on either side of the split
+		void classifyChunk(PartitionJob *job, SizeType start, SizeType end, SizeType index) const {
+			PartitionChunk &chunk = job->chunks[index];
+			const int axis = job->axis;
+			SizeType numLeft = 0, numRight = 0;
+			BoundingBoxType leftBounds, rightBounds;
+
+			for (SizeType i=start; i<end; ++i) {
+				const IndexType primIndex = job->input[i];
+				const BoundingBoxType bbox = job->derived->getBoundingBox(primIndex);
+				job->inputCopy[i] = primIndex;
+
+				if (bbox.max[axis] <= job->splitPos) {
+					leftBounds.expandBy(bbox);
+					numLeft++;
+				} else if (bbox.min[axis] > job->splitPos) {
+					rightBounds.expandBy(bbox);
+					numRight++;
+				} else {
+					leftBounds.expandBy(bbox);
+					rightBounds.expandBy(bbox);
+					numLeft++;
+					numRight++;
+				}
+			}
+
+			chunk.numLeft = numLeft;
+			chunk.numRight = numRight;
+			chunk.leftBounds = leftBounds;
+			chunk.rightBounds = rightBounds;
+		}
+
+		/// Write the primitives of a chunk to the left and right index lists
+		void distributeChunk(PartitionJob *job, SizeType start, SizeType end, SizeType index) const {
+			const PartitionChunk &chunk = job->chunks[index];
+			const int axis = job->axis;
+			IndexType *left = job->leftIndices + chunk.leftOffset,
+					  *right = job->rightIndices + chunk.rightOffset;
+
+			for (SizeType i=start; i<end; ++i) {
+				const IndexType primIndex = job->inputCopy[i];
+				const BoundingBoxType bbox = job->derived->getBoundingBox(primIndex);
+
+				if (bbox.max[axis] <= job->splitPos) {
+					*left++ = primIndex;
+				} else if (bbox.min[axis] > job->splitPos) {
+					*right++ = primIndex;
+				} else {
+					*left++ = primIndex;
+					*right++ = primIndex;
+				}
+			}
+		}
+
 	private:
 		SizeType *m_minBins;
 		SizeType *m_maxBins;
@@ -2408,10 +3184,15 @@ protected:
 	SizeType m_minMaxBins;
 	SizeType m_nodeCount;
 	SizeType m_indexCount;
+	float m_heuristicCost;
+	qint64 m_buildTime;
+	SizeType m_indirectionCount;
 	std::vector<TreeBuilder *> m_builders;
 	std::vector<KDNode *> m_indirections;
 	QMutex m_indirectionLock;
-	BuildInterface m_interface;
+	BuildScheduler m_scheduler;
+	size_t m_maxBuildMemory;
+	BuildMemoryTracker m_memoryTracker;
 };
 
 /**
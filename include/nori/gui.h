@@ -24,26 +24,104 @@
 
 class PreviewWidget;
 
+NORI_NAMESPACE_BEGIN
+class Scene;
+class Camera;
+class RenderJob;
+class RenderEngine;
+NORI_NAMESPACE_END
+
 /**
  * \brief Implements a simple preview window for watching
  * renderings as they progress
+ *
+ * The camera can be moved interactively: dragging with the left mouse
+ * button orbits around the point in the center of the view, dragging
+ * with the right button (or with Shift held down) pans, and the mouse
+ * wheel moves towards or away from that point. Every change cancels the blocks in flight and starts
+ * over using a perspective camera with the new view: first with one
+ * sample per pixel at a quarter of the resolution, then progressively
+ * (one sample per pixel and pass) at the full resolution, up to the 
+ * scene's sample count. The scene, including its acceleration data 
+ * structure, is reused.
+ *
+ * Images that are larger than the screen are shown downsampled; Ctrl
+ * and the mouse wheel zoom into them, and dragging with Ctrl held down
+ * pans.
+ *
+ * The \a Stop button, and closing the window, stop the rendering after
+ * the blocks in flight (see \ref nori::RenderJob::cancel()). The part of
+ * the image that was rendered up to then is saved as usual.
  */
 class NoriWindow : public QWidget {
 	Q_OBJECT
 public:
-	NoriWindow(const nori::ImageBlock *output);
+	/**
+	 * \brief Create a window that displays the given job
+	 *
+	 * The job must have been submitted to \c engine. It is cancelled
+	 * when the camera is moved, and must outlive the window.
+	 */
+	NoriWindow(nori::RenderEngine *engine, nori::RenderJob *job);
+
+	/// Cancel and release the jobs started by camera changes
+	virtual ~NoriWindow();
 
 	inline void startRefresh() { m_refreshTimer->start(); }
 	inline void stopRefresh() { m_refreshTimer->stop(); }
 
+	/// Was the camera moved (i.e. the original job cancelled)?
+	inline bool isNavigated() const { return m_navigated; }
+
+	/**
+	 * \brief Change the view in response to a mouse drag (in pixels)
+	 *
+	 * \param pan
+	 *     Move the camera sideways instead of orbiting
+	 */
+	void drag(int dx, int dy, bool pan);
+
+	/// Move towards (positive) or away from the center of the view
+	void zoom(int delta);
+
 private slots:
 	void setExposure(int value);
 	void refresh();
+	void restart();
+	void stop();
+
+protected:
+	/// Stop rendering when the window is closed
+	void closeEvent(QCloseEvent *event);
 
 private:
+	/// Cancel the jobs started by camera changes, wait for them and release them
+	void releaseJobs();
+
+	/// Create a perspective camera with the current view and the given resolution
+	nori::Camera *createCamera(const nori::Vector2i &size) const;
+
 	PreviewWidget *m_preview;
 	QSlider *m_exposure;
-	QTimer *m_refreshTimer;
+	QPushButton *m_stop;
+	QTimer *m_refreshTimer, *m_restartTimer;
+
+	nori::RenderEngine *m_engine;
+	nori::RenderJob *m_job;
+	const nori::Scene *m_scene;
+	bool m_navigated;
+
+	/* The current view: position, center of the view, up 
+	   direction, horizontal field of view, and resolution */
+	nori::Point3f m_origin, m_target;
+	nori::Vector3f m_up;
+	float m_fov;
+	nori::Vector2i m_size;
+
+	/* Jobs started by the last camera change (low resolution 
+	   preview and progressive rendering) and their cameras */
+	nori::RenderJob *m_previewJob, *m_fullJob;
+	nori::Camera *m_previewCamera, *m_fullCamera;
 };
 
 #endif /* __GUI_H */
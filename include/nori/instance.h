@@ -0,0 +1,342 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__INSTANCE_H)
+#define __INSTANCE_H
+
+#include <nori/accel.h>
+#include <nori/transform.h>
+
+/// Maximum depth of the top-level hierarchy over instances
+#define NORI_INSTANCE_MAXDEPTH 64
+
+/// Maximum number of levels of detail of an instance
+#define NORI_INSTANCE_MAX_LODS 8
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Places a shared triangle mesh into the scene using a transformation
+ *
+ * The first instance of a mesh declares it as a nested element with an
+ * \c id attribute. Further instances refer to the same geometry using a 
+ * <tt>&lt;ref id=".."/&gt;</tt> element, e.g.
+ * \code
+ * <instance>
+ *     <mesh type="obj" id="chair"> .. </mesh>
+ *     <transform name="toWorld"> .. </transform>
+ * </instance>
+ * <instance>
+ *     <ref id="chair"/>
+ *     <transform name="toWorld"> .. </transform>
+ * </instance>
+ * \endcode
+ * The mesh is stored (and its acceleration data structure is built) only
+ * once, regardless of how many times it is instantiated. Only meshes that
+ * are nested inside an instance can be named and referenced.
+ *
+ * Alternatively, the mesh can be declared in a separate scene file (as
+ * the only object of its <tt>&lt;scene&gt;</tt>) and included by every
+ * instance using <tt>&lt;include filename=".."/&gt;</tt>. All instances
+ * that include the same file share one mesh (see \ref loadScene()).
+ *
+ * An instance moves when a second transformation \c toWorldEnd is given:
+ * \c toWorld then applies at time 0 and \c toWorldEnd at time 1 (see
+ * \ref TRay::time), and the two matrices are linearly interpolated in
+ * between (times outside of [0, 1] are clamped). Every vertex thus moves
+ * along a straight line, which keeps the interpolated bounding boxes of
+ * the \ref InstanceAccelerator conservative. Rotations should therefore
+ * be small between the two keys.
+ *
+ * Further meshes nested in the instance form a chain of geometric levels
+ * of detail: pre-simplified versions of the first mesh, from fine to
+ * coarse, each of which receives its own bottom-level structure.
+ * \code
+ * <instance>
+ *     <mesh type="obj" id="tree"> .. </mesh>
+ *     <mesh type="obj" id="tree-lod1"> .. </mesh>
+ *     <mesh type="obj" id="tree-lod2"> .. </mesh>
+ * </instance>
+ * \endcode
+ * Every level has its own material, which should usually match that of
+ * the first mesh. A level is used where its triangles are no wider than \c lodThreshold
+ * times the footprint of a pixel (the width that the rays of a pixel
+ * cover, see \ref selectLOD()). By default (<tt>lodSelection = "camera"</tt>),
+ * the level is chosen once for the whole instance from the distance of
+ * its bounding box to the camera, so that all rays see the same geometry.
+ * With <tt>lodSelection = "footprint"</tt>, rays that carry differentials
+ * (i.e. camera rays) choose it from their own footprint where they enter
+ * the instance; all other rays use the camera's choice, which may
+ * differ and cause slight self-intersection artifacts.
+ */
+class Instance : public NoriObject {
+public:
+	Instance(const PropertyList &propList);
+
+	/// Register the referenced mesh (or one of its levels of detail)
+	void addChild(NoriObject *child);
+
+	/// Compute the world-space bounding box of the instance
+	void activate();
+
+	/// Return the shared mesh referenced by this instance
+	inline const Mesh *getMesh() const { return m_lods[0]; }
+
+	/// Return the shared mesh referenced by this instance
+	inline Mesh *getMesh() { return m_lods[0]; }
+
+	/// Return the number of levels of detail (including the full-resolution mesh)
+	inline int getLODCount() const { return (int) m_lods.size(); }
+
+	/// Return the mesh of a level of detail (level 0 is \ref getMesh())
+	inline Mesh *getLOD(int level) const { return m_lods[level]; }
+
+	/**
+	 * \brief Return the coarsest level of detail whose average world-space
+	 * edge length is at most \c lodThreshold times the given footprint width
+	 */
+	int selectLOD(float footprint) const;
+
+	/**
+	 * \brief Choose the level of detail for rays without differentials
+	 * (and for all rays unless <tt>lodSelection = "footprint"</tt>)
+	 *
+	 * \param origin
+	 *     Position of the camera
+	 * \param pixelAngle
+	 *     Angle covered by a pixel, i.e. the growth of its footprint
+	 *     per unit distance (zero selects the full resolution)
+	 */
+	void selectCameraLOD(const Point3f &origin, float pixelAngle);
+
+	/// Return the level of detail chosen by \ref selectCameraLOD()
+	inline int getCameraLOD() const { return m_cameraLOD; }
+
+	/// Do rays with differentials choose their own level of detail?
+	inline bool hasFootprintLOD() const { return m_footprintLOD && m_lods.size() > 1; }
+
+	/// Return the transformation from object to world coordinates (at time 0)
+	inline const Transform &getToWorld() const { return m_toWorld; }
+
+	/// Return the transformation from world to object coordinates (at time 0)
+	inline const Transform &getToLocal() const { return m_toLocal; }
+
+	/// Does the instance move (i.e. was \c toWorldEnd specified)?
+	inline bool isMoving() const { return m_moving; }
+
+	/// Return the transformation from object to world coordinates at the given time
+	Transform getToWorld(float time) const;
+
+	/// Return the transformation from world to object coordinates at the given time
+	Transform getToLocal(float time) const;
+
+	/// Return a world-space bounding box of the instance (over its whole motion)
+	inline const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/**
+	 * \brief Return the world-space bounding box of the instance at
+	 * time 0 (<tt>key = 0</tt>) or time 1 (<tt>key = 1</tt>)
+	 */
+	inline const BoundingBox3f &getKeyBoundingBox(int key) const { return m_keyBBox[key]; }
+
+	/// Return a human-readable summary of this instance
+	QString toString() const;
+
+	EClassType getClassType() const { return EInstance; }
+private:
+	std::vector<Mesh *> m_lods;
+	/// Average world-space edge length of each level of detail
+	std::vector<float> m_lodEdgeLength;
+	float m_lodThreshold;
+	bool m_footprintLOD;
+	int m_cameraLOD;
+	Transform m_toWorld;
+	Transform m_toLocal;
+	Transform m_toWorldEnd;
+	bool m_moving;
+	BoundingBox3f m_bbox;
+	BoundingBox3f m_keyBBox[2];
+};
+
+/**
+ * \brief Two-level acceleration data structure
+ *
+ * Rays are first intersected against a flat acceleration data structure
+ * containing all ordinary meshes of a scene, and then against a small 
+ * bounding volume hierarchy over the instances. Rays that reach an 
+ * instance are transformed into its local coordinate system and traced 
+ * against the bottom-level structure of the shared mesh. The resulting
+ * intersection records are transformed back into world space.
+ *
+ * The top-level hierarchy is motion-aware: each node stores the bounds of
+ * its instances at time 0 and time 1, which are interpolated to the time
+ * of a ray. Since the vertices of moving instances follow straight lines,
+ * the result bounds their positions at that time, and motion blur costs
+ * little more than tracing a static scene.
+ *
+ * Instances with several levels of detail have a bottom-level structure
+ * per level; the one that a ray is traced against is chosen when the ray
+ * reaches the instance (see \ref Instance).
+ */
+class InstanceAccelerator : public Accelerator {
+public:
+	/**
+	 * \brief Create a two-level structure on top of an acceleration 
+	 * data structure for the non-instanced geometry. 
+	 *
+	 * Takes ownership of \c flat.
+	 */
+	InstanceAccelerator(Accelerator *flat);
+
+	/// Release all memory (including the bottom-level structures)
+	virtual ~InstanceAccelerator();
+
+	/**
+	 * \brief Transfer ownership of a bottom-level acceleration data 
+	 * structure (which must already be built)
+	 */
+	void addBottomLevel(Accelerator *accel);
+
+	/**
+	 * \brief Register an instance along with the bottom-level structures
+	 * of its levels of detail (\ref Instance::getLODCount() entries)
+	 */
+	void addInstance(const Instance *instance, const Accelerator * const *accels);
+
+	/// Build the flat structure and the top-level hierarchy
+	void build();
+
+	/**
+	 * \brief Update the flat and bottom-level structures after their
+	 * meshes have changed, then rebuild the top-level hierarchy
+	 *
+	 * The instance bounding boxes must be up to date (see 
+	 * \ref Instance::activate()).
+	 *
+	 * \return \c true if all of the underlying structures were
+	 *    updated incrementally
+	 */
+	bool update();
+
+	/// Intersect a ray against all geometry (see \ref Accelerator::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its, 
+		bool shadowRay = false) const;
+
+	/// Occlusion query against all geometry (see \ref Accelerator::rayOccluded())
+	bool rayOccluded(const Ray3f &ray) const;
+
+	/// Return an axis-aligned bounding box containing all geometry
+	inline const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/// Return the memory used by all levels of the data structure
+	size_t getMemoryUsage() const;
+
+	/// Report the memory of all levels (the top level counts as \c accel)
+	void reportMemory(MemoryReport &report) const;
+
+	/// Return the time spent to build all levels in milliseconds
+	qint64 getBuildTime() const;
+
+	/// Return the name of this acceleration data structure
+	QString getName() const;
+
+protected:
+	/// Node of the top-level hierarchy
+	struct InstanceNode {
+		/// Bounding box of all instances below this node (at time 0)
+		BoundingBox3f bbox;
+		/// Bounding box of all instances below this node at time 1
+		BoundingBox3f bboxEnd;
+		/**
+		 * \brief For inner nodes, the index of the second child (the first
+		 * child immediately follows its parent). For leaves, the index
+		 * of the first entry in \ref m_instances
+		 */
+		uint32_t offset;
+		/// Number of instances (leaf) or zero (inner node)
+		uint32_t count;
+	};
+
+	/// An instance together with the bottom-level structures of its levels of detail
+	struct InstanceRecord {
+		const Instance *instance;
+		/// Index of the structure of level 0 in \ref m_lodAccels
+		uint32_t lodOffset;
+	};
+
+	/// Construct the top-level hierarchy over all instances
+	void buildTopLevel();
+
+	/// Recursively construct the top-level hierarchy over the given range of instances
+	uint32_t buildRecursive(uint32_t start, uint32_t end, int depth);
+
+	/**
+	 * \brief Return the bottom-level structure that a ray is traced against
+	 *
+	 * Rays with differentials may choose the level of detail from their
+	 * footprint where they enter the instance's bounding box; all other
+	 * rays use the level chosen for the camera.
+	 */
+	inline const Accelerator *getAccelerator(const InstanceRecord &record, const Ray3f &ray) const {
+		const Instance *instance = record.instance;
+		int level = instance->getCameraLOD();
+		if (ray.hasDifferentials && instance->hasFootprintLOD()) {
+			float nearT, farT;
+			if (instance->getBoundingBox().rayIntersect(ray, nearT, farT)) {
+				float t = std::max(nearT, ray.mint);
+				float width = std::max(
+					(ray.rxOrigin - ray.o).norm() + t * (ray.rxDirection - ray.d).norm(),
+					(ray.ryOrigin - ray.o).norm() + t * (ray.ryDirection - ray.d).norm());
+				level = instance->selectLOD(width);
+			}
+		}
+		return m_lodAccels[record.lodOffset + level];
+	}
+
+	/// Intersect a ray against the bounding box of a node at the ray's time
+	inline bool rayIntersectNode(const InstanceNode &node, const Ray3f &ray) const {
+		float nearT, farT;
+		bool hit;
+		if (m_moving) {
+			float t = std::min(std::max(ray.time, 0.0f), 1.0f);
+			BoundingBox3f bbox;
+			bbox.min = node.bbox.min * (1 - t) + node.bboxEnd.min * t;
+			bbox.max = node.bbox.max * (1 - t) + node.bboxEnd.max * t;
+			hit = bbox.rayIntersect(ray, nearT, farT);
+		} else {
+			hit = node.bbox.rayIntersect(ray, nearT, farT);
+		}
+		return hit && nearT <= ray.maxt && farT >= ray.mint;
+	}
+
+private:
+	Accelerator *m_flat;
+	std::vector<Accelerator *> m_bottomLevel;
+	std::vector<InstanceRecord> m_instances;
+	/// Bottom-level structures of the levels of detail of all instances
+	std::vector<const Accelerator *> m_lodAccels;
+	std::vector<InstanceNode> m_nodes;
+	BoundingBox3f m_bbox;
+	qint64 m_buildTime;
+	/// Do any of the instances move?
+	bool m_moving;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __INSTANCE_H */
@@ -19,12 +19,172 @@
 #if !defined(__INTEGRATOR_H)
 #define __INTEGRATOR_H
 
-#include <nori/object.h>
+#include <nori/scene.h>
+#include <nori/sampler.h>
 #include <nori/dpdf.h>
 #include <nori/frame.h>
+#include <nori/aov.h>
+#include <nori/pathstats.h>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief First intersection of the camera ray of a pixel (see 
+ * \ref RenderContext::rayIntersect())
+ */
+struct PrimaryHit {
+	/// Origin and direction of the ray
+	Point3f o;
+	Vector3f d;
+	/// The hit record (see \ref Intersection)
+	float t;
+	const Mesh *mesh;
+	uint32_t primIndex;
+	Point2f bary;
+	const Transform *toWorldTrafo;
+	/// Does the entry hold a ray? Did it hit anything?
+	bool valid, hit;
+
+	inline PrimaryHit() : valid(false), hit(false) { }
+};
+
+/**
+ * \brief Per-thread state that is passed to \ref Integrator::Li()
+ *
+ * A render thread creates one context per scene and reuses it for all
+ * of its samples. Besides the thread's sample generator and scratch
+ * memory, it caches scene data that integrators would otherwise query
+ * for every sample, and it collects statistics without any 
+ * synchronization.
+ */
+struct RenderContext {
+	/// The scene being rendered
+	const Scene *scene;
+	/// Camera used by the rendering
+	const Camera *camera;
+	/// The scene's medium (or \c NULL)
+	const Medium *medium;
+	/// The thread's sample generator
+	Sampler *sampler;
+	/// The thread's arena for temporary allocations (see \ref Sampler::getArena())
+	MemoryArena *arena;
+	/// Bounding box of the scene
+	BoundingBox3f sceneBounds;
+	/// Length of the diagonal of \ref sceneBounds
+	float sceneDiameter;
+
+	/**
+	 * \brief When not \c NULL, the integrator describes the first 
+	 * surface seen by the camera ray here (see \ref AOVRecord)
+	 *
+	 * The batched version of \ref Integrator::Li() receives one
+	 * record per ray. The records are cleared by the caller.
+	 */
+	AOVRecord *aov;
+
+	/**
+	 * \brief Image that receives the contributions of light paths
+	 * (see \ref ImageBlock::putSplat()) when the integrator uses 
+	 * splatting, and \c NULL otherwise
+	 */
+	ImageBlock *splats;
+
+	/**
+	 * \brief Position of the current sample on the image (only set by
+	 * the render threads when the integrator isn't in wavefront mode)
+	 */
+	Point2f pixel;
+
+	/**
+	 * \brief Pixel that the current sample belongs to (set along with
+	 * \ref pixel; samples of an importance sampled filter can lie outside
+	 * of it). Each pixel is rendered by one thread at a time.
+	 */
+	Point2i pixelIndex;
+
+	/**
+	 * \brief Cache entry of the pixel of the current sample, which serves
+	 * the first query of \ref rayIntersect() (or \c NULL)
+	 */
+	PrimaryHit *primaryHit;
+
+	/**
+	 * \brief Traversal state shared by the camera rays of the current
+	 * block, which serves the first query of \ref rayIntersect() (or \c NULL)
+	 */
+	const Accelerator::CameraRaySeed *cameraSeed;
+
+	/// Number of rays traced so far (to be counted by the integrator)
+	uint64_t rayCount;
+	/// Number of shadow rays traced so far (to be counted by the integrator)
+	uint64_t shadowRayCount;
+
+	/**
+	 * \brief The thread's path statistics, which the integrator may record
+	 * into (\c NULL unless enabled with the \c pathStatistics property
+	 * of the scene, see \ref PathStatistics)
+	 */
+	PathStatistics *pathStats;
+
+	/// Create a context for rendering \c scene using the given sampler
+	inline RenderContext(const Scene *scene, Sampler *sampler, 
+			const Camera *camera = NULL)
+		: scene(scene), camera(camera ? camera : scene->getCamera()),
+		  medium(scene->getMedium()), sampler(sampler), 
+		  arena(&sampler->getArena()), sceneBounds(scene->getBoundingBox()),
+		  sceneDiameter(sceneBounds.getExtents().norm()), aov(NULL), splats(NULL), pixel(0.0f, 0.0f), pixelIndex(-1, -1), primaryHit(NULL), cameraSeed(NULL), rayCount(0), 
+		  shadowRayCount(0), pathStats(NULL) { }
+
+	/// Reset the statistics counters
+	inline void resetStatistics() { rayCount = shadowRayCount = 0; }
+
+	/**
+	 * \brief Intersect a ray against the scene (see \ref Scene::rayIntersect())
+	 *
+	 * Integrators use this for the camera ray, i.e. the first query of
+	 * a path. When the render thread provides a \ref primaryHit entry, 
+	 * a ray that equals the cached one reuses its hit record instead of
+	 * traversing the scene; any other ray replaces the entry. Camera 
+	 * rays repeat when the pixel samples aren't jittered and the camera
+	 * has neither depth of field nor motion blur. Otherwise, a camera 
+	 * ray is traced starting from the \ref cameraSeed (if any). Later
+	 * queries of the path always trace the ray from scratch.
+	 */
+	inline bool rayIntersect(const Ray3f &ray, Intersection &its) {
+		PrimaryHit *cached = primaryHit;
+		const Accelerator::CameraRaySeed *seed = cameraSeed;
+		primaryHit = NULL;
+		cameraSeed = NULL;
+		if (!cached)
+			return seed ? scene->rayIntersect(ray, its, *seed) : scene->rayIntersect(ray, its);
+
+		if (cached->valid && cached->o == ray.o && cached->d == ray.d) {
+			if (!cached->hit)
+				return false;
+			its = Intersection();
+			its.t = cached->t;
+			its.mesh = cached->mesh;
+			its.primIndex = cached->primIndex;
+			its.bary = cached->bary;
+			its.toWorldTrafo = cached->toWorldTrafo;
+			return true;
+		}
+
+		cached->hit = seed ? scene->rayIntersect(ray, its, *seed) : scene->rayIntersect(ray, its);
+		cached->valid = true;
+		cached->o = ray.o;
+		cached->d = ray.d;
+		if (cached->hit) {
+			cached->t = its.t;
+			cached->mesh = its.mesh;
+			cached->primIndex = its.primIndex;
+			cached->bary = its.bary;
+			cached->toWorldTrafo = its.toWorldTrafo;
+		}
+		return cached->hit;
+	}
+};
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -42,22 +202,97 @@ public:
 	/**
 	 * \brief Sample the incident radiance along a ray
 	 *
-	 * \param scene
-	 *    A pointer to the underlying scene
-	 * \param sampler
-	 *    A pointer to a sample generator
+	 * \param context
+	 *    Per-thread state (scene, sample generator, scratch memory, 
+	 *    and statistics)
 	 * \param ray
 	 *    The ray in question
 	 * \return
 	 *    A (usually) unbiased estimate of the radiance in this direction
 	 */
-	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
+	virtual Color3f Li(RenderContext &context, const Ray3f &ray) const = 0;
+
+	/**
+	 * \brief Sample the incident radiance along a batch of rays
+	 *
+	 * This is used by \ref RenderWorker when the integrator runs in 
+	 * wavefront mode (see \ref isWavefront()). The default implementation
+	 * simply calls \ref Li() for each ray. Integrators can override it to
+	 * trace the secondary rays of all paths in the batch together, in an 
+	 * order that improves the coherence of the traversal (see \ref sortRays()).
+	 *
+	 * \param context
+	 *    Per-thread state (scene, sample generator, scratch memory, 
+	 *    and statistics)
+	 * \param rays
+	 *    An array of \c count rays
+	 * \param result
+	 *    Used to return the radiance estimate of each ray
+	 * \param count
+	 *    The number of rays
+	 */
+	virtual void Li(RenderContext &context, const Ray3f *rays, 
+			Color3f *result, uint32_t count) const {
+		AOVRecord *aovs = context.aov;
+		for (uint32_t i=0; i<count; ++i) {
+			if (aovs)
+				context.aov = aovs + i;
+			result[i] = Li(context, rays[i]);
+		}
+		context.aov = aovs;
+	}
+
+	/**
+	 * \brief Should the render threads pass batches of rays to the 
+	 * integrator (instead of calling \ref Li() once per pixel sample)?
+	 */
+	inline bool isWavefront() const { return m_wavefront; }
+
+	/**
+	 * \brief Does the integrator splat contributions to arbitrary pixels
+	 * (see \ref RenderContext::splats)?
+	 *
+	 * The splatted image is added to the output when the job is done,
+	 * scaled as if every pixel of the camera's image had received the 
+	 * same number of samples.
+	 */
+	inline bool usesSplatting() const { return m_splatting; }
+
+	/**
+	 * \brief Does the integrator need to prepare every pass of a
+	 * progressive rendering (see \ref preprocess())?
+	 *
+	 * Such jobs are always rendered progressively (one sample per pixel
+	 * and pass, unless the scene specifies otherwise), and they don't
+	 * overlap with other jobs of the render engine.
+	 */
+	inline bool usesPasses() const { return m_passes; }
+
+	/**
+	 * \brief Prepare a pass of a progressive rendering (e.g. trace a 
+	 * new set of photons)
+	 *
+	 * Only called for integrators that \ref usesPasses(): once before 
+	 * the first pass of a job (which can be a later one when resuming
+	 * from a checkpoint) and then between passes. No block is in flight
+	 * during the call, so the integrator may replace any state that
+	 * \ref Li() reads. The render threads wait in the meantime, hence 
+	 * expensive work should use threads of its own.
+	 */
+	virtual void preprocess(const Scene *scene, int pass) { }
 
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
 	 * provided by this instance
 	 * */
 	EClassType getClassType() const { return EIntegrator; }
+protected:
+	/// Create an integrator that processes one pixel sample at a time
+	Integrator() : m_wavefront(false), m_splatting(false), m_passes(false) { }
+protected:
+	bool m_wavefront;
+	bool m_splatting;
+	bool m_passes;
 };
 
 NORI_NAMESPACE_END
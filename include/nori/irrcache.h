@@ -0,0 +1,170 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__IRRCACHE_H)
+#define __IRRCACHE_H
+
+#include <nori/bbox.h>
+#include <nori/color.h>
+#include <nori/frame.h>
+#include <QReadWriteLock>
+
+/// Maximum depth of the octree of an \ref IrradianceCache
+#define NORI_IRRCACHE_MAX_DEPTH 16
+
+NORI_NAMESPACE_BEGIN
+
+/// A sparse sample of the irradiance that is stored in an \ref IrradianceCache
+struct IrradianceRecord {
+	/// Position of the sample
+	Point3f p;
+	/// Surface normal at the sample
+	Normal3f n;
+	/// Irradiance at the sample
+	Color3f E;
+	/// Rotational gradient of each color channel
+	Vector3f rotGrad[3];
+	/// Translational gradient of each color channel
+	Vector3f transGrad[3];
+	/// Harmonic mean distance to the surrounding surfaces (clamped)
+	float R;
+};
+
+/**
+ * \brief Irradiance cache (Ward et al.) with gradients (Ward and
+ * Heckbert) that is shared by all render threads
+ *
+ * Integrators compute the irradiance only at sparse points using a
+ * stratified set of hemispherical rays (see \ref sampleDirection() and
+ * \ref addRecord()), and interpolate it everywhere else using
+ * \ref lookup(). A record is used at a point if its error estimate
+ *
+ * \f[
+ *     \epsilon_i(p, n) = \frac{\|p - p_i\|}{R_i} + \sqrt{1 - n \cdot n_i}
+ * \f]
+ *
+ * stays below the \c error threshold, and the records are blended with
+ * weights \f$1 / \epsilon_i\f$ after extrapolating them along their
+ * rotational and translational gradients. Records whose hemisphere
+ * lies behind the point are ignored.
+ *
+ * The records are kept in an octree over the scene: a record is stored
+ * in the nodes that overlap its sphere of influence and are not much
+ * smaller than it, so that a lookup only checks the records along the
+ * path from the root to the leaf containing the query point. Lookups
+ * take a shared lock, and insertions an exclusive one.
+ */
+class IrradianceCache {
+public:
+	/**
+	 * \brief Create an empty cache
+	 *
+	 * \param bbox
+	 *     Region that contains all records (typically the bounds of the scene)
+	 * \param error
+	 *     Error threshold of the interpolation (smaller values create
+	 *     more records)
+	 * \param sampleCount
+	 *     Approximate number of hemispherical rays per record
+	 * \param minSpacing
+	 *     Lower bound of the record radius \f$R_i\f$
+	 * \param maxSpacing
+	 *     Upper bound of the record radius \f$R_i\f$
+	 */
+	IrradianceCache(const BoundingBox3f &bbox, float error, int sampleCount,
+		float minSpacing, float maxSpacing);
+
+	/// Release all memory
+	~IrradianceCache();
+
+	/**
+	 * \brief Interpolate the irradiance at a point from the records
+	 * of the cache
+	 *
+	 * \return \c false if no record is close enough (in which case
+	 *     the caller should compute a new one)
+	 */
+	bool lookup(const Point3f &p, const Normal3f &n, Color3f &E) const;
+
+	/// Return the number of hemispherical rays used to compute a record
+	inline int getSampleCount() const { return m_thetaRes * m_phiRes; }
+
+	/**
+	 * \brief Return a direction of the stratified hemispherical
+	 * sample set of a new record (in the local frame)
+	 *
+	 * \param index
+	 *     Index of the stratum (less than \ref getSampleCount())
+	 * \param sample
+	 *     Uniformly distributed sample on \f$[0,1]^2\f$ that jitters
+	 *     the direction within its stratum
+	 */
+	Vector3f sampleDirection(int index, const Point2f &sample) const;
+
+	/**
+	 * \brief Compute a new record from the hemispherical samples at
+	 * a point, add it to the cache, and return its irradiance
+	 *
+	 * \param p
+	 *     Position of the record
+	 * \param frame
+	 *     Shading frame at \c p, which was used to convert the sample
+	 *     directions to world space
+	 * \param radiance
+	 *     Radiance arriving along each of the \ref getSampleCount()
+	 *     directions returned by \ref sampleDirection()
+	 * \param dist
+	 *     Distance to the surface seen along each direction (or the
+	 *     maximum ray length, when there is none)
+	 */
+	Color3f addRecord(const Point3f &p, const Frame &frame,
+		const Color3f *radiance, const float *dist);
+
+	/// Return the number of records
+	size_t getRecordCount() const;
+
+	/// Return a human-readable summary
+	QString toString() const;
+private:
+	struct Node {
+		Node *children[8];
+		std::vector<uint32_t> records;
+
+		Node() { memset(children, 0, sizeof(children)); }
+		~Node() { for (int i=0; i<8; ++i) delete children[i]; }
+	};
+
+	/// Store a record in the nodes that overlap its sphere of influence
+	void insert(Node *node, const BoundingBox3f &nodeBounds, uint32_t index,
+		const BoundingBox3f &recordBounds, int depth);
+
+	/// Return the bounds of the child \c i of a node
+	static BoundingBox3f childBounds(const BoundingBox3f &bounds, int i);
+
+	BoundingBox3f m_bbox;
+	float m_error;
+	int m_thetaRes, m_phiRes;
+	float m_minSpacing, m_maxSpacing;
+	Node m_root;
+	std::vector<IrradianceRecord> m_records;
+	mutable QReadWriteLock m_lock;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __IRRCACHE_H */
@@ -22,10 +22,22 @@
 #define __KDTREE_H
 
 #include <nori/gkdtree.h>
-#include <nori/mesh.h>
+#include <nori/accel.h>
+#include <QThreadStorage>
+
+/**
+ * \brief Number of sibling node pairs that share a 64-byte cache line
+ * in the clustered node layout (see \ref KDTree::relayoutNodes())
+ */
+#define NORI_KD_CLUSTER_PAIRS 4
+
+/// Number of recently tested triangles remembered by a query (a power of two)
+#define NORI_KD_MAILBOX_SIZE 8
 
 NORI_NAMESPACE_BEGIN
 
+struct TriAccel4;
+
 /**
  * \brief Specializes \ref GenericKDTree to a three-dimensional
  * tree that can be used to intersect rays against triangles meshes.
@@ -39,7 +51,8 @@ NORI_NAMESPACE_BEGIN
  *
  * \author Wenzel Jakob
  */
-class KDTree : public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree> {
+class KDTree : public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree>,
+		public Accelerator {
 protected:
 	typedef GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree>  Parent;
 	typedef Parent::SizeType                                             SizeType;
@@ -51,6 +64,31 @@ protected:
 	using Parent::m_indices;
 
 public:
+	/// Tree construction quality levels (see \ref setBuildQuality())
+	enum EBuildQuality {
+		/// Use min-max binning at all levels (fast, for interactive previews)
+		EBinned = 0,
+		/// Bin the top levels, then switch to the O(n log n) perfect-split builder
+		EDefault = 1,
+		/// Use the O(n log n) perfect-split builder throughout (slow, single-threaded)
+		EExact = 2
+	};
+
+	/// Phases of \ref build() whose time is reported by \ref getMetricsJSON()
+	enum EBuildPhase {
+		/// Creating (and early split clipping) the triangle references
+		EPhaseReferences = 0,
+		/// Constructing the tree
+		EPhaseTree,
+		/// Remapping clipped references and clustering the nodes
+		EPhaseLayout,
+		/// Loading or saving the cache file
+		EPhaseCache,
+		/// Packing the leaf triangles and building the short ray grid
+		EPhasePrecompute,
+		EBuildPhaseCount
+	};
+
 	/// Create a new and empty kd-tree
 	KDTree();
 
@@ -58,52 +96,305 @@ public:
 	virtual ~KDTree();
 
 	/**
-	 * \brief Register a triangle mesh for inclusion in the kd-tree.
+	 * \brief Return the number of primitives seen by the tree construction
 	 *
-	 * This function can only be used before \ref build() is called
+	 * This is the number of triangles, except while the tree is built
+	 * over the additional triangle references created by early split
+	 * clipping.
 	 */
-	void addMesh(Mesh *mesh);
+	inline SizeType getPrimitiveCount() const {
+		return m_references.empty() ? Accelerator::getPrimitiveCount()
+			: (SizeType) m_references.size();
+	}
 
-	/// Build the kd-tree
+	/**
+	 * \brief Build the kd-tree
+	 *
+	 * Calling this function again rebuilds the tree from scratch (e.g.
+	 * after the vertex positions of a mesh have changed). The split
+	 * planes of a kd-tree cannot follow moving triangles, hence 
+	 * \ref Accelerator::update() always takes this route. Rebuilds 
+	 * bypass the tree cache file.
+	 */
 	void build();
 
 	/**
-	 * \brief Intersect a ray against all triangle meshes registered
-	 * with the kd-tree
+	 * \brief Trade tree construction time against tree quality
+	 *
+	 * This adjusts the primitive count threshold at which the builder
+	 * switches from min-max binning to the exact O(n log n) method.
+	 * Must be called before \ref build().
+	 */
+	void setBuildQuality(EBuildQuality quality);
+
+	/// Return the tree construction quality level
+	inline EBuildQuality getBuildQuality() const { return m_buildQuality; }
+
+	/**
+	 * \brief Specify whether the leaf triangles should be packed into a 
+	 * precomputed SIMD-friendly layout after the tree has been built
+	 *
+	 * This avoids mesh lookups and scattered vertex reads during traversal
+	 * at a cost of 44 bytes per referenced triangle. Enabled by default.
+	 */
+	inline void setPrecomputeTriangles(bool value) { m_precomputeTriangles = value; }
+
+	/// Return whether leaf triangles are packed after building the tree
+	inline bool getPrecomputeTriangles() const { return m_precomputeTriangles; }
+
+	/**
+	 * \brief Specify whether the nodes should be rearranged into cache 
+	 * line-sized clusters after the tree has been built
+	 *
+	 * See \ref relayoutNodes(). Enabled by default.
+	 */
+	inline void setClusteredLayout(bool value) { m_clusteredLayout = value; }
+
+	/// Return whether the nodes are rearranged into clusters after building the tree
+	inline bool getClusteredLayout() const { return m_clusteredLayout; }
+
+	/**
+	 * \brief Skip triangles that a query has already tested in another leaf
+	 *
+	 * Triangles that straddle split planes are referenced from several
+	 * leaves. With mailboxing, each query remembers the last few tested
+	 * triangles (see \ref NORI_KD_MAILBOX_SIZE) in a small hash table on
+	 * the stack of the calling thread and does not test them again. With
+	 * precomputed triangles, a block of four is only skipped when all of
+	 * them were tested. Ray packets are not affected. Disabled by default.
+	 */
+	inline void setMailboxing(bool value) { m_mailboxing = value; }
+
+	/// Do queries skip triangles that they have already tested?
+	inline bool getMailboxing() const { return m_mailboxing; }
+
+	/**
+	 * \brief Speed up short occlusion queries (e.g. ambient occlusion
+	 * rays) with a coarse grid over the tree
+	 *
+	 * After building the tree, each cell of a uniform grid stores the
+	 * deepest node whose region contains the cell grown by \c length
+	 * times the diagonal of the tree's bounding box. A query of
+	 * \ref rayOccluded() that starts in a cell and is no longer than
+	 * that lies entirely within the node's region, so its traversal
+	 * starts there instead of at the root, and is accepted right away
+	 * when the node is an empty leaf. Must be called before \ref build().
+	 *
+	 * \param length
+	 *     Maximum length of the accelerated queries (relative to the
+	 *     diagonal of the tree's bounding box), or zero to disable the
+	 *     grid (the default)
+	 * \param resolution
+	 *     Number of cells along the longest axis of the bounding box
+	 */
+	inline void setShortRayGrid(float length, int resolution) {
+		m_shortRayLength = length;
+		m_shortRayResolution = resolution;
+	}
+
+	/// Return the maximum length of the queries that are accelerated by the grid
+	inline float getShortRayLength() const { return m_shortRayLength; }
+
+	/**
+	 * \brief Rearrange the nodes of a built tree so that parents and their
+	 * nearby descendants share cache lines
+	 *
+	 * The tree construction emits sibling pairs in depth-first order, so
+	 * descending into a right child usually touches a distant cache line.
+	 * This function instead packs each subtree's top sibling pairs (in
+	 * breadth-first order) into a cache line, then lays out the remaining
+	 * subtrees recursively in the same way. This is similar to a van Emde
+	 * Boas layout, but with a block size of one cache line. Every line is
+	 * filled completely, so the node count does not change.
+	 */
+	void relayoutNodes();
+
+	/**
+	 * \brief Configure early split clipping of triangles with loose bounds
+	 *
+	 * Long and thin triangles that are not aligned with the coordinate
+	 * axes have bounding boxes that are much larger than the triangles
+	 * themselves, which leads to deep trees with many duplicated
+	 * references. When enabled, the bounding box of each such triangle
+	 * is recursively split in half along its longest axis before the
+	 * tree is built, and the triangle is clipped to both halves. The 
+	 * resulting parts are then treated as separate primitives. See 
+	 * "Early Split Clipping for Bounding Volume Hierarchies" by Manfred 
+	 * Ernst and Guenther Greiner.
+	 *
+	 * \param threshold
+	 *    A triangle (part) is split while the surface area of its bounding
+	 *    box exceeds this many times the area of the triangle. The largest
+	 *    boxes are split first. 0 disables early split clipping (the default).
+	 * \param budget
+	 *    Maximum number of additional references relative to the number 
+	 *    of triangles (e.g. 0.5 allows 50% more primitives)
+	 */
+	inline void setSplitClipping(float threshold, float budget) {
+		m_splitThreshold = threshold;
+		m_splitBudget = budget;
+	}
+
+	/// Return the bounding box to triangle area ratio above which triangles are split
+	inline float getSplitThreshold() const { return m_splitThreshold; }
+
+	/// Return the maximum number of additional references due to early split clipping
+	inline float getSplitBudget() const { return m_splitBudget; }
+
+	/**
+	 * \brief Specify a file that caches the tree between runs
 	 *
-	 * Detailed information about the intersection, if any, will be
-	 * stored in the provided \ref Intersection data record. 
+	 * When set, \ref build() first attempts to map a previously saved
+	 * tree from this file into memory. The file records a hash of all
+	 * mesh data and tree construction parameters and is only reused
+	 * when these match. Otherwise, the tree is built as usual and then
+	 * written to the file. An empty string (the default) disables caching.
+	 */
+	inline void setCacheFilename(const QString &filename) { m_cacheFilename = filename; }
+
+	/// Return the name of the tree cache file (if any)
+	inline const QString &getCacheFilename() const { return m_cacheFilename; }
+
+	/**
+	 * \brief Specify a file that receives the quality metrics of every
+	 * build of the tree (see \ref getMetricsJSON())
 	 *
-	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
-	 * information is really needed. When set to \c true, the 
-	 * function just checks whether or not there is occlusion, but without
-	 * providing any more detail (i.e. \c its will not be filled with
-	 * contents). This is usually much faster.
+	 * Each build appends one JSON object per line, so that the file
+	 * can collect the trees of a scene (e.g. the bottom-level trees of
+	 * its instances) and of successive runs. An empty string (the
+	 * default) disables the export.
+	 */
+	inline void setMetricsFilename(const QString &filename) { m_metricsFilename = filename; }
+
+	/// Return the name of the file that receives the quality metrics (if any)
+	inline const QString &getMetricsFilename() const { return m_metricsFilename; }
+
+	/**
+	 * \brief Return the quality metrics of the tree as a JSON object
+	 *
+	 * The metrics are gathered by a pass over the final tree: the SAH
+	 * cost, the numbers of inner nodes, leaves and empty leaves, the
+	 * number of leaf entries per triangle (duplication due to straddling
+	 * and clipped triangles), the average size of the nonempty leaves and
+	 * the largest one, a histogram of the leaf depths, the number of
+	 * indirection nodes, and the time of each phase of the last build
+	 * (see \ref EBuildPhase). Trees loaded from the cache report no
+	 * indirections.
+	 */
+	QString getMetricsJSON() const;
+
+	/**
+	 * \brief Keep the tree out of core
 	 *
-	 * \return \c true If an intersection was found
+	 * When enabled, a newly built tree is written to the cache file (see
+	 * \ref setCacheFilename(), which is required) and then released and
+	 * mapped from that file, just like a tree that was loaded from the
+	 * cache. The operating system pages the nodes in on demand and can
+	 * drop them again, which, together with binary meshes, allows rendering
+	 * scenes whose geometry exceeds the physical memory. Precomputed
+	 * triangles (see \ref setPrecomputeTriangles()) would have to stay in
+	 * memory and are hence not used. To avoid reading all geometry, the
+	 * hash that validates the cache only samples the mesh data.
 	 */
+	inline void setOutOfCore(bool value) { m_outOfCore = value; }
+
+	/// Is the tree kept out of core?
+	inline bool isOutOfCore() const { return m_outOfCore; }
+
+	/// Intersect a ray against the kd-tree (see \ref Accelerator::rayIntersect())
 	bool rayIntersect(const Ray3f &ray, Intersection &its, 
 		bool shadowRay = false) const;
 
-	/// Return the total number of internally represented triangles 
-	inline SizeType getPrimitiveCount() const { return m_primitiveCount; }
+	/**
+	 * \brief Determine whether a ray segment intersects any triangle
+	 *
+	 * Unlike \ref rayIntersect(), this uses a simple front-to-back
+	 * traversal that only tracks the ray segment overlapping each node,
+	 * and it returns as soon as any triangle is hit. Every thread also 
+	 * remembers the triangles that blocked its previous query and tests 
+	 * them first, since consecutive shadow rays (e.g. ambient occlusion
+	 * samples at the same pixel) are often blocked by the same geometry.
+	 */
+	bool rayOccluded(const Ray3f &ray) const;
+
+	/**
+	 * \brief Find the leaf that contains the origin of the camera rays,
+	 * and the nodes along the path to it whose far child any of them
+	 * may enter (see \ref Accelerator::prepareCameraRays())
+	 *
+	 * All rays from a pinhole camera descend along this path first;
+	 * nodes whose split plane the rays of the block move away from
+	 * are left out, since their far child is never visited.
+	 */
+	bool prepareCameraRays(const Point3f &origin, const Vector3f *corners,
+		CameraRaySeed &seed) const;
+
+	/**
+	 * \brief Intersect a camera ray starting at the leaf of the seed,
+	 * after setting up the far children of the seeded path on the stack
+	 * (see \ref Accelerator::rayIntersectSeeded())
+	 */
+	bool rayIntersectSeeded(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed &seed) const;
+
+	/**
+	 * \brief Intersect a packet of \ref NORI_PACKET_SIZE rays against
+	 * all triangle meshes registered with the kd-tree
+	 *
+	 * When the direction vectors of the rays agree in sign along each
+	 * axis, the packet is traversed using SSE instructions and a single
+	 * shared stack, which amortizes the cost of node fetches and mesh
+	 * lookups over all rays. Divergent packets, trees over meshes with
+	 * alpha masks, and builds without SSE support fall back to separate
+	 * calls to \ref rayIntersect().
+	 *
+	 * \param rays
+	 *    Array of \ref NORI_PACKET_SIZE rays
+	 * \param its
+	 *    Array of \ref NORI_PACKET_SIZE intersection records.
+	 *    Entries are only valid when the associated ray hit something.
+	 * \param shadowRay
+	 *    Same meaning as in \ref rayIntersect()
+	 * \return A bit mask, whose i-th bit is set when ray \c i
+	 *    intersected a triangle.
+	 */
+	int rayIntersectPacket(const Ray3f *rays, Intersection *its,
+		bool shadowRay = false) const;
+
+	/// Return the memory used by nodes, indices and precomputed triangles
+	size_t getMemoryUsage() const;
 
-	/// Return the total number of meshes registered with the kd-tree
-	inline SizeType getMeshCount() const { return (SizeType) m_meshes.size(); }
+	/**
+	 * \brief Report the nodes, leaf indices, indirection table and
+	 * precomputed triangles separately (the nodes and indices of a tree
+	 * mapped from the cache count as mapped memory)
+	 */
+	void reportMemory(MemoryReport &report) const;
 
-	/// Return one of the registered meshes
-	inline Mesh *getMesh(IndexType idx) { return m_meshes[idx]; }
-	
-	/// Return one of the registered meshes (const version)
-	inline const Mesh *getMesh(IndexType idx) const { return m_meshes[idx]; }
+	/// Return the time spent building the tree in milliseconds
+	qint64 getBuildTime() const { return Parent::getBuildTime(); }
+
+	/// Return the name of this acceleration data structure
+	QString getName() const { return "kd-tree"; }
+
+	/**
+	 * \brief Return and reset the calling thread's traversal counts (see
+	 * \ref Accelerator::collectTraversalStatistics())
+	 *
+	 * Counts \ref rayIntersect() and \ref rayOccluded(), but not
+	 * \ref rayIntersectPacket().
+	 */
+	bool collectTraversalStatistics(TraversalStatistics &stats) const;
 
 	//// Return an axis-aligned bounding box containing the entire tree
 	inline const BoundingBox3f &getBoundingBox() const {
 		return m_bbox;
 	}
 
-	//// Return an axis-aligned bounding box containing the given triangle
+	//// Return an axis-aligned bounding box containing the given triangle (or reference)
 	inline BoundingBox3f getBoundingBox(IndexType index) const {
+		if (!m_references.empty())
+			return m_references[index].bbox;
 		IndexType meshIdx = findMesh(index);
 		return m_meshes[meshIdx]->getBoundingBox(index);
 	}
@@ -115,24 +406,152 @@ public:
 	 * See \ref Mesh::getClippedBoundingBox() for details
 	 */
 	inline BoundingBox3f getClippedBoundingBox(IndexType index, const BoundingBox3f &clip) const {
+		if (!m_references.empty()) {
+			/* Only consider the part of the triangle covered by the reference */
+			const TriangleReference &ref = m_references[index];
+			BoundingBox3f bbox(clip);
+			bbox.clip(ref.bbox);
+			return m_meshes[ref.mesh]->getClippedBoundingBox(
+				ref.index - m_sizeMap[ref.mesh], bbox);
+		}
 		IndexType meshIdx = findMesh(index);
 		return m_meshes[meshIdx]->getClippedBoundingBox(index, clip);
 	}
 protected:
 	/**
-	 * \brief Compute the mesh and triangle indices corresponding to 
-	 * a primitive index used by the underlying generic kd-tree implementation. 
+	 * \brief Implementation of \ref rayIntersect(), which is compiled
+	 * separately for shadow rays and closest-hit queries so that the 
+	 * traversal loop doesn't test the flag. When \c seed is given,
+	 * traversal starts at its leaf if the ray enters the tree there.
 	 */
-	IndexType findMesh(IndexType &idx) const {
-		std::vector<IndexType>::const_iterator it = std::lower_bound(
-				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
-		idx -= *it;
-		return (IndexType) (it - m_sizeMap.begin());
-	}
+	template <bool ShadowRay> bool rayIntersect(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed *seed = NULL) const;
+
+	/**
+	 * \brief Apply the alpha masks of the meshes to the hits of a
+	 * \ref TriAccel4 block (see \ref Mesh::alphaTest())
+	 *
+	 * \return The mask of the hits that remain
+	 */
+	int alphaTest(const TriAccel4 &block, int hits, const float *u, const float *v,
+		const Ray3f &ray, bool shadowRay) const;
+
+	/**
+	 * \brief Pack the triangles of each leaf node into blocks of four
+	 * Moller-Trumbore records stored in a structure-of-arrays layout
+	 */
+	void precomputeTriangles();
+
+	/// Hash the mesh data and construction parameters that determine the tree
+	uint64_t computeCacheHash() const;
+
+	/// Append the quality metrics to \ref m_metricsFilename (if set)
+	void saveMetrics() const;
+
+	/// Try to map the tree from \ref m_cacheFilename (returns \c false if out of date)
+	bool loadCache(uint64_t hash);
+
+	/// Write the tree to \ref m_cacheFilename (returns \c false upon failure)
+	bool saveCache(uint64_t hash) const;
+
+	/// Unmap the tree cache file (if mapped)
+	void unmapCache();
+
+	/// Release the nodes, indices and packed triangles of a built tree
+	void clear();
+
+	/**
+	 * \brief Create one triangle reference per triangle, which caches its
+	 * bounding box and mesh for the tree construction
+	 *
+	 * Without this table, every bounding box query of the builder would 
+	 * search for the mesh (see \ref findMesh()) and gather the vertices
+	 * again. Large scenes are processed using several threads.
+	 */
+	void createReferences();
+
+	/// Compute the triangle references of a range of triangles
+	void createReferences(IndexType start, IndexType end);
+
+	/**
+	 * \brief Add the triangle references used by early split clipping
+	 * (see \ref setSplitClipping())
+	 */
+	void splitTriangles();
+
+	/**
+	 * \brief Replace the triangle references in the leaves of a built 
+	 * tree by the triangles, and remove duplicates within each leaf
+	 */
+	void remapReferences();
+
+	/// Build (or release) the grid of \ref setShortRayGrid() over the built tree
+	void buildShortRayGrid();
 private:
-	std::vector<Mesh *> m_meshes;
-	std::vector<SizeType> m_sizeMap;
-	SizeType m_primitiveCount;
+	friend class ReferenceThread;
+
+	/**
+	 * \brief Bounding box of a triangle (or of a part of it created by
+	 * early split clipping) during the tree construction
+	 */
+	struct TriangleReference {
+		BoundingBox3f bbox;
+		/// Index of the triangle
+		IndexType index;
+		/// Index of its mesh
+		IndexType mesh;
+	};
+
+	EBuildQuality m_buildQuality;
+	bool m_precomputeTriangles;
+	bool m_outOfCore;
+	bool m_clusteredLayout;
+	bool m_mailboxing;
+	/// Do any of the meshes have an alpha mask (see \ref Mesh::alphaTest())?
+	bool m_alphaMasks;
+	/// Packed leaf triangles (or \c NULL if not precomputed)
+	TriAccel4 *m_triAccel;
+	/// Maps the first index entry of each leaf to its first block in \ref m_triAccel
+	IndexType *m_triAccelOffset;
+	/// Number of blocks in \ref m_triAccel
+	SizeType m_triAccelCount;
+	/**
+	 * \brief Per-thread index of the last occluding \ref TriAccel4 block
+	 * (or triangle, when triangles are not precomputed)
+	 */
+	mutable QThreadStorage<IndexType *> m_lastOccluder;
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	/// Per-thread traversal counts (see \ref collectTraversalStatistics())
+	mutable QThreadStorage<TraversalStatistics *> m_statistics;
+#endif
+	float m_splitThreshold, m_splitBudget;
+	/* Grid for short occlusion queries (see setShortRayGrid()) */
+	float m_shortRayLength;
+	int m_shortRayResolution;
+	/// Offsets of the nodes of the cells in \ref m_nodes (or empty)
+	std::vector<uint32_t> m_shortRayCells;
+	/// Number of cells along each axis
+	Vector3i m_shortRayCellCount;
+	/// Conversion from positions to cell coordinates (relative to the bounding box)
+	Vector3f m_shortRayScale;
+	/// Squared maximum length of the accelerated queries (in world units)
+	float m_shortRayMaxLength2;
+	/// Triangle references (only exist while building)
+	std::vector<TriangleReference> m_references;
+	/// Name of the tree cache file (or empty)
+	QString m_cacheFilename;
+	/// Name of the file that receives the quality metrics (or empty)
+	QString m_metricsFilename;
+	/// Time spent in each phase of the last build (in milliseconds)
+	qint64 m_phaseTime[EBuildPhaseCount];
+	/// Was the tree of the last build loaded from the cache?
+	bool m_cached;
+	/// Memory-mapped contents of the tree cache file (or \c NULL)
+	char *m_cacheData;
+	size_t m_cacheSize;
+#if defined(PLATFORM_WINDOWS)
+	void *m_cacheFile, *m_cacheMapping;
+#endif
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,165 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__LIGHTBVH_H)
+#define __LIGHTBVH_H
+
+#include <nori/bbox.h>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+class Mesh;
+class Luminaire;
+
+/**
+ * \brief Bounding volume hierarchy over the emitting triangles of a
+ * scene, used to choose a triangle for a luminaire sample based on its
+ * estimated contribution to the illuminated point (many-light sampling)
+ *
+ * Every node stores the bounding box, total power and a cone bounding
+ * the normals of the triangles below it. The importance of a node for
+ * a reference point is its power times a bound of the cosine at the
+ * luminaire, divided by the squared distance (Conty Estevez and Kulla,
+ * "Importance Sampling of Many Lights with Adaptive Tree Splitting").
+ * \ref sample() descends from the root, choosing each child with a
+ * probability proportional to its importance, so that nearby triangles
+ * facing the point are preferred over far away or turned away ones,
+ * while every triangle that might contribute keeps a nonzero probability.
+ *
+ * The luminaires must emit a constant radiance from the surface of
+ * their mesh (like \c AreaLuminaire), since the power of a triangle
+ * is assumed to be proportional to its surface area.
+ */
+class LightBVH {
+public:
+	/// An emitting triangle (a leaf of the hierarchy)
+	struct Emitter {
+		const Luminaire *luminaire;
+		const Mesh *mesh;
+		uint32_t triangle;
+	};
+
+	/**
+	 * \brief Build the hierarchy over all triangles of the given
+	 * meshes, which must have an attached luminaire
+	 */
+	LightBVH(const std::vector<const Mesh *> &meshes);
+
+	/// Return the total power of the emitting triangles
+	inline float getPower() const { return m_nodes.empty() ? 0.0f : m_nodes[0].power; }
+
+	/// Return the number of emitting triangles
+	inline size_t getEmitterCount() const { return m_emitters.size(); }
+
+	/// Return the memory used by the nodes and emitters (in bytes)
+	inline size_t getMemoryUsage() const {
+		return m_nodes.capacity() * sizeof(Node) + m_emitters.capacity() * sizeof(Emitter)
+			+ m_leaves.capacity() * sizeof(uint32_t);
+	}
+
+	/// Return an emitting triangle
+	inline const Emitter &getEmitter(size_t index) const { return m_emitters[index]; }
+
+	/**
+	 * \brief Choose an emitting triangle to illuminate \c ref, and
+	 * uniformly sample a position on it
+	 *
+	 * The first dimension of \c sample is reused for the decision at
+	 * every level of the hierarchy.
+	 *
+	 * \param p
+	 *     Sampled position
+	 * \param n
+	 *     Surface normal at \c p
+	 * \param pdf
+	 *     Probability density of \c p with respect to surface area
+	 * \return Index of the emitter (see \ref getEmitter()), or -1 if
+	 *     no triangle can illuminate \c ref
+	 */
+	int sample(const Point3f &ref, const Point2f &sample, Point3f &p,
+		Normal3f &n, float &pdf) const;
+
+	/**
+	 * \brief Return the probability density (with respect to surface
+	 * area) of sampling a position on the given triangle of a luminaire
+	 * using \ref sample()
+	 */
+	float pdf(const Point3f &ref, const Luminaire *luminaire, uint32_t triangle) const;
+
+	/// Does the hierarchy contain the triangles of the given luminaire?
+	inline bool contains(const Luminaire *luminaire) const {
+		return m_offsets.find(luminaire) != m_offsets.end();
+	}
+
+	/// Return a human-readable summary
+	QString toString() const;
+protected:
+	/// Node of the hierarchy (children follow in depth-first order)
+	struct Node {
+		BoundingBox3f bbox;
+		/// Axis of the cone that bounds the surface normals
+		Vector3f axis;
+		/// Spread angle of the normal cone around \ref axis
+		float thetaO;
+		/// Total power of the triangles below
+		float power;
+		/// Index of the second child (the first one follows); 0 for leaves
+		uint32_t right;
+		/// Index of the parent node (-1 for the root)
+		uint32_t parent;
+		/// Index of the emitter of a leaf
+		uint32_t emitter;
+	};
+
+	/// An emitting triangle during the build
+	struct BuildItem {
+		BoundingBox3f bbox;
+		Point3f centroid;
+		Vector3f axis;
+		float thetaO;
+		float power;
+		uint32_t emitter;
+	};
+
+	/// Orders build items by the centroid coordinate along an axis
+	struct CentroidOrder {
+		CentroidOrder(int axis) : axis(axis) { }
+		inline bool operator()(const BuildItem &a, const BuildItem &b) const {
+			return a.centroid[axis] < b.centroid[axis];
+		}
+		int axis;
+	};
+
+	/// Recursively build the subtree over a range of items, and return its index
+	uint32_t build(std::vector<BuildItem> &items, size_t begin, size_t end, uint32_t parent);
+
+	/// Estimate the contribution of the triangles below a node to \c ref
+	float importance(const Node &node, const Point3f &ref) const;
+private:
+	std::vector<Node> m_nodes;
+	std::vector<Emitter> m_emitters;
+	/// Leaf node of every triangle (-1 for triangles without power)
+	std::vector<uint32_t> m_leaves;
+	/// Offset of the triangles of each luminaire in \ref m_leaves
+	std::map<const Luminaire *, uint32_t> m_offsets;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __LIGHTBVH_H */
@@ -0,0 +1,167 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__LUMINAIRE_H)
+#define __LUMINAIRE_H
+
+#include <nori/object.h>
+#include <nori/bbox.h>
+
+NORI_NAMESPACE_BEGIN
+
+class Luminaire;
+
+/**
+ * \brief Convenience data structure used to pass multiple
+ * parameters to the evaluation and sampling routines in \ref Luminaire
+ */
+struct LuminaireQueryRecord {
+	/// Pointer to the associated luminaire
+	const Luminaire *luminaire;
+	/// Reference position (i.e. the point that is illuminated)
+	Point3f ref;
+	/// Position on the luminaire
+	Point3f p;
+	/// Surface normal at \ref p
+	Normal3f n;
+	/// Direction from \ref ref to \ref p (normalized)
+	Vector3f d;
+	/// Distance between \ref ref and \ref p (infinite for environment luminaires)
+	float dist;
+	/// Probability density of \ref p wrt. solid angles at \ref ref
+	float pdf;
+	/**
+	 * \brief Index of the triangle containing \ref p on the mesh of
+	 * the luminaire (\c (uint32_t) -1 if unknown)
+	 *
+	 * Required by \ref Scene::pdfLuminaire() when the scene samples
+	 * individual emitting triangles (see \ref LightBVH)
+	 */
+	uint32_t triangle;
+
+	/// Create a new record for sampling a luminaire
+	inline LuminaireQueryRecord(const Point3f &ref)
+		: luminaire(NULL), ref(ref), dist(0), pdf(0), triangle((uint32_t) -1) { }
+
+	/**
+	 * \brief Create a new record for querying a luminaire at a given
+	 * position (e.g. one that was found by tracing a ray from \c ref)
+	 */
+	inline LuminaireQueryRecord(const Luminaire *luminaire, const Point3f &ref,
+			const Point3f &p, const Normal3f &n) : luminaire(luminaire), ref(ref),
+			p(p), n(n), pdf(0), triangle((uint32_t) -1) {
+		d = p - ref;
+		dist = d.norm();
+		d /= dist;
+	}
+
+	/**
+	 * \brief Create a new record for querying an environment luminaire
+	 * in a direction (e.g. that of a ray that left the scene)
+	 */
+	inline LuminaireQueryRecord(const Luminaire *luminaire, const Point3f &ref,
+			const Vector3f &d) : luminaire(luminaire), ref(ref), d(d),
+			dist(std::numeric_limits<float>::infinity()), pdf(0),
+			triangle((uint32_t) -1) { }
+};
+
+/**
+ * \brief Superclass of all luminaires
+ */
+class Luminaire : public NoriObject {
+public:
+	/**
+	 * \brief Sample a position on the luminaire that illuminates
+	 * \c lRec.ref, and return the importance weight (i.e. the emitted
+	 * radiance divided by the probability density of the sample with
+	 * respect to solid angles at \c lRec.ref)
+	 *
+	 * Fills in all fields of \c lRec. Visibility is not taken into account.
+	 *
+	 * \return The weight, or zero if sampling failed
+	 */
+	virtual Color3f sample(LuminaireQueryRecord &lRec, const Point2f &sample) const = 0;
+
+	/**
+	 * \brief Sample a ray that leaves the luminaire (e.g. to start
+	 * a light path)
+	 *
+	 * Sets \c lRec.p and \c lRec.n to the origin of the ray and the
+	 * surface normal there, and \c lRec.pdf to the density of the origin
+	 * with respect to surface area (or volume, see \ref isVolume()).
+	 * The latter is zero when the origin
+	 * isn't a point on the luminaire (environment luminaires), which
+	 * hence can't be connected to other vertices.
+	 *
+	 * \return The emitted radiance times the cosine at the origin, divided
+	 *    by the density of the ray, or zero if sampling failed
+	 */
+	virtual Color3f sampleRay(LuminaireQueryRecord &lRec, Ray3f &ray,
+		const Point2f &positionSample, const Point2f &directionSample) const = 0;
+
+	/// Return the radiance emitted from \c lRec.p towards \c lRec.ref
+	virtual Color3f eval(const LuminaireQueryRecord &lRec) const = 0;
+
+	/**
+	 * \brief Compute the probability density of sampling \c lRec.p
+	 * using \ref sample() (with respect to solid angles at \c lRec.ref)
+	 */
+	virtual float pdf(const LuminaireQueryRecord &lRec) const = 0;
+
+	/**
+	 * \brief Return the (approximate) total power emitted by the luminaire,
+	 * which is used to choose between the luminaires of a scene
+	 */
+	virtual float getPower() const = 0;
+
+	/**
+	 * \brief Is this an environment luminaire, which emits towards
+	 * the scene from infinitely far away?
+	 *
+	 * Such luminaires are evaluated for rays that don't hit anything.
+	 */
+	virtual bool isEnvironment() const { return false; }
+
+	/**
+	 * \brief Does the luminaire sample the emission of a participating
+	 * medium (see \ref Medium::getLuminaire())?
+	 *
+	 * Such luminaires emit from points inside the medium instead of a
+	 * surface: \c lRec.n is zero, and densities of positions are taken
+	 * with respect to volume instead of surface area. Paths never hit
+	 * them, hence their samples get the full MIS weight.
+	 */
+	virtual bool isVolume() const { return false; }
+
+	/**
+	 * \brief Inform the luminaire about the extents of the scene once
+	 * they are known (e.g. to let an environment luminaire estimate 
+	 * its power)
+	 */
+	virtual void setSceneBounds(const BoundingBox3f &bbox) { }
+
+	/**
+	 * \brief Return the type of object (i.e. Mesh/Luminaire/etc.)
+	 * provided by this instance
+	 * */
+	EClassType getClassType() const { return ELuminaire; }
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __LUMINAIRE_H */
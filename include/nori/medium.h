@@ -20,9 +20,15 @@
 #define __MEDIUM_H
 
 #include <nori/object.h>
+#include <nori/spectrum.h>
+
+/// Maximum number of media on a \ref MediumStack (including the exterior medium)
+#define NORI_MAX_MEDIUM_DEPTH 8
 
 NORI_NAMESPACE_BEGIN
 
+struct Intersection;
+
 /**
  * \brief Generic participating medium interface
  * 
@@ -30,6 +36,11 @@ NORI_NAMESPACE_BEGIN
  * (e.g. homogeneous/heterogeneous). It only contains two method, since that's 
  * all that is required to interface with path tracers: sampling a distance 
  * and evaluating the transmittance along a ray segment.
+ *
+ * Media may also emit light (e.g. fire). Such media report their power
+ * using \ref getEmittedPower() and sample positions proportional to
+ * their emission, which lets \ref activate() create a luminaire for
+ * them (see \ref getLuminaire()).
  */
 class Medium : public NoriObject {
 public:
@@ -78,6 +89,73 @@ public:
 	 */
 	virtual Color3f evalTransmittance(const Ray3f &ray, Sampler *sampler) const = 0;
 
+	/**
+	 * \brief Evaluate the scattering coefficient times the transmittance
+	 * at distance \c t along a ray segment, and the density with which
+	 * \ref sampleDistance() samples an interaction there
+	 *
+	 * This allows combining other strategies for sampling distances
+	 * (e.g. equiangular sampling) with that of the medium using MIS.
+	 *
+	 * \return \c false if the medium doesn't support this (the default),
+	 *    e.g. because it samples distances using delta tracking
+	 */
+	virtual bool evalDistance(const Ray3f &ray, float t, Color3f &value, float &pdf) const;
+
+	/**
+	 * \brief Spectral version of \ref sampleDistance() for the four
+	 * wavelengths of a path in spectral mode (see \ref Wavelengths)
+	 *
+	 * The default implementation samples the distance in RGB and turns
+	 * the weight into a spectrum, which is exact for media whose
+	 * coefficients don't depend on the wavelength. Chromatic media
+	 * should sample the distance for the hero wavelength instead.
+	 */
+	virtual bool sampleSpectralDistance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl, float &t, Spectrum4f &weight) const;
+
+	/**
+	 * \brief Spectral version of \ref evalTransmittance() (the default
+	 * implementation turns the RGB transmittance into a spectrum)
+	 */
+	virtual Spectrum4f evalSpectralTransmittance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl) const;
+
+	/**
+	 * \brief Evaluate the emitted radiance per unit length at \c p, i.e.
+	 * sigma_a(p) times the radiance Le(p) emitted by the medium
+	 */
+	virtual Color3f evalEmission(const Point3f &p) const;
+
+	/**
+	 * \brief Return the radiance gathered by an interaction at \c p that
+	 * was sampled using \ref sampleDistance(): \ref evalEmission() divided
+	 * by the probability per unit length of the interaction (in which the
+	 * transmittance cancels out)
+	 */
+	virtual Color3f evalCollisionEmission(const Point3f &p) const;
+
+	/**
+	 * \brief Sample a position roughly proportional to the emission
+	 * of the medium
+	 *
+	 * \return The density of \c p with respect to volume (zero if
+	 *    sampling failed)
+	 */
+	virtual float sampleEmissionPosition(const Point2f &sample, Point3f &p) const;
+
+	/// Return the density of sampling \c p using \ref sampleEmissionPosition()
+	virtual float pdfEmissionPosition(const Point3f &p) const;
+
+	/// Return the (approximate) total power emitted by the medium (zero if it doesn't emit)
+	virtual float getEmittedPower() const;
+
+	/**
+	 * \brief Return the luminaire that samples the emission of the
+	 * medium (\c NULL if it doesn't emit)
+	 */
+	inline const Luminaire *getLuminaire() const { return m_luminaire; }
+
 	/// Return a pointer to the phase function associated with this medium
 	inline const PhaseFunction *getPhaseFunction() const { return m_phaseFunction; }
 
@@ -98,8 +176,73 @@ protected:
 
 protected:
 	PhaseFunction *m_phaseFunction;
+	Luminaire *m_luminaire;
+};
+
+/**
+ * \brief Stack of the media that contain the current vertex of a path
+ *
+ * Media can be bound to the interior of meshes (see \ref 
+ * Mesh::getInteriorMedium()). The bottom of the stack is the medium
+ * that surrounds everything else (i.e. the scene's medium, possibly
+ * \c NULL). Whenever a path crosses the surface of a mesh with an 
+ * interior medium, \ref update() enters or leaves that medium, 
+ * depending on the side from which the surface is crossed. This 
+ * handles nested as well as overlapping media. The medium on top is
+ * the one that the path currently travels through; a \c NULL medium
+ * means vacuum, in which no medium sampling takes place at all.
+ */
+class MediumStack {
+public:
+	/// Create a stack that only contains the exterior medium
+	inline MediumStack(const Medium *exterior = NULL) : m_size(1) {
+		m_media[0] = exterior;
+	}
+
+	/// Return the medium that contains the current vertex (or \c NULL)
+	inline const Medium *top() const { return m_media[m_size - 1]; }
+
+	/// Return the number of media on the stack (including the exterior one)
+	inline int size() const { return m_size; }
+
+	/// Enter a medium (ignored beyond \ref NORI_MAX_MEDIUM_DEPTH nested media)
+	inline void enter(const Medium *medium) {
+		if (m_size < NORI_MAX_MEDIUM_DEPTH)
+			m_media[m_size++] = medium;
+	}
+
+	/// Leave a medium, which need not be the innermost one
+	void leave(const Medium *medium);
+
+	/**
+	 * \brief Update the stack when a path crosses a surface
+	 *
+	 * \param its
+	 *    The surface intersection
+	 * \param d
+	 *    Direction in which the path continues through the surface
+	 *    (i.e. the direction of the refracted ray)
+	 */
+	void update(Intersection &its, const Vector3f &d);
+private:
+	const Medium *m_media[NORI_MAX_MEDIUM_DEPTH];
+	int m_size;
 };
 
+/**
+ * \brief Convert a dense volume in the VOL format into a sparse volume
+ * that can be used by the \c heterogeneous medium
+ *
+ * \param brickSize
+ *    Edge length of the bricks in voxels
+ * \param encoding
+ *    Encoding of the stored density values: \c float32, \c float16
+ *    (half precision) or \c uint8 (quantized relative to the maximum
+ *    density of every brick)
+ */
+extern void convertToSparseVolume(const QString &input, const QString &output, 
+	int brickSize = 8, const QString &encoding = "float32");
+
 NORI_NAMESPACE_END
 
 #endif /* __MEDIUM_H */
@@ -0,0 +1,69 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__MEMREPORT_H)
+#define __MEMREPORT_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Memory used by the parts of a scene, by category
+ *
+ * Objects add the sizes of their buffers and tables using
+ * \ref NoriObject::reportMemory(). Memory that is mapped from a file
+ * (e.g. binary meshes, kd-tree caches, or volumes) is counted separately,
+ * since it only occupies physical memory once it is touched, and the
+ * operating system can drop it again. The categories keep the order in
+ * which they were first added.
+ */
+class MemoryReport {
+public:
+	/// Add memory to a category (which is created on first use)
+	void add(const QString &category, size_t bytes, size_t mappedBytes = 0);
+
+	/// Return the resident memory of a category (in bytes)
+	size_t getResident(const QString &category) const;
+
+	/// Return the total resident memory (in bytes)
+	size_t getTotalResident() const;
+
+	/// Return the total mapped memory (in bytes)
+	size_t getTotalMapped() const;
+
+	/// Write the report to a JSON file (e.g. for a render farm's scheduler)
+	void save(const QString &filename) const;
+
+	/// Return the report as a JSON object
+	std::string toJSON() const;
+
+	/// Return a human-readable table of the nonempty categories
+	QString toString() const;
+private:
+	struct Entry {
+		QString category;
+		size_t resident, mapped;
+	};
+
+	std::vector<Entry> m_entries;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __MEMREPORT_H */
@@ -23,6 +23,12 @@
 #include <nori/dpdf.h>
 #include <nori/frame.h>
 
+/**
+ * Number of triangles per chunk when the area distribution of a mesh is
+ * computed in parallel (see \ref Mesh::computeAreaDistribution())
+ */
+#define NORI_MESH_AREA_CHUNK 65536
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -32,6 +38,11 @@ NORI_NAMESPACE_BEGIN
  * This includes the position, traveled ray distance, uv coordinates, as well
  * as well as two local coordinate frames (one that corresponds to the true
  * geometry, and one that is used for shading computations).
+ *
+ * The ray tracing routines only fill in a cheap hit record consisting of
+ * \ref t, \ref mesh, \ref primIndex and \ref bary. The remaining fields
+ * are computed on demand by \ref computeDifferentialGeometry(), which
+ * must be called before they are accessed.
  */
 struct Intersection {
 	/// Position of the surface intersection
@@ -40,15 +51,63 @@ struct Intersection {
 	float t;
 	/// UV coordinates, if any
 	Point2f uv;
+	/// Partial derivatives of the position wrt. the UV coordinates
+	Vector3f dpdu, dpdv;
+	/// Offsets to the hit points of the ray differentials (see \ref computeFootprint())
+	Vector3f dpdx, dpdy;
+	/// Approximate width of the ray's footprint in UV space (0 = unknown)
+	float uvWidth;
 	/// Shading frame (based on the shading normal)
 	Frame shFrame;
 	/// Geometric frame (based on the true geometry)
 	Frame geoFrame;
 	/// Pointer to the associated mesh
 	const Mesh *mesh;
+	/// Index of the intersected triangle within \ref mesh
+	uint32_t primIndex;
+	/// Barycentric coordinates of the intersection within the triangle
+	Point2f bary;
+	/// Object-to-world transformation of an intersected instance (or \c NULL)
+	const Transform *toWorldTrafo;
+	/// Have \ref p, \ref uv, \ref shFrame and \ref geoFrame been computed?
+	bool hasDifferentials;
 
 	/// Create an uninitialized intersection record
-	inline Intersection() : mesh(NULL) { }
+	inline Intersection() : mesh(NULL), toWorldTrafo(NULL), hasDifferentials(false) { }
+
+	/**
+	 * \brief Compute the position, texture coordinates and frames
+	 * from the hit record (does nothing when this already happened)
+	 */
+	inline void computeDifferentialGeometry() {
+		if (!hasDifferentials)
+			computeDifferentialGeometryInternal(true);
+	}
+
+	/**
+	 * \brief Compute the differential geometry of the intersections
+	 * <tt>its[indices[0]], .., its[indices[count-1]]</tt>
+	 *
+	 * Used by integrators in wavefront mode. The coordinate frames of all
+	 * intersections are completed together (see the batched
+	 * \ref coordinateSystem()).
+	 */
+	static void computeDifferentialGeometry(Intersection *its,
+		const uint32_t *indices, uint32_t count);
+
+	/**
+	 * \brief Estimate the footprint of a ray with differentials
+	 * (see \ref TRay) on the surface, i.e. \ref dpdx, \ref dpdy and
+	 * \ref uvWidth. Requires \ref computeDifferentialGeometry().
+	 */
+	void computeFootprint(const Ray3f &ray);
+
+	/**
+	 * \brief Propagate the differentials of the incident \c ray
+	 * through a specular reflection into \c reflected (assuming that
+	 * the shading normal is locally constant)
+	 */
+	void reflectDifferentials(const Ray3f &ray, Ray3f &reflected) const;
 
 	/// Transform a direction vector into the local shading frame
 	inline Vector3f toLocal(const Vector3f &d) const {
@@ -62,6 +121,82 @@ struct Intersection {
 
 	/// Return a human-readable summary of the intersection record
 	QString toString() const;
+private:
+	/// Compute the differential geometry, leaving \c s and \c t of the frames unset unless \c buildFrames
+	void computeDifferentialGeometryInternal(bool buildFrames);
+};
+
+/**
+ * \brief Pre-gathered vertex data of a triangle (see \ref Mesh::setPackTriangles())
+ *
+ * Stores the first vertex and the two edges sharing it, i.e. exactly
+ * what the Moeller-Trumbore intersection test needs. Each vector is
+ * padded to 16 bytes so that an aligned array of these records can be 
+ * accessed using aligned SSE loads.
+ */
+struct PackedTriangle {
+	/// First vertex position (the last entry is unused)
+	float p0[4];
+	/// Edge from the first to the second vertex (the last entry is unused)
+	float e1[4];
+	/// Edge from the first to the third vertex (the last entry is unused)
+	float e2[4];
+};
+
+/// Encode a unit vector using the octahedral mapping (16 bits per coordinate)
+inline uint32_t encodeNormal(const Normal3f &n) {
+	float invL1 = 1.0f / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+	float u = n.x() * invL1, v = n.y() * invL1;
+	if (n.z() < 0) {
+		/* Fold the lower hemisphere over the diagonals */
+		float tmp = (1 - std::abs(v)) * (u < 0 ? -1.0f : 1.0f);
+		v = (1 - std::abs(u)) * (v < 0 ? -1.0f : 1.0f);
+		u = tmp;
+	}
+	uint32_t qu = (uint32_t) ((clamp(u, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f + 0.5f),
+	         qv = (uint32_t) ((clamp(v, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f + 0.5f);
+	return qu | (qv << 16);
+}
+
+/// Decode a unit vector encoded by \ref encodeNormal()
+inline Normal3f decodeNormal(uint32_t value) {
+	float u = (value & 0xFFFF) * (2.0f / 65535.0f) - 1.0f,
+	      v = (value >> 16) * (2.0f / 65535.0f) - 1.0f,
+	      z = 1.0f - std::abs(u) - std::abs(v);
+	if (z < 0) {
+		float tmp = (1 - std::abs(v)) * (u < 0 ? -1.0f : 1.0f);
+		v = (1 - std::abs(u)) * (v < 0 ? -1.0f : 1.0f);
+		u = tmp;
+	}
+	return Normal3f(Vector3f(u, v, z).normalized());
+}
+
+/**
+ * \brief Compact record of an emitting triangle (see \ref Mesh::getEmitterTriangles())
+ *
+ * Holds everything that \ref Mesh::samplePosition() needs, including
+ * the cell of the alias table for choosing the triangle, in exactly one
+ * cache line. The vertex normals are stored in an octahedral encoding
+ * with 16 bits per coordinate (the geometric normal when the mesh has
+ * no vertex normals).
+ */
+struct EmitterTriangle {
+	/// First vertex position
+	float p0[3];
+	/// Edge from the first to the second vertex
+	float e1[3];
+	/// Edge from the first to the third vertex
+	float e2[3];
+	/// Encoded normals of the three vertices
+	uint32_t n[3];
+	/// Surface area of the triangle
+	float area;
+	/// Probability of keeping this triangle when its alias table cell is chosen
+	float aliasProb;
+	/// Triangle that is chosen otherwise
+	uint32_t alias;
+	/// Unused (pads the record to 64 bytes)
+	uint32_t unused;
 };
 
 /**
@@ -92,6 +227,16 @@ public:
 	 */
 	void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const;
 
+	/**
+	 * \brief Uniformly sample a position on the given triangle with
+	 * respect to surface area. Returns both position and normal
+	 *
+	 * Only available for meshes with an attached luminaire (see
+	 * \ref getEmitterTriangles())
+	 */
+	void sampleTrianglePosition(uint32_t index, const Point2f &sample,
+		Point3f &p, Normal3f &n) const;
+
 	/// Return the surface area of the given triangle
 	float surfaceArea(uint32_t index) const;
 
@@ -135,6 +280,33 @@ public:
 	 */
 	bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+	/**
+	 * \brief Specify whether \ref activate() should gather the vertices 
+	 * of every triangle into a \ref PackedTriangle record
+	 *
+	 * This removes the indirection through the index buffer (and three
+	 * scattered vertex reads) from \ref rayIntersect(), at a cost of
+	 * 48 bytes per triangle. Disabled by default, since the kd-tree and 
+	 * BVH normally intersect their own precomputed copies of the leaf 
+	 * triangles. Can be enabled using the \c packTriangles property of
+	 * the mesh loaders.
+	 */
+	inline void setPackTriangles(bool value) { m_packTriangles = value; }
+
+	/// Return the packed triangle records (or \c NULL if they don't exist)
+	inline const PackedTriangle *getPackedTriangles() const { return m_packedTriangles; }
+
+	/**
+	 * \brief Return the emitter table of the mesh (or \c NULL)
+	 *
+	 * \ref activate() builds this table of \ref EmitterTriangle records
+	 * for meshes with an attached luminaire, whose surface is sampled
+	 * for every luminaire sample. \ref samplePosition() then chooses and
+	 * samples a triangle by fetching (usually) one cache line, instead
+	 * of accessing the area distribution, index buffer and vertices.
+	 */
+	inline const EmitterTriangle *getEmitterTriangles() const { return m_emitterTriangles; }
+
 	/// Return the surface area of the entire mesh
 	inline float surfaceArea() const { return m_distr.getSum(); }
 	
@@ -144,24 +316,190 @@ public:
 	/// Return a pointer to the vertex positions
 	inline const Point3f *getVertexPositions() const { return m_vertexPositions; }
 
-	/// Return a pointer to the vertex normals (or \c NULL if there are none)
+	/**
+	 * \brief Replace the vertex positions (e.g. for the next frame of 
+	 * an animation) while keeping the mesh topology
+	 *
+	 * \param positions
+	 *    Array of \ref getVertexCount() new vertex positions
+	 * \param normals
+	 *    Optional array of new vertex normals. Ignored when the mesh
+	 *    has no vertex normals; otherwise, the existing ones are kept
+	 *    when this parameter is \c NULL.
+	 *
+	 * Any acceleration data structure containing the mesh must be
+	 * updated afterwards (see \ref Scene::updateGeometry()).
+	 */
+	void setVertexPositions(const Point3f *positions, const Normal3f *normals = NULL);
+
+	/**
+	 * \brief Return the geometric frame of every triangle (or \c NULL)
+	 *
+	 * These are only precomputed for meshes without vertex normals, whose
+	 * intersections then use them as both geometric and shading frame.
+	 */
+	inline const Frame *getFaceFrames() const { return m_faceFrames; }
+
+	/**
+	 * \brief Specify whether \ref activate() should compress the vertex
+	 * normals and texture coordinates
+	 *
+	 * Normals are then stored using the octahedral encoding of
+	 * \ref encodeNormal() (4 instead of 12 bytes, with an angular error
+	 * below 0.01 degrees), and texture coordinates as two 16-bit fixed
+	 * point numbers relative to the bounding rectangle of all texture
+	 * coordinates of the mesh (4 instead of 8 bytes). Together with the
+	 * positions, this shrinks a vertex from 32 to 20 bytes. Both are
+	 * decoded on demand by \ref computeDifferentialGeometry(). Meshes
+	 * whose texture coordinates span a large range (e.g. heavily tiled
+	 * textures) lose precision; 16 bits suffice for textures of up to
+	 * 4096 pixels that are repeated up to 16 times. Disabled by default,
+	 * can be enabled using the \c compressAttributes property of the
+	 * OBJ loader.
+	 */
+	inline void setCompressAttributes(bool value) { m_compressAttributes = value; }
+
+	/**
+	 * \brief Return a pointer to the vertex normals (or \c NULL if there
+	 * are none, or if they are compressed)
+	 *
+	 * Use \ref hasVertexNormals() and \ref getVertexNormal() to access
+	 * the normals of meshes with compressed attributes.
+	 */
 	inline const Normal3f *getVertexNormals() const { return m_vertexNormals; }
 
-	/// Return a pointer to the texture coordinates (or \c NULL if there are none)
+	/**
+	 * \brief Return a pointer to the texture coordinates (or \c NULL if 
+	 * there are none, or if they are compressed)
+	 */
 	inline const Point2f *getVertexTexCoords() const { return m_vertexTexCoords; }
 
+	/// Does the mesh have vertex normals (compressed or not)?
+	inline bool hasVertexNormals() const { return m_vertexNormals || m_packedNormals; }
+
+	/// Does the mesh have texture coordinates (compressed or not)?
+	inline bool hasVertexTexCoords() const { return m_vertexTexCoords || m_packedTexCoords; }
+
+	/// Return the normal of a vertex (requires \ref hasVertexNormals())
+	inline Normal3f getVertexNormal(uint32_t index) const {
+		if (m_vertexNormals)
+			return m_vertexNormals[index];
+		return decodeNormal(m_packedNormals[index]);
+	}
+
+	/// Return the texture coordinates of a vertex (requires \ref hasVertexTexCoords())
+	inline Point2f getVertexTexCoord(uint32_t index) const {
+		if (m_vertexTexCoords)
+			return m_vertexTexCoords[index];
+		uint32_t value = m_packedTexCoords[index];
+		return Point2f(
+			m_texCoordOffset.x() + (value & 0xFFFF) * m_texCoordScale.x(),
+			m_texCoordOffset.y() + (value >> 16) * m_texCoordScale.y());
+	}
+
 	/// Return a pointer to the triangle vertex index list
 	inline const uint32_t *getIndices() const { return m_indices; }
 
 	/// Return a pointer to the BSDF associated with this mesh
 	inline const BSDF *getBSDF() const { return m_bsdf; }
 
-	/// Register a child object (e.g. a BSDF) with the mesh
+	/**
+	 * \brief Return the medium that fills the interior of this mesh
+	 * (or \c NULL if there is none)
+	 *
+	 * The mesh should be closed and consistently oriented (normals 
+	 * pointing outwards). See \ref MediumStack.
+	 */
+	inline const Medium *getInteriorMedium() const { return m_interiorMedium; }
+
+	/// Is this mesh a luminaire?
+	inline bool isLuminaire() const { return m_luminaire != NULL; }
+
+	/// Return the luminaire associated with this mesh (or \c NULL)
+	inline const Luminaire *getLuminaire() const { return m_luminaire; }
+
+	/**
+	 * \brief Return the alpha mask of the mesh (or \c NULL), i.e. a
+	 * nested texture whose luminance gives the opacity of the surface
+	 */
+	inline const Texture *getAlphaMask() const { return m_alphaMask; }
+
+	/**
+	 * \brief Any-hit filter of the alpha mask, which acceleration data
+	 * structures apply before they accept a hit
+	 *
+	 * Closest-hit queries keep the hits where the opacity is at least
+	 * 0.5 (i.e. the mask cuts out the surface). Shadow rays instead keep
+	 * a hit with a probability equal to the opacity, which is decided by
+	 * a hash of the ray and the triangle instead of a sampler, so that
+	 * the test is cheap and gives the same answer for every leaf that
+	 * contains the triangle. Partially transparent surfaces hence cast
+	 * shadows of the correct density on average.
+	 *
+	 * \param index
+	 *     Index of the triangle within the mesh
+	 * \param u, v
+	 *     Barycentric coordinates of the hit
+	 */
+	inline bool alphaTest(uint32_t index, float u, float v, const Ray3f &ray,
+			bool shadowRay) const {
+		return !m_alphaMask || evalAlphaTest(index, u, v, ray, shadowRay);
+	}
+
+	/// Register a child object (e.g. a BSDF or an interior medium) with the mesh
 	virtual void addChild(NoriObject *child);
 
+	/// Is this a \ref ProceduralMesh (e.g. \ref Curves) instead of a triangle mesh?
+	virtual bool isProcedural() const { return false; }
+
+	/**
+	 * \brief Are the vertex attributes and indices mapped from a file
+	 * (see the \c binary mesh type) instead of being allocated?
+	 */
+	virtual bool isMapped() const { return false; }
+
+	/**
+	 * \brief Report the positions, normals, texture coordinates, indices, 
+	 * derived per-triangle data, and the area distribution
+	 */
+	virtual void reportMemory(MemoryReport &report) const;
+
 	/// Return the name of this mesh
 	inline const QString &getName() const { return m_name; }
 
+	/// Return the index of this mesh within the scene (e.g. for mesh ID buffers)
+	inline uint32_t getID() const { return m_id; }
+
+	/// Set the index of this mesh within the scene (done by \ref Scene::addChild())
+	inline void setID(uint32_t id) { m_id = id; }
+
+	/**
+	 * \brief Write the mesh to a binary mesh file
+	 *
+	 * The file can be loaded much faster than an OBJ file, since its 
+	 * arrays are mapped into memory instead of being parsed (see the
+	 * \c binary mesh type, and the <tt>nori --convert</tt> command)
+	 */
+	void saveBinary(const QString &filename) const;
+
+	/**
+	 * \brief Compute an order of the triangles and vertices with a good
+	 * memory locality
+	 *
+	 * The triangles are sorted along a Morton curve through their
+	 * centroids, and the vertices by their first use in that order
+	 * (unreferenced ones go last). Nearby triangles, and hence the 
+	 * triangles of a kd-tree leaf, then share cache lines and pages.
+	 *
+	 * \param indices
+	 *    Receives the reordered index buffer, which refers to the
+	 *    vertices in their new order
+	 * \param vertexOrder
+	 *    Receives the old index of every vertex in the new order
+	 */
+	void computeLocalityOrder(std::vector<uint32_t> &indices,
+		std::vector<uint32_t> &vertexOrder) const;
+
 	/// Return a human-readable summary of this instance
 	QString toString() const;
 
@@ -173,16 +511,62 @@ public:
 protected:
 	/// Create an empty mesh
 	Mesh();
+
+	/**
+	 * \brief Recompute the discrete distribution used by \ref samplePosition()
+	 *
+	 * Large meshes are processed using all cores: each chunk of
+	 * \c NORI_MESH_AREA_CHUNK triangles computes the running sums of its
+	 * areas, which are then offset by the total of the preceding chunks.
+	 * Since the chunks don't depend on the number of threads, neither
+	 * does the result.
+	 */
+	void computeAreaDistribution();
+
+	/// Gather the vertices of all triangles into \ref m_packedTriangles
+	void packTriangles();
+
+	/// Compute the geometric frames of all triangles into \ref m_faceFrames
+	void computeFaceFrames();
+
+	/// Build \ref m_emitterTriangles (requires the area distribution)
+	void buildEmitterTable();
+
+	/// Replace the vertex normals and texture coordinates by their compressed versions
+	void compressAttributes();
+
+	/// Evaluate the alpha mask (see \ref alphaTest())
+	bool evalAlphaTest(uint32_t index, float u, float v, const Ray3f &ray,
+		bool shadowRay) const;
+
+	/**
+	 * \brief Reorder the triangles and vertices as computed by
+	 * \ref computeLocalityOrder() (must be called before \ref activate())
+	 */
+	void reorderForLocality();
 protected:
 	Point3f  *m_vertexPositions;
 	Normal3f *m_vertexNormals;
 	Point2f  *m_vertexTexCoords;
+	uint32_t *m_packedNormals;
+	uint32_t *m_packedTexCoords;
+	Point2f  m_texCoordOffset;
+	Vector2f m_texCoordScale;
+	bool     m_compressAttributes;
 	uint32_t *m_indices;
+	PackedTriangle *m_packedTriangles;
+	EmitterTriangle *m_emitterTriangles;
+	bool m_packTriangles;
+	Frame    *m_faceFrames;
 	uint32_t m_vertexCount;
 	uint32_t m_triangleCount;
 	DiscretePDF m_distr;
 	BSDF    *m_bsdf;
+	Medium  *m_interiorMedium;
+	Luminaire *m_luminaire;
+	Texture *m_alphaMask;
 	QString m_name;
+	uint32_t m_id;
 };
 
 NORI_NAMESPACE_END
@@ -21,9 +21,67 @@
 
 #include <nori/proplist.h>
 #include <boost/function.hpp>
+#include <QAtomicInt>
+#include <map>
+
+#define NORI_POOL_CHUNK_SIZE 65536 /* Size of the memory chunks requested by ObjectPool */
+#define NORI_POOL_ALIGNMENT 16 /* Alignment of the objects allocated by ObjectPool */
 
 NORI_NAMESPACE_BEGIN
 
+class MemoryReport;
+
+/**
+ * \brief Memory pool for the objects of one scene
+ *
+ * While a scene is instantiated (see \ref loadScene()), all objects that
+ * the loading thread creates are taken from one pool, which advances a 
+ * pointer within large chunks of memory. This places the objects of a 
+ * scene next to each other. Deleting an object runs its destructor but
+ * doesn't return its memory. Instead, all chunks are released at once 
+ * when the last object of the pool has been deleted, hence a pool may
+ * outlive its scene when another scene adopts some of its objects.
+ *
+ * Objects that are created on other threads or when no pool is active
+ * (e.g. the per-thread clones of a sampler) come from the global heap.
+ */
+class ObjectPool {
+public:
+	/// Create a pool and make it the active one of the calling thread
+	ObjectPool();
+
+	/**
+	 * \brief Deactivate the pool (reactivating the previous one)
+	 *
+	 * Must be called on the thread that created the pool. Afterwards,
+	 * the pool deletes itself as soon as it holds no more objects.
+	 */
+	void close();
+
+	/// Return the active pool of the calling thread (or \c NULL)
+	static ObjectPool *getActive();
+
+	/// Allocate memory for an object (from the active pool, if any)
+	static void *allocate(size_t size);
+
+	/// Release the memory of an object allocated by \ref allocate()
+	static void deallocate(void *ptr);
+private:
+	~ObjectPool();
+
+	/// Allocate from this pool (only on the thread that created it)
+	void *allocateLocal(size_t size);
+
+	/// Drop a reference (an object or the pool being active)
+	void release();
+private:
+	std::vector<uint8_t *> m_chunks;
+	uint8_t *m_current, *m_end;
+	ObjectPool *m_previous;
+	/// Number of objects, plus one while the pool is active
+	QAtomicInt m_refCount;
+};
+
 /**
  * \brief Base class of all objects
  *
@@ -44,12 +102,20 @@ public:
 		ESampler,
 		ETest,
 		EReconstructionFilter,
+		EInstance,
+		ETexture,
 		EClassTypeCount
 	};
 
 	/// Virtual destructor
 	virtual ~NoriObject() { }
 
+	/// Allocate instances from the active \ref ObjectPool (if any)
+	static void *operator new(size_t size) { return ObjectPool::allocate(size); }
+
+	/// Release memory that was allocated by \ref operator new()
+	static void operator delete(void *ptr) { ObjectPool::deallocate(ptr); }
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
 	 * provided by this instance
@@ -86,6 +152,14 @@ public:
 	 */
 	virtual void activate();
 
+	/**
+	 * \brief Add the memory used by the object's buffers and tables
+	 * (e.g. vertex arrays or sampling distributions) to a report
+	 *
+	 * The default implementation adds nothing.
+	 */
+	virtual void reportMemory(MemoryReport &report) const;
+
 	/// Return a brief string summary of the instance (for debugging purposes)
 	virtual QString toString() const = 0;
 	
@@ -100,6 +174,8 @@ public:
 			case EIntegrator: return "integrator";
 			case ESampler:    return "sampler";
 			case ETest:       return "test";
+			case EInstance:   return "instance";
+			case ETexture:    return "texture";
 			default:          return "<unknown>";
 		}
 	}
@@ -0,0 +1,88 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__PAGING_H)
+#define __PAGING_H
+
+#include <nori/common.h>
+#include <QMutex>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Registry of the memory-mapped files that hold scene data (e.g.
+ * binary meshes and kd-tree cache files), which reports their working set
+ *
+ * Mapped files are paged in on demand by the operating system, which can
+ * also drop their pages again under memory pressure. This makes it
+ * possible to render scenes whose geometry is larger than the physical
+ * memory, as long as the working set of the rays fits. The statistics
+ * tell how well that works: the resident part of the mappings (determined
+ * using \c mincore()) and the number of page faults of the process.
+ * On Windows, only the size of the mappings is reported.
+ */
+class PagedMemory {
+public:
+	/// Snapshot of the paging statistics
+	struct Statistics {
+		/// Total size of the registered mappings (in bytes)
+		size_t mappedBytes;
+		/// Size of their pages that are currently resident (in bytes)
+		size_t residentBytes;
+		/// Page faults of the process that required I/O so far
+		uint64_t majorFaults;
+		/// Page faults of the process that were served without I/O so far
+		uint64_t minorFaults;
+
+		inline Statistics() : mappedBytes(0), residentBytes(0),
+			majorFaults(0), minorFaults(0) { }
+	};
+
+	/// Return the registry that is shared by all mappings
+	static PagedMemory *getInstance();
+
+	/// Register a mapping (\c data must be page-aligned)
+	void addRegion(const void *data, size_t size);
+
+	/// Remove a previously registered mapping
+	void removeRegion(const void *data);
+
+	/// Are any mappings registered?
+	bool hasRegions() const;
+
+	/**
+	 * \brief Return the current statistics
+	 *
+	 * This checks the residency of every page of the mappings, hence it
+	 * should not be called more often than e.g. once per rendering.
+	 */
+	Statistics getStatistics() const;
+
+	/// Return a human-readable summary of the change since an earlier snapshot
+	static QString toString(const Statistics &start, const Statistics &end, float seconds);
+private:
+	PagedMemory() { }
+
+	mutable QMutex m_mutex;
+	std::map<const void *, size_t> m_regions;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __PAGING_H */
@@ -20,14 +20,86 @@
 #define __PARSER_H
 
 #include <nori/object.h>
+#include <QByteArray>
 
 NORI_NAMESPACE_BEGIN
 
+class Scene;
+
+/// Flags that control how a scene file is loaded (see \ref loadScene())
+enum ESceneLoadFlags {
+	/// Don't validate the file against the XML schema (for trusted inputs)
+	ESkipValidation = 0x01,
+
+	/**
+	 * Store the parsed object graph in a binary cache next to the 
+	 * file (<tt>scene.xml.cache</tt>) and load it from there as long 
+	 * as the contents of the file don't change
+	 */
+	EUseSceneCache  = 0x02
+};
+
 /**
  * \brief Load a scene from the specified filename and
  * return its root object
+ *
+ * <tt>&lt;include filename=".."/&gt;</tt> elements in the scene or in its
+ * instances add the objects nested in the <tt>&lt;scene&gt;</tt> of
+ * another file (relative paths are resolved like mesh filenames). Each
+ * file is parsed once per process, as long as its contents don't change.
+ * Instances that include the same file share its objects (i.e. a single
+ * mesh), whereas each include in the scene itself creates new objects.
+ *
+ * Meshes of the scene that load the same OBJ or binary mesh file (or
+ * files with the same contents) with otherwise identical parameters
+ * are turned into instances of one mesh, unless the scene's
+ * \c shareMeshes property is \c false.
+ *
+ * \param flags
+ *    A combination of \ref ESceneLoadFlags
+ *
+ * \param geometrySource
+ *    A previously loaded scene (or \c NULL). When the new scene 
+ *    declares exactly the same meshes and instances and uses the same
+ *    acceleration data structure settings, it takes over the meshes
+ *    and the built data structure of \c geometrySource instead of 
+ *    loading and building them again (see \ref Scene::adoptGeometry()).
+ *    This is meant for sequences of scenes that only differ in e.g. 
+ *    the camera or the integrator.
+ */
+extern NoriObject *loadScene(const QString &filename, int flags = 0,
+	Scene *geometrySource = NULL);
+
+/**
+ * \brief Picks the scene whose geometry a newly loaded scene takes over,
+ * once the geometry of the new scene is known (see \ref loadScene())
+ */
+class GeometrySource {
+public:
+	virtual ~GeometrySource() { }
+
+	/**
+	 * \brief Return a previously loaded scene whose geometry may be
+	 * taken over by a scene with the given geometry key (or \c NULL)
+	 *
+	 * Called after the file was parsed, before any object is created.
+	 * The call may block, e.g. until the returned scene has been 
+	 * rendered, while the thread that loads the scene waits.
+	 */
+	virtual Scene *getGeometrySource(const QByteArray &geometryKey) = 0;
+};
+
+/**
+ * \brief Load a scene like \ref loadScene(), deciding after parsing 
+ * which scene's geometry to take over
+ *
+ * This lets a scene be loaded while its predecessor is still in use:
+ * the new scene only waits for the predecessor when it can take over
+ * the predecessor's geometry, and loads its own geometry right away 
+ * otherwise.
  */
-extern NoriObject *loadScene(const QString &filename);
+extern NoriObject *loadScene(const QString &filename, int flags,
+	GeometrySource &geometrySource);
 
 NORI_NAMESPACE_END
 
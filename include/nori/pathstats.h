@@ -0,0 +1,156 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__PATHSTATS_H)
+#define __PATHSTATS_H
+
+#include <nori/common.h>
+#include <QElapsedTimer>
+
+/// Number of bins of the path depth histogram (the last one collects all longer paths)
+#define NORI_PATH_DEPTH_BINS 32
+
+/// Only every n-th sample is timed (see \ref PathStatistics)
+#define NORI_PATH_TIMING_INTERVAL 16
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Counters that an integrator records about the paths that
+ * it traces (enabled with the \c pathStatistics property of the scene)
+ *
+ * Every render thread has its own instance (see \ref RenderContext::pathStats),
+ * so that no synchronization is needed; they are summed up per job.
+ *
+ * The time spent in the stages of a sample is an estimate: only every
+ * \c NORI_PATH_TIMING_INTERVAL-th sample is timed, to keep the overhead
+ * of reading the clock low. Traversal covers the intersection and shadow
+ * ray queries (including the transmittance along shadow rays), medium
+ * tracking covers the sampling of distances in media, and shading is
+ * the remainder of the time spent in \ref Integrator::Li().
+ */
+struct PathStatistics {
+	/// Stages of a sample whose time is measured
+	enum EStage {
+		ETraversal = 0,
+		EMedium,
+		EShading,
+		EStageCount
+	};
+
+	/// Number of paths per depth (number of segments)
+	uint64_t depths[NORI_PATH_DEPTH_BINS];
+	/// Number of samples, and the number of paths traced by them (incl. split off ones)
+	uint64_t samples, paths;
+	/// Number of scattering events in media
+	uint64_t mediumInteractions;
+	/// Number of BSDF or phase function samples that failed (terminating the path)
+	uint64_t bsdfFailures;
+	/// Time spent in each stage by the timed samples (in nanoseconds)
+	qint64 stageTime[EStageCount];
+	/// Number of samples that were timed
+	uint64_t timedSamples;
+
+	inline PathStatistics() { reset(); timer.start(); }
+
+	/// Reset all counters
+	void reset();
+
+	/// Add the counters of another thread
+	PathStatistics &operator+=(const PathStatistics &stats);
+
+	/// Called by the render thread before \ref Integrator::Li()
+	inline void beginSample() {
+		timed = (samples++ % NORI_PATH_TIMING_INTERVAL) == 0;
+		if (timed) {
+			sampleStart = timer.nsecsElapsed();
+			sampleStaged = stageTime[ETraversal] + stageTime[EMedium];
+		}
+	}
+
+	/// Called by the render thread after \ref Integrator::Li()
+	inline void endSample() {
+		if (!timed)
+			return;
+		stageTime[EShading] += timer.nsecsElapsed() - sampleStart
+			- (stageTime[ETraversal] + stageTime[EMedium] - sampleStaged);
+		++timedSamples;
+		timed = false;
+	}
+
+	/// Record a path that ended after \c depth segments
+	inline void addPath(int depth) {
+		++depths[std::min(std::max(depth, 0), NORI_PATH_DEPTH_BINS - 1)];
+		++paths;
+	}
+
+	/// Is the current sample timed?
+	inline bool isTimed() const { return timed; }
+
+	/// Return the current time of the thread's clock (in nanoseconds)
+	inline qint64 now() const { return timer.nsecsElapsed(); }
+
+	/// Return the average depth of the paths
+	float getAverageDepth() const;
+
+	/**
+	 * \brief Return a human-readable summary, given the number of rays
+	 * (including shadow rays) traced by the integrator
+	 */
+	QString toString(uint64_t rayCount) const;
+
+	/// Return the counters as a JSON object (see \ref toString())
+	QString toJSON(uint64_t rayCount) const;
+private:
+	QElapsedTimer timer;
+	qint64 sampleStart, sampleStaged;
+	bool timed;
+};
+
+/**
+ * \brief Adds the time until it goes out of scope to a stage of
+ * the current sample, when the sample is timed
+ *
+ * \code
+ * {
+ *     PathStageTimer stageTimer(context.pathStats, PathStatistics::ETraversal);
+ *     hit = context.rayIntersect(ray, its);
+ * }
+ * \endcode
+ */
+class PathStageTimer {
+public:
+	inline PathStageTimer(PathStatistics *stats, PathStatistics::EStage stage)
+		: m_stats(stats && stats->isTimed() ? stats : NULL), m_stage(stage) {
+		if (m_stats)
+			m_start = m_stats->now();
+	}
+
+	inline ~PathStageTimer() {
+		if (m_stats)
+			m_stats->stageTime[m_stage] += m_stats->now() - m_start;
+	}
+private:
+	PathStatistics *m_stats;
+	PathStatistics::EStage m_stage;
+	qint64 m_start;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __PATHSTATS_H */
@@ -0,0 +1,125 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__PCG32_H)
+#define __PCG32_H
+
+#include <nori/common.h>
+
+#define PCG32_DEFAULT_STATE  0x853c49e6748fea9bULL
+#define PCG32_DEFAULT_STREAM 0xda3e39cb94b95bdbULL
+#define PCG32_MULT           0x5851f42d4c957f2dULL
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief PCG32 pseudorandom number generator
+ *
+ * A permuted linear congruential generator with 64 bits of state and a
+ * selectable stream (M.E. O'Neill, "PCG: A Family of Simple Fast
+ * Space-Efficient Statistically Good Algorithms for Random Number
+ * Generation", 2014). Compared to the Mersenne Twister in \ref Random,
+ * its state fits into 16 bytes, and it can jump ahead by an arbitrary
+ * number of steps in logarithmic time. Seeding it with e.g. a pixel
+ * index as the stream and a sample index as the offset thus yields
+ * reproducible random numbers regardless of the order of evaluation.
+ */
+class PCG32 {
+public:
+	/// Create a generator with the default state and stream
+	inline PCG32() : m_state(PCG32_DEFAULT_STATE), m_inc(PCG32_DEFAULT_STREAM) { }
+
+	/// Create a generator using the given state and stream
+	inline PCG32(uint64_t initState, uint64_t initSeq = 1) { seed(initState, initSeq); }
+
+	/**
+	 * \brief Seed the generator
+	 *
+	 * \param initState
+	 *     Starting state of the generator
+	 * \param initSeq
+	 *     Selects one of 2^63 distinct streams
+	 */
+	inline void seed(uint64_t initState, uint64_t initSeq = 1) {
+		m_state = 0U;
+		m_inc = (initSeq << 1u) | 1u;
+		nextUInt();
+		m_state += initState;
+		nextUInt();
+	}
+
+	/// Generate an uniformly distributed 32-bit integer
+	inline uint32_t nextUInt() {
+		uint64_t oldState = m_state;
+		m_state = oldState * PCG32_MULT + m_inc;
+		uint32_t xorShifted = (uint32_t) (((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rot = (uint32_t) (oldState >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+	}
+
+	/// Generate an uniformly distributed single precision value on [0,1)
+	inline float nextFloat() {
+		/* Generate a number in [1,2) and subtract 1 */
+		union {
+			uint32_t u;
+			float f;
+		} x;
+		x.u = (nextUInt() >> 9) | 0x3f800000u;
+		return x.f - 1.0f;
+	}
+
+	/// Fill an array with uniformly distributed values on [0,1)
+	inline void nextFloat(float *values, size_t count) {
+		for (size_t i=0; i<count; ++i)
+			values[i] = nextFloat();
+	}
+
+	/**
+	 * \brief Advance the generator by \c delta steps (negative values
+	 * move backwards) in O(log(delta)) time
+	 *
+	 * Based on F. Brown, "Random Number Generation with Arbitrary Stride",
+	 * Transactions of the American Nuclear Society, 1994.
+	 */
+	inline void advance(int64_t delta) {
+		uint64_t curMult = PCG32_MULT, curPlus = m_inc, accMult = 1u, accPlus = 0u;
+		uint64_t d = (uint64_t) delta;
+		while (d > 0) {
+			if (d & 1) {
+				accMult *= curMult;
+				accPlus = accPlus * curMult + curPlus;
+			}
+			curPlus = (curMult + 1) * curPlus;
+			curMult *= curMult;
+			d /= 2;
+		}
+		m_state = accMult * m_state + accPlus;
+	}
+
+	/// Return the internal state (e.g. to create a deterministic child generator)
+	inline uint64_t getState() const { return m_state; }
+private:
+	/// RNG state (all values are possible)
+	uint64_t m_state;
+	/// Controls which RNG sequence (stream) is selected (must be odd)
+	uint64_t m_inc;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __PCG32_H */
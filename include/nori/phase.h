@@ -35,6 +35,9 @@ struct PhaseFunctionQueryRecord {
 	/// Outgoing direction (in the world frame)
 	Vector3f wo;
 
+	/// Create an uninitialized record (e.g. for arrays of queries)
+	inline PhaseFunctionQueryRecord() { }
+
 	/// Create a new record for sampling the phase function
 	inline PhaseFunctionQueryRecord(const Vector3f &wi)
 		: wi(wi) { }
@@ -62,6 +65,28 @@ public:
 	 */
 	virtual float sample(PhaseFunctionQueryRecord &pRec, const Point2f &sample) const = 0;
 
+	/**
+	 * \brief Sample the phase function for a batch of queries
+	 *
+	 * Avoids a virtual call per query (see the batched \ref BSDF::sample()).
+	 * The default implementation simply calls \ref sample() for each query.
+	 *
+	 * \param pRecs
+	 *     An array of \c count queries, whose \c wo fields are set to
+	 *     the sampled directions
+	 * \param samples
+	 *     An array of \c count uniformly distributed samples on \f$[0,1]^2\f$
+	 * \param result
+	 *     Used to return the sample weight of each query
+	 * \param count
+	 *     The number of queries
+	 */
+	virtual void sample(PhaseFunctionQueryRecord *pRecs, const Point2f *samples,
+			float *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = sample(pRecs[i], samples[i]);
+	}
+
 	/**
 	 * \brief Evaluate the phase function for a pair of directions 
 	 * specified in \code pRec
@@ -0,0 +1,164 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__PROCEDURAL_H)
+#define __PROCEDURAL_H
+
+#include <nori/accel.h>
+
+/// Maximum depth of the hierarchy over procedural shapes
+#define NORI_PROCEDURAL_MAXDEPTH 64
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Mesh whose shapes are intersected by custom code instead of
+ * being stored as triangles (e.g. \ref Curves)
+ *
+ * Procedural meshes have no triangles of their own, hence they are
+ * ignored by the triangle acceleration data structures. Instead, a
+ * \ref ProceduralAccelerator builds a hierarchy over the bounding boxes
+ * of their shapes and calls \ref rayIntersect() for the shapes whose
+ * boxes are hit.
+ */
+class ProceduralMesh : public Mesh {
+public:
+	/// Is this a procedural mesh? (always \c true)
+	bool isProcedural() const { return true; }
+
+	/// Return the number of shapes
+	virtual uint32_t getShapeCount() const = 0;
+
+	/// Return an axis-aligned bounding box containing the given shape
+	virtual BoundingBox3f getBoundingBox(uint32_t index) const = 0;
+
+	/**
+	 * \brief Intersect a ray against a shape
+	 *
+	 * \param index
+	 *    Index of the shape
+	 * \param ray
+	 *    The ray segment to be used for the intersection query
+	 * \param maxt
+	 *    Only intersections closer than this are reported
+	 * \param t
+	 *    Upon success, the distance along the ray
+	 * \param uv
+	 *    Upon success, the parameters of the intersection within the
+	 *    shape (stored in \ref Intersection::bary)
+	 * \return
+	 *   \c true if an intersection has been detected
+	 */
+	virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float maxt,
+		float &t, Point2f &uv) const = 0;
+
+	/**
+	 * \brief Compute the differential geometry of an intersection found
+	 * by \ref rayIntersect()
+	 *
+	 * Expects \c its.t, \c its.primIndex (the index of the shape) and
+	 * \c its.bary (its parameters), and sets all other fields.
+	 */
+	virtual void computeDifferentialGeometry(const Ray3f &ray, Intersection &its) const = 0;
+};
+
+/**
+ * \brief Adds the shapes of all \ref ProceduralMesh instances to another
+ * acceleration data structure
+ *
+ * Any procedural meshes registered with the wrapped structure are ignored
+ * by it (since they have no triangles). This class collects them and
+ * builds a bounding volume hierarchy over their shapes, which is
+ * traversed in addition to the wrapped structure. Intersections with
+ * procedural shapes are reported with their differential geometry
+ * already computed.
+ */
+class ProceduralAccelerator : public Accelerator {
+public:
+	/**
+	 * \brief Wrap an acceleration data structure, whose registered
+	 * meshes include one or more procedural meshes
+	 *
+	 * Takes ownership of \c inner.
+	 */
+	ProceduralAccelerator(Accelerator *inner);
+
+	/// Release all memory (including the wrapped structure)
+	virtual ~ProceduralAccelerator();
+
+	/// Build the wrapped structure and the hierarchy over the shapes
+	void build();
+
+	/// Update the wrapped structure (the procedural shapes don't move)
+	bool update();
+
+	/// Intersect a ray against all geometry (see \ref Accelerator::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const;
+
+	/// Return an axis-aligned bounding box containing all geometry
+	inline const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	/// Return the memory used by both data structures
+	size_t getMemoryUsage() const;
+
+	/// Report the memory of both data structures (the hierarchy of shapes counts as \c accel)
+	void reportMemory(MemoryReport &report) const;
+
+	/// Return the time spent to build both data structures in milliseconds
+	qint64 getBuildTime() const;
+
+	/// Return the name of this acceleration data structure
+	QString getName() const;
+
+protected:
+	/// Node of the hierarchy over the shapes
+	struct ShapeNode {
+		/// Bounding box of all shapes below this node
+		BoundingBox3f bbox;
+		/**
+		 * \brief For inner nodes, the index of the second child (the first
+		 * child immediately follows its parent). For leaves, the index
+		 * of the first entry in \ref m_refs
+		 */
+		uint32_t offset;
+		/// Number of shapes (leaf) or zero (inner node)
+		uint32_t count;
+	};
+
+	/// Reference to a shape together with its bounding box
+	struct ShapeRef {
+		BoundingBox3f bbox;
+		const ProceduralMesh *mesh;
+		uint32_t index;
+	};
+
+	/// Recursively construct the hierarchy over the given range of shapes
+	uint32_t buildRecursive(uint32_t start, uint32_t end, int depth);
+
+private:
+	Accelerator *m_inner;
+	std::vector<ShapeRef> m_refs;
+	std::vector<ShapeNode> m_nodes;
+	BoundingBox3f m_bbox;
+	qint64 m_buildTime;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __PROCEDURAL_H */
@@ -0,0 +1,185 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__PROFILER_H)
+#define __PROFILER_H
+
+#include <nori/common.h>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QThreadStorage>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Records how long the phases of a run take (e.g. parsing, mesh
+ * loading, kd-tree construction, the rendering of each image block,
+ * writing images) and how long threads wait for contended locks
+ *
+ * Recording is off unless \ref enable() is called (<tt>nori --trace</tt>),
+ * in which case \ref save() writes the events in the JSON trace event
+ * format of Chrome's <tt>about:tracing</tt> (also read by Perfetto).
+ * While disabled, instrumented code only pays for a branch. Each thread
+ * appends to its own event list, so threads don't contend while recording.
+ *
+ * Events are added using \ref ProfileScope and \ref profiledLock().
+ */
+class Profiler {
+public:
+	/// Return the profiler that is shared by all threads
+	static Profiler *getInstance();
+
+	/// Start recording (time stamps are relative to this call)
+	void enable();
+
+	/// Is recording enabled?
+	inline bool isEnabled() const { return m_enabled; }
+
+	/// Return the time since \ref enable() in nanoseconds
+	inline qint64 now() const { return m_timer.nsecsElapsed(); }
+
+	/**
+	 * \brief Record an event of the calling thread
+	 *
+	 * \param name
+	 *     Name of the event (must be a string constant)
+	 * \param category
+	 *     Category of the event (must be a string constant)
+	 * \param start
+	 *     Start time in nanoseconds (see \ref now())
+	 * \param duration
+	 *     Duration in nanoseconds
+	 * \param detail
+	 *     Optional description (e.g. a filename), shown with the event
+	 */
+	void record(const char *name, const char *category, qint64 start,
+		qint64 duration, const QString &detail = QString());
+
+	/// Set the name under which the calling thread appears in the trace
+	void setThreadName(const QString &name);
+
+	/**
+	 * \brief Write all recorded events to a JSON file
+	 *
+	 * Must not be called while other threads are still recording.
+	 * Throws a \ref NoriException upon failure.
+	 */
+	void save(const QString &filename) const;
+private:
+	/// Recorded event
+	struct Event {
+		const char *name, *category;
+		qint64 start, duration;
+		QString detail;
+	};
+
+	/// Events of one thread (owned by the profiler, so that they outlive the thread)
+	struct ThreadEvents {
+		int id;
+		QString name;
+		std::vector<Event> events;
+	};
+
+	/// Thread-local reference to a \ref ThreadEvents record
+	struct ThreadSlot {
+		ThreadEvents *events;
+	};
+
+	Profiler() : m_enabled(false) { }
+	~Profiler();
+
+	/// Return the event list of the calling thread (created on first use)
+	ThreadEvents *getThreadEvents();
+
+	volatile bool m_enabled;
+	QElapsedTimer m_timer;
+	mutable QMutex m_mutex;
+	std::vector<ThreadEvents *> m_threads;
+	QThreadStorage<ThreadSlot *> m_slot;
+};
+
+/**
+ * \brief Records the lifetime of a scope as an event (see \ref Profiler)
+ *
+ * <pre>
+ * ProfileScope scope("Build kd-tree", "accel");
+ * </pre>
+ */
+class ProfileScope {
+public:
+	/// Start the event (if the profiler is enabled)
+	inline ProfileScope(const char *name, const char *category)
+		: m_name(name), m_category(category) {
+		Profiler *profiler = Profiler::getInstance();
+		m_start = profiler->isEnabled() ? profiler->now() : -1;
+	}
+
+	/// Finish the event
+	inline ~ProfileScope() {
+		if (m_start >= 0) {
+			Profiler *profiler = Profiler::getInstance();
+			profiler->record(m_name, m_category, m_start,
+				profiler->now() - m_start, m_detail);
+		}
+	}
+
+	/**
+	 * \brief Is the event being recorded?
+	 *
+	 * Check this before computing an expensive \ref setDetail() argument.
+	 */
+	inline bool isActive() const { return m_start >= 0; }
+
+	/// Attach a description (e.g. a filename) to the event
+	inline void setDetail(const QString &detail) { m_detail = detail; }
+private:
+	const char *m_name, *m_category;
+	qint64 m_start;
+	QString m_detail;
+};
+
+/**
+ * \brief Lock a mutex, and record the time spent waiting for it when it
+ * was held by another thread (and the profiler is enabled)
+ */
+inline void profiledLock(QMutex &mutex, const char *name) {
+	Profiler *profiler = Profiler::getInstance();
+	if (!profiler->isEnabled()) {
+		mutex.lock();
+	} else if (!mutex.tryLock()) {
+		qint64 start = profiler->now();
+		mutex.lock();
+		profiler->record(name, "lock", start, profiler->now() - start);
+	}
+}
+
+/// Counterpart of \c QMutexLocker that uses \ref profiledLock()
+class ProfiledMutexLocker {
+public:
+	inline ProfiledMutexLocker(QMutex *mutex, const char *name) : m_mutex(mutex) {
+		profiledLock(*mutex, name);
+	}
+
+	inline ~ProfiledMutexLocker() { m_mutex->unlock(); }
+private:
+	QMutex *m_mutex;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __PROFILER_H */
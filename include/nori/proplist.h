@@ -22,13 +22,20 @@
 #include <nori/color.h>
 #include <nori/transform.h>
 #include <boost/variant.hpp>
-#include <map>
+#include <vector>
+
+class QDataStream;
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief This is a sssociative container used to supply the constructors
  * of \ref NoriObject subclasses with parameter information.
+ *
+ * Property names are interned: every distinct name is assigned a small
+ * integer once per process, and lists store these identifiers in a sorted
+ * array. Lookups (which take string constants) thus don't allocate, which
+ * matters for scenes with many thousands of objects.
  */
 class PropertyList {
 public:
@@ -38,78 +45,100 @@ public:
 	void setBoolean(const QString &name, const bool &value);
 	
 	/// Get a boolean property, and throw an exception if it does not exist
-	bool getBoolean(const QString &name) const;
+	bool getBoolean(const char *name) const;
 
 	/// Get a boolean property, and use a default value if it does not exist
-	bool getBoolean(const QString &name, const bool &defaultValue) const;
+	bool getBoolean(const char *name, const bool &defaultValue) const;
 
 	/// Set an integer property
 	void setInteger(const QString &name, const int &value);
 	
 	/// Get an integer property, and throw an exception if it does not exist
-	int getInteger(const QString &name) const;
+	int getInteger(const char *name) const;
 
 	/// Get am integer property, and use a default value if it does not exist
-	int getInteger(const QString &name, const int &defaultValue) const;
+	int getInteger(const char *name, const int &defaultValue) const;
 
 	/// Set a float property
 	void setFloat(const QString &name, const float &value);
 	
 	/// Get a float property, and throw an exception if it does not exist
-	float getFloat(const QString &name) const;
+	float getFloat(const char *name) const;
 
 	/// Get a float property, and use a default value if it does not exist
-	float getFloat(const QString &name, const float &defaultValue) const;
+	float getFloat(const char *name, const float &defaultValue) const;
 
 	/// Set a string property
 	void setString(const QString &name, const QString &value);
 
 	/// Get a string property, and throw an exception if it does not exist
-	QString getString(const QString &name) const;
+	QString getString(const char *name) const;
 
 	/// Get a string property, and use a default value if it does not exist
-	QString getString(const QString &name, const QString &defaultValue) const;
+	QString getString(const char *name, const QString &defaultValue) const;
 
 	/// Set a color property
 	void setColor(const QString &name, const Color3f &value);
 
 	/// Get a color property, and throw an exception if it does not exist
-	Color3f getColor(const QString &name) const;
+	Color3f getColor(const char *name) const;
 
 	/// Get a color property, and use a default value if it does not exist
-	Color3f getColor(const QString &name, const Color3f &defaultValue) const;
+	Color3f getColor(const char *name, const Color3f &defaultValue) const;
 
 	/// Set a point property
 	void setPoint(const QString &name, const Point3f &value);
 
 	/// Get a point property, and throw an exception if it does not exist
-	Point3f getPoint(const QString &name) const;
+	Point3f getPoint(const char *name) const;
 
 	/// Get a point property, and use a default value if it does not exist
-	Point3f getPoint(const QString &name, const Point3f &defaultValue) const;
+	Point3f getPoint(const char *name, const Point3f &defaultValue) const;
 
 	/// Set a vector property
 	void setVector(const QString &name, const Vector3f &value);
 
 	/// Get a vector property, and throw an exception if it does not exist
-	Vector3f getVector(const QString &name) const;
+	Vector3f getVector(const char *name) const;
 
 	/// Get a vector property, and use a default value if it does not exist
-	Vector3f getVector(const QString &name, const Vector3f &defaultValue) const;
+	Vector3f getVector(const char *name, const Vector3f &defaultValue) const;
 
 	/// Set a transform property
 	void setTransform(const QString &name, const Transform &value);
 
 	/// Get a transform property, and throw an exception if it does not exist
-	Transform getTransform(const QString &name) const;
+	Transform getTransform(const char *name) const;
 
 	/// Get a transform property, and use a default value if it does not exist
-	Transform getTransform(const QString &name, const Transform &defaultValue) const;
+	Transform getTransform(const char *name, const Transform &defaultValue) const;
+
+	/// Remove a property (returns \c false if it did not exist)
+	bool remove(const char *name);
+
+	/// Write all properties to a binary stream (e.g. a scene cache)
+	void write(QDataStream &stream) const;
+
+	/**
+	 * \brief Replace the contents with properties that were written 
+	 * by \ref write(). Throws an exception if the data is invalid.
+	 */
+	void read(QDataStream &stream);
 private:
 	typedef boost::variant<bool, int, float, QString, 
 		Color3f, Point3f, Transform> Property;
 
-	std::map<QString, Property> m_properties;
+	/// Identifier of an interned property name and the property's value
+	typedef std::pair<int, Property> Entry;
+
+	/// Return the property with the given name (or \c NULL if there is none)
+	const Property *find(const char *name) const;
+
+	/// Return the storage of a new property (warning if it already exists)
+	Property &insert(const QString &name);
+
+	/// Properties sorted by the identifiers of their names
+	std::vector<Entry> m_properties;
 };
 
 NORI_NAMESPACE_END
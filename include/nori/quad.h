@@ -22,6 +22,9 @@
 #include <nori/common.h>
 #include <boost/function.hpp>
 
+/// Minimum number of points per thread when splitting a batch (see \ref NDIntegrator::setThreadCount())
+#define NORI_QUAD_MIN_BATCH 32
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -71,6 +74,21 @@ public:
 	NDIntegrator(size_t fDim, size_t dim,
 			size_t maxEvals, double absError = 0, double relError = 0);
 
+	/**
+	 * \brief Set the number of threads that evaluate the integrand in
+	 * \ref integrateVectorized() (default: 1)
+	 *
+	 * Every batch of points is then split into up to this many parts
+	 * (of at least \ref NORI_QUAD_MIN_BATCH points), which are passed
+	 * to the integrand in parallel. It must hence be thread-safe. Since
+	 * the integrator evaluates all regions that must be refined at once,
+	 * the batches quickly grow large enough for this.
+	 */
+	inline void setThreadCount(int threadCount) { m_threadCount = std::max(1, threadCount); }
+
+	/// Return the number of threads that evaluate the integrand
+	inline int getThreadCount() const { return m_threadCount; }
+
 	/**
 	 * \brief Integrate the function \c f over the rectangular domain 
 	 * bounded by \c min and \c max.
@@ -120,6 +138,7 @@ public:
 protected:
 	size_t m_fdim, m_dim, m_maxEvals;
 	double m_absError, m_relError;
+	int m_threadCount;
 };
 
 NORI_NAMESPACE_END
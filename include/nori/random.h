@@ -56,6 +56,18 @@ public:
 
 	/// Generate an uniformly distributed single precision value on [0,1)
 	float nextFloat();
+
+	/**
+	 * \brief Fill an array with uniformly distributed single precision 
+	 * values on [0,1)
+	 *
+	 * Produces the same sequence as repeated calls to \ref nextFloat(),
+	 * but tempers the generator state in bulk.
+	 */
+	void nextFloat(float *values, size_t count);
+private:
+	/// Generate the next \ref MT_N words of the internal state
+	void regenerate();
 private:
 	uint32_t m_mt[MT_N];
 	int m_mti;
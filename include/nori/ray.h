@@ -31,6 +31,17 @@ NORI_NAMESPACE_BEGIN
  * infinity), as well as the componentwise reciprocals of the ray direction.
  * That is just done for convenience, as these values are frequently required.
  *
+ * Camera rays can optionally carry ray differentials: two auxiliary rays
+ * through the neighboring pixels (offset by one pixel in x and y), which
+ * estimate the footprint of the ray on the surfaces that it hits (see
+ * \ref Intersection::computeFootprint()). Textures use this to choose
+ * their level of detail.
+ *
+ * Rays also record the time at which they are traced, which is sampled
+ * within the shutter interval of the camera (see \ref Camera::sampleTime())
+ * and determines the positions of moving instances. Rays that continue a
+ * path (e.g. shadow rays) must inherit the time of the ray they continue.
+ *
  * \remark Important: be careful when changing the ray direction. You must
  * call \ref update() to compute the componentwise reciprocals as well, or Nori's
  * ray-triangle intersection code will go haywire.
@@ -43,37 +54,73 @@ template <typename _PointType, typename _VectorType> struct TRay {
 	PointType o;     ///< Ray origin
 	VectorType d;    ///< Ray direction
 	VectorType dRcp; ///< Componentwise reciprocals of the ray direction
+	int dirIsNeg[PointType::Dimension]; ///< Is \ref dRcp negative along each axis?
 	Scalar mint;     ///< Minimum position on the ray segment
 	Scalar maxt;     ///< Maximum position on the ray segment
+	Scalar time;     ///< Time at which the ray is traced
+
+	bool hasDifferentials;   ///< Are the ray differentials below valid?
+	PointType rxOrigin;      ///< Origin of the differential ray offset in x
+	PointType ryOrigin;      ///< Origin of the differential ray offset in y
+	VectorType rxDirection;  ///< Direction of the differential ray offset in x
+	VectorType ryDirection;  ///< Direction of the differential ray offset in y
 
 	/// Construct a new ray
 	inline TRay() : mint(Epsilon), 
-		maxt(std::numeric_limits<Scalar>::infinity()) { }
+		maxt(std::numeric_limits<Scalar>::infinity()), time(0), hasDifferentials(false) { }
 	
 	/// Construct a new ray
 	inline TRay(const PointType &o, const VectorType &d) : o(o), d(d), 
-			mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()) {
+			mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()),
+			time(0), hasDifferentials(false) {
 		update();
 	}
 
 	/// Construct a new ray
 	inline TRay(const PointType &o, const VectorType &d, 
-		Scalar mint, Scalar maxt) : o(o), d(d), mint(mint), maxt(maxt) {
+		Scalar mint, Scalar maxt) : o(o), d(d), mint(mint), maxt(maxt),
+		time(0), hasDifferentials(false) {
 		update();
 	}
 
 	/// Copy constructor
 	inline TRay(const TRay &ray) 
 	 : o(ray.o), d(ray.d), dRcp(ray.dRcp),
-	   mint(ray.mint), maxt(ray.maxt) { }
+	   mint(ray.mint), maxt(ray.maxt), time(ray.time), hasDifferentials(ray.hasDifferentials),
+	   rxOrigin(ray.rxOrigin), ryOrigin(ray.ryOrigin),
+	   rxDirection(ray.rxDirection), ryDirection(ray.ryDirection) {
+		for (int i=0; i<PointType::Dimension; ++i)
+			dirIsNeg[i] = ray.dirIsNeg[i];
+	}
 
 	/// Copy a ray, but change the covered segment of the copy
 	inline TRay(const TRay &ray, Scalar mint, Scalar maxt) 
-	 : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt) { }
+	 : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt),
+	   time(ray.time), hasDifferentials(ray.hasDifferentials),
+	   rxOrigin(ray.rxOrigin), ryOrigin(ray.ryOrigin),
+	   rxDirection(ray.rxDirection), ryDirection(ray.ryDirection) {
+		for (int i=0; i<PointType::Dimension; ++i)
+			dirIsNeg[i] = ray.dirIsNeg[i];
+	}
 
-	/// Update the reciprocal ray directions after changing 'd'
+	/// Update the reciprocal ray directions (and their signs) after changing 'd'
 	inline void update() {
 		dRcp = d.cwiseInverse();
+		for (int i=0; i<PointType::Dimension; ++i)
+			dirIsNeg[i] = dRcp[i] < 0;
+	}
+
+	/**
+	 * \brief Scale the offsets of the differential rays, e.g. by
+	 * \f$1/\sqrt{n}\f$ when a pixel receives \f$n\f$ samples
+	 */
+	inline void scaleDifferentials(Scalar scale) {
+		if (!hasDifferentials)
+			return;
+		rxOrigin = o + (rxOrigin - o) * scale;
+		ryOrigin = o + (ryOrigin - o) * scale;
+		rxDirection = d + (rxDirection - d) * scale;
+		ryDirection = d + (ryDirection - d) * scale;
 	}
 
 	/// Return the position of a point along the ray
@@ -83,7 +130,9 @@ template <typename _PointType, typename _VectorType> struct TRay {
 	inline Ray3f reverse() const {
 		Ray3f result;
 		result.o = o; result.d = -d; result.dRcp = -dRcp;
-		result.mint = mint; result.maxt = maxt;
+		for (int i=0; i<PointType::Dimension; ++i)
+			result.dirIsNeg[i] = !dirIsNeg[i];
+		result.mint = mint; result.maxt = maxt; result.time = time;
 		return result;
 	}
 
@@ -94,12 +143,14 @@ template <typename _PointType, typename _VectorType> struct TRay {
 				"  o = %1,\n"
 				"  d = %2,\n"
 				"  mint = %3,\n"
-				"  maxt = %4\n"
+				"  maxt = %4,\n"
+				"  time = %5\n"
 				"]")
 			.arg(o.toString())
 			.arg(d.toString())
 			.arg(mint)
-			.arg(maxt);
+			.arg(maxt)
+			.arg(time);
 	}
 };
 
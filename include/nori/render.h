@@ -0,0 +1,476 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__RENDER_H)
+#define __RENDER_H
+
+#include <nori/block.h>
+#include <nori/accel.h>
+#include <nori/paging.h>
+#include <nori/volcache.h>
+#include <nori/integrator.h>
+#include <deque>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+class RenderEngine;
+class RenderWorker;
+class RenderCache;
+class StreamingFilm;
+struct BitmapSaveOptions;
+struct RenderContext;
+
+/**
+ * \brief A rendering of (a region of) an image
+ *
+ * Jobs are handed to a \ref RenderEngine, which renders them in the
+ * order of submission. The output is accumulated in an \ref ImageBlock
+ * that can be displayed while the job is in progress.
+ */
+class RenderJob {
+public:
+	/// Snapshot of the progress and throughput of a job (see \ref getStatus())
+	struct Status {
+		/// Has a worker picked up the job / has it been rendered completely?
+		bool started, finished;
+		/// Time spent rendering so far in milliseconds
+		qint64 elapsed;
+		/// Index of the current pass and number of passes (an upper bound in adaptive mode)
+		int pass, passCount;
+		/// Finished blocks, and blocks that are in flight or yet to be rendered
+		int finishedBlocks, remainingBlocks;
+		/// Pixel samples rendered so far, and the number that is planned in total
+		uint64_t sampleCount, totalSampleCount;
+		/// Rays and shadow rays traced so far (as counted by the integrator)
+		uint64_t rayCount, shadowRayCount;
+		/**
+		 * \brief Estimated time until the job is finished in seconds 
+		 * (negative when unknown)
+		 *
+		 * Extrapolated from the samples rendered so far. Progressive 
+		 * renderings with a noise target may finish earlier.
+		 */
+		float remainingTime;
+
+		/// Return the fraction of the planned samples that were rendered
+		inline float getProgress() const {
+			if (finished)
+				return 1.0f;
+			return totalSampleCount == 0 ? 0.0f :
+				std::min(sampleCount / (float) totalSampleCount, 1.0f);
+		}
+
+		/// Return the average number of samples per second
+		inline float getSampleRate() const {
+			return elapsed > 0 ? sampleCount * 1000.0f / elapsed : 0.0f;
+		}
+
+		/// Return the average number of rays (including shadow rays) per second
+		inline float getRayRate() const {
+			return elapsed > 0 ? (rayCount + shadowRayCount) * 1000.0f / elapsed : 0.0f;
+		}
+	};
+
+	/**
+	 * \brief Create a new render job
+	 *
+	 * \param scene
+	 *     The scene to be rendered (must stay alive until the job is done)
+	 * \param camera
+	 *     Camera to render from (\c NULL = the scene's camera)
+	 * \param sampleCount
+	 *     Samples per pixel (0 = the setting of the scene's sampler)
+	 * \param offset
+	 *     Offset of the region to be rendered
+	 * \param size
+	 *     Size of the region to be rendered (zero = up to the
+	 *     end of the camera's output image)
+	 */
+	RenderJob(const Scene *scene, const Camera *camera = NULL,
+		uint32_t sampleCount = 0, const Point2i &offset = Point2i(0, 0),
+		const Vector2i &size = Vector2i(0, 0));
+
+	/// Release all memory
+	~RenderJob();
+
+	/**
+	 * \brief Return the image block that receives the output
+	 *
+	 * The block is allocated when the job is submitted. It remains
+	 * \c NULL when the output is streamed to a file (see 
+	 * \ref setStreamingOutput())
+	 */
+	inline ImageBlock *getOutput() { return m_output; }
+
+	/// Return the image block that receives the output (const version)
+	inline const ImageBlock *getOutput() const { return m_output; }
+
+	/// Return the scene being rendered
+	inline const Scene *getScene() const { return m_scene; }
+
+	/// Return the camera used by this job
+	inline const Camera *getCamera() const { return m_camera; }
+
+	/**
+	 * \brief Only render every \c count-th block, starting with block
+	 * \c index (see \ref BlockGenerator::selectTiles())
+	 *
+	 * Must be called before submitting the job.
+	 */
+	void setTileRange(int index, int count);
+
+	/**
+	 * \brief Write the finished blocks straight into a tiled OpenEXR 
+	 * file instead of keeping the whole image in memory
+	 *
+	 * The file is complete once the job has been destroyed. This 
+	 * doesn't support progressive or adaptive rendering, or rendering
+	 * a subset of the blocks. Must be called before submitting the job.
+	 */
+	void setStreamingOutput(const QString &filename, const BitmapSaveOptions &options);
+
+	/**
+	 * \brief Periodically save the rendering state to a checkpoint file
+	 * (see \ref BlockGenerator::setCheckpoint())
+	 *
+	 * Checkpoints are written between the passes of a progressive 
+	 * rendering, which is enabled if necessary. Must be called before 
+	 * submitting the job.
+	 *
+	 * \param interval
+	 *     Minimum time between two checkpoints in seconds
+	 * \param resume
+	 *     Continue from the checkpoint file if it exists
+	 */
+	void setCheckpoint(const QString &filename, float interval, bool resume);
+
+	/**
+	 * \brief Only render the parts of the image that are affected by the
+	 * edits of the scene since the previous rendering (see \ref RenderCache)
+	 *
+	 * The rest is taken from the cache file, which is updated once the
+	 * job has been rendered completely. Must be called before 
+	 * submitting the job.
+	 */
+	void setRenderCache(const QString &filename);
+
+	/**
+	 * \brief Render progressively, taking \c samplesPerPass samples per
+	 * pixel in each pass (instead of the scene's \c samplesPerPass setting)
+	 *
+	 * Must be called before submitting the job.
+	 */
+	void setProgressive(uint32_t samplesPerPass);
+
+	/**
+	 * \brief Stop rendering the job as soon as possible
+	 *
+	 * No further blocks are handed out, and blocks in flight stop after
+	 * their current row. The job then finishes as usual (see \ref wait()),
+	 * with a partially rendered output. This function is thread-safe.
+	 */
+	void cancel();
+
+	/// Was the job cancelled (i.e. is its output incomplete once it is finished)?
+	inline bool isCancelled() const { return m_cancelled; }
+
+	/// Has the job been rendered completely (or cancelled and stopped)?
+	bool isFinished() const;
+
+	/// Wait until the job has been rendered completely
+	void wait();
+
+	/// Return the time spent rendering in milliseconds (once the job is finished)
+	inline qint64 getRenderTime() const { return m_renderTime; }
+
+	/// Return the number of samples rendered so far
+	uint64_t getSampleCount() const;
+
+	/// Return the number of rays traced so far (as counted by the integrator)
+	inline uint64_t getRayCount() const { return m_rayCount; }
+
+	/**
+	 * \brief Return a snapshot of the job's progress and throughput
+	 *
+	 * This function is thread-safe and may be called at any time after
+	 * the job was submitted. The ray counts are updated after every block.
+	 */
+	Status getStatus() const;
+
+	/// Return the number of shadow rays traced so far (as counted by the integrator)
+	inline uint64_t getShadowRayCount() const { return m_shadowRayCount; }
+
+	/**
+	 * \brief Return the work done by the acceleration data structure's
+	 * queries, summed over all threads (see 
+	 * \ref Accelerator::collectTraversalStatistics())
+	 *
+	 * Complete once the job is finished. Remains zero unless Nori is
+	 * built with \c NORI_TRAVERSAL_STATISTICS.
+	 */
+	inline const Accelerator::TraversalStatistics &getTraversalStatistics() const {
+		return m_traversal;
+	}
+
+	/**
+	 * \brief Return the path statistics recorded by the integrator,
+	 * summed over all threads (see \ref PathStatistics)
+	 *
+	 * Complete once the job is finished. Remains empty unless the
+	 * scene's \c pathStatistics property is set.
+	 */
+	inline const PathStatistics &getPathStatistics() const { return m_pathStats; }
+protected:
+	friend class RenderEngine;
+	friend class RenderWorker;
+
+	/// Allocate the output image block (called when the job is submitted)
+	void allocateOutput();
+
+	/// Set up the block generator (called when the first worker picks up the job)
+	void start(int threadCount);
+
+	/// Record the samples rendered by a thread on NUMA node \c node
+	void addSamples(int node, uint64_t sampleCount);
+
+	/// Record the ray counts collected in a thread's \ref RenderContext
+	void addRays(uint64_t rayCount, uint64_t shadowRayCount);
+
+	/// Record the traversal work of a thread's queries
+	void addTraversalStatistics(const Accelerator::TraversalStatistics &stats);
+
+	/// Record the path statistics collected by a thread
+	void addPathStatistics(const PathStatistics &stats);
+
+	/// Add a finished block to the output (image block or streamed file)
+	void put(ImageBlock &block);
+
+	/// Add the splatted contributions to the output (called once the job is done)
+	void addSplats();
+private:
+	const Scene *m_scene;
+	const Camera *m_camera;
+	uint32_t m_sampleCount;
+	int m_tileIndex, m_tileCount;
+	QString m_checkpointFilename;
+	float m_checkpointInterval;
+	bool m_resume;
+	RenderCache *m_cache;
+	uint32_t m_samplesPerPass;
+	volatile bool m_cancelled;
+	Point2i m_offset;
+	Vector2i m_size;
+	ImageBlock *m_output;
+	/// Contributions splatted by the integrator (or \c NULL)
+	ImageBlock *m_splats;
+	/// First hits of the camera rays per pixel (see \ref Scene::getPrimaryHitCache())
+	std::vector<PrimaryHit> m_primaryHits;
+	StreamingFilm *m_film;
+	BlockGenerator *m_blockGenerator;
+	RenderEngine *m_engine;
+	bool m_finished;
+	int m_users;
+	QElapsedTimer m_timer;
+	qint64 m_renderTime;
+	mutable QMutex m_statsMutex;
+	std::vector<uint64_t> m_nodeSamples;
+	uint64_t m_rayCount, m_shadowRayCount;
+	Accelerator::TraversalStatistics m_traversal;
+	PathStatistics m_pathStats;
+	/// Paging statistics when the job started (see \ref PagedMemory)
+	PagedMemory::Statistics m_pagingStart;
+	/// Statistics of the \ref VolumeCache when the job started
+	VolumeCache::Statistics m_volumeCacheStart;
+};
+
+/**
+ * \brief Renders jobs using a persistent pool of worker threads
+ *
+ * Jobs are processed in the order in which they were submitted. When
+ * the current job runs out of blocks (e.g. towards its end, or between
+ * the passes of a progressive rendering), idle workers continue with
+ * the following jobs, so that a sequence of frames (e.g. a turntable)
+ * keeps all cores busy. Worker threads, their samplers and image blocks
+ * are reused between jobs.
+ */
+class RenderEngine {
+public:
+	/**
+	 * \brief Launch the worker threads
+	 *
+	 * \param threadCount
+	 *     Number of worker threads (0 = one per core)
+	 * \param pinThreads
+	 *     Pin the workers to cores, filling one NUMA node after
+	 *     the other
+	 */
+	RenderEngine(int threadCount = 0, bool pinThreads = false);
+
+	/// Finish all submitted jobs and shut down the worker threads
+	~RenderEngine();
+
+	/**
+	 * \brief Queue a job for rendering
+	 *
+	 * The job must stay alive until it is finished (see \ref RenderJob::wait())
+	 */
+	void submit(RenderJob *job);
+
+	/// Return the number of worker threads
+	inline int getThreadCount() const { return (int) m_workers.size(); }
+protected:
+	friend class RenderJob;
+	friend class RenderWorker;
+
+	/**
+	 * \brief Return the unfinished jobs in order of submission, waiting
+	 * until there is at least one (starts jobs that are new)
+	 *
+	 * The jobs can't complete their \ref RenderJob::wait() until the 
+	 * caller hands them back using \ref releaseJobs().
+	 *
+	 * \return \c false when the engine is shutting down
+	 */
+	bool getJobs(std::vector<RenderJob *> &jobs);
+
+	/// Release jobs obtained from \ref getJobs()
+	void releaseJobs(const std::vector<RenderJob *> &jobs);
+
+	/// Mark a job as finished and remove it from the queue
+	void finished(RenderJob *job);
+
+	/// Clone a sampler (the original's random state is shared between threads)
+	Sampler *cloneSampler(Sampler *sampler);
+private:
+	std::vector<RenderWorker *> m_workers;
+	std::deque<RenderJob *> m_jobs;
+	QMutex m_mutex;
+	QWaitCondition m_jobCond, m_finishCond;
+	bool m_shutdown;
+};
+
+/**
+ * \brief Worker thread of a \ref RenderEngine
+ *
+ * This class implements the main rendering logic, which consists of
+ * fetching work from a job (in the form of rectangular image blocks
+ * to be rendered), processing it, and writing the output to the
+ * job's target buffer.
+ */
+class RenderWorker : public QThread {
+public:
+	/**
+	 * \brief Create a new worker thread
+	 *
+	 * \param core
+	 *     When nonnegative, the thread pins itself to this core and
+	 *     allocates its working memory after doing so
+	 * \param node
+	 *     NUMA node of the core (used to select node-local scene data)
+	 */
+	RenderWorker(RenderEngine *engine, int core = -1, int node = 0);
+
+	/// Release all memory
+	virtual ~RenderWorker();
+
+	/// Main rendering thread loop
+	void run();
+protected:
+	/**
+	 * \brief Fetch and render blocks of the specified job
+	 *
+	 * \param wait
+	 *     Wait for work when the job has no block available right now
+	 * \param single
+	 *     Stop after one block (used for jobs that are not first in line)
+	 *
+	 * \return \c true if at least one block was rendered
+	 */
+	bool render(RenderJob *job, bool wait, bool single);
+
+	/**
+	 * \brief Render a single block
+	 *
+	 * \param sampleCount
+	 *     Number of samples per pixel
+	 * \param firstSample
+	 *     Index of the first of these samples (see \ref Sampler::generate())
+	 * \return
+	 *     The number of pixel samples that were rendered
+	 */
+	uint64_t renderBlock(RenderJob *job, ImageBlock &block, uint32_t sampleCount,
+		uint32_t firstSample);
+
+	/**
+	 * \brief Render a block in wavefront mode: camera rays are collected
+	 * in batches of up to \ref NORI_RAY_BATCH_SIZE and handed to the
+	 * batched version of \ref Integrator::Li()
+	 */
+	uint64_t renderBatched(RenderJob *job, ImageBlock &block, uint32_t sampleCount,
+		uint32_t firstSample);
+
+	/// Compute the radiance of the rays in \ref m_rays and add them to \c block
+	void traceBatch(RenderJob *job, ImageBlock &block);
+
+	/// Hand the meshes hit while rendering \c block to the job's render cache (if any)
+	void recordHits(RenderJob *job, const ImageBlock &block);
+
+	/// Return this thread's sampler for the given scene
+	Sampler *getSampler(const Scene *scene);
+
+	/// Make sure that \ref m_context refers to the scene and camera of \c job
+	void bindContext(RenderJob *job);
+
+	/**
+	 * \brief Move the traversal work of this thread's recent queries
+	 * into \ref m_traversal and return it
+	 */
+	Accelerator::TraversalStatistics collectTraversalStatistics();
+private:
+	RenderEngine *m_engine;
+	int m_core, m_node;
+	std::map<const Sampler *, Sampler *> m_samplers;
+	ImageBlock *m_block;
+	const ReconstructionFilter *m_blockFilter;
+	int m_blockSize;
+	/// Blocks reserved by this thread (see \ref BlockGenerator::setRunLength())
+	BlockGenerator::Run m_run;
+	RenderContext *m_context;
+	/// Meshes hit by the current block (see \ref RenderJob::setRenderCache())
+	std::vector<uint32_t> m_hits;
+
+	/* Camera rays of the wavefront mode, their weights, film positions
+	   and filter weights, radiance values, and AOVs (if requested) */
+	std::vector<Ray3f> m_rays;
+	std::vector<Color3f> m_weights, m_values;
+	std::vector<Point2f> m_pixelSamples;
+	std::vector<float> m_filterWeights;
+	std::vector<AOVRecord> m_aovs;
+
+	/// Traversal work of this thread's queries that wasn't handed to the job yet
+	Accelerator::TraversalStatistics m_traversal;
+	/// Path statistics of this thread that weren't handed to the job yet
+	PathStatistics m_pathStats;
+	/// Traversal state of the camera rays of the current block
+	Accelerator::CameraRaySeed m_cameraSeed;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __RENDER_H */
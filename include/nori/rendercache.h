@@ -0,0 +1,116 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__RENDERCACHE_H)
+#define __RENDERCACHE_H
+
+#include <nori/block.h>
+
+#define NORI_RENDER_CACHE_CELL_SIZE 16 /* Edge length of the cells whose hit meshes are recorded */
+
+NORI_NAMESPACE_BEGIN
+
+class Scene;
+class Camera;
+
+/**
+ * \brief Film of a previous rendering of a scene, together with the
+ * meshes that were hit in each part of the image, so that only the
+ * parts affected by an edit are rendered again (<tt>nori --incremental</tt>)
+ *
+ * The image is divided into cells of \ref NORI_RENDER_CACHE_CELL_SIZE
+ * pixels. While rendering, every block records the meshes hit by any of
+ * its rays (see \ref Scene::setHitRecord()) into a bit set per cell.
+ * The cache file stores the unnormalized pixels of the output, the bit
+ * sets, and a key per mesh that describes its material (the BSDF and
+ * interior medium). Everything else -- geometry, luminaires, camera,
+ * integrator, sampler, global medium and instances -- makes up a global
+ * key.
+ *
+ * When the scene is rendered again and only materials have changed,
+ * the cells whose rays hit one of the changed meshes are cleared and
+ * rendered again (along with their neighbors, which received filtered
+ * samples from them), while the remaining pixels are taken from the
+ * cache. Any other change renders the whole image. Edits are detected
+ * from the description of the objects (see \ref NoriObject::toString()),
+ * hence modifying a texture file while keeping its name goes unnoticed.
+ *
+ * Deferred filtering, AOVs, integrators that splat or that need a pass
+ * over the whole image, and tile ranges are not supported.
+ */
+class RenderCache {
+public:
+	/**
+	 * \brief Prepare the cache of a region of the image of \c camera
+	 *
+	 * \param sampleCount
+	 *     Samples per pixel of the rendering (part of the global key)
+	 */
+	RenderCache(const Scene *scene, const Camera *camera, const QString &filename,
+		const Point2i &offset, const Vector2i &size, uint32_t sampleCount);
+
+	/**
+	 * \brief Load the cache file and copy the pixels that remain valid
+	 * into \c output (the others are cleared)
+	 *
+	 * \return \c false if there is no usable cache, i.e. everything has
+	 *     to be rendered
+	 */
+	bool load(ImageBlock *output);
+
+	/// Must the block with the given offset (in the image) and size be rendered?
+	bool isDirty(const Point2i &offset, const Vector2i &size) const;
+
+	/// Return the number of words of a bit set with one bit per mesh
+	inline size_t getWordCount() const { return m_wordCount; }
+
+	/**
+	 * \brief Record the meshes hit while rendering a block (thread-safe)
+	 *
+	 * \param hits
+	 *     Bit set of the meshes (see \ref getWordCount())
+	 */
+	void record(const Point2i &offset, const Vector2i &size,
+		const std::vector<uint32_t> &hits);
+
+	/// Write the cache file for the rendered \c output
+	void save(const ImageBlock *output);
+protected:
+	/// Compute the keys of the scene's materials and of everything else
+	void computeKeys(const Scene *scene, const Camera *camera, uint32_t sampleCount);
+
+	/// Return the range of cells covered by a block (end exclusive)
+	void getCells(const Point2i &offset, const Vector2i &size,
+		Point2i &start, Point2i &end) const;
+private:
+	QString m_filename;
+	Point2i m_offset;
+	Vector2i m_size, m_cellCount;
+	size_t m_wordCount;
+	uint64_t m_globalKey;
+	std::vector<uint64_t> m_meshKeys;
+	/// Bit sets of the meshes hit in every cell
+	std::vector<uint32_t> m_hits;
+	/// Cells to be rendered (empty = all of them)
+	std::vector<uint8_t> m_dirty;
+	QMutex m_mutex;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __RENDERCACHE_H */
@@ -21,8 +21,8 @@
 
 #include <nori/object.h>
 
-/// Reconstruction filters will be tabulated at this resolution
-#define NORI_FILTER_RESOLUTION 32
+/// Reconstruction filters will be tabulated for this many subpixel offsets per pixel
+#define NORI_FILTER_RESOLUTION 64
 
 NORI_NAMESPACE_BEGIN
 
@@ -40,9 +40,44 @@ NORI_NAMESPACE_BEGIN
  */
 class ReconstructionFilter : public NoriObject {
 public:
+	/// Create a filter that is applied while rendering
+	inline ReconstructionFilter() : m_deferred(false), m_sampled(false) { }
+
 	/// Return the filter radius in fractional pixels
 	inline float getRadius() const { return m_radius; }
 
+	/**
+	 * \brief Is the filter applied in a separate pass once the image
+	 * is rendered, instead of to every sample (see \ref ImageBlock)?
+	 *
+	 * Given by the \c deferred property of the wide filters. This is 
+	 * much cheaper per sample when the radius is large.
+	 */
+	inline bool isDeferred() const { return m_deferred; }
+
+	/**
+	 * \brief Is the filter importance sampled?
+	 *
+	 * Given by the \c sampled property of the wide filters. The film
+	 * positions of a pixel's samples are then distributed like the 
+	 * filter (see \ref sampleOffset()), and every sample only 
+	 * contributes to its own pixel, weighted by the sign of the filter.
+	 */
+	inline bool isSampled() const { return m_sampled; }
+
+	/**
+	 * \brief Map a uniformly distributed sample to an offset from the
+	 * center of a pixel that is distributed like the filter (or rather,
+	 * its absolute value)
+	 *
+	 * \param weight
+	 *     Returns the sign of the filter at the offset (+1 or -1)
+	 */
+	Point2f sampleOffset(const Point2f &sample, float &weight) const;
+
+	/// Tabulate the filter for \ref sampleOffset() (if it is sampled)
+	void activate();
+
 	/// Evaluate the filter function
 	virtual float eval(float x) const = 0;
 
@@ -52,7 +87,14 @@ public:
 	 * */
 	EClassType getClassType() const { return EReconstructionFilter; }
 protected:
+	/// Sample one coordinate of \ref sampleOffset()
+	float sampleOffset(float sample, float &weight) const;
+
 	float m_radius;
+	bool m_deferred, m_sampled;
+	/* Tabulated filter and the cumulative distribution of its absolute
+	   value, NORI_FILTER_RESOLUTION entries per pixel over [-radius, radius] */
+	std::vector<float> m_values, m_cdf;
 };
 
 NORI_NAMESPACE_END
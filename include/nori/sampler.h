@@ -20,6 +20,7 @@
 #define __SAMPLER_H
 
 #include <nori/object.h>
+#include <nori/arena.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -78,8 +79,19 @@ public:
 	 * 
 	 * This function is called initially and every time the 
 	 * integrator starts rendering a new pixel.
+	 *
+	 * Implementations must derive their random state from the sampler's
+	 * seed, the pixel, and the sample index alone. This makes renderings
+	 * reproducible, regardless of the number of threads and of which
+	 * thread renders which pixel.
+	 *
+	 * \param pixel
+	 *    Integer coordinates of the pixel in the output image
+	 * \param firstSample
+	 *    Index of the first sample to be generated (when the samples 
+	 *    of a pixel are taken in several passes)
 	 */
-	virtual void generate() = 0;
+	virtual void generate(const Point2i &pixel, uint32_t firstSample = 0) = 0;
 
 	/// Advance to the next sample
 	virtual void advance() = 0;
@@ -90,16 +102,104 @@ public:
 	/// Retrieve the next two component values from the current sample
 	virtual Point2f next2D() = 0;
 
+	/**
+	 * \brief Retrieve \c count consecutive results of \ref next1D() at once
+	 *
+	 * Rendering code that knows how many values it needs (e.g. the 
+	 * camera samples of all pixel samples of a pixel) should prefer
+	 * this function, since it replaces \c count virtual calls by one and 
+	 * lets implementations generate the values in bulk. The default 
+	 * implementation simply calls \ref next1D() repeatedly.
+	 */
+	virtual void next1DArray(float *values, size_t count) {
+		for (size_t i=0; i<count; ++i)
+			values[i] = next1D();
+	}
+
+	/// Retrieve \c count consecutive results of \ref next2D() at once (see \ref next1DArray())
+	virtual void next2DArray(Point2f *values, size_t count) {
+		for (size_t i=0; i<count; ++i)
+			values[i] = next2D();
+	}
+
 	/// Return the number of configured pixel samples
 	virtual inline size_t getSampleCount() const { return m_sampleCount; }
 
+	/**
+	 * \brief Return an arena for temporary allocations made while 
+	 * computing pixel samples (e.g. by \ref Integrator::Li())
+	 *
+	 * Since every thread has its own sampler, this requires no locking. 
+	 * The render threads reset the arena after every image block.
+	 */
+	inline MemoryArena &getArena() { return m_arena; }
+
+	/// Return the seed that is combined with the pixel coordinates
+	inline uint64_t getSeed() const { return m_seed; }
+
+	/**
+	 * \brief Return the target relative standard error of the pixels 
+	 * for adaptive sampling (0 = disabled)
+	 *
+	 * When set, the samples are taken in several passes. Pixels that
+	 * reached the target stop receiving samples, and the remaining
+	 * budget of \ref getSampleCount() samples per pixel on average is
+	 * spent on the noisy ones, up to \ref getMaxSampleCount() each.
+	 */
+	inline float getTargetError() const { return m_targetError; }
+
+	/// Return the maximum number of samples per pixel for adaptive sampling
+	inline size_t getMaxSampleCount() const { return m_maxSampleCount; }
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
 	 * provided by this instance
 	 * */
 	EClassType getClassType() const { return ESampler; }
+protected:
+	/**
+	 * \brief Read the properties shared by all samplers
+	 * (\c sampleCount, \c seed, \c targetError, and \c maxSampleCount)
+	 */
+	void configure(const PropertyList &propList) {
+		int sampleCount = propList.getInteger("sampleCount", 1);
+		if (sampleCount <= 0)
+			throw NoriException("The sample count must be positive!");
+		m_sampleCount = (size_t) sampleCount;
+		m_seed = (uint64_t) propList.getInteger("seed", 0);
+		m_targetError = propList.getFloat("targetError", 0.0f);
+		int maxSampleCount = propList.getInteger("maxSampleCount", 4 * sampleCount);
+		if (m_targetError < 0 || maxSampleCount < sampleCount)
+			throw NoriException("Invalid adaptive sampling parameters!");
+		m_maxSampleCount = (size_t) maxSampleCount;
+	}
+
+	/// Copy the properties read by \ref configure() (used by \ref clone())
+	void copySettings(const Sampler *other) {
+		m_sampleCount = other->m_sampleCount;
+		m_seed = other->m_seed;
+		m_targetError = other->m_targetError;
+		m_maxSampleCount = other->m_maxSampleCount;
+	}
+
+	/// Hash the seed, a pixel and an integer into a 64-bit value
+	inline uint64_t hashPixel(const Point2i &pixel, uint64_t value = 0) const {
+		uint64_t key = ((uint64_t) (uint32_t) pixel.y() << 32) | (uint32_t) pixel.x();
+		return mix64(mix64(m_seed ^ key) + 0x9e3779b97f4a7c15ULL * (1 + value));
+	}
+
+	/// Finalizer of the SplitMix64 generator
+	static inline uint64_t mix64(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
 protected:
 	size_t m_sampleCount;
+	uint64_t m_seed;
+	float m_targetError;
+	size_t m_maxSampleCount;
+	MemoryArena m_arena;
 };
 
 NORI_NAMESPACE_END
@@ -19,10 +19,23 @@
 #if !defined(__SCENE_H)
 #define __SCENE_H
 
-#include <nori/kdtree.h>
+#include <nori/accel.h>
+#include <nori/bitmap.h>
+#include <nori/block.h>
+#include <nori/medium.h>
+#include <nori/luminaire.h>
+#include <nori/dpdf.h>
+#include <nori/memreport.h>
+#include <QAtomicPointer>
+#include <QThreadStorage>
 
 NORI_NAMESPACE_BEGIN
 
+class BottomLevelBuildThread;
+class KDTree;
+class LightBVH;
+class AccelBuildThread;
+
 /**
  * \brief Main scene data structure
  *
@@ -38,14 +51,45 @@ public:
 	/// Release all memory
 	virtual ~Scene();
 
-	/// Return a pointer to the scene's kd-tree
-	inline const KDTree *getKDTree() const { return m_kdtree; }
+	/**
+	 * \brief Return a pointer to the scene's ray intersection acceleration 
+	 * data structure (possibly the preview, see the \c previewAccel property)
+	 */
+	inline const Accelerator *getAccelerator() const { return m_activeAccel; }
+
+	/**
+	 * \brief Build an additional acceleration data structure of the given
+	 * type (see the \c accel property) over the meshes of the scene
+	 *
+	 * The caller owns the result, which doesn't own the meshes. Used to
+	 * compare data structures on the same scene (see \c raybench). Scenes
+	 * with instances are not supported.
+	 */
+	Accelerator *buildAccelerator(const QString &type) const;
+
+	/**
+	 * \brief Apply the kd-tree construction and traversal settings of the
+	 * scene (the \c kd* properties) to a tree
+	 *
+	 * Used for the scene's own trees and by \c raybench when tuning the
+	 * construction parameters.
+	 */
+	void configureKDTree(KDTree *kdtree) const;
 
 	/// Return a pointer to the scene's integrator
 	inline const Integrator *getIntegrator() const { return m_integrator; }
 	
-	/// Return a pointer to the scene's camera
+	/// Return a pointer to the scene's camera (the first one, if there are several)
 	inline const Camera *getCamera() const { return m_camera; }
+
+	/**
+	 * \brief Return all cameras of the scene in the order of declaration
+	 *
+	 * A scene with several cameras is rendered as a multi-view image 
+	 * (e.g. a stereo pair), whose views share the scene, the worker 
+	 * threads and the integrator's caches.
+	 */
+	inline const std::vector<Camera *> &getCameras() const { return m_cameras; }
 	
 	/// Return a pointer to the scene's sample generator (const version)
 	inline const Sampler *getSampler() const { return m_sampler; }
@@ -53,12 +97,171 @@ public:
 	/// Return a pointer to the scene's sample generator
 	inline Sampler *getSampler() { return m_sampler; }
 
-	/// Return a pointer to the scene's medium (if any)
+	/// Return a pointer to the scene's medium (if any), which surrounds all meshes
 	inline const Medium *getMedium() const { return m_medium; }
 
+	/// Return the environment luminaire (if any), which is seen by rays that leave the scene
+	inline const Luminaire *getEnvironmentLuminaire() const { return m_environment; }
+
+	/**
+	 * \brief Return the size of the image blocks used for parallel 
+	 * rendering (\c blockSize property)
+	 *
+	 * A value of zero means that the size should be chosen 
+	 * automatically (see \ref BlockGenerator::autoBlockSize())
+	 */
+	inline int getBlockSize() const { return m_blockSize; }
+
+	/// Return the order of the image blocks (\c blockOrder property)
+	inline BlockGenerator::EBlockOrder getBlockOrder() const { return m_blockOrder; }
+
+	/**
+	 * \brief Return the number of consecutive blocks that a render thread
+	 * may reserve at once (\c blockRunLength property, see
+	 * \ref BlockGenerator::setRunLength())
+	 */
+	inline int getBlockRunLength() const { return m_blockRunLength; }
+
+	/**
+	 * \brief Are the samples jittered within their pixels? (\c pixelJitter
+	 * property; otherwise they are taken at the pixel centers)
+	 */
+	inline bool getPixelJitter() const { return m_pixelJitter; }
+
+	/**
+	 * \brief Are the first hits of the camera rays cached per pixel? 
+	 * (\c primaryHitCache property, see \ref RenderContext::rayIntersect())
+	 */
+	inline bool getPrimaryHitCache() const { return m_primaryHitCache; }
+
+	/**
+	 * \brief Do the camera rays of a block start their traversal at the
+	 * leaf of the camera? (\c seedCameraRays property, see
+	 * \ref Accelerator::prepareCameraRays())
+	 */
+	inline bool getSeedCameraRays() const { return m_seedCameraRays; }
+
+	/**
+	 * \brief Do the integrators record statistics about their paths?
+	 * (\c pathStatistics property, see \ref PathStatistics)
+	 */
+	inline bool getPathStatistics() const { return m_pathStatistics; }
+
+	/**
+	 * \brief Return the number of samples per pixel taken in each
+	 * pass of a progressive rendering (\c samplesPerPass property)
+	 *
+	 * Zero means that every block is rendered with all samples at once
+	 */
+	inline uint32_t getSamplesPerPass() const { return m_samplesPerPass; }
+
+	/// Return the time limit of a progressive rendering in seconds (0 = none)
+	inline float getTimeLimit() const { return m_timeLimit; }
+
+	/**
+	 * \brief Return the wall-clock budget of a rendering in seconds
+	 * (0 = none, see \ref BlockGenerator::setTimeBudget())
+	 */
+	inline float getTimeBudget() const { return m_timeBudget; }
+
+	/// Return the noise level at which a progressive rendering stops (0 = never)
+	inline float getTargetNoise() const { return m_targetNoise; }
+
+	/**
+	 * \brief Should meshes that load the same file with the same parameters
+	 * (apart from \c toWorld) be turned into instances of one shared mesh?
+	 * (\c shareMeshes property, see \ref loadScene())
+	 */
+	inline bool getShareMeshes() const { return m_shareMeshes; }
+
+	/// Should render threads be pinned to individual cores? (\c pinThreads property)
+	inline bool getPinThreads() const { return m_pinThreads; }
+
+	/// Return the time between checkpoints in seconds (0 = disabled, \c checkpointInterval property)
+	inline float getCheckpointInterval() const { return m_checkpointInterval; }
+
+	/**
+	 * \brief Return how the rendered image is written to disk 
+	 * (\c exrHalf, \c exrCompression, \c exrTileSize, \c preview and
+	 * \c previewExposure properties)
+	 */
+	inline const BitmapSaveOptions &getOutputOptions() const { return m_outputOptions; }
+
+	/**
+	 * \brief Should finished blocks be written straight into a tiled EXR
+	 * file instead of keeping the image in memory? (\c streamOutput property)
+	 */
+	inline bool getStreamOutput() const { return m_streamOutput; }
+
+	/**
+	 * \brief Return the auxiliary images that are rendered along with
+	 * the radiance (a combination of \ref EAOV flags, \c aovs property)
+	 */
+	inline int getAOVs() const { return m_aovs; }
+
+	/**
+	 * \brief Should the final image be denoised? (\c denoise property)
+	 *
+	 * This requires the job's output to store AOVs, even if none
+	 * of them are written to disk
+	 */
+	inline bool getDenoise() const { return m_denoise; }
+
+	/// Return the radius of the denoising filter in pixels (\c denoiseRadius property)
+	inline int getDenoiseRadius() const { return m_denoiseRadius; }
+
+	/// Return the color tolerance of the denoiser (\c denoiseStrength property)
+	inline float getDenoiseStrength() const { return m_denoiseStrength; }
+
 	/// Return a reference to an array containing all meshes
 	inline const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+	/// Return the instances of the scene
+	inline const std::vector<Instance *> &getInstances() const { return m_instances; }
+
+	/// Return the luminaires of the scene (with nonzero power)
+	inline const std::vector<const Luminaire *> &getLuminaires() const { return m_luminaires; }
+
+	/**
+	 * \brief Choose a luminaire proportional to its power, and sample
+	 * a position on it that illuminates \c lRec.ref
+	 *
+	 * Choosing a luminaire only costs a binary search, so that scenes
+	 * with many luminaires don't need more time per sample. Unless the
+	 * \c lightSampling property is \c "power", the emitting triangles of
+	 * all meshes are chosen together based on their estimated contribution
+	 * to \c lRec.ref instead (see \ref LightBVH), which is the better
+	 * choice when the scene contains many, or large, emitting meshes.
+	 *
+	 * \return The emitted radiance divided by the probability density
+	 *    of the sample (stored in \c lRec.pdf), i.e. including the 
+	 *    probability of choosing the luminaire. Zero if sampling failed
+	 *    or the scene doesn't contain any luminaires.
+	 */
+	Color3f sampleLuminaire(LuminaireQueryRecord &lRec, const Point2f &sample) const;
+
+	/**
+	 * \brief Return the probability density of sampling \c lRec.p on 
+	 * \c lRec.luminaire using \ref sampleLuminaire() (with respect to
+	 * solid angles at \c lRec.ref)
+	 *
+	 * For positions on a mesh, \c lRec.triangle must be set.
+	 */
+	float pdfLuminaire(const LuminaireQueryRecord &lRec) const;
+
+	/**
+	 * \brief Choose a luminaire proportional to its power, and sample 
+	 * a ray leaving it (see \ref Luminaire::sampleRay())
+	 *
+	 * The first dimension of \c positionSample is reused to choose the
+	 * luminaire. \c lRec.pdf includes the probability of the choice.
+	 *
+	 * \return The weight of the ray, or zero if sampling failed or the
+	 *    scene doesn't contain any luminaires
+	 */
+	Color3f sampleEmission(LuminaireQueryRecord &lRec, Ray3f &ray,
+		const Point2f &positionSample, const Point2f &directionSample) const;
+
 	/**
 	 * \brief Intersect a ray against all triangles stored in the scene
 	 * and return detailed intersection information
@@ -69,12 +272,40 @@ public:
 	 *
 	 * \param its
 	 *    A detailed intersection record, which will be filled by the
-	 *    intersection query
+	 *    intersection query. Only the hit distance, mesh, triangle index
+	 *    and barycentric coordinates are available right away -- call
+	 *    \ref Intersection::computeDifferentialGeometry() before
+	 *    accessing the position, texture coordinates or frames.
 	 *
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-		return m_kdtree->rayIntersect(ray, its, false);
+		bool hit = getLocalAccelerator()->rayIntersect(ray, its, false);
+		if (m_recordHits && hit)
+			recordHit(its.mesh);
+		return hit;
+	}
+
+	/**
+	 * \brief Intersect a camera ray, starting from the traversal state
+	 * that it shares with the other rays of its block (see
+	 * \ref Accelerator::rayIntersectSeeded())
+	 */
+	inline bool rayIntersect(const Ray3f &ray, Intersection &its,
+			const Accelerator::CameraRaySeed &seed) const {
+		bool hit = getLocalAccelerator()->rayIntersectSeeded(ray, its, seed);
+		if (m_recordHits && hit)
+			recordHit(its.mesh);
+		return hit;
+	}
+
+	/**
+	 * \brief Prepare the traversal of the camera rays of a block (see
+	 * \ref Accelerator::prepareCameraRays())
+	 */
+	inline bool prepareCameraRays(const Point3f &origin, const Vector3f *corners,
+			Accelerator::CameraRaySeed &seed) const {
+		return getLocalAccelerator()->prepareCameraRays(origin, corners, seed);
 	}
 
 	/**
@@ -93,8 +324,60 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray3f &ray) const {
-		Intersection its; /* Unused */
-		return m_kdtree->rayIntersect(ray, its, true);
+		return getLocalAccelerator()->rayOccluded(ray);
+	}
+
+	/**
+	 * \brief Intersect a packet of \ref NORI_PACKET_SIZE coherent rays
+	 * (e.g. neighboring camera rays) against the scene
+	 *
+	 * \param rays
+	 *    Array of \ref NORI_PACKET_SIZE rays
+	 *
+	 * \param its
+	 *    Array of \ref NORI_PACKET_SIZE intersection records
+	 *
+	 * \param shadowRay
+	 *    Only determine whether there is an intersection, without
+	 *    filling in the intersection records
+	 *
+	 * \return A bit mask, whose i-th bit is set when ray \c i hit
+	 *    something
+	 */
+	inline int rayIntersectPacket(const Ray3f *rays, Intersection *its,
+			bool shadowRay = false) const {
+		int hits = getLocalAccelerator()->rayIntersectPacket(rays, its, shadowRay);
+		if (m_recordHits && !shadowRay) {
+			for (int i=0; i<NORI_PACKET_SIZE; ++i)
+				if (hits & (1 << i))
+					recordHit(its[i].mesh);
+		}
+		return hits;
+	}
+
+	/**
+	 * \brief Intersect a batch of rays against the scene (see 
+	 * \ref Accelerator::rayIntersectBatch())
+	 */
+	inline void rayIntersectBatch(const Ray3f *rays, const uint32_t *indices,
+			uint32_t count, Intersection *its, bool *hit) const {
+		getLocalAccelerator()->rayIntersectBatch(rays, indices, count, its, hit);
+		if (m_recordHits) {
+			for (uint32_t k=0; k<count; ++k) {
+				uint32_t i = indices ? indices[k] : k;
+				if (hit[i])
+					recordHit(its[i].mesh);
+			}
+		}
+	}
+
+	/**
+	 * \brief Determine whether the ray segments of a batch are occluded
+	 * (see \ref Accelerator::rayOccludedBatch())
+	 */
+	inline void rayIntersectBatch(const Ray3f *rays, const uint32_t *indices,
+			uint32_t count, bool *occluded) const {
+		getLocalAccelerator()->rayOccludedBatch(rays, indices, count, occluded);
 	}
 
  	/**
@@ -139,13 +422,123 @@ public:
 	 */
 	Color3f evalTransmittance(const Ray3f &ray, Sampler *sampler) const;
 
+	/**
+	 * \brief Importance sample the distance to the next medium interaction 
+	 * within the medium on top of a \ref MediumStack
+	 *
+	 * Like the above, but for scenes whose meshes bound media. Paths
+	 * start with the stack <tt>MediumStack(scene->getMedium())</tt>, and
+	 * call \ref MediumStack::update() whenever they pass through a 
+	 * surface. In vacuum, this returns immediately.
+	 */
+	inline bool sampleDistance(const Ray3f &ray, Sampler *sampler, float &t, 
+			Color3f &weight, const MediumStack &media) const {
+		if (!media.top()) {
+			weight = Color3f(1.0f);
+			return false;
+		}
+		return media.top()->sampleDistance(ray, sampler, t, weight);
+	}
+
+	/**
+	 * \brief Evaluate the transmittance along a path segment within the 
+	 * medium on top of a \ref MediumStack
+	 *
+	 * The segment is assumed not to cross any medium boundary (as is the 
+	 * case for unoccluded segments, since boundaries are surfaces).
+	 */
+	inline Color3f evalTransmittance(const Ray3f &ray, Sampler *sampler,
+			const MediumStack &media) const {
+		if (!media.top())
+			return Color3f(1.0f);
+		return media.top()->evalTransmittance(ray, sampler);
+	}
+
+	/**
+	 * \brief Determine the visibility along a shadow ray and the
+	 * transmittance of the media it passes through in one query
+	 *
+	 * Returns zero as soon as the segment turns out to be occluded, so
+	 * that the media are only evaluated along unoccluded segments.
+	 * Surfaces with a \c null BSDF (see \ref BSDF::isNull()) don't
+	 * occlude the ray: it is traced through them, and the media are
+	 * switched as it crosses them (starting with those in \c media).
+	 */
+	Color3f evalVisibilityTransmittance(const Ray3f &ray, Sampler *sampler,
+		const MediumStack &media) const;
+
+	/// Spectral version of \ref sampleDistance() (see \ref Medium::sampleSpectralDistance())
+	inline bool sampleSpectralDistance(const Ray3f &ray, Sampler *sampler,
+			const Wavelengths &wl, float &t, Spectrum4f &weight, const MediumStack &media) const {
+		if (!media.top()) {
+			weight = Spectrum4f(1.0f);
+			return false;
+		}
+		return media.top()->sampleSpectralDistance(ray, sampler, wl, t, weight);
+	}
+
+	/// Spectral version of \ref evalTransmittance()
+	inline Spectrum4f evalSpectralTransmittance(const Ray3f &ray, Sampler *sampler,
+			const Wavelengths &wl, const MediumStack &media) const {
+		if (!media.top())
+			return Spectrum4f(1.0f);
+		return media.top()->evalSpectralTransmittance(ray, sampler, wl);
+	}
+
+	/// Spectral version of \ref evalVisibilityTransmittance()
+	Spectrum4f evalSpectralVisibilityTransmittance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl, const MediumStack &media) const;
+
+	/// Does the scene contain surfaces with a \c null BSDF?
+	inline bool hasNullInterfaces() const { return m_hasNullInterfaces; }
+
+	/// Does the scene contain participating media (including those of mesh interiors)?
+	inline bool hasMedia() const { return m_hasMedia; }
+
+	/// Does the scene contain media that emit light (see \ref Medium::getLuminaire())?
+	inline bool hasVolumeEmission() const { return m_hasVolumeEmission; }
+
 	/**
 	 * \brief Return an axis-aligned box that bounds the scene
 	 */
 	inline const BoundingBox3f &getBoundingBox() const {
-		return m_kdtree->getBoundingBox();
+		return getAccelerator()->getBoundingBox();
 	}
 
+	/**
+	 * \brief Update the acceleration data structure after the vertex
+	 * positions of one or more meshes have changed
+	 *
+	 * Call this after \ref Mesh::setVertexPositions() (e.g. once per 
+	 * frame of an animation). A BVH is refitted unless its quality has 
+	 * degraded past the \c refitThreshold property (1.5 by default, see
+	 * \ref BVH::setRefitThreshold()). A kd-tree is always rebuilt.
+	 */
+	void updateGeometry();
+
+	/**
+	 * \brief Take over the meshes, instances and built acceleration data
+	 * structure of another scene
+	 *
+	 * This only succeeds when both scenes have the same geometry key (see
+	 * \ref setGeometryKey()) and acceleration data structure settings. It
+	 * must be called before \ref activate() and replaces adding meshes and
+	 * instances. Afterwards, \c other is left without geometry and may
+	 * only be released.
+	 *
+	 * \return \c true if the geometry was taken over
+	 */
+	bool adoptGeometry(Scene *other);
+
+	/**
+	 * \brief Set a key that identifies the meshes and instances of the
+	 * scene, e.g. their serialized parameters (see \ref loadScene())
+	 */
+	inline void setGeometryKey(const QByteArray &key) { m_geometryKey = key; }
+
+	/// Return the key that identifies the geometry (see \ref setGeometryKey())
+	inline const QByteArray &getGeometryKey() const { return m_geometryKey; }
+
 	/**
 	 * \brief Inherited from \ref NoriObject::activate()
 	 *
@@ -157,17 +550,144 @@ public:
 	/// Add a child object to the scene (meshes, integrators etc.)
 	void addChild(NoriObject *obj);
 
+	/**
+	 * \brief Report the memory of the scene's objects, and estimate that
+	 * of the film and of the blocks and samplers of the render threads
+	 * (which are only allocated once rendering starts)
+	 */
+	void reportMemory(MemoryReport &report) const;
+
+	/// Return the memory report that was made by \ref activate()
+	inline const MemoryReport &getMemoryReport() const { return m_memoryReport; }
+
+	/**
+	 * \brief Record the meshes hit by the rays of the calling thread
+	 * (e.g. to find out which parts of an image depend on a mesh)
+	 *
+	 * Until recording is stopped by passing \c NULL, every mesh found 
+	 * by \ref rayIntersect() (and its packet and batch versions) sets
+	 * the bit of its ID (see \ref Mesh::getID()) in \c hits, which must
+	 * have a bit for every mesh. Meshes that are only referenced by 
+	 * instances aren't recorded, and neither are shadow rays.
+	 */
+	void setHitRecord(std::vector<uint32_t> *hits) const;
+
 	/// Return a brief string summary of the instance (for debugging purposes)
 	QString toString() const;
 
 	EClassType getClassType() const { return EScene; }
+private:
+	/// Record a hit of the calling thread (see \ref setHitRecord())
+	void recordHit(const Mesh *mesh) const;
+
+	/// Build the acceleration data structure (and its preview or replicas)
+	void buildAccelerator();
+
+	/**
+	 * \brief Instantiate an acceleration data structure of the given type
+	 * (by default the one selected by the \c accel property)
+	 */
+	Accelerator *createAccelerator(const QString &cacheFilename = "",
+		const QString &type = "") const;
+
+	/**
+	 * \brief Return the acceleration data structure for the NUMA node 
+	 * of the calling thread (see \ref setThreadNode())
+	 */
+	inline const Accelerator *getLocalAccelerator() const {
+		return m_replicas.empty() ? (const Accelerator *) m_activeAccel : m_replicas[getThreadNode()];
+	}
+
+	/// Build a copy of the acceleration data structure in the memory of each NUMA node
+	void buildReplicas();
+
+	/**
+	 * \brief Start building the bottom-level structure of an instanced
+	 * mesh in the background (unless this has already happened)
+	 *
+	 * This is done as soon as the mesh is added, so that the build 
+	 * overlaps the loading of the remaining meshes
+	 */
+	void buildBottomLevel(Mesh *mesh);
+
+	/**
+	 * \brief Choose the level of detail of every instance from its
+	 * distance to the camera (see \ref Instance::selectCameraLOD())
+	 */
+	void selectInstanceLODs();
+
+	/// Wait until the full-quality structure has replaced the preview (if any)
+	void waitForAccel();
+
+	/**
+	 * \brief Collect the luminaires, and prepare the distributions used
+	 * to choose between them (including the light BVH)
+	 */
+	void prepareLuminaires();
 private:
 	std::vector<Mesh *> m_meshes;
+	std::vector<const Luminaire *> m_luminaires;
+	DiscretePDF m_luminairePDF;
+	/// Luminaires chosen by \ref sampleLuminaire() (\c NULL = the triangles in \ref m_lightBVH)
+	std::vector<const Luminaire *> m_directLuminaires;
+	DiscretePDF m_directPDF;
+	LightBVH *m_lightBVH;
+	bool m_useLightBVH;
 	Integrator *m_integrator;
 	Sampler *m_sampler;
 	Camera *m_camera;
+	std::vector<Camera *> m_cameras;
 	Medium *m_medium;
-	KDTree *m_kdtree;
+	Luminaire *m_environment;
+	std::vector<Instance *> m_instances;
+	std::vector<BottomLevelBuildThread *> m_bottomLevelBuilds;
+	Accelerator *m_accel;
+	/// Structure used for ray queries (\ref m_accel or \ref m_previewAccel)
+	QAtomicPointer<const Accelerator> m_activeAccel;
+	/// Quickly built structure used until \ref m_accel is ready (or \c NULL)
+	Accelerator *m_previewAccel;
+	AccelBuildThread *m_accelBuild;
+	std::vector<Accelerator *> m_replicas;
+	QString m_accelType;
+	/// Properties of the scene, passed on to accelerator plug-ins
+	PropertyList m_accelProps;
+	int m_kdBuildQuality;
+	int m_kdMaxBuildMemory;
+	bool m_kdMailboxing;
+	QString m_kdMetrics;
+	float m_kdShortRayLength;
+	int m_kdShortRayResolution;
+	float m_kdTraversalCost, m_kdQueryCost, m_kdEmptySpaceBonus;
+	int m_kdStopPrims, m_kdMaxBadRefines, m_kdExactPrimThreshold;
+	float m_kdSplitThreshold, m_kdSplitBudget;
+	float m_refitThreshold;
+	int m_blockSize;
+	BlockGenerator::EBlockOrder m_blockOrder;
+	int m_blockRunLength;
+	bool m_pixelJitter, m_primaryHitCache, m_seedCameraRays;
+	bool m_pathStatistics;
+	uint32_t m_samplesPerPass;
+	float m_timeLimit, m_targetNoise, m_timeBudget;
+	float m_checkpointInterval;
+	bool m_pinThreads, m_replicateAccel;
+	bool m_shareMeshes;
+	bool m_outOfCore;
+	bool m_perMeshAccel, m_usePreviewAccel;
+	bool m_hasNullInterfaces, m_hasMedia, m_hasVolumeEmission;
+	QByteArray m_geometryKey;
+	/// Hit records of the threads (see \ref setHitRecord())
+	mutable QThreadStorage<std::vector<uint32_t> **> m_hitRecords;
+	/// Has any thread started recording hits?
+	mutable volatile bool m_recordHits;
+	/// Were the meshes and acceleration data structure taken over from another scene?
+	bool m_adoptedGeometry;
+	BitmapSaveOptions m_outputOptions;
+	bool m_streamOutput;
+	int m_aovs;
+	bool m_denoise;
+	int m_denoiseRadius;
+	float m_denoiseStrength;
+	MemoryReport m_memoryReport;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,184 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SDTREE_H)
+#define __SDTREE_H
+
+#include <nori/bbox.h>
+
+/// Maximum depth of the directional quadtrees of an \ref SDTree
+#define NORI_DTREE_MAX_DEPTH 20
+
+/// Maximum depth of the spatial binary tree of an \ref SDTree
+#define NORI_SDTREE_MAX_DEPTH 32
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Quadtree over the square of cylindrical coordinates
+ * \f$(\frac{\cos\theta + 1}{2}, \frac{\phi}{2\pi})\f$ of the sphere of
+ * directions, which stores the radiance that arrived from each region
+ *
+ * Since the mapping preserves areas, the density of a direction is the
+ * density on the square divided by \f$4\pi\f$. Every node stores the
+ * sums of its four quadrants, and a recorded sample is added to the
+ * quadrant at every level along its path (using atomic additions, so
+ * that several threads can record at the same time).
+ */
+class DTree {
+public:
+	/// Create a tree that consists of an empty root node
+	DTree();
+
+	/// Add \c value to the quadrants containing the point \c p (thread-safe)
+	void record(const Point2f &p, float value);
+
+	/// Sample a point proportional to the recorded values
+	Point2f sample(const Point2f &sample) const;
+
+	/// Return the density of sampling \c p (wrt. the unit square)
+	float pdf(const Point2f &p) const;
+
+	/// Return the sum of all recorded values
+	inline float getTotal() const {
+		const Node &root = m_nodes[0];
+		return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+	}
+
+	/**
+	 * \brief Create an empty tree whose nodes are subdivided wherever
+	 * they receive more than \c threshold of the total value of this tree
+	 */
+	void refine(float threshold, DTree &result) const;
+
+	/// Return the number of nodes
+	inline size_t getNodeCount() const { return m_nodes.size(); }
+private:
+	struct Node {
+		/// Sums of the quadrants (indexed by x + 2y)
+		float sum[4];
+		/// Indices of the child nodes (zero = the quadrant is a leaf)
+		uint32_t children[4];
+
+		Node() {
+			for (int i=0; i<4; ++i) {
+				sum[i] = 0.0f;
+				children[i] = 0;
+			}
+		}
+	};
+
+	std::vector<Node> m_nodes;
+};
+
+/**
+ * \brief Leaf of the spatial binary tree of an \ref SDTree: the learned
+ * directional distribution of a region, and the one being recorded
+ */
+struct SDTreeLeaf {
+	/// Distribution learned in the previous pass (read-only during a pass)
+	DTree sampling;
+	/// Distribution that records the radiance of the current pass
+	DTree building;
+	/// Number of samples recorded in the current pass
+	float sampleCount;
+	/**
+	 * \brief Mean luminance of the radiance that left the region toward
+	 * the paths, learned in the previous pass (zero = unknown)
+	 */
+	float reflected;
+	/// Sum and number of the reflected radiance samples of the current pass
+	float reflectedSum, reflectedCount;
+
+	inline SDTreeLeaf() : sampleCount(0), reflected(0), reflectedSum(0),
+		reflectedCount(0) { }
+
+	/// Can directions be sampled from the learned distribution?
+	inline bool canSample() const { return sampling.getTotal() > 0; }
+
+	/// Record the radiance that arrived from direction \c d (thread-safe)
+	void record(const Vector3f &d, float radiance);
+
+	/// Record the luminance of radiance that left the region toward a path (thread-safe)
+	void recordReflected(float radiance);
+
+	/// Sample a direction from the learned distribution
+	Vector3f sample(const Point2f &sample) const;
+
+	/// Return the density of sampling direction \c d (wrt. solid angles)
+	float pdf(const Vector3f &d) const;
+};
+
+/**
+ * \brief Spatial-directional tree (SD-tree) for path guiding (Mueller
+ * et al., "Practical Path Guiding for Efficient Light-Transport
+ * Simulation")
+ *
+ * A binary tree over a cube around the scene, whose nodes split their
+ * region in the middle along the x, y and z axes in turn. Each leaf
+ * holds a pair of directional quadtrees (see \ref SDTreeLeaf): render
+ * threads sample directions from the distribution that was learned in
+ * the previous pass, and record the radiance they find into the other
+ * one using atomic additions. The structure of the tree is only
+ * changed by \ref refine() between passes, so lookups need no locks.
+ */
+class SDTree {
+public:
+	/// Create a tree with a single leaf for the given scene bounds
+	SDTree(const BoundingBox3f &bbox);
+
+	/// Return the leaf whose region contains \c p
+	SDTreeLeaf *lookup(const Point3f &p);
+
+	/**
+	 * \brief Learn from the samples of the pass that just ended
+	 *
+	 * Leaves that received more than \c spatialThreshold samples are
+	 * split. Then the recorded distribution of every leaf becomes the
+	 * one used for sampling, and the recording starts over using a
+	 * quadtree that is refined according to the recorded values (see
+	 * \ref DTree::refine()). The mean of the reflected radiance becomes
+	 * the estimate \ref SDTreeLeaf::reflected of leaves that recorded
+	 * any. Must not be called during a pass.
+	 */
+	void refine(float spatialThreshold, float directionalThreshold);
+
+	/// Return the number of leaves
+	inline size_t getLeafCount() const { return m_leaves.size(); }
+
+	/// Return the total number of directional quadtree nodes
+	size_t getDirectionalNodeCount() const;
+private:
+	struct Node {
+		/// Indices of the child nodes (zero = the node is a leaf)
+		uint32_t children[2];
+		/// Index of the leaf data
+		uint32_t leaf;
+	};
+
+	/// Split the leaf data of node \c index until it has few enough samples
+	void subdivide(uint32_t index, int depth, float threshold);
+
+	BoundingBox3f m_bbox;
+	std::vector<Node> m_nodes;
+	std::vector<SDTreeLeaf> m_leaves;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SDTREE_H */
@@ -0,0 +1,120 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SERVER_H)
+#define __SERVER_H
+
+#include <nori/common.h>
+#include <QByteArray>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+class Scene;
+class RenderEngine;
+class StatusMonitor;
+struct ServerJob;
+
+/**
+ * \brief Long-running render server that processes job files
+ * dropped into a directory (<tt>nori --server</tt>)
+ *
+ * Each job is a text file with the extension <tt>.job</tt> that
+ * contains one <tt>key = value</tt> pair per line (lines starting
+ * with \c # are ignored):
+ *
+ * - \c scene: the scene file (required)
+ * - \c output: the EXR file to be written (default: the name of
+ *   the job file with the extension <tt>.exr</tt>)
+ * - \c spp: samples per pixel (default: the scene's sampler setting)
+ * - \c origin, \c target, \c up and \c fov: replace the scene's camera
+ *   by a perspective camera with the same resolution, which looks from
+ *   \c origin towards \c target (\c up defaults to <tt>0 1 0</tt> and
+ *   \c fov to 30 degrees)
+ *
+ * Relative paths are interpreted with respect to the directory. When
+ * a job is done, its file is replaced by one with the extension
+ * <tt>.done</tt>, or <tt>.failed</tt> containing the error message.
+ * To prevent the server from reading a partially written job, create
+ * the file under a different name and then rename it.
+ *
+ * Scenes stay loaded between jobs, keyed by the hash of the scene
+ * file's contents, so that repeated jobs on the same scene don't pay
+ * for parsing, mesh loading and building the acceleration data
+ * structure again. Changes to files referenced by a scene (e.g. meshes)
+ * are therefore only noticed when the scene file itself changes. All
+ * jobs share one pool of render threads, and the jobs found in the
+ * directory at the same time are queued together, so that the threads
+ * move on to the next frame while the previous one finishes.
+ *
+ * The server exits once a file named \c shutdown appears in the directory.
+ */
+class RenderServer {
+public:
+	/**
+	 * \brief Create a render server
+	 *
+	 * \param directory
+	 *     Directory that is watched for job files
+	 * \param loadFlags
+	 *     Flags used to load scenes (see \ref loadScene())
+	 * \param maxScenes
+	 *     Number of scenes that are kept loaded (the least
+	 *     recently used ones are released first)
+	 */
+	RenderServer(const QString &directory, int loadFlags = 0, int maxScenes = 4);
+
+	/// Release all scenes and shut down the render threads
+	~RenderServer();
+
+	/// Report the progress of the jobs using the given monitor (or \c NULL)
+	inline void setStatusMonitor(StatusMonitor *monitor) { m_monitor = monitor; }
+
+	/// Process jobs until the server is asked to shut down
+	void run();
+private:
+	/// Read a job file and queue it for rendering
+	void submit(ServerJob &job);
+
+	/// Wait for a job, write its output and replace the job file
+	void finish(ServerJob &job);
+
+	/// Return a loaded scene, loading it if necessary
+	Scene *getScene(const QString &filename);
+
+	/// Release the least recently used scenes beyond \ref m_maxScenes
+	void releaseScenes();
+
+	/// A scene that is kept loaded
+	struct CachedScene {
+		Scene *scene;
+		uint64_t lastUse;
+	};
+private:
+	QString m_directory;
+	int m_loadFlags;
+	int m_maxScenes;
+	RenderEngine *m_engine;
+	StatusMonitor *m_monitor;
+	std::map<QByteArray, CachedScene> m_scenes;
+	uint64_t m_useCounter;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SERVER_H */
@@ -0,0 +1,121 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SIMD_H)
+#define __SIMD_H
+
+#include <nori/color.h>
+#include <nori/vector.h>
+
+/* The 4-wide code paths are opt-in (qmake CONFIG+=simd4) and need SSE2 */
+#if defined(NORI_SIMD4) && defined(NORI_SSE)
+#define NORI_SIMD4_ENABLED 1
+#include <emmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Four floats in one SSE register
+ *
+ * Nori's 3-component types (\ref Color3f, \ref Vector3f, \ref Point3f,
+ * \ref Normal3f) are tightly packed, since their arrays are written to
+ * files and used as frame buffers. Eigen does not vectorize them. Hot
+ * code can instead load them into a \c Float4 (the last lane is zero),
+ * compute with full registers, and store the first three lanes back.
+ *
+ * Without \c NORI_SIMD4_ENABLED, this is a plain array of four floats.
+ */
+struct Float4 {
+#if defined(NORI_SIMD4_ENABLED)
+	__m128 value;
+
+	inline Float4() { }
+	inline Float4(__m128 value) : value(value) { }
+	inline explicit Float4(float f) : value(_mm_set1_ps(f)) { }
+	inline Float4(float x, float y, float z, float w) : value(_mm_setr_ps(x, y, z, w)) { }
+
+	inline Float4 operator+(const Float4 &f) const { return _mm_add_ps(value, f.value); }
+	inline Float4 operator-(const Float4 &f) const { return _mm_sub_ps(value, f.value); }
+	inline Float4 operator*(const Float4 &f) const { return _mm_mul_ps(value, f.value); }
+	inline Float4 operator*(float f) const { return _mm_mul_ps(value, _mm_set1_ps(f)); }
+	inline Float4 &operator+=(const Float4 &f) { value = _mm_add_ps(value, f.value); return *this; }
+
+	/// Store the four lanes to memory
+	inline void store(float *target) const { _mm_storeu_ps(target, value); }
+#else
+	float value[4];
+
+	inline Float4() { }
+	inline explicit Float4(float f) { value[0] = value[1] = value[2] = value[3] = f; }
+	inline Float4(float x, float y, float z, float w) {
+		value[0] = x; value[1] = y; value[2] = z; value[3] = w;
+	}
+
+	inline Float4 operator+(const Float4 &f) const {
+		return Float4(value[0] + f.value[0], value[1] + f.value[1],
+			value[2] + f.value[2], value[3] + f.value[3]);
+	}
+	inline Float4 operator-(const Float4 &f) const {
+		return Float4(value[0] - f.value[0], value[1] - f.value[1],
+			value[2] - f.value[2], value[3] - f.value[3]);
+	}
+	inline Float4 operator*(const Float4 &f) const {
+		return Float4(value[0] * f.value[0], value[1] * f.value[1],
+			value[2] * f.value[2], value[3] * f.value[3]);
+	}
+	inline Float4 operator*(float f) const {
+		return Float4(value[0] * f, value[1] * f, value[2] * f, value[3] * f);
+	}
+	inline Float4 &operator+=(const Float4 &f) { *this = *this + f; return *this; }
+
+	/// Store the four lanes to memory
+	inline void store(float *target) const {
+		for (int i=0; i<4; ++i)
+			target[i] = value[i];
+	}
+#endif
+
+	/// Load a 3D vector (or point/normal)
+	template <typename Derived> static inline Float4 load(const Eigen::MatrixBase<Derived> &v) {
+		return Float4(v.coeff(0), v.coeff(1), v.coeff(2), 0.0f);
+	}
+
+	/// Load a color
+	static inline Float4 load(const Color3f &c) {
+		return Float4(c.r(), c.g(), c.b(), 0.0f);
+	}
+
+	/// Return the first three lanes as a vector
+	inline Vector3f toVector() const {
+		float tmp[4];
+		store(tmp);
+		return Vector3f(tmp[0], tmp[1], tmp[2]);
+	}
+
+	/// Return the first three lanes as a color
+	inline Color3f toColor() const {
+		float tmp[4];
+		store(tmp);
+		return Color3f(tmp[0], tmp[1], tmp[2]);
+	}
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SIMD_H */
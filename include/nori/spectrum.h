@@ -0,0 +1,131 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SPECTRUM_H)
+#define __SPECTRUM_H
+
+#include <nori/color.h>
+
+/// Range of wavelengths that are sampled in spectral mode (in nanometers)
+#define NORI_LAMBDA_MIN 380.0f
+#define NORI_LAMBDA_MAX 780.0f
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Values of a spectral quantity at the four wavelengths of a
+ * \ref Wavelengths sample, which fit into one SIMD register
+ */
+struct Spectrum4f : public Eigen::Array4f {
+public:
+	typedef Eigen::Array4f Base;
+
+	/// Initialize all wavelengths with a uniform value
+	inline Spectrum4f(float value = 0) : Base(value, value, value, value) { }
+
+	/// Initialize the spectrum with specific per-wavelength values
+	inline Spectrum4f(float a, float b, float c, float d) : Base(a, b, c, d) { }
+
+	/// Construct a spectrum from ArrayBase (needed to play nice with Eigen)
+	template <typename Derived> inline Spectrum4f(const Eigen::ArrayBase<Derived>& p)
+		: Base(p) { }
+
+	/// Assign a spectrum from ArrayBase (needed to play nice with Eigen)
+	template <typename Derived> Spectrum4f &operator=(const Eigen::ArrayBase<Derived>& p) {
+		this->Base::operator=(p);
+		return *this;
+	}
+
+	/// Return a human-readable string summary
+	inline QString toString() const {
+		return QString("[%1, %2, %3, %4]").arg(coeff(0)).arg(coeff(1)).arg(coeff(2)).arg(coeff(3));
+	}
+};
+
+/**
+ * \brief Four wavelengths that are carried along a path in spectral mode
+ *
+ * The first one (the hero wavelength) is uniformly distributed over
+ * [\ref NORI_LAMBDA_MIN, \ref NORI_LAMBDA_MAX], and the others follow at
+ * a quarter of the range each (wrapping around), which stratifies them.
+ * Since every wavelength of the set has the same distribution, decisions
+ * that depend on the wavelength (e.g. distances in a chromatic medium)
+ * can be sampled for the hero wavelength alone and weighted by the
+ * balance heuristic over all four (hero wavelength MIS), i.e. divided by
+ * the average density of the four.
+ *
+ * Colors of the scene are turned into spectra using a basis of three
+ * smooth, nonnegative spectra that sum to one: a red, green, and blue
+ * band with transitions around 490 and 590 nm. Reflectances in [0, 1]
+ * hence remain in [0, 1] at every wavelength, and white is constant.
+ * Spectra are turned back into colors by projecting them onto the dual
+ * basis, which recovers the color of an upsampled spectrum exactly.
+ */
+struct Wavelengths {
+	/// The wavelengths (in nanometers), starting with the hero wavelength
+	Spectrum4f lambda;
+	/// Values of the red, green, and blue basis spectra at the wavelengths
+	Spectrum4f basis[3];
+
+	/// Sample four wavelengths from a uniformly distributed value
+	inline Wavelengths(float sample) {
+		Spectrum4f offset = Spectrum4f(0.0f, 0.25f, 0.5f, 0.75f) + sample;
+		offset -= (offset >= 1.0f).cast<float>();
+		lambda = NORI_LAMBDA_MIN + offset * (NORI_LAMBDA_MAX - NORI_LAMBDA_MIN);
+
+		basis[2] = 1.0f - smoothStep((lambda - 470.0f) * (1.0f / 40.0f));
+		basis[0] = smoothStep((lambda - 570.0f) * (1.0f / 40.0f));
+		basis[1] = 1.0f - basis[0] - basis[2];
+	}
+
+	/// Turn a color into a spectrum, and evaluate it at the wavelengths
+	inline Spectrum4f fromRGB(const Color3f &color) const {
+		return basis[0] * color.r() + basis[1] * color.g() + basis[2] * color.b();
+	}
+
+	/**
+	 * \brief Turn the values of a spectrum at the wavelengths into an
+	 * (unbiased) estimate of its color
+	 */
+	inline Color3f toRGB(const Spectrum4f &value) const {
+		/* Inverse of the Gram matrix of the basis, times the range of
+		   the wavelengths (i.e. divided by their density) */
+		static const float dual[3][3] = {
+			{  2.167299f, -0.124590f,  0.006111f },
+			{ -0.124590f,  4.478332f, -0.219646f },
+			{  0.006111f, -0.219646f,  3.825487f }
+		};
+		Spectrum4f r = value * basis[0], g = value * basis[1], b = value * basis[2];
+		Color3f projection(r.mean(), g.mean(), b.mean());
+		Color3f result;
+		for (int i=0; i<3; ++i)
+			result[i] = dual[i][0] * projection.r() + dual[i][1] * projection.g()
+				+ dual[i][2] * projection.b();
+		return result;
+	}
+private:
+	/// Smooth transition from zero (at x <= 0) to one (at x >= 1)
+	static inline Spectrum4f smoothStep(const Spectrum4f &x) {
+		Spectrum4f t = x.max(Spectrum4f(0.0f)).min(Spectrum4f(1.0f));
+		return t * t * (3.0f - 2.0f * t);
+	}
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SPECTRUM_H */
@@ -0,0 +1,110 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__STATUS_H)
+#define __STATUS_H
+
+#include <nori/render.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Reports the progress and throughput of render jobs while
+ * they are running (see \ref RenderJob::getStatus())
+ *
+ * The monitor has two outputs, both of which are optional:
+ *
+ * - Every \c interval seconds, it prints one line per job to \c stdout
+ *   that starts with <tt>NORI_STATUS</tt> followed by a JSON object, e.g.
+ *   <pre>
+ *   NORI_STATUS {"job": "cbox.xml", "state": "rendering", "elapsed": 12.0,
+ *     "pass": 0, "passes": 1, "finishedBlocks": 410, "remainingBlocks": 612,
+ *     "samples": 8396800, "totalSamples": 20971520, "progress": 0.4004,
+ *     "samplesPerSecond": 699733, "rays": 16793600, "shadowRays": 8396800,
+ *     "raysPerSecond": 2099200, "eta": 17.97}
+ *   </pre>
+ *   (on a single line). A final line with the state \c finished is
+ *   printed when a job is removed from the monitor.
+ * - A minimal HTTP server on the given port (on all interfaces) answers
+ *   <tt>GET /metrics</tt> with the same values in the text format of
+ *   Prometheus (metrics named <tt>nori_render_*</tt> with a \c job
+ *   label), and <tt>GET /status</tt> with a JSON object whose \c jobs
+ *   array contains the objects of the status lines.
+ *
+ * Throughputs are averages since the job was picked up by the render
+ * threads, and the remaining time is extrapolated from them.
+ */
+class StatusMonitor : public QThread {
+public:
+	/**
+	 * \brief Start monitoring
+	 *
+	 * \param interval
+	 *     Time between two status lines in seconds (0 = no status lines)
+	 * \param port
+	 *     TCP port of the HTTP server (0 = no server). Throws a
+	 *     \ref NoriException when the port can't be opened.
+	 */
+	StatusMonitor(float interval, int port);
+
+	/// Stop the monitoring thread and close the port
+	virtual ~StatusMonitor();
+
+	/**
+	 * \brief Report the status of a job under the given name
+	 *
+	 * The job must have been submitted, and it must stay alive until
+	 * it is removed using \ref removeJob().
+	 */
+	void addJob(const RenderJob *job, const QString &name);
+
+	/// Stop reporting a job (printing its final status line)
+	void removeJob(const RenderJob *job);
+
+	/// Monitoring thread loop
+	void run();
+protected:
+	/// Return the status of a job as a JSON object
+	static QString toJSON(const QString &name, const RenderJob::Status &status);
+
+	/// Return the status of all jobs in the Prometheus text format (requires \c m_mutex)
+	QString toPrometheus() const;
+
+	/// Print a status line for every job (requires \c m_mutex)
+	void printStatus() const;
+
+	/// Answer one HTTP request on a newly accepted connection
+	void serve(intptr_t connection);
+private:
+	/// A job that is being monitored
+	struct MonitoredJob {
+		const RenderJob *job;
+		QString name;
+	};
+
+	float m_interval;
+	/// Listening socket (a \c SOCKET on Windows, a file descriptor elsewhere; -1 = none)
+	intptr_t m_socket;
+	mutable QMutex m_mutex;
+	std::vector<MonitoredJob> m_jobs;
+	volatile bool m_shutdown;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __STATUS_H */
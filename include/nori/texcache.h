@@ -0,0 +1,216 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TEXCACHE_H)
+#define __TEXCACHE_H
+
+#include <nori/bitmap.h>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThreadStorage>
+#include <map>
+
+/// Number of independently locked parts of the \ref TextureCache
+#define NORI_TEXCACHE_SHARDS 16
+
+/// Number of tiles in the lookup cache of each thread (a power of two)
+#define NORI_TEXCACHE_THREAD_TILES 64
+
+/// Default memory budget of the \ref TextureCache (in MiB)
+#define NORI_TEXCACHE_DEFAULT_BUDGET 512
+
+NORI_NAMESPACE_BEGIN
+
+class TiledImage;
+struct TiledImageFile;
+
+/**
+ * \brief Tile of one level of a \ref TiledImage that was read into
+ * the \ref TextureCache
+ *
+ * Tiles are reference counted: the cache holds one reference while the
+ * tile is resident, and the lookup cache of every thread that recently
+ * used it holds another one. Evicted tiles are hence only released
+ * once no thread can access them anymore.
+ */
+struct TextureTile {
+	/// Key of the tile (image, level and tile coordinates)
+	uint64_t key;
+	/// Size of the tile (smaller than the tile size at the image borders)
+	int width, height;
+	/// Pixels in row-major order
+	Color3f *pixels;
+	/// Number of references
+	QAtomicInt refs;
+	/// Neighbors in the LRU list of the owning shard of the cache
+	TextureTile *prev, *next;
+
+	TextureTile(int width, int height) : key(0), width(width), height(height),
+		refs(1), prev(NULL), next(NULL) {
+		pixels = new Color3f[width * height];
+	}
+
+	~TextureTile() { delete[] pixels; }
+
+	/// Return the memory used by the tile (in bytes)
+	inline size_t getMemoryUsage() const {
+		return sizeof(TextureTile) + sizeof(Color3f) * width * height;
+	}
+
+	/// Release a reference, and free the tile when it was the last one
+	inline void release() {
+		if (!refs.deref())
+			delete this;
+	}
+};
+
+/**
+ * \brief Out-of-core cache of the tiles of all \ref TiledImage
+ * instances, which keeps their total size within a memory budget
+ *
+ * Tiles are read on demand and evicted in least recently used order.
+ * The resident tiles are spread over \c NORI_TEXCACHE_SHARDS parts with
+ * separate locks and budgets, and files are read without holding any
+ * lock. In front of this, every thread has a small direct-mapped cache
+ * of the tiles that it used last, whose lookups need no locks at all.
+ */
+class TextureCache {
+public:
+	/// Return the cache that is shared by all images
+	static TextureCache *getInstance();
+
+	/// Set the memory budget for resident tiles (in bytes)
+	void setMemoryBudget(size_t bytes);
+
+	/// Return the memory budget for resident tiles (in bytes)
+	inline size_t getMemoryBudget() const { return m_budget; }
+
+	/// Return the memory that is currently used by resident tiles (in bytes)
+	size_t getMemoryUsage() const;
+
+	/// Return the ID that identifies the tiles of a newly opened image
+	uint32_t registerImage();
+
+	/**
+	 * \brief Return a tile of an image, reading it if necessary
+	 *
+	 * The tile remains valid until the calling thread requests
+	 * another tile, which may replace it in its lookup cache.
+	 */
+	const TextureTile *getTile(const TiledImage *image, int level, int x, int y);
+private:
+	/// Independently locked part of the cache
+	struct Shard {
+		QMutex mutex;
+		std::map<uint64_t, TextureTile *> tiles;
+		/// Most and least recently used tiles
+		TextureTile *head, *tail;
+		size_t memory;
+
+		Shard() : head(NULL), tail(NULL), memory(0) { }
+	};
+
+	/// Lookup cache of one thread
+	struct ThreadTiles {
+		TextureTile *tiles[NORI_TEXCACHE_THREAD_TILES];
+
+		ThreadTiles() { memset(tiles, 0, sizeof(tiles)); }
+		~ThreadTiles() {
+			for (int i=0; i<NORI_TEXCACHE_THREAD_TILES; ++i)
+				if (tiles[i])
+					tiles[i]->release();
+		}
+	};
+
+	TextureCache();
+
+	/// Find or read a tile, and return it with a reference for the caller
+	TextureTile *fetch(const TiledImage *image, uint64_t key, int level, int x, int y);
+
+	/// Unlink a tile from the LRU list of a shard
+	static void unlink(Shard &shard, TextureTile *tile);
+
+	/// Insert a tile at the front of the LRU list of a shard
+	static void pushFront(Shard &shard, TextureTile *tile);
+
+	Shard m_shards[NORI_TEXCACHE_SHARDS];
+	QThreadStorage<ThreadTiles *> m_threadTiles;
+	size_t m_budget;
+	QAtomicInt m_nextID;
+};
+
+/**
+ * \brief Mip-mapped RGB image that is stored in an OpenEXR file
+ *
+ * Tiled files are paged in one tile at a time via the \ref TextureCache,
+ * so that their memory use is bounded. Their levels are taken from the
+ * file (tiled files with a single level are not mip-mapped); large
+ * textures should hence be converted to tiled and mip-mapped files
+ * (e.g. using \c exrmaketiled). Scanline files are read completely
+ * via \ref Bitmap, and their mip map is computed using a box filter.
+ */
+class TiledImage {
+public:
+	/// Open the file, and read it unless it is tiled
+	TiledImage(const QString &filename);
+
+	/// Release the file (the resident tiles stay in the cache until evicted)
+	~TiledImage();
+
+	/// Return the number of levels of the mip map
+	inline int getLevelCount() const { return (int) m_levelSizes.size(); }
+
+	/// Return the size of a level (in pixels)
+	inline const Vector2i &getSize(int level) const { return m_levelSizes[level]; }
+
+	/// Return a pixel of a level (thread-safe)
+	inline Color3f getPixel(int level, int x, int y) const {
+		if (!m_file)
+			return m_levels[level]->coeff(y, x);
+		const TextureTile *tile = TextureCache::getInstance()->getTile(
+			this, level, x / m_tileSize.x(), y / m_tileSize.y());
+		return tile->pixels[(y % m_tileSize.y()) * tile->width + x % m_tileSize.x()];
+	}
+
+	/// Is the image paged in via the \ref TextureCache?
+	inline bool isPaged() const { return m_file != NULL; }
+
+	/// Return the ID of the image within the \ref TextureCache
+	inline uint32_t getID() const { return m_id; }
+
+	/// Read a tile from the file (called by the \ref TextureCache)
+	TextureTile *readTile(int level, int x, int y) const;
+
+	/// Return the filename
+	inline const QString &getFilename() const { return m_filename; }
+private:
+	QString m_filename;
+	uint32_t m_id;
+	std::vector<Vector2i> m_levelSizes;
+
+	/* Paged images */
+	TiledImageFile *m_file;
+	Vector2i m_tileSize;
+
+	/* Resident images */
+	std::vector<Bitmap *> m_levels;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __TEXCACHE_H */
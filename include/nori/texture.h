@@ -0,0 +1,56 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TEXTURE_H)
+#define __TEXTURE_H
+
+#include <nori/object.h>
+#include <nori/color.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Superclass of all color-valued textures, which are parameterized
+ * by the uv coordinates of the surface (see \ref Intersection::uv)
+ */
+class Texture : public NoriObject {
+public:
+	/**
+	 * \brief Evaluate the texture
+	 *
+	 * \param uv
+	 *     Texture coordinates of the query
+	 * \param width
+	 *     Approximate width of the footprint of the query in texture
+	 *     coordinates, which selects the level of detail (0 = finest)
+	 */
+	virtual Color3f eval(const Point2f &uv, float width = 0.0f) const = 0;
+
+	/// Return the average value of the texture
+	virtual Color3f getAverage() const = 0;
+
+	/**
+	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+	 * provided by this instance
+	 * */
+	EClassType getClassType() const { return ETexture; }
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __TEXTURE_H */
@@ -31,20 +31,24 @@ NORI_NAMESPACE_BEGIN
  * rotation, translation, uniform or non-uniform scaling, and perspective
  * transformations. The inverse of this transformation is also recorded
  * here, since it is required when transforming normal vectors.
+ *
+ * Affine transformations (whose last row is <tt>[0, 0, 0, 1]</tt>) are
+ * detected on construction. Points are then transformed using the upper
+ * 3x4 part of the matrix, without the projective row and the divide.
  */
 struct Transform {
 public:
 	/// Create the identity transform
 	Transform() : 
 		m_transform(Eigen::Matrix4f::Identity()),
-		m_inverse(Eigen::Matrix4f::Identity()) { }
+		m_inverse(Eigen::Matrix4f::Identity()), m_affine(true) { }
 
 	/// Create a new transform instance for the given matrix 
 	Transform(const Eigen::Matrix4f &trafo);
 
 	/// Create a new transform instance for the given matrix and its inverse
 	Transform(const Eigen::Matrix4f &trafo, const Eigen::Matrix4f &inv) 
-		: m_transform(trafo), m_inverse(inv) { }
+		: m_transform(trafo), m_inverse(inv), m_affine(isAffine(trafo)) { }
 
 	/// Return the underlying matrix
 	inline const Eigen::Matrix4f &getMatrix() const {
@@ -56,6 +60,11 @@ public:
 		return m_inverse;
 	}
 
+	/// Is this an affine transformation (i.e. not a projective one)?
+	inline bool isAffine() const {
+		return m_affine;
+	}
+
 	/// Return the inverse transformation
 	Transform inverse() const {
 		return Transform(m_inverse, m_transform);
@@ -76,24 +85,35 @@ public:
 
 	/// Transform a point by an arbitrary matrix in homogeneous coordinates
 	inline Point3f operator*(const Point3f &p) const {
+		if (EXPECT_TAKEN(m_affine))
+			return m_transform.topLeftCorner<3,3>() * p
+				+ m_transform.topRightCorner<3,1>();
 		Vector4f result = m_transform * Vector4f(p[0], p[1], p[2], 1.0f);
 		return result.head<3>() / result.w();
 	}
 
 	/// Apply the homogeneous transformation to a ray
 	inline Ray3f operator*(const Ray3f &r) const {
-		return Ray3f(
+		Ray3f result(
 			operator*(r.o), 
 			operator*(r.d), 
 			r.mint, r.maxt
 		);
+		result.time = r.time;
+		return result;
 	}
 
 	/// Return a string representation
 	QString toString() const;
 private:
+	/// Check whether the last row of a matrix is [0, 0, 0, 1]
+	static inline bool isAffine(const Eigen::Matrix4f &m) {
+		return m(3, 0) == 0 && m(3, 1) == 0 && m(3, 2) == 0 && m(3, 3) == 1;
+	}
+
 	Eigen::Matrix4f m_transform;
 	Eigen::Matrix4f m_inverse;
+	bool m_affine;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,164 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TRIACCEL_H)
+#define __TRIACCEL_H
+
+#include <nori/ray.h>
+
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Marks unused entries of a \ref TriAccel4 block
+#define NORI_TRIACCEL_INVALID 0xFFFFFFFFu
+
+/**
+ * \brief Precomputed Moller-Trumbore data for up to four triangles
+ * in a structure-of-arrays layout (used by the leaf nodes of
+ * \ref KDTree and \ref BVH)
+ *
+ * Unused entries have all-zero edges, which makes them degenerate
+ * and guarantees that they are never reported as a hit.
+ */
+struct TriAccel4 {
+	/// First vertex position (x, y and z components)
+	float p0[3][4];
+	/// Edge from the first to the second vertex
+	float e1[3][4];
+	/// Edge from the first to the third vertex
+	float e2[3][4];
+	/// Index of the associated mesh
+	uint32_t mesh[4];
+	/// Index of the triangle within its mesh
+	uint32_t prim[4];
+
+	/// Store a triangle in one of the four entries
+	inline void set(int lane, const Point3f &v0, const Point3f &v1,
+			const Point3f &v2, uint32_t meshIndex, uint32_t primIndex) {
+		Vector3f edge1 = v1 - v0, edge2 = v2 - v0;
+		for (int k=0; k<3; ++k) {
+			p0[k][lane] = v0[k];
+			e1[k][lane] = edge1[k];
+			e2[k][lane] = edge2[k];
+		}
+		mesh[lane] = meshIndex;
+		prim[lane] = primIndex;
+	}
+
+	/// Mark one of the entries as unused
+	inline void clear(int lane) {
+		for (int k=0; k<3; ++k)
+			p0[k][lane] = e1[k][lane] = e2[k][lane] = 0.0f;
+		mesh[lane] = prim[lane] = NORI_TRIACCEL_INVALID;
+	}
+
+	/**
+	 * \brief Intersect a ray against all four triangles
+	 *
+	 * \return A bit mask of the triangles that were hit with a
+	 * distance in [mint, maxt]. The barycentric coordinates and
+	 * distances are returned via \c u, \c v and \c t.
+	 */
+	inline int rayIntersect(const Ray3f &ray, float mint, float maxt,
+			float *u, float *v, float *t) const {
+#if defined(NORI_SSE)
+		const __m128
+			dx = _mm_set1_ps(ray.d.x()), dy = _mm_set1_ps(ray.d.y()), dz = _mm_set1_ps(ray.d.z()),
+			e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]),
+			e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+
+		/* pvec = d x edge2 */
+		const __m128
+			px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y)),
+			py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z)),
+			pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+		/* det = edge1 . pvec */
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px),
+			_mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		const __m128 degenerate = _mm_and_ps(
+			_mm_cmpgt_ps(det, _mm_set1_ps(-1e-8f)),
+			_mm_cmplt_ps(det, _mm_set1_ps(1e-8f)));
+		const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+		/* tvec = o - p0 */
+		const __m128
+			tx = _mm_sub_ps(_mm_set1_ps(ray.o.x()), _mm_load_ps(p0[0])),
+			ty = _mm_sub_ps(_mm_set1_ps(ray.o.y()), _mm_load_ps(p0[1])),
+			tz = _mm_sub_ps(_mm_set1_ps(ray.o.z()), _mm_load_ps(p0[2]));
+
+		const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px),
+			_mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+		/* qvec = tvec x edge1 */
+		const __m128
+			qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y)),
+			qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z)),
+			qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+		const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx),
+			_mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+
+		const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx),
+			_mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(tt, _mm_set1_ps(mint)));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(tt, _mm_set1_ps(maxt)));
+		mask = _mm_andnot_ps(degenerate, mask);
+
+		_mm_storeu_ps(u, uu);
+		_mm_storeu_ps(v, vv);
+		_mm_storeu_ps(t, tt);
+		return _mm_movemask_ps(mask);
+#else
+		int result = 0;
+		for (int i=0; i<4; ++i) {
+			Vector3f edge1(e1[0][i], e1[1][i], e1[2][i]),
+			         edge2(e2[0][i], e2[1][i], e2[2][i]);
+			Vector3f pvec = ray.d.cross(edge2);
+			float det = edge1.dot(pvec);
+			if (det > -1e-8f && det < 1e-8f)
+				continue;
+			float inv_det = 1.0f / det;
+			Vector3f tvec = ray.o - Point3f(p0[0][i], p0[1][i], p0[2][i]);
+			u[i] = tvec.dot(pvec) * inv_det;
+			if (u[i] < 0.0 || u[i] > 1.0)
+				continue;
+			Vector3f qvec = tvec.cross(edge1);
+			v[i] = ray.d.dot(qvec) * inv_det;
+			if (v[i] < 0.0 || u[i] + v[i] > 1.0)
+				continue;
+			t[i] = edge2.dot(qvec) * inv_det;
+			if (t[i] >= mint && t[i] <= maxt)
+				result |= 1 << i;
+		}
+		return result;
+#endif
+	}
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __TRIACCEL_H */
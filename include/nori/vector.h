@@ -164,8 +164,28 @@ public:
 	}
 };
 
-/// Complete the set {a} to an orthonormal base
-extern void coordinateSystem(const Vector3f &a, Vector3f &b, Vector3f &c);
+/**
+ * \brief Complete the set {a} to an orthonormal base
+ *
+ * Uses the branchless construction by Duff et al. ("Building an
+ * Orthonormal Basis, Revisited", JCGT 2017), which needs neither a
+ * square root nor a comparison of the components of \c a.
+ */
+inline void coordinateSystem(const Vector3f &a, Vector3f &b, Vector3f &c) {
+	float sign = copysignf(1.0f, a.z()),
+	      s = -1.0f / (sign + a.z()),
+	      xy = a.x() * a.y() * s;
+	b = Vector3f(1.0f + sign * a.x() * a.x() * s, sign * xy, -sign * a.x());
+	c = Vector3f(xy, sign + a.y() * a.y() * s, -a.y());
+}
+
+/**
+ * \brief Complete a batch of unit vectors to orthonormal bases
+ *
+ * Equivalent to calling \ref coordinateSystem() for each entry, but
+ * processes four vectors at a time using SSE when available.
+ */
+extern void coordinateSystem(const Vector3f *a, Vector3f *b, Vector3f *c, uint32_t count);
 
 NORI_NAMESPACE_END
 
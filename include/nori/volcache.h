@@ -0,0 +1,284 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__VOLCACHE_H)
+#define __VOLCACHE_H
+
+#include <nori/common.h>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadStorage>
+#include <deque>
+#include <map>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#endif
+
+/// Number of independently locked parts of the \ref VolumeCache
+#define NORI_VOLCACHE_SHARDS 16
+
+/// Number of bricks in the lookup cache of each thread (a power of two)
+#define NORI_VOLCACHE_THREAD_BRICKS 64
+
+/// Default memory budget of the \ref VolumeCache (in MiB)
+#define NORI_VOLCACHE_DEFAULT_BUDGET 1024
+
+/// Maximum number of pending prefetch requests (further ones are dropped)
+#define NORI_VOLCACHE_PREFETCH_QUEUE 256
+
+NORI_NAMESPACE_BEGIN
+
+class PrefetchThread;
+
+/**
+ * \brief Brick of a sparse volume that was read into the \ref VolumeCache
+ *
+ * Like \ref TextureTile, bricks are reference counted: the cache holds
+ * one reference while the brick is resident, and the lookup cache of
+ * every thread that recently used it holds another one.
+ */
+struct VolumeBrick {
+	/// Key of the brick (file and brick index)
+	uint64_t key;
+	/// Size of the brick (in bytes)
+	size_t size;
+	/// Contents of the brick as stored in the file
+	char *data;
+	/// Number of references
+	QAtomicInt refs;
+	/// Neighbors in the LRU list of the owning shard of the cache
+	VolumeBrick *prev, *next;
+
+	VolumeBrick(size_t size) : key(0), size(size), refs(1), prev(NULL), next(NULL) {
+		data = new char[size];
+	}
+
+	~VolumeBrick() { delete[] data; }
+
+	/// Return the memory used by the brick (in bytes)
+	inline size_t getMemoryUsage() const { return sizeof(VolumeBrick) + size; }
+
+	/// Release a reference, and free the brick when it was the last one
+	inline void release() {
+		if (!refs.deref())
+			delete this;
+	}
+};
+
+/**
+ * \brief File whose bricks of equal size are read through the \ref VolumeCache
+ * using positioned reads (\c pread()), which several threads can issue at once
+ */
+class BrickFile {
+public:
+	/**
+	 * \brief Open a file
+	 *
+	 * \param offset
+	 *     Position of the first brick in the file (in bytes)
+	 * \param brickBytes
+	 *     Size of a brick (in bytes)
+	 */
+	BrickFile(const QString &filename, uint64_t offset, size_t brickBytes);
+
+	/// Cancel the pending prefetches of the file, and close it
+	~BrickFile();
+
+	/// Read a brick from the file (called by the \ref VolumeCache)
+	VolumeBrick *readBrick(uint32_t index) const;
+
+	/// Return the ID of the file within the \ref VolumeCache
+	inline uint32_t getID() const { return m_id; }
+
+	/// Return the filename
+	inline const QString &getFilename() const { return m_filename; }
+private:
+	QString m_filename;
+	uint32_t m_id;
+	uint64_t m_offset;
+	size_t m_brickBytes;
+#if defined(PLATFORM_WINDOWS)
+	HANDLE m_file;
+#else
+	int m_file;
+#endif
+};
+
+/**
+ * \brief Out-of-core cache of the bricks of all sparse volumes that are
+ * read from a \ref BrickFile instead of being mapped into memory
+ *
+ * Mapped files are paged in by the operating system within the page
+ * faults of the render threads, which can stall them for a long time
+ * on network file systems, and their residency can't be controlled.
+ * This cache instead keeps the bricks that were read explicitly within
+ * a memory budget, evicting them in least recently used order. Like the
+ * \ref TextureCache, the resident bricks are spread over
+ * \c NORI_VOLCACHE_SHARDS parts with separate locks and budgets, files
+ * are read without holding any lock, and every thread has a small
+ * direct-mapped cache of the bricks that it used last.
+ *
+ * In addition, bricks can be requested ahead of their use (e.g. the
+ * next brick along a ray), which a background thread then reads.
+ */
+class VolumeCache {
+public:
+	/// Counters of the cache since the start of the process
+	struct Statistics {
+		/// Bricks that were found in the cache
+		uint64_t hits;
+		/// Bricks that had to be read by the thread that needed them
+		uint64_t misses;
+		/// Bricks that were read by the prefetching thread
+		uint64_t prefetches;
+		/// Prefetch requests that were dropped since the queue was full
+		uint64_t droppedPrefetches;
+		/// Bricks that were evicted
+		uint64_t evictions;
+		/// Bytes that were read from the files
+		uint64_t bytesRead;
+
+		inline Statistics() : hits(0), misses(0), prefetches(0),
+			droppedPrefetches(0), evictions(0), bytesRead(0) { }
+	};
+
+	/// Return the cache that is shared by all volumes
+	static VolumeCache *getInstance();
+
+	/// Set the memory budget for resident bricks (in bytes)
+	void setMemoryBudget(size_t bytes);
+
+	/// Return the memory budget for resident bricks (in bytes)
+	inline size_t getMemoryBudget() const { return m_budget; }
+
+	/// Return the memory that is currently used by resident bricks (in bytes)
+	size_t getMemoryUsage() const;
+
+	/// Return the ID that identifies the bricks of a newly opened file
+	uint32_t registerFile();
+
+	/// Has any file been opened?
+	inline bool isUsed() const { return (int) m_nextID > 0; }
+
+	/**
+	 * \brief Return a brick of a file, reading it if necessary
+	 *
+	 * The brick remains valid until the calling thread requests
+	 * another brick, which may replace it in its lookup cache.
+	 */
+	const VolumeBrick *getBrick(const BrickFile *file, uint32_t index);
+
+	/**
+	 * \brief Ask the prefetching thread to read a brick of a file
+	 * in the background, unless the calling thread has used it recently
+	 */
+	void prefetch(const BrickFile *file, uint32_t index);
+
+	/**
+	 * \brief Drop the pending prefetch requests for a file, and wait
+	 * until the prefetching thread doesn't read from it anymore
+	 */
+	void cancelPrefetches(const BrickFile *file);
+
+	/// Return the current statistics
+	Statistics getStatistics() const;
+
+	/// Return a human-readable summary of the change since an earlier snapshot
+	static QString toString(const Statistics &start, const Statistics &end);
+private:
+	friend class PrefetchThread;
+
+	/// Independently locked part of the cache
+	struct Shard {
+		QMutex mutex;
+		std::map<uint64_t, VolumeBrick *> bricks;
+		/// Most and least recently used bricks
+		VolumeBrick *head, *tail;
+		size_t memory;
+
+		Shard() : head(NULL), tail(NULL), memory(0) { }
+	};
+
+	/**
+	 * \brief Lookup cache of one thread, which also counts the hits
+	 * and misses of the thread (so that they need no atomic operations)
+	 */
+	struct ThreadBricks {
+		VolumeCache *cache;
+		VolumeBrick *bricks[NORI_VOLCACHE_THREAD_BRICKS];
+		uint64_t hits, misses;
+
+		ThreadBricks(VolumeCache *cache) : cache(cache), hits(0), misses(0) {
+			memset(bricks, 0, sizeof(bricks));
+		}
+		~ThreadBricks();
+	};
+
+	/// Pending prefetch request
+	struct PrefetchRequest {
+		const BrickFile *file;
+		uint32_t index;
+	};
+
+	VolumeCache();
+	~VolumeCache();
+
+	/// Return the lookup cache of the calling thread
+	ThreadBricks *getThreadBricks();
+
+	/**
+	 * \brief Find or read a brick, and return it with a reference for the
+	 * caller (if \c wasRead is given, it tells whether the brick was read)
+	 */
+	VolumeBrick *fetch(const BrickFile *file, uint64_t key, uint32_t index, bool *wasRead);
+
+	/// Read the requested bricks until the cache is destroyed (see \ref PrefetchThread)
+	void runPrefetches();
+
+	/// Unlink a brick from the LRU list of a shard
+	static void unlink(Shard &shard, VolumeBrick *brick);
+
+	/// Insert a brick at the front of the LRU list of a shard
+	static void pushFront(Shard &shard, VolumeBrick *brick);
+
+	/* Statistics (hits and misses of the threads that are still running
+	   are kept by their lookup caches, which are destroyed before them) */
+	mutable QMutex m_statsMutex;
+	std::vector<ThreadBricks *> m_threads;
+	Statistics m_stats;
+
+	Shard m_shards[NORI_VOLCACHE_SHARDS];
+	QThreadStorage<ThreadBricks *> m_threadBricks;
+	size_t m_budget;
+	QAtomicInt m_nextID;
+
+	/* Prefetching */
+	QMutex m_prefetchMutex;
+	QWaitCondition m_prefetchPending, m_prefetchDone;
+	std::deque<PrefetchRequest> m_prefetchQueue;
+	/// File that the prefetching thread is currently reading from
+	const BrickFile *m_prefetchFile;
+	bool m_prefetchStop;
+	PrefetchThread *m_prefetchThread;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __VOLCACHE_H */
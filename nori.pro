@@ -2,27 +2,73 @@ SOURCES += src/common.cpp \
 	src/object.cpp \
 	src/proplist.cpp \
 	src/diffuse.cpp \
+	src/bitmaptexture.cpp \
 	src/isotropic.cpp \
+	src/tabulated.cpp \
 	src/microfacet.cpp \
 	src/scene.cpp \
+	src/lightbvh.cpp \
 	src/random.cpp \
 	src/quad.cpp \
+	src/albedo.cpp \
+	src/albedotable.cpp \
 	src/ao.cpp \
+	src/area.cpp \
+	src/direct.cpp \
+	src/envmap.cpp \
+	src/path.cpp \
+	src/lighttracer.cpp \
+	src/pssmlt.cpp \
+	src/ppm.cpp \
 	src/chi2test.cpp \
 	src/ttest.cpp \
 	src/mesh.cpp \
+	src/accel.cpp \
 	src/kdtree.cpp \
+	src/kdbench.cpp \
+	src/raybench.cpp \
+	src/profiler.cpp \
+	src/memreport.cpp \
+	src/pathstats.cpp \
+	src/status.cpp \
+	src/cluster.cpp \
+	src/bvh.cpp \
+	src/instance.cpp \
+	src/procedural.cpp \
+	src/curves.cpp \
+	src/displaced.cpp \
+	src/geocache.cpp \
 	src/obj.cpp \
+	src/binarymesh.cpp \
 	src/perspective.cpp \
+	src/orthographic.cpp \
+	src/fisheye.cpp \
+	src/spherical.cpp \
 	src/rfilter.cpp \
 	src/block.cpp \
+	src/rendercache.cpp \
+	src/film.cpp \
+	src/denoiser.cpp \
+	src/irrcache.cpp \
+	src/sdtree.cpp \
+	src/texcache.cpp \
+	src/paging.cpp \
+	src/volcache.cpp \
+	src/render.cpp \
 	src/bitmap.cpp \
 	src/parser.cpp \
+	src/server.cpp \
 	src/mirror.cpp \
+	src/bssrdf.cpp \
+	src/dipole.cpp \
+	src/null.cpp \
 	src/medium.cpp \
 	src/homogeneous.cpp \
 	src/heterogeneous.cpp \
 	src/independent.cpp \
+	src/stratified.cpp \
+	src/halton.cpp \
+	src/sobol.cpp \
 	src/main.cpp \
 	src/gui.cpp
 
@@ -53,7 +99,7 @@ macx | unix {
 	QMAKE_CXXFLAGS += -O3 -march=nocona -msse2 -mfpmath=sse -fstrict-aliasing
 	QMAKE_LIBDIR += /usr/local/lib
 	INCLUDEPATH += /usr/include/OpenEXR /usr/local/include/OpenEXR
-	LIBS += -lIlmImf -lIex
+	LIBS += -lIlmImf -lIex -lHalf
 }
 
 win32 {
@@ -64,7 +110,24 @@ win32 {
 	QMAKE_CXXFLAGS += /O2 /fp:fast /GS- /GL /D_SCL_SECURE_NO_WARNINGS /D_CRT_SECURE_NO_WARNINGS
 	QMAKE_LDFLAGS += /LTCG
 	SOURCES += src/support_win32.cpp
-	LIBS += IlmImf.lib Iex.lib IlmThread.lib Imath.lib Half.lib
+	LIBS += IlmImf.lib Iex.lib IlmThread.lib Imath.lib Half.lib psapi.lib ws2_32.lib
+}
+
+# Pass CONFIG+=simd4 to qmake to compute with 3-vectors in 4-wide SSE registers
+simd4 {
+	DEFINES += NORI_SIMD4
+}
+
+# Pass CONFIG+=libm to qmake to use the C library instead of the fast
+# transcendental functions in fastmath.h (e.g. for validation)
+libm {
+	DEFINES += NORI_LIBM
+}
+
+# Pass CONFIG+=travstats to qmake to count the nodes and triangles visited
+# by kd-tree queries (see Accelerator::collectTraversalStatistics())
+travstats {
+	DEFINES += NORI_TRAVERSAL_STATISTICS
 }
 
 TARGET = nori
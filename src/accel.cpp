@@ -0,0 +1,179 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/memreport.h>
+#include <boost/static_assert.hpp>
+
+NORI_NAMESPACE_BEGIN
+
+Accelerator::Accelerator() : m_ownsMeshes(true), m_primitiveCount(0) {
+	m_sizeMap.push_back(0);
+}
+
+Accelerator::~Accelerator() {
+	if (!m_ownsMeshes)
+		return;
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		delete m_meshes[i];
+}
+
+void Accelerator::reportMemory(MemoryReport &report) const {
+	report.add("accel", getMemoryUsage());
+}
+
+void Accelerator::addMesh(Mesh *mesh) {
+	m_primitiveCount += mesh->getTriangleCount();
+	m_meshes.push_back(mesh);
+	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+}
+
+bool Accelerator::update() {
+	build();
+	return false;
+}
+
+bool Accelerator::rayOccluded(const Ray3f &ray) const {
+	Intersection its; /* Unused */
+	return rayIntersect(ray, its, true);
+}
+
+bool Accelerator::prepareCameraRays(const Point3f &, const Vector3f *,
+		CameraRaySeed &seed) const {
+	seed.accel = NULL;
+	return false;
+}
+
+bool Accelerator::rayIntersectSeeded(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed &) const {
+	return rayIntersect(ray, its, false);
+}
+
+QString Accelerator::TraversalStatistics::toString() const {
+	double n = (double) std::max(queries, (uint64_t) 1);
+	return QString("%1 M queries, per query: %2 nodes, %3 leaves, %4 triangle "
+		"tests (%5% hit)").arg(queries / 1e6, 0, 'f', 2).arg(nodes / n, 0, 'f', 2)
+		.arg(leaves / n, 0, 'f', 2).arg(triangles / n, 0, 'f', 2)
+		.arg(100.0 * hits / n, 0, 'f', 1);
+}
+
+bool Accelerator::collectTraversalStatistics(TraversalStatistics &) const {
+	return false;
+}
+
+std::map<QString, AcceleratorFactory::Constructor> *AcceleratorFactory::m_constructors = NULL;
+
+void AcceleratorFactory::registerAccelerator(const QString &name, const Constructor &constr) {
+	if (!m_constructors)
+		m_constructors = new std::map<QString, AcceleratorFactory::Constructor>();
+	(*m_constructors)[name] = constr;
+}
+
+bool AcceleratorFactory::isRegistered(const QString &name) {
+	return m_constructors && m_constructors->find(name) != m_constructors->end();
+}
+
+QString AcceleratorFactory::getNames() {
+	QString result;
+	if (!m_constructors)
+		return result;
+	for (std::map<QString, Constructor>::const_iterator it = m_constructors->begin();
+			it != m_constructors->end(); ++it) {
+		if (!result.isEmpty())
+			result += ", ";
+		result += it->first;
+	}
+	return result;
+}
+
+Accelerator *AcceleratorFactory::createInstance(const QString &name, const PropertyList &propList) {
+	if (!isRegistered(name))
+		throw NoriException(QString("An acceleration data structure named '%1' "
+			"could not be found!").arg(name));
+	return (*m_constructors)[name](propList);
+}
+
+int Accelerator::rayIntersectPacket(const Ray3f *rays, Intersection *its, bool shadowRay) const {
+	int result = 0;
+	for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+		if (rayIntersect(rays[i], its[i], shadowRay))
+			result |= 1 << i;
+	}
+	return result;
+}
+
+void Accelerator::rayIntersectBatch(const Ray3f *rays, const uint32_t *indices,
+		uint32_t count, Intersection *its, bool *hit) const {
+	for (uint32_t k=0; k<count; ++k) {
+		uint32_t i = indices ? indices[k] : k;
+		hit[i] = rayIntersect(rays[i], its[i], false);
+	}
+}
+
+void Accelerator::rayOccludedBatch(const Ray3f *rays, const uint32_t *indices,
+		uint32_t count, bool *occluded) const {
+	for (uint32_t k=0; k<count; ++k) {
+		uint32_t i = indices ? indices[k] : k;
+		occluded[i] = rayOccluded(rays[i]);
+	}
+}
+
+/// Spread the lower 10 bits of a value so that there are two zero bits between each one
+static inline uint64_t spreadBits(uint32_t value) {
+	uint64_t x = value & 0x3FF;
+	x = (x | (x << 16)) & 0x30000FF;
+	x = (x | (x << 8))  & 0x300F00F;
+	x = (x | (x << 4))  & 0x30C30C3;
+	x = (x | (x << 2))  & 0x9249249;
+	return x;
+}
+
+void sortRays(const Ray3f *rays, uint32_t count, 
+		const BoundingBox3f &bbox, std::vector<uint32_t> &order) {
+	BOOST_STATIC_ASSERT(NORI_RAYSORT_GRID <= 1024);
+
+	Vector3f extents = bbox.getExtents();
+	Vector3f scale;
+	for (int i=0; i<3; ++i)
+		scale[i] = extents[i] > 0 ? NORI_RAYSORT_GRID / extents[i] : 0.0f;
+
+	/* Key: Morton code of the origin cell (30 bits), followed by 
+	   the direction octant (3 bits) */
+	std::vector<std::pair<uint64_t, uint32_t> > keys(count);
+	for (uint32_t i=0; i<count; ++i) {
+		const Ray3f &ray = rays[i];
+		uint64_t key = (ray.d.x() < 0 ? 4 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 1 : 0);
+		uint32_t cell[3];
+		for (int k=0; k<3; ++k) {
+			int c = (int) ((ray.o[k] - bbox.min[k]) * scale[k]);
+			cell[k] = (uint32_t) std::max(0, std::min(c, NORI_RAYSORT_GRID - 1));
+		}
+		uint64_t morton = (spreadBits(cell[0]) << 2) 
+			| (spreadBits(cell[1]) << 1) | spreadBits(cell[2]);
+		key |= morton << 3;
+		keys[i] = std::make_pair(key, i);
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	order.resize(count);
+	for (uint32_t i=0; i<count; ++i)
+		order[i] = keys[i].second;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,161 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/albedo.h>
+#include <QFile>
+#include <boost/static_assert.hpp>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Header of an albedo table file
+ *
+ * It is followed by the entries (little endian floats), ordered by
+ * roughness and then by \f$\cos\theta\f$.
+ */
+struct AlbedoTableHeader {
+	char magic[3];
+	uint8_t version;
+	uint32_t cosThetaResolution;
+	uint32_t roughnessResolution;
+	float minRoughness;
+	float maxRoughness;
+	uint8_t reserved[12];
+};
+
+BOOST_STATIC_ASSERT(sizeof(AlbedoTableHeader) == 32);
+
+AlbedoTable::AlbedoTable() : m_cosThetaResolution(0), m_roughnessResolution(0),
+	m_minRoughness(0), m_maxRoughness(0) { }
+
+AlbedoTable::AlbedoTable(int cosThetaResolution, int roughnessResolution,
+		float minRoughness, float maxRoughness)
+	: m_cosThetaResolution(cosThetaResolution), m_roughnessResolution(roughnessResolution),
+	  m_minRoughness(minRoughness), m_maxRoughness(maxRoughness) {
+	if (cosThetaResolution < 2 || roughnessResolution < 1)
+		throw NoriException(QString("AlbedoTable: invalid resolution %1x%2")
+			.arg(cosThetaResolution).arg(roughnessResolution));
+	m_data.resize(cosThetaResolution * roughnessResolution, 0.0f);
+	m_averages.resize(roughnessResolution, 0.0f);
+}
+
+void AlbedoTable::load(const QString &filename) {
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Cannot open \"%1\"").arg(filename));
+
+	AlbedoTableHeader header;
+	if (file.read((char *) &header, sizeof(AlbedoTableHeader)) != sizeof(AlbedoTableHeader)
+		|| memcmp(header.magic, "NAT", 3) != 0)
+		throw NoriException(QString("\"%1\" is not an albedo table!").arg(filename));
+	if (header.version != NORI_ALBEDO_TABLE_VERSION)
+		throw NoriException(QString("The albedo table \"%1\" has an unsupported "
+			"version (%2)!").arg(filename).arg(header.version));
+	if (header.cosThetaResolution < 2 || header.roughnessResolution < 1
+		|| header.cosThetaResolution > 65536 || header.roughnessResolution > 65536)
+		throw NoriException(QString("The albedo table \"%1\" is corrupt!").arg(filename));
+
+	m_cosThetaResolution = (int) header.cosThetaResolution;
+	m_roughnessResolution = (int) header.roughnessResolution;
+	m_minRoughness = header.minRoughness;
+	m_maxRoughness = header.maxRoughness;
+	m_data.resize(m_cosThetaResolution * m_roughnessResolution);
+	qint64 size = (qint64) (sizeof(float) * m_data.size());
+	if (file.read((char *) &m_data[0], size) != size) {
+		m_data.clear();
+		throw NoriException(QString("The albedo table \"%1\" is truncated!").arg(filename));
+	}
+	computeAverages();
+}
+
+void AlbedoTable::save(const QString &filename) const {
+	AlbedoTableHeader header;
+	memset(&header, 0, sizeof(AlbedoTableHeader));
+	memcpy(header.magic, "NAT", 3);
+	header.version = NORI_ALBEDO_TABLE_VERSION;
+	header.cosThetaResolution = (uint32_t) m_cosThetaResolution;
+	header.roughnessResolution = (uint32_t) m_roughnessResolution;
+	header.minRoughness = m_minRoughness;
+	header.maxRoughness = m_maxRoughness;
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(filename));
+	qint64 size = (qint64) (sizeof(float) * m_data.size());
+	bool success = file.write((const char *) &header, sizeof(AlbedoTableHeader))
+		== sizeof(AlbedoTableHeader) && (size == 0 ||
+		file.write((const char *) &m_data[0], size) == size);
+	file.close();
+	if (!success) {
+		file.remove();
+		throw NoriException(QString("Unable to write \"%1\"").arg(filename));
+	}
+}
+
+void AlbedoTable::computeAverages() {
+	/* Midpoint rule over the cosThetaResolution intervals */
+	m_averages.resize(m_roughnessResolution);
+	for (int j=0; j<m_roughnessResolution; ++j) {
+		double sum = 0;
+		for (int i=0; i<m_cosThetaResolution; ++i)
+			sum += coeff(i, j) * getCosTheta(i);
+		m_averages[j] = (float) (2 * sum / m_cosThetaResolution);
+	}
+}
+
+void AlbedoTable::findRoughness(float roughness, int &j, float &t) const {
+	if (m_roughnessResolution == 1 || m_maxRoughness <= m_minRoughness) {
+		j = 0; t = 0;
+		return;
+	}
+	float x = clamp((roughness - m_minRoughness) / (m_maxRoughness - m_minRoughness), 0.0f, 1.0f)
+		* (m_roughnessResolution - 1);
+	j = std::min((int) x, m_roughnessResolution - 2);
+	t = x - j;
+}
+
+float AlbedoTable::eval(float cosTheta, float roughness) const {
+	int j;
+	float tj;
+	findRoughness(roughness, j, tj);
+
+	float x = clamp(cosTheta * m_cosThetaResolution - 0.5f, 0.0f,
+		(float) (m_cosThetaResolution - 1));
+	int i = std::min((int) x, m_cosThetaResolution - 2);
+	float ti = x - i;
+
+	float value = (1 - ti) * coeff(i, j) + ti * coeff(i + 1, j);
+	if (tj > 0)
+		value = (1 - tj) * value + tj * ((1 - ti) * coeff(i, j + 1) + ti * coeff(i + 1, j + 1));
+	return value;
+}
+
+float AlbedoTable::evalAverage(float roughness) const {
+	int j;
+	float t;
+	findRoughness(roughness, j, t);
+	return t > 0 ? (1 - t) * m_averages[j] + t * m_averages[j + 1] : m_averages[j];
+}
+
+QString AlbedoTable::toString() const {
+	return QString("AlbedoTable[resolution=%1x%2, roughness=[%3, %4]]")
+		.arg(m_cosThetaResolution).arg(m_roughnessResolution)
+		.arg(m_minRoughness).arg(m_maxRoughness);
+}
+
+NORI_NAMESPACE_END
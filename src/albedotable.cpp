@@ -0,0 +1,189 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/albedo.h>
+#include <nori/bsdf.h>
+#include <nori/quad.h>
+#include <boost/bind.hpp>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tool that tabulates the directional albedo of a BSDF (see
+ * \ref AlbedoTable)
+ *
+ * For every roughness value of the table, the tool creates an instance
+ * of the BSDF type given by the \c bsdf property, passing on all of its
+ * own properties plus the roughness (named by \c roughnessProperty).
+ * Other parameters of the BSDF can thus be specified directly on the
+ * tool, e.g.
+ *
+ * <pre>
+ * &lt;test type="albedotable"&gt;
+ *     &lt;string name="bsdf" value="microfacet"/&gt;
+ *     &lt;color name="kd" value="0, 0, 0"/&gt;
+ *     &lt;string name="filename" value="microfacet-albedo.bin"/&gt;
+ * &lt;/test&gt;
+ * </pre>
+ *
+ * Each entry integrates the luminance of the BSDF times
+ * \f$\cos\theta_o\f$ over the hemisphere using \ref NDIntegrator, whose
+ * batches are evaluated using all cores. Since BSDFs are isotropic,
+ * only half of the hemisphere (\f$\phi \in [0, \pi]\f$) is integrated.
+ */
+class AlbedoTableGenerator : public NoriObject {
+public:
+	AlbedoTableGenerator(const PropertyList &propList) : m_bsdfProps(propList) {
+		/* Type of the BSDF */
+		m_bsdfType = propList.getString("bsdf", "microfacet");
+
+		/* Name of the BSDF property that is varied */
+		m_roughnessProperty = propList.getString("roughnessProperty", "alpha");
+
+		/* Range of the roughness values and resolution of the table */
+		m_minRoughness = propList.getFloat("minRoughness", 0.01f);
+		m_maxRoughness = propList.getFloat("maxRoughness", 1.0f);
+		m_roughnessResolution = propList.getInteger("roughnessResolution", 32);
+		m_cosThetaResolution = propList.getInteger("cosThetaResolution", 32);
+
+		/* Maximum number of integrand evaluations per entry */
+		m_maxEvals = propList.getInteger("maxEvals", 1000000);
+
+		/* Relative error requirement of every entry */
+		m_relError = propList.getFloat("relError", 1e-4f);
+
+		/* File the table is written to */
+		m_filename = propList.getString("filename");
+
+		if (m_roughnessResolution < 1 || m_cosThetaResolution < 2)
+			throw NoriException("AlbedoTableGenerator: invalid resolution!");
+		if (m_minRoughness > m_maxRoughness)
+			throw NoriException("AlbedoTableGenerator: invalid roughness range!");
+	}
+
+	void activate() {
+		AlbedoTable table(m_cosThetaResolution, m_roughnessResolution,
+			m_minRoughness, m_maxRoughness);
+
+		NDIntegrator integrator(1, 2, (size_t) m_maxEvals, 0, m_relError);
+		integrator.setThreadCount(getCoreCount());
+		double min[2] = { 0, 0 }, max[2] = { M_PI / 2, M_PI };
+
+		cout << "Tabulating the albedo of \"" << qPrintable(m_bsdfType) << "\" ("
+			 << m_cosThetaResolution << "x" << m_roughnessResolution << " entries, "
+			 << integrator.getThreadCount() << " threads) .." << endl;
+		QElapsedTimer timer;
+		timer.start();
+		size_t totalEvals = 0;
+
+		for (int j=0; j<m_roughnessResolution; ++j) {
+			PropertyList props(m_bsdfProps);
+			props.setFloat(m_roughnessProperty, table.getRoughness(j));
+			BSDF *bsdf = static_cast<BSDF *>(
+				NoriObjectFactory::createInstance(m_bsdfType, props));
+			if (bsdf->getClassType() != EBSDF) {
+				delete bsdf;
+				throw NoriException(QString("AlbedoTableGenerator: \"%1\" is not a BSDF!")
+					.arg(m_bsdfType));
+			}
+			if (bsdf->isDiscrete()) {
+				delete bsdf;
+				throw NoriException("AlbedoTableGenerator: discrete BSDFs are not supported!");
+			}
+			bsdf->activate();
+
+			for (int i=0; i<m_cosThetaResolution; ++i) {
+				float cosTheta = table.getCosTheta(i),
+				      sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+				Vector3f wi(sinTheta, 0.0f, cosTheta);
+				double result, error;
+				size_t evals = 0;
+
+				integrator.integrateVectorized(
+					boost::bind(&AlbedoTableGenerator::integrand, bsdf, wi, _1, _2, _3),
+					min, max, &result, &error, &evals);
+
+				/* Account for the other half of the hemisphere */
+				table.coeff(i, j) = (float) (2 * result);
+				totalEvals += evals;
+			}
+			delete bsdf;
+
+			cout << "  roughness " << table.getRoughness(j) << ": albedo "
+				 << table.coeff(m_cosThetaResolution - 1, j) << " (normal incidence) .. "
+				 << table.coeff(0, j) << " (grazing)" << endl;
+		}
+
+		table.computeAverages();
+		table.save(m_filename);
+		cout << "Wrote \"" << qPrintable(m_filename) << "\" (" << totalEvals
+			 << " evaluations, took " << timer.elapsed() << " ms)." << endl;
+	}
+
+	QString toString() const {
+		return QString(
+			"AlbedoTableGenerator[\n"
+			"  bsdf = \"%1\",\n"
+			"  roughnessProperty = \"%2\",\n"
+			"  roughness = [%3, %4],\n"
+			"  resolution = %5x%6,\n"
+			"  filename = \"%7\"\n"
+			"]")
+			.arg(m_bsdfType)
+			.arg(m_roughnessProperty)
+			.arg(m_minRoughness)
+			.arg(m_maxRoughness)
+			.arg(m_cosThetaResolution)
+			.arg(m_roughnessResolution)
+			.arg(m_filename);
+	}
+
+	EClassType getClassType() const { return ETest; }
+private:
+	/// Evaluate the cosine-weighted BSDF over spherical coordinates (thread-safe)
+	static void integrand(const BSDF *bsdf, const Vector3f &wi,
+			size_t nPts, const double *in, double *out) {
+		std::vector<BSDFQueryRecord> bRecs(nPts);
+		std::vector<Color3f> values(nPts);
+		for (size_t i=0; i<nPts; ++i) {
+			Vector3f wo = sphericalDirection((float) in[2*i], (float) in[2*i+1]);
+			bRecs[i] = BSDFQueryRecord(wi, wo, ESolidAngle);
+		}
+		if (nPts > 0)
+			bsdf->eval(&bRecs[0], &values[0], (uint32_t) nPts);
+		for (size_t i=0; i<nPts; ++i) {
+			/* Jacobian of the spherical coordinates times the cosine */
+			float theta = (float) in[2*i];
+			out[i] = (double) (values[i].getLuminance()
+				* std::cos(theta) * std::sin(theta));
+		}
+	}
+private:
+	PropertyList m_bsdfProps;
+	QString m_bsdfType;
+	QString m_roughnessProperty;
+	QString m_filename;
+	float m_minRoughness, m_maxRoughness;
+	int m_roughnessResolution, m_cosThetaResolution;
+	int m_maxEvals;
+	float m_relError;
+};
+
+NORI_REGISTER_CLASS(AlbedoTableGenerator, "albedotable");
+NORI_NAMESPACE_END
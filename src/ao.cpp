@@ -19,12 +19,28 @@
 #include <nori/integrator.h>
 #include <nori/sampler.h>
 #include <nori/scene.h>
+#include <nori/irrcache.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Ambient occlusion: very simple rendering technique that adds
  * "depth" to renderings by accounting for local shadowing.
+ *
+ * With \c rays > 1, each surface hit shoots several occlusion rays
+ * with stratified directions, which are traced as packets from their
+ * shared origin. This amortizes the cost of the camera ray over many
+ * occlusion rays, whose traversal is also more coherent.
+ *
+ * With the \c cache property, the occlusion is only computed at sparse
+ * points (using \c cacheSamples stratified rays each) and interpolated
+ * in between using an \ref IrradianceCache that is shared by all
+ * render threads and blocks. This gives smooth previews of diffuse
+ * scenes much faster than taking many rays per pixel.
+ *
+ * Single occlusion rays benefit from the \c kdShortRayLength property
+ * of the scene: when it is at least \c length, the kd-tree starts them
+ * at the subtree around their origin (see \ref KDTree::setShortRayGrid()).
  */
 class AmbientOcclusion : public Integrator {
 public:
@@ -32,36 +48,270 @@ public:
 		/* Ray length of the ambient occlusion queries;
 		   expressed relative to the scene size */
 		m_length = propList.getFloat("length", 0.1f);
+
+		/* Number of stratified occlusion rays per surface hit */
+		m_occlusionRays = propList.getInteger("rays", 1);
+
+		/* Trace the shadow rays of whole batches of pixel samples in sorted order */
+		m_wavefront = propList.getBoolean("wavefront", false);
+
+		/* Interpolate the occlusion from an irradiance cache */
+		m_useCache = propList.getBoolean("cache", false);
+
+		/* Error threshold of the cache (smaller = more records) */
+		m_cacheError = propList.getFloat("cacheError", 0.3f);
+
+		/* Number of rays per cache record */
+		m_cacheSamples = propList.getInteger("cacheSamples", 128);
+
+		/* Bounds of the spacing between records (relative to the scene size) */
+		m_cacheMinSpacing = propList.getFloat("cacheMinSpacing", 0.001f);
+		m_cacheMaxSpacing = propList.getFloat("cacheMaxSpacing", 0.05f);
+
+		if (m_occlusionRays < 1)
+			throw NoriException(QString("AmbientOcclusion: invalid rays %1 "
+				"(must be positive)").arg(m_occlusionRays));
+		if (m_cacheError <= 0)
+			throw NoriException(QString("AmbientOcclusion: invalid cacheError %1 "
+				"(must be positive)").arg(m_cacheError));
+		if (m_cacheSamples < 1)
+			throw NoriException(QString("AmbientOcclusion: invalid cacheSamples %1 "
+				"(must be positive)").arg(m_cacheSamples));
+		if (m_cacheMinSpacing <= 0 || m_cacheMaxSpacing < m_cacheMinSpacing)
+			throw NoriException("AmbientOcclusion: the cache spacing bounds must satisfy "
+				"0 < cacheMinSpacing <= cacheMaxSpacing!");
+	}
+
+	virtual ~AmbientOcclusion() {
+		delete (IrradianceCache *) m_cache;
 	}
 
-	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+	Color3f Li(RenderContext &context, const Ray3f &ray) const {
+		const Scene *scene = context.scene;
+
 		/* Find the surface that is visible in the requested direction */
 		Intersection its;
-		if (!scene->rayIntersect(ray, its))
+		context.rayCount++;
+		if (!context.rayIntersect(ray, its))
 			return Color3f(0.0f);
 
+		/* Compute the shading frame and position */
+		its.computeDifferentialGeometry();
+		if (context.aov)
+			context.aov->set(its);
+
+		if (m_useCache)
+			return cachedOcclusion(context, its);
+		if (m_occlusionRays > 1)
+			return occlusion(context, its);
+
 		/* Sample a cosine-weighted direction from the hemisphere (local coordinates) */
-		Vector3f d = squareToCosineHemisphere(sampler->next2D());
+		Vector3f d = squareToCosineHemisphere(context.sampler->next2D());
 
 		/* Use the shading frame at "its" to convert it to world coordinates */
 		d = its.toWorld(d);
 
 		/* Determine the length of the "shadow ray" based on the scene size
 		   and the configuration options */
-		float length = m_length * scene->getBoundingBox().getExtents().norm();
+		float length = m_length * context.sceneDiameter;
 
 		/* Create a new outgoing ray having extents (epsilon, length) */
 		Ray3f shadowRay(its.p, d, Epsilon, length);
 
 		/* Perform an occlusion test and return one or zero depending on the result */
+		context.shadowRayCount++;
 		return Color3f(scene->rayIntersect(shadowRay) ? 0.0f : 1.0f);
 	}
 
+	void Li(RenderContext &context, const Ray3f *rays, 
+			Color3f *result, uint32_t count) const {
+		/* Cache lookups happen one pixel sample at a time */
+		if (m_useCache) {
+			Integrator::Li(context, rays, result, count);
+			return;
+		}
+
+		const Scene *scene = context.scene;
+		MemoryArena &arena = *context.arena;
+
+		/* Neighboring camera rays are coherent: trace them as packets */
+		context.rayCount += count;
+		Intersection *its = arena.alloc<Intersection>(count);
+		uint32_t i = 0;
+		for (; i + NORI_PACKET_SIZE <= count; i += NORI_PACKET_SIZE) {
+			int hits = scene->rayIntersectPacket(rays + i, &its[i]);
+			for (int j=0; j<NORI_PACKET_SIZE; ++j) {
+				if (!(hits & (1 << j)))
+					its[i+j].mesh = NULL;
+			}
+		}
+		for (; i<count; ++i) {
+			if (!scene->rayIntersect(rays[i], its[i]))
+				its[i].mesh = NULL;
+		}
+
+		/* Generate one shadow ray per surface hit. Several rays per hit
+		   are traced right away as packets, as they share their origin */
+		float length = m_length * context.sceneDiameter;
+		Ray3f *shadowRays = arena.alloc<Ray3f>(count);
+		uint32_t *owners = arena.alloc<uint32_t>(count);
+		uint32_t shadowRayCount = 0, hitCount = 0;
+
+		/* Compute the differential geometry of all hits together
+		   (temporarily listing them in the owners array) */
+		for (i=0; i<count; ++i) {
+			if (its[i].mesh)
+				owners[hitCount++] = i;
+		}
+		Intersection::computeDifferentialGeometry(its, owners, hitCount);
+
+		for (i=0; i<count; ++i) {
+			result[i] = Color3f(0.0f);
+			if (!its[i].mesh)
+				continue;
+			if (context.aov)
+				context.aov[i].set(its[i]);
+			if (m_occlusionRays > 1) {
+				result[i] = occlusion(context, its[i]);
+				continue;
+			}
+			Vector3f d = its[i].toWorld(squareToCosineHemisphere(context.sampler->next2D()));
+			shadowRays[shadowRayCount] = Ray3f(its[i].p, d, Epsilon, length);
+			owners[shadowRayCount++] = i;
+		}
+
+		if (shadowRayCount == 0)
+			return;
+
+		/* These are incoherent -- trace them in sorted order */
+		std::vector<uint32_t> order;
+		sortRays(shadowRays, shadowRayCount, context.sceneBounds, order);
+		context.shadowRayCount += shadowRayCount;
+		for (size_t k=0; k<order.size(); ++k) {
+			uint32_t index = order[k];
+			if (!scene->rayIntersect(shadowRays[index]))
+				result[owners[index]] = Color3f(1.0f);
+		}
+	}
+
 	QString toString() const {
-		return QString("AmbientOcclusion[length=%1]").arg(m_length);
+		return QString("AmbientOcclusion[length=%1, rays=%2, wavefront=%3, cache=%4, "
+			"cacheError=%5, cacheSamples=%6]")
+			.arg(m_length).arg(m_occlusionRays).arg(m_wavefront).arg(m_useCache)
+			.arg(m_cacheError).arg(m_cacheSamples);
 	}
 private:
+	/**
+	 * \brief Trace \c m_occlusionRays stratified rays from a surface
+	 * interaction as packets, and return the unoccluded fraction
+	 */
+	Color3f occlusion(RenderContext &context, const Intersection &its) const {
+		int n = m_occlusionRays;
+		Point2f *samples = context.arena->alloc<Point2f>(n);
+		stratify(context.sampler, samples, n);
+
+		float length = m_length * context.sceneDiameter;
+		Ray3f packet[NORI_PACKET_SIZE];
+		Intersection unused[NORI_PACKET_SIZE];
+		int unoccluded = 0;
+		for (int i=0; i<n; i += NORI_PACKET_SIZE) {
+			/* Pad the last packet by repeating its last ray */
+			int active = std::min(NORI_PACKET_SIZE, n - i);
+			for (int j=0; j<NORI_PACKET_SIZE; ++j) {
+				Vector3f d = its.toWorld(squareToCosineHemisphere(
+					samples[i + std::min(j, active - 1)]));
+				packet[j] = Ray3f(its.p, d, Epsilon, length);
+			}
+			int hits = context.scene->rayIntersectPacket(packet, unused, true);
+			for (int j=0; j<active; ++j) {
+				if (!(hits & (1 << j)))
+					unoccluded++;
+			}
+		}
+		context.shadowRayCount += n;
+		return Color3f(unoccluded / (float) n);
+	}
+
+	/**
+	 * \brief Generate \c n samples on the unit square that are stratified
+	 * on a jittered grid (when \c n is a square number), or else in both
+	 * dimensions separately (Latin hypercube)
+	 */
+	void stratify(Sampler *sampler, Point2f *samples, int n) const {
+		int res = (int) (std::sqrt((float) n) + 0.5f);
+		if (res * res == n) {
+			float inv = 1.0f / res;
+			for (int i=0; i<n; ++i) {
+				Point2f jitter = sampler->next2D();
+				samples[i] = Point2f(((i % res) + jitter.x()) * inv,
+					((i / res) + jitter.y()) * inv);
+			}
+			return;
+		}
+
+		float inv = 1.0f / n;
+		for (int i=0; i<n; ++i) {
+			Point2f jitter = sampler->next2D();
+			samples[i] = Point2f((i + jitter.x()) * inv, (i + jitter.y()) * inv);
+		}
+		for (int i=n-1; i>0; --i) {
+			int j = std::min((int) (sampler->next1D() * (i + 1)), i);
+			std::swap(samples[i].y(), samples[j].y());
+		}
+	}
+
+	/**
+	 * \brief Interpolate the unoccluded fraction of the hemisphere at a
+	 * surface interaction from the cache, or compute a new record
+	 */
+	Color3f cachedOcclusion(RenderContext &context, const Intersection &its) const {
+		IrradianceCache *cache = getCache(context);
+		Color3f E;
+		if (cache->lookup(its.p, its.shFrame.n, E))
+			return E * INV_PI;
+
+		/* Trace the stratified rays of a new record, recording the
+		   visibility and the distance to the occluder (if any) */
+		const Scene *scene = context.scene;
+		float length = m_length * context.sceneDiameter;
+		int sampleCount = cache->getSampleCount();
+		Color3f *visibility = context.arena->alloc<Color3f>(sampleCount);
+		float *dist = context.arena->alloc<float>(sampleCount);
+		Intersection occluder;
+		for (int i=0; i<sampleCount; ++i) {
+			Vector3f d = its.toWorld(cache->sampleDirection(i, context.sampler->next2D()));
+			context.rayCount++;
+			if (scene->rayIntersect(Ray3f(its.p, d, Epsilon, length), occluder)) {
+				visibility[i] = Color3f(0.0f);
+				dist[i] = occluder.t;
+			} else {
+				visibility[i] = Color3f(1.0f);
+				dist[i] = length;
+			}
+		}
+		return cache->addRecord(its.p, its.shFrame, visibility, dist) * INV_PI;
+	}
+
+	/// Return the cache, creating it when the first record is needed
+	IrradianceCache *getCache(const RenderContext &context) const {
+		IrradianceCache *cache = m_cache;
+		if (cache)
+			return cache;
+		QMutexLocker locker(&m_cacheMutex);
+		if (!m_cache)
+			m_cache = new IrradianceCache(context.sceneBounds, m_cacheError, m_cacheSamples,
+				m_cacheMinSpacing * context.sceneDiameter, m_cacheMaxSpacing * context.sceneDiameter);
+		return m_cache;
+	}
+
 	float m_length;
+	int m_occlusionRays;
+	bool m_useCache;
+	float m_cacheError;
+	int m_cacheSamples;
+	float m_cacheMinSpacing, m_cacheMaxSpacing;
+	mutable QAtomicPointer<IrradianceCache> m_cache;
+	mutable QMutex m_cacheMutex;
 };
 
 NORI_REGISTER_CLASS(AmbientOcclusion, "ao");
@@ -0,0 +1,101 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/luminaire.h>
+#include <nori/mesh.h>
+#include <nori/frame.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Area luminaire that emits a constant radiance from the front
+ * side (i.e. the side of the normals) of the mesh it is attached to
+ *
+ * Positions are sampled uniformly with respect to surface area using
+ * \ref Mesh::samplePosition().
+ */
+class AreaLuminaire : public Luminaire {
+public:
+	AreaLuminaire(const PropertyList &propList) : m_mesh(NULL) {
+		m_radiance = propList.getColor("radiance");
+	}
+
+	Color3f sample(LuminaireQueryRecord &lRec, const Point2f &sample) const {
+		m_mesh->samplePosition(sample, lRec.p, lRec.n);
+		lRec.luminaire = this;
+		lRec.d = lRec.p - lRec.ref;
+		float distSquared = lRec.d.squaredNorm();
+		lRec.dist = std::sqrt(distSquared);
+		lRec.d /= lRec.dist;
+
+		/* Convert the density from area to solid angles */
+		float cosTheta = -lRec.n.dot(lRec.d);
+		if (cosTheta <= 0 || lRec.dist == 0) {
+			lRec.pdf = 0.0f;
+			return Color3f(0.0f);
+		}
+		lRec.pdf = m_mesh->pdf() * distSquared / cosTheta;
+		return m_radiance / lRec.pdf;
+	}
+
+	Color3f sampleRay(LuminaireQueryRecord &lRec, Ray3f &ray,
+			const Point2f &positionSample, const Point2f &directionSample) const {
+		m_mesh->samplePosition(positionSample, lRec.p, lRec.n);
+		lRec.luminaire = this;
+		lRec.pdf = m_mesh->pdf();
+
+		/* Cosine-weighted emission into the front side */
+		Vector3f d = Frame(lRec.n).toWorld(squareToCosineHemisphere(directionSample));
+		ray = Ray3f(lRec.p, d);
+		return m_radiance * (M_PI / lRec.pdf);
+	}
+
+	Color3f eval(const LuminaireQueryRecord &lRec) const {
+		return lRec.n.dot(lRec.d) < 0 ? m_radiance : Color3f(0.0f);
+	}
+
+	float pdf(const LuminaireQueryRecord &lRec) const {
+		float cosTheta = -lRec.n.dot(lRec.d);
+		if (cosTheta <= 0)
+			return 0.0f;
+		return m_mesh->pdf() * lRec.dist * lRec.dist / cosTheta;
+	}
+
+	float getPower() const {
+		return m_radiance.getLuminance() * m_mesh->surfaceArea() * M_PI;
+	}
+
+	/// Attach the luminaire to the mesh it was declared in
+	void setParent(NoriObject *parent) {
+		if (parent->getClassType() != EMesh)
+			throw NoriException("AreaLuminaire: can only be attached to a mesh!");
+		m_mesh = static_cast<Mesh *>(parent);
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString("AreaLuminaire[radiance = %1]")
+			.arg(m_radiance.toString());
+	}
+private:
+	Color3f m_radiance;
+	const Mesh *m_mesh;
+};
+
+NORI_REGISTER_CLASS(AreaLuminaire, "area");
+NORI_NAMESPACE_END
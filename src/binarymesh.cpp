@@ -0,0 +1,303 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/paging.h>
+#include <QFile>
+#include <boost/static_assert.hpp>
+#include <algorithm>
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#endif
+
+/// Version of the binary mesh format (increase when changing the layout)
+#define NORI_BINARY_MESH_VERSION 1
+
+/**
+ * \brief Alignment of the arrays within a binary mesh file (a page, so
+ * that every page of the mapping holds data of only one array)
+ */
+#define NORI_BINARY_MESH_ALIGNMENT 4096
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Header of a binary mesh file
+ *
+ * It is followed by the vertex positions, normals and texture coordinates
+ * (if any) and the triangle indices, in the in-memory layout of \ref Mesh.
+ * Each array starts at the given offset, which is a multiple of
+ * \ref NORI_BINARY_MESH_ALIGNMENT (files written by earlier versions
+ * use 64 bytes, which works just as well). The triangles are sorted
+ * along a Morton curve, and the vertices follow in the order in which
+ * the triangles use them. All values use the byte order of the
+ * machine that wrote the file (i.e. little endian in practice).
+ */
+struct BinaryMeshHeader {
+	char magic[3];
+	uint8_t version;
+	uint32_t flags;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint64_t positionOffset;
+	uint64_t normalOffset;
+	uint64_t texCoordOffset;
+	uint64_t indexOffset;
+	uint8_t reserved[16];
+
+	enum EFlags {
+		EHasNormals = 0x01,
+		EHasTexCoords = 0x02
+	};
+};
+
+BOOST_STATIC_ASSERT(sizeof(BinaryMeshHeader) == 64);
+
+static inline uint64_t alignOffset(uint64_t offset) {
+	return (offset + NORI_BINARY_MESH_ALIGNMENT - 1)
+		/ NORI_BINARY_MESH_ALIGNMENT * NORI_BINARY_MESH_ALIGNMENT;
+}
+
+void Mesh::saveBinary(const QString &filename) const {
+	BinaryMeshHeader header;
+	memset(&header, 0, sizeof(BinaryMeshHeader));
+	memcpy(header.magic, "NBM", 3);
+	header.version = NORI_BINARY_MESH_VERSION;
+	header.vertexCount = m_vertexCount;
+	header.triangleCount = m_triangleCount;
+
+	/* Compute the location of every array */
+	uint64_t offset = alignOffset(sizeof(BinaryMeshHeader));
+	header.positionOffset = offset;
+	offset = alignOffset(offset + sizeof(Point3f) * m_vertexCount);
+	if (hasVertexNormals()) {
+		header.flags |= BinaryMeshHeader::EHasNormals;
+		header.normalOffset = offset;
+		offset = alignOffset(offset + sizeof(Normal3f) * m_vertexCount);
+	}
+	if (hasVertexTexCoords()) {
+		header.flags |= BinaryMeshHeader::EHasTexCoords;
+		header.texCoordOffset = offset;
+		offset = alignOffset(offset + sizeof(Point2f) * m_vertexCount);
+	}
+	header.indexOffset = offset;
+
+	/* Store the triangles and vertices in an order with a good locality,
+	   so that nearby triangles and their vertices share the pages of the
+	   file. This keeps the working set of a mapped mesh small */
+	std::vector<uint32_t> indices, vertexOrder;
+	computeLocalityOrder(indices, vertexOrder);
+
+	std::vector<Point3f> positions(m_vertexCount);
+	std::vector<Normal3f> normals(hasVertexNormals() ? m_vertexCount : 0);
+	std::vector<Point2f> texCoords(hasVertexTexCoords() ? m_vertexCount : 0);
+	for (uint32_t i=0; i<m_vertexCount; ++i) {
+		positions[i] = m_vertexPositions[vertexOrder[i]];
+		if (!normals.empty())
+			normals[i] = getVertexNormal(vertexOrder[i]);
+		if (!texCoords.empty())
+			texCoords[i] = getVertexTexCoord(vertexOrder[i]);
+	}
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(filename));
+
+	struct Array { uint64_t offset; const void *data; qint64 size; } arrays[] = {
+		{ header.positionOffset, positions.empty() ? NULL : &positions[0],
+			(qint64) (sizeof(Point3f) * m_vertexCount) },
+		{ header.normalOffset, normals.empty() ? NULL : &normals[0],
+			(qint64) (sizeof(Normal3f) * m_vertexCount) },
+		{ header.texCoordOffset, texCoords.empty() ? NULL : &texCoords[0],
+			(qint64) (sizeof(Point2f) * m_vertexCount) },
+		{ header.indexOffset, indices.empty() ? NULL : &indices[0],
+			(qint64) (sizeof(uint32_t) * 3 * m_triangleCount) }
+	};
+
+	bool success = file.write((const char *) &header, sizeof(BinaryMeshHeader))
+		== sizeof(BinaryMeshHeader);
+	for (int i=0; i<4 && success; ++i) {
+		if (!arrays[i].data)
+			continue;
+		success = file.seek(arrays[i].offset) &&
+			file.write((const char *) arrays[i].data, arrays[i].size) == arrays[i].size;
+	}
+	file.close();
+
+	if (!success) {
+		file.remove();
+		throw NoriException(QString("Unable to write \"%1\"").arg(filename));
+	}
+}
+
+/**
+ * \brief Loader for binary mesh files
+ *
+ * The file is mapped into memory, and the vertex and index arrays of the
+ * mesh point directly into the mapping. Loading thus only costs the page
+ * faults of the data that is actually accessed, and the operating system
+ * can drop unmodified pages again when memory runs low (see \ref PagedMemory).
+ * The mapping is private (copy-on-write), so that e.g.
+ * \ref Mesh::setVertexPositions() and the \c toWorld transformation
+ * don't modify the file.
+ *
+ * Binary mesh files are created with <tt>nori --convert</tt> (see
+ * \ref Mesh::saveBinary()).
+ */
+class BinaryMesh : public Mesh {
+public:
+	BinaryMesh(const PropertyList &propList) : m_data(NULL), m_size(0) {
+		m_filename = propList.getString("filename");
+		Transform trafo = propList.getTransform("toWorld", Transform());
+
+		/* Gather the vertices of every triangle to speed up intersection tests */
+		m_packTriangles = propList.getBoolean("packTriangles", false);
+		m_name = m_filename;
+
+		/* Parse the file header */
+		QFile file(m_filename);
+		BinaryMeshHeader header;
+		if (!file.open(QIODevice::ReadOnly))
+			throw NoriException(QString("Cannot open \"%1\"").arg(m_filename));
+		bool valid = file.read((char *) &header, sizeof(BinaryMeshHeader)) == sizeof(BinaryMeshHeader);
+		m_size = (size_t) file.size();
+		file.close();
+
+		if (!valid || memcmp(header.magic, "NBM", 3) != 0 || header.version != NORI_BINARY_MESH_VERSION)
+			throw NoriException(QString("\"%1\" is not a valid binary mesh file!").arg(m_filename));
+
+		uint64_t vertexCount = header.vertexCount, triangleCount = header.triangleCount;
+		if (header.positionOffset + sizeof(Point3f) * vertexCount > m_size ||
+			((header.flags & BinaryMeshHeader::EHasNormals) &&
+			  header.normalOffset + sizeof(Normal3f) * vertexCount > m_size) ||
+			((header.flags & BinaryMeshHeader::EHasTexCoords) &&
+			  header.texCoordOffset + sizeof(Point2f) * vertexCount > m_size) ||
+			header.indexOffset + sizeof(uint32_t) * 3 * triangleCount > m_size)
+			throw NoriException(QString("The binary mesh file \"%1\" is truncated!").arg(m_filename));
+
+		cout << "Mapping \"" << qPrintable(m_filename) << "\" into memory .." << endl;
+		map();
+
+		/* Check the indices before handing the arrays to Mesh (whose
+		   destructor would otherwise try to release them) */
+		const uint32_t *indices = (const uint32_t *) (m_data + header.indexOffset);
+		for (uint64_t i=0; i<3*triangleCount; ++i) {
+			if (indices[i] >= header.vertexCount) {
+				unmap();
+				throw NoriException(QString("The binary mesh file \"%1\" contains "
+					"an invalid vertex index!").arg(m_filename));
+			}
+		}
+
+		m_vertexCount = header.vertexCount;
+		m_triangleCount = header.triangleCount;
+		m_vertexPositions = (Point3f *) (m_data + header.positionOffset);
+		if (header.flags & BinaryMeshHeader::EHasNormals)
+			m_vertexNormals = (Normal3f *) (m_data + header.normalOffset);
+		if (header.flags & BinaryMeshHeader::EHasTexCoords)
+			m_vertexTexCoords = (Point2f *) (m_data + header.texCoordOffset);
+		m_indices = (uint32_t *) (m_data + header.indexOffset);
+
+		/* Only touch the vertex data if there is a transformation */
+		if (!trafo.getMatrix().isIdentity()) {
+			for (uint32_t i=0; i<m_vertexCount; ++i)
+				m_vertexPositions[i] = trafo * m_vertexPositions[i];
+			if (m_vertexNormals) {
+				for (uint32_t i=0; i<m_vertexCount; ++i)
+					m_vertexNormals[i] = (trafo * m_vertexNormals[i]).normalized();
+			}
+		}
+
+		cout << "Mapped " << m_triangleCount << " triangles and "
+			 << m_vertexCount << " vertices." << endl;
+	}
+
+	bool isMapped() const { return true; }
+
+	virtual ~BinaryMesh() {
+		/* The arrays belong to the mapping, not to Mesh */
+		m_vertexPositions = NULL;
+		m_vertexNormals = NULL;
+		m_vertexTexCoords = NULL;
+		m_indices = NULL;
+		unmap();
+	}
+protected:
+	void map() {
+		QByteArray filename = m_filename.toLocal8Bit();
+		#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+			int fd = open(filename.data(), O_RDONLY);
+			if (fd == -1)
+				throw NoriException(QString("Could not open \"%1\"!").arg(m_filename));
+			void *data = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED)
+				throw NoriException("mmap(): failed.");
+			if (close(fd) != 0)
+				throw NoriException("close(): unable to close file descriptor!");
+			m_data = (char *) data;
+		#elif defined(PLATFORM_WINDOWS)
+			m_file = CreateFileA(filename.data(), GENERIC_READ,
+				FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL, NULL);
+			if (m_file == INVALID_HANDLE_VALUE)
+				throw NoriException(QString("Could not open \"%1\"!").arg(m_filename));
+			m_fileMapping = CreateFileMapping(m_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+			if (m_fileMapping == NULL)
+				throw NoriException("CreateFileMapping(): failed.");
+			m_data = (char *) MapViewOfFile(m_fileMapping, FILE_MAP_COPY, 0, 0, 0);
+			if (m_data == NULL)
+				throw NoriException("MapViewOfFile(): failed.");
+		#endif
+		PagedMemory::getInstance()->addRegion(m_data, m_size);
+	}
+
+	void unmap() {
+		if (!m_data)
+			return;
+		PagedMemory::getInstance()->removeRegion(m_data);
+		#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+			if (munmap(m_data, m_size) != 0)
+				throw NoriException("munmap(): unable to unmap memory!");
+		#elif defined(PLATFORM_WINDOWS)
+			if (!UnmapViewOfFile(m_data))
+				throw NoriException("UnmapViewOfFile(): unable to unmap memory region");
+			if (!CloseHandle(m_fileMapping))
+				throw NoriException("CloseHandle(): unable to close file mapping!");
+			if (!CloseHandle(m_file))
+				throw NoriException("CloseHandle(): unable to close file");
+		#endif
+		m_data = NULL;
+	}
+protected:
+	QString m_filename;
+	char *m_data;
+	size_t m_size;
+#if defined(PLATFORM_WINDOWS)
+	HANDLE m_file;
+	HANDLE m_fileMapping;
+#endif
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "binary");
+NORI_NAMESPACE_END
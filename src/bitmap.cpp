@@ -17,31 +17,60 @@
 */
 
 #include <nori/bitmap.h>
+#include <nori/profiler.h>
 #include <ImfInputFile.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfMultiPartOutputFile.h>
+#include <ImfOutputPart.h>
+#include <ImfTiledOutputPart.h>
+#include <ImfPartType.h>
 #include <ImfChannelList.h>
 #include <ImfStringAttribute.h>
 #include <ImfVersion.h>
 #include <ImfIO.h>
+#include <ImfThreading.h>
+#include <OpenEXRConfig.h>
 #include <QFile>
+#include <QMutex>
+#include <QImage>
 
-NORI_NAMESPACE_BEGIN
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
 
-Bitmap::Bitmap(const QString &filename) {
-	if (!QFile(filename).exists())
-		throw NoriException(QString("EXR file \"%1\" does not exist!").arg(filename));
+/// Number of entries of the lookup table of \ref Bitmap::toSRGB8()
+#define NORI_SRGB_TABLE_SIZE 8192
 
-	QByteArray filenameUtf8 = filename.toUtf8();
-	Imf::InputFile file(filenameUtf8.data());
-	const Imf::Header &header = file.header();
-	const Imf::ChannelList &channels = header.channels();
+#if OPENEXR_VERSION_MAJOR > 2 || (OPENEXR_VERSION_MAJOR == 2 && OPENEXR_VERSION_MINOR >= 2)
+#define NORI_EXR_HAS_DWA 1 /* DWAA/DWAB compression was added in OpenEXR 2.2 */
+#endif
 
-	Imath::Box2i dw = file.header().dataWindow();
-	resize(dw.max.y - dw.min.y + 1, dw.max.x - dw.min.x + 1);
+NORI_NAMESPACE_BEGIN
 
-	cout << "Reading a " << cols() << "x" << rows() 
-		 << " OpenEXR file from \"" << qPrintable(filename) << "\"" << endl;
-	
+static QMutex threadPoolMutex;
+static bool threadPoolReady = false;
+
+/**
+ * \brief Let OpenEXR decode and encode the blocks of a file on its global
+ * pool with one thread per core (instead of on the calling thread alone)
+ *
+ * Files read or written by several threads at once share the pool.
+ */
+static void initThreadPool() {
+	QMutexLocker locker(&threadPoolMutex);
+	if (threadPoolReady)
+		return;
+	Imf::setGlobalThreadCount(getCoreCount());
+	threadPoolReady = true;
+}
+
+/**
+ * \brief Find the red, green, and blue channels of an OpenEXR file
+ * (shared by \ref Bitmap and \ref MipBitmap)
+ */
+static void findRGBChannels(const Imf::Header &header, const char *names[3]) {
+	const Imf::ChannelList &channels = header.channels();
 	const char *ch_r = NULL, *ch_g = NULL, *ch_b = NULL;
 	for (Imf::ChannelList::ConstIterator it = channels.begin(); it != channels.end(); ++it) {
 		QString name = QString(it.name()).toLower();
@@ -65,47 +94,371 @@ Bitmap::Bitmap(const QString &filename) {
 
 	if (!ch_r || !ch_g || !ch_b)
 		throw NoriException("This is not a standard RGB OpenEXR file!");
+	names[0] = ch_r; names[1] = ch_g; names[2] = ch_b;
+}
 
-	size_t compStride = sizeof(float),
+/**
+ * \brief Read the RGB channels of an OpenEXR file into an interleaved
+ * buffer of \c width pixels per row, converting them to \c type
+ */
+static void readRGBChannels(Imf::InputFile &file, const char *names[3],
+		Imf::PixelType type, char *ptr, size_t width) {
+	size_t compStride = type == Imf::HALF ? sizeof(half) : sizeof(float),
 	       pixelStride = 3 * compStride,
-	       rowStride = pixelStride * cols();
-
-	char *ptr = reinterpret_cast<char *>(data());
+	       rowStride = pixelStride * width;
 
 	Imf::FrameBuffer frameBuffer;
-	frameBuffer.insert(ch_r, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-	frameBuffer.insert(ch_g, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-	frameBuffer.insert(ch_b, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); 
+	for (int i=0; i<3; ++i) {
+		frameBuffer.insert(names[i], Imf::Slice(type, ptr, pixelStride, rowStride));
+		ptr += compStride;
+	}
 	file.setFrameBuffer(frameBuffer);
+	Imath::Box2i dw = file.header().dataWindow();
 	file.readPixels(dw.min.y, dw.max.y);
 }
 
-void Bitmap::save(const QString &filename) {
-	cout << "Writing a " << cols() << "x" << rows() 
-		 << " OpenEXR file to \"" << qPrintable(filename) << "\"" << endl;
+Bitmap::Bitmap(const QString &filename) {
+	if (!QFile(filename).exists())
+		throw NoriException(QString("EXR file \"%1\" does not exist!").arg(filename));
 
-	Imf::Header header(cols(), rows());
-	header.insert("comments", Imf::StringAttribute("Generated by Nori"));
+	ProfileScope scope("Read EXR", "load");
+	scope.setDetail(filename);
+	initThreadPool();
+	QByteArray filenameUtf8 = filename.toUtf8();
+	Imf::InputFile file(filenameUtf8.data());
 
-	Imf::ChannelList &channels = header.channels();
-	channels.insert("R", Imf::Channel(Imf::FLOAT));
-	channels.insert("G", Imf::Channel(Imf::FLOAT));
-	channels.insert("B", Imf::Channel(Imf::FLOAT));
+	Imath::Box2i dw = file.header().dataWindow();
+	resize(dw.max.y - dw.min.y + 1, dw.max.x - dw.min.x + 1);
 
-	Imf::FrameBuffer frameBuffer;
+	cout << "Reading a " << cols() << "x" << rows() 
+		 << " OpenEXR file from \"" << qPrintable(filename) << "\"" << endl;
+
+	const char *channels[3];
+	findRGBChannels(file.header(), channels);
+	readRGBChannels(file, channels, Imf::FLOAT, reinterpret_cast<char *>(data()), cols());
+}
+
+MipBitmap::MipBitmap(const QString &filename, bool halfPrecision) : m_half(halfPrecision) {
+	if (!QFile(filename).exists())
+		throw NoriException(QString("EXR file \"%1\" does not exist!").arg(filename));
+
+	ProfileScope scope("Read EXR", "load");
+	scope.setDetail(filename);
+	initThreadPool();
+	QByteArray filenameUtf8 = filename.toUtf8();
+	Imf::InputFile file(filenameUtf8.data());
+	const char *channels[3];
+	findRGBChannels(file.header(), channels);
+
+	Imath::Box2i dw = file.header().dataWindow();
+	m_levels.resize(1);
+	Level &level = m_levels[0];
+	level.width = dw.max.x - dw.min.x + 1;
+	level.height = dw.max.y - dw.min.y + 1;
+
+	cout << "Reading a " << level.width << "x" << level.height << " OpenEXR file from \""
+		 << qPrintable(filename) << "\"" << (m_half ? " (half precision)" : "") << endl;
+
+	/* Read the channels in the precision of the storage, so that no
+	   full precision copy of the image is needed */
+	size_t count = 3 * (size_t) level.width * level.height;
+	if (m_half) {
+		level.halves.resize(count);
+		readRGBChannels(file, channels, Imf::HALF, (char *) &level.halves[0], level.width);
+	} else {
+		level.values.resize(count);
+		readRGBChannels(file, channels, Imf::FLOAT, (char *) &level.values[0], level.width);
+	}
+
+	buildPyramid();
+}
+
+void MipBitmap::buildPyramid() {
+	while (m_levels.back().width > 1 || m_levels.back().height > 1) {
+		m_levels.push_back(Level());
+		const Level &source = m_levels[m_levels.size() - 2];
+		Level &target = m_levels.back();
+		int level = (int) m_levels.size() - 2;
+		target.width = std::max(1, (source.width + 1) / 2);
+		target.height = std::max(1, (source.height + 1) / 2);
+		size_t count = 3 * (size_t) target.width * target.height;
+		if (m_half)
+			target.halves.resize(count);
+		else
+			target.values.resize(count);
+
+		/* Average blocks of 2x2 pixels (repeating the last row or column) */
+		for (int y=0; y<target.height; ++y) {
+			int y0 = std::min(2*y, source.height - 1), y1 = std::min(2*y + 1, source.height - 1);
+			for (int x=0; x<target.width; ++x) {
+				int x0 = std::min(2*x, source.width - 1), x1 = std::min(2*x + 1, source.width - 1);
+				Color3f value = (lookup(level, y0, x0) + lookup(level, y0, x1)
+					+ lookup(level, y1, x0) + lookup(level, y1, x1)) * 0.25f;
+				size_t index = 3 * ((size_t) y * target.width + x);
+				for (int i=0; i<3; ++i) {
+					if (m_half)
+						target.halves[index + i] = half(value[i]);
+					else
+						target.values[index + i] = value[i];
+				}
+			}
+		}
+	}
+}
+
+size_t MipBitmap::getMemoryUsage() const {
+	size_t result = 0;
+	for (size_t i=0; i<m_levels.size(); ++i)
+		result += m_levels[i].halves.size() * sizeof(half)
+			+ m_levels[i].values.size() * sizeof(float);
+	return result;
+}
+
+/// Look up an OpenEXR compression method by name
+static bool lookupCompression(const QString &name, Imf::Compression &result) {
+	QString key = name.toLower();
+	if (key == "none")       result = Imf::NO_COMPRESSION;
+	else if (key == "rle")   result = Imf::RLE_COMPRESSION;
+	else if (key == "zips")  result = Imf::ZIPS_COMPRESSION;
+	else if (key == "zip")   result = Imf::ZIP_COMPRESSION;
+	else if (key == "piz")   result = Imf::PIZ_COMPRESSION;
+	else if (key == "pxr24") result = Imf::PXR24_COMPRESSION;
+	else if (key == "b44")   result = Imf::B44_COMPRESSION;
+	else if (key == "b44a")  result = Imf::B44A_COMPRESSION;
+#if defined(NORI_EXR_HAS_DWA)
+	else if (key == "dwaa")  result = Imf::DWAA_COMPRESSION;
+	else if (key == "dwab")  result = Imf::DWAB_COMPRESSION;
+#endif
+	else return false;
+	return true;
+}
+
+bool Bitmap::isSupportedCompression(const QString &name) {
+	return getExrCompression(name) >= 0;
+}
+
+int Bitmap::getExrCompression(const QString &name) {
+	Imf::Compression compression;
+	if (!lookupCompression(name, compression))
+		return -1;
+	return (int) compression;
+}
+
+/**
+ * Create the header of an EXR file (or part) storing the given channels
+ * of a bitmap, and a frame buffer that refers to the bitmap's pixels
+ */
+static Imf::Header createHeader(Bitmap &bitmap, const QStringList &channelNames,
+		const BitmapSaveOptions &options, Imf::FrameBuffer &frameBuffer) {
+	Imf::Compression compression;
+	if (!lookupCompression(options.compression, compression))
+		throw NoriException(QString("Unsupported EXR compression method \"%1\"!")
+			.arg(options.compression));
+	if (channelNames.size() < 1 || channelNames.size() > 3)
+		throw NoriException("An EXR layer must have between one and three channels!");
+
+	Imf::Header header((int) bitmap.cols(), (int) bitmap.rows());
+	header.insert("comments", Imf::StringAttribute("Generated by Nori"));
+	header.compression() = compression;
+	if (options.tileSize > 0)
+		header.setTileDescription(Imf::TileDescription(
+			options.tileSize, options.tileSize, Imf::ONE_LEVEL));
+
+	/* OpenEXR converts the float frame buffer to half channels on the fly */
+	Imf::PixelType pixelType = options.half ? Imf::HALF : Imf::FLOAT;
 	size_t compStride = sizeof(float),
 	       pixelStride = 3 * compStride,
-	       rowStride = pixelStride * cols();
+	       rowStride = pixelStride * bitmap.cols();
 
-	char *ptr = reinterpret_cast<char *>(data());
-	frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-	frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-	frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); 
+	char *ptr = reinterpret_cast<char *>(bitmap.data());
+	for (int i=0; i<channelNames.size(); ++i) {
+		QByteArray name = channelNames[i].toUtf8();
+		header.channels().insert(name.data(), Imf::Channel(pixelType));
+		frameBuffer.insert(name.data(), Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+		ptr += compStride;
+	}
+	return header;
+}
+
+void Bitmap::save(const QString &filename, const BitmapSaveOptions &options) {
+	ProfileScope scope("Write EXR", "output");
+	scope.setDetail(filename);
+	initThreadPool();
+	cout << "Writing a " << cols() << "x" << rows() 
+		 << " OpenEXR file to \"" << qPrintable(filename) << "\"" << endl;
+
+	Imf::FrameBuffer frameBuffer;
+	Imf::Header header = createHeader(*this, 
+		QStringList() << "R" << "G" << "B", options, frameBuffer);
 
 	QByteArray filenameUtf8 = filename.toUtf8();
-	Imf::OutputFile file(filenameUtf8.data(), header);
-	file.setFrameBuffer(frameBuffer);
-	file.writePixels(rows());
+	if (options.tileSize > 0) {
+		Imf::TiledOutputFile file(filenameUtf8.data(), header);
+		file.setFrameBuffer(frameBuffer);
+		file.writeTiles(0, file.numXTiles() - 1, 0, file.numYTiles() - 1);
+	} else {
+		Imf::OutputFile file(filenameUtf8.data(), header);
+		file.setFrameBuffer(frameBuffer);
+		file.writePixels(rows());
+	}
+}
+
+void Bitmap::saveLayers(const QString &filename, const std::vector<BitmapLayer> &layers,
+		const BitmapSaveOptions &options) {
+	ProfileScope scope("Write EXR", "output");
+	scope.setDetail(filename);
+	initThreadPool();
+	if (layers.empty())
+		throw NoriException("Bitmap::saveLayers(): no layers were specified!");
+
+	cout << "Writing a " << layers[0].bitmap->cols() << "x" << layers[0].bitmap->rows() 
+		 << " OpenEXR file with " << layers.size() << " parts to \"" 
+		 << qPrintable(filename) << "\"" << endl;
+
+	std::vector<Imf::Header> headers;
+	std::vector<Imf::FrameBuffer> frameBuffers(layers.size());
+	for (size_t i=0; i<layers.size(); ++i) {
+		const BitmapLayer &layer = layers[i];
+		if (layer.bitmap->rows() != layers[0].bitmap->rows() || 
+			layer.bitmap->cols() != layers[0].bitmap->cols())
+			throw NoriException("Bitmap::saveLayers(): the layers differ in size!");
+		Imf::Header header = createHeader(*layer.bitmap, layer.channels,
+			options, frameBuffers[i]);
+		header.setName(layer.name.toStdString());
+		header.setType(options.tileSize > 0 ? Imf::TILEDIMAGE : Imf::SCANLINEIMAGE);
+		headers.push_back(header);
+	}
+
+	QByteArray filenameUtf8 = filename.toUtf8();
+	Imf::MultiPartOutputFile file(filenameUtf8.data(), &headers[0], (int) headers.size());
+	for (size_t i=0; i<layers.size(); ++i) {
+		if (options.tileSize > 0) {
+			Imf::TiledOutputPart part(file, (int) i);
+			part.setFrameBuffer(frameBuffers[i]);
+			part.writeTiles(0, part.numXTiles() - 1, 0, part.numYTiles() - 1);
+		} else {
+			Imf::OutputPart part(file, (int) i);
+			part.setFrameBuffer(frameBuffers[i]);
+			part.writePixels((int) layers[i].bitmap->rows());
+		}
+	}
+}
+
+void Bitmap::toHeatMap(float maxValue) {
+	if (maxValue <= 0) {
+		std::vector<float> values;
+		for (int y=0; y<rows(); ++y)
+			for (int x=0; x<cols(); ++x)
+				if (coeff(y, x).r() > 0)
+					values.push_back(coeff(y, x).r());
+		if (values.empty()) {
+			setConstant(Color3f(0.0f));
+			return;
+		}
+		std::vector<float>::iterator it = values.begin() + (values.size() - 1) * 99 / 100;
+		std::nth_element(values.begin(), it, values.end());
+		maxValue = *it;
+	}
+
+	/* Blue, cyan, green, yellow, red */
+	const Color3f ramp[5] = {
+		Color3f(0.0f, 0.0f, 1.0f), Color3f(0.0f, 1.0f, 1.0f), Color3f(0.0f, 1.0f, 0.0f),
+		Color3f(1.0f, 1.0f, 0.0f), Color3f(1.0f, 0.0f, 0.0f)
+	};
+
+	for (int y=0; y<rows(); ++y) {
+		for (int x=0; x<cols(); ++x) {
+			Color3f &pixel = coeffRef(y, x);
+			if (!(pixel.r() > 0)) {
+				pixel = Color3f(0.0f);
+				continue;
+			}
+			float pos = std::min(pixel.r() / maxValue, 1.0f) * 4;
+			int i = std::min((int) pos, 3);
+			float t = pos - i;
+			pixel = ramp[i] * (1 - t) + ramp[i+1] * t;
+		}
+	}
+}
+
+/**
+ * \brief 8-bit sRGB values of linear values in [0, 1] at equal spacing
+ *
+ * The steepest part of the curve (the linear segment near zero) rises by
+ * less than half an 8-bit step from one entry to the next.
+ */
+struct SRGBTable {
+	uint8_t values[NORI_SRGB_TABLE_SIZE];
+
+	SRGBTable() {
+		for (int i=0; i<NORI_SRGB_TABLE_SIZE; ++i) {
+			float value = Color3f(i / (float) (NORI_SRGB_TABLE_SIZE - 1)).toSRGB().r();
+			values[i] = (uint8_t) clamp((int) (value * 255.0f + 0.5f), 0, 255);
+		}
+	}
+};
+
+static SRGBTable srgbTable;
+
+void Bitmap::toSRGB8(const Color3f *source, uint8_t *target, size_t count, float scale) {
+	/* Colors are tightly packed, so the channels can be processed as one array */
+	const float *values = source->data();
+	size_t i = 0, size = 3 * count;
+	scale *= NORI_SRGB_TABLE_SIZE - 1;
+#if defined(NORI_SSE)
+	const __m128 scale4 = _mm_set1_ps(scale), half = _mm_set1_ps(0.5f),
+		zero = _mm_setzero_ps(), max = _mm_set1_ps(NORI_SRGB_TABLE_SIZE - 1);
+	for (; i+4<=size; i+=4) {
+		/* _mm_max_ps() returns its second argument for NaNs, which turn black */
+		__m128 value = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values + i), scale4), half);
+		value = _mm_min_ps(_mm_max_ps(value, zero), max);
+		int32_t index[4];
+		_mm_storeu_si128((__m128i *) index, _mm_cvttps_epi32(value));
+		target[i]   = srgbTable.values[index[0]];
+		target[i+1] = srgbTable.values[index[1]];
+		target[i+2] = srgbTable.values[index[2]];
+		target[i+3] = srgbTable.values[index[3]];
+	}
+#endif
+	for (; i<size; ++i) {
+		float value = values[i] * scale + 0.5f;
+		target[i] = value > 0 ? srgbTable.values[
+			(int) std::min(value, (float) (NORI_SRGB_TABLE_SIZE - 1))] : 0;
+	}
+}
+
+void Bitmap::savePreview(const QString &filename, float exposure) const {
+	ProfileScope scope("Write preview", "output");
+	scope.setDetail(filename);
+	float scale = std::pow(2.0f, exposure);
+	QImage image((int) cols(), (int) rows(), QImage::Format_RGB888);
+	for (int y=0; y<rows(); ++y)
+		toSRGB8(&coeff(y, 0), image.scanLine(y), (size_t) cols(), scale);
+	if (!image.save(filename, NULL, 90))
+		throw NoriException(QString("Could not write the preview image \"%1\"").arg(filename));
+}
+
+void BitmapWriter::run() {
+	Profiler::getInstance()->setThreadName("image writer");
+	try {
+		/* The preview is quick to write, so it goes first */
+		if (!m_options.preview.isEmpty()) {
+			QString name = m_filename;
+			if (name.endsWith(".exr"))
+				name.chop(4);
+			m_layers[0].bitmap->savePreview(name + "." + m_options.preview,
+				m_options.previewExposure);
+		}
+		if (m_layers.size() == 1)
+			m_layers[0].bitmap->save(m_filename, m_options);
+		else
+			Bitmap::saveLayers(m_filename, m_layers, m_options);
+	} catch (const NoriException &ex) {
+		m_error = ex.getReason();
+	} catch (const std::exception &ex) {
+		/* OpenEXR reports I/O errors using Iex exceptions */
+		m_error = ex.what();
+	}
 }
 
 NORI_NAMESPACE_END
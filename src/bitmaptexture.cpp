@@ -0,0 +1,140 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/texture.h>
+#include <nori/texcache.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Texture that is read from an OpenEXR file
+ *
+ * Uses bilinear interpolation within the level of the mip map that
+ * matches the footprint of a query, and linear interpolation between
+ * two levels. Tiled files are paged in on demand through the shared
+ * \ref TextureCache (see \ref TiledImage), so that many large textures
+ * can be rendered with a fixed memory budget.
+ */
+class BitmapTexture : public Texture {
+public:
+	BitmapTexture(const PropertyList &propList) {
+		/* OpenEXR file containing the texture */
+		m_filename = propList.getString("filename");
+
+		/* Factor applied to all values */
+		m_scale = propList.getColor("scale", Color3f(1.0f));
+
+		/* Behavior outside of [0, 1]^2: 'repeat' or 'clamp' */
+		QString wrap = propList.getString("wrap", "repeat");
+		if (wrap == "repeat")
+			m_repeat = true;
+		else if (wrap == "clamp")
+			m_repeat = false;
+		else
+			throw NoriException(QString("BitmapTexture: unknown wrap mode \"%1\" (must be "
+				"\"repeat\" or \"clamp\")").arg(wrap));
+
+		m_image = new TiledImage(m_filename);
+
+		/* The coarsest level contains the average */
+		int last = m_image->getLevelCount() - 1;
+		const Vector2i &size = m_image->getSize(last);
+		m_average = Color3f(0.0f);
+		for (int y=0; y<size.y(); ++y)
+			for (int x=0; x<size.x(); ++x)
+				m_average += m_image->getPixel(last, x, y);
+		m_average = m_average * m_scale / (float) (size.x() * size.y());
+	}
+
+	virtual ~BitmapTexture() {
+		delete m_image;
+	}
+
+	Color3f eval(const Point2f &uv, float width) const {
+		/* Choose the level whose pixels are about as large as the footprint */
+		int levelCount = m_image->getLevelCount();
+		float level = 0.0f;
+		if (width > 0)
+			level = clamp(std::log(width * m_image->getSize(0).maxCoeff()) / std::log(2.0f),
+				0.0f, (float) (levelCount - 1));
+
+		int fine = std::min((int) level, levelCount - 1);
+		float t = level - fine;
+		Color3f result = bilinear(fine, uv);
+		if (t > 0 && fine + 1 < levelCount)
+			result = result * (1 - t) + bilinear(fine + 1, uv) * t;
+		return result * m_scale;
+	}
+
+	Color3f getAverage() const {
+		return m_average;
+	}
+
+	QString toString() const {
+		return QString(
+			"BitmapTexture[\n"
+			"  filename = \"%1\",\n"
+			"  size = %2x%3,\n"
+			"  levels = %4,\n"
+			"  paged = %5,\n"
+			"  wrap = %6,\n"
+			"  scale = %7\n"
+			"]")
+		.arg(m_filename)
+		.arg(m_image->getSize(0).x())
+		.arg(m_image->getSize(0).y())
+		.arg(m_image->getLevelCount())
+		.arg(m_image->isPaged())
+		.arg(m_repeat ? "repeat" : "clamp")
+		.arg(m_scale.toString());
+	}
+private:
+	/// Map a pixel coordinate into the image
+	inline int wrap(int x, int size) const {
+		if (m_repeat) {
+			x %= size;
+			return x < 0 ? x + size : x;
+		}
+		return std::min(std::max(x, 0), size - 1);
+	}
+
+	/// Bilinearly interpolate a level (v points up, as in the OBJ convention)
+	inline Color3f bilinear(int level, const Point2f &uv) const {
+		const Vector2i &size = m_image->getSize(level);
+		float x = uv.x() * size.x() - 0.5f,
+		      y = (1 - uv.y()) * size.y() - 0.5f;
+		float fx = std::floor(x), fy = std::floor(y);
+		float tx = x - fx, ty = y - fy;
+		int x0 = wrap((int) fx, size.x()), x1 = wrap((int) fx + 1, size.x()),
+		    y0 = wrap((int) fy, size.y()), y1 = wrap((int) fy + 1, size.y());
+
+		return (m_image->getPixel(level, x0, y0) * (1 - tx)
+			  + m_image->getPixel(level, x1, y0) * tx) * (1 - ty)
+			 + (m_image->getPixel(level, x0, y1) * (1 - tx)
+			  + m_image->getPixel(level, x1, y1) * tx) * ty;
+	}
+
+	QString m_filename;
+	TiledImage *m_image;
+	Color3f m_scale;
+	Color3f m_average;
+	bool m_repeat;
+};
+
+NORI_REGISTER_CLASS(BitmapTexture, "bitmap");
+NORI_NAMESPACE_END
@@ -23,44 +23,665 @@
 #include <nori/camera.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
-#include <nori/bbox.h>
+#include <nori/profiler.h>
+#include <nori/rendercache.h>
+#include <boost/static_assert.hpp>
+#include <Eigen/LU>
+#include <QFile>
+#include <QThread>
+#include <half.h>
 
 NORI_NAMESPACE_BEGIN
 
+/// Version of the partial image file format (increase when changing the layout)
+#define NORI_PARTIAL_IMAGE_VERSION 1
+
+/**
+ * \brief Header of a file written by \ref ImageBlock::save()
+ *
+ * It is followed by the <tt>(size+2*borderSize)</tt> pixels of the 
+ * block (in row-major order, 4 floats each)
+ */
+struct PartialImageHeader {
+	char magic[3];
+	uint8_t version;
+	int32_t imageSize[2];
+	int32_t offset[2];
+	int32_t size[2];
+	int32_t borderSize;
+	uint8_t reserved[32];
+};
+
+BOOST_STATIC_ASSERT(sizeof(PartialImageHeader) == 64);
+
+/// Version of the serialized image block format (increase when changing the layout)
+#define NORI_SERIALIZED_BLOCK_VERSION 2
+
+/**
+ * \brief Header of a block written by \ref ImageBlock::serialize()
+ *
+ * It is followed by the pixels (including the border, 4 values each),
+ * and optionally the AOV sums and the subpixel moments. With 
+ * \ref ImageBlock::ESerializeHalf, the pixels and moments are stored
+ * as half floats, multiplied by \c scale. With 
+ * \ref ImageBlock::ESerializeCompressed, each of the three sections is
+ * split into byte planes, and the whole payload is compressed using
+ * \c qCompress().
+ */
+struct SerializedBlockHeader {
+	char magic[3];
+	uint8_t version;
+	int32_t offset[2];
+	int32_t size[2];
+	int32_t rows, cols;
+	int32_t borderSize;
+	uint32_t aovCount;
+	uint32_t subpixelCount;
+	uint32_t flags;
+	float scale;
+};
+
+BOOST_STATIC_ASSERT(sizeof(SerializedBlockHeader) == 48);
+
+/// Version of the checkpoint file format (increase when changing the layout)
+#define NORI_CHECKPOINT_VERSION 1
+
+/**
+ * \brief Header of a file written by \ref BlockGenerator::saveCheckpoint()
+ *
+ * It is followed by the pixels of the output (including its border, 4
+ * floats each), and optionally the per-pixel moments (3 floats each),
+ * convergence flags (1 byte each) and subpixel moments of a deferred
+ * filter (see \ref ImageBlock::getSubpixelMoments())
+ */
+struct CheckpointHeader {
+	char magic[3];
+	uint8_t version;
+	int32_t offset[2];
+	int32_t size[2];
+	int32_t borderSize;
+	uint32_t sampleCount;
+	uint32_t samplesPerPass;
+	int32_t pass;
+	uint32_t flags;
+	uint64_t key;
+	uint8_t reserved[16];
+};
+
+BOOST_STATIC_ASSERT(sizeof(CheckpointHeader) == 64);
+
+/* Optional sections of a checkpoint */
+#define NORI_CHECKPOINT_MOMENTS   1
+#define NORI_CHECKPOINT_CONVERGED 2
+#define NORI_CHECKPOINT_SUBPIXEL  4
+
+/**
+ * Exponents (i, j) of the subpixel moments that are recorded per pixel
+ * with a deferred filter. The first one is the plain sum of the samples
+ */
+static const int subpixelExponents[NORI_SUBPIXEL_MOMENTS][2] = {
+	{ 0, 0 }, { 1, 0 }, { 0, 1 }, { 2, 0 }, { 1, 1 }, { 0, 2 }, { 2, 1 }, { 1, 2 }, { 2, 2 }
+};
+
 ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter) 
-		: m_offset(0), m_size(size) {
-	/* Tabulate the image reconstruction filter for performance reasons */
+		: m_offset(0), m_size(size), m_weights(NULL), m_allDirty(true) {
 	m_filterRadius = filter->getRadius();
-	m_borderSize = (int) std::ceil(m_filterRadius - 0.5f);
-	m_filter = new float[NORI_FILTER_RESOLUTION + 1];
-	for (int i=0; i<NORI_FILTER_RESOLUTION; ++i) {
-		float pos = (m_filterRadius * i) / NORI_FILTER_RESOLUTION;
-		m_filter[i] = filter->eval(pos);
+	m_filterExtent = (int) std::ceil(m_filterRadius);
+	int footprint = 2*m_filterExtent + 1;
+	m_singlePixel = m_filterRadius <= 0.5f;
+	m_pixelWeight = filter->eval(0.0f) * filter->eval(0.0f);
+	m_deferred = filter->isDeferred() && !m_singlePixel;
+
+	/* An importance sampled filter is accounted for by the positions of
+	   the samples, which are recorded at the centers of their pixels */
+	if (filter->isSampled()) {
+		m_singlePixel = true;
+		m_pixelWeight = 1.0f;
+		m_filterRadius = 0.5f;
+		m_filterExtent = 0;
+		footprint = 1;
+	}
+
+	if (m_deferred) {
+		/* Fit the weights that a sample at the subpixel offset f (in 
+		   [-1/2, 1/2)) gives a pixel at the offset d from its own pixel,
+		   i.e. filter(d - f), by a quadratic polynomial in f (least 
+		   squares, using the same number of points as the tabulation) */
+		m_borderSize = 0;
+		m_filterFit.resize(3 * footprint);
+		for (int k=0; k<footprint; ++k) {
+			Eigen::Matrix3d A = Eigen::Matrix3d::Zero();
+			Eigen::Vector3d b = Eigen::Vector3d::Zero();
+			for (int i=0; i<NORI_FILTER_RESOLUTION; ++i) {
+				double f = (i + 0.5) / NORI_FILTER_RESOLUTION - 0.5;
+				float dist = std::abs(k - m_filterExtent - (float) f);
+				double weight = dist <= m_filterRadius ? filter->eval(dist) : 0.0;
+				Eigen::Vector3d basis(1.0, f, f*f);
+				A += basis * basis.transpose();
+				b += basis * weight;
+			}
+			Eigen::Vector3d coeffs = A.inverse() * b;
+			for (int i=0; i<3; ++i)
+				m_filterFit[3*k + i] = (float) coeffs[i];
+		}
+	} else {
+		/* Tabulate the weights of the image reconstruction filter for each 
+		   quantized subpixel position. A sample at pixel position i+f (where
+		   f is in [0, 1)) affects the pixels i-extent .. i+extent */
+		m_borderSize = (int) std::ceil(m_filterRadius - 0.5f);
+		m_weights = new float[NORI_FILTER_RESOLUTION * footprint];
+		for (int i=0; i<NORI_FILTER_RESOLUTION; ++i) {
+			float f = (i + 0.5f) / NORI_FILTER_RESOLUTION;
+			for (int k=0; k<footprint; ++k) {
+				float dist = std::abs(k - m_filterExtent - f);
+				m_weights[i*footprint + k] = dist <= m_filterRadius ? filter->eval(dist) : 0.0f;
+			}
+		}
 	}
-	m_filter[NORI_FILTER_RESOLUTION] = 0.0f;
-	m_lookupFactor = NORI_FILTER_RESOLUTION / m_filterRadius;
-	m_weightsX = new float[(int) std::ceil(2*m_filterRadius) + 1];
-	m_weightsY = new float[(int) std::ceil(2*m_filterRadius) + 1];
 
 	/* Allocate space for pixels and border regions */
 	resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+	if (m_deferred)
+		m_subpixel.assign(rows() * cols() * 4 * (NORI_SUBPIXEL_MOMENTS - 1), 0.0f);
+	m_rowLocks = new QMutex[rows()];
 }
 
 ImageBlock::~ImageBlock() {
-	delete[] m_filter;
-	delete[] m_weightsX;
-	delete[] m_weightsY;
+	delete[] m_weights;
+	delete[] m_rowLocks;
+}
+
+size_t ImageBlock::estimateMemoryUsage(const Vector2i &size,
+		const ReconstructionFilter *filter, bool aovs) {
+	/* Same border and buffers as the constructor and setAOVs() */
+	float radius = filter->getRadius();
+	bool deferred = filter->isDeferred() && radius > 0.5f;
+	int border = (deferred || filter->isSampled()) ? 0 : (int) std::ceil(radius - 0.5f);
+	size_t rows = size.y() + 2*border, cols = size.x() + 2*border;
+	size_t perPixel = sizeof(Color4f);
+	if (deferred)
+		perPixel += 4 * (NORI_SUBPIXEL_MOMENTS - 1) * sizeof(float);
+	if (aovs)
+		perPixel += NORI_AOV_CHANNELS * sizeof(float);
+	return rows * cols * perPixel + rows * sizeof(QMutex);
+}
+
+void ImageBlock::setAOVs(bool enabled) {
+	if (enabled)
+		m_aovs.assign(rows() * cols() * NORI_AOV_CHANNELS, 0.0f);
+	else
+		std::vector<float>().swap(m_aovs);
+}
+
+/// Work that \ref forEachRow() does for every row of an image
+struct RowTask {
+	virtual ~RowTask() { }
+
+	/// Process row \c y
+	virtual void processRow(int y) const = 0;
+};
+
+/// Helper thread of \ref forEachRow(), which processes every \c step-th row starting at \c start
+class RowThread : public QThread {
+public:
+	RowThread(const RowTask &task, int height, int start, int step)
+		: m_task(task), m_height(height), m_start(start), m_step(step) { }
+
+	void run() {
+		for (int y=m_start; y<m_height; y+=m_step)
+			m_task.processRow(y);
+	}
+private:
+	const RowTask &m_task;
+	int m_height, m_start, m_step;
+};
+
+/**
+ * \brief Process all rows of an image using all cores
+ *
+ * The rows are interleaved between the threads, so that expensive
+ * parts of the image are shared evenly. Small images (where starting
+ * the threads would take longer than the work) use fewer threads.
+ */
+static void forEachRow(const RowTask &task, int height) {
+	int threadCount = std::max(1, std::min(getCoreCount(), height / 32));
+	std::vector<RowThread *> threads;
+	for (int i=1; i<threadCount; ++i) {
+		threads.push_back(new RowThread(task, height, i, threadCount));
+		threads.back()->start();
+	}
+	RowThread(task, height, 0, threadCount).run();
+	for (size_t i=0; i<threads.size(); ++i) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+/// Divides the pixels of a block (or of its filtered snapshot) by their weights
+struct NormalizeTask : public RowTask {
+	const ImageBlock::Snapshot &source;
+	int offset;
+	Bitmap &target;
+
+	NormalizeTask(const ImageBlock::Snapshot &source, int offset, Bitmap &target)
+		: source(source), offset(offset), target(target) { }
+
+	void processRow(int y) const {
+		const Color4f *row = &source.coeff(y + offset, offset);
+		Color3f *result = &target.coeffRef(y, 0);
+		for (int x=0; x<target.cols(); ++x)
+			result[x] = row[x].normalized();
+	}
+};
+
+/// Turns the accumulated AOV channels of a block into the pixels of an AOV bitmap
+struct AOVTask : public RowTask {
+	const float *aovs;
+	int stride, offset;
+	EAOV aov;
+	Bitmap &target;
+
+	AOVTask(const float *aovs, int stride, int offset, EAOV aov, Bitmap &target)
+		: aovs(aovs), stride(stride), offset(offset), aov(aov), target(target) { }
+
+	void processRow(int y) const {
+		for (int x=0; x<target.cols(); ++x) {
+			const float *values = aovs + ((y + offset) * stride 
+				+ x + offset) * NORI_AOV_CHANNELS;
+			float count = values[0], invCount = count > 0 ? 1.0f / count : 0.0f;
+			Color3f &pixel = target.coeffRef(y, x);
+			switch (aov) {
+				case EAOVDepth:
+					pixel = Color3f(values[1] * invCount);
+					break;
+				case EAOVNormal: {
+						Vector3f n(values[2], values[3], values[4]);
+						if (n.squaredNorm() > 0)
+							n.normalize();
+						pixel = Color3f(n.x(), n.y(), n.z());
+					}
+					break;
+				case EAOVAlbedo:
+					pixel = Color3f(values[5], values[6], values[7]) * invCount;
+					break;
+				case EAOVMeshID:
+					pixel = Color3f(values[NORI_AOV_CHANNELS - 1] - 1);
+					break;
+				case EAOVSampleCount:
+					pixel = Color3f(count);
+					break;
+				case EAOVVariance: {
+						float variance = 0.0f;
+						if (count > 1) {
+							float mean = values[8] * invCount;
+							variance = std::max(0.0f, (values[9] - count*mean*mean) 
+								/ (count * (count - 1)));
+						}
+						pixel = Color3f(variance);
+					}
+					break;
+				case EAOVCost:
+					pixel = Color3f(values[10] * invCount);
+					break;
+				default: /* EAOVRenderTime (checked by the caller) */
+					pixel = Color3f(values[11], values[11] * invCount,
+						values[12] * invCount) * 1e-3f;
+					break;
+			}
+		}
+	}
+};
+
+Bitmap *ImageBlock::toAOVBitmap(EAOV aov) const {
+	if (m_aovs.empty())
+		throw NoriException("ImageBlock::toAOVBitmap(): AOVs are disabled!");
+	if (aov < EAOVDepth || aov > EAOVRenderTime || (aov & (aov - 1)) != 0)
+		throw NoriException("ImageBlock::toAOVBitmap(): unknown AOV!");
+
+	Bitmap *result = new Bitmap(m_size);
+	forEachRow(AOVTask(&m_aovs[0], (int) cols(), m_borderSize, aov, *result), m_size.y());
+	if (aov == EAOVCost)
+		result->toHeatMap();
+	return result;
 }
 
 Bitmap *ImageBlock::toBitmap() const {
 	Bitmap *result = new Bitmap(m_size);
-	for (int y=0; y<m_size.y(); ++y)
-		for (int x=0; x<m_size.x(); ++x)
-			result->coeffRef(y, x) = coeff(y + m_borderSize, x + m_borderSize).normalized();
+	if (m_deferred) {
+		Snapshot filtered;
+		resolve(filtered);
+		forEachRow(NormalizeTask(filtered, 0, *result), m_size.y());
+	} else {
+		forEachRow(NormalizeTask(*this, m_borderSize, *result), m_size.y());
+	}
+	return result;
+}
+
+void ImageBlock::resolve(Snapshot &target) const {
+	int width = m_size.x(), height = m_size.y(), extent = m_filterExtent;
+	const int stride = 4 * (NORI_SUBPIXEL_MOMENTS - 1);
+	Snapshot temp(height, width);
+	target.resize(height, width);
+	target.setConstant(Color4f());
+
+	/* The filtered image is the sum over the moments (i, j) of the moment
+	   image, convolved with the coefficients of f^i along x and those of
+	   f^j along y. Convolve all moments with the same j along x first, 
+	   and then their sum along y */
+	for (int j=0; j<3; ++j) {
+		temp.setConstant(Color4f());
+		for (int m=0; m<NORI_SUBPIXEL_MOMENTS; ++m) {
+			if (subpixelExponents[m][1] != j)
+				continue;
+			int i = subpixelExponents[m][0];
+			for (int y=0; y<height; ++y) {
+				Color4f *row = &temp.coeffRef(y, 0);
+				for (int x=0; x<width; ++x) {
+					Color4f moment;
+					if (m == 0) {
+						moment = coeff(y, x);
+					} else {
+						const float *values = &m_subpixel[(y * cols() + x) * stride + 4 * (m - 1)];
+						moment = Color4f(values[0], values[1], values[2], values[3]);
+					}
+					if (moment.w() == 0 && moment.head<3>().isZero())
+						continue;
+					int dStart = std::max(-extent, -x), dEnd = std::min(extent, width - 1 - x);
+					for (int d=dStart; d<=dEnd; ++d)
+						row[x + d] += moment * m_filterFit[3*(d + extent) + i];
+				}
+			}
+		}
+
+		for (int y=0; y<height; ++y) {
+			int dStart = std::max(-extent, -y), dEnd = std::min(extent, height - 1 - y);
+			for (int d=dStart; d<=dEnd; ++d) {
+				float weight = m_filterFit[3*(d + extent) + j];
+				const Color4f *source = &temp.coeff(y, 0);
+				Color4f *row = &target.coeffRef(y + d, 0);
+				for (int x=0; x<width; ++x)
+					row[x] += source[x] * weight;
+			}
+		}
+	}
+}
+
+void ImageBlock::save(const QString &filename, const Vector2i &imageSize) const {
+	if (m_deferred)
+		throw NoriException("Partial images don't support deferred filtering!");
+
+	PartialImageHeader header;
+	memset(&header, 0, sizeof(PartialImageHeader));
+	memcpy(header.magic, "NIB", 3);
+	header.version = NORI_PARTIAL_IMAGE_VERSION;
+	for (int i=0; i<2; ++i) {
+		header.imageSize[i] = imageSize[i];
+		header.offset[i] = m_offset[i];
+		header.size[i] = m_size[i];
+	}
+	header.borderSize = m_borderSize;
+
+	QFile file(filename);
+	qint64 dataBytes = sizeof(Color4f) * rows() * cols();
+	bool success = file.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+		file.write((const char *) &header, sizeof(PartialImageHeader)) == sizeof(PartialImageHeader) &&
+		file.write((const char *) data(), dataBytes) == dataBytes;
+	file.close();
+
+	if (!success)
+		throw NoriException(QString("Unable to write the partial image \"%1\"!").arg(filename));
+}
+
+Bitmap *ImageBlock::merge(const QStringList &filenames) {
+	typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Storage;
+	Storage image, block;
+	Vector2i imageSize(0, 0);
+	int borderSize = 0;
+
+	for (int i=0; i<filenames.size(); ++i) {
+		QFile file(filenames[i]);
+		PartialImageHeader header;
+		if (!file.open(QIODevice::ReadOnly) ||
+			file.read((char *) &header, sizeof(PartialImageHeader)) != sizeof(PartialImageHeader) ||
+			memcmp(header.magic, "NIB", 3) != 0 || header.version != NORI_PARTIAL_IMAGE_VERSION)
+			throw NoriException(QString("\"%1\" is not a partial image!").arg(filenames[i]));
+
+		Vector2i size(header.size[0], header.size[1]);
+		Vector2i offset(header.offset[0], header.offset[1]);
+
+		if (i == 0) {
+			imageSize = Vector2i(header.imageSize[0], header.imageSize[1]);
+			borderSize = header.borderSize;
+			image.resize(imageSize.y() + 2*borderSize, imageSize.x() + 2*borderSize);
+			image.setConstant(Color4f());
+		} else if (imageSize != Vector2i(header.imageSize[0], header.imageSize[1]) 
+				|| borderSize != header.borderSize) {
+			throw NoriException(QString("\"%1\" does not match the image size and "
+				"reconstruction filter of \"%2\"!").arg(filenames[i]).arg(filenames[0]));
+		}
+
+		if ((offset.array() < 0).any() || ((offset + size).array() > imageSize.array()).any())
+			throw NoriException(QString("\"%1\": the block lies outside of the image!").arg(filenames[i]));
+
+		block.resize(size.y() + 2*borderSize, size.x() + 2*borderSize);
+		qint64 dataBytes = sizeof(Color4f) * block.rows() * block.cols();
+		if (file.read((char *) block.data(), dataBytes) != dataBytes)
+			throw NoriException(QString("\"%1\" is truncated!").arg(filenames[i]));
+
+		/* The border of the block lines up with the border of the image */
+		image.block(offset.y(), offset.x(), block.rows(), block.cols()) += block;
+	}
+
+	Bitmap *result = new Bitmap(imageSize);
+	for (int y=0; y<imageSize.y(); ++y)
+		for (int x=0; x<imageSize.x(); ++x)
+			result->coeffRef(y, x) = image(y + borderSize, x + borderSize).normalized();
+	return result;
+}
+
+/**
+ * \brief Split an array of \c count elements of \c elementSize bytes each
+ * into byte planes, storing the differences between successive bytes
+ *
+ * Neighboring floats of an image mostly agree in their sign, exponent
+ * and leading mantissa bits, which turns those planes into long runs 
+ * that compress well (like the ZIP compression of OpenEXR).
+ */
+static void shuffleBytes(const char *source, char *target, size_t count, int elementSize) {
+	uint8_t previous = 0;
+	for (int b=0; b<elementSize; ++b) {
+		for (size_t i=0; i<count; ++i) {
+			uint8_t value = (uint8_t) source[i * elementSize + b];
+			*target++ = (char) (uint8_t) (value - previous);
+			previous = value;
+		}
+	}
+}
+
+/// Undo \ref shuffleBytes()
+static void unshuffleBytes(const char *source, char *target, size_t count, int elementSize) {
+	uint8_t previous = 0;
+	for (int b=0; b<elementSize; ++b) {
+		for (size_t i=0; i<count; ++i) {
+			previous = (uint8_t) (previous + (uint8_t) *source++);
+			target[i * elementSize + b] = (char) previous;
+		}
+	}
+}
+
+/// Append floats to a serialized block in the format selected by \c flags (see \ref decodeFloats())
+static char *encodeFloats(char *target, const float *values, size_t count, bool halfPrecision,
+		float scale, bool shuffle) {
+	std::vector<half> halves;
+	const char *source = (const char *) values;
+	int elementSize = sizeof(float);
+	if (halfPrecision) {
+		halves.resize(count);
+		for (size_t i=0; i<count; ++i)
+			halves[i] = half(values[i] * scale);
+		source = (const char *) &halves[0];
+		elementSize = sizeof(half);
+	}
+	if (count == 0)
+		return target;
+	if (shuffle)
+		shuffleBytes(source, target, count, elementSize);
+	else
+		memcpy(target, source, count * elementSize);
+	return target + count * elementSize;
+}
+
+/// Read floats written by \ref encodeFloats()
+static const char *decodeFloats(const char *source, float *values, size_t count,
+		bool halfPrecision, float scale, bool shuffle) {
+	if (count == 0)
+		return source;
+	if (!halfPrecision) {
+		if (shuffle)
+			unshuffleBytes(source, (char *) values, count, sizeof(float));
+		else
+			memcpy(values, source, count * sizeof(float));
+		return source + count * sizeof(float);
+	}
+
+	std::vector<half> halves(count);
+	if (shuffle)
+		unshuffleBytes(source, (char *) &halves[0], count, sizeof(half));
+	else
+		memcpy(&halves[0], source, count * sizeof(half));
+	float invScale = 1.0f / scale;
+	for (size_t i=0; i<count; ++i)
+		values[i] = (float) halves[i] * invScale;
+	return source + count * sizeof(half);
+}
+
+QByteArray ImageBlock::serialize(int flags) const {
+	bool halfPrecision = (flags & ESerializeHalf) != 0,
+	     compressed = (flags & ESerializeCompressed) != 0;
+
+	SerializedBlockHeader header;
+	memset(&header, 0, sizeof(SerializedBlockHeader));
+	memcpy(header.magic, "NSB", 3);
+	header.version = NORI_SERIALIZED_BLOCK_VERSION;
+	for (int i=0; i<2; ++i) {
+		header.offset[i] = m_offset[i];
+		header.size[i] = m_size[i];
+	}
+	header.rows = (int32_t) rows();
+	header.cols = (int32_t) cols();
+	header.borderSize = m_borderSize;
+	header.aovCount = (uint32_t) m_aovs.size();
+	header.subpixelCount = (uint32_t) m_subpixel.size();
+	header.flags = (uint32_t) (flags & (ESerializeHalf | ESerializeCompressed));
+	header.scale = 1.0f;
+
+	size_t pixelCount = 4 * rows() * cols();
+	const float *pixels = (const float *) data();
+	if (halfPrecision) {
+		/* The pixels are unnormalized sums, which can exceed the range of
+		   half floats. Scale them by a power of two (which is exact), so 
+		   that the largest one is just below 2^15 */
+		float maxValue = 0.0f;
+		for (size_t i=0; i<pixelCount; ++i)
+			maxValue = std::max(maxValue, std::abs(pixels[i]));
+		for (size_t i=0; i<m_subpixel.size(); ++i)
+			maxValue = std::max(maxValue, std::abs(m_subpixel[i]));
+		if (maxValue > 0 && maxValue < std::numeric_limits<float>::infinity()) {
+			int exponent;
+			std::frexp(maxValue, &exponent);
+			header.scale = std::ldexp(1.0f, 15 - exponent);
+		}
+	}
+
+	/* The AOVs store integers (e.g. mesh IDs and sample counts) and
+	   are therefore always kept in single precision */
+	size_t valueSize = halfPrecision ? sizeof(half) : sizeof(float);
+	QByteArray payload;
+	payload.resize((int) (valueSize * (pixelCount + m_subpixel.size())
+		+ sizeof(float) * m_aovs.size()));
+	char *ptr = payload.data();
+	ptr = encodeFloats(ptr, pixels, pixelCount, halfPrecision, header.scale, compressed);
+	ptr = encodeFloats(ptr, m_aovs.empty() ? NULL : &m_aovs[0], m_aovs.size(),
+		false, 1.0f, compressed);
+	encodeFloats(ptr, m_subpixel.empty() ? NULL : &m_subpixel[0], m_subpixel.size(),
+		halfPrecision, header.scale, compressed);
+	if (compressed)
+		payload = qCompress(payload, 1);
+
+	QByteArray result((const char *) &header, sizeof(SerializedBlockHeader));
+	result.append(payload);
 	return result;
 }
 
-void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
+void ImageBlock::deserialize(const QByteArray &serialized) {
+	SerializedBlockHeader header;
+	if (serialized.size() < (int) sizeof(SerializedBlockHeader))
+		throw NoriException("ImageBlock::deserialize(): the data is truncated!");
+	memcpy(&header, serialized.constData(), sizeof(SerializedBlockHeader));
+	if (memcmp(header.magic, "NSB", 3) != 0 || header.version != NORI_SERIALIZED_BLOCK_VERSION)
+		throw NoriException("ImageBlock::deserialize(): not a serialized image block!");
+	if (header.rows != rows() || header.cols != cols() || header.borderSize != m_borderSize
+			|| header.aovCount != m_aovs.size() || header.subpixelCount != m_subpixel.size())
+		throw NoriException("ImageBlock::deserialize(): the block doesn't match the size, "
+			"reconstruction filter or AOVs of this one!");
+
+	Vector2i size(header.size[0], header.size[1]);
+	if ((size.array() < 0).any() || size.x() + 2*m_borderSize > cols()
+			|| size.y() + 2*m_borderSize > rows())
+		throw NoriException("ImageBlock::deserialize(): invalid block size!");
+
+	bool halfPrecision = (header.flags & ESerializeHalf) != 0,
+	     compressed = (header.flags & ESerializeCompressed) != 0;
+	size_t pixelCount = 4 * rows() * cols();
+	size_t valueSize = halfPrecision ? sizeof(half) : sizeof(float);
+	size_t payloadSize = valueSize * (pixelCount + m_subpixel.size())
+		+ sizeof(float) * m_aovs.size();
+
+	/* Uncompressed blocks are decoded right out of the received data */
+	QByteArray uncompressed;
+	const char *ptr = serialized.constData() + sizeof(SerializedBlockHeader);
+	size_t available = serialized.size() - sizeof(SerializedBlockHeader);
+	if (compressed) {
+		uncompressed = qUncompress(QByteArray::fromRawData(ptr, (int) available));
+		ptr = uncompressed.constData();
+		available = uncompressed.size();
+	}
+	if (available != payloadSize || (halfPrecision && !(header.scale > 0)))
+		throw NoriException("ImageBlock::deserialize(): the data is truncated or corrupted!");
+
+	ptr = decodeFloats(ptr, (float *) data(), pixelCount, halfPrecision, header.scale, compressed);
+	ptr = decodeFloats(ptr, m_aovs.empty() ? NULL : &m_aovs[0], m_aovs.size(),
+		false, 1.0f, compressed);
+	decodeFloats(ptr, m_subpixel.empty() ? NULL : &m_subpixel[0], m_subpixel.size(),
+		halfPrecision, header.scale, compressed);
+
+	m_offset = Point2i(header.offset[0], header.offset[1]);
+	m_size = size;
+	markDirty();
+}
+
+/// Add a weighted color to a pixel, optionally using atomic operations
+template <bool Atomic> static inline void addWeighted(Color4f &target, const Color4f &color, float weight) {
+	if (Atomic) {
+		for (int i=0; i<4; ++i)
+			atomicAdd(&target.coeffRef(i), color.coeff(i) * weight);
+	} else {
+		target += color * weight;
+	}
+}
+
+/// Add a weighted color to 4 floats (e.g. a subpixel moment), optionally using atomic operations
+template <bool Atomic> static inline void addWeighted(float *target, const Color4f &color, float weight) {
+	for (int i=0; i<4; ++i) {
+		if (Atomic)
+			atomicAdd(&target[i], color.coeff(i) * weight);
+		else
+			target[i] += color.coeff(i) * weight;
+	}
+}
+
+template <bool Atomic> void ImageBlock::splat(const Point2f &_pos, const Color3f &value, float alpha,
+		float weight) {
 	if (!value.isValid()) {
 		/* If this happens, go fix your code instead of removing this warning ;) */
 		cerr << "Integrator: computed an invalid radiance value: " 
@@ -74,29 +695,276 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
 		_pos.y() - 0.5f - (m_offset.y() - m_borderSize)
 	);
 
-	/* Compute the rectangle of pixels that will need to be updated */
-	BoundingBox2i bbox(
-		Point2i( std::ceil(pos.x() - m_filterRadius),  std::ceil(pos.y() - m_filterRadius)),
-		Point2i(std::floor(pos.x() + m_filterRadius), std::floor(pos.y() + m_filterRadius))
-	);
-	bbox.clip(BoundingBox2i(Point2i(0, 0), Point2i(cols() - 1, rows() - 1)));
+	/* Deferred filter: add the sample and its subpixel moments to the 
+	   nearest pixel (the sample lies within [-1/2, 1/2) of its center) */
+	if (m_deferred) {
+		int x = (int) std::floor(pos.x() + 0.5f), y = (int) std::floor(pos.y() + 0.5f);
+		if (x < 0 || y < 0 || x >= cols() || y >= rows())
+			return;
+		Color4f color = Color4f(value.r(), value.g(), value.b(), alpha) * weight;
+		addWeighted<Atomic>(coeffRef(y, x), color, 1.0f);
+
+		float fx = pos.x() - x, fy = pos.y() - y;
+		float powersX[3] = { 1.0f, fx, fx*fx }, powersY[3] = { 1.0f, fy, fy*fy };
+		float *moments = &m_subpixel[(y * cols() + x) * 4 * (NORI_SUBPIXEL_MOMENTS - 1)];
+		for (int m=1; m<NORI_SUBPIXEL_MOMENTS; ++m) {
+			float weight = powersX[subpixelExponents[m][0]] * powersY[subpixelExponents[m][1]];
+			addWeighted<Atomic>(moments + 4 * (m - 1), color, weight);
+		}
+		return;
+	}
+
+	/* Box filter: only the nearest pixel is affected */
+	if (m_singlePixel) {
+		int x = (int) std::floor(pos.x() + 0.5f), y = (int) std::floor(pos.y() + 0.5f);
+		if (x >= 0 && y >= 0 && x < cols() && y < rows())
+			addWeighted<Atomic>(coeffRef(y, x), Color4f(value.r(), value.g(), value.b(), alpha), m_pixelWeight * weight);
+		return;
+	}
+
+	/* Look up the weights for the sample's subpixel position */
+	int ix = (int) std::floor(pos.x()), iy = (int) std::floor(pos.y());
+	int footprint = 2*m_filterExtent + 1;
+	const float *weightsX = m_weights + footprint * std::min(
+		(int) ((pos.x() - ix) * NORI_FILTER_RESOLUTION), NORI_FILTER_RESOLUTION - 1);
+	const float *weightsY = m_weights + footprint * std::min(
+		(int) ((pos.y() - iy) * NORI_FILTER_RESOLUTION), NORI_FILTER_RESOLUTION - 1);
 
-	/* Lookup values from the pre-rasterized filter */
-	for (int x=bbox.min.x(), idx = 0; x<=bbox.max.x(); ++x)
-		m_weightsX[idx++] = m_filter[(int) (std::abs(x-pos.x()) * m_lookupFactor)];
-	for (int y=bbox.min.y(), idx = 0; y<=bbox.max.y(); ++y)
-		m_weightsY[idx++] = m_filter[(int) (std::abs(y-pos.y()) * m_lookupFactor)];
+	/* Rectangle of pixels that will need to be updated */
+	int x0 = ix - m_filterExtent, y0 = iy - m_filterExtent;
+	int xStart = std::max(x0, 0), xEnd = std::min(ix + m_filterExtent, (int) cols() - 1);
+	int yStart = std::max(y0, 0), yEnd = std::min(iy + m_filterExtent, (int) rows() - 1);
 
-	for (int y=bbox.min.y(), yr=0; y<=bbox.max.y(); ++y, ++yr) 
-		for (int x=bbox.min.x(), xr=0; x<=bbox.max.x(); ++x, ++xr) 
-			coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
+	Color4f color = Color4f(value.r(), value.g(), value.b(), alpha) * weight;
+	for (int y=yStart; y<=yEnd; ++y) {
+		Color4f rowColor = color * weightsY[y - y0];
+		Color4f *target = &coeffRef(y, 0);
+		for (int x=xStart; x<=xEnd; ++x)
+			addWeighted<Atomic>(target[x], rowColor, weightsX[x - x0]);
+	}
 }
 	
+void ImageBlock::put(const Point2f &pos, const Color3f &value, float weight) {
+	splat<false>(pos, value, 1.0f, weight);
+}
+
+void ImageBlock::putAtomic(const Point2f &pos, const Color3f &value) {
+	splat<true>(pos, value, 1.0f, 1.0f);
+}
+
+void ImageBlock::putSplat(const Point2f &pos, const Color3f &value) {
+	splat<true>(pos, value, 0.0f, 1.0f);
+}
+
+void ImageBlock::addSplats(const ImageBlock &b, float scale) {
+	if (b.rows() != rows() || b.cols() != cols())
+		throw NoriException("ImageBlock::addSplats(): the sizes of the blocks don't match!");
+	for (int y=0; y<rows(); ++y) {
+		for (int x=0; x<cols(); ++x) {
+			const Color4f &splat = b.coeff(y, x);
+			Color4f &target = coeffRef(y, x);
+			for (int i=0; i<3; ++i)
+				target.coeffRef(i) += splat.coeff(i) * scale;
+		}
+	}
+	if (!m_subpixel.empty() && !b.m_subpixel.empty()) {
+		for (size_t i=0; i<m_subpixel.size(); i += 4) {
+			for (int j=0; j<3; ++j)
+				m_subpixel[i + j] += b.m_subpixel[i + j] * scale;
+		}
+	}
+	markDirty();
+}
+
+void ImageBlock::putAOV(const Point2f &pos, const Color3f &value, const AOVRecord &aov) {
+	if (m_aovs.empty())
+		return;
+
+	/* AOVs are not filtered: find the pixel containing the sample */
+	int x = (int) std::floor(pos.x()) - m_offset.x() + m_borderSize,
+	    y = (int) std::floor(pos.y()) - m_offset.y() + m_borderSize;
+	if (x < 0 || y < 0 || x >= cols() || y >= rows())
+		return;
+
+	float *values = &m_aovs[(y * cols() + x) * NORI_AOV_CHANNELS];
+	values[0] += 1.0f;
+	values[1] += aov.depth;
+	values[2] += aov.normal.x();
+	values[3] += aov.normal.y();
+	values[4] += aov.normal.z();
+	values[5] += aov.albedo.r();
+	values[6] += aov.albedo.g();
+	values[7] += aov.albedo.b();
+	float lum = value.getLuminance();
+	values[8] += lum;
+	values[9] += lum * lum;
+	values[10] += aov.cost;
+	values[11] += aov.time;
+
+	/* IDs can't be averaged -- keep the first one (stored plus one, so
+	   that zero means "no surface seen yet") */
+	if (values[NORI_AOV_CHANNELS - 1] == 0 && aov.meshID >= 0)
+		values[NORI_AOV_CHANNELS - 1] = (float) (aov.meshID + 1);
+}
+
+void ImageBlock::putAOVBlockTime(float sampleTime) {
+	for (size_t i=0; i<m_aovs.size(); i += NORI_AOV_CHANNELS)
+		m_aovs[i + 12] += m_aovs[i] * sampleTime;
+}
+
+/// Add the AOVs of a pixel to another one
+static inline void addAOVs(float *target, const float *source) {
+	for (int i=0; i<NORI_AOV_CHANNELS - 1; ++i)
+		target[i] += source[i];
+	if (target[NORI_AOV_CHANNELS - 1] == 0)
+		target[NORI_AOV_CHANNELS - 1] = source[NORI_AOV_CHANNELS - 1];
+}
+
 void ImageBlock::put(ImageBlock &b) {
 	Vector2i offset = b.getOffset() - m_offset;
 	Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
-	block(offset.y(), offset.x(), size.y(), size.x()) 
-		+= b.topLeftCorner(size.y(), size.x());
+
+	/* The border of a neighboring block reaches up to 'border' pixels into 
+	   this one. Everything closer than twice that to the edge of 'b' can 
+	   also be written by other threads, while the remaining interior 
+	   pixels belong to 'b' alone */
+	int edge = 2*b.getBorderSize();
+	int interior = std::max(0, size.x() - 2*edge);
+
+	for (int y=0; y<size.y(); ++y) {
+		QMutex &lock = m_rowLocks[offset.y() + y];
+		if (y < edge || y >= size.y() - edge || interior == 0) {
+			profiledLock(lock, "Wait for image row");
+			row(offset.y() + y).segment(offset.x(), size.x()) 
+				+= b.row(y).head(size.x());
+			lock.unlock();
+		} else {
+			if (edge > 0) {
+				profiledLock(lock, "Wait for image row");
+				row(offset.y() + y).segment(offset.x(), edge) 
+					+= b.row(y).head(edge);
+				row(offset.y() + y).segment(offset.x() + size.x() - edge, edge) 
+					+= b.row(y).segment(size.x() - edge, edge);
+				lock.unlock();
+			}
+			row(offset.y() + y).segment(offset.x() + edge, interior) 
+				+= b.row(y).segment(edge, interior);
+		}
+	}
+
+	/* Record the modified pixels (including the border of 'b', but
+	   not that of this block) for incremental snapshots */
+	int x0 = std::max(offset.x(), m_borderSize),
+	    y0 = std::max(offset.y(), m_borderSize),
+	    x1 = std::min(offset.x() + size.x(), m_size.x() + m_borderSize),
+	    y1 = std::min(offset.y() + size.y(), m_size.y() + m_borderSize);
+	if (x0 < x1 && y0 < y1) {
+		QMutexLocker locker(&m_dirtyMutex);
+		if (m_dirtyRegions.size() >= NORI_MAX_DIRTY_REGIONS) {
+			m_allDirty = true;
+			m_dirtyRegions.clear();
+		}
+		if (!m_allDirty)
+			m_dirtyRegions.push_back(Region(Point2i(x0 - m_borderSize, y0 - m_borderSize),
+				Vector2i(x1 - x0, y1 - y0)));
+	}
+
+	/* Neither do the subpixel moments of a deferred filter (no border) */
+	if (!m_subpixel.empty() && !b.m_subpixel.empty()) {
+		const int stride = 4 * (NORI_SUBPIXEL_MOMENTS - 1);
+		for (int y=0; y<b.getSize().y(); ++y) {
+			float *target = &m_subpixel[((offset.y() + y) * cols() + offset.x()) * stride];
+			const float *source = &b.m_subpixel[y * b.cols() * stride];
+			for (int i=0; i<b.getSize().x() * stride; ++i)
+				target[i] += source[i];
+		}
+	}
+
+	/* The AOVs of different blocks never overlap, so no locks are needed */
+	if (!m_aovs.empty() && !b.m_aovs.empty()) {
+		int border = b.getBorderSize();
+		for (int y=0; y<b.getSize().y(); ++y) {
+			for (int x=0; x<b.getSize().x(); ++x) {
+				addAOVs(&m_aovs[((offset.y() + border + y) * cols() 
+					+ offset.x() + border + x) * NORI_AOV_CHANNELS],
+					&b.m_aovs[((border + y) * b.cols() + border + x) * NORI_AOV_CHANNELS]);
+			}
+		}
+	}
+}
+
+void ImageBlock::snapshot(Snapshot &target) const {
+	target = block(m_borderSize, m_borderSize, m_size.y(), m_size.x());
+}
+
+void ImageBlock::snapshot(Snapshot &target, std::vector<Region> &regions, int factor) const {
+	Vector2i targetSize = (m_size + Vector2i(factor - 1, factor - 1)) / factor;
+	bool all;
+	regions.clear();
+	{
+		QMutexLocker locker(&m_dirtyMutex);
+		all = m_allDirty || target.rows() != targetSize.y() || target.cols() != targetSize.x();
+		if (!all)
+			regions.swap(m_dirtyRegions);
+		m_dirtyRegions.clear();
+		m_allDirty = false;
+	}
+
+	if (all) {
+		if (factor == 1) {
+			snapshot(target);
+		} else {
+			target.resize(targetSize.y(), targetSize.x());
+			sumPixels(target, Point2i(0, 0), targetSize, Point2i(0, 0), m_size, factor);
+		}
+		regions.push_back(Region(Point2i(0, 0), targetSize));
+		return;
+	}
+
+	for (size_t i=0; i<regions.size(); ++i) {
+		const Point2i &offset = regions[i].first;
+		const Vector2i &size = regions[i].second;
+		if (factor == 1) {
+			target.block(offset.y(), offset.x(), size.y(), size.x()) = block(
+				offset.y() + m_borderSize, offset.x() + m_borderSize, size.y(), size.x());
+			continue;
+		}
+		Point2i start = offset / factor;
+		Point2i end = (offset + size + Vector2i(factor - 1, factor - 1)) / factor;
+		sumPixels(target, start, end - start, start * factor, m_size, factor);
+		regions[i] = Region(start, end - start);
+	}
+}
+
+void ImageBlock::snapshot(Snapshot &target, const Point2i &offset, const Vector2i &size,
+		int factor) const {
+	Vector2i targetSize = (size + Vector2i(factor - 1, factor - 1)) / factor;
+	target.resize(targetSize.y(), targetSize.x());
+	sumPixels(target, Point2i(0, 0), targetSize, offset, offset + size, factor);
+}
+
+void ImageBlock::sumPixels(Snapshot &target, const Point2i &targetOffset, const Vector2i &targetSize,
+		const Point2i &source, const Point2i &end, int factor) const {
+	for (int y=0; y<targetSize.y(); ++y) {
+		Color4f *row = &target.coeffRef(targetOffset.y() + y, targetOffset.x());
+		for (int x=0; x<targetSize.x(); ++x)
+			row[x] = Color4f();
+		int yStart = source.y() + y * factor, yEnd = std::min(yStart + factor, end.y());
+		for (int sy=yStart; sy<yEnd; ++sy) {
+			const Color4f *sourceRow = &coeff(sy + m_borderSize, m_borderSize);
+			for (int x=0; x<targetSize.x(); ++x) {
+				int xStart = source.x() + x * factor, xEnd = std::min(xStart + factor, end.x());
+				for (int sx=xStart; sx<xEnd; ++sx)
+					row[x] += sourceRow[sx];
+			}
+		}
+	}
+}
+
+void ImageBlock::markDirty() {
+	QMutexLocker locker(&m_dirtyMutex);
+	m_allDirty = true;
+	m_dirtyRegions.clear();
 }
 
 QString ImageBlock::toString() const {
@@ -105,115 +973,655 @@ QString ImageBlock::toString() const {
 		.arg(m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-		: m_size(size), m_blockSize(blockSize) {
-	m_numBlocks = Vector2i(
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, 
+		uint32_t sampleCount, const Point2i &offset, EBlockOrder order) 
+		: m_nextBlock(0), m_runLength(1), m_size(size), m_offset(offset), m_blockSize(blockSize),
+		m_sampleCount(sampleCount), m_samplesPerPass(sampleCount), m_passCount(1),
+		m_pass(0), m_stop(false), m_timeLimit(0), m_targetNoise(0), 
+		m_targetError(0), m_sampleBudget(0), m_timeBudget(0), m_passStart(0),
+		m_passPixels(0), m_checkpointOutput(NULL),
+		m_checkpointInterval(0), m_lastCheckpoint(0), m_checkpointKey(0), 
+		m_integrator(NULL), m_scene(NULL), m_activeBlocks(0), m_finishedBlocks(0), 
+		m_done(false), m_medianSampleTime(0) {
+	Vector2i numBlocks(
 		(int) std::ceil(size.x() / (float) blockSize),
 		(int) std::ceil(size.y() / (float) blockSize));
-	m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-	m_direction = ERight;
-	m_block = Point2i(m_numBlocks / 2);
-	m_stepsLeft = 1;
-	m_numSteps = 1;
+
+	std::vector<Point2i> positions;
+	positions.reserve(numBlocks.x() * numBlocks.y());
+	switch (order) {
+		case EScanline:
+			for (int y=0; y<numBlocks.y(); ++y)
+				for (int x=0; x<numBlocks.x(); ++x)
+					positions.push_back(Point2i(x, y));
+			break;
+		case EHilbert: hilbertOrder(numBlocks, positions); break;
+		case EMorton: mortonOrder(numBlocks, positions); break;
+		default: spiralOrder(numBlocks, positions); break;
+	}
+
+	m_blocks.reserve(positions.size());
+	for (size_t i=0; i<positions.size(); ++i) {
+		Point2i pos = positions[i] * blockSize;
+		m_blocks.push_back(std::make_pair(pos, 
+			Vector2i((size - pos).cwiseMin(Vector2i::Constant(blockSize)))));
+	}
+
+	/* When only a few blocks are left, threads that finish early would
+	   otherwise sit idle until the slowest one is done. Split the last
+	   blocks into quadrants (twice) to even out the tail */
+	int tailSize = 2 * getCoreCount();
+	for (int level=0; level<2; ++level)
+		subdivideTail(tailSize, blockSize >> (level+1));
+
 	m_timer.start();
 }
 
-bool BlockGenerator::next(ImageBlock &block) {
-	m_mutex.lock();
+BlockGenerator::EBlockOrder BlockGenerator::parseBlockOrder(const QString &name) {
+	if (name == "spiral")
+		return ESpiral;
+	else if (name == "scanline")
+		return EScanline;
+	else if (name == "hilbert")
+		return EHilbert;
+	else if (name == "morton")
+		return EMorton;
+	throw NoriException(QString("Unknown block order \"%1\" (must be \"spiral\", "
+		"\"scanline\", \"hilbert\" or \"morton\")").arg(name));
+}
 
-	if (m_blocksLeft == 0) {
-		m_mutex.unlock();
-		return false;
+void BlockGenerator::spiralOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions) {
+	/* Walk along a spiral that starts in the center of the image
+	   and record the blocks in that order */
+	int blocksLeft = numBlocks.x() * numBlocks.y();
+	Point2i block(numBlocks / 2);
+	int direction = ERight, numSteps = 1, stepsLeft = 1;
+
+	while (blocksLeft-- > 0) {
+		positions.push_back(block);
+		if (blocksLeft == 0)
+			break;
+
+		do {
+			switch (direction) {
+				case ERight: ++block.x(); break;
+				case EDown:  ++block.y(); break;
+				case ELeft:  --block.x(); break;
+				case EUp:    --block.y(); break;
+			}
+
+			if (--stepsLeft == 0) {
+				direction = (direction + 1) % 4;
+				if (direction == ELeft || direction == ERight) 
+					++numSteps;
+				stepsLeft = numSteps;
+			}
+		} while ((block.array() < 0).any() ||
+		         (block.array() >= numBlocks.array()).any());
+	}
+}
+
+void BlockGenerator::hilbertOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions) {
+	/* Walk along the curve over the enclosing power-of-two square and
+	   skip the positions outside of the image */
+	int n = 1;
+	while (n < numBlocks.maxCoeff())
+		n *= 2;
+	for (int64_t d=0; d<(int64_t) n*n; ++d) {
+		int64_t t = d;
+		int x = 0, y = 0;
+		for (int s=1; s<n; s *= 2) {
+			int rx = (int) (1 & (t / 2)), ry = (int) (1 & (t ^ rx));
+			if (ry == 0) {
+				if (rx == 1) {
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			t /= 4;
+		}
+		if (x < numBlocks.x() && y < numBlocks.y())
+			positions.push_back(Point2i(x, y));
 	}
+}
+
+void BlockGenerator::mortonOrder(const Vector2i &numBlocks, std::vector<Point2i> &positions) {
+	int n = 1;
+	while (n < numBlocks.maxCoeff())
+		n *= 2;
+	for (int64_t d=0; d<(int64_t) n*n; ++d) {
+		/* De-interleave the bits of the curve index */
+		int x = 0, y = 0;
+		for (int bit=0; (1 << bit) < n; ++bit) {
+			x |= (int) ((d >> (2*bit)) & 1) << bit;
+			y |= (int) ((d >> (2*bit + 1)) & 1) << bit;
+		}
+		if (x < numBlocks.x() && y < numBlocks.y())
+			positions.push_back(Point2i(x, y));
+	}
+}
 
-	Point2i pos = m_block * m_blockSize;
-	block.setOffset(pos);
-	block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+int BlockGenerator::autoBlockSize(const Vector2i &size, int coreCount, 
+		size_t sampleCount) {
+	/* Edge length that results in the desired number of blocks per core */
+	float target = std::sqrt(size.x() * (float) size.y()
+		/ (NORI_BLOCKS_PER_CORE * coreCount));
 
-	if (--m_blocksLeft == 0) {
-		cout << "Rendering finished (took " << m_timer.elapsed() << " ms)" << endl;
-		m_mutex.unlock();
-		return true;
+	/* .. but keep at least a few thousand samples per block, so that
+	   merging and scheduling are negligible compared to rendering */
+	target = std::max(target, std::sqrt(4096.0f / 
+		std::max(sampleCount, (size_t) 1)));
+
+	int blockSize = NORI_MIN_BLOCK_SIZE;
+	while (2*blockSize <= target && 2*blockSize <= NORI_MAX_BLOCK_SIZE)
+		blockSize *= 2;
+	return blockSize;
+}
+
+void BlockGenerator::subdivide(const Block &block, int blockSize, 
+		std::vector<Block> &target) {
+	const Point2i &offset = block.first;
+	const Vector2i &size = block.second;
+	for (int y=0; y<size.y(); y += blockSize) {
+		for (int x=0; x<size.x(); x += blockSize) {
+			Vector2i rel(x, y);
+			target.push_back(std::make_pair(Point2i(offset + rel),
+				Vector2i((size - rel).cwiseMin(Vector2i::Constant(blockSize)))));
+		}
 	}
+}
 
-	do {
-		switch (m_direction) {
-			case ERight: ++m_block.x(); break;
-			case EDown:  ++m_block.y(); break;
-			case ELeft:  --m_block.x(); break;
-			case EUp:    --m_block.y(); break;
+void BlockGenerator::subdivideTail(int count, int blockSize) {
+	if (blockSize < NORI_MIN_BLOCK_SIZE)
+		return;
+
+	size_t start = m_blocks.size() - std::min(m_blocks.size(), (size_t) count);
+	std::vector<Block> tail(m_blocks.begin() + start, m_blocks.end());
+	m_blocks.resize(start);
+
+	for (size_t i=0; i<tail.size(); ++i)
+		subdivide(tail[i], blockSize, m_blocks);
+}
+
+void BlockGenerator::selectTiles(int index, int count) {
+	if (count < 1 || index < 0 || index >= count)
+		throw NoriException(QString("Invalid tile range %1/%2").arg(index).arg(count));
+
+	std::vector<Block> blocks;
+	for (size_t i=index; i<m_blocks.size(); i += count)
+		blocks.push_back(m_blocks[i]);
+	m_blocks.swap(blocks);
+}
+
+void BlockGenerator::selectDirty(const RenderCache &cache) {
+	std::vector<Block> blocks;
+	for (size_t i=0; i<m_blocks.size(); ++i) {
+		if (cache.isDirty(Point2i(m_offset + m_blocks[i].first), m_blocks[i].second))
+			blocks.push_back(m_blocks[i]);
+	}
+	m_blocks.swap(blocks);
+}
+
+void BlockGenerator::setProgressive(uint32_t samplesPerPass, 
+		float timeLimit, float targetNoise) {
+	m_samplesPerPass = std::max(std::min(samplesPerPass, m_sampleCount), 1u);
+	m_passCount = (int) ((m_sampleCount + m_samplesPerPass - 1) / m_samplesPerPass);
+	m_timeLimit = timeLimit;
+	m_targetNoise = targetNoise;
+
+	/* Per-pixel luminance sum, sum of squares, and sample count */
+	if (targetNoise > 0)
+		m_moments.resize(m_size.x() * m_size.y(), Vector3f(0.0f));
+}
+
+void BlockGenerator::setAdaptive(float targetError, uint32_t maxSampleCount) {
+	/* The budget covers the selected blocks at the original sample count */
+	m_sampleBudget = 0;
+	for (size_t i=0; i<m_blocks.size(); ++i)
+		m_sampleBudget += (uint64_t) m_blocks[i].second.prod() * m_sampleCount;
+
+	m_targetError = targetError;
+	m_sampleCount = std::max(maxSampleCount, m_sampleCount);
+	m_passCount = (int) ((m_sampleCount + m_samplesPerPass - 1) / m_samplesPerPass);
+	m_moments.resize(m_size.x() * m_size.y(), Vector3f(0.0f));
+	m_converged.resize(m_size.x() * m_size.y(), 0);
+	m_blockConverged.resize(m_blocks.size(), 0);
+}
+
+void BlockGenerator::setTimeBudget(float seconds) {
+	if (seconds <= 0)
+		return;
+	m_timeBudget = (qint64) (1000 * seconds);
+	if (m_timeLimit <= 0 || m_timeLimit > seconds)
+		m_timeLimit = seconds;
+
+	/* Per-pixel moments estimate the error of the blocks, and the block
+	   flags (also used by adaptive sampling) exclude blocks from a pass */
+	if (m_moments.empty())
+		m_moments.resize(m_size.x() * m_size.y(), Vector3f(0.0f));
+	if (m_blockConverged.empty())
+		m_blockConverged.resize(m_blocks.size(), 0);
+
+	m_passPixels = 0;
+	for (size_t i=0; i<m_blocks.size(); ++i)
+		m_passPixels += (uint64_t) m_blocks[i].second.prod();
+}
+
+bool BlockGenerator::fitTimeBudget() {
+	qint64 now = m_timer.elapsed();
+	double timePerPixel = (now - m_passStart) / (double) std::max(m_passPixels, (uint64_t) 1);
+	double remaining = (m_timeBudget - now) * (double) NORI_TIME_BUDGET_MARGIN;
+	m_passStart = now;
+
+	/* Blocks that the next pass would visit, the noisiest first */
+	std::vector<std::pair<float, size_t> > blocks;
+	uint64_t pixels = 0;
+	for (size_t i=0; i<m_blocks.size(); ++i) {
+		if (m_blockConverged[i])
+			continue;
+		blocks.push_back(std::make_pair(-blockError(m_blocks[i]), i));
+		pixels += (uint64_t) m_blocks[i].second.prod();
+	}
+	m_passPixels = pixels;
+	if (blocks.empty() || pixels * timePerPixel <= remaining)
+		return !blocks.empty();
+
+	/* Only part of the image fits: make this the last pass */
+	std::sort(blocks.begin(), blocks.end());
+	m_passPixels = 0;
+	size_t selected = 0;
+	for (size_t k=0; k<blocks.size(); ++k) {
+		size_t i = blocks[k].second;
+		uint64_t area = (uint64_t) m_blocks[i].second.prod();
+		if ((m_passPixels + area) * timePerPixel <= remaining) {
+			m_passPixels += area;
+			++selected;
+		} else {
+			m_blockConverged[i] = 1;
 		}
+	}
+	if (selected == 0) {
+		cout << "Time budget: no further pass fits" << endl;
+		return false;
+	}
+	m_passCount = m_pass + 2;
+	cout << "Time budget: the last pass refines the " << selected << "/" 
+		 << blocks.size() << " noisiest blocks" << endl;
+	return true;
+}
 
-		if (--m_stepsLeft == 0) {
-			m_direction = (m_direction + 1) % 4;
-			if (m_direction == ELeft || m_direction == ERight) 
-				++m_numSteps;
-			m_stepsLeft = m_numSteps;
+float BlockGenerator::blockError(const Block &block) const {
+	const Point2i &pos = block.first;
+	const Vector2i &size = block.second;
+	double sum = 0;
+	for (int y=pos.y(); y<pos.y() + size.y(); ++y) {
+		for (int x=pos.x(); x<pos.x() + size.x(); ++x) {
+			const Vector3f &moments = m_moments[y * m_size.x() + x];
+			if (moments.z() < 2)
+				return std::numeric_limits<float>::infinity();
+			sum += pixelError(moments);
 		}
-	} while ((m_block.array() < 0).any() ||
-	         (m_block.array() >= m_numBlocks.array()).any());
+	}
+	return (float) (sum / std::max(size.prod(), 1));
+}
+
+void BlockGenerator::setCheckpoint(ImageBlock *output, const QString &filename,
+		float interval, uint64_t key) {
+	m_checkpointOutput = output;
+	m_checkpointFilename = filename;
+	m_checkpointInterval = (qint64) (1000 * interval);
+	m_checkpointKey = key;
+}
+
+void BlockGenerator::saveCheckpoint() {
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(CheckpointHeader));
+	memcpy(header.magic, "NCP", 3);
+	header.version = NORI_CHECKPOINT_VERSION;
+	for (int i=0; i<2; ++i) {
+		header.offset[i] = m_offset[i];
+		header.size[i] = m_size[i];
+	}
+	header.borderSize = m_checkpointOutput->getBorderSize();
+	header.sampleCount = m_sampleCount;
+	header.samplesPerPass = m_samplesPerPass;
+	header.pass = m_pass;
+	header.flags = (m_moments.empty() ? 0 : NORI_CHECKPOINT_MOMENTS)
+		| (m_converged.empty() ? 0 : NORI_CHECKPOINT_CONVERGED)
+		| (m_checkpointOutput->isDeferred() ? NORI_CHECKPOINT_SUBPIXEL : 0);
+	header.key = m_checkpointKey;
+
+	/* Write to a temporary file first, so that a crash while writing
+	   doesn't destroy the previous checkpoint */
+	QString tempFilename = m_checkpointFilename + ".tmp";
+	QFile file(tempFilename);
+	qint64 dataBytes = sizeof(Color4f) * m_checkpointOutput->rows() * m_checkpointOutput->cols(),
+	       momentBytes = sizeof(Vector3f) * m_moments.size(),
+	       convergedBytes = m_converged.size();
+	const std::vector<float> &subpixel = m_checkpointOutput->getSubpixelMoments();
+	qint64 subpixelBytes = sizeof(float) * subpixel.size();
+	bool success = file.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+		file.write((const char *) &header, sizeof(CheckpointHeader)) == sizeof(CheckpointHeader) &&
+		file.write((const char *) m_checkpointOutput->data(), dataBytes) == dataBytes &&
+		(momentBytes == 0 || file.write((const char *) &m_moments[0], momentBytes) == momentBytes) &&
+		(convergedBytes == 0 || file.write((const char *) &m_converged[0], convergedBytes) == convergedBytes) &&
+		(subpixelBytes == 0 || file.write((const char *) &subpixel[0], subpixelBytes) == subpixelBytes);
+	file.close();
+
+	if (success) {
+		QFile::remove(m_checkpointFilename);
+		success = QFile::rename(tempFilename, m_checkpointFilename);
+	}
+
+	/* Keep rendering even if the checkpoint couldn't be written */
+	if (!success)
+		cerr << "Warning: unable to write the checkpoint \"" 
+			 << qPrintable(m_checkpointFilename) << "\"" << endl;
+	else
+		cout << "Wrote checkpoint \"" << qPrintable(m_checkpointFilename) 
+			 << "\" (continues with pass " << m_pass + 1 << ")" << endl;
+	m_lastCheckpoint = m_timer.elapsed();
+}
 
-	m_mutex.unlock();
+bool BlockGenerator::resume() {
+	if (!m_checkpointOutput)
+		throw NoriException("BlockGenerator::resume(): no checkpoint was configured!");
+
+	QFile file(m_checkpointFilename);
+	if (!file.exists())
+		return false;
+
+	CheckpointHeader header;
+	if (!file.open(QIODevice::ReadOnly) ||
+		file.read((char *) &header, sizeof(CheckpointHeader)) != sizeof(CheckpointHeader) ||
+		memcmp(header.magic, "NCP", 3) != 0 || header.version != NORI_CHECKPOINT_VERSION)
+		throw NoriException(QString("\"%1\" is not a checkpoint!").arg(m_checkpointFilename));
+
+	uint32_t flags = (m_moments.empty() ? 0 : NORI_CHECKPOINT_MOMENTS)
+		| (m_converged.empty() ? 0 : NORI_CHECKPOINT_CONVERGED)
+		| (m_checkpointOutput->isDeferred() ? NORI_CHECKPOINT_SUBPIXEL : 0);
+	if (Point2i(header.offset[0], header.offset[1]) != m_offset ||
+		Vector2i(header.size[0], header.size[1]) != m_size ||
+		header.borderSize != m_checkpointOutput->getBorderSize() ||
+		header.sampleCount != m_sampleCount || header.samplesPerPass != m_samplesPerPass ||
+		header.flags != flags || header.key != m_checkpointKey ||
+		header.pass <= 0 || header.pass >= m_passCount)
+		throw NoriException(QString("The checkpoint \"%1\" was written with a "
+			"different configuration!").arg(m_checkpointFilename));
+
+	qint64 dataBytes = sizeof(Color4f) * m_checkpointOutput->rows() * m_checkpointOutput->cols(),
+	       momentBytes = sizeof(Vector3f) * m_moments.size(),
+	       convergedBytes = m_converged.size();
+	std::vector<float> &subpixel = m_checkpointOutput->getSubpixelMoments();
+	qint64 subpixelBytes = sizeof(float) * subpixel.size();
+	if (file.read((char *) m_checkpointOutput->data(), dataBytes) != dataBytes ||
+		(momentBytes > 0 && file.read((char *) &m_moments[0], momentBytes) != momentBytes) ||
+		(convergedBytes > 0 && file.read((char *) &m_converged[0], convergedBytes) != convergedBytes) ||
+		(subpixelBytes > 0 && file.read((char *) &subpixel[0], subpixelBytes) != subpixelBytes))
+		throw NoriException(QString("The checkpoint \"%1\" is truncated!").arg(m_checkpointFilename));
+	m_checkpointOutput->markDirty();
+
+	m_pass = header.pass;
+	cout << "Resuming from checkpoint \"" << qPrintable(m_checkpointFilename)
+		 << "\" with pass " << m_pass + 1 << "/" << m_passCount << endl;
+
+	/* Skip the blocks that have already converged */
+	if (m_targetError > 0)
+		updateConvergence();
 	return true;
 }
 
-BlockRenderThread::BlockRenderThread(const Scene *scene, Sampler *sampler, 
-		BlockGenerator *blockGenerator, ImageBlock *output) 
-	 : m_scene(scene), m_blockGenerator(blockGenerator), m_output(output) {
-	/* Create a new sample generator for the current thread */
-	m_sampler = sampler->clone();
+void BlockGenerator::setPreprocess(Integrator *integrator, const Scene *scene) {
+	m_integrator = integrator;
+	m_scene = scene;
 }
 
-BlockRenderThread::~BlockRenderThread() {
-	delete m_sampler;
+bool BlockGenerator::next(ImageBlock &block, uint32_t &sampleCount, 
+		uint32_t &firstSample, bool wait, Run *run) {
+	if (run && run->generator != this) {
+		run->generator = this;
+		run->next = run->end = 0;
+	}
+
+	while (true) {
+		/* Lock-free in the common case: the block order was determined in 
+		   the constructor. The block counts as active before it is fetched, 
+		   so that other threads never see zero active blocks while there
+		   may still be work that could be split */
+		int index;
+		if (run && run->next < run->end) {
+			/* A block of the run of this thread (already counted as active) */
+			index = run->next++;
+		} else if (run && m_runLength > 1 && m_blockConverged.empty()) {
+			/* Reserve a run, which shrinks as the pass runs out of blocks.
+			   Reserved blocks count as active, except for those beyond the
+			   end (the block that is returned keeps the count positive) */
+			int size = (int) m_blocks.size(), remaining = size - (int) m_nextBlock;
+			int length = std::max(1, std::min(m_runLength, remaining / (2 * getCoreCount())));
+			m_activeBlocks.fetchAndAddOrdered(length);
+			index = m_nextBlock.fetchAndAddOrdered(length);
+			int available = std::max(1, std::min(length, size - index));
+			if (available < length)
+				m_activeBlocks.fetchAndAddOrdered(available - length);
+			run->next = index + 1;
+			run->end = index + available;
+		} else {
+			m_activeBlocks.ref();
+			index = m_nextBlock.fetchAndAddOrdered(1);
+		}
+
+		/* Skip blocks without any pixels that need more samples */
+		if (!m_blockConverged.empty()) {
+			while (index < (int) m_blocks.size() && m_blockConverged[index])
+				index = m_nextBlock.fetchAndAddOrdered(1);
+		}
+
+		if (m_timeLimit > 0 && !m_stop && m_timer.elapsed() > 1000 * m_timeLimit) {
+			cout << "Time limit reached, stopping.." << endl;
+			m_stop = true;
+		}
+
+		if (index < (int) m_blocks.size() && !m_stop) {
+			block.setOffset(Point2i(m_offset + m_blocks[index].first));
+			block.setSize(m_blocks[index].second);
+			sampleCount = getPassSampleCount();
+			firstSample = getPassFirstSample();
+			return true;
+		}
+
+		/* Out of precomputed blocks -- wait for blocks that are split off
+		   by other threads, for the next pass, or until everything has
+		   been rendered */
+		ProfiledMutexLocker locker(&m_mutex, "Wait for block generator");
+		if (run && run->next < run->end) {
+			/* Stopped: hand back the rest of the run (while the current
+			   block still keeps the count positive) */
+			m_activeBlocks.fetchAndAddOrdered(run->next - run->end);
+			run->next = run->end;
+		}
+		release();
+		if (wait && m_splitBlocks.empty() && (int) m_activeBlocks > 0) {
+			ProfileScope scope("Wait for blocks", "render");
+			while (wait && m_splitBlocks.empty() && (int) m_activeBlocks > 0)
+				m_cond.wait(&m_mutex);
+		}
+
+		if (!m_splitBlocks.empty() && !m_stop) {
+			const SplitBlock &splitBlock = m_splitBlocks.back();
+			m_activeBlocks.ref();
+			block.setOffset(splitBlock.first.first);
+			block.setSize(splitBlock.first.second);
+			sampleCount = splitBlock.second;
+			firstSample = getPassFirstSample();
+			m_splitBlocks.pop_back();
+			return true;
+		}
+
+		/* Otherwise, the last active block was just released. This 
+		   either finished the rendering, or a new pass has begun */
+		if (m_done || !wait)
+			return false;
+	}
 }
 
-void BlockRenderThread::run() {
-	try {
-		const Integrator *integrator = m_scene->getIntegrator();
-		const Camera *camera = m_scene->getCamera();
-	
-		/* Allocate a small image block local to this thread
-		   that will be used to accumulate radiance samples */
-		ImageBlock block(Vector2i(NORI_BLOCK_SIZE), 
-			camera->getReconstructionFilter());
-	
-		/* Fetch a block to be rendered from the block generator */
-		while (m_blockGenerator->next(block)) {
-			Point2i offset = block.getOffset();
-			Vector2i size  = block.getSize();
-	
-			/* Clear its contents */
-			block.clear();
-	
-			/* For each pixel and pixel sample sample */
-			for (int y=0; y<size.y(); ++y) {
-				for (int x=0; x<size.x(); ++x) {
-					for (uint32_t i=0; i<m_sampler->getSampleCount(); ++i) {
-						Point2f pixelSample = Point2f(x + offset.x(), y + offset.y()) + m_sampler->next2D();
-						Point2f apertureSample = m_sampler->next2D();
-	
-						/* Sample a ray from the camera */
-						Ray3f ray;
-						Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
-	
-						/* Compute the incident radiance */
-						value *= integrator->Li(m_scene, m_sampler, ray);
-	
-						/* Store in the image block */
-						block.put(pixelSample, value);
-					}
-				}
-			}
-	
-			/* The image block has been processed. Now add it to the "big"
-			   block that represents the entire image */
-			m_output->put(block);
+void BlockGenerator::finished(int sampleCount, qint64 nsecs) {
+	ProfiledMutexLocker locker(&m_mutex, "Wait for block generator");
+	++m_finishedBlocks;
+
+	if (sampleCount > 0) {
+		m_sampleTimes.push_back(nsecs / (float) sampleCount);
+
+		/* Refresh the median every now and then; wait for a few 
+		   blocks so that a single outlier doesn't define it */
+		size_t n = m_sampleTimes.size();
+		if (n >= 8 && ((n & (n-1)) == 0 || n % 32 == 0)) {
+			std::vector<float> times(m_sampleTimes);
+			std::nth_element(times.begin(), times.begin() + n/2, times.end());
+			m_medianSampleTime = times[n/2];
 		}
-	} catch (const NoriException &ex) {
-		cerr << "Caught a critical exception within a rendering thread: " << qPrintable(ex.getReason()) << endl;
-		exit(-1);
 	}
+
+	release();
+}
+
+void BlockGenerator::stop() {
+	ProfiledMutexLocker locker(&m_mutex, "Wait for block generator");
+	m_stop = true;
+	m_splitBlocks.clear();
+	m_cond.wakeAll();
+}
+
+void BlockGenerator::split(const Point2i &offset, const Vector2i &size, 
+		uint32_t sampleCount) {
+	ProfiledMutexLocker locker(&m_mutex, "Wait for block generator");
+	std::vector<Block> blocks;
+	subdivide(std::make_pair(offset, size), 
+		std::max(m_blockSize / 2, NORI_MIN_BLOCK_SIZE), blocks);
+	for (size_t i=0; i<blocks.size(); ++i)
+		m_splitBlocks.push_back(std::make_pair(blocks[i], sampleCount));
+	m_cond.wakeAll();
+}
+
+BlockGenerator::Progress BlockGenerator::getProgress() const {
+	QMutexLocker locker(&m_mutex);
+	Progress progress;
+	progress.pass = m_pass;
+	progress.passCount = m_passCount;
+	progress.finishedBlocks = m_finishedBlocks;
+	progress.elapsed = m_timer.elapsed();
+	progress.timeLimit = (qint64) (1000 * m_timeLimit);
+	progress.done = m_done;
+
+	/* Blocks of the current pass that weren't fetched yet, blocks that were
+	   split off or are in flight, and all blocks of the later passes
+	   (m_activeBlocks also briefly counts threads that are fetching a block) */
+	if (m_done) {
+		progress.remainingBlocks = 0;
+	} else {
+		int blockCount = (int) m_blocks.size();
+		progress.remainingBlocks = std::max(blockCount - (int) m_nextBlock, 0)
+			+ (int) m_splitBlocks.size() + std::max((int) m_activeBlocks, 0)
+			+ (m_stop ? 0 : (m_passCount - m_pass - 1) * blockCount);
+	}
+	return progress;
+}
+
+void BlockGenerator::release() {
+	if (m_stop)
+		m_splitBlocks.clear();
+
+	if (m_activeBlocks.deref() || !m_splitBlocks.empty()
+			|| ((int) m_nextBlock < (int) m_blocks.size() && !m_stop))
+		return;
+
+	/* The current pass is complete */
+	if (m_done)
+		return;
+
+	if (m_passCount > 1) {
+		QString noise;
+		if (!m_moments.empty())
+			noise = QString(", estimated noise %1").arg(estimateNoise());
+		cout << "Pass " << m_pass + 1 << "/" << m_passCount << " done (" 
+			 << m_timer.elapsed() << " ms" << qPrintable(noise) << ")" << endl;
+	}
+
+	bool pending = m_targetError > 0 ? updateConvergence() : true;
+	if (pending && m_timeBudget > 0 && !m_stop && m_pass + 1 < m_passCount)
+		pending = fitTimeBudget();
+
+	if (m_stop || !pending || m_pass + 1 >= m_passCount || 
+			(!m_moments.empty() && estimateNoise() < m_targetNoise)) {
+		cout << "Rendering finished (took " << m_timer.elapsed() << " ms)" << endl;
+		m_done = true;
+	} else {
+		++m_pass;
+		if (m_checkpointOutput && m_timer.elapsed() - m_lastCheckpoint >= m_checkpointInterval)
+			saveCheckpoint();
+		if (m_integrator)
+			m_integrator->preprocess(m_scene, m_pass);
+		m_nextBlock.fetchAndStoreOrdered(0);
+	}
+
+	/* Wake up any threads waiting for work */
+	m_cond.wakeAll();
+}
+
+float BlockGenerator::estimateNoise() const {
+	double sum = 0;
+	for (size_t i=0; i<m_moments.size(); ++i) {
+		const Vector3f &moments = m_moments[i];
+		float n = moments.z();
+		if (n < 2)
+			continue;
+		sum += pixelError(moments);
+	}
+	return (float) (sum / std::max(m_moments.size(), (size_t) 1));
+}
+
+float BlockGenerator::pixelError(const Vector3f &moments) {
+	float n = moments.z();
+	float mean = moments.x() / n;
+	float variance = std::max(0.0f, (moments.y() - n*mean*mean) / (n-1));
+
+	/* Standard error relative to the pixel value; the offset keeps
+	   nearly black pixels from dominating the average */
+	return std::sqrt(variance / n) / (std::abs(mean) + 1e-2f);
+}
+
+bool BlockGenerator::updateConvergence() {
+	uint64_t sampleCount = 0;
+	size_t converged = 0;
+	for (size_t i=0; i<m_moments.size(); ++i) {
+		const Vector3f &moments = m_moments[i];
+		sampleCount += (uint64_t) moments.z();
+		if (!m_converged[i] && moments.z() >= 2 && 
+				(moments.z() >= m_sampleCount || pixelError(moments) < m_targetError))
+			m_converged[i] = 1;
+		converged += m_converged[i];
+	}
+
+	/* Flag the blocks in which all pixels have converged */
+	size_t pendingBlocks = 0;
+	for (size_t i=0; i<m_blocks.size(); ++i) {
+		const Point2i &pos = m_blocks[i].first;
+		const Vector2i &size = m_blocks[i].second;
+		bool done = true;
+		for (int y=pos.y(); y<pos.y() + size.y() && done; ++y)
+			for (int x=pos.x(); x<pos.x() + size.x() && done; ++x)
+				done = m_converged[y * m_size.x() + x] != 0;
+		m_blockConverged[i] = done ? 1 : 0;
+		pendingBlocks += done ? 0 : 1;
+	}
+
+	cout << "Adaptive sampling: " << converged << "/" << m_moments.size()
+		<< " pixels converged, " << (100.0 * sampleCount / m_sampleBudget) 
+		<< "% of the sample budget used" << endl;
+
+	return pendingBlocks > 0 && sampleCount < m_sampleBudget;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,231 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bssrdf.h>
+#include <nori/scene.h>
+#include <nori/sampler.h>
+#include <nori/frame.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief BSDF at the exit point of a \ref DiffusionProfile
+ *
+ * Light leaves the material in a direction that is proportional to
+ * the Fresnel transmittance times the cosine, i.e. the BSDF is
+ * (1 - F(cos theta)) / (c pi), where c normalizes it to one.
+ */
+class DiffusionExit : public BSDF {
+public:
+	DiffusionExit(const DiffusionProfile *profile) : m_profile(profile) {
+		/* c = 2 * integral of (1 - F(mu)) mu over [0, 1] */
+		const int steps = 1024;
+		double sum = 0;
+		for (int i=0; i<steps; ++i) {
+			float mu = (i + 0.5f) / steps;
+			sum += (1 - profile->fresnel(mu)) * mu;
+		}
+		float c = (float) (2 * sum / steps);
+		m_normalization = c > 0 ? 1.0f / c : 0.0f;
+	}
+
+	Color3f eval(const BSDFQueryRecord &bRec) const {
+		if (bRec.measure != ESolidAngle || Frame::cosTheta(bRec.wo) <= 0)
+			return Color3f(0.0f);
+		return Color3f((1 - m_profile->fresnel(Frame::cosTheta(bRec.wo)))
+			* m_normalization * INV_PI);
+	}
+
+	float pdf(const BSDFQueryRecord &bRec) const {
+		if (bRec.measure != ESolidAngle || Frame::cosTheta(bRec.wo) <= 0)
+			return 0.0f;
+		return INV_PI * Frame::cosTheta(bRec.wo);
+	}
+
+	Color3f sample(BSDFQueryRecord &bRec, const Point2f &sample) const {
+		bRec.measure = ESolidAngle;
+		bRec.wo = squareToCosineHemisphere(sample);
+		return Color3f((1 - m_profile->fresnel(Frame::cosTheta(bRec.wo))) * m_normalization);
+	}
+
+	QString toString() const {
+		return QString("DiffusionExit[normalization = %1]").arg(m_normalization);
+	}
+private:
+	const DiffusionProfile *m_profile;
+	float m_normalization;
+};
+
+DiffusionProfile::DiffusionProfile() : m_resolution(0), m_exitBSDF(NULL) {
+	for (int c=0; c<3; ++c)
+		m_maxRadius[c] = 0.0f;
+}
+
+DiffusionProfile::~DiffusionProfile() {
+	delete m_exitBSDF;
+}
+
+void DiffusionProfile::buildTables(const float *extent, float quantile, int resolution) {
+	m_resolution = resolution;
+	for (int c=0; c<3; ++c) {
+		m_cdf[c].clear();
+		m_maxRadius[c] = 0.0f;
+
+		/* Find the radius that contains the requested fraction of the
+		   reflectance (the profile is sampled more densely near the center) */
+		std::vector<double> cumulative(NORI_SSS_SEARCH_STEPS + 1, 0.0);
+		float lastR = 0.0f, lastF = 0.0f;
+		for (int j=1; j<=NORI_SSS_SEARCH_STEPS; ++j) {
+			float x = j / (float) NORI_SSS_SEARCH_STEPS, r = extent[c] * x * x;
+			float f = evalProfile(r)[c] * 2 * (float) M_PI * r;
+			cumulative[j] = cumulative[j-1] + 0.5 * (f + lastF) * (r - lastR);
+			lastR = r;
+			lastF = f;
+		}
+		double total = cumulative[NORI_SSS_SEARCH_STEPS];
+		if (!(total > 0))
+			continue;
+		int j = 1;
+		while (j < NORI_SSS_SEARCH_STEPS && cumulative[j] < quantile * total)
+			++j;
+		float x = j / (float) NORI_SSS_SEARCH_STEPS;
+		m_maxRadius[c] = extent[c] * x * x;
+
+		/* Tabulate the cumulative distribution up to that radius */
+		const int substeps = 8;
+		std::vector<float> &cdf = m_cdf[c];
+		cdf.resize(resolution + 1);
+		cdf[0] = 0.0f;
+		double sum = 0;
+		for (int i=0; i<resolution; ++i) {
+			float x0 = i / (float) resolution, x1 = (i + 1) / (float) resolution;
+			float r0 = m_maxRadius[c] * x0 * x0, r1 = m_maxRadius[c] * x1 * x1;
+			for (int k=0; k<substeps; ++k) {
+				float r = r0 + (r1 - r0) * (k + 0.5f) / substeps;
+				sum += evalProfile(r)[c] * 2 * M_PI * r * (r1 - r0) / substeps;
+			}
+			cdf[i+1] = (float) sum;
+		}
+		if (!(sum > 0)) {
+			cdf.clear();
+			m_maxRadius[c] = 0.0f;
+			continue;
+		}
+		for (int i=1; i<=resolution; ++i)
+			cdf[i] /= (float) sum;
+		cdf[resolution] = 1.0f;
+	}
+
+	delete m_exitBSDF;
+	m_exitBSDF = new DiffusionExit(this);
+}
+
+float DiffusionProfile::sampleRadius(int channel, float sample) const {
+	const std::vector<float> &cdf = m_cdf[channel];
+	if (cdf.empty())
+		return -1.0f;
+	int i = (int) (std::upper_bound(cdf.begin(), cdf.end(), sample) - cdf.begin()) - 1;
+	i = std::max(0, std::min(i, m_resolution - 1));
+	float width = cdf[i+1] - cdf[i];
+	float t = width > 0 ? (sample - cdf[i]) / width : 0.5f;
+	float x0 = i / (float) m_resolution, x1 = (i + 1) / (float) m_resolution;
+	float r0 = m_maxRadius[channel] * x0 * x0, r1 = m_maxRadius[channel] * x1 * x1;
+	return r0 + std::max(0.0f, std::min(t, 1.0f)) * (r1 - r0);
+}
+
+float DiffusionProfile::pdfRadius(int channel, float r) const {
+	const std::vector<float> &cdf = m_cdf[channel];
+	float maxRadius = m_maxRadius[channel];
+	if (cdf.empty() || r <= 0 || r >= maxRadius)
+		return 0.0f;
+
+	/* The density is constant within each entry of the table */
+	int i = std::min((int) (std::sqrt(r / maxRadius) * m_resolution), m_resolution - 1);
+	float x0 = i / (float) m_resolution, x1 = (i + 1) / (float) m_resolution;
+	float r0 = maxRadius * x0 * x0, r1 = maxRadius * x1 * x1;
+	return (cdf[i+1] - cdf[i]) / (r1 - r0) * INV_TWOPI / r;
+}
+
+bool DiffusionProfile::sampleExit(const Scene *scene, Sampler *sampler, float time,
+		Intersection &its, Color3f &weight, uint64_t &rayCount) const {
+	/* Choose a color channel, and the axis of the frame to probe along
+	   (the normal with probability 1/2, each tangent with 1/4) */
+	const Frame &frame = its.geoFrame;
+	const Vector3f axes[3] = { Vector3f(frame.n), frame.s, frame.t };
+	const float axisProb[3] = { 0.5f, 0.25f, 0.25f };
+	int channel = std::min((int) (sampler->next1D() * 3), 2);
+	float axisSample = sampler->next1D();
+	int axis = axisSample < 0.5f ? 0 : (axisSample < 0.75f ? 1 : 2);
+	const Vector3f &a = axes[axis], &b1 = axes[(axis + 1) % 3], &b2 = axes[(axis + 2) % 3];
+
+	/* Sample a point on the plane through the entry point */
+	Point2f sample = sampler->next2D();
+	float r = sampleRadius(channel, sample.x()), maxRadius = m_maxRadius[channel];
+	if (r < 0 || r >= maxRadius)
+		return false;
+	float phi = 2 * (float) M_PI * sample.y();
+	float halfLength = std::sqrt(maxRadius * maxRadius - r * r);
+
+	/* Find the points of the mesh along the probe ray through it */
+	Point3f origin = its.p + (b1 * std::cos(phi) + b2 * std::sin(phi)) * r + a * halfLength;
+	Ray3f probe(origin, -a, 0.0f, 2 * halfLength);
+	probe.time = time;
+	Intersection hits[NORI_SSS_MAX_HITS];
+	int count = 0;
+	while (count < NORI_SSS_MAX_HITS) {
+		rayCount++;
+		if (!scene->rayIntersect(probe, hits[count]))
+			break;
+		float t = hits[count].t;
+		if (hits[count].mesh == its.mesh)
+			++count;
+		probe.mint = t + Epsilon * std::max(1.0f, t);
+		if (probe.mint >= probe.maxt)
+			break;
+	}
+	if (count == 0)
+		return false;
+
+	/* Choose one of them, and compute its density wrt. area (one-sample
+	   MIS over all channels and axes) */
+	Intersection &exit = hits[std::min((int) (sampler->next1D() * count), count - 1)];
+	exit.computeDifferentialGeometry();
+	Vector3f d = exit.p - its.p;
+	float pdf = 0.0f;
+	for (int i=0; i<3; ++i) {
+		float along = d.dot(axes[i]);
+		float rProj = std::sqrt(std::max(0.0f, d.squaredNorm() - along * along));
+		float cosine = std::abs(exit.geoFrame.n.dot(axes[i]));
+		for (int c=0; c<3; ++c)
+			pdf += axisProb[i] * (1.0f / 3.0f) * pdfRadius(c, rProj) * cosine;
+	}
+	pdf /= count;
+	if (pdf <= 0)
+		return false;
+
+	weight = evalProfile(d.norm()) / pdf;
+	its = exit;
+	return true;
+}
+
+QString DiffusionProfile::toString() const {
+	return QString("[%1, %2, %3] (%4 entries)").arg(m_maxRadius[0])
+		.arg(m_maxRadius[1]).arg(m_maxRadius[2]).arg(m_resolution);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,558 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/triaccel.h>
+#include <nori/boxaccel.h>
+#include <nori/profiler.h>
+#include <nori/memreport.h>
+#include <boost/static_assert.hpp>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/// Determines on which side of a bin boundary a primitive's centroid lies
+struct BinPredicate {
+	int axis, bin;
+	float minValue, scale;
+
+	inline BinPredicate(int axis, int bin, float minValue, float scale)
+		: axis(axis), bin(bin), minValue(minValue), scale(scale) { }
+
+	template <typename Primitive> inline bool operator()(const Primitive &prim) const {
+		return std::min((int) ((prim.centroid[axis] - minValue) * scale),
+			NORI_BVH_BINS - 1) <= bin;
+	}
+};
+
+/// Orders primitives by the position of their centroid along an axis
+struct CentroidOrdering {
+	int axis;
+
+	inline CentroidOrdering(int axis) : axis(axis) { }
+
+	template <typename Primitive> inline bool operator()(const Primitive &a, const Primitive &b) const {
+		return a.centroid[axis] < b.centroid[axis];
+	}
+};
+
+/**
+ * Each of the four entries of a wide node is either unused (an empty box),
+ * an inner node (\c count is zero and \c child is the index of another
+ * wide node), or a leaf (\c child is the index of its first \ref TriAccel4
+ * block, and \c count is its number of triangles)
+ */
+struct BVH::WideNode {
+	BoxAccel4 boxes;
+	uint32_t child[4];
+	uint32_t count[4];
+};
+
+BVH::BVH() : m_triAccel(NULL), m_triAccelCount(0), m_wideNodes(NULL),
+		m_wideNodeCount(0), m_wide(false), m_buildTime(0),
+		m_refitThreshold(1.5f), m_buildCost(0) {
+	BOOST_STATIC_ASSERT(sizeof(BVHNode) == 32);
+	BOOST_STATIC_ASSERT(sizeof(WideNode) == 128);
+}
+
+BVH::~BVH() {
+	if (m_triAccel)
+		freeAligned(m_triAccel);
+	if (m_wideNodes)
+		freeAligned(m_wideNodes);
+}
+
+void BVH::build() {
+	ProfileScope scope("Build BVH", "accel");
+	SizeType primCount = getPrimitiveCount();
+	cout << "Constructing a SAH BVH (" << primCount << " triangles) .." << endl;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Compute the bounding box and centroid of every triangle */
+	std::vector<BuildPrimitive> prims(primCount);
+	m_bbox.reset();
+	for (IndexType i=0; i<primCount; ++i) {
+		IndexType primIndex = i;
+		IndexType meshIndex = findMesh(primIndex);
+		BuildPrimitive &prim = prims[i];
+		prim.bbox = m_meshes[meshIndex]->getBoundingBox(primIndex);
+		prim.centroid = prim.bbox.getCenter();
+		prim.index = i;
+		m_bbox.expandBy(prim.bbox);
+	}
+
+	std::vector<TriAccel4> blocks;
+	m_nodes.clear();
+	if (primCount > 0) {
+		m_nodes.reserve(2 * (primCount / NORI_BVH_MINLEAF) + 1);
+		buildRecursive(prims, 0, primCount, 1, blocks);
+	}
+
+	/* Move the triangle blocks into properly aligned storage */
+	if (m_triAccel)
+		freeAligned(m_triAccel);
+	m_triAccelCount = (SizeType) blocks.size();
+	m_triAccel = static_cast<TriAccel4 *>(allocAligned(
+		sizeof(TriAccel4) * std::max(m_triAccelCount, (SizeType) 1)));
+	if (m_triAccelCount > 0)
+		memcpy(m_triAccel, &blocks[0], sizeof(TriAccel4) * m_triAccelCount);
+	std::vector<BVHNode>(m_nodes).swap(m_nodes);
+	if (m_wide)
+		buildWide();
+
+	m_buildTime = timer.elapsed();
+	m_buildCost = getCost();
+
+	cout << "Finished after " << m_buildTime << " ms" << endl 
+		 << "The final " << qPrintable(getName()) << " requires " << getMemoryUsage() / 1024 
+		 << " KiB of memory (" << m_nodes.size() << " nodes";
+	if (m_wide)
+		cout << ", " << m_wideNodeCount << " wide nodes";
+	cout << ")" << endl;
+}
+
+void BVH::buildWide() {
+	std::vector<WideNode> nodes;
+	/* Pairs of binary nodes and the wide nodes that replace them */
+	std::vector<std::pair<uint32_t, uint32_t> > todo;
+	if (!m_nodes.empty()) {
+		nodes.push_back(WideNode());
+		todo.push_back(std::make_pair((uint32_t) 0, (uint32_t) 0));
+	}
+
+	while (!todo.empty()) {
+		uint32_t nodeIndex = todo.back().first, wideIndex = todo.back().second;
+		todo.pop_back();
+
+		/* Gather up to four descendants, repeatedly opening up the inner
+		   node with the largest surface area (i.e. the one most likely
+		   to be traversed) */
+		uint32_t children[4];
+		int childCount = 0;
+		const BVHNode &node = m_nodes[nodeIndex];
+		if (node.isLeaf()) {
+			children[childCount++] = nodeIndex;
+		} else {
+			children[childCount++] = nodeIndex + 1;
+			children[childCount++] = node.offset;
+		}
+
+		while (childCount < 4) {
+			int best = -1;
+			float bestArea = -1;
+			for (int i=0; i<childCount; ++i) {
+				const BVHNode &child = m_nodes[children[i]];
+				if (!child.isLeaf() && child.bbox.getSurfaceArea() > bestArea) {
+					best = i;
+					bestArea = child.bbox.getSurfaceArea();
+				}
+			}
+			if (best < 0)
+				break;
+			uint32_t opened = children[best];
+			children[best] = opened + 1;
+			children[childCount++] = m_nodes[opened].offset;
+		}
+
+		for (int lane=0; lane<4; ++lane) {
+			/* Note: 'nodes' may be reallocated within this loop */
+			if (lane >= childCount) {
+				nodes[wideIndex].boxes.clear(lane);
+				nodes[wideIndex].child[lane] = nodes[wideIndex].count[lane] = 0;
+				continue;
+			}
+			const BVHNode &child = m_nodes[children[lane]];
+			nodes[wideIndex].boxes.set(lane, child.bbox);
+			if (child.isLeaf()) {
+				nodes[wideIndex].child[lane] = child.offset;
+				nodes[wideIndex].count[lane] = child.getPrimCount();
+			} else {
+				uint32_t index = (uint32_t) nodes.size();
+				nodes.push_back(WideNode());
+				nodes[wideIndex].child[lane] = index;
+				nodes[wideIndex].count[lane] = 0;
+				todo.push_back(std::make_pair(children[lane], index));
+			}
+		}
+	}
+
+	/* Move the nodes into properly aligned storage */
+	if (m_wideNodes)
+		freeAligned(m_wideNodes);
+	m_wideNodeCount = (SizeType) nodes.size();
+	m_wideNodes = static_cast<WideNode *>(allocAligned(
+		sizeof(WideNode) * std::max(m_wideNodeCount, (SizeType) 1)));
+	if (m_wideNodeCount > 0)
+		memcpy(m_wideNodes, &nodes[0], sizeof(WideNode) * m_wideNodeCount);
+}
+
+bool BVH::update() {
+	if (m_nodes.empty())
+		return true;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Children are always stored after their parent, hence a backwards
+	   sweep visits the leaves before the inner nodes that contain them */
+	for (size_t i=m_nodes.size(); i-- > 0; ) {
+		BVHNode &node = m_nodes[i];
+		if (!node.isLeaf()) {
+			node.bbox = m_nodes[i+1].bbox;
+			node.bbox.expandBy(m_nodes[node.offset].bbox);
+			continue;
+		}
+
+		/* Repack the triangles of the leaf and recompute its bounds */
+		node.bbox.reset();
+		for (uint32_t j=0; j<node.getPrimCount(); ++j) {
+			TriAccel4 &block = m_triAccel[node.offset + j/4];
+			int lane = (int) (j % 4);
+			IndexType meshIndex = block.mesh[lane], primIndex = block.prim[lane];
+			const Mesh *mesh = m_meshes[meshIndex];
+			const uint32_t *indices = mesh->getIndices() + 3*primIndex;
+			const Point3f *positions = mesh->getVertexPositions();
+			const Point3f &p0 = positions[indices[0]], &p1 = positions[indices[1]],
+			              &p2 = positions[indices[2]];
+			block.set(lane, p0, p1, p2, meshIndex, primIndex);
+			node.bbox.expandBy(p0);
+			node.bbox.expandBy(p1);
+			node.bbox.expandBy(p2);
+		}
+	}
+	m_bbox = m_nodes[0].bbox;
+
+	float cost = getCost();
+	if (cost > m_refitThreshold * m_buildCost) {
+		cout << "The SAH cost of the refitted BVH increased from " << m_buildCost
+			 << " to " << cost << ", rebuilding .." << endl;
+		build();
+		return false;
+	}
+	if (m_wide)
+		buildWide();
+
+	cout << "Refitted the BVH in " << timer.elapsed() << " ms (SAH cost "
+		 << cost << ", " << m_buildCost << " after the last build)" << endl;
+	return true;
+}
+
+float BVH::getCost() const {
+	if (m_nodes.empty())
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (size_t i=0; i<m_nodes.size(); ++i) {
+		const BVHNode &node = m_nodes[i];
+		cost += node.bbox.getSurfaceArea() * 
+			(node.isLeaf() ? (float) node.getPrimCount() : 1.0f);
+	}
+
+	float rootArea = m_nodes[0].bbox.getSurfaceArea();
+	return rootArea > 0 ? cost / rootArea : 0.0f;
+}
+
+uint32_t BVH::buildRecursive(std::vector<BuildPrimitive> &prims,
+		uint32_t start, uint32_t end, int depth, std::vector<TriAccel4> &blocks) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(BVHNode());
+
+	BoundingBox3f bbox, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(prims[i].bbox);
+		centroidBBox.expandBy(prims[i].centroid);
+	}
+
+	uint32_t primCount = end - start;
+	uint32_t split = 0;
+	int axis = -1;
+
+	if (primCount > NORI_BVH_MINLEAF && depth < NORI_BVH_MAXDEPTH) {
+		/* Evaluate the surface area heuristic at the bin boundaries
+		   along all three axes (with unit traversal and intersection cost) */
+		float bestCost = std::numeric_limits<float>::infinity();
+		int bestAxis = -1, bestBin = 0;
+		Vector3f extents = centroidBBox.getExtents();
+
+		for (int a=0; a<3; ++a) {
+			if (extents[a] <= 0)
+				continue;
+
+			BoundingBox3f binBBox[NORI_BVH_BINS];
+			uint32_t binCount[NORI_BVH_BINS];
+			memset(binCount, 0, sizeof(binCount));
+
+			float scale = NORI_BVH_BINS / extents[a];
+			for (uint32_t i=start; i<end; ++i) {
+				int bin = std::min((int) ((prims[i].centroid[a] - centroidBBox.min[a]) * scale),
+					NORI_BVH_BINS - 1);
+				binCount[bin]++;
+				binBBox[bin].expandBy(prims[i].bbox);
+			}
+
+			/* Sweep from the right to collect the costs of the right sides */
+			float rightCost[NORI_BVH_BINS];
+			BoundingBox3f accumBBox;
+			uint32_t accumCount = 0;
+			for (int i=NORI_BVH_BINS-1; i>0; --i) {
+				accumBBox.expandBy(binBBox[i]);
+				accumCount += binCount[i];
+				rightCost[i] = accumCount > 0 ? accumCount * accumBBox.getSurfaceArea() : 0.0f;
+			}
+
+			/* .. and then from the left */
+			accumBBox.reset();
+			accumCount = 0;
+			for (int i=0; i<NORI_BVH_BINS-1; ++i) {
+				accumBBox.expandBy(binBBox[i]);
+				accumCount += binCount[i];
+				if (accumCount == 0 || accumCount == primCount)
+					continue;
+				float cost = accumCount * accumBBox.getSurfaceArea() + rightCost[i+1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = a;
+					bestBin = i;
+				}
+			}
+		}
+
+		float leafCost = (float) primCount,
+			splitCost = 1.0f + bestCost / bbox.getSurfaceArea();
+
+		if (bestAxis >= 0 && (splitCost < leafCost || primCount > 4*NORI_BVH_MINLEAF)) {
+			/* Partition the primitives with respect to the chosen bin boundary */
+			float scale = NORI_BVH_BINS / extents[bestAxis];
+			float minValue = centroidBBox.min[bestAxis];
+			BuildPrimitive *ptr = std::partition(&prims[0] + start, &prims[0] + end,
+				BinPredicate(bestAxis, bestBin, minValue, scale));
+			split = (uint32_t) (ptr - &prims[0]);
+			axis = bestAxis;
+		} else if (bestAxis < 0 && primCount > 4*NORI_BVH_MINLEAF) {
+			/* All centroids coincide: split the list in half to keep the leaves small */
+			split = start + primCount / 2;
+			axis = centroidBBox.getMajorAxis();
+		}
+
+		if (axis >= 0 && (split == start || split == end)) {
+			/* Floating point trouble -- fall back to a median split */
+			split = start + primCount / 2;
+			std::nth_element(&prims[0] + start, &prims[0] + split, &prims[0] + end,
+				CentroidOrdering(axis));
+		}
+	}
+
+	if (axis < 0) {
+		/* Create a leaf node and pack its triangles */
+		BVHNode &node = m_nodes[nodeIndex];
+		node.bbox = bbox;
+		node.offset = (uint32_t) blocks.size();
+		node.data = primCount << 2;
+
+		for (uint32_t i=start; i<end; i += 4) {
+			TriAccel4 block;
+			for (int lane=0; lane<4; ++lane) {
+				if (i + lane >= end) {
+					block.clear(lane);
+					continue;
+				}
+				IndexType primIndex = prims[i + lane].index;
+				IndexType meshIndex = findMesh(primIndex);
+				const Mesh *mesh = m_meshes[meshIndex];
+				const uint32_t *indices = mesh->getIndices() + 3*primIndex;
+				const Point3f *positions = mesh->getVertexPositions();
+				block.set(lane, positions[indices[0]], positions[indices[1]],
+					positions[indices[2]], meshIndex, primIndex);
+			}
+			blocks.push_back(block);
+		}
+		return nodeIndex;
+	}
+
+	buildRecursive(prims, start, split, depth+1, blocks);
+	uint32_t rightChild = buildRecursive(prims, split, end, depth+1, blocks);
+
+	/* Note: 'm_nodes' may have been reallocated by the recursive calls */
+	BVHNode &node = m_nodes[nodeIndex];
+	node.bbox = bbox;
+	node.offset = rightChild;
+	node.data = (uint32_t) axis;
+	return nodeIndex;
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+	if (m_nodes.empty())
+		return false;
+	if (m_wide)
+		return rayIntersectWide(ray, its, shadowRay);
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon) 
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	uint32_t stack[NORI_BVH_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIndex = 0;
+	bool foundIntersection = false;
+	uint32_t foundPrimIndex = 0;
+
+	while (true) {
+		const BVHNode &node = m_nodes[nodeIndex];
+
+		float nodeMinT, nodeMaxT;
+		if (node.bbox.rayIntersect(ray, mint, maxt, nodeMinT, nodeMaxT)) {
+			if (!node.isLeaf()) {
+				/* Visit the nearer child first */
+				if (ray.dirIsNeg[node.getAxis()]) {
+					stack[stackPos++] = nodeIndex + 1;
+					nodeIndex = node.offset;
+				} else {
+					stack[stackPos++] = node.offset;
+					nodeIndex = nodeIndex + 1;
+				}
+				continue;
+			}
+
+			const TriAccel4 *block = m_triAccel + node.offset,
+			                *last = block + (node.getPrimCount() + 3) / 4;
+			for (; block != last; ++block) {
+				float u[4], v[4], t[4];
+				int hits = block->rayIntersect(ray, mint, maxt, u, v, t);
+				if (!hits)
+					continue;
+				if (shadowRay)
+					return true;
+				for (int i=0; i<4; ++i) {
+					if ((hits & (1 << i)) && t[i] <= maxt) {
+						maxt = t[i];
+						its.t = t[i];
+						its.bary = Point2f(u[i], v[i]);
+						its.mesh = m_meshes[block->mesh[i]];
+						foundPrimIndex = block->prim[i];
+						foundIntersection = true;
+					}
+				}
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIndex = stack[--stackPos];
+	}
+
+	if (foundIntersection && !shadowRay)
+		fillIntersectionRecord(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool BVH::rayIntersectWide(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon) 
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	/* Every visited node pushes at most three more entries than it pops */
+	struct StackEntry {
+		uint32_t node;
+		float t;
+	} stack[3*NORI_BVH_MAXDEPTH + 1];
+	uint32_t stackPos = 0;
+	bool foundIntersection = false;
+	uint32_t foundPrimIndex = 0;
+
+	stack[stackPos].node = 0;
+	stack[stackPos++].t = mint;
+
+	while (stackPos > 0) {
+		StackEntry entry = stack[--stackPos];
+		/* Skip nodes that lie behind an intersection found in the meantime */
+		if (entry.t > maxt)
+			continue;
+		const WideNode &node = m_wideNodes[entry.node];
+
+		float nearT[4];
+		int hits = node.boxes.rayIntersect(ray, mint, maxt, nearT);
+
+		/* Intersect leaves right away and collect the inner nodes */
+		StackEntry inner[4];
+		int innerCount = 0;
+		for (int lane=0; lane<4; ++lane) {
+			if (!(hits & (1 << lane)) || nearT[lane] > maxt)
+				continue;
+			if (node.count[lane] == 0) {
+				inner[innerCount].node = node.child[lane];
+				inner[innerCount++].t = nearT[lane];
+				continue;
+			}
+
+			const TriAccel4 *block = m_triAccel + node.child[lane],
+			                *last = block + (node.count[lane] + 3) / 4;
+			for (; block != last; ++block) {
+				float u[4], v[4], t[4];
+				int triHits = block->rayIntersect(ray, mint, maxt, u, v, t);
+				if (!triHits)
+					continue;
+				if (shadowRay)
+					return true;
+				for (int i=0; i<4; ++i) {
+					if ((triHits & (1 << i)) && t[i] <= maxt) {
+						maxt = t[i];
+						its.t = t[i];
+						its.bary = Point2f(u[i], v[i]);
+						its.mesh = m_meshes[block->mesh[i]];
+						foundPrimIndex = block->prim[i];
+						foundIntersection = true;
+					}
+				}
+			}
+		}
+
+		/* Push the inner nodes so that the nearest one is visited first */
+		for (int i=1; i<innerCount; ++i) {
+			StackEntry tmp = inner[i];
+			int j = i;
+			for (; j > 0 && inner[j-1].t < tmp.t; --j)
+				inner[j] = inner[j-1];
+			inner[j] = tmp;
+		}
+		for (int i=0; i<innerCount; ++i)
+			stack[stackPos++] = inner[i];
+	}
+
+	if (foundIntersection && !shadowRay)
+		fillIntersectionRecord(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+void BVH::reportMemory(MemoryReport &report) const {
+	report.add("bvhNodes", m_nodes.size() * sizeof(BVHNode) + m_wideNodeCount * sizeof(WideNode));
+	report.add("bvhTriangles", m_triAccelCount * sizeof(TriAccel4));
+}
+
+size_t BVH::getMemoryUsage() const {
+	return m_nodes.size() * sizeof(BVHNode) 
+		+ m_triAccelCount * sizeof(TriAccel4)
+		+ m_wideNodeCount * sizeof(WideNode);
+}
+
+NORI_NAMESPACE_END
@@ -22,10 +22,184 @@
 #include <nori/random.h>
 #include <boost/math/distributions/chi_squared.hpp>
 #include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
+#include <QDir>
+#include <QFile>
+#include <QThread>
 #include <fstream>
 
+/// Version of the files written by the cache of \ref ChiSquareTest
+#define NORI_CHI2_CACHE_VERSION 1
+
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Header of a file in the cache of \ref ChiSquareTest
+ *
+ * It is followed by the integrals of the density over the cells of the
+ * contingency table (little endian floats, ordered by theta and then phi).
+ */
+struct ChiSquareCacheHeader {
+	char magic[3];
+	uint8_t version;
+	uint32_t thetaResolution;
+	uint32_t phiResolution;
+	uint32_t reserved;
+	/// Hash of the tested object, the incident direction, and the resolution
+	uint64_t key;
+};
+
+BOOST_STATIC_ASSERT(sizeof(ChiSquareCacheHeader) == 24);
+
+/// Continue a 64 bit FNV-1a hash with a buffer
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *bytes = (const uint8_t *) data;
+	for (size_t i=0; i<size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * \brief Worker thread of \ref ChiSquareTest
+ *
+ * First adds its share of the samples of a BSDF or phase function to its
+ * own histogram, using its own random number generator. Then, it
+ * numerically integrates the density over cells of the contingency
+ * table (using the 'cubature' library), which it takes from a shared
+ * counter until none are left. The thread is started once per round of
+ * the sequential test: the histogram keeps growing, and the integrals
+ * are only computed in the first round.
+ */
+class ChiSquareWorker : public QThread {
+public:
+	ChiSquareWorker(const BSDF *bsdf, const PhaseFunction *phaseFunction,
+			const Vector3f &wi, int thetaResolution, int phiResolution,
+			uint32_t seed, uint32_t stream, QAtomicInt &nextCell, float *cellIntegrals)
+		: m_bsdf(bsdf), m_phaseFunction(phaseFunction), m_wi(wi),
+		  m_thetaResolution(thetaResolution), m_phiResolution(phiResolution),
+		  m_sampleCount(0), m_nextCell(nextCell), m_cellIntegrals(cellIntegrals),
+		  m_histogram(thetaResolution * phiResolution, 0) {
+		uint32_t values[2] = { seed, stream };
+		m_random.seed(values, 2);
+	}
+
+	/// Set the number of samples that the next run adds to the histogram
+	inline void setSampleCount(int sampleCount) { m_sampleCount = sampleCount; }
+
+	void run() {
+		float factorTheta = m_thetaResolution / M_PI,
+			  factorPhi   = m_phiResolution / (2 * M_PI);
+
+		/* Generate many samples and create a histogram / contingency table.
+		   They are drawn in batches, which saves a virtual call per sample */
+		Point2f samples[NORI_WARP_BATCH_SIZE];
+		BSDFQueryRecord bRecs[NORI_WARP_BATCH_SIZE];
+		PhaseFunctionQueryRecord pRecs[NORI_WARP_BATCH_SIZE];
+		Color3f bsdfResults[NORI_WARP_BATCH_SIZE];
+		float phaseResults[NORI_WARP_BATCH_SIZE];
+		for (int k=0; k<m_sampleCount; k+=NORI_WARP_BATCH_SIZE) {
+			uint32_t size = (uint32_t) std::min(m_sampleCount - k, NORI_WARP_BATCH_SIZE);
+			for (uint32_t i=0; i<size; ++i)
+				samples[i] = Point2f(m_random.nextFloat(), m_random.nextFloat());
+			if (m_bsdf) {
+				for (uint32_t i=0; i<size; ++i)
+					bRecs[i] = BSDFQueryRecord(m_wi);
+				m_bsdf->sample(bRecs, samples, bsdfResults, size);
+			} else {
+				for (uint32_t i=0; i<size; ++i)
+					pRecs[i] = PhaseFunctionQueryRecord(m_wi);
+				m_phaseFunction->sample(pRecs, samples, phaseResults, size);
+			}
+
+			for (uint32_t i=0; i<size; ++i) {
+				if (m_bsdf ? (bsdfResults[i].array() == 0).all() : phaseResults[i] == 0)
+					continue;
+
+				Point2f coords = sphericalCoordinates(m_bsdf ? bRecs[i].wo : pRecs[i].wo);
+
+				int thetaBin = std::min(std::max(0,
+					(int) std::floor(coords.x() * factorTheta)), m_thetaResolution-1);
+				int phiBin = std::min(std::max(0,
+					(int) std::floor(coords.y() * factorPhi)), m_phiResolution-1);
+				m_histogram[thetaBin * m_phiResolution + phiBin] += 1;
+			}
+		}
+
+		factorTheta = M_PI / m_thetaResolution;
+		factorPhi   = 2 * M_PI / m_phiResolution;
+
+		/* Numerically integrate the probability density function
+		   over rectangles in spherical coordinates */
+		NDIntegrator integrator(1, 2, 100000, 0, 1e-6f);
+		int cellCount = m_thetaResolution * m_phiResolution;
+		while (true) {
+			int cell = m_nextCell.fetchAndAddRelaxed(1);
+			if (cell >= cellCount)
+				break;
+			int i = cell / m_phiResolution, j = cell % m_phiResolution;
+
+			double min[2], max[2];
+			min[0] = i * factorTheta;
+			max[0] = (i+1) * factorTheta;
+			min[1] = j * factorPhi;
+			max[1] = (j+1) * factorPhi;
+			double result, error;
+
+			if (m_bsdf)
+				integrator.integrateVectorized(
+					boost::bind(&ChiSquareWorker::bsdfIntegrand, m_bsdf, m_wi, _1, _2, _3),
+					min, max, &result, &error
+				);
+			else
+				integrator.integrateVectorized(
+					boost::bind(&ChiSquareWorker::phaseFunctionIntegrand, m_phaseFunction, m_wi, _1, _2, _3),
+					min, max, &result, &error
+				);
+
+			m_cellIntegrals[cell] = (float) result;
+		}
+	}
+
+	/// Return the histogram of the samples of this thread
+	inline const std::vector<uint32_t> &getHistogram() const { return m_histogram; }
+private:
+	/// Functor to evaluate the pdf values of a BSDF
+	static void bsdfIntegrand(const BSDF *bsdf,
+		const Vector3f &wi, size_t nPts, const double *in, double *out) {
+		for (int i=0; i<(int) nPts; ++i) {
+			/* The quadrature code runs in double precision, so some extra
+			   conversions are required */
+			Vector3f wo = sphericalDirection((float) in[2*i], (float) in[2*i+1]);
+			BSDFQueryRecord bRec(wi, wo, ESolidAngle);
+			out[i] = (double) (bsdf->pdf(bRec) * std::sin((float) in[2*i]));
+		}
+	}
+
+	/// Functor to evaluate the pdf values of a phase function
+	static void phaseFunctionIntegrand(const PhaseFunction *phase,
+		const Vector3f &wi, size_t nPts, const double *in, double *out) {
+		for (int i=0; i<(int) nPts; ++i) {
+			/* The quadrature code runs in double precision, so some extra
+			   conversions are required */
+			Vector3f wo = sphericalDirection((float) in[2*i], (float) in[2*i+1]);
+			PhaseFunctionQueryRecord bRec(wi, wo);
+			out[i] = (double) (phase->pdf(bRec) * std::sin((float) in[2*i]));
+		}
+	}
+private:
+	const BSDF *m_bsdf;
+	const PhaseFunction *m_phaseFunction;
+	Vector3f m_wi;
+	int m_thetaResolution, m_phiResolution;
+	int m_sampleCount;
+	QAtomicInt &m_nextCell;
+	float *m_cellIntegrals;
+	std::vector<uint32_t> m_histogram;
+	Random m_random;
+};
+
 class ChiSquareTest : public NoriObject {
 public:
 	ChiSquareTest(const PropertyList &propList) {
@@ -47,6 +221,23 @@ public:
 
 		/* Number of samples that should be taken (-1: automatic) */
 		m_sampleCount = propList.getInteger("sampleCount", -1);
+
+		/* Directory in which the integrals of the density over the cells
+		   are cached (keyed by the tested object's description, the incident
+		   direction, and the resolution), or empty to always integrate.
+		   Changes of a density that don't show up in the description of
+		   the object require clearing the cache! */
+		m_cacheDirectory = propList.getString("cacheDirectory", "");
+
+		/* Sequential testing: the samples are drawn in this many rounds,
+		   and the test stops after a round once its outcome is clear. The
+		   null hypothesis is accepted early when the p-value exceeds
+		   'acceptLevel' (1 = never). A single round takes all samples. */
+		m_rounds = propList.getInteger("rounds", 8);
+		m_acceptLevel = propList.getFloat("acceptLevel", 0.5f);
+		if (m_rounds < 1 || m_acceptLevel <= 0 || m_acceptLevel > 1)
+			throw NoriException(QString("Invalid sequential test parameters (rounds=%1 "
+				"must be >= 1, acceptLevel=%2 must be in (0, 1])").arg(m_rounds).arg(m_acceptLevel));
 		
 		/* Each provided BSDF will be tested for a few different
 		   incident directions. The value specified here determines
@@ -56,6 +247,7 @@ public:
 		m_phiResolution = 2 * m_thetaResolution;
 		m_frequencies = new float[m_thetaResolution * m_phiResolution];
 		m_expFrequencies = new float[m_thetaResolution * m_phiResolution];
+		m_cellIntegrals = new float[m_thetaResolution * m_phiResolution];
 
 		if (m_sampleCount < 0) // ~5K samples per bin
 			m_sampleCount = m_thetaResolution * m_phiResolution * 5000;
@@ -64,6 +256,7 @@ public:
 	virtual ~ChiSquareTest() {
 		delete[] m_frequencies;
 		delete[] m_expFrequencies;
+		delete[] m_cellIntegrals;
 
 		for (size_t i=0; i<m_bsdfs.size(); ++i)
 			delete m_bsdfs[i];
@@ -91,13 +284,11 @@ public:
 
 	/// Execute the chi-square test
 	void activate() {
-		/* Initialize the cubature code */
-		NDIntegrator integrator(1, 2, 100000, 0, 1e-6f);
-
 		/* Create a pseudorandom number generator */
 		Random *random = new Random();
 
 		int passed = 0, total = 0;
+		int64_t samplesUsed = 0;
 
 		/* Test each registered BSDF */
 		for (size_t k=0; k<m_bsdfs.size(); ++k) {
@@ -112,63 +303,11 @@ public:
 				/* Randomly pick an incident direction on the hemisphere */
 				Vector3f wi = squareToCosineHemisphere(
 					Point2f(random->nextFloat(), random->nextFloat()));
-	
-				cout << "Accumulating " << m_sampleCount << " samples into a " << m_thetaResolution 
-					 << "x" << m_phiResolution << " contingency table .." << endl;
-
-				float factorTheta = m_thetaResolution / M_PI,
-					  factorPhi   = m_phiResolution / (2 * M_PI);
-	
-				memset(m_frequencies, 0, m_thetaResolution*m_phiResolution*sizeof(float));
-
-				/* Generate many samples from the BSDF and create 
-				   a histogram / contingency table */
-				BSDFQueryRecord bRec(wi);
-				for (int i=0; i<m_sampleCount; ++i) {
-					Point2f sample(random->nextFloat(), random->nextFloat());
-					Color3f result = bsdf->sample(bRec, sample);
 
-					if ((result.array() == 0).all())
-						continue;
-	
-					Point2f coords = sphericalCoordinates(bRec.wo);
-	
-					int thetaBin = std::min(std::max(0,
-						(int) std::floor(coords.x() * factorTheta)), m_thetaResolution-1);
-					int phiBin = std::min(std::max(0,
-						(int) std::floor(coords.y() * factorPhi)), m_phiResolution-1);
-					m_frequencies[thetaBin * m_phiResolution + phiBin] += 1;
-				}
-	
-				factorTheta = M_PI / m_thetaResolution;
-				factorPhi   = 2 * M_PI / m_phiResolution;
-	
-				/* Numerically integrate the probability density
-				   function over rectangles in spherical coordinates.
-				   This is done using the 'cubature' library. */
-				float *ptr = m_expFrequencies;
-				cout << "Integrating expected frequencies .." << endl;
-				for (int i=0; i<m_thetaResolution; ++i) {
-					double min[2], max[2];
-					min[0] = i * factorTheta;
-					max[0] = (i+1) * factorTheta;
-					for (int j=0; j<m_phiResolution; ++j) {
-						min[1] = j * factorPhi;
-						max[1] = (j+1) * factorPhi;
-						double result, error;
-
-						integrator.integrateVectorized(
-							boost::bind(&ChiSquareTest::bsdfIntegrand, bsdf, wi, _1, _2, _3),
-							min, max, &result, &error
-						);
-	
-						*ptr++ = result * m_sampleCount;
-					}
-				}
-	
+				bool accepted = runTest(bsdf, NULL, wi, random->nextUInt(), samplesUsed);
 				dump(QString("chi2test_%1.m").arg(total));
 
-				if (runTest())
+				if (accepted)
 					++passed;
 
 				cout << endl;
@@ -188,81 +327,215 @@ public:
 				/* Randomly pick an incident direction on the sphere */
 				Vector3f wi = squareToUniformSphere(
 					Point2f(random->nextFloat(), random->nextFloat()));
-	
-				cout << "Accumulating " << m_sampleCount << " samples into a " << m_thetaResolution 
-					 << "x" << m_phiResolution << " contingency table .." << endl;
-
-				float factorTheta = m_thetaResolution / M_PI,
-					  factorPhi   = m_phiResolution / (2 * M_PI);
-	
-				memset(m_frequencies, 0, m_thetaResolution*m_phiResolution*sizeof(float));
 
-				/* Generate many samples from the PhaseFunction and create 
-				   a histogram / contingency table */
-				PhaseFunctionQueryRecord bRec(wi);
-				for (int i=0; i<m_sampleCount; ++i) {
-					Point2f sample(random->nextFloat(), random->nextFloat());
-					Color3f result = phaseFunction->sample(bRec, sample);
-
-					if ((result.array() == 0).all())
-						continue;
-	
-					Point2f coords = sphericalCoordinates(bRec.wo);
-	
-					int thetaBin = std::min(std::max(0,
-						(int) std::floor(coords.x() * factorTheta)), m_thetaResolution-1);
-					int phiBin = std::min(std::max(0,
-						(int) std::floor(coords.y() * factorPhi)), m_phiResolution-1);
-					m_frequencies[thetaBin * m_phiResolution + phiBin] += 1;
-				}
-	
-				factorTheta = M_PI / m_thetaResolution;
-				factorPhi   = 2 * M_PI / m_phiResolution;
-	
-				/* Numerically integrate the probability density
-				   function over rectangles in spherical coordinates.
-				   This is done using the 'cubature' library. */
-				float *ptr = m_expFrequencies;
-				cout << "Integrating expected frequencies .." << endl;
-				for (int i=0; i<m_thetaResolution; ++i) {
-					double min[2], max[2];
-					min[0] = i * factorTheta;
-					max[0] = (i+1) * factorTheta;
-					for (int j=0; j<m_phiResolution; ++j) {
-						min[1] = j * factorPhi;
-						max[1] = (j+1) * factorPhi;
-						double result, error;
-
-						integrator.integrateVectorized(
-							boost::bind(&ChiSquareTest::phaseFunctionIntegrand, phaseFunction, wi, _1, _2, _3),
-							min, max, &result, &error
-						);
-	
-						*ptr++ = result * m_sampleCount;
-					}
-				}
-	
+				bool accepted = runTest(NULL, phaseFunction, wi, random->nextUInt(), samplesUsed);
 				dump(QString("chi2test_%1.m").arg(total));
 
-				if (runTest())
+				if (accepted)
 					++passed;
 
 				cout << endl;
 			}
 		}
 
-		cout << "Passed " << passed << "/" << total << " tests." << endl;
+		cout << "Passed " << passed << "/" << total << " tests (used " << samplesUsed
+			 << " of " << (int64_t) m_sampleCount * total << " samples)." << endl;
 
 		delete random;
 	}
 
+	/**
+	 * \brief Test a BSDF or phase function for one incident direction
+	 *
+	 * The samples are drawn in up to \c m_rounds rounds by one
+	 * \ref ChiSquareWorker per core, each of which uses its own random
+	 * number stream (derived from \c seed) and histogram. After each
+	 * round, the histograms are merged into the contingency table and
+	 * tested against the expected frequencies of the samples so far.
+	 *
+	 * \param samplesUsed
+	 *     Incremented by the number of samples that were drawn
+	 * \return Whether the null hypothesis was accepted
+	 */
+	bool runTest(const BSDF *bsdf, const PhaseFunction *phaseFunction,
+			const Vector3f &wi, uint32_t seed, int64_t &samplesUsed) {
+		int cellCount = m_thetaResolution * m_phiResolution;
+		int threadCount = std::max(1, std::min(getCoreCount(), m_sampleCount / m_rounds));
+
+		cout << "Accumulating up to " << m_sampleCount << " samples into a " << m_thetaResolution 
+			 << "x" << m_phiResolution << " contingency table in " << m_rounds << " rounds and "
+			 << "integrating expected frequencies (" << threadCount << " threads) .." << endl;
+
+		/* With cached integrals, the workers find no cells left to integrate */
+		uint64_t key = computeCacheKey(bsdf, phaseFunction, wi);
+		bool cached = loadCache(key);
+		QAtomicInt nextCell(cached ? cellCount : 0);
+		std::vector<ChiSquareWorker *> workers(threadCount);
+		for (int i=0; i<threadCount; ++i)
+			workers[i] = new ChiSquareWorker(bsdf, phaseFunction, wi,
+				m_thetaResolution, m_phiResolution, seed, (uint32_t) i,
+				nextCell, m_cellIntegrals);
+
+		/* Apply the Sidak correction term, since we'll be conducting multiple independent 
+		   hypothesis tests. This accounts for the fact that the probability of a failure
+		   increases quickly when several hypothesis tests are run in sequence. */
+		float alpha = 1.0f - std::pow(1.0f - m_significanceLevel, 1.0f / (m_testCount * 
+			(m_bsdfs.size() + m_phaseFunctions.size())));
+
+		int done = 0, decision = 0;
+		for (int round=1; decision == 0; ++round) {
+			int target = (int) ((int64_t) m_sampleCount * round / m_rounds),
+			    count = target - done;
+			for (int i=0; i<threadCount; ++i) {
+				workers[i]->setSampleCount((int) ((int64_t) count * (i + 1) / threadCount
+				     - (int64_t) count * i / threadCount));
+				workers[i]->start();
+			}
+
+			memset(m_frequencies, 0, cellCount*sizeof(float));
+			for (int i=0; i<threadCount; ++i) {
+				workers[i]->wait();
+				const std::vector<uint32_t> &histogram = workers[i]->getHistogram();
+				for (int j=0; j<cellCount; ++j)
+					m_frequencies[j] += (float) histogram[j];
+			}
+			if (!cached) {
+				saveCache(key);
+				cached = true;
+			}
+			for (int j=0; j<cellCount; ++j)
+				m_expFrequencies[j] = m_cellIntegrals[j] * target;
+
+			decision = decide(computePValue(target), alpha, done, target);
+			done = target;
+		}
+
+		for (int i=0; i<threadCount; ++i)
+			delete workers[i];
+		samplesUsed += done;
+		return decision > 0;
+	}
+
+	/// Return the key of the integrals of an object for an incident direction
+	uint64_t computeCacheKey(const BSDF *bsdf, const PhaseFunction *phaseFunction,
+			const Vector3f &wi) const {
+		QByteArray description = bsdf ? bsdf->toString().toUtf8()
+			: phaseFunction->toString().toUtf8();
+		uint32_t values[6] = { bsdf ? 0u : 1u, (uint32_t) m_thetaResolution,
+			(uint32_t) m_phiResolution, 0, 0, 0 };
+		memcpy(&values[3], wi.data(), sizeof(float) * 3);
+		uint64_t hash = hashBytes(0xcbf29ce484222325ULL, values, sizeof(values));
+		return hashBytes(hash, description.constData(), (size_t) description.size());
+	}
+
+	/// Return the cache file of a key
+	QString getCacheFilename(uint64_t key) const {
+		return QDir(m_cacheDirectory).filePath(
+			QString("chi2_%1.dat").arg((qulonglong) key, 16, 16, QChar('0')));
+	}
+
+	/// Read the cell integrals of a key from the cache, if they exist
+	bool loadCache(uint64_t key) {
+		if (m_cacheDirectory.isEmpty())
+			return false;
+		QFile file(getCacheFilename(key));
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+
+		ChiSquareCacheHeader header;
+		qint64 size = (qint64) (sizeof(float) * m_thetaResolution * m_phiResolution);
+		if (file.read((char *) &header, sizeof(ChiSquareCacheHeader)) != sizeof(ChiSquareCacheHeader)
+			|| memcmp(header.magic, "NCC", 3) != 0 || header.version != NORI_CHI2_CACHE_VERSION
+			|| header.key != key || header.thetaResolution != (uint32_t) m_thetaResolution
+			|| header.phiResolution != (uint32_t) m_phiResolution
+			|| file.read((char *) m_cellIntegrals, size) != size) {
+			cerr << "Warning: ignoring the invalid cache file \""
+				 << qPrintable(file.fileName()) << "\"" << endl;
+			return false;
+		}
+		cout << "Loaded the expected frequencies from \"" << qPrintable(file.fileName())
+			 << "\"" << endl;
+		return true;
+	}
+
+	/// Write the cell integrals of a key to the cache (failures only cause a warning)
+	void saveCache(uint64_t key) const {
+		if (m_cacheDirectory.isEmpty())
+			return;
+		ChiSquareCacheHeader header;
+		memset(&header, 0, sizeof(ChiSquareCacheHeader));
+		memcpy(header.magic, "NCC", 3);
+		header.version = NORI_CHI2_CACHE_VERSION;
+		header.thetaResolution = (uint32_t) m_thetaResolution;
+		header.phiResolution = (uint32_t) m_phiResolution;
+		header.key = key;
+
+		QDir().mkpath(m_cacheDirectory);
+		QFile file(getCacheFilename(key));
+		qint64 size = (qint64) (sizeof(float) * m_thetaResolution * m_phiResolution);
+		bool success = file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+			&& file.write((const char *) &header, sizeof(ChiSquareCacheHeader))
+				== sizeof(ChiSquareCacheHeader)
+			&& file.write((const char *) m_cellIntegrals, size) == size;
+		file.close();
+		if (!success) {
+			file.remove();
+			cerr << "Warning: unable to write the cache file \""
+				 << qPrintable(file.fileName()) << "\"" << endl;
+		}
+	}
+
+	/**
+	 * \brief Decide on the null hypothesis after a round of samples
+	 *
+	 * The significance level is spent over the rounds in proportion to
+	 * the square of the fraction of samples drawn so far, which (like
+	 * O'Brien-Fleming boundaries) keeps most of it for the last round.
+	 * The levels of all rounds sum up to \c alpha, so the probability
+	 * of a false rejection remains below \c alpha.
+	 *
+	 * \param pval
+	 *     p-value of the samples so far (negative if the test failed outright)
+	 * \param previous
+	 *     Number of samples before this round
+	 * \param done
+	 *     Number of samples after this round
+	 * \return 1 (accepted), -1 (rejected) or 0 (undecided, continue)
+	 */
+	int decide(float pval, float alpha, int previous, int done) {
+		if (pval < 0)
+			return -1;
+
+		float before = (float) previous / m_sampleCount, after = (float) done / m_sampleCount;
+		float level = alpha * (after * after - before * before);
+
+		if (pval < level) {
+			cout << "Rejected the null hypothesis (p-value = " << pval << ", "
+				"significance level = " << level << ", " << done << " samples)" << endl;
+			return -1;
+		} else if (done == m_sampleCount || pval > m_acceptLevel) {
+			cout << "Accepted the null hypothesis (p-value = " << pval << ", "
+				"significance level = " << level << ", " << done << " samples)" << endl;
+			return 1;
+		} else {
+			cout << "Undecided after " << done << " samples (p-value = " << pval << ", "
+				"significance level = " << level << "), continuing .." << endl;
+			return 0;
+		}
+	}
+
 	/// Internally used data structure for sorting cells by exp. frequency
 	struct Cell {
 		float expFrequency;
 		size_t index;
 	};
 
-	bool runTest() {
+	/**
+	 * \brief Compute the p-value of the contingency table for a given
+	 * number of samples, or -1 if the null hypothesis must be rejected
+	 * outright
+	 */
+	float computePValue(int sampleCount) {
 		/* Sort all cells by their expected frequencies */
 		std::vector<Cell> cells(m_thetaResolution*m_phiResolution);
 		for (size_t i=0; i<cells.size(); ++i) {
@@ -283,7 +556,7 @@ public:
 
 			size_t index = it->index;
 			if (m_expFrequencies[index] == 0) {
-				if (m_frequencies[index] > m_sampleCount * 1e-5f) {
+				if (m_frequencies[index] > sampleCount * 1e-5f) {
 					/* Uh oh: samples in a cell that should be completely empty
 					   according to the probability density function. Ordinarily,
 					   even a single sample requires immediate rejection of the null 
@@ -293,7 +566,7 @@ public:
 
 					cout << "Encountered " << m_frequencies[index] << " samples in a cell "
 						 << "with expected frequency 0. Rejecting the null hypothesis!" << endl;
-					return false;
+					return -1;
 				}
 			} else if (m_expFrequencies[index] < m_minExpFrequency) {
 				/* Pool cells with low expected frequencies */
@@ -327,7 +600,7 @@ public:
 
 		if (dof <= 0) {
 			cout << "The number of degrees of freedom (" << dof << ") is too low!" << endl;
-			return false;
+			return -1;
 		}
 
 		cout << "Chi-square statistic = " << chsq << " (d.o.f. = " << dof << ")" << endl;
@@ -342,24 +615,10 @@ public:
 			pval = 1 - (float) boost::math::cdf(chSqDist, chsq);
 		} catch (const std::exception &ex) {
 			cout << "Encountered an internal error during the p-value computation: " << ex.what() << endl;
-			return false;
+			return -1;
 		}
 
-		/* Apply the Sidak correction term, since we'll be conducting multiple independent 
-		   hypothesis tests. This accounts for the fact that the probability of a failure
-		   increases quickly when several hypothesis tests are run in sequence. */
-		float alpha = 1.0f - std::pow(1.0f - m_significanceLevel, 1.0f / (m_testCount * 
-			(m_bsdfs.size() + m_phaseFunctions.size())));
-
-		if (pval < alpha) {
-			cout << "Rejected the null hypothesis (p-value = " << pval << ", "
-				"significance level = " << alpha << ")" << endl;
-			return false;
-		} else {
-			cout << "Accepted the null hypothesis (p-value = " << pval << ", "
-				"significance level = " << alpha << ")" << endl;
-			return true;
-		}
+		return pval;
 	}
 
 	/**
@@ -412,43 +671,23 @@ public:
 			"  minExpFrequency = %3,\n"
 			"  sampleCount = %4,\n"
 			"  testCount = %5,\n"
-			"  significanceLevel = %6\n"
+			"  significanceLevel = %6,\n"
+			"  rounds = %7,\n"
+			"  acceptLevel = %8,\n"
+			"  cacheDirectory = \"%9\"\n"
 			"]")
 			.arg(m_thetaResolution)
 			.arg(m_phiResolution)
 			.arg(m_minExpFrequency)
 			.arg(m_sampleCount)
 			.arg(m_testCount)
-			.arg(m_significanceLevel);
+			.arg(m_significanceLevel)
+			.arg(m_rounds)
+			.arg(m_acceptLevel)
+			.arg(m_cacheDirectory);
 	}
 
 	EClassType getClassType() const { return ETest; }
-private:
-	/// Functor to evaluate the pdf values in parallel using OpenMP
-	static void bsdfIntegrand(const BSDF *bsdf,
-		const Vector3f &wi, size_t nPts, const double *in, double *out) {
-		// Disabling for now, this is actually slower in some cases!
-		// #pragma omp parallel for
-		for (int i=0; i<(int) nPts; ++i) {
-			/* The quadrature code runs in double precision, so some extra
-			   conversions are required */
-			Vector3f wo = sphericalDirection((float) in[2*i], (float) in[2*i+1]);
-			BSDFQueryRecord bRec(wi, wo, ESolidAngle);
-			out[i] = (double) (bsdf->pdf(bRec) * std::sin((float) in[2*i]));
-		}
-	}
-
-	static void phaseFunctionIntegrand(const PhaseFunction *phase,
-		const Vector3f &wi, size_t nPts, const double *in, double *out) {
-		// Disabling for now, this is actually slower in some cases!
-		for (int i=0; i<(int) nPts; ++i) {
-			/* The quadrature code runs in double precision, so some extra
-			   conversions are required */
-			Vector3f wo = sphericalDirection((float) in[2*i], (float) in[2*i+1]);
-			PhaseFunctionQueryRecord bRec(wi, wo);
-			out[i] = (double) (phase->pdf(bRec) * std::sin((float) in[2*i]));
-		}
-	}
 private:
 	int m_thetaResolution, m_phiResolution;
 	int m_minExpFrequency;
@@ -456,7 +695,12 @@ private:
 	int m_testCount;
 	float *m_frequencies;
 	float *m_expFrequencies;
+	/// Integrals of the density over the cells
+	float *m_cellIntegrals;
 	float m_significanceLevel;
+	int m_rounds;
+	float m_acceptLevel;
+	QString m_cacheDirectory;
 	std::vector<BSDF *> m_bsdfs;
 	std::vector<PhaseFunction *> m_phaseFunctions;
 };
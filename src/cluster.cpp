@@ -0,0 +1,764 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/cluster.h>
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/integrator.h>
+#include <nori/render.h>
+#include <QCryptographicHash>
+#include <QFile>
+#include <deque>
+
+#if defined(PLATFORM_WINDOWS)
+#include <winsock2.h>
+typedef int socklen_t;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#define closesocket close
+#endif
+
+/* Don't raise SIGPIPE when the other side has gone away */
+#if defined(MSG_NOSIGNAL)
+#define NORI_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define NORI_SEND_FLAGS 0
+#endif
+
+/// How often the master and the workers check for messages and shutdown (ms)
+#define NORI_CLUSTER_POLL_INTERVAL 50
+
+/// Time after which a worker tries to reach the master again (ms)
+#define NORI_CLUSTER_RETRY_INTERVAL 2000
+
+/// Time a new connection has to introduce itself (ms)
+#define NORI_CLUSTER_HELLO_TIMEOUT 5000
+
+/// Version of the protocol between master and workers (increase when changing it)
+#define NORI_CLUSTER_VERSION 2
+
+/// Identifies Nori workers (and machines with the same byte order)
+#define NORI_CLUSTER_MAGIC 0x49524f4e
+
+/// Largest accepted message (in bytes)
+#define NORI_CLUSTER_MAX_MESSAGE (1 << 30)
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Messages between master and workers
+ *
+ * Each one starts with a \ref MessageHeader that is followed by
+ * \c length bytes of payload.
+ */
+enum EClusterMessage {
+	/// Worker: magic number, protocol version and thread count (3 x uint32)
+	EHello = 1,
+	/**
+	 * Master: format of the results (see \ref ImageBlock::serialize()) and
+	 * length of the scene file name (2 x int32), name, contents of the file
+	 */
+	EScene,
+	/// Master: render a unit -- identifier, offset and size (5 x int32)
+	EUnit,
+	/// Master: drop a unit that another worker has rendered -- identifier (int32)
+	ECancel,
+	/// Master: the rendering is done (no payload)
+	EDone,
+	/// Worker: identifier of the unit (int32) and the serialized \ref ImageBlock
+	EResult,
+	/// Worker: the scene couldn't be loaded -- error message (UTF-8)
+	EError
+};
+
+/// Header of a message between master and workers
+struct MessageHeader {
+	uint32_t type;
+	uint32_t length;
+};
+
+/// Gives access to the (protected) sleep function of QThread
+class ClusterSleep : public QThread {
+public:
+	static void msleep(unsigned long msecs) { QThread::msleep(msecs); }
+};
+
+/// Send a message, returning \c false when the connection is broken
+static bool sendMessage(intptr_t socket, uint32_t type, const QByteArray &payload = QByteArray()) {
+	MessageHeader header;
+	header.type = type;
+	header.length = (uint32_t) payload.size();
+	QByteArray message((const char *) &header, sizeof(MessageHeader));
+	message.append(payload);
+
+	const char *data = message.constData();
+	int remaining = message.size();
+	while (remaining > 0) {
+		int n = (int) send((int) socket, data, remaining, NORI_SEND_FLAGS);
+		if (n <= 0)
+			return false;
+		data += n;
+		remaining -= n;
+	}
+	return true;
+}
+
+/// Receive exactly \c size bytes, returning \c false when the connection is broken
+static bool receiveAll(intptr_t socket, char *data, int size) {
+	while (size > 0) {
+		int n = (int) recv((int) socket, data, size, 0);
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/// Receive a message, returning \c false when the connection is broken
+static bool receiveMessage(intptr_t socket, uint32_t &type, QByteArray &payload) {
+	MessageHeader header;
+	if (!receiveAll(socket, (char *) &header, sizeof(MessageHeader))
+			|| header.length > NORI_CLUSTER_MAX_MESSAGE)
+		return false;
+	type = header.type;
+	payload.resize((int) header.length);
+	return receiveAll(socket, payload.data(), payload.size());
+}
+
+/**
+ * \brief Wait until data arrives on a socket
+ *
+ * \return A positive value when there is data (or the connection was
+ * closed), zero after \c msecs milliseconds without data, and a
+ * negative value upon failure
+ */
+static int waitReadable(intptr_t socket, int msecs) {
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET((int) socket, &fds);
+	struct timeval timeout;
+	timeout.tv_sec = msecs / 1000;
+	timeout.tv_usec = (msecs % 1000) * 1000;
+	return select((int) socket + 1, &fds, NULL, NULL, &timeout);
+}
+
+/// Append 32-bit integers to a message payload
+static void appendInts(QByteArray &payload, const int32_t *values, int count) {
+	payload.append((const char *) values, (int) (count * sizeof(int32_t)));
+}
+
+/// Read 32-bit integers from a message payload (\c false if it's too short)
+static bool readInts(const QByteArray &payload, int32_t *values, int count) {
+	if (payload.size() < (int) (count * sizeof(int32_t)))
+		return false;
+	memcpy(values, payload.constData(), count * sizeof(int32_t));
+	return true;
+}
+
+/**
+ * \brief Talks to one worker on behalf of a \ref ClusterMaster: sends
+ * the scene, keeps the worker's queue of units full, and collects
+ * the results
+ */
+class ClusterConnection : public QThread {
+public:
+	ClusterConnection(ClusterMaster *master, intptr_t socket, int id, const QString &peer)
+		: m_master(master), m_socket(socket), m_id(id), m_peer(peer), m_introduced(false), m_finished(0) {
+		start();
+	}
+
+	~ClusterConnection() {
+		wait();
+		closesocket((int) m_socket);
+	}
+
+	void run() {
+		try {
+			serve();
+		} catch (const NoriException &ex) {
+			cerr << "Worker " << m_id << " (" << qPrintable(m_peer) << "): "
+				 << qPrintable(ex.getReason()) << endl;
+		}
+
+		/* Hand the units that weren't rendered to other workers */
+		for (size_t i=0; i<m_units.size(); ++i)
+			m_master->release(m_id, m_units[i]);
+		m_units.clear();
+
+		if (m_introduced)
+			cout << "Worker " << m_id << " (" << qPrintable(m_peer) << ") disconnected after "
+				 << m_finished << " units" << endl;
+	}
+protected:
+	/// Serve the worker until it disconnects or the rendering is done
+	void serve() {
+		uint32_t type;
+		QByteArray payload;
+		int32_t hello[3];
+		if (waitReadable(m_socket, NORI_CLUSTER_HELLO_TIMEOUT) <= 0
+				|| !receiveMessage(m_socket, type, payload) || type != EHello
+				|| !readInts(payload, hello, 3) || (uint32_t) hello[0] != NORI_CLUSTER_MAGIC
+				|| hello[1] != NORI_CLUSTER_VERSION) {
+			cerr << "Rejected a connection from " << qPrintable(m_peer)
+				 << " (not a compatible Nori worker)" << endl;
+			return;
+		}
+		m_introduced = true;
+		cout << "Worker " << m_id << " (" << qPrintable(m_peer) << ", "
+			 << hello[2] << " threads) connected" << endl;
+
+		payload.clear();
+		int32_t values[2] = { m_master->m_blockFormat, m_master->m_sceneName.size() };
+		appendInts(payload, values, 2);
+		payload.append(m_master->m_sceneName);
+		payload.append(m_master->m_sceneContents);
+		if (!sendMessage(m_socket, EScene, payload))
+			return;
+
+		while (true) {
+			if (m_master->isDone()) {
+				sendMessage(m_socket, EDone);
+				return;
+			}
+
+			/* Drop the units that another worker has rendered */
+			for (size_t i=0; i<m_units.size(); ) {
+				if (m_master->isObsolete(m_units[i])) {
+					int32_t id = m_units[i];
+					m_master->release(m_id, id);
+					m_units.erase(m_units.begin() + i);
+					payload.clear();
+					appendInts(payload, &id, 1);
+					if (!sendMessage(m_socket, ECancel, payload))
+						return;
+				} else {
+					++i;
+				}
+			}
+
+			/* Keep the queue of the worker full */
+			while (m_units.size() < NORI_CLUSTER_UNITS_IN_FLIGHT) {
+				int unit = m_master->assign(m_id);
+				if (unit < 0)
+					break;
+				m_units.push_back(unit);
+				const ClusterMaster::Unit &u = m_master->m_units[unit];
+				int32_t values[5] = { unit, u.offset.x(), u.offset.y(), u.size.x(), u.size.y() };
+				payload.clear();
+				appendInts(payload, values, 5);
+				if (!sendMessage(m_socket, EUnit, payload))
+					return;
+			}
+
+			int ready = waitReadable(m_socket, NORI_CLUSTER_POLL_INTERVAL);
+			if (ready < 0 || (ready > 0 && !receiveMessage(m_socket, type, payload)))
+				return;
+			if (ready == 0)
+				continue;
+
+			if (type == EResult) {
+				int32_t id;
+				if (!readInts(payload, &id, 1))
+					throw NoriException("Received a malformed result");
+				std::vector<int>::iterator it = std::find(m_units.begin(), m_units.end(), id);
+				if (it == m_units.end())
+					continue; /* Cancelled while the result was on its way */
+				m_units.erase(it);
+				m_master->finish(m_id, id, payload.mid(sizeof(int32_t)));
+				++m_finished;
+			} else if (type == EError) {
+				throw NoriException(QString("Unable to render the scene: %1")
+					.arg(QString::fromUtf8(payload.constData(), payload.size())));
+			} else {
+				throw NoriException(QString("Received an unexpected message (type %1)").arg(type));
+			}
+		}
+	}
+private:
+	ClusterMaster *m_master;
+	intptr_t m_socket;
+	int m_id;
+	QString m_peer;
+	bool m_introduced;
+	/// Units that were sent to the worker and haven't come back yet
+	std::vector<int> m_units;
+	int m_finished;
+};
+
+ClusterMaster::ClusterMaster(int port, const QString &sceneFile, const Scene *scene,
+		const Point2i &offset, const Vector2i &size_, int unitSize, int blockFormat)
+		: m_blockFormat(blockFormat), m_scene(scene), m_output(NULL), m_finishedUnits(0),
+		m_assignmentCount(0), m_cancelled(false), m_socket(-1), m_nextWorker(0),
+		m_shutdown(false) {
+	if (port <= 0 || port > 65535)
+		throw NoriException(QString("Invalid cluster port %1").arg(port));
+	if (unitSize <= 0)
+		throw NoriException(QString("Invalid work unit size %1").arg(unitSize));
+	if (scene->getIntegrator()->usesSplatting() || scene->getIntegrator()->usesPasses())
+		throw NoriException("Cluster renderings don't support integrators that splat "
+			"light paths or render in passes!");
+
+	/* The workers receive the scene file as it is on disk */
+	QFile file(sceneFile);
+	if (!file.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Unable to open the file \"%1\"").arg(sceneFile));
+	m_sceneContents = file.readAll();
+	file.close();
+	m_sceneName = sceneFile.toUtf8();
+
+	const Camera *camera = scene->getCamera();
+	Vector2i outputSize = camera->getOutputSize();
+	Vector2i size = size_;
+	if (size == Vector2i(0, 0))
+		size = outputSize - offset;
+	if ((offset.array() < 0).any() || (size.array() <= 0).any()
+			|| ((offset + size).array() > outputSize.array()).any())
+		throw NoriException("The region to be rendered lies outside of the image!");
+
+	m_output = new ImageBlock(size, camera->getReconstructionFilter());
+	m_output->setOffset(offset);
+	m_output->setAOVs(scene->getAOVs() != 0 || scene->getDenoise());
+	m_output->clear();
+
+	for (int y=0; y<size.y(); y += unitSize) {
+		for (int x=0; x<size.x(); x += unitSize) {
+			Unit unit;
+			unit.offset = offset + Point2i(x, y);
+			unit.size = Vector2i(std::min(unitSize, size.x() - x),
+				std::min(unitSize, size.y() - y));
+			unit.assigned = 0;
+			unit.finished = false;
+			m_units.push_back(unit);
+		}
+	}
+
+#if defined(PLATFORM_WINDOWS)
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+		delete m_output;
+		throw NoriException("Unable to initialize Winsock");
+	}
+#endif
+	int fd = (int) socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(int));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short) port);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			|| listen(fd, 16) != 0) {
+		if (fd >= 0)
+			closesocket(fd);
+#if defined(PLATFORM_WINDOWS)
+		WSACleanup();
+#endif
+		delete m_output;
+		throw NoriException(QString("Unable to listen on the cluster port %1").arg(port));
+	}
+	m_socket = fd;
+
+	start();
+}
+
+ClusterMaster::~ClusterMaster() {
+	/* Stop accepting workers, and let the connected ones know that we're done */
+	m_shutdown = true;
+	wait();
+	cancel();
+	for (size_t i=0; i<m_connections.size(); ++i)
+		delete m_connections[i];
+	closesocket((int) m_socket);
+#if defined(PLATFORM_WINDOWS)
+	WSACleanup();
+#endif
+	delete m_output;
+}
+
+void ClusterMaster::run() {
+	while (!m_shutdown) {
+		if (waitReadable(m_socket, NORI_CLUSTER_POLL_INTERVAL) <= 0)
+			continue;
+		struct sockaddr_in addr;
+		socklen_t addrLength = sizeof(addr);
+		int connection = (int) accept((int) m_socket, (struct sockaddr *) &addr, &addrLength);
+		if (connection < 0)
+			continue;
+
+		/* Notice machines that vanish without closing the connection */
+		int keepAlive = 1;
+		setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE, (const char *) &keepAlive, sizeof(int));
+
+		QString peer = QString("%1:%2").arg(inet_ntoa(addr.sin_addr)).arg(ntohs(addr.sin_port));
+		QMutexLocker locker(&m_mutex);
+		reapConnections();
+		m_connections.push_back(new ClusterConnection(this, connection, m_nextWorker++, peer));
+	}
+}
+
+void ClusterMaster::reapConnections() {
+	for (size_t i=0; i<m_connections.size(); ) {
+		if (m_connections[i]->isFinished()) {
+			delete m_connections[i];
+			m_connections.erase(m_connections.begin() + i);
+		} else {
+			++i;
+		}
+	}
+}
+
+int ClusterMaster::assign(int worker) {
+	QMutexLocker locker(&m_mutex);
+	if (m_cancelled)
+		return -1;
+
+	/* Prefer units that nobody is rendering. Otherwise steal the one that
+	   the fewest workers have, and among those the one handed out last,
+	   which its worker most likely hasn't started yet */
+	int best = -1;
+	for (size_t i=0; i<m_units.size(); ++i) {
+		const Unit &unit = m_units[i];
+		if (unit.finished || std::find(unit.workers.begin(), unit.workers.end(),
+				worker) != unit.workers.end())
+			continue;
+		if (best < 0 || unit.workers.size() < m_units[best].workers.size()
+				|| (unit.workers.size() == m_units[best].workers.size()
+				&& unit.assigned > m_units[best].assigned))
+			best = (int) i;
+		if (unit.workers.empty())
+			break;
+	}
+
+	if (best >= 0) {
+		m_units[best].workers.push_back(worker);
+		m_units[best].assigned = ++m_assignmentCount;
+	}
+	return best;
+}
+
+void ClusterMaster::release(int worker, int unit) {
+	QMutexLocker locker(&m_mutex);
+	std::vector<int> &workers = m_units[unit].workers;
+	std::vector<int>::iterator it = std::find(workers.begin(), workers.end(), worker);
+	if (it != workers.end())
+		workers.erase(it);
+}
+
+void ClusterMaster::finish(int worker, int unit, const QByteArray &serialized) {
+	if (unit < 0 || unit >= (int) m_units.size())
+		throw NoriException(QString("Received the result of an unknown unit %1").arg(unit));
+
+	/* Unpack the block before taking the lock */
+	const Unit &u = m_units[unit];
+	ImageBlock block(u.size, m_scene->getCamera()->getReconstructionFilter());
+	block.setAOVs(m_output->hasAOVs());
+	block.deserialize(serialized);
+	if (block.getOffset() != u.offset || block.getSize() != u.size)
+		throw NoriException(QString("The result of unit %1 covers the wrong region").arg(unit));
+
+	QMutexLocker locker(&m_mutex);
+	std::vector<int> &workers = m_units[unit].workers;
+	std::vector<int>::iterator it = std::find(workers.begin(), workers.end(), worker);
+	if (it != workers.end())
+		workers.erase(it);
+	if (m_units[unit].finished || m_cancelled)
+		return;
+
+	/* Merging while holding the lock guarantees that the output is
+	   complete once the rendering counts as done */
+	m_output->put(block);
+	m_units[unit].finished = true;
+	if (++m_finishedUnits == (int) m_units.size())
+		m_doneCond.wakeAll();
+}
+
+bool ClusterMaster::isObsolete(int unit) const {
+	QMutexLocker locker(&m_mutex);
+	return m_units[unit].finished || m_cancelled;
+}
+
+bool ClusterMaster::isDone() const {
+	QMutexLocker locker(&m_mutex);
+	return m_cancelled || m_finishedUnits == (int) m_units.size();
+}
+
+void ClusterMaster::cancel() {
+	QMutexLocker locker(&m_mutex);
+	m_cancelled = true;
+	m_doneCond.wakeAll();
+}
+
+bool ClusterMaster::isCancelled() const {
+	QMutexLocker locker(&m_mutex);
+	return m_cancelled;
+}
+
+bool ClusterMaster::waitDone(unsigned long msecs) {
+	QMutexLocker locker(&m_mutex);
+	if (!m_cancelled && m_finishedUnits < (int) m_units.size())
+		m_doneCond.wait(&m_mutex, msecs);
+	return m_cancelled || m_finishedUnits == (int) m_units.size();
+}
+
+ClusterMaster::Progress ClusterMaster::getProgress() const {
+	QMutexLocker locker(&m_mutex);
+	Progress progress;
+	progress.unitCount = (int) m_units.size();
+	progress.finishedUnits = m_finishedUnits;
+	progress.workerCount = 0;
+	for (size_t i=0; i<m_connections.size(); ++i) {
+		if (!m_connections[i]->isFinished())
+			++progress.workerCount;
+	}
+	return progress;
+}
+
+/// A unit that a worker renders for the master
+struct WorkerUnit {
+	int32_t id;
+	RenderJob *job;
+	bool cancelled;
+};
+
+/// The units of a worker (cancelled and deleted when out of scope)
+struct WorkerUnits : public std::deque<WorkerUnit> {
+	~WorkerUnits() {
+		for (iterator it = begin(); it != end(); ++it) {
+			it->job->cancel();
+			it->job->wait();
+			delete it->job;
+		}
+	}
+};
+
+ClusterWorker::ClusterWorker(const QString &host, int port, int loadFlags)
+		: m_host(host), m_port(port), m_loadFlags(loadFlags), m_scene(NULL) {
+	if (port <= 0 || port > 65535)
+		throw NoriException(QString("Invalid cluster port %1").arg(port));
+}
+
+ClusterWorker::~ClusterWorker() {
+	delete m_scene;
+}
+
+void ClusterWorker::run(const volatile sig_atomic_t *stop) {
+#if defined(PLATFORM_WINDOWS)
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		throw NoriException("Unable to initialize Winsock");
+#endif
+
+	bool waiting = false;
+	while (!*stop) {
+		/* Look up the master every time, in case it moved */
+		int fd = -1;
+		struct hostent *entry = gethostbyname(m_host.toLocal8Bit().constData());
+		if (entry && entry->h_addrtype == AF_INET) {
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			memcpy(&addr.sin_addr, entry->h_addr_list[0], sizeof(addr.sin_addr));
+			addr.sin_port = htons((unsigned short) m_port);
+			fd = (int) socket(AF_INET, SOCK_STREAM, 0);
+			if (fd >= 0 && ::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+				closesocket(fd);
+				fd = -1;
+			}
+		}
+
+		if (fd < 0) {
+			if (!waiting)
+				cout << "Waiting for the master at " << qPrintable(m_host) << ":"
+					 << m_port << " .." << endl;
+			waiting = true;
+			for (int i=0; i<NORI_CLUSTER_RETRY_INTERVAL && !*stop; i += NORI_CLUSTER_POLL_INTERVAL)
+				ClusterSleep::msleep(NORI_CLUSTER_POLL_INTERVAL);
+			continue;
+		}
+
+		int keepAlive = 1;
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *) &keepAlive, sizeof(int));
+		waiting = false;
+		try {
+			serve(fd, stop);
+		} catch (const NoriException &ex) {
+			cerr << "Error while rendering for the master: " << qPrintable(ex.getReason()) << endl;
+		}
+		closesocket(fd);
+
+		/* Give a master that has just finished the time to close its port */
+		for (int i=0; i<NORI_CLUSTER_RETRY_INTERVAL && !*stop; i += NORI_CLUSTER_POLL_INTERVAL)
+			ClusterSleep::msleep(NORI_CLUSTER_POLL_INTERVAL);
+	}
+
+#if defined(PLATFORM_WINDOWS)
+	WSACleanup();
+#endif
+}
+
+void ClusterWorker::serve(intptr_t connection, const volatile sig_atomic_t *stop) {
+	int32_t hello[3] = { (int32_t) NORI_CLUSTER_MAGIC, NORI_CLUSTER_VERSION, getCoreCount() };
+	QByteArray payload;
+	appendInts(payload, hello, 3);
+	if (!sendMessage(connection, EHello, payload))
+		return;
+
+	/* Wait for the scene */
+	uint32_t type;
+	int ready;
+	while ((ready = waitReadable(connection, NORI_CLUSTER_POLL_INTERVAL)) == 0 && !*stop)
+		;
+	if (ready <= 0 || !receiveMessage(connection, type, payload) || type != EScene)
+		return;
+	int32_t values[2];
+	if (!readInts(payload, values, 2) || values[1] < 0
+			|| payload.size() < (int) (2 * sizeof(int32_t)) + values[1])
+		throw NoriException("Received a malformed scene");
+	int blockFormat = values[0];
+	QByteArray name = payload.mid(2 * sizeof(int32_t), values[1]);
+	QByteArray contents = payload.mid(2 * sizeof(int32_t) + values[1]);
+
+	Scene *scene;
+	try {
+		scene = getScene(QString::fromUtf8(name.constData(), name.size()), contents);
+	} catch (const NoriException &ex) {
+		sendMessage(connection, EError, ex.getReason().toUtf8());
+		throw;
+	}
+	cout << "Rendering \"" << name.constData() << "\" for the master .." << endl;
+
+	RenderEngine engine(getCoreCount(), scene->getPinThreads());
+	WorkerUnits units;
+	int rendered = 0;
+	while (!*stop) {
+		/* Send the finished units back, dropping the cancelled ones */
+		for (size_t i=0; i<units.size(); ) {
+			WorkerUnit &unit = units[i];
+			if (!unit.job->isFinished()) {
+				++i;
+				continue;
+			}
+			unit.job->wait();
+			if (!unit.cancelled) {
+				payload.clear();
+				appendInts(payload, &unit.id, 1);
+				payload.append(unit.job->getOutput()->serialize(blockFormat));
+				++rendered;
+			}
+			delete unit.job;
+			bool cancelled = unit.cancelled;
+			units.erase(units.begin() + i);
+			if (!cancelled && !sendMessage(connection, EResult, payload))
+				return;
+		}
+
+		ready = waitReadable(connection, NORI_CLUSTER_POLL_INTERVAL);
+		if (ready < 0 || (ready > 0 && !receiveMessage(connection, type, payload))) {
+			cerr << "Lost the connection to the master" << endl;
+			return;
+		}
+		if (ready == 0)
+			continue;
+
+		if (type == EUnit) {
+			int32_t values[5];
+			if (!readInts(payload, values, 5))
+				throw NoriException("Received a malformed work unit");
+			WorkerUnit unit;
+			unit.id = values[0];
+			unit.cancelled = false;
+			unit.job = new RenderJob(scene, NULL, 0, Point2i(values[1], values[2]),
+				Vector2i(values[3], values[4]));
+			engine.submit(unit.job);
+			units.push_back(unit);
+		} else if (type == ECancel) {
+			int32_t id;
+			if (!readInts(payload, &id, 1))
+				throw NoriException("Received a malformed message");
+			for (size_t i=0; i<units.size(); ++i) {
+				if (units[i].id == id && !units[i].cancelled) {
+					units[i].cancelled = true;
+					units[i].job->cancel();
+				}
+			}
+		} else if (type == EDone) {
+			cout << "The master is done (rendered " << rendered << " units)" << endl;
+			return;
+		} else {
+			throw NoriException(QString("Received an unexpected message (type %1)").arg(type));
+		}
+	}
+}
+
+Scene *ClusterWorker::getScene(const QString &name, const QByteArray &contents) {
+	QByteArray hash = QCryptographicHash::hash(contents, QCryptographicHash::Md5);
+	if (m_scene && m_sceneHash == hash) {
+		cout << "Using the loaded scene \"" << qPrintable(name) << "\"" << endl;
+		return m_scene;
+	}
+	delete m_scene;
+	m_scene = NULL;
+
+	/* Load the file itself when it's on a shared file system. Otherwise,
+	   write the received copy to the working directory, which is where
+	   the files referenced by the scene are looked up */
+	QString filename = name;
+	QFile file(filename);
+	bool shared = file.open(QIODevice::ReadOnly) && file.readAll() == contents;
+	file.close();
+	if (!shared) {
+		filename = QString(".nori-cluster-%1.xml").arg(QString(hash.toHex()));
+		QFile copy(filename);
+		if (!copy.open(QIODevice::WriteOnly | QIODevice::Truncate)
+				|| copy.write(contents) != contents.size())
+			throw NoriException(QString("Unable to write \"%1\"").arg(filename));
+		copy.close();
+	}
+
+	NoriObject *root = NULL;
+	try {
+		root = loadScene(filename, m_loadFlags);
+	} catch (...) {
+		if (!shared)
+			QFile::remove(filename);
+		throw;
+	}
+	if (!shared)
+		QFile::remove(filename);
+
+	if (root->getClassType() != NoriObject::EScene) {
+		delete root;
+		throw NoriException(QString("The file \"%1\" doesn't contain a scene!").arg(name));
+	}
+	m_scene = static_cast<Scene *>(root);
+	m_sceneHash = hash;
+	return m_scene;
+}
+
+NORI_NAMESPACE_END
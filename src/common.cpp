@@ -1,14 +1,28 @@
 #include <nori/object.h>
+#include <nori/fastmath.h>
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <boost/math/special_functions/fpclassify.hpp>
 
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
+
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
 #endif
 
 #if defined(PLATFORM_WINDOWS)
 #include <windows.h>
+#include <psapi.h>
+#endif
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+#include <sys/resource.h>
 #endif
 
 #if defined(PLATFORM_MACOS)
@@ -19,6 +33,9 @@
 #define L1_CACHE_LINE_SIZE 64
 #endif
 
+#define NORI_HUGE_PAGE_SIZE ((size_t) 2 << 20)     /* 2 MiB pages (x86-64) */
+#define NORI_GIGANTIC_PAGE_SIZE ((size_t) 1 << 30) /* 1 GiB pages (x86-64) */
+
 NORI_NAMESPACE_BEGIN
 
 Color3f Color3f::toSRGB() const {
@@ -31,7 +48,7 @@ Color3f Color3f::toSRGB() const {
 			result[i] = 12.92f * value;
 		else
 			result[i] = (1.0f + 0.055f) 
-				* std::pow(value, 1.0f/2.4f) -  0.055f;
+				* fastPow(value, 1.0f/2.4f) -  0.055f;
 	}
 
 	return result;
@@ -46,7 +63,7 @@ Color3f Color3f::toLinearRGB() const {
 		if (value <= 0.04045f)
 			result[i] = value * (1.0f / 12.92f);
 		else
-			result[i] = std::pow((value + 0.055f)
+			result[i] = fastPow((value + 0.055f)
 				* (1.0f / 1.055f), 2.4f);
 	}
 
@@ -69,7 +86,7 @@ float Color3f::getLuminance() const {
 }
 
 Transform::Transform(const Eigen::Matrix4f &trafo) 
-	: m_transform(trafo), m_inverse(trafo.inverse()) { }
+	: m_transform(trafo), m_inverse(trafo.inverse()), m_affine(isAffine(trafo)) { }
 
 QString Transform::toString() const {
 	std::ostringstream oss;
@@ -81,7 +98,7 @@ Vector3f squareToUniformSphere(const Point2f &sample) {
 	float z = 1.0f - 2.0f * sample.y();
 	float r = std::sqrt(std::max((float) 0.0f, 1.0f - z*z));
 	float sinPhi, cosPhi;
-	sincosf(2.0f * M_PI * sample.x(), &sinPhi, &cosPhi);
+	fastSinCos(2.0f * M_PI * sample.x(), &sinPhi, &cosPhi);
 	return Vector3f(r * cosPhi, r * sinPhi, z);
 }
 
@@ -90,7 +107,7 @@ Vector3f squareToUniformHemisphere(const Point2f &sample) {
 	float sinTheta = std::sqrt(std::max((float) 0, 1-cosTheta*cosTheta));
 
 	float sinPhi, cosPhi;
-	sincosf(2.0f * M_PI * sample.y(), &sinPhi, &cosPhi);
+	fastSinCos(2.0f * M_PI * sample.y(), &sinPhi, &cosPhi);
 
 	return Vector3f(cosPhi * sinTheta, sinPhi * sinTheta, cosTheta);
 }
@@ -103,10 +120,115 @@ Vector3f squareToCosineHemisphere(const Point2f &sample) {
 	return Vector3f(p.x(), p.y(), z);
 }
 
+#if defined(NORI_SSE) && !defined(NORI_LIBM)
+/**
+ * Sine and cosine of four angles in [-pi/4, pi/4], using the
+ * polynomials of \ref fastSinCos() (no range reduction is needed)
+ */
+static inline void sinCos4(__m128 r, __m128 *sin, __m128 *cos) {
+	__m128 r2 = _mm_mul_ps(r, r);
+	__m128 s = _mm_add_ps(_mm_set1_ps(8.3321608736e-3f),
+		_mm_mul_ps(r2, _mm_set1_ps(-1.9515295891e-4f)));
+	s = _mm_add_ps(_mm_set1_ps(-1.6666654611e-1f), _mm_mul_ps(r2, s));
+	*sin = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), s));
+
+	__m128 c = _mm_add_ps(_mm_set1_ps(-1.388731625493765e-3f),
+		_mm_mul_ps(r2, _mm_set1_ps(2.443315711809948e-5f)));
+	c = _mm_add_ps(_mm_set1_ps(4.166664568298827e-2f), _mm_mul_ps(r2, c));
+	*cos = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), r2)),
+		_mm_mul_ps(_mm_mul_ps(r2, r2), c));
+}
+
+/// Per-lane selection: <tt>mask ? a : b</tt>
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
+
+void squareToUniformSphere(const Point2f *samples, Vector3f *result, uint32_t count) {
+	uint32_t i = 0;
+#if defined(NORI_SSE) && !defined(NORI_LIBM)
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+	const __m128i oneI = _mm_set1_epi32(1), twoI = _mm_set1_epi32(2);
+	for (; i+4<=count; i+=4) {
+		const Point2f *s = samples + i;
+		__m128 u = _mm_setr_ps(s[0].x(), s[1].x(), s[2].x(), s[3].x()),
+		       v = _mm_setr_ps(s[0].y(), s[1].y(), s[2].y(), s[3].y());
+
+		__m128 z = _mm_sub_ps(one, _mm_mul_ps(two, v)),
+		       r = _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(z, z))));
+
+		/* phi = 2 pi u = q pi/2 + rem, where q is the nearest quadrant.
+		   Since u is given, the remainder is exact without Cody-Waite */
+		__m128 u4 = _mm_mul_ps(_mm_set1_ps(4.0f), u);
+		__m128i q = _mm_cvttps_epi32(_mm_add_ps(u4, _mm_set1_ps(0.5f)));
+		__m128 rem = _mm_mul_ps(_mm_set1_ps((float) (M_PI / 2)),
+			_mm_sub_ps(u4, _mm_cvtepi32_ps(q)));
+		__m128 sinR, cosR;
+		sinCos4(rem, &sinR, &cosR);
+
+		/* Rotate by the quadrant (as in fastSinCos()) */
+		__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, oneI), oneI)),
+		       sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, twoI), 30)),
+		       cosSign = _mm_castsi128_ps(_mm_slli_epi32(
+		           _mm_and_si128(_mm_add_epi32(q, oneI), twoI), 30));
+		__m128 sinPhi = _mm_xor_ps(select4(swap, cosR, sinR), sinSign),
+		       cosPhi = _mm_xor_ps(select4(swap, sinR, cosR), cosSign);
+
+		float x[4], y[4], zs[4];
+		_mm_storeu_ps(x, _mm_mul_ps(r, cosPhi));
+		_mm_storeu_ps(y, _mm_mul_ps(r, sinPhi));
+		_mm_storeu_ps(zs, z);
+		for (int k=0; k<4; ++k)
+			result[i+k] = Vector3f(x[k], y[k], zs[k]);
+	}
+#endif
+	for (; i<count; ++i)
+		result[i] = squareToUniformSphere(samples[i]);
+}
+
+void squareToCosineHemisphere(const Point2f *samples, Vector3f *result, uint32_t count) {
+	uint32_t i = 0;
+#if defined(NORI_SSE) && !defined(NORI_LIBM)
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps(),
+	             absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	for (; i+4<=count; i+=4) {
+		const Point2f *s = samples + i;
+		__m128 r1 = _mm_sub_ps(_mm_mul_ps(two, _mm_setr_ps(s[0].x(), s[1].x(), s[2].x(), s[3].x())), one),
+		       r2 = _mm_sub_ps(_mm_mul_ps(two, _mm_setr_ps(s[0].y(), s[1].y(), s[2].y(), s[3].y())), one);
+
+		/* Branch-free form of the concentric mapping: the four regions
+		   reduce to two cases with an angle in [-pi/4, pi/4], namely
+		   r1 (cos a, sin a) with a = pi/4 r2/r1 when |r1| > |r2|, and
+		   r2 (sin a, cos a) with a = pi/4 r1/r2 otherwise */
+		__m128 first = _mm_cmpgt_ps(_mm_and_ps(r1, absMask), _mm_and_ps(r2, absMask)),
+		       major = select4(first, r1, r2),
+		       minor = select4(first, r2, r1);
+		__m128 ratio = _mm_and_ps(_mm_div_ps(minor, major), _mm_cmpneq_ps(major, zero));
+		__m128 sinA, cosA;
+		sinCos4(_mm_mul_ps(_mm_set1_ps((float) (M_PI / 4)), ratio), &sinA, &cosA);
+
+		__m128 px = _mm_mul_ps(major, select4(first, cosA, sinA)),
+		       py = _mm_mul_ps(major, select4(first, sinA, cosA)),
+		       pz = _mm_sqrt_ps(_mm_max_ps(zero,
+		           _mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(px, px)), _mm_mul_ps(py, py))));
+
+		float x[4], y[4], z[4];
+		_mm_storeu_ps(x, px);
+		_mm_storeu_ps(y, py);
+		_mm_storeu_ps(z, pz);
+		for (int k=0; k<4; ++k)
+			result[i+k] = Vector3f(x[k], y[k], z[k]);
+	}
+#endif
+	for (; i<count; ++i)
+		result[i] = squareToCosineHemisphere(samples[i]);
+}
+
 Point2f squareToUniformDisk(const Point2f &sample) {
 	float r = std::sqrt(sample.x());
 	float sinPhi, cosPhi;
-	sincosf(2.0f * M_PI * sample.y(), &sinPhi, &cosPhi);
+	fastSinCos(2.0f * M_PI * sample.y(), &sinPhi, &cosPhi);
 
 	return Point2f(
 		cosPhi * r,
@@ -139,7 +261,7 @@ Point2f squareToUniformDiskConcentric(const Point2f &sample) {
 	}
 
 	Point2f result;
-	sincosf(coords.y(), &result[1], &result[0]);
+	fastSinCos(coords.y(), &result[1], &result[0]);
 	return result*coords.x();
 }
 
@@ -151,8 +273,8 @@ Point2f squareToTriangle(const Point2f &sample) {
 Vector3f sphericalDirection(float theta, float phi) {
 	float sinTheta, cosTheta, sinPhi, cosPhi;
 
-	sincosf(theta, &sinTheta, &cosTheta);
-	sincosf(phi, &sinPhi, &cosPhi);
+	fastSinCos(theta, &sinTheta, &cosTheta);
+	fastSinCos(phi, &sinPhi, &cosPhi);
 
 	return Vector3f(
 		sinTheta * cosPhi,
@@ -171,15 +293,67 @@ Point2f sphericalCoordinates(const Vector3f &v) {
 	return result;
 }
 
-void coordinateSystem(const Vector3f &a, Vector3f &b, Vector3f &c) {
-	if (std::abs(a.x()) > std::abs(a.y())) {
-		float invLen = 1.0f / std::sqrt(a.x() * a.x() + a.z() * a.z());
-		c = Vector3f(a.z() * invLen, 0.0f, -a.x() * invLen);
-	} else {
-		float invLen = 1.0f / std::sqrt(a.y() * a.y() + a.z() * a.z());
-		c = Vector3f(0.0f, a.z() * invLen, -a.y() * invLen);
+float fresnel(float cosThetaI, float extIOR, float intIOR) {
+	float etaI = extIOR, etaT = intIOR;
+	if (extIOR == intIOR)
+		return 0.0f;
+
+	/* Swap the indices of refraction if the interaction starts
+	   at the inside of the object */
+	if (cosThetaI < 0.0f) {
+		std::swap(etaI, etaT);
+		cosThetaI = -cosThetaI;
+	}
+
+	/* Using Snell's law, calculate the squared sine of the
+	   angle between the normal and the transmitted ray */
+	float eta = etaI / etaT,
+	      sinThetaTSqr = eta*eta * (1-cosThetaI*cosThetaI);
+
+	/* Total internal reflection */
+	if (sinThetaTSqr > 1.0f)
+		return 1.0f;
+
+	float cosThetaT = std::sqrt(1.0f - sinThetaTSqr);
+	float Rs = (etaI * cosThetaI - etaT * cosThetaT)
+	         / (etaI * cosThetaI + etaT * cosThetaT);
+	float Rp = (etaT * cosThetaI - etaI * cosThetaT)
+	         / (etaT * cosThetaI + etaI * cosThetaT);
+	return (Rs * Rs + Rp * Rp) / 2.0f;
+}
+
+void coordinateSystem(const Vector3f *a, Vector3f *b, Vector3f *c, uint32_t count) {
+	uint32_t i = 0;
+#if defined(NORI_SSE)
+	const __m128 one = _mm_set1_ps(1.0f), signBit = _mm_set1_ps(-0.0f);
+	for (; i+4<=count; i+=4) {
+		const Vector3f *v = a + i;
+		__m128 x = _mm_setr_ps(v[0].x(), v[1].x(), v[2].x(), v[3].x()),
+		       y = _mm_setr_ps(v[0].y(), v[1].y(), v[2].y(), v[3].y()),
+		       z = _mm_setr_ps(v[0].z(), v[1].z(), v[2].z(), v[3].z());
+
+		/* Same computation as the scalar version, four lanes at a time */
+		__m128 sign = _mm_or_ps(one, _mm_and_ps(z, signBit)),
+		       negSign = _mm_xor_ps(sign, signBit),
+		       s = _mm_div_ps(_mm_xor_ps(one, signBit), _mm_add_ps(sign, z)),
+		       xy = _mm_mul_ps(_mm_mul_ps(x, y), s);
+
+		float result[6][4];
+		_mm_storeu_ps(result[0], _mm_add_ps(one, _mm_mul_ps(sign, _mm_mul_ps(_mm_mul_ps(x, x), s))));
+		_mm_storeu_ps(result[1], _mm_mul_ps(sign, xy));
+		_mm_storeu_ps(result[2], _mm_mul_ps(negSign, x));
+		_mm_storeu_ps(result[3], xy);
+		_mm_storeu_ps(result[4], _mm_add_ps(sign, _mm_mul_ps(_mm_mul_ps(y, y), s)));
+		_mm_storeu_ps(result[5], _mm_xor_ps(y, signBit));
+
+		for (int k=0; k<4; ++k) {
+			b[i+k] = Vector3f(result[0][k], result[1][k], result[2][k]);
+			c[i+k] = Vector3f(result[3][k], result[4][k], result[5][k]);
+		}
 	}
-	b = c.cross(a);
+#endif
+	for (; i<count; ++i)
+		coordinateSystem(a[i], b[i], c[i]);
 }
 
 void *allocAligned(size_t size) {
@@ -202,6 +376,98 @@ void freeAligned(void *ptr) {
 #endif
 }
 
+static bool hugePagesEnabled = true;
+
+void setHugePagesEnabled(bool enabled) {
+	hugePagesEnabled = enabled;
+}
+
+bool getHugePagesEnabled() {
+	return hugePagesEnabled;
+}
+
+#if defined(PLATFORM_LINUX)
+/**
+ * Map an anonymous region that is backed by huge pages where possible.
+ * On success, \c size receives the size of the mapping
+ */
+static void *mapHugePages(size_t &size) {
+	/* Prefer pages that were reserved by the administrator (hugetlbfs), 
+	   1 GiB ones only when the region fills them well */
+	size_t rounded;
+#if defined(MAP_HUGE_1GB)
+	rounded = (size + NORI_GIGANTIC_PAGE_SIZE - 1) & ~(NORI_GIGANTIC_PAGE_SIZE - 1);
+	if (size >= NORI_GIGANTIC_PAGE_SIZE && rounded - size <= size / 8) {
+		void *ptr = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			size = rounded;
+			return ptr;
+		}
+	}
+#endif
+	rounded = (size + NORI_HUGE_PAGE_SIZE - 1) & ~(NORI_HUGE_PAGE_SIZE - 1);
+	void *ptr = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED) {
+		size = rounded;
+		return ptr;
+	}
+
+	/* Otherwise, ask for transparent huge pages. These only back 
+	   aligned 2 MiB ranges, hence the region is aligned by mapping
+	   one page more and trimming it */
+	ptr = mmap(NULL, rounded + NORI_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	uintptr_t start = (uintptr_t) ptr,
+	          aligned = (start + NORI_HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (NORI_HUGE_PAGE_SIZE - 1);
+	if (aligned > start)
+		munmap(ptr, aligned - start);
+	munmap((void *) (aligned + rounded), NORI_HUGE_PAGE_SIZE - (aligned - start));
+#if defined(MADV_HUGEPAGE)
+	madvise((void *) aligned, rounded, MADV_HUGEPAGE);
+#endif
+	size = rounded;
+	return (void *) aligned;
+}
+#endif
+
+/* Regions returned by allocLarge() are preceded by one cache line
+   that stores the size of their mapping (0 = from allocAligned()) */
+void *allocLarge(size_t size) {
+	size += L1_CACHE_LINE_SIZE;
+	uint8_t *base = NULL;
+	size_t mapped = 0;
+#if defined(PLATFORM_LINUX)
+	if (hugePagesEnabled && size >= NORI_HUGE_PAGE_SIZE) {
+		mapped = size;
+		base = static_cast<uint8_t *>(mapHugePages(mapped));
+		if (!base)
+			mapped = 0;
+	}
+#endif
+	if (!base)
+		base = static_cast<uint8_t *>(allocAligned(size));
+	*reinterpret_cast<size_t *>(base) = mapped;
+	return base + L1_CACHE_LINE_SIZE;
+}
+
+void freeLarge(void *ptr) {
+	if (!ptr)
+		return;
+	uint8_t *base = static_cast<uint8_t *>(ptr) - L1_CACHE_LINE_SIZE;
+	size_t mapped = *reinterpret_cast<size_t *>(base);
+#if defined(PLATFORM_LINUX)
+	if (mapped > 0) {
+		munmap(base, mapped);
+		return;
+	}
+#endif
+	freeAligned(base);
+}
+
 int getCoreCount() {
 #if defined(PLATFORM_WINDOWS)
 	SYSTEM_INFO sys_info;
@@ -218,10 +484,129 @@ int getCoreCount() {
 #endif
 }
 
+size_t getPeakMemoryUsage() {
+#if defined(PLATFORM_WINDOWS)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (size_t) counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	#if defined(PLATFORM_MACOS)
+		return (size_t) usage.ru_maxrss; /* bytes */
+	#else
+		return (size_t) usage.ru_maxrss * 1024; /* KiB */
+	#endif
+#endif
+}
+
+int getNodeCount() {
+#if defined(PLATFORM_WINDOWS)
+	ULONG highestNode;
+	if (!GetNumaHighestNodeNumber(&highestNode))
+		return 1;
+	return (int) highestNode + 1;
+#elif defined(PLATFORM_LINUX)
+	int nodeCount = 0;
+	while (true) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%i", nodeCount);
+		if (access(path, F_OK) != 0)
+			break;
+		++nodeCount;
+	}
+	return std::max(nodeCount, 1);
+#else
+	return 1;
+#endif
+}
+
+std::vector<int> getNodeCores(int node) {
+	std::vector<int> cores;
+#if defined(PLATFORM_WINDOWS)
+	ULONGLONG mask;
+	if (GetNumaNodeProcessorMask((UCHAR) node, &mask)) {
+		for (int i=0; i<64; ++i)
+			if (mask & (1ULL << i))
+				cores.push_back(i);
+	}
+#elif defined(PLATFORM_LINUX)
+	/* The CPU list has the form "0-7,16-23" */
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (file) {
+		int first, last;
+		while (fscanf(file, "%d", &first) == 1) {
+			last = first;
+			if (fscanf(file, "-%d", &last) < 0)
+				last = first;
+			for (int i=first; i<=last; ++i)
+				cores.push_back(i);
+			if (fgetc(file) != ',')
+				break;
+		}
+		fclose(file);
+	}
+#endif
+	/* No topology information: all cores belong to the same node */
+	if (cores.empty() && node == 0) {
+		for (int i=0; i<getCoreCount(); ++i)
+			cores.push_back(i);
+	}
+	return cores;
+}
+
+bool setThreadAffinity(const std::vector<int> &cores) {
+#if defined(PLATFORM_WINDOWS)
+	DWORD_PTR mask = 0;
+	for (size_t i=0; i<cores.size(); ++i)
+		mask |= (DWORD_PTR) 1 << cores[i];
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(PLATFORM_LINUX)
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	for (size_t i=0; i<cores.size(); ++i)
+		CPU_SET(cores[i], &mask);
+	return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else
+	/* Mac OS only supports affinity hints between threads */
+	return false;
+#endif
+}
+
+static QThreadStorage<int *> threadNode;
+
+int getThreadNode() {
+	return threadNode.hasLocalData() ? *threadNode.localData() : 0;
+}
+
+void setThreadNode(int node) {
+	if (!threadNode.hasLocalData())
+		threadNode.setLocalData(new int(node));
+	else
+		*threadNode.localData() = node;
+}
+
 QString indent(const QString &string, int amount) {
 	QString result = string;
 	result.replace("\n", QString("\n") + QString(" ").repeated(amount));
 	return result;
 }
 
+std::string toJSONString(const QString &string) {
+	std::string result("\"");
+	QByteArray utf8 = string.toUtf8();
+	for (int i=0; i<utf8.size(); ++i) {
+		char c = utf8[i];
+		if (c == '"' || c == '\\')
+			result += '\\';
+		if ((unsigned char) c >= 0x20)
+			result += c;
+	}
+	return result + "\"";
+}
+
 NORI_NAMESPACE_END
@@ -0,0 +1,326 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/curves.h>
+#include <nori/bsdf.h>
+#include <Eigen/Geometry>
+#include <QTextStream>
+#include <QStringList>
+#include <QFile>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/// Split a cubic Bezier segment at its midpoint (de Casteljau), producing 7 control points
+static inline void subdivideBezier(const Point3f *cp, Point3f *result) {
+	Point3f p01 = (cp[0] + cp[1]) * 0.5f, p12 = (cp[1] + cp[2]) * 0.5f,
+	        p23 = (cp[2] + cp[3]) * 0.5f, p012 = (p01 + p12) * 0.5f,
+	        p123 = (p12 + p23) * 0.5f;
+	result[0] = cp[0];
+	result[1] = p01;
+	result[2] = p012;
+	result[3] = (p012 + p123) * 0.5f;
+	result[4] = p123;
+	result[5] = p23;
+	result[6] = cp[3];
+}
+
+/// Evaluate a cubic Bezier segment and its derivative
+static inline Point3f evalBezier(const Point3f *cp, float u, Vector3f &deriv) {
+	Point3f p01 = cp[0] + (cp[1] - cp[0]) * u, p12 = cp[1] + (cp[2] - cp[1]) * u,
+	        p23 = cp[2] + (cp[3] - cp[2]) * u;
+	Point3f p012 = p01 + (p12 - p01) * u, p123 = p12 + (p23 - p12) * u;
+	deriv = (p123 - p012) * 3.0f;
+	return p012 + (p123 - p012) * u;
+}
+
+/// Add the clipped, widened control point hulls of the pieces of a segment to \c result
+static void clipPieces(const Point3f *cp, int depth, float halfWidth,
+		const BoundingBox3f &clip, BoundingBox3f &result) {
+	if (depth > 0) {
+		Point3f split[7];
+		subdivideBezier(cp, split);
+		clipPieces(split, depth - 1, halfWidth, clip, result);
+		clipPieces(split + 3, depth - 1, halfWidth, clip, result);
+		return;
+	}
+
+	BoundingBox3f bbox(cp[0]);
+	for (int i=1; i<4; ++i)
+		bbox.expandBy(cp[i]);
+	bbox.min -= Vector3f::Constant(halfWidth);
+	bbox.max += Vector3f::Constant(halfWidth);
+	bbox.clip(clip);
+	if (bbox.isValid())
+		result.expandBy(bbox);
+}
+
+Curves::Curves(const PropertyList &propList) : m_strandCount(0) {
+	/* Text file with the control points of one strand per line */
+	m_filename = propList.getString("filename");
+
+	/* Radius at the root and at the tip of every strand */
+	m_radius = propList.getFloat("radius", 0.01f);
+	m_tipRadius = propList.getFloat("tipRadius", m_radius);
+	if (m_radius <= 0 || m_tipRadius < 0)
+		throw NoriException(QString("Curves: invalid radii (radius=%1 must be > 0, "
+			"tipRadius=%2 must be >= 0)").arg(m_radius).arg(m_tipRadius));
+
+	/* Shading across the ribbon: 'flat' or 'cylinder' */
+	QString type = propList.getString("type", "cylinder");
+	if (type == "flat")
+		m_type = EFlat;
+	else if (type == "cylinder")
+		m_type = ECylinder;
+	else
+		throw NoriException(QString("Curves: unknown type \"%1\" (must be "
+			"\"flat\" or \"cylinder\")").arg(type));
+
+	QFile input(m_filename);
+	if (!input.open(QIODevice::ReadOnly | QIODevice::Text))
+		throw NoriException(QString("Cannot open \"%1\"").arg(m_filename));
+	cout << "Loading \"" << qPrintable(m_filename) << "\" .." << endl;
+	m_name = m_filename;
+
+	QTextStream stream(&input);
+	int lineNumber = 0;
+	while (!stream.atEnd()) {
+		QString line = stream.readLine().trimmed();
+		++lineNumber;
+		if (line.isEmpty() || line.startsWith('#'))
+			continue;
+
+		QStringList list = line.split(QRegExp("\\s+"), QString::SkipEmptyParts);
+		if (list.size() % 3 != 0 || list.size() < 12 || (list.size() / 3) % 3 != 1)
+			throw NoriException(QString("Error while parsing \"%1\" (line %2): a strand "
+				"must have 3n+1 control points (n >= 1)").arg(m_filename).arg(lineNumber));
+
+		uint32_t first = (uint32_t) m_points.size();
+		for (int i=0; i<list.size(); i += 3) {
+			bool ok[3];
+			Point3f p(list[i].toFloat(&ok[0]), list[i+1].toFloat(&ok[1]),
+				list[i+2].toFloat(&ok[2]));
+			if (!ok[0] || !ok[1] || !ok[2])
+				throw NoriException(QString("Error while parsing \"%1\" (line %2): "
+					"invalid number").arg(m_filename).arg(lineNumber));
+			m_points.push_back(p);
+		}
+
+		/* The width tapers linearly over the segments of the strand */
+		uint32_t segmentCount = (uint32_t) (list.size() / 3 - 1) / 3;
+		for (uint32_t i=0; i<segmentCount; ++i) {
+			Segment segment;
+			segment.offset = first + 3*i;
+			segment.width0 = 2 * lerp(i / (float) segmentCount, m_radius, m_tipRadius);
+			segment.width1 = 2 * lerp((i+1) / (float) segmentCount, m_radius, m_tipRadius);
+			m_segments.push_back(segment);
+		}
+		m_strandCount++;
+	}
+
+	if (m_segments.empty())
+		throw NoriException(QString("\"%1\" doesn't contain any strands!").arg(m_filename));
+
+	cout << "Loaded " << m_strandCount << " strands with " << m_segments.size()
+		 << " segments" << endl;
+}
+
+Curves::~Curves() { }
+
+void Curves::activate() {
+	if (m_luminaire)
+		throw NoriException("Curves can't be luminaires!");
+	if (m_interiorMedium)
+		throw NoriException("Curves can't have an interior medium!");
+
+	if (!m_bsdf) {
+		/* If no material was assigned, instantiate a diffuse BRDF */
+		m_bsdf = static_cast<BSDF *>(
+			NoriObjectFactory::createInstance("diffuse", PropertyList()));
+	}
+}
+
+BoundingBox3f Curves::getBoundingBox(uint32_t index) const {
+	Point3f inf = Point3f::Constant(std::numeric_limits<float>::infinity());
+	return getClippedBoundingBox(index, BoundingBox3f(-inf, inf));
+}
+
+BoundingBox3f Curves::getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const {
+	const Segment &segment = m_segments[index];
+	BoundingBox3f result;
+	clipPieces(&m_points[segment.offset], 2, 0.5f * std::max(segment.width0, segment.width1),
+		clip, result);
+	return result;
+}
+
+bool Curves::rayIntersect(uint32_t index, const Ray3f &ray, float maxt,
+		float &t, Point2f &uv) const {
+	const Segment &segment = m_segments[index];
+	const Point3f *points = &m_points[segment.offset];
+
+	/* Transform the control points into a coordinate system, in which
+	   the ray starts at the origin and points along the z axis */
+	float dLength = ray.d.norm();
+	Frame rayFrame(ray.d / dLength);
+	Point3f cp[4];
+	for (int i=0; i<4; ++i)
+		cp[i] = rayFrame.toLocal(points[i] - ray.o);
+
+	/* Subdivide until the pieces are approximately straight (i.e. until
+	   their deviation from a line falls below 5% of the curve width) */
+	float L0 = 0;
+	for (int i=0; i<2; ++i)
+		L0 = std::max(L0, (cp[i] - 2.0f * cp[i+1] + cp[i+2]).cwiseAbs().maxCoeff());
+	float eps = 0.05f * std::max(segment.width0, segment.width1);
+	int depth = 0;
+	if (L0 > 0)
+		depth = clamp((int) std::floor(0.5f * std::log(1.41421356f * 6.0f * L0
+			/ (8.0f * eps)) / std::log(2.0f) + 0.5f), 0, NORI_CURVES_MAXSUBDIV);
+
+	float zMax = maxt * dLength, u;
+	if (!recursiveIntersect(cp, 0.0f, 1.0f, depth, segment.width0, segment.width1,
+			ray.mint * dLength, zMax, u))
+		return false;
+	t = zMax / dLength;
+	uv = Point2f(u, 0.0f);
+	return true;
+}
+
+bool Curves::recursiveIntersect(const Point3f *cp, float u0, float u1, int depth,
+		float width0, float width1, float zMin, float &zMax, float &u) const {
+	/* Reject pieces whose widened hull doesn't contain the ray */
+	float halfWidth = 0.5f * std::max(lerp(u0, width0, width1), lerp(u1, width0, width1));
+	Point3f min = cp[0], max = cp[0];
+	for (int i=1; i<4; ++i) {
+		min = min.cwiseMin(cp[i]);
+		max = max.cwiseMax(cp[i]);
+	}
+	if (min.x() - halfWidth > 0 || max.x() + halfWidth < 0 ||
+		min.y() - halfWidth > 0 || max.y() + halfWidth < 0 ||
+		min.z() - halfWidth > zMax || max.z() + halfWidth < zMin)
+		return false;
+
+	if (depth > 0) {
+		Point3f split[7];
+		subdivideBezier(cp, split);
+		float uMid = 0.5f * (u0 + u1);
+		bool hit = recursiveIntersect(split, u0, uMid, depth - 1,
+			width0, width1, zMin, zMax, u);
+		hit |= recursiveIntersect(split + 3, uMid, u1, depth - 1,
+			width0, width1, zMin, zMax, u);
+		return hit;
+	}
+
+	/* Test against the lines through the end points that are perpendicular
+	   to the piece, so that neighboring pieces don't both report a hit */
+	float edge = (cp[1].y() - cp[0].y()) * -cp[0].y() + cp[0].x() * (cp[0].x() - cp[1].x());
+	if (edge < 0)
+		return false;
+	edge = (cp[2].y() - cp[3].y()) * -cp[3].y() + cp[3].x() * (cp[3].x() - cp[2].x());
+	if (edge < 0)
+		return false;
+
+	/* Closest point of the (nearly straight) piece to the ray */
+	Vector2f direction(cp[3].x() - cp[0].x(), cp[3].y() - cp[0].y());
+	float denom = direction.squaredNorm();
+	if (denom == 0)
+		return false;
+	float w = -(cp[0].x() * direction.x() + cp[0].y() * direction.y()) / denom;
+
+	float uHit = clamp(lerp(w, u0, u1), u0, u1);
+	float width = lerp(uHit, width0, width1);
+	Vector3f deriv;
+	Point3f pc = evalBezier(cp, clamp(w, 0.0f, 1.0f), deriv);
+	if (pc.x() * pc.x() + pc.y() * pc.y() > 0.25f * width * width)
+		return false;
+	if (pc.z() < zMin || pc.z() > zMax)
+		return false;
+
+	zMax = pc.z();
+	u = uHit;
+	return true;
+}
+
+void Curves::computeDifferentialGeometry(const Ray3f &ray, Intersection &its) const {
+	const Segment &segment = m_segments[its.primIndex];
+	const Point3f *points = &m_points[segment.offset];
+	float u = its.bary.x();
+
+	Vector3f dpdu;
+	Point3f center = evalBezier(points, u, dpdu);
+	if (dpdu.isZero())
+		dpdu = points[3] - points[0];
+	Vector3f axis = dpdu.normalized();
+
+	/* The ribbon faces the ray, i.e. its normal is the component of the
+	   reversed ray direction that is perpendicular to the curve */
+	Vector3f d = ray.d.normalized();
+	Vector3f normal = axis * axis.dot(d) - d;
+	float length = normal.norm();
+	if (length > 0) {
+		normal /= length;
+	} else {
+		Vector3f tmp;
+		coordinateSystem(axis, normal, tmp);
+	}
+	Vector3f side = axis.cross(normal);
+
+	its.p = ray(its.t);
+	float width = lerp(u, segment.width0, segment.width1);
+	float s = width > 0 ? clamp((its.p - center).dot(side) / (0.5f * width), -1.0f, 1.0f) : 0.0f;
+
+	its.uv = Point2f(u, 0.5f * (s + 1));
+	its.dpdu = dpdu;
+	its.dpdv = side * width;
+	its.dpdx = its.dpdy = Vector3f::Zero();
+	its.uvWidth = 0.0f;
+	its.geoFrame = Frame(axis, normal.cross(axis), normal);
+
+	if (m_type == ECylinder) {
+		/* Bend the normal as if the ribbon was the visible half of a cylinder */
+		Vector3f shNormal = (normal * std::sqrt(std::max(0.0f, 1 - s*s)) + side * s).normalized();
+		its.shFrame = Frame(axis, shNormal.cross(axis), shNormal);
+	} else {
+		its.shFrame = its.geoFrame;
+	}
+
+	its.toWorldTrafo = NULL;
+	its.hasDifferentials = true;
+}
+
+QString Curves::toString() const {
+	return QString(
+		"Curves[\n"
+		"  name = \"%1\",\n"
+		"  strandCount = %2,\n"
+		"  segmentCount = %3,\n"
+		"  radius = [%4, %5],\n"
+		"  type = %6,\n"
+		"  bsdf = %7\n"
+		"]")
+	.arg(m_name)
+	.arg(m_strandCount)
+	.arg(m_segments.size())
+	.arg(m_radius)
+	.arg(m_tipRadius)
+	.arg(m_type == EFlat ? "flat" : "cylinder")
+	.arg(indent(m_bsdf->toString()));
+}
+
+NORI_REGISTER_CLASS(Curves, "curves");
+NORI_NAMESPACE_END
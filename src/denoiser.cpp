@@ -0,0 +1,180 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/denoiser.h>
+#include <nori/block.h>
+#include <QAtomicInt>
+
+#define NORI_DENOISE_NORMAL_SIGMA 0.2f /* Tolerance of the normal term (distance between unit normals) */
+#define NORI_DENOISE_ALBEDO_SIGMA 0.1f /* Tolerance of the albedo term */
+#define NORI_DENOISE_MIN_ALBEDO   0.01f /* Smaller albedos aren't divided out */
+
+NORI_NAMESPACE_BEGIN
+
+/// Shared state of the threads that denoise an image
+struct DenoiseTask {
+	const Bitmap *color, *albedo, *normal, *variance;
+	/// Color divided by the albedo, and the variance of its luminance
+	Bitmap demodulated;
+	std::vector<float> demodVariance;
+	Bitmap *result;
+	int radius;
+	float strength;
+	/// Next row that hasn't been claimed by a thread
+	QAtomicInt nextRow;
+};
+
+/// Processes rows of the image until none are left
+class DenoiseWorker : public QThread {
+public:
+	DenoiseWorker(DenoiseTask *task) : m_task(task) { }
+
+	void run() {
+		const DenoiseTask &t = *m_task;
+		int width = (int) t.result->cols(), height = (int) t.result->rows();
+		float invSpatial = 1.0f / (0.5f * t.radius * t.radius);
+		float invNormal = 1.0f / (NORI_DENOISE_NORMAL_SIGMA * NORI_DENOISE_NORMAL_SIGMA);
+		float invAlbedo = 1.0f / (NORI_DENOISE_ALBEDO_SIGMA * NORI_DENOISE_ALBEDO_SIGMA);
+		float strength2 = t.strength * t.strength;
+
+		int y;
+		while ((y = m_task->nextRow.fetchAndAddOrdered(1)) < height) {
+			int yStart = std::max(0, y - t.radius), yEnd = std::min(height - 1, y + t.radius);
+
+			for (int x=0; x<width; ++x) {
+				int xStart = std::max(0, x - t.radius), xEnd = std::min(width - 1, x + t.radius);
+				const Color3f &n = t.normal->coeff(y, x), &a = t.albedo->coeff(y, x);
+				float lum = t.demodulated.coeff(y, x).getLuminance();
+				float var = t.demodVariance[y * width + x];
+
+				Color3f sum(0.0f);
+				float weightSum = 0.0f;
+				for (int yq=yStart; yq<=yEnd; ++yq) {
+					for (int xq=xStart; xq<=xEnd; ++xq) {
+						float dx = (float) (xq - x), dy = (float) (yq - y);
+						float dColor = t.demodulated.coeff(yq, xq).getLuminance() - lum;
+
+						float exponent = (dx*dx + dy*dy) * invSpatial
+							+ (t.normal->coeff(yq, xq) - n).matrix().squaredNorm() * invNormal
+							+ (t.albedo->coeff(yq, xq) - a).matrix().squaredNorm() * invAlbedo
+							+ dColor * dColor / (strength2 * (var + t.demodVariance[yq * width + xq]) + Epsilon);
+
+						float weight = std::exp(-exponent);
+						sum += t.demodulated.coeff(yq, xq) * weight;
+						weightSum += weight;
+					}
+				}
+
+				/* The center pixel always has weight one */
+				Color3f value = sum / weightSum;
+				for (int i=0; i<3; ++i) {
+					if (a[i] > NORI_DENOISE_MIN_ALBEDO)
+						value[i] *= a[i];
+				}
+				t.result->coeffRef(y, x) = value;
+			}
+		}
+	}
+private:
+	DenoiseTask *m_task;
+};
+
+Denoiser::Denoiser(int radius, float strength, int threadCount)
+	: m_radius(radius), m_strength(strength), m_threadCount(threadCount) {
+	if (m_radius < 1 || m_strength <= 0 || m_threadCount < 0)
+		throw NoriException(QString("Invalid denoiser parameters (radius=%1 must be >= 1, "
+			"strength=%2 must be > 0, threadCount=%3 must be >= 0)")
+			.arg(m_radius).arg(m_strength).arg(m_threadCount));
+	if (m_threadCount == 0)
+		m_threadCount = getCoreCount();
+}
+
+Bitmap *Denoiser::denoise(const ImageBlock &block) const {
+	if (!block.hasAOVs())
+		throw NoriException("Denoiser::denoise(): the image block doesn't store AOVs!");
+
+	Bitmap *color = block.toBitmap();
+	Bitmap *albedo = block.toAOVBitmap(EAOVAlbedo);
+	Bitmap *normal = block.toAOVBitmap(EAOVNormal);
+	Bitmap *variance = block.toAOVBitmap(EAOVVariance);
+	Bitmap *result = denoise(*color, *albedo, *normal, *variance);
+	delete color;
+	delete albedo;
+	delete normal;
+	delete variance;
+	return result;
+}
+
+Bitmap *Denoiser::denoise(const Bitmap &color, const Bitmap &albedo,
+		const Bitmap &normal, const Bitmap &variance) const {
+	Vector2i size((int) color.cols(), (int) color.rows());
+	if (albedo.cols() != size.x() || albedo.rows() != size.y() ||
+		normal.cols() != size.x() || normal.rows() != size.y() ||
+		variance.cols() != size.x() || variance.rows() != size.y())
+		throw NoriException("Denoiser::denoise(): the guide images must "
+			"have the same size as the color image!");
+
+	DenoiseTask task;
+	task.color = &color;
+	task.albedo = &albedo;
+	task.normal = &normal;
+	task.variance = &variance;
+	task.radius = m_radius;
+	task.strength = m_strength;
+	task.result = new Bitmap(size);
+
+	/* Divide out the albedo, so that texture detail isn't blurred.
+	   This scales the standard deviation by the same factor */
+	task.demodulated.resize(size.y(), size.x());
+	task.demodVariance.resize(size.x() * size.y());
+	for (int y=0; y<size.y(); ++y) {
+		for (int x=0; x<size.x(); ++x) {
+			Color3f value = color.coeff(y, x);
+			const Color3f &a = albedo.coeff(y, x);
+			for (int i=0; i<3; ++i) {
+				if (a[i] > NORI_DENOISE_MIN_ALBEDO)
+					value[i] /= a[i];
+			}
+			float scale = value.getLuminance() / std::max(color.coeff(y, x).getLuminance(), Epsilon);
+			if (color.coeff(y, x).getLuminance() <= 0)
+				scale = 1.0f;
+			task.demodulated.coeffRef(y, x) = value;
+			task.demodVariance[y * size.x() + x] = variance.coeff(y, x).r() * scale * scale;
+		}
+	}
+
+	int threadCount = std::max(1, std::min(m_threadCount, size.y()));
+	std::vector<DenoiseWorker *> workers(threadCount);
+	for (int i=0; i<threadCount; ++i) {
+		workers[i] = new DenoiseWorker(&task);
+		workers[i]->start();
+	}
+	for (int i=0; i<threadCount; ++i) {
+		workers[i]->wait();
+		delete workers[i];
+	}
+
+	return task.result;
+}
+
+QString Denoiser::toString() const {
+	return QString("Denoiser[radius=%1, strength=%2, threadCount=%3]")
+		.arg(m_radius).arg(m_strength).arg(m_threadCount);
+}
+
+NORI_NAMESPACE_END
@@ -18,18 +18,39 @@
 
 #include <nori/bsdf.h>
 #include <nori/frame.h>
+#include <nori/texture.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Diffuse / Lambertian BRDF model
+ *
+ * The albedo is either constant, or given by a nested \ref Texture.
  */
 class Diffuse : public BSDF {
 public:
-	Diffuse(const PropertyList &propList) {
+	Diffuse(const PropertyList &propList) : m_texture(NULL) {
 		m_albedo = propList.getColor("albedo", Color3f(0.5f));
 	}
 
+	virtual ~Diffuse() {
+		delete m_texture;
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case ETexture:
+				if (m_texture)
+					throw NoriException("Diffuse: tried to register multiple textures!");
+				m_texture = static_cast<Texture *>(obj);
+				break;
+
+			default:
+				throw NoriException(QString("Diffuse::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
 	/// Evaluate the BRDF model
 	Color3f eval(const BSDFQueryRecord &bRec) const {
 		/* This is a smooth BRDF -- return zero if the measure
@@ -40,7 +61,7 @@ public:
 			return Color3f(0.0f);
 
 		/* The BRDF is simply the albedo / pi */
-		return m_albedo * INV_PI;
+		return getAlbedo(bRec) * INV_PI;
 	}
 
 	/// Compute the density of \ref sample() wrt. solid angles
@@ -75,7 +96,44 @@ public:
 
 		/* eval() / pdf() * cos(theta) = albedo. There
 		   is no need to call these functions. */
-		return m_albedo;
+		return getAlbedo(bRec);
+	}
+
+	/* Batched versions, which avoid a virtual call per query */
+
+	void eval(const BSDFQueryRecord *bRecs, Color3f *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = Diffuse::eval(bRecs[i]);
+	}
+
+	void pdf(const BSDFQueryRecord *bRecs, float *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = Diffuse::pdf(bRecs[i]);
+	}
+
+	void sample(BSDFQueryRecord *bRecs, const Point2f *samples,
+			Color3f *result, uint32_t count) const {
+		/* Warp the samples four at a time (see \ref squareToCosineHemisphere()) */
+		Vector3f wo[NORI_WARP_BATCH_SIZE];
+		for (uint32_t k=0; k<count; k+=NORI_WARP_BATCH_SIZE) {
+			uint32_t size = std::min(count - k, (uint32_t) NORI_WARP_BATCH_SIZE);
+			squareToCosineHemisphere(samples + k, wo, size);
+			for (uint32_t i=0; i<size; ++i) {
+				BSDFQueryRecord &bRec = bRecs[k+i];
+				if (Frame::cosTheta(bRec.wi) <= 0) {
+					result[k+i] = Color3f(0.0f);
+					continue;
+				}
+				bRec.measure = ESolidAngle;
+				bRec.wo = wo[i];
+				result[k+i] = getAlbedo(bRec);
+			}
+		}
+	}
+
+	/// The hemispherical reflectance is simply the (average) albedo
+	Color3f getAlbedo() const {
+		return m_texture ? m_texture->getAverage() : m_albedo;
 	}
 
 	/// Return a human-readable summary
@@ -83,12 +141,18 @@ public:
 		return QString(
 			"Diffuse[\n"
 			"  albedo = %1\n"
-			"]").arg(m_albedo.toString());
+			"]").arg(m_texture ? indent(m_texture->toString()) : m_albedo.toString());
 	}
 
 	EClassType getClassType() const { return EBSDF; }
 private:
+	/// Albedo at the surface interaction of a query
+	inline Color3f getAlbedo(const BSDFQueryRecord &bRec) const {
+		return m_texture ? m_texture->eval(bRec.uv, bRec.uvWidth) : m_albedo;
+	}
+
 	Color3f m_albedo;
+	Texture *m_texture;
 };
 
 NORI_REGISTER_CLASS(Diffuse, "diffuse");
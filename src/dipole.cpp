@@ -0,0 +1,175 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bssrdf.h>
+#include <nori/frame.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Translucent material with a smooth dielectric boundary, whose
+ * subsurface scattering is approximated by the classical dipole
+ * diffusion profile (Jensen et al. 2001)
+ *
+ * The interior is given by the same coefficients as a homogeneous medium
+ * (\c sigmaS, \c sigmaA, and the anisotropy \c g of its phase function,
+ * all multiplied by \c scale), and the boundary by \c intIOR and \c extIOR.
+ * The \c profileQuantile parameter chooses the fraction of the reflectance
+ * of the profile that is kept (truncating it shortens the probe rays, but
+ * darkens the material slightly), and \c profileResolution the size of
+ * the tables used to sample it.
+ *
+ * As a BSDF, the material only reflects specularly at its boundary; the
+ * light that is transmitted into it is handled by integrators that
+ * support \ref DiffusionProfile (i.e. the path tracer). Others render
+ * it as a dark dielectric.
+ */
+class Dipole : public BSDF, public DiffusionProfile {
+public:
+	Dipole(const PropertyList &propList) {
+		float scale = propList.getFloat("scale", 1.0f);
+		m_sigmaS = propList.getColor("sigmaS") * scale;
+		m_sigmaA = propList.getColor("sigmaA") * scale;
+		m_g = propList.getFloat("g", 0.0f);
+		m_intIOR = propList.getFloat("intIOR", 1.33f);
+		m_extIOR = propList.getFloat("extIOR", 1.0f);
+		m_quantile = propList.getFloat("profileQuantile", 0.999f);
+		m_tableResolution = propList.getInteger("profileResolution", 256);
+
+		if ((m_sigmaS.array() < 0).any() || (m_sigmaA.array() < 0).any())
+			throw NoriException("Dipole: sigmaS and sigmaA must be nonnegative!");
+		if (m_g <= -1 || m_g >= 1)
+			throw NoriException(QString("Dipole: invalid anisotropy g=%1 (must be "
+				"in (-1, 1))").arg(m_g));
+		if (m_intIOR <= 0 || m_extIOR <= 0)
+			throw NoriException("Dipole: the indices of refraction must be positive!");
+		if (m_quantile <= 0 || m_quantile > 1 || m_tableResolution < 1)
+			throw NoriException(QString("Dipole: invalid profile parameters (profileQuantile=%1 "
+				"must be in (0, 1], profileResolution=%2 must be >= 1)")
+				.arg(m_quantile).arg(m_tableResolution));
+	}
+
+	void activate() {
+		/* Diffuse Fresnel reflectance of the boundary (polynomial fit) */
+		float eta = m_intIOR / m_extIOR;
+		float fdr = -1.440f / (eta * eta) + 0.710f / eta + 0.668f + 0.0636f * eta;
+		float A = (1 + fdr) / (1 - fdr);
+
+		/* Reduced coefficients, and the depths of the real and virtual sources */
+		float extent[3];
+		for (int c=0; c<3; ++c) {
+			float sigmaSPrime = m_sigmaS[c] * (1 - m_g),
+			      sigmaTPrime = sigmaSPrime + m_sigmaA[c];
+			if (sigmaTPrime <= 0)
+				throw NoriException("Dipole: the material must scatter or absorb "
+					"light in every channel!");
+			m_albedoPrime[c] = sigmaSPrime / sigmaTPrime;
+			m_sigmaTr[c] = std::sqrt(3 * m_sigmaA[c] * sigmaTPrime);
+			m_zr[c] = 1 / sigmaTPrime;
+			m_zv[c] = m_zr[c] * (1 + 4.0f / 3.0f * A);
+
+			/* The profile falls off like exp(-sigmaTr * r) (or like
+			   1/r^3 without absorption) */
+			extent[c] = 1e4f * m_zr[c];
+			if (m_sigmaTr[c] > 0)
+				extent[c] = std::min(extent[c], 50 / m_sigmaTr[c]);
+
+			/* Total diffuse reflectance */
+			float root = std::sqrt(3 * (1 - m_albedoPrime[c]));
+			m_albedo[c] = 0.5f * m_albedoPrime[c] * (1 + std::exp(-4.0f / 3.0f * A * root))
+				* std::exp(-root);
+		}
+		buildTables(extent, m_quantile, m_tableResolution);
+	}
+
+	/* DiffusionProfile interface */
+
+	float fresnel(float cosTheta) const {
+		return nori::fresnel(cosTheta, m_extIOR, m_intIOR);
+	}
+
+	Color3f evalProfile(float r) const {
+		Color3f result;
+		for (int c=0; c<3; ++c) {
+			float dr = std::sqrt(r * r + m_zr[c] * m_zr[c]),
+			      dv = std::sqrt(r * r + m_zv[c] * m_zv[c]);
+			float real = m_zr[c] * (1 + m_sigmaTr[c] * dr) * std::exp(-m_sigmaTr[c] * dr)
+				/ (dr * dr * dr);
+			float virt = m_zv[c] * (1 + m_sigmaTr[c] * dv) * std::exp(-m_sigmaTr[c] * dv)
+				/ (dv * dv * dv);
+			result[c] = m_albedoPrime[c] * 0.25f * INV_PI * (real + virt);
+		}
+		return result;
+	}
+
+	/* BSDF interface: specular reflection at the boundary */
+
+	Color3f eval(const BSDFQueryRecord &) const {
+		/* Discrete BRDFs always evaluate to zero in Nori */
+		return Color3f(0.0f);
+	}
+
+	float pdf(const BSDFQueryRecord &) const {
+		/* Discrete BRDFs always evaluate to zero in Nori */
+		return 0.0f;
+	}
+
+	Color3f sample(BSDFQueryRecord &bRec, const Point2f &) const {
+		if (Frame::cosTheta(bRec.wi) <= 0)
+			return Color3f(0.0f);
+		bRec.wo = Vector3f(-bRec.wi.x(), -bRec.wi.y(), bRec.wi.z());
+		bRec.measure = EDiscrete;
+		return Color3f(fresnel(Frame::cosTheta(bRec.wi)));
+	}
+
+	bool isDiscrete() const {
+		return true;
+	}
+
+	/// The total diffuse reflectance of the profile
+	Color3f getAlbedo() const {
+		return m_albedo;
+	}
+
+	const DiffusionProfile *getDiffusionProfile() const {
+		return this;
+	}
+
+	QString toString() const {
+		return QString(
+			"Dipole[\n"
+			"  sigmaS = %1,\n"
+			"  sigmaA = %2,\n"
+			"  g = %3,\n"
+			"  intIOR = %4,\n"
+			"  extIOR = %5,\n"
+			"  maxRadius = %6\n"
+			"]").arg(m_sigmaS.toString()).arg(m_sigmaA.toString()).arg(m_g)
+			.arg(m_intIOR).arg(m_extIOR).arg(DiffusionProfile::toString());
+	}
+private:
+	Color3f m_sigmaS, m_sigmaA;
+	float m_g, m_intIOR, m_extIOR;
+	float m_quantile;
+	int m_tableResolution;
+	Color3f m_albedo;
+	float m_albedoPrime[3], m_sigmaTr[3], m_zr[3], m_zv[3];
+};
+
+NORI_REGISTER_CLASS(Dipole, "dipole");
+NORI_NAMESPACE_END
@@ -0,0 +1,435 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
+#include <nori/camera.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Direct illumination from the luminaires of the scene (area
+ * luminaires and an environment luminaire)
+ *
+ * Combines luminaire sampling (see \ref Scene::sampleLuminaire(), which
+ * chooses luminaires proportional to their power) and BSDF sampling
+ * using multiple importance sampling with the power heuristic. Only
+ * the first surface interaction is considered.
+ *
+ * With \c restir, luminaire samples are instead chosen by reservoir-based
+ * spatiotemporal resampling (Bitterli et al., "Spatiotemporal Reservoir
+ * Resampling for Real-Time Ray Tracing with Dynamic Direct Lighting"),
+ * which needs a single shadow ray per camera ray for the quality of many
+ * luminaire samples. Every camera ray draws \c candidates luminaire
+ * samples and keeps one of them with a probability proportional to its
+ * unshadowed contribution divided by its density (resampled importance
+ * sampling). Since the render threads process the pixels of a pass in
+ * parallel, the reservoir (the kept sample and its weight) of every
+ * pixel is stored per pass, and the reservoirs of the previous pass are
+ * merged in: that of the same pixel (temporal reuse, with at most
+ * \c maxHistory times the candidates of a pass) and those of
+ * \c neighbors random pixels within \c neighborRadius pixels (spatial
+ * reuse). Neighbors whose surface differs in depth by more than 10% or
+ * in orientation by more than 25 degrees are skipped. Only the finally
+ * selected sample is tested for visibility, and occluded ones don't
+ * propagate further. This is the biased variant of the method (each
+ * reservoir counts as many candidates as it has seen), which slightly
+ * darkens contact shadows and edges. BSDF samples then only account for
+ * discrete components, which luminaires can't sample. The renderings
+ * are progressive (one pass per sample per pixel).
+ */
+class DirectIllumination : public Integrator {
+public:
+	DirectIllumination(const PropertyList &propList) {
+		/* Number of luminaire and BSDF samples per camera ray */
+		m_luminaireSamples = propList.getInteger("luminaireSamples", 1);
+		m_bsdfSamples = propList.getInteger("bsdfSamples", 1);
+		if (m_luminaireSamples < 0 || m_bsdfSamples < 0 ||
+			m_luminaireSamples + m_bsdfSamples == 0)
+			throw NoriException("DirectIllumination: the sample counts must be "
+				"nonnegative and not both zero!");
+
+		/* Reservoir-based resampling of the luminaire samples */
+		m_restir = propList.getBoolean("restir", false);
+		m_candidates = propList.getInteger("candidates", 32);
+		m_neighbors = propList.getInteger("neighbors", 4);
+		m_neighborRadius = propList.getFloat("neighborRadius", 16.0f);
+		m_temporalReuse = propList.getBoolean("temporalReuse", true);
+		m_maxHistory = propList.getFloat("maxHistory", 20.0f);
+		if (m_restir && (m_candidates < 1 || m_neighbors < 0 || m_maxHistory <= 0))
+			throw NoriException("DirectIllumination: invalid resampling parameters!");
+		m_passes = m_restir;
+		m_camera = NULL;
+		m_reservoirs[0] = m_reservoirs[1] = NULL;
+	}
+
+	virtual ~DirectIllumination() {
+		delete[] m_reservoirs[0];
+		delete[] m_reservoirs[1];
+	}
+
+	void preprocess(const Scene *scene, int pass) {
+		if (!m_reservoirs[0]) {
+			m_camera = scene->getCamera();
+			m_size = m_camera->getOutputSize();
+			size_t count = (size_t) m_size.x() * m_size.y();
+			for (int i=0; i<2; ++i) {
+				m_reservoirs[i] = new Reservoir[count];
+				memset(m_reservoirs[i], 0, count * sizeof(Reservoir));
+			}
+			return;
+		}
+
+		/* The reservoirs of the pass that just ended are reused by the next one */
+		std::swap(m_reservoirs[0], m_reservoirs[1]);
+	}
+
+	Color3f Li(RenderContext &context, const Ray3f &ray) const {
+		const Scene *scene = context.scene;
+
+		/* Find the surface that is visible in the requested direction */
+		Intersection its;
+		context.rayCount++;
+		if (!context.rayIntersect(ray, its)) {
+			const Luminaire *env = scene->getEnvironmentLuminaire();
+			return env ? env->eval(LuminaireQueryRecord(env, ray.o, ray.d))
+				: Color3f(0.0f);
+		}
+
+		its.computeDifferentialGeometry();
+		its.computeFootprint(ray);
+		if (context.aov)
+			context.aov->set(its);
+
+		/* Radiance emitted by the surface itself */
+		Color3f result(0.0f);
+		const Luminaire *luminaire = its.mesh->getLuminaire();
+		if (luminaire)
+			result += luminaire->eval(LuminaireQueryRecord(luminaire,
+				ray.o, its.p, its.shFrame.n));
+
+		const BSDF *bsdf = its.mesh->getBSDF();
+		if (!bsdf || scene->getLuminaires().empty())
+			return result;
+
+		Vector3f wi = its.toLocal(-ray.d);
+		float lumWeight = 1.0f / m_luminaireSamples,
+		      bsdfWeight = 1.0f / m_bsdfSamples;
+
+		/* Luminaire sampling */
+		if (m_restir)
+			result += resampleLuminaires(context, ray, its, bsdf, wi);
+		for (int i=0; i<m_luminaireSamples && !m_restir; ++i) {
+			LuminaireQueryRecord lRec(its.p);
+			Color3f value = scene->sampleLuminaire(lRec, context.sampler->next2D());
+			if (value.isZero())
+				continue;
+
+			BSDFQueryRecord bRec(wi, its.toLocal(lRec.d), ESolidAngle);
+			bRec.uv = its.uv;
+			bRec.uvWidth = its.uvWidth;
+			Color3f bsdfVal = bsdf->eval(bRec);
+			if (bsdfVal.isZero())
+				continue;
+
+			Ray3f shadowRay(its.p, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+			shadowRay.time = ray.time;
+			context.shadowRayCount++;
+			if (scene->rayIntersect(shadowRay))
+				continue;
+
+			/* BSDF samples never hit emitting media */
+			float bsdfPdf = m_bsdfSamples > 0 && !lRec.luminaire->isVolume()
+				? bsdf->pdf(bRec) : 0.0f;
+			float weight = miWeight(lRec.pdf * m_luminaireSamples,
+				bsdfPdf * m_bsdfSamples);
+			result += value * bsdfVal * std::abs(Frame::cosTheta(bRec.wo))
+				* weight * lumWeight;
+		}
+
+		/* BSDF sampling */
+		for (int i=0; i<m_bsdfSamples; ++i) {
+			BSDFQueryRecord bRec(wi);
+			bRec.uv = its.uv;
+			bRec.uvWidth = its.uvWidth;
+			Color3f bsdfVal = bsdf->sample(bRec, context.sampler->next2D());
+			if (bsdfVal.isZero() || (m_restir && bRec.measure != EDiscrete))
+				continue;
+
+			/* Find the luminaire in the sampled direction (if any) */
+			Ray3f bsdfRay(its.p, its.toWorld(bRec.wo));
+			bsdfRay.time = ray.time;
+			Intersection lumIts;
+			LuminaireQueryRecord lRec(its.p);
+			context.rayCount++;
+			if (scene->rayIntersect(bsdfRay, lumIts)) {
+				if (!lumIts.mesh->isLuminaire())
+					continue;
+				lumIts.computeDifferentialGeometry();
+				lRec = LuminaireQueryRecord(lumIts.mesh->getLuminaire(),
+					its.p, lumIts.p, lumIts.shFrame.n);
+				lRec.triangle = lumIts.primIndex;
+			} else {
+				if (!scene->getEnvironmentLuminaire())
+					continue;
+				lRec = LuminaireQueryRecord(scene->getEnvironmentLuminaire(),
+					its.p, bsdfRay.d);
+			}
+			Color3f value = lRec.luminaire->eval(lRec);
+			if (value.isZero())
+				continue;
+
+			/* Discrete BSDF components can't be sampled by the luminaires */
+			float weight = 1.0f;
+			if (bRec.measure != EDiscrete && m_luminaireSamples > 0 && !m_restir)
+				weight = miWeight(bsdf->pdf(bRec) * m_bsdfSamples,
+					scene->pdfLuminaire(lRec) * m_luminaireSamples);
+			result += value * bsdfVal * weight * bsdfWeight;
+		}
+
+		return result;
+	}
+
+	QString toString() const {
+		if (m_restir)
+			return QString("DirectIllumination[restir, candidates=%1, neighbors=%2, "
+				"neighborRadius=%3, temporalReuse=%4, maxHistory=%5, bsdfSamples=%6]")
+				.arg(m_candidates).arg(m_neighbors).arg(m_neighborRadius)
+				.arg(m_temporalReuse ? "true" : "false").arg(m_maxHistory)
+				.arg(m_bsdfSamples);
+		return QString("DirectIllumination[luminaireSamples=%1, bsdfSamples=%2]")
+			.arg(m_luminaireSamples).arg(m_bsdfSamples);
+	}
+private:
+	/**
+	 * \brief Luminaire sample that was kept by the resampling of a pixel,
+	 * together with its weight
+	 */
+	struct Reservoir {
+		/// Sampled luminaire (\c NULL if there is no sample)
+		const Luminaire *luminaire;
+		/// Position on the luminaire, or direction for environment luminaires
+		Point3f p;
+		/// Surface normal at \ref p (see \ref encodeNormal())
+		uint32_t n;
+		/// Triangle containing \ref p (see \ref LuminaireQueryRecord::triangle)
+		uint32_t triangle;
+		/// Contribution weight of the sample (zero if it is occluded)
+		float W;
+		/// Number of candidates that the reservoir has seen
+		float M;
+		/// Distance of the shaded point from the camera
+		float depth;
+		/// Shading normal of the shaded point (see \ref encodeNormal())
+		uint32_t refNormal;
+	};
+
+	/// Reservoir while it is being updated with candidates
+	struct Selection {
+		const Luminaire *luminaire;
+		Point3f p;
+		Normal3f n;
+		uint32_t triangle;
+		/// Unshadowed contribution of the kept sample and its luminance (the target density)
+		Color3f contribution;
+		float target;
+		float weightSum, M;
+
+		inline Selection() : luminaire(NULL), triangle((uint32_t) -1),
+			contribution(0.0f), target(0.0f), weightSum(0.0f), M(0.0f) { }
+
+		/// Add a candidate, and keep it with probability proportional to its weight
+		inline void update(const Luminaire *lum, const Point3f &pos, const Normal3f &normal,
+				uint32_t tri, const Color3f &value, float targetPdf, float weight,
+				float count, float sample) {
+			weightSum += weight;
+			M += count;
+			if (weight > 0 && sample * weightSum < weight) {
+				luminaire = lum;
+				p = pos;
+				n = normal;
+				triangle = tri;
+				contribution = value;
+				target = targetPdf;
+			}
+		}
+	};
+
+	/**
+	 * \brief Return the unshadowed contribution of a luminaire sample to
+	 * the shaded point with respect to the measure of the reservoirs
+	 * (surface area, volume or solid angle for environment luminaires)
+	 *
+	 * \param G
+	 *     Receives the factor converting solid angles at the shaded
+	 *     point to that measure
+	 */
+	Color3f evalSample(const Intersection &its, const BSDF *bsdf, const Vector3f &wi,
+			const Luminaire *luminaire, const Point3f &p, const Normal3f &n,
+			uint32_t triangle, Vector3f &d, float &dist, float &G) const {
+		LuminaireQueryRecord lRec(its.p);
+		if (luminaire->isEnvironment()) {
+			lRec = LuminaireQueryRecord(luminaire, its.p, Vector3f(p));
+			G = 1.0f;
+		} else {
+			lRec = LuminaireQueryRecord(luminaire, its.p, p, n);
+			lRec.triangle = triangle;
+			G = (luminaire->isVolume() ? 1.0f : std::abs(n.dot(lRec.d)))
+				/ (lRec.dist * lRec.dist);
+		}
+		d = lRec.d;
+		dist = lRec.dist;
+		if (!(G > 0))
+			return Color3f(0.0f);
+		Color3f value = luminaire->eval(lRec);
+		if (value.isZero())
+			return Color3f(0.0f);
+
+		BSDFQueryRecord bRec(wi, its.toLocal(d), ESolidAngle);
+		bRec.uv = its.uv;
+		bRec.uvWidth = its.uvWidth;
+		return value * bsdf->eval(bRec) * (std::abs(Frame::cosTheta(bRec.wo)) * G);
+	}
+
+	/// Merge the stored reservoir of a pixel into a selection
+	void mergeReservoir(const Reservoir &r, float maxM, const Intersection &its,
+			const BSDF *bsdf, const Vector3f &wi, float depth, Selection &selection,
+			float sample) const {
+		if (!r.luminaire || r.M <= 0)
+			return;
+
+		/* Skip neighbors on dissimilar surfaces */
+		if (std::abs(r.depth - depth) > 0.1f * depth ||
+				decodeNormal(r.refNormal).dot(its.shFrame.n) < 0.906f)
+			return;
+
+		Vector3f d;
+		float dist, G, M = std::min(r.M, maxM);
+		Normal3f n = decodeNormal(r.n);
+		Color3f value = evalSample(its, bsdf, wi, r.luminaire, r.p, n, r.triangle, d, dist, G);
+		float target = value.getLuminance();
+		selection.update(r.luminaire, r.p, n, r.triangle, value, target,
+			target * r.W * M, M, sample);
+	}
+
+	/**
+	 * \brief Estimate the direct illumination of a surface using
+	 * reservoir-based resampling (see the class description)
+	 */
+	Color3f resampleLuminaires(RenderContext &context, const Ray3f &ray,
+			const Intersection &its, const BSDF *bsdf, const Vector3f &wi) const {
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+
+		/* Resampled importance sampling of the initial candidates */
+		Selection selection;
+		for (int i=0; i<m_candidates; ++i) {
+			LuminaireQueryRecord lRec(its.p);
+			if (scene->sampleLuminaire(lRec, sampler->next2D()).isZero()) {
+				selection.M += 1;
+				continue;
+			}
+			Point3f p = lRec.luminaire->isEnvironment() ? Point3f(lRec.d) : lRec.p;
+			Vector3f d;
+			float dist, G;
+			Color3f value = evalSample(its, bsdf, wi, lRec.luminaire, p, lRec.n,
+				lRec.triangle, d, dist, G);
+			float target = value.getLuminance();
+			selection.update(lRec.luminaire, p, lRec.n, lRec.triangle, value, target,
+				target > 0 ? target / (lRec.pdf * G) : 0.0f, 1.0f, sampler->next1D());
+		}
+
+		/* Reuse the reservoirs of the previous pass */
+		Point2i pixel = context.pixelIndex;
+		bool stored = m_reservoirs[0] && context.camera == m_camera
+			&& (pixel.array() >= 0).all() && (pixel.array() < m_size.array()).all();
+		float depth = its.t;
+		if (stored) {
+			const Reservoir *previous = m_reservoirs[1];
+			float maxM = m_maxHistory * m_candidates;
+			if (m_temporalReuse)
+				mergeReservoir(previous[pixel.y() * m_size.x() + pixel.x()], maxM,
+					its, bsdf, wi, depth, selection, sampler->next1D());
+			for (int i=0; i<m_neighbors; ++i) {
+				Point2f offset = squareToUniformDisk(sampler->next2D()) * m_neighborRadius;
+				Point2i q(pixel.x() + (int) std::floor(offset.x() + 0.5f),
+				          pixel.y() + (int) std::floor(offset.y() + 0.5f));
+				if ((q.array() < 0).any() || (q.array() >= m_size.array()).any() || q == pixel)
+					continue;
+				mergeReservoir(previous[q.y() * m_size.x() + q.x()], maxM,
+					its, bsdf, wi, depth, selection, sampler->next1D());
+			}
+		}
+
+		/* Trace a shadow ray toward the selected sample only */
+		Color3f result(0.0f);
+		float W = 0.0f;
+		if (selection.luminaire && selection.target > 0) {
+			W = selection.weightSum / (selection.M * selection.target);
+			Vector3f d;
+			float dist, G;
+			evalSample(its, bsdf, wi, selection.luminaire,
+				selection.p, selection.n, selection.triangle, d, dist, G);
+			Ray3f shadowRay(its.p, d, Epsilon, selection.luminaire->isEnvironment()
+				? std::numeric_limits<float>::infinity() : dist * (1 - Epsilon));
+			shadowRay.time = ray.time;
+			context.shadowRayCount++;
+			if (scene->rayIntersect(shadowRay))
+				W = 0.0f;
+			else
+				result = selection.contribution * W;
+		}
+
+		if (stored) {
+			Reservoir &r = m_reservoirs[0][pixel.y() * m_size.x() + pixel.x()];
+			r.luminaire = selection.luminaire;
+			r.p = selection.p;
+			r.n = encodeNormal(selection.luminaire ? selection.n : Normal3f(0.0f, 0.0f, 1.0f));
+			r.triangle = selection.triangle;
+			r.W = W;
+			r.M = selection.M;
+			r.depth = depth;
+			r.refNormal = encodeNormal(its.shFrame.n);
+		}
+		return result;
+	}
+
+	/// Power heuristic
+	inline float miWeight(float pdfA, float pdfB) const {
+		pdfA *= pdfA; pdfB *= pdfB;
+		return pdfA > 0 ? pdfA / (pdfA + pdfB) : 0.0f;
+	}
+
+	int m_luminaireSamples;
+	int m_bsdfSamples;
+
+	/* Reservoir-based resampling */
+	bool m_restir, m_temporalReuse;
+	int m_candidates, m_neighbors;
+	float m_neighborRadius, m_maxHistory;
+	const Camera *m_camera;
+	Vector2i m_size;
+	/// Reservoirs of the current and the previous pass (one per pixel)
+	Reservoir *m_reservoirs[2];
+};
+
+NORI_REGISTER_CLASS(DirectIllumination, "direct");
+NORI_NAMESPACE_END
@@ -0,0 +1,371 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/displaced.h>
+#include <nori/texture.h>
+#include <nori/bsdf.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+DisplacedMesh::DisplacedMesh(const PropertyList &propList)
+		: m_cage(NULL), m_displacement(NULL) {
+	/* Every patch is split into 4^subdivisions triangles */
+	m_level = propList.getInteger("subdivisions", 4);
+	if (m_level < 0 || m_level > NORI_DISPLACED_MAXLEVEL)
+		throw NoriException(QString("DisplacedMesh: the subdivision level "
+			"must be in [0, %1]!").arg(NORI_DISPLACED_MAXLEVEL));
+	m_resolution = 1u << m_level;
+
+	/* Displacement = scale * texture luminance, clamped to [-bound, bound] */
+	m_scale = propList.getFloat("scale", 1.0f);
+	m_bound = propList.getFloat("bound", std::abs(m_scale));
+	if (m_bound < 0)
+		throw NoriException("DisplacedMesh: the displacement bound must be nonnegative!");
+
+	/* Blend between the flat triangle (0) and the Phong surface (1) */
+	m_shapeFactor = propList.getFloat("shapeFactor", 0.75f);
+
+	m_cacheID = GeometryCache::getInstance()->registerMesh();
+}
+
+DisplacedMesh::~DisplacedMesh() {
+	delete m_cage;
+	delete m_displacement;
+}
+
+void DisplacedMesh::addChild(NoriObject *obj) {
+	switch (obj->getClassType()) {
+		case EMesh:
+			if (m_cage)
+				throw NoriException("DisplacedMesh: tried to register multiple cage meshes!");
+			if (static_cast<Mesh *>(obj)->isProcedural())
+				throw NoriException("DisplacedMesh: the cage must be a triangle mesh!");
+			m_cage = static_cast<Mesh *>(obj);
+			break;
+
+		case ETexture:
+			if (m_displacement)
+				throw NoriException("DisplacedMesh: tried to register multiple displacement textures!");
+			m_displacement = static_cast<Texture *>(obj);
+			break;
+
+		default:
+			Mesh::addChild(obj);
+	}
+}
+
+void DisplacedMesh::activate() {
+	if (!m_cage)
+		throw NoriException("DisplacedMesh: no cage mesh was specified!");
+	if (!m_cage->hasVertexNormals())
+		throw NoriException("DisplacedMesh: the cage mesh needs vertex normals!");
+	if (m_luminaire)
+		throw NoriException("Displaced meshes can't be luminaires!");
+	if (m_interiorMedium)
+		throw NoriException("Displaced meshes can't have an interior medium!");
+	m_name = m_cage->getName();
+
+	if (!m_bsdf) {
+		/* If no material was assigned, instantiate a diffuse BRDF */
+		m_bsdf = static_cast<BSDF *>(
+			NoriObjectFactory::createInstance("diffuse", PropertyList()));
+	}
+
+	/* The Phong surface of a patch is a quadratic triangular Bezier patch,
+	   hence it lies within the convex hull of its six control points */
+	const uint32_t *indices = m_cage->getIndices();
+	const Point3f *positions = m_cage->getVertexPositions();
+	float alpha = m_shapeFactor;
+	m_bboxes.resize(m_cage->getTriangleCount());
+	for (uint32_t i=0; i<m_cage->getTriangleCount(); ++i) {
+		BoundingBox3f bbox;
+		for (int k=0; k<3; ++k) {
+			uint32_t a = indices[3*i + k], b = indices[3*i + (k+1) % 3];
+			const Point3f &pa = positions[a], &pb = positions[b];
+			Normal3f na = m_cage->getVertexNormal(a), nb = m_cage->getVertexNormal(b);
+
+			/* Projections of each end point onto the tangent plane of the other one */
+			Point3f projA = pb - na * (pb - pa).dot(na),
+			        projB = pa - nb * (pa - pb).dot(nb);
+			bbox.expandBy(pa);
+			bbox.expandBy(Point3f((pa + pb) * (0.5f * (1 - alpha))
+				+ (projA + projB) * (0.5f * alpha)));
+		}
+		bbox.min -= Vector3f::Constant(m_bound);
+		bbox.max += Vector3f::Constant(m_bound);
+		m_bboxes[i] = bbox;
+	}
+}
+
+Point3f DisplacedMesh::evalBase(uint32_t index, const Point2f &bary, Normal3f &n) const {
+	const uint32_t *indices = m_cage->getIndices() + 3*index;
+	const Point3f *positions = m_cage->getVertexPositions();
+	Normal3f normals[3];
+	for (int k=0; k<3; ++k)
+		normals[k] = m_cage->getVertexNormal(indices[k]);
+	float b[3] = { 1 - bary.x() - bary.y(), bary.x(), bary.y() };
+
+	Point3f p = Point3f::Zero();
+	n = Normal3f::Zero();
+	for (int k=0; k<3; ++k) {
+		p += positions[indices[k]] * b[k];
+		n += normals[k] * b[k];
+	}
+
+	/* Phong tessellation: interpolate the projections of the
+	   point onto the tangent planes of the three vertices */
+	Point3f proj = Point3f::Zero();
+	for (int k=0; k<3; ++k) {
+		const Point3f &pk = positions[indices[k]];
+		const Normal3f &nk = normals[k];
+		proj += (p - nk * (p - pk).dot(nk)) * b[k];
+	}
+
+	float length = n.norm();
+	if (length > 0)
+		n /= length;
+	return p * (1 - m_shapeFactor) + proj * m_shapeFactor;
+}
+
+Point2f DisplacedMesh::evalTexCoords(uint32_t index, const Point2f &bary) const {
+	if (!m_cage->hasVertexTexCoords())
+		return bary;
+	const uint32_t *indices = m_cage->getIndices() + 3*index;
+	return m_cage->getVertexTexCoord(indices[0]) * (1 - bary.x() - bary.y())
+		+ m_cage->getVertexTexCoord(indices[1]) * bary.x()
+		+ m_cage->getVertexTexCoord(indices[2]) * bary.y();
+}
+
+TessellatedPatch *DisplacedMesh::tessellate(uint32_t index) const {
+	uint32_t N = m_resolution;
+	TessellatedPatch *patch = new TessellatedPatch((N+1) * (N+2) / 2, N * N);
+	float invN = 1.0f / N;
+
+	/* Place the vertices of the triangular grid (row j has N-j+1 of them) */
+	for (uint32_t j=0; j<=N; ++j) {
+		for (uint32_t i=0; i<=N-j; ++i) {
+			Point2f bary(i * invN, j * invN);
+			Normal3f n;
+			Point3f p = evalBase(index, bary, n);
+			if (m_displacement) {
+				float d = m_scale * m_displacement->eval(
+					evalTexCoords(index, bary)).getLuminance();
+				p += n * clamp(d, -m_bound, m_bound);
+			}
+			patch->positions[vertexIndex(i, j)] = p;
+			patch->normals[vertexIndex(i, j)] = n;
+		}
+	}
+
+	/* Create the triangles row by row, alternating between upward and
+	   downward facing ones, and accumulate the normals of the displaced
+	   surface (weighted by the triangle areas) */
+	std::vector<Normal3f> faceNormals;
+	if (m_displacement)
+		faceNormals.resize(patch->vertexCount, Normal3f::Zero());
+	BoundingBox3f blockBBox;
+	uint32_t tri = 0;
+	for (uint32_t j=0; j<N; ++j) {
+		for (uint32_t i=0; i<N-j; ++i) {
+			for (int down=0; down<2; ++down) {
+				if (down && i + 1 == N - j)
+					break;
+				uint32_t v0 = down ? vertexIndex(i+1, j) : vertexIndex(i, j),
+				         v1 = down ? vertexIndex(i+1, j+1) : vertexIndex(i+1, j),
+				         v2 = vertexIndex(i, j+1);
+				const Point3f &p0 = patch->positions[v0],
+				              &p1 = patch->positions[v1],
+				              &p2 = patch->positions[v2];
+
+				patch->blocks[tri / 4].set(tri % 4, p0, p1, p2, 0, tri);
+				blockBBox.expandBy(p0);
+				blockBBox.expandBy(p1);
+				blockBBox.expandBy(p2);
+
+				if (m_displacement) {
+					Normal3f n((p1 - p0).cross(p2 - p0));
+					faceNormals[v0] += n;
+					faceNormals[v1] += n;
+					faceNormals[v2] += n;
+				}
+
+				if (++tri % 4 == 0) {
+					uint32_t block = tri / 4 - 1;
+					patch->groups[block / 4].set(block % 4, blockBBox);
+					blockBBox.reset();
+				}
+			}
+		}
+	}
+
+	/* Pad the last block and group */
+	if (tri % 4 != 0) {
+		for (uint32_t k=tri % 4; k<4; ++k)
+			patch->blocks[tri / 4].clear(k);
+		patch->groups[(tri / 4) / 4].set((tri / 4) % 4, blockBBox);
+	}
+	for (uint32_t block=patch->blockCount; block<4 * patch->groupCount; ++block)
+		patch->groups[block / 4].clear(block % 4);
+
+	/* Keep the normals of the base surface where the displaced one is degenerate */
+	for (uint32_t k=0; k<faceNormals.size(); ++k) {
+		float length = faceNormals[k].norm();
+		if (length > 0)
+			patch->normals[k] = faceNormals[k] / length;
+	}
+
+	return patch;
+}
+
+bool DisplacedMesh::rayIntersect(uint32_t index, const Ray3f &ray, float maxt,
+		float &t, Point2f &uv) const {
+	const TessellatedPatch *patch = GeometryCache::getInstance()->getPatch(this, index);
+	uint32_t foundTri = NORI_TRIACCEL_INVALID;
+	float foundU = 0, foundV = 0;
+
+	for (uint32_t group=0; group<patch->groupCount; ++group) {
+		float nearT[4];
+		int boxHits = patch->groups[group].rayIntersect(ray, ray.mint, maxt, nearT);
+		for (int lane=0; lane<4; ++lane) {
+			if (!(boxHits & (1 << lane)) || nearT[lane] > maxt)
+				continue;
+
+			const TriAccel4 &block = patch->blocks[4 * group + lane];
+			float u[4], v[4], tri[4];
+			int triHits = block.rayIntersect(ray, ray.mint, maxt, u, v, tri);
+			for (int i=0; i<4; ++i) {
+				if ((triHits & (1 << i)) && tri[i] <= maxt) {
+					maxt = tri[i];
+					foundTri = block.prim[i];
+					foundU = u[i];
+					foundV = v[i];
+				}
+			}
+		}
+	}
+
+	if (foundTri == NORI_TRIACCEL_INVALID)
+		return false;
+	t = maxt;
+
+	/* Find the row and column of the triangle, and convert the
+	   barycentric coordinates to those of the cage triangle */
+	uint32_t N = m_resolution, j = 0, k = foundTri;
+	while (k >= 2 * (N - j) - 1) {
+		k -= 2 * (N - j) - 1;
+		++j;
+	}
+	float i = (float) (k / 2), row = (float) j, x, y;
+	if (k % 2 == 0) {
+		/* Upward facing: (i, j), (i+1, j), (i, j+1) */
+		x = i + foundU;
+		y = row + foundV;
+	} else {
+		/* Downward facing: (i+1, j), (i+1, j+1), (i, j+1) */
+		x = i + 1 - foundV;
+		y = row + foundU + foundV;
+	}
+	uv = Point2f(x / N, y / N);
+	return true;
+}
+
+void DisplacedMesh::computeDifferentialGeometry(const Ray3f &ray, Intersection &its) const {
+	const TessellatedPatch *patch = GeometryCache::getInstance()->getPatch(this, its.primIndex);
+
+	/* Find the triangle of the grid that contains the intersection */
+	uint32_t N = m_resolution;
+	float x = its.bary.x() * N, y = its.bary.y() * N;
+	uint32_t j = std::min((uint32_t) std::max(y, 0.0f), N - 1),
+	         i = std::min((uint32_t) std::max(x, 0.0f), N - 1 - j);
+	float fx = x - i, fy = y - j, s, t;
+	uint32_t idx[3];
+	Point2f grid[3];
+	if (fx + fy <= 1 || i + j + 1 == N) {
+		idx[0] = vertexIndex(i, j);   grid[0] = Point2f((float) i, (float) j);
+		idx[1] = vertexIndex(i+1, j); grid[1] = Point2f((float) i + 1, (float) j);
+		s = fx; t = fy;
+	} else {
+		idx[0] = vertexIndex(i+1, j);   grid[0] = Point2f((float) i + 1, (float) j);
+		idx[1] = vertexIndex(i+1, j+1); grid[1] = Point2f((float) i + 1, (float) j + 1);
+		s = fx + fy - 1; t = 1 - fx;
+	}
+	idx[2] = vertexIndex(i, j+1);
+	grid[2] = Point2f((float) i, (float) j + 1);
+	s = std::max(s, 0.0f);
+	t = std::max(t, 0.0f);
+	float b[3] = { std::max(1 - s - t, 0.0f), s, t };
+
+	const Point3f &p0 = patch->positions[idx[0]],
+	              &p1 = patch->positions[idx[1]],
+	              &p2 = patch->positions[idx[2]];
+	its.p = p0 * b[0] + p1 * b[1] + p2 * b[2];
+
+	Vector3f shNormal = (patch->normals[idx[0]] * b[0] + patch->normals[idx[1]] * b[1]
+		+ patch->normals[idx[2]] * b[2]).normalized();
+	Vector3f geoNormal = (p1 - p0).cross(p2 - p0);
+	float length = geoNormal.norm();
+	geoNormal = length > 0 ? Vector3f(geoNormal / length) : shNormal;
+
+	/* Partial derivatives of the position wrt. the texture coordinates */
+	its.uv = evalTexCoords(its.primIndex, its.bary);
+	Point2f uv0 = evalTexCoords(its.primIndex, grid[0] / (float) N);
+	Vector2f duv1 = evalTexCoords(its.primIndex, grid[1] / (float) N) - uv0,
+	         duv2 = evalTexCoords(its.primIndex, grid[2] / (float) N) - uv0;
+	float det = duv1.x() * duv2.y() - duv1.y() * duv2.x();
+	if (std::abs(det) > 1e-12f) {
+		float invDet = 1.0f / det;
+		its.dpdu = ((p1 - p0) * duv2.y() - (p2 - p0) * duv1.y()) * invDet;
+		its.dpdv = ((p2 - p0) * duv1.x() - (p1 - p0) * duv2.x()) * invDet;
+	} else {
+		/* Degenerate parameterization */
+		its.dpdu = its.dpdv = Vector3f::Zero();
+	}
+	its.dpdx = its.dpdy = Vector3f::Zero();
+	its.uvWidth = 0.0f;
+
+	its.geoFrame = Frame(geoNormal);
+	its.shFrame = Frame(shNormal);
+	its.toWorldTrafo = NULL;
+	its.hasDifferentials = true;
+}
+
+QString DisplacedMesh::toString() const {
+	return QString(
+		"DisplacedMesh[\n"
+		"  name = \"%1\",\n"
+		"  patchCount = %2,\n"
+		"  subdivisions = %3,\n"
+		"  scale = %4,\n"
+		"  bound = %5,\n"
+		"  shapeFactor = %6,\n"
+		"  displacement = %7,\n"
+		"  bsdf = %8\n"
+		"]")
+	.arg(m_name)
+	.arg(m_cage->getTriangleCount())
+	.arg(m_level)
+	.arg(m_scale)
+	.arg(m_bound)
+	.arg(m_shapeFactor)
+	.arg(m_displacement ? indent(m_displacement->toString()) : QString("null"))
+	.arg(indent(m_bsdf->toString()));
+}
+
+NORI_REGISTER_CLASS(DisplacedMesh, "displaced");
+NORI_NAMESPACE_END
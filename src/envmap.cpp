@@ -0,0 +1,269 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/luminaire.h>
+#include <nori/bitmap.h>
+#include <nori/transform.h>
+#include <nori/dpdf.h>
+#include <nori/memreport.h>
+#include <nori/frame.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Environment luminaire that surrounds the scene with radiance
+ * from a latitude-longitude map (OpenEXR file)
+ *
+ * In the local coordinate system of the luminaire (see the \c toWorld
+ * parameter), the rows of the map go from the +Z pole to the -Z pole,
+ * and the columns go around the Z axis starting at +X.
+ *
+ * Directions are importance sampled from a piecewise constant density
+ * that is proportional to the luminance of the pixels times the sine
+ * of their polar angle (i.e. the solid angle they cover). A row is
+ * chosen from the marginal distribution and then a column from the
+ * row's conditional distribution -- both are constant-time alias table
+ * lookups, and so is the evaluation of the density.
+ *
+ * The map is loaded into a \ref MipBitmap, optionally with half precision
+ * (\c halfPrecision). The density is tabulated over the first level of
+ * its pyramid that is at most \c samplingResolution pixels wide, which
+ * keeps the tables of large maps small and in cache; a sampled pixel of
+ * that level is then covered uniformly, and its radiance is looked up
+ * at full resolution.
+ */
+class EnvironmentLuminaire : public Luminaire {
+public:
+	EnvironmentLuminaire(const PropertyList &propList) : m_samplingLevel(0), m_sceneRadius(0) {
+		m_filename = propList.getString("filename");
+		m_toWorld = propList.getTransform("toWorld", Transform());
+		m_toLocal = m_toWorld.inverse();
+		m_scale = propList.getFloat("scale", 1.0f);
+		if (m_scale < 0)
+			throw NoriException(QString("EnvironmentLuminaire: invalid scale %1 "
+				"(must be >= 0)").arg(m_scale));
+
+		/* Store the map with half precision */
+		m_halfPrecision = propList.getBoolean("halfPrecision", false);
+
+		/* Maximum width of the level of the map that the sampling density is built from */
+		m_samplingResolution = propList.getInteger("samplingResolution", 4096);
+		if (m_samplingResolution < 1)
+			throw NoriException(QString("EnvironmentLuminaire: invalid samplingResolution "
+				"%1 (must be >= 1)").arg(m_samplingResolution));
+	}
+
+	void activate() {
+		cout << "Loading \"" << qPrintable(m_filename) << "\" .." << endl;
+		m_map = MipBitmap(m_filename, m_halfPrecision);
+		if (m_map.getWidth() == 0 || m_map.getHeight() == 0)
+			throw NoriException(QString("EnvironmentLuminaire: \"%1\" is empty!").arg(m_filename));
+
+		m_samplingLevel = 0;
+		while (m_samplingLevel + 1 < m_map.getLevelCount()
+				&& m_map.getWidth(m_samplingLevel) > m_samplingResolution)
+			++m_samplingLevel;
+		int height = m_map.getHeight(m_samplingLevel), width = m_map.getWidth(m_samplingLevel);
+
+		/* Tabulate the sampling density over the pixels: luminance
+		   times the sine of the polar angle at the row's center */
+		m_rowPDF.clear();
+		m_rowPDF.reserve(height);
+		m_columnPDFs.resize(height);
+		for (int i=0; i<height; ++i) {
+			float sinTheta = std::sin((i + 0.5f) * M_PI / height);
+			DiscretePDF &columnPDF = m_columnPDFs[i];
+			columnPDF.clear();
+			columnPDF.reserve(width);
+			for (int j=0; j<width; ++j)
+				columnPDF.append(std::max(m_map.lookup(m_samplingLevel, i, j)
+					.getLuminance(), 0.0f) * sinTheta);
+			m_rowPDF.append(columnPDF.normalize());
+		}
+
+		/* Integral of the luminance over the sphere of directions */
+		float sum = m_rowPDF.normalize();
+		m_integral = sum * m_scale * (2 * M_PI / width) * (M_PI / height);
+		if (m_integral <= 0)
+			cerr << "Warning: the environment map \"" << qPrintable(m_filename)
+				 << "\" is black!" << endl;
+	}
+
+	Color3f sample(LuminaireQueryRecord &lRec, const Point2f &_sample) const {
+		if (m_integral <= 0) {
+			lRec.pdf = 0.0f;
+			return Color3f(0.0f);
+		}
+
+		/* Choose a pixel, and reuse the sample for the position within it */
+		Point2f sample(_sample);
+		size_t row = m_rowPDF.sampleReuse(sample.y());
+		size_t col = m_columnPDFs[row].sampleReuse(sample.x());
+
+		float u = (col + sample.x()) / m_map.getWidth(m_samplingLevel),
+		      v = (row + sample.y()) / m_map.getHeight(m_samplingLevel);
+		float theta = v * M_PI, phi = u * 2 * M_PI;
+		float sinTheta, cosTheta, sinPhi, cosPhi;
+		sincosf(theta, &sinTheta, &cosTheta);
+		sincosf(phi, &sinPhi, &cosPhi);
+
+		lRec.luminaire = this;
+		lRec.d = (m_toWorld * Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta)).normalized();
+		lRec.dist = std::numeric_limits<float>::infinity();
+		lRec.p = lRec.ref + lRec.d * (2 * m_sceneRadius);
+		lRec.n = Normal3f(-lRec.d);
+		lRec.pdf = pdf(row, col, sinTheta);
+		if (lRec.pdf <= 0)
+			return Color3f(0.0f);
+
+		/* The radiance of the full resolution pixel at the sampled position */
+		int width = m_map.getWidth(), height = m_map.getHeight();
+		return m_map.lookup(0, clamp((int) (v * height), 0, height - 1),
+			clamp((int) (u * width), 0, width - 1)) * (m_scale / lRec.pdf);
+	}
+
+	Color3f sampleRay(LuminaireQueryRecord &lRec, Ray3f &ray,
+			const Point2f &positionSample, const Point2f &directionSample) const {
+		/* Sample the direction towards the environment, and then an origin
+		   on a disk that covers the scene as seen from that direction */
+		LuminaireQueryRecord dRec(m_sceneCenter);
+		Color3f value = sample(dRec, directionSample);
+		if (value.isZero())
+			return value;
+
+		Point2f p = squareToUniformDiskConcentric(positionSample) * m_sceneRadius;
+		Frame frame(dRec.d);
+		lRec.luminaire = this;
+		lRec.p = m_sceneCenter + m_sceneRadius * dRec.d + frame.s * p.x() + frame.t * p.y();
+		lRec.n = Normal3f(-dRec.d);
+		lRec.pdf = 0.0f;
+		ray = Ray3f(lRec.p, -dRec.d);
+
+		/* Divide by the density 1 / (pi r^2) of the origin */
+		return value * (M_PI * m_sceneRadius * m_sceneRadius);
+	}
+
+	Color3f eval(const LuminaireQueryRecord &lRec) const {
+		int row, col;
+		lookup(lRec.d, 0, row, col);
+		return m_map.lookup(0, row, col) * m_scale;
+	}
+
+	float pdf(const LuminaireQueryRecord &lRec) const {
+		if (m_integral <= 0)
+			return 0.0f;
+		int row, col;
+		float cosTheta = lookup(lRec.d, m_samplingLevel, row, col);
+		return pdf(row, col, std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta)));
+	}
+
+	float getPower() const {
+		/* Flux through a disk that covers the scene from any direction */
+		return m_integral * M_PI * m_sceneRadius * m_sceneRadius;
+	}
+
+	bool isEnvironment() const { return true; }
+
+	void setSceneBounds(const BoundingBox3f &bbox) {
+		m_sceneRadius = std::max(0.5f * bbox.getExtents().norm(), Epsilon);
+		m_sceneCenter = bbox.getCenter();
+	}
+
+	/// Environment luminaires belong to the scene and not to a mesh
+	void setParent(NoriObject *parent) {
+		if (parent->getClassType() != EScene)
+			throw NoriException("EnvironmentLuminaire: can only be a child of the scene!");
+	}
+
+	void reportMemory(MemoryReport &report) const {
+		report.add("environmentMaps", m_map.getMemoryUsage());
+		size_t pdfs = m_rowPDF.getMemoryUsage();
+		for (size_t i=0; i<m_columnPDFs.size(); ++i)
+			pdfs += m_columnPDFs[i].getMemoryUsage();
+		report.add("pdfTables", pdfs);
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString(
+			"EnvironmentLuminaire[\n"
+			"  filename = \"%1\",\n"
+			"  size = %2x%3,\n"
+			"  scale = %4,\n"
+			"  halfPrecision = %5,\n"
+			"  samplingResolution = %6,\n"
+			"  toWorld = %7\n"
+			"]")
+		.arg(m_filename)
+		.arg(m_map.getLevelCount() > 0 ? m_map.getWidth() : 0)
+		.arg(m_map.getLevelCount() > 0 ? m_map.getHeight() : 0)
+		.arg(m_scale)
+		.arg(m_halfPrecision)
+		.arg(m_samplingResolution)
+		.arg(indent(m_toWorld.toString(), 12));
+	}
+private:
+	/**
+	 * \brief Find the pixel of a level of the map in a given world space direction
+	 *
+	 * \return The cosine of the polar angle of the direction
+	 */
+	inline float lookup(const Vector3f &dWorld, int level, int &row, int &col) const {
+		Vector3f d = (m_toLocal * dWorld).normalized();
+		float theta = std::acos(clamp(d.z(), -1.0f, 1.0f)),
+		      phi = std::atan2(d.y(), d.x());
+		if (phi < 0)
+			phi += 2 * M_PI;
+		int height = m_map.getHeight(level), width = m_map.getWidth(level);
+		row = clamp((int) (theta * INV_PI * height), 0, height - 1);
+		col = clamp((int) (phi * INV_TWOPI * width), 0, width - 1);
+		return d.z();
+	}
+
+	/**
+	 * \brief Density of sampling a direction within a given pixel of
+	 * the sampling level (wrt. solid angles)
+	 *
+	 * The density over the unit square (which is piecewise constant)
+	 * is converted using the Jacobian 2*pi^2*sin(theta) of the mapping
+	 * to the sphere.
+	 */
+	inline float pdf(size_t row, size_t col, float sinTheta) const {
+		if (sinTheta <= 0)
+			return 0.0f;
+		float pdfPixel = m_rowPDF[row] * m_columnPDFs[row][col];
+		return pdfPixel * m_map.getHeight(m_samplingLevel) * m_map.getWidth(m_samplingLevel)
+			/ (2 * M_PI * M_PI * sinTheta);
+	}
+
+	QString m_filename;
+	Transform m_toWorld, m_toLocal;
+	float m_scale;
+	bool m_halfPrecision;
+	int m_samplingResolution;
+	MipBitmap m_map;
+	int m_samplingLevel;
+	DiscretePDF m_rowPDF;
+	std::vector<DiscretePDF> m_columnPDFs;
+	float m_integral;
+	float m_sceneRadius;
+	Point3f m_sceneCenter;
+};
+
+NORI_REGISTER_CLASS(EnvironmentLuminaire, "envmap");
+NORI_NAMESPACE_END
@@ -0,0 +1,197 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/film.h>
+#include <nori/block.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Wraps the OpenEXR file, so that film.h doesn't depend on the OpenEXR headers
+struct StreamingFilm::ExrFile {
+	Imf::TiledOutputFile file;
+
+	ExrFile(const char *filename, const Imf::Header &header)
+		: file(filename, header) { }
+};
+
+StreamingFilm::StreamingFilm(const QString &filename, const Vector2i &size,
+		const Point2i &offset, int borderSize, const BitmapSaveOptions &options)
+		: m_filename(filename), m_size(size), m_offset(offset), m_borderSize(borderSize),
+		  m_residentTiles(0), m_peakResidentTiles(0), m_file(NULL) {
+	m_tileSize = options.tileSize > 0 ? options.tileSize : NORI_STREAM_TILE_SIZE;
+	m_tileCount = Vector2i(
+		(size.x() + m_tileSize - 1) / m_tileSize,
+		(size.y() + m_tileSize - 1) / m_tileSize);
+
+	int compression = Bitmap::getExrCompression(options.compression);
+	if (compression < 0)
+		throw NoriException(QString("Unsupported EXR compression method \"%1\"!")
+			.arg(options.compression));
+
+	/* A tile is complete once all blocks overlapping it or its border 
+	   have been added. Count the pixels of these blocks */
+	m_tiles.resize(m_tileCount.x() * m_tileCount.y());
+	for (size_t i=0; i<m_tiles.size(); ++i) {
+		Point2i min, max;
+		getTileRegion((int) i, min, max);
+		int width  = std::min(max.x() + borderSize, size.x()) - std::max(min.x() - borderSize, 0),
+		    height = std::min(max.y() + borderSize, size.y()) - std::max(min.y() - borderSize, 0);
+		m_tiles[i].pending = (int64_t) width * height;
+		m_tiles[i].written = false;
+	}
+
+	cout << "Streaming a " << size.x() << "x" << size.y() << " OpenEXR file to \""
+		 << qPrintable(filename) << "\" (" << m_tiles.size() << " tiles of "
+		 << m_tileSize << "x" << m_tileSize << " pixels)" << endl;
+
+	Imf::Header header(size.x(), size.y());
+	header.insert("comments", Imf::StringAttribute("Generated by Nori"));
+	header.compression() = (Imf::Compression) compression;
+	header.setTileDescription(Imf::TileDescription(m_tileSize, m_tileSize, Imf::ONE_LEVEL));
+
+	/* Tiles are written in the order in which they are completed. With 
+	   any other line order, OpenEXR would buffer them in memory */
+	header.lineOrder() = Imf::RANDOM_Y;
+
+	Imf::PixelType pixelType = options.half ? Imf::HALF : Imf::FLOAT;
+	Imf::ChannelList &channels = header.channels();
+	channels.insert("R", Imf::Channel(pixelType));
+	channels.insert("G", Imf::Channel(pixelType));
+	channels.insert("B", Imf::Channel(pixelType));
+
+	QByteArray filenameUtf8 = filename.toUtf8();
+	m_file = new ExrFile(filenameUtf8.data(), header);
+}
+
+StreamingFilm::~StreamingFilm() {
+	try {
+		/* Tiles that weren't completed (e.g. parts of the image 
+		   that no block covered) are written as they are */
+		for (size_t i=0; i<m_tiles.size(); ++i) {
+			if (!m_tiles[i].written)
+				writeTile((int) i, m_tiles[i].pixels);
+		}
+		delete m_file;
+	} catch (const std::exception &ex) {
+		cerr << "Unable to finish the OpenEXR file \"" << qPrintable(m_filename)
+			 << "\": " << ex.what() << endl;
+	}
+
+	cout << "Finished streaming \"" << qPrintable(m_filename) << "\" (at most "
+		 << m_peakResidentTiles << " of " << m_tiles.size() 
+		 << " tiles were kept in memory)" << endl;
+}
+
+void StreamingFilm::getTileRegion(int index, Point2i &min, Point2i &max) const {
+	int tx = index % m_tileCount.x(), ty = index / m_tileCount.x();
+	min = Point2i(tx * m_tileSize, ty * m_tileSize);
+	max = Point2i(
+		std::min(min.x() + m_tileSize, m_size.x()),
+		std::min(min.y() + m_tileSize, m_size.y()));
+}
+
+void StreamingFilm::put(const ImageBlock &block) {
+	int border = block.getBorderSize();
+
+	/* Interior of the block relative to the image, the pixels that it 
+	   touches (including the border), and the position of its storage */
+	int bx0 = block.getOffset().x() - m_offset.x(), bx1 = bx0 + block.getSize().x(),
+	    by0 = block.getOffset().y() - m_offset.y(), by1 = by0 + block.getSize().y();
+	int x0 = std::max(bx0 - border, 0), x1 = std::min(bx1 + border, m_size.x()),
+	    y0 = std::max(by0 - border, 0), y1 = std::min(by1 + border, m_size.y());
+	int storageX = bx0 - border, storageY = by0 - border;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	std::vector<std::pair<int, TilePixels> > completed;
+
+	m_mutex.lock();
+	for (int ty=y0 / m_tileSize; ty<=(y1 - 1) / m_tileSize; ++ty) {
+		for (int tx=x0 / m_tileSize; tx<=(x1 - 1) / m_tileSize; ++tx) {
+			int index = ty * m_tileCount.x() + tx;
+			Tile &tile = m_tiles[index];
+			Point2i min, max;
+			getTileRegion(index, min, max);
+			int width = max.x() - min.x();
+
+			if (tile.pixels.empty()) {
+				tile.pixels.resize(width * (max.y() - min.y()), Color4f());
+				m_peakResidentTiles = std::max(m_peakResidentTiles, ++m_residentTiles);
+			}
+
+			/* Add the part of the block that overlaps the tile */
+			int xStart = std::max(x0, min.x()), xEnd = std::min(x1, max.x());
+			for (int y=std::max(y0, min.y()); y<std::min(y1, max.y()); ++y) {
+				const Color4f *source = block.data() + (y - storageY) * block.cols() + (xStart - storageX);
+				Color4f *target = &tile.pixels[(y - min.y()) * width + (xStart - min.x())];
+				for (int x=0; x<xEnd - xStart; ++x)
+					target[x] += source[x];
+			}
+
+			/* The pixels of the block won't affect the tile anymore */
+			int overlapX = std::min(bx1, max.x() + border) - std::max(bx0, min.x() - border),
+			    overlapY = std::min(by1, max.y() + border) - std::max(by0, min.y() - border);
+			if (overlapX > 0 && overlapY > 0)
+				tile.pending -= (int64_t) overlapX * overlapY;
+
+			if (tile.pending == 0 && !tile.written) {
+				tile.written = true;
+				completed.push_back(std::make_pair(index, TilePixels()));
+				completed.back().second.swap(tile.pixels);
+				--m_residentTiles;
+			}
+		}
+	}
+	m_mutex.unlock();
+
+	for (size_t i=0; i<completed.size(); ++i)
+		writeTile(completed[i].first, completed[i].second);
+}
+
+void StreamingFilm::writeTile(int index, const TilePixels &pixels) {
+	Point2i min, max;
+	getTileRegion(index, min, max);
+	int width = max.x() - min.x(), height = max.y() - min.y();
+
+	std::vector<Color3f> normalized(width * height);
+	if (!pixels.empty()) {
+		for (size_t i=0; i<normalized.size(); ++i)
+			normalized[i] = pixels[i].normalized();
+	}
+
+	/* OpenEXR addresses the frame buffer using image coordinates */
+	size_t compStride = sizeof(float),
+	       pixelStride = 3 * compStride,
+	       rowStride = pixelStride * width;
+	char *ptr = reinterpret_cast<char *>(&normalized[0])
+		- min.x() * pixelStride - min.y() * rowStride;
+
+	Imf::FrameBuffer frameBuffer;
+	frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+	frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
+	frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+
+	QMutexLocker locker(&m_writeMutex);
+	m_file->file.setFrameBuffer(frameBuffer);
+	m_file->file.writeTile(index % m_tileCount.x(), index / m_tileCount.x());
+}
+
+NORI_NAMESPACE_END
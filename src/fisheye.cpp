@@ -0,0 +1,168 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/camera.h>
+#include <nori/rfilter.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Fisheye camera with an equidistant projection
+ *
+ * The angle between a ray and the view direction (the camera's z axis)
+ * is proportional to the distance of its film position from the image
+ * center. The field of view \c fov (in degrees, 180 by default, up to 360)
+ * spans the width of the image, so that a square image at 180 degrees 
+ * shows a hemisphere (e.g. a dome master). Pixels outside of this image
+ * circle remain black.
+ *
+ * The image is oriented like that of the perspective camera. The ray
+ * interval is given by the \c nearClip and \c farClip distances, and the
+ * shutter interval is specified as for the perspective camera.
+ */
+class FisheyeCamera : public Camera {
+public:
+	FisheyeCamera(const PropertyList &propList) {
+		/* Width and height in pixels. Default: 1024x1024 */
+		m_outputSize.x() = propList.getInteger("width", 1024);
+		m_outputSize.y() = propList.getInteger("height", 1024);
+
+		/* Name of the view in a multi-view rendering. Default: none */
+		m_name = propList.getString("name", "");
+
+		/* Specifies an optional camera-to-world transformation. Default: none */
+		m_cameraToWorld = propList.getTransform("toWorld", Transform());
+
+		/* Field of view across the width of the image in degrees */
+		m_fov = propList.getFloat("fov", 180.0f);
+
+		/* Near and far clipping distances in world-space units */
+		m_nearClip = propList.getFloat("nearClip", 1e-4f);
+		m_farClip = propList.getFloat("farClip", 1e4f);
+
+		/* Shutter interval (in the time units of the instance motion keys) */
+		m_shutterOpen = propList.getFloat("shutterOpen", 0.0f);
+		m_shutterClose = propList.getFloat("shutterClose", m_shutterOpen);
+		if (m_shutterClose < m_shutterOpen)
+			throw NoriException(QString("FisheyeCamera: the shutter closes (%1) "
+				"before it opens (%2)!").arg(m_shutterClose).arg(m_shutterOpen));
+		if (m_fov <= 0 || m_fov > 360)
+			throw NoriException("FisheyeCamera: the field of view must be in (0, 360]!");
+
+		m_rfilter = NULL;
+	}
+
+	void activate() {
+		/* Film positions relative to the image center, in units of the 
+		   radius of the image circle */
+		m_scale = Vector2f(2.0f / m_outputSize.x(), -2.0f / m_outputSize.x());
+		m_center = Point2f(0.5f * m_outputSize.x(), 0.5f * m_outputSize.y());
+		m_halfFov = 0.5f * degToRad(m_fov);
+		m_origin = m_cameraToWorld * Point3f(0.0f, 0.0f, 0.0f);
+
+		/* If no reconstruction filter was assigned, instantiate a Gaussian filter */
+		if (!m_rfilter)
+			m_rfilter = static_cast<ReconstructionFilter *>(
+				NoriObjectFactory::createInstance("gaussian", PropertyList()));
+	}
+
+	Color3f sampleRay(Ray3f &ray,
+			const Point2f &samplePosition,
+			const Point2f &apertureSample) const {
+		float radius;
+		Vector3f d = direction(samplePosition, radius);
+
+		ray.o = m_origin;
+		ray.d = d;
+		ray.mint = m_nearClip;
+		ray.maxt = radius <= 1.0f ? m_farClip : m_nearClip;
+		ray.update();
+
+		/* Ray differentials: rays through the neighboring pixels */
+		float unused;
+		ray.rxOrigin = ray.ryOrigin = ray.o;
+		ray.rxDirection = direction(samplePosition + Point2f(1.0f, 0.0f), unused);
+		ray.ryDirection = direction(samplePosition + Point2f(0.0f, 1.0f), unused);
+		ray.hasDifferentials = true;
+
+		/* Outside of the image circle (the empty ray interval doesn't hit anything) */
+		return Color3f(radius <= 1.0f ? 1.0f : 0.0f);
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case EReconstructionFilter:
+				if (m_rfilter)
+					throw NoriException("Camera: tried to register multiple reconstruction filters!");
+				m_rfilter = static_cast<ReconstructionFilter *>(obj);
+				break;
+
+			default:
+				throw NoriException(QString("Camera::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString(
+			"FisheyeCamera[\n"
+			"  cameraToWorld = %1,\n"
+			"  outputSize = %2,\n"
+			"  fov = %3,\n"
+			"  clip = [%4, %5],\n"
+			"  shutter = [%6, %7],\n"
+			"  rfilter = %8\n"
+			"]")
+		.arg(indent(m_cameraToWorld.toString(), 18))
+		.arg(m_outputSize.toString())
+		.arg(m_fov)
+		.arg(m_nearClip)
+		.arg(m_farClip)
+		.arg(m_shutterOpen)
+		.arg(m_shutterClose)
+		.arg(indent(m_rfilter->toString()));
+	}
+protected:
+	/**
+	 * \brief Return the world space direction through a film position,
+	 * and its distance from the image center relative to the radius of 
+	 * the image circle
+	 */
+	Vector3f direction(const Point2f &samplePosition, float &radius) const {
+		Vector2f p = (samplePosition - m_center).cwiseProduct(m_scale);
+		radius = p.norm();
+		float theta = radius * m_halfFov, sinTheta = std::sin(theta);
+		Vector3f local(0.0f, 0.0f, 1.0f);
+		if (radius > 0)
+			local = Vector3f(sinTheta * p.x() / radius, sinTheta * p.y() / radius,
+				std::cos(theta));
+		return (m_cameraToWorld * local).normalized();
+	}
+private:
+	Transform m_cameraToWorld;
+	Point3f m_origin;
+	Point2f m_center;
+	Vector2f m_scale;
+	float m_fov, m_halfFov;
+	float m_nearClip;
+	float m_farClip;
+};
+
+NORI_REGISTER_CLASS(FisheyeCamera, "fisheye");
+NORI_NAMESPACE_END
@@ -0,0 +1,170 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/geocache.h>
+#include <nori/displaced.h>
+#include <QMutexLocker>
+
+NORI_NAMESPACE_BEGIN
+
+/// Key of a patch: 24 bits for the mesh and 40 for the patch index
+static inline uint64_t patchKey(uint32_t mesh, uint32_t index) {
+	return ((uint64_t) mesh << 40) | (uint64_t) index;
+}
+
+/// Scramble the bits of a key, so that neighboring patches use different slots
+static inline uint32_t patchHash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t) key;
+}
+
+TessellatedPatch::TessellatedPatch(uint32_t vertexCount, uint32_t triangleCount)
+		: key(0), vertexCount(vertexCount), refs(1), prev(NULL), next(NULL) {
+	blockCount = (triangleCount + 3) / 4;
+	groupCount = (blockCount + 3) / 4;
+	positions = new Point3f[vertexCount];
+	normals = new Normal3f[vertexCount];
+	blocks = static_cast<TriAccel4 *>(allocAligned(blockCount * sizeof(TriAccel4)));
+	groups = static_cast<BoxAccel4 *>(allocAligned(groupCount * sizeof(BoxAccel4)));
+}
+
+TessellatedPatch::~TessellatedPatch() {
+	delete[] positions;
+	delete[] normals;
+	freeAligned(blocks);
+	freeAligned(groups);
+}
+
+GeometryCache::GeometryCache() : m_budget((size_t) NORI_GEOCACHE_DEFAULT_BUDGET << 20),
+	m_nextID(0) {
+}
+
+GeometryCache *GeometryCache::getInstance() {
+	static GeometryCache cache;
+	return &cache;
+}
+
+void GeometryCache::setMemoryBudget(size_t bytes) {
+	m_budget = bytes;
+}
+
+size_t GeometryCache::getMemoryUsage() const {
+	size_t result = 0;
+	for (int i=0; i<NORI_GEOCACHE_SHARDS; ++i) {
+		Shard &shard = const_cast<Shard &>(m_shards[i]);
+		QMutexLocker locker(&shard.mutex);
+		result += shard.memory;
+	}
+	return result;
+}
+
+uint32_t GeometryCache::registerMesh() {
+	/* IDs are never reused (see TextureCache::registerImage()) */
+	int id = m_nextID.fetchAndAddOrdered(1);
+	if (id >= (1 << 24))
+		throw NoriException("GeometryCache: too many meshes were created!");
+	return (uint32_t) id;
+}
+
+const TessellatedPatch *GeometryCache::getPatch(const DisplacedMesh *mesh, uint32_t index) {
+	uint64_t key = patchKey(mesh->getCacheID(), index);
+
+	if (!m_threadPatches.hasLocalData())
+		m_threadPatches.setLocalData(new ThreadPatches());
+	TessellatedPatch *&slot = m_threadPatches.localData()->patches[
+		patchHash(key) & (NORI_GEOCACHE_THREAD_PATCHES - 1)];
+	if (slot && slot->key == key)
+		return slot;
+
+	TessellatedPatch *patch = fetch(mesh, key, index);
+	if (slot)
+		slot->release();
+	slot = patch;
+	return patch;
+}
+
+TessellatedPatch *GeometryCache::fetch(const DisplacedMesh *mesh, uint64_t key, uint32_t index) {
+	Shard &shard = m_shards[patchHash(key) % NORI_GEOCACHE_SHARDS];
+	std::map<uint64_t, TessellatedPatch *>::iterator it;
+	{
+		QMutexLocker locker(&shard.mutex);
+		it = shard.patches.find(key);
+		if (it != shard.patches.end()) {
+			TessellatedPatch *patch = it->second;
+			unlink(shard, patch);
+			pushFront(shard, patch);
+			patch->refs.ref();
+			return patch;
+		}
+	}
+
+	/* Tessellate the patch without holding the lock */
+	TessellatedPatch *patch = mesh->tessellate(index);
+	patch->key = key;
+
+	QMutexLocker locker(&shard.mutex);
+	it = shard.patches.find(key);
+	if (it != shard.patches.end()) {
+		/* Another thread was faster */
+		delete patch;
+		patch = it->second;
+		unlink(shard, patch);
+	} else {
+		shard.patches[key] = patch;
+		shard.memory += patch->getMemoryUsage();
+
+		/* Evict the least recently used patches of the shard */
+		size_t budget = m_budget / NORI_GEOCACHE_SHARDS;
+		while (shard.memory > budget && shard.tail) {
+			TessellatedPatch *victim = shard.tail;
+			unlink(shard, victim);
+			shard.patches.erase(victim->key);
+			shard.memory -= victim->getMemoryUsage();
+			victim->release();
+		}
+	}
+	pushFront(shard, patch);
+	patch->refs.ref();
+	return patch;
+}
+
+void GeometryCache::unlink(Shard &shard, TessellatedPatch *patch) {
+	if (patch->prev)
+		patch->prev->next = patch->next;
+	else
+		shard.head = patch->next;
+	if (patch->next)
+		patch->next->prev = patch->prev;
+	else
+		shard.tail = patch->prev;
+	patch->prev = patch->next = NULL;
+}
+
+void GeometryCache::pushFront(Shard &shard, TessellatedPatch *patch) {
+	patch->next = shard.head;
+	patch->prev = NULL;
+	if (shard.head)
+		shard.head->prev = patch;
+	else
+		shard.tail = patch;
+	shard.head = patch;
+}
+
+NORI_NAMESPACE_END
@@ -17,6 +17,9 @@
 */
 
 #include <nori/gui.h>
+#include <nori/render.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
 #include <QGLWidget>
 #include <QGLShader>
 
@@ -34,31 +37,88 @@ using namespace nori;
 	#define GL_RGBA32F_ARB 0x8814
 #endif
 
+/**
+ * \brief Displays the image of a render job using OpenGL
+ *
+ * Images that don't fit onto the screen are shown downsampled by an
+ * integer factor. The widget keeps a mirror of the image at that
+ * resolution, which is updated region by region as blocks are merged,
+ * so that neither the copy nor the texture grow with the image. Ctrl
+ * and the mouse wheel zoom into the image (up to its full resolution)
+ * around the mouse, and dragging with Ctrl held down pans; only the
+ * visible crop is then fetched at the higher resolution.
+ */
 class PreviewWidget : public QGLWidget {
 public:
-	PreviewWidget(QWidget *parent, const ImageBlock *output)
-		: QGLWidget(parent), m_output(output), m_scale(1.0f) {
-		const Vector2i &size = m_output->getSize();
-		setMinimumSize(size.x(), size.y());
-		setMaximumSize(size.x(), size.y());
+	PreviewWidget(NoriWindow *window, const ImageBlock *output)
+		: QGLWidget(window), m_window(window), m_output(output),
+		  m_textureSize(0, 0), m_cropOffset(0, 0), m_scale(1.0f), m_reload(true) {
+		/* Leave some space for the window decorations and controls */
+		const Vector2i &size = output->getSize();
+		QRect screen = QApplication::desktop()->availableGeometry(window);
+		Vector2i available(std::max(1, screen.width() * 9 / 10), 
+			std::max(1, screen.height() * 8 / 10));
+		int factor = std::max(1, std::max(
+			(size.x() + available.x() - 1) / available.x(),
+			(size.y() + available.y() - 1) / available.y()));
+		m_displaySize = (size + Vector2i(factor - 1, factor - 1)) / factor;
+		m_factor = m_zoom = factor;
+		setMinimumSize(m_displaySize.x(), m_displaySize.y());
+		setMaximumSize(m_displaySize.x(), m_displaySize.y());
 	}
 
 	QSize sizeHint() const {
-		const Vector2i &size = m_output->getSize();
-		return QSize(size.x(), size.y());
+		return QSize(m_displaySize.x(), m_displaySize.y());
+	}
+
+	/// Display another image block (which is stretched to the size of the widget)
+	void setOutput(const ImageBlock *output) {
+		const Vector2i &size = output->getSize();
+		m_output = output;
+		m_factor = std::max(1, std::max(
+			(size.x() + m_displaySize.x() - 1) / m_displaySize.x(),
+			(size.y() + m_displaySize.y() - 1) / m_displaySize.y()));
+		m_zoom = m_factor;
+		m_mirror.resize(0, 0);
+		m_reload = true;
+		refresh();
 	}
 
 	void refresh() {
-		/* Reload the partially rendered image into a texture */
-		m_output->lock();
-		int borderSize = m_output->getBorderSize();
-		const Vector2i &size = m_output->getSize();
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_output->cols());
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, size.x(), size.y(),
-				0, GL_RGBA, GL_FLOAT, (uint8_t *) m_output->data() + 
-				(borderSize * m_output->cols() + borderSize) * sizeof(Color4f));
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-		m_output->unlock();
+		/* Bring the mirror up to date with the parts of the image that
+		   changed since the last refresh. This goes through a private 
+		   copy, so that the render threads never have to wait for the upload */
+		m_output->snapshot(m_mirror, m_regions, m_factor);
+
+		if (m_zoom < m_factor) {
+			/* Fetch the crop again when any of it changed */
+			Vector2i cropSize = getCropSize();
+			bool changed = m_reload;
+			for (size_t i=0; i<m_regions.size() && !changed; ++i) {
+				Point2i start = m_regions[i].first * m_factor;
+				Point2i end = start + m_regions[i].second * m_factor;
+				changed = start.x() < m_cropOffset.x() + cropSize.x() && end.x() > m_cropOffset.x()
+					&& start.y() < m_cropOffset.y() + cropSize.y() && end.y() > m_cropOffset.y();
+			}
+			if (!changed)
+				return;
+			m_output->snapshot(m_crop, m_cropOffset, cropSize, m_zoom);
+			m_regions.clear();
+			m_regions.push_back(ImageBlock::Region(Point2i(0, 0), 
+				Vector2i((int) m_crop.cols(), (int) m_crop.rows())));
+			upload(m_crop);
+		} else {
+			if (m_reload) {
+				m_regions.clear();
+				m_regions.push_back(ImageBlock::Region(Point2i(0, 0), 
+					Vector2i((int) m_mirror.cols(), (int) m_mirror.rows())));
+			}
+			if (m_regions.empty())
+				return;
+			upload(m_mirror);
+		}
+		m_reload = false;
+
 		if (m_program.isLinked()) 
 			updateGL();
 	}
@@ -75,6 +135,10 @@ protected:
 		glBindTexture(GL_TEXTURE_2D, m_texture);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+		/* Allocate and upload everything the first time */
+		m_textureSize = Vector2i(0, 0);
+		m_reload = true;
 		refresh();
 
 		if (!m_program.addShaderFromSourceCode(QGLShader::Vertex,
@@ -124,32 +188,134 @@ protected:
 		glBindTexture(GL_TEXTURE_2D, m_texture);
 		m_program.setUniformValue("scale", m_scale);
 		m_program.setUniformValue("source", 0);
+
+		/* The mirror is stretched to the widget, while a crop is shown
+		   with one texel per pixel (it may not fill the widget) */
+		float width = 1.0f, height = 1.0f;
+		if (m_zoom < m_factor) {
+			width = std::min(1.0f, m_textureSize.x() / (float) m_displaySize.x());
+			height = std::min(1.0f, m_textureSize.y() / (float) m_displaySize.y());
+		}
 		glBegin(GL_QUADS);
 		glTexCoord2f(0.0f, 0.0f);
 		glVertex2f(0.0f, 0.0f);
 		glTexCoord2f(1.0f, 0.0f);
-		glVertex2f(1.0f, 0.0f);
+		glVertex2f(width, 0.0f);
 		glTexCoord2f(1.0f, 1.0f);
-		glVertex2f(1.0f, 1.0f);
+		glVertex2f(width, height);
 		glTexCoord2f(0.0f, 1.0f);
-		glVertex2f(0.0f, 1.0f);
+		glVertex2f(0.0f, height);
 		glEnd();
 	}
+
+	void mousePressEvent(QMouseEvent *event) {
+		m_lastPos = event->pos();
+	}
+
+	void mouseMoveEvent(QMouseEvent *event) {
+		QPoint delta = event->pos() - m_lastPos;
+		m_lastPos = event->pos();
+		if (!(event->buttons() & (Qt::LeftButton | Qt::RightButton)))
+			return;
+		if (event->modifiers() & Qt::ControlModifier) {
+			if (m_zoom < m_factor) {
+				m_cropOffset -= Vector2i(delta.x(), delta.y()) * m_zoom;
+				clampCrop();
+				m_reload = true;
+				refresh();
+			}
+			return;
+		}
+		m_window->drag(delta.x(), delta.y(), (event->buttons() & Qt::RightButton)
+			|| (event->modifiers() & Qt::ShiftModifier));
+	}
+
+	void wheelEvent(QWheelEvent *event) {
+		if (!(event->modifiers() & Qt::ControlModifier)) {
+			m_window->zoom(event->delta());
+			return;
+		}
+
+		/* Keep the pixel under the mouse in place */
+		Point2i pos(event->pos().x(), event->pos().y());
+		Point2i pixel;
+		if (m_zoom < m_factor) {
+			pixel = m_cropOffset + pos * m_zoom;
+		} else {
+			const Vector2i &size = m_output->getSize();
+			pixel = Point2i(pos.x() * size.x() / m_displaySize.x(),
+				pos.y() * size.y() / m_displaySize.y());
+		}
+		int zoom = event->delta() > 0 ? std::max(1, m_zoom / 2) 
+			: std::min(m_factor, m_zoom * 2);
+		if (zoom == m_zoom)
+			return;
+		m_zoom = zoom;
+		m_cropOffset = pixel - pos * m_zoom;
+		clampCrop();
+		m_reload = true;
+		refresh();
+	}
 private:
+	/// Upload the regions in \c m_regions of a mirror or crop into the texture
+	void upload(const ImageBlock::Snapshot &source) {
+		makeCurrent();
+		Vector2i size((int) source.cols(), (int) source.rows());
+		glBindTexture(GL_TEXTURE_2D, m_texture);
+		if (m_textureSize != size) {
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, size.x(), size.y(),
+					0, GL_RGBA, GL_FLOAT, NULL);
+			m_textureSize = size;
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, size.x());
+		for (size_t i=0; i<m_regions.size(); ++i) {
+			const Point2i &offset = m_regions[i].first;
+			const Vector2i &regionSize = m_regions[i].second;
+			glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x(), offset.y(),
+				regionSize.x(), regionSize.y(), GL_RGBA, GL_FLOAT, 
+				(const uint8_t *) &source.coeff(offset.y(), offset.x()));
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	/// Return the size of the crop (in pixels of the image) at the current zoom
+	Vector2i getCropSize() const {
+		return (m_displaySize * m_zoom).cwiseMin(m_output->getSize());
+	}
+
+	/// Move the crop back into the image
+	void clampCrop() {
+		Vector2i limit = m_output->getSize() - getCropSize();
+		m_cropOffset = m_cropOffset.cwiseMax(Point2i(0, 0)).cwiseMin(limit);
+	}
+
+	NoriWindow *m_window;
 	const ImageBlock *m_output;
+	/// Downsampled copy of the image, and the crop that is shown when zoomed in
+	ImageBlock::Snapshot m_mirror, m_crop;
+	std::vector<ImageBlock::Region> m_regions;
+	Vector2i m_displaySize, m_textureSize;
+	/// Downsampling of the mirror, and of the crop (equal when not zoomed in)
+	int m_factor, m_zoom;
+	Point2i m_cropOffset;
+	QPoint m_lastPos;
 	GLuint m_texture;
 	float m_scale;
+	bool m_reload;
 	QGLShaderProgram m_program;
 };
 
 
-NoriWindow::NoriWindow(const ImageBlock *output) : QWidget(NULL) {
+NoriWindow::NoriWindow(RenderEngine *engine, RenderJob *job) : QWidget(NULL),
+		m_engine(engine), m_job(job), m_scene(job->getScene()), m_navigated(false),
+		m_previewJob(NULL), m_fullJob(NULL), m_previewCamera(NULL), m_fullCamera(NULL) {
 	setWindowTitle("Nori");
 
 	QVBoxLayout *layout = new QVBoxLayout(this);
 	layout->setSizeConstraint(QLayout::SetFixedSize);
 	setLayout(layout);
-	m_preview = new PreviewWidget(this, output);
+	m_preview = new PreviewWidget(this, job->getOutput());
 
 	m_exposure = new QSlider(this);
 	m_exposure->setMinimum(-1000);
@@ -163,9 +329,33 @@ NoriWindow::NoriWindow(const ImageBlock *output) : QWidget(NULL) {
 	QLabel *label = new QLabel("Exposure : ", this);
 	layout2->addWidget(label);
 	layout2->addWidget(m_exposure);
+	m_stop = new QPushButton("Stop", this);
+	m_stop->setToolTip("Stop rendering and save the image rendered so far");
+	layout2->addWidget(m_stop);
 	layout->addWidget(m_preview);
 	layout->addLayout(layout2);
 
+	/* Recover the view of the job's camera from the rays through the
+	   center and the edges of the image (through the aperture center) */
+	const Camera *camera = job->getCamera();
+	m_size = camera->getOutputSize();
+	Point2f apertureCenter(0.5f, 0.5f);
+	Ray3f center, left, right, top;
+	camera->sampleRay(center, Point2f(0.5f * m_size.x(), 0.5f * m_size.y()), apertureCenter);
+	camera->sampleRay(left, Point2f(0.0f, 0.5f * m_size.y()), apertureCenter);
+	camera->sampleRay(right, Point2f((float) m_size.x(), 0.5f * m_size.y()), apertureCenter);
+	camera->sampleRay(top, Point2f(0.5f * m_size.x(), 0.0f), apertureCenter);
+	Vector3f dir = center.d.normalized();
+	m_origin = center.o;
+	m_fov = radToDeg(std::acos(clamp(left.d.normalized().dot(right.d.normalized()), -1.0f, 1.0f)));
+	m_up = (top.d.normalized() - dir * dir.dot(top.d.normalized())).normalized();
+
+	/* Orbit around the surface in the center of the view */
+	Intersection its;
+	float distance = m_scene->rayIntersect(center, its) ? its.t
+		: 0.5f * m_scene->getBoundingBox().getExtents().norm();
+	m_target = m_origin + dir * distance;
+
 	#if defined(Q_WS_MACX)
 		nori_raise_osx();
 	#endif
@@ -173,15 +363,169 @@ NoriWindow::NoriWindow(const ImageBlock *output) : QWidget(NULL) {
 	m_refreshTimer = new QTimer(this);
 	m_refreshTimer->setInterval(500);
 
+	/* Restart at most every 30 ms while the mouse is moving */
+	m_restartTimer = new QTimer(this);
+	m_restartTimer->setInterval(30);
+	m_restartTimer->setSingleShot(true);
+
 	connect(m_refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+	connect(m_restartTimer, SIGNAL(timeout()), this, SLOT(restart()));
 	connect(m_exposure, SIGNAL(valueChanged(int)), this, SLOT(setExposure(int)));
+	connect(m_stop, SIGNAL(clicked()), this, SLOT(stop()));
 	show();
 }
 
+NoriWindow::~NoriWindow() {
+	releaseJobs();
+}
+
 void NoriWindow::setExposure(int value) {
 	m_preview->setScale(std::pow(2, value / 100.0f));
 }
 
+void NoriWindow::stop() {
+	/* The jobs finish with what they have rendered so far */
+	m_job->cancel();
+	if (m_previewJob)
+		m_previewJob->cancel();
+	if (m_fullJob)
+		m_fullJob->cancel();
+	m_stop->setEnabled(false);
+	setWindowTitle("Nori (stopped)");
+}
+
+void NoriWindow::closeEvent(QCloseEvent *event) {
+	stop();
+	QWidget::closeEvent(event);
+}
+
 void NoriWindow::refresh() {
+	/* Switch from the low resolution preview to the full resolution 
+	   once the latter has completed its first pass */
+	if (m_previewJob && m_fullJob) {
+		RenderJob::Status status = m_fullJob->getStatus();
+		if (status.pass > 0 || status.finished) {
+			m_preview->setOutput(m_fullJob->getOutput());
+			m_previewJob->wait();
+			delete m_previewJob;
+			delete m_previewCamera;
+			m_previewJob = NULL;
+			m_previewCamera = NULL;
+			return;
+		}
+	}
 	m_preview->refresh();
 }
+
+void NoriWindow::drag(int dx, int dy, bool pan) {
+	Vector3f offset = m_origin - m_target;
+	float distance = offset.norm();
+	Vector3f dir = -offset / distance;
+	Vector3f left = m_up.cross(dir).normalized();
+	Vector3f up = dir.cross(left);
+
+	if (pan) {
+		/* Move the view so that the center point follows the mouse */
+		float scale = 2 * distance * std::tan(degToRad(m_fov / 2)) / m_size.x();
+		Vector3f shift = (left * (float) dx + up * (float) dy) * scale;
+		m_origin += shift;
+		m_target += shift;
+	} else {
+		/* Turn around the up direction and the horizontal axis,
+		   stopping short of looking straight up or down */
+		float angle = 0.01f;
+		Vector3f rotated = Eigen::AngleAxisf(-dx * angle, m_up) 
+			* Eigen::AngleAxisf(dy * angle, left) * offset;
+		if (std::abs(rotated.normalized().dot(m_up)) > 0.99f)
+			rotated = Eigen::AngleAxisf(-dx * angle, m_up) * offset;
+		m_origin = m_target + rotated;
+	}
+	m_restartTimer->start();
+}
+
+void NoriWindow::zoom(int delta) {
+	/* One step of the wheel (120 units) covers 10% of the distance */
+	float scale = std::pow(0.9f, delta / 120.0f);
+	Vector3f offset = (m_origin - m_target) * scale;
+	if (offset.norm() > Epsilon)
+		m_origin = m_target + offset;
+	m_restartTimer->start();
+}
+
+Camera *NoriWindow::createCamera(const Vector2i &size) const {
+	/* Same convention as the <lookat> tag of scene files */
+	Vector3f dir = (m_target - m_origin).normalized();
+	Vector3f left = m_up.cross(dir).normalized();
+	Vector3f newUp = dir.cross(left);
+
+	Eigen::Matrix4f trafo;
+	trafo << left, newUp, dir, m_origin,
+		     0, 0, 0, 1;
+
+	PropertyList propList;
+	propList.setInteger("width", size.x());
+	propList.setInteger("height", size.y());
+	propList.setTransform("toWorld", Transform(trafo));
+	propList.setFloat("fov", m_fov);
+	Camera *camera = static_cast<Camera *>(
+		NoriObjectFactory::createInstance("perspective", propList));
+	camera->activate();
+	return camera;
+}
+
+void NoriWindow::releaseJobs() {
+	RenderJob *jobs[] = { m_previewJob, m_fullJob };
+	for (int i=0; i<2; ++i) {
+		if (jobs[i])
+			jobs[i]->cancel();
+	}
+	for (int i=0; i<2; ++i) {
+		if (jobs[i]) {
+			jobs[i]->wait();
+			delete jobs[i];
+		}
+	}
+	delete m_previewCamera;
+	delete m_fullCamera;
+	m_previewJob = m_fullJob = NULL;
+	m_previewCamera = m_fullCamera = NULL;
+}
+
+void NoriWindow::restart() {
+	/* Stop the current rendering. The scene's own job is only cancelled
+	   (its owner waits for it) */
+	if (!m_navigated) {
+		m_job->cancel();
+		m_navigated = true;
+	}
+	RenderJob *oldJobs[] = { m_previewJob, m_fullJob };
+	Camera *oldCameras[] = { m_previewCamera, m_fullCamera };
+	for (int i=0; i<2; ++i) {
+		if (oldJobs[i])
+			oldJobs[i]->cancel();
+	}
+
+	/* A quick look at a quarter of the resolution, followed by 
+	   progressive passes at the full resolution. The render threads
+	   move on to these as soon as the cancelled jobs are stopped */
+	m_previewCamera = createCamera((m_size / 4).cwiseMax(Vector2i(1, 1)));
+	m_previewJob = new RenderJob(m_scene, m_previewCamera, 1);
+	m_engine->submit(m_previewJob);
+
+	m_fullCamera = createCamera(m_size);
+	m_fullJob = new RenderJob(m_scene, m_fullCamera);
+	m_fullJob->setProgressive(1);
+	m_engine->submit(m_fullJob);
+
+	m_preview->setOutput(m_previewJob->getOutput());
+	m_stop->setEnabled(true);
+	setWindowTitle("Nori");
+
+	for (int i=0; i<2; ++i) {
+		if (oldJobs[i]) {
+			oldJobs[i]->wait();
+			delete oldJobs[i];
+		}
+		delete oldCameras[i];
+	}
+}
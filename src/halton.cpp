@@ -0,0 +1,120 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+#include <nori/pcg32.h>
+
+#define NORI_HALTON_DIMENSIONS 32 /* Number of dimensions with their own prime base */
+
+NORI_NAMESPACE_BEGIN
+
+static const uint32_t haltonPrimes[NORI_HALTON_DIMENSIONS] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+	59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+/// Radical inverse of \c index in the given base
+static inline float radicalInverse(uint32_t base, uint32_t index) {
+	const float invBase = 1.0f / base;
+	float invBaseN = 1.0f, result = 0.0f;
+	while (index > 0) {
+		uint32_t next = index / base;
+		invBaseN *= invBase;
+		result += (index - next * base) * invBaseN;
+		index = next;
+	}
+	return std::min(result, OneMinusEpsilon);
+}
+
+/**
+ * Halton sampling - component \c i of a pixel's samples follows the
+ * radical inverse in the \c i-th prime base. The point set of each
+ * pixel is randomized by a per-pixel Cranley-Patterson rotation
+ * (a random toroidal shift per dimension). Components beyond the
+ * first \ref NORI_HALTON_DIMENSIONS are generated independently.
+ */
+class Halton : public Sampler {
+public:
+	Halton(const PropertyList &propList) {
+		configure(propList);
+		memset(m_rotation, 0, sizeof(m_rotation));
+		m_sampleIndex = 0;
+		m_dimension = 0;
+	}
+
+	Sampler *clone() {
+		Halton *cloned = new Halton();
+		cloned->copySettings(this);
+		memset(cloned->m_rotation, 0, sizeof(m_rotation));
+		cloned->m_sampleIndex = 0;
+		cloned->m_dimension = 0;
+		return cloned;
+	}
+
+	void generate(const Point2i &pixel, uint32_t firstSample) {
+		/* The rotation only depends on the pixel, so that passes of a 
+		   progressive rendering continue the same point set */
+		m_random.seed(hashPixel(pixel));
+		m_random.nextFloat(m_rotation, NORI_HALTON_DIMENSIONS);
+		m_random.seed(hashPixel(pixel, firstSample + 1));
+		m_sampleIndex = firstSample;
+		m_dimension = 0;
+	}
+
+	void advance() {
+		m_sampleIndex++;
+		m_dimension = 0;
+	}
+
+	float next1D() {
+		if (m_dimension >= NORI_HALTON_DIMENSIONS)
+			return m_random.nextFloat();
+		return sample(m_dimension++);
+	}
+
+	Point2f next2D() {
+		if (m_dimension + 1 >= NORI_HALTON_DIMENSIONS) {
+			float x = m_random.nextFloat();
+			return Point2f(x, m_random.nextFloat());
+		}
+		float x = sample(m_dimension++);
+		return Point2f(x, sample(m_dimension++));
+	}
+
+	QString toString() const {
+		return QString("Halton[sampleCount=%1, seed=%2]").arg(m_sampleCount).arg(m_seed);
+	}
+protected:
+	Halton() { }
+
+	/// Evaluate a rotated component of the current sample
+	inline float sample(int dim) const {
+		float value = radicalInverse(haltonPrimes[dim], m_sampleIndex) + m_rotation[dim];
+		if (value >= 1.0f)
+			value -= 1.0f;
+		return std::min(value, OneMinusEpsilon);
+	}
+protected:
+	PCG32 m_random;
+	float m_rotation[NORI_HALTON_DIMENSIONS];
+	uint32_t m_sampleIndex;
+	int m_dimension;
+};
+
+NORI_REGISTER_CLASS(Halton, "halton");
+NORI_NAMESPACE_END
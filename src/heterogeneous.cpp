@@ -17,8 +17,23 @@
 */
 
 #include <nori/medium.h>
+#include <nori/bbox.h>
+#include <nori/sampler.h>
+#include <nori/fastmath.h>
+#include <nori/paging.h>
+#include <nori/volcache.h>
+#include <nori/dpdf.h>
+#include <nori/memreport.h>
+#include <Eigen/LU>
 #include <QFile>
+#include <QStringList>
 #include <QDataStream>
+#include <boost/static_assert.hpp>
+#include <half.h>
+
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
 
 #if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
 #include <sys/mman.h>
@@ -29,8 +44,445 @@
 #include <windows.h>
 #endif
 
+/* Russian roulette is applied when a transmittance estimate drops below this value */
+#define NORI_TRANSMITTANCE_RR_THRESHOLD 0.1f
+
+/// Version of the sparse volume format (increase when changing the layout)
+#define NORI_SPARSE_VOLUME_VERSION 3
+
+/// Number of entries of the table of blackbody radiances
+#define NORI_BLACKBODY_TABLE_SIZE 1024
+
+/// Number of strata of the second coordinate of positions sampled within a cell of the emission distribution
+#define NORI_EMISSION_SAMPLE_SPLIT 4096
+
+/// Maximum number of channels of a volume (see \ref HeterogeneousMedium)
+#define NORI_MAX_VOLUME_CHANNELS 8
+
+/// Maximum number of ray marching steps per cell of the majorant grid
+#define NORI_MAX_MARCHING_STEPS 256
+
+/// Number of densities that ratio tracking and ray marching look up together
+#define NORI_DENSITY_BATCH 16
+
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Header of a sparse (bricked) volume file
+ *
+ * The volume is divided into bricks that cover the interpolation 
+ * intervals of \c brickSize voxels along each axis. Each brick stores
+ * <tt>(brickSize+1)^3</tt> voxels, i.e. including the voxels shared
+ * with its neighbors, so that any lookup only touches a single brick.
+ * Every voxel consists of \c channels interleaved values, the first of
+ * which is the density. Bricks whose density is entirely zero aren't
+ * stored.
+ *
+ * The header is followed by the brick index (one \c int32_t per brick,
+ * x varies fastest, -1 = empty) at \c indexOffset and the stored bricks
+ * at \c brickOffset, in the order of a Morton curve through the
+ * brick grid. The values are encoded as specified by \c encoding
+ * (see \ref EVoxelEncoding). Quantized bricks are scaled by one
+ * \c float per stored brick and channel, located at \c scaleOffset. All 
+ * values use the byte order of the machine that wrote the file (i.e.
+ * little endian in practice, like VOL files).
+ */
+struct SparseVolumeHeader {
+	char magic[3];
+	uint8_t version;
+	int32_t resolution[3];
+	int32_t brickSize;
+	int32_t gridSize[3];
+	uint64_t indexOffset;
+	uint64_t brickOffset;
+	uint32_t brickCount;
+	uint32_t encoding;
+	uint64_t scaleOffset;
+	uint32_t channels;
+	uint32_t reserved;
+};
+
+BOOST_STATIC_ASSERT(sizeof(SparseVolumeHeader) == 72);
+
+/// Encodings of the density values (same codes as the \c type field of VOL files)
+enum EVoxelEncoding {
+	EFloat32 = 1,
+	EFloat16 = 2,
+	EUInt8 = 3
+};
+
+/**
+ * \brief Converts between the density values of a given encoding 
+ * and floats
+ *
+ * 8-bit values are quantized: a value of 255 corresponds to 1 in dense
+ * volumes, and to the maximum density of its brick in sparse volumes.
+ * The medium instantiates its lookup and tracking code once for every
+ * encoding, so that decoding doesn't cost a branch per voxel.
+ */
+template <typename T> struct VoxelTraits { };
+
+template <> struct VoxelTraits<float> {
+	static const bool quantized = false;
+	static inline float decode(float value) { return value; }
+	static inline float encode(float value) { return value; }
+};
+
+template <> struct VoxelTraits<half> {
+	static const bool quantized = false;
+	static inline float decode(half value) { return value; }
+	static inline half encode(float value) { return half(value); }
+};
+
+template <> struct VoxelTraits<uint8_t> {
+	static const bool quantized = true;
+	static inline float decode(uint8_t value) { return value; }
+	/// Expects the value relative to the scale, i.e. in [0, 255]
+	static inline uint8_t encode(float value) {
+		return (uint8_t) std::min(std::max((int) (value + 0.5f), 0), 255);
+	}
+};
+
+/// Return the size of a density value of the given encoding (0 if unsupported)
+static size_t voxelSize(int encoding) {
+	switch (encoding) {
+		case EFloat32: return sizeof(float);
+		case EFloat16: return sizeof(half);
+		case EUInt8: return sizeof(uint8_t);
+		default: return 0;
+	}
+}
+
+/// Return the name of an encoding
+static const char *voxelEncodingName(int encoding) {
+	switch (encoding) {
+		case EFloat16: return "float16";
+		case EUInt8: return "uint8";
+		default: return "float32";
+	}
+}
+
+/// Lower and upper bound of the density within a cell of the majorant grid
+struct DensityBounds {
+	float minimum, maximum;
+};
+
+/**
+ * \brief Walks along a ray through the cells of a coarse grid of 
+ * majorants (maximum densities) using a 3D-DDA
+ *
+ * All coordinates are in units of voxels of the density data. 
+ * Every call of \ref next() returns the ray segment within the 
+ * next cell, together with the cell's density bounds.
+ */
+class MajorantTraversal {
+public:
+	/**
+	 * \param o, d
+	 *    Ray origin and direction in voxel coordinates
+	 * \param mint, maxt
+	 *    Parameter interval of the ray
+	 * \param bounds
+	 *    Density bounds of every cell (x varies fastest)
+	 * \param gridSize
+	 *    Number of cells along each axis
+	 * \param cellSize
+	 *    Edge length of a cell in voxels
+	 * \param extents
+	 *    Extents of the domain in voxels
+	 */
+	MajorantTraversal(const Point3f &o, const Vector3f &d, float mint, float maxt,
+			const DensityBounds *bounds, const Vector3i &gridSize, int cellSize,
+			const Vector3f &extents) : m_bounds(bounds), m_gridSize(gridSize) {
+		/* Clip the ray against the domain */
+		for (int i=0; i<3; ++i) {
+			if (d[i] == 0) {
+				if (o[i] < 0 || o[i] > extents[i])
+					maxt = -1;
+				continue;
+			}
+			float t0 = -o[i] / d[i], t1 = (extents[i] - o[i]) / d[i];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			mint = std::max(mint, t0);
+			maxt = std::min(maxt, t1);
+		}
+		m_t = mint;
+		m_maxt = maxt;
+		if (mint >= maxt)
+			return;
+
+		Point3f p = o + d * mint;
+		for (int i=0; i<3; ++i) {
+			m_cell[i] = std::min(std::max((int) std::floor(p[i] / cellSize), 0), gridSize[i] - 1);
+			if (d[i] > 0) {
+				m_step[i] = 1;
+				m_next[i] = ((m_cell[i] + 1) * cellSize - o[i]) / d[i];
+				m_delta[i] = cellSize / d[i];
+			} else if (d[i] < 0) {
+				m_step[i] = -1;
+				m_next[i] = (m_cell[i] * cellSize - o[i]) / d[i];
+				m_delta[i] = -cellSize / d[i];
+			} else {
+				m_step[i] = 0;
+				m_next[i] = std::numeric_limits<float>::infinity();
+				m_delta[i] = 0;
+			}
+		}
+	}
+
+	/// Return the next segment [t0, t1] and its density bounds (\c false when done)
+	bool next(float &t0, float &t1, DensityBounds &bounds) {
+		if (m_t >= m_maxt)
+			return false;
+
+		int axis = 0;
+		if (m_next[1] < m_next[axis])
+			axis = 1;
+		if (m_next[2] < m_next[axis])
+			axis = 2;
+
+		t0 = m_t;
+		t1 = std::min(m_next[axis], m_maxt);
+		bounds = m_bounds[(m_cell.z() * m_gridSize.y() + m_cell.y()) * m_gridSize.x() + m_cell.x()];
+
+		m_t = t1;
+		m_cell[axis] += m_step[axis];
+		m_next[axis] += m_delta[axis];
+		if (m_cell[axis] < 0 || m_cell[axis] >= m_gridSize[axis])
+			m_t = m_maxt;
+		return true;
+	}
+
+	/// Return the index of the cell after the last returned segment (-1 if there is none)
+	inline int nextCell() const {
+		if (m_t >= m_maxt)
+			return -1;
+		return (m_cell.z() * m_gridSize.y() + m_cell.y()) * m_gridSize.x() + m_cell.x();
+	}
+private:
+	const DensityBounds *m_bounds;
+	Vector3i m_gridSize;
+	Point3i m_cell;
+	Vector3i m_step;
+	Vector3f m_next, m_delta;
+	float m_t, m_maxt;
+};
+
+/// Decode the i-th value of a dense volume (used when rearranging volumes)
+static float decodeVoxel(const char *data, int encoding, size_t i) {
+	switch (encoding) {
+		case EFloat16: return VoxelTraits<half>::decode(((const half *) data)[i]);
+		case EUInt8: return VoxelTraits<uint8_t>::decode(((const uint8_t *) data)[i]) / 255.0f;
+		default: return VoxelTraits<float>::decode(((const float *) data)[i]);
+	}
+}
+
+/**
+ * \brief Copy the voxels of a brick of a dense volume with \c channels
+ * interleaved values per voxel (including the voxels shared with the
+ * next bricks) and zero-pad it beyond the end
+ *
+ * \return \c false if the density (first channel) of the brick is entirely zero
+ */
+static bool gatherBrick(const char *data, int encoding, int channels, 
+		const Vector3i &resolution, int brickSize, const Point3i &brick, float *target) {
+	bool nonEmpty = false;
+	size_t row = resolution.x(), slab = row * resolution.y();
+	for (int z=0; z<=brickSize; ++z) {
+		for (int y=0; y<=brickSize; ++y) {
+			for (int x=0; x<=brickSize; ++x) {
+				Point3i p = brick * brickSize + Point3i(x, y, z);
+				bool inside = (p.array() < resolution.array()).all();
+				size_t voxel = p.z()*slab + p.y()*row + p.x();
+				for (int c=0; c<channels; ++c) {
+					float value = inside ? decodeVoxel(data, encoding, voxel * channels + c) : 0.0f;
+					if (c == 0)
+						nonEmpty |= value != 0.0f;
+					*target++ = value;
+				}
+			}
+		}
+	}
+	return nonEmpty;
+}
+
+/**
+ * \brief Encode the values of a brick with \c channels interleaved
+ * values per voxel
+ *
+ * \param scales
+ *    Receives the scale factor of every channel (1 for unquantized
+ *    encodings)
+ * \param scale
+ *    Scale factor of quantized encodings (by default, the maximum
+ *    value of each channel within the brick / 255)
+ */
+static void encodeBrick(const std::vector<float> &brick, int channels, int encoding,
+		std::vector<char> &target, float *scales, float scale = 0.0f) {
+	size_t count = brick.size();
+	target.resize(count * voxelSize(encoding));
+	for (int c=0; c<channels; ++c)
+		scales[c] = encoding == EUInt8 ? scale : 1.0f;
+	switch (encoding) {
+		case EFloat16:
+			for (size_t i=0; i<count; ++i)
+				((half *) &target[0])[i] = VoxelTraits<half>::encode(brick[i]);
+			break;
+		case EUInt8: {
+				for (int c=0; c<channels && scale <= 0; ++c) {
+					float maximum = 0.0f;
+					for (size_t i=c; i<count; i += channels)
+						maximum = std::max(maximum, brick[i]);
+					scales[c] = maximum > 0 ? maximum / 255.0f : 1.0f;
+				}
+				for (size_t i=0; i<count; ++i)
+					((uint8_t *) &target[0])[i] = VoxelTraits<uint8_t>::encode(
+						brick[i] / scales[i % channels]);
+			}
+			break;
+		default:
+			for (size_t i=0; i<count; ++i)
+				((float *) &target[0])[i] = VoxelTraits<float>::encode(brick[i]);
+			break;
+	}
+}
+
+/// Interleave the bits of the coordinates of a cell (Morton / Z-order code)
+static inline uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+	uint64_t code = 0;
+	for (int i=0; i<21; ++i)
+		code |= ((uint64_t) ((x >> i) & 1) << (3*i))
+			 |  ((uint64_t) ((y >> i) & 1) << (3*i + 1))
+			 |  ((uint64_t) ((z >> i) & 1) << (3*i + 2));
+	return code;
+}
+
+/**
+ * \brief Return the (linear) indices of the cells of a grid in the order
+ * of a Morton curve, which keeps neighboring cells close together
+ */
+static std::vector<uint32_t> mortonOrder(const Vector3i &gridSize) {
+	std::vector<std::pair<uint64_t, uint32_t> > codes;
+	codes.reserve((size_t) gridSize.x() * gridSize.y() * gridSize.z());
+	for (int z=0; z<gridSize.z(); ++z)
+		for (int y=0; y<gridSize.y(); ++y)
+			for (int x=0; x<gridSize.x(); ++x)
+				codes.push_back(std::make_pair(mortonCode(x, y, z), 
+					(uint32_t) codes.size()));
+	std::sort(codes.begin(), codes.end());
+
+	std::vector<uint32_t> order(codes.size());
+	for (size_t i=0; i<codes.size(); ++i)
+		order[i] = codes[i].second;
+	return order;
+}
+
+/**
+ * \brief Dense single-channel grid that is held in memory, which stores
+ * an additional quantity of a heterogeneous medium (e.g. its temperature)
+ *
+ * Uses the same coordinates and interpolation as the density values.
+ */
+struct DenseGrid {
+	Vector3i resolution;
+	std::vector<float> values;
+
+	/// Load a VOL file with a single float32, float16 or uint8 channel
+	void load(const QString &filename) {
+		QFile in(filename);
+		if (!in.open(QIODevice::ReadOnly))
+			throw NoriException(QString("Cannot open \"%1\"").arg(filename));
+		qint64 size = in.size();
+		const uchar *mapping = size >= 48 ? in.map(0, size) : NULL;
+		if (!mapping || memcmp(mapping, "VOL", 3) != 0 || mapping[3] != 3)
+			throw NoriException(QString("\"%1\" is not a valid volume data file!").arg(filename));
+
+		int32_t type, channels;
+		memcpy(&type, mapping + 4, sizeof(int32_t));
+		memcpy(resolution.data(), mapping + 8, 3 * sizeof(int32_t));
+		memcpy(&channels, mapping + 20, sizeof(int32_t));
+		if (voxelSize(type) == 0 || channels != 1)
+			throw NoriException("Only volumes with a single float32, float16 or uint8 channel are supported!");
+		size_t count = (size_t) resolution.x() * resolution.y() * resolution.z();
+		if ((resolution.array() < 2).any() || size < 48 + (qint64) (voxelSize(type) * count))
+			throw NoriException(QString("The volume data file \"%1\" is truncated!").arg(filename));
+
+		cout << "Loading \"" << qPrintable(filename) << "\" .." << endl;
+		const char *data = (const char *) (mapping + 48);
+		values.resize(count);
+		for (size_t i=0; i<count; ++i) {
+			switch (type) {
+				case EFloat16: values[i] = VoxelTraits<half>::decode(((const half *) data)[i]); break;
+				case EUInt8: values[i] = VoxelTraits<uint8_t>::decode(((const uint8_t *) data)[i]) / 255.0f; break;
+				default: values[i] = ((const float *) data)[i]; break;
+			}
+		}
+	}
+
+	/// Return the value of a voxel
+	inline float get(int x, int y, int z) const {
+		return values[((size_t) z * resolution.y() + y) * resolution.x() + x];
+	}
+
+	/// Interpolate the grid at \c p (in local coordinates, see \ref HeterogeneousMedium)
+	float lookup(const Point3f &_p) const {
+		Point3f p  = _p.cwiseProduct(resolution.cast<float>()),
+				pf = Point3f(std::floor(p.x()), std::floor(p.y()), std::floor(p.z()));
+		Point3i p0 = pf.cast<int>();
+		if ((p0.array() < 0).any() || (p0.array() >= resolution.array() - 1).any())
+			return 0.0f;
+
+		size_t row = resolution.x(), slab = row * resolution.y(),
+		       offset = p0.z()*slab + p0.y()*row + p0.x();
+		const float *data = &values[0];
+		Vector3f w1 = p-pf, w0 = (1 - w1.array()).matrix();
+		return (((data[offset] * w0.x() + data[offset + 1] * w1.x()) * w0.y() +
+		         (data[offset + row] * w0.x() + data[offset + row + 1] * w1.x()) * w1.y()) * w0.z() +
+		        ((data[offset + slab] * w0.x() + data[offset + slab + 1] * w1.x()) * w0.y() +
+		         (data[offset + slab + row] * w0.x() + data[offset + slab + row + 1] * w1.x()) * w1.y()) * w1.z());
+	}
+};
+
+/// Piecewise Gaussian lobe of the fit of the CIE color matching functions (see below)
+static inline double cieLobe(double lambda, double mu, double sigma1, double sigma2) {
+	double t = (lambda - mu) / (lambda < mu ? sigma1 : sigma2);
+	return std::exp(-0.5 * t * t);
+}
+
+/**
+ * \brief Return the linear sRGB color of the radiance emitted by a black
+ * body at the given temperature (in Kelvin), in W/(m^2 sr nm)
+ *
+ * Integrates Planck's law against the multi-lobe fit of the CIE 1931
+ * color matching functions by Wyman et al. ("Simple Analytic 
+ * Approximations to the CIE XYZ Color Matching Functions"), normalized 
+ * so that a constant spectrum of one has a luminance of one.
+ */
+static Color3f blackbody(float temperature) {
+	if (temperature <= 0)
+		return Color3f(0.0f);
+	const double c = 299792458.0, h = 6.62606957e-34, k = 1.3806488e-23;
+	double X = 0, Y = 0, Z = 0, norm = 0;
+	for (int i=0; i<=94; ++i) {
+		double lambda = 360.0 + 5.0 * i, l = lambda * 1e-9;
+		double radiance = 2 * h * c * c / (l*l*l*l*l * (std::exp(h * c / (l * k * temperature)) - 1)) * 1e-9;
+		double x = 1.056 * cieLobe(lambda, 599.8, 37.9, 31.0) + 0.362 * cieLobe(lambda, 442.0, 16.0, 26.7)
+		         - 0.065 * cieLobe(lambda, 501.1, 20.4, 26.2),
+		       y = 0.821 * cieLobe(lambda, 568.8, 46.9, 40.5) + 0.286 * cieLobe(lambda, 530.9, 16.3, 31.1),
+		       z = 1.217 * cieLobe(lambda, 437.0, 11.8, 36.0) + 0.681 * cieLobe(lambda, 459.0, 26.0, 13.8);
+		X += radiance * x;
+		Y += radiance * y;
+		Z += radiance * z;
+		norm += y;
+	}
+	X /= norm; Y /= norm; Z /= norm;
+	return Color3f(
+		(float) ( 3.240479 * X - 1.537150 * Y - 0.498535 * Z),
+		(float) (-0.969256 * X + 1.875991 * Y + 0.041556 * Z),
+		(float) ( 0.055648 * X - 0.204043 * Y + 1.057311 * Z)).clamp();
+}
+
 /**
  * \brief Heterogeneous participating medium class. The implementation 
  * fetches density values from an external file that is mapped into memory.
@@ -38,53 +490,388 @@ NORI_NAMESPACE_BEGIN
  * The density values in the file are interpreted as the extinction
  * coefficient sigma_t. The scattering albedo is assumed to be constant
  * throughout the volume, and is given as a parameter to this class.
+ *
+ * The file is either a dense grid in the VOL format (version 3), or a
+ * sparse volume (see \ref SparseVolumeHeader), which can be created 
+ * using <tt>nori --convert input.vol output.nsv</tt>. Sparse volumes
+ * only map the pages of non-empty bricks, and use their bricks as the
+ * cells of the majorant grid (the \c majorantCellSize parameter is 
+ * ignored), so that empty bricks are skipped during tracking.
+ *
+ * Besides the density, the voxels may hold further channels, which are
+ * interleaved with it in a single file (the \c channels field of VOL
+ * files, which is kept by the conversion to sparse volumes): a gray or
+ * RGB albedo (which multiplies the \c albedo parameter), an emitted
+ * radiance and a temperature (see below). Their meaning is given by the
+ * \c channels parameter, e.g. <tt>"density, albedo.r, albedo.g, albedo.b,
+ * temperature"</tt>. Since the eight voxels of a lookup then contain
+ * all channels, a single fetch serves them, mostly from the same cache
+ * lines, whereas separate files would multiply the scattered memory
+ * accesses. The tracking code only reads the densities.
+ *
+ * Density values are stored as 32-bit floats, 16-bit (half precision)
+ * floats or quantized 8-bit integers (the \c type of VOL files, or the 
+ * encoding chosen during the conversion), which reduces the memory 
+ * footprint and bandwidth of large volumes by a factor of 2 or 4. 
+ * 8-bit values of sparse volumes are relative to the maximum density
+ * of their brick, which retains more precision than a global scale.
+ *
+ * In the linear layout of VOL files, the eight voxels of a lookup are
+ * spread over four rows that lie far apart, so that rays marching 
+ * through large volumes miss the cache (and fault in pages) at almost
+ * every step. Bricked volumes keep them together, and store the bricks
+ * along a Morton curve, so that neighboring bricks are usually close
+ * as well. Dense volumes can be rearranged into bricks of 
+ * \c majorantCellSize voxels when they are loaded (<tt>layout = 
+ * "tiled"</tt>, at the cost of holding the copy in memory), and the 
+ * brick of the next cell of the majorant grid is prefetched while 
+ * tracking through the current one. On Linux and Mac OS, the boolean
+ * parameters \c preload and \c hugePages pass \c MADV_WILLNEED (read
+ * the whole file ahead) and \c MADV_HUGEPAGE (where supported) to
+ * \c madvise() for the mapping.
+ *
+ * Page faults on a mapped file stall the render threads for as long as
+ * the disk or network takes to deliver the page. With \c brickCache, the
+ * bricks of a sparse volume are instead read explicitly into the \ref
+ * VolumeCache, whose memory use is bounded (<tt>nori --volume-cache
+ * MiB</tt>) and which is shared by all volumes and threads. Only the
+ * brick index and scales are kept in memory. The brick of the next cell
+ * along a ray is then read by a background thread ahead of its use.
+ *
+ * Distances are sampled using delta tracking. Instead of a single 
+ * global bound on the density, this uses the local majorants of a 
+ * coarse grid (built when the medium is loaded), which is traversed
+ * using a 3D-DDA. In sparse media, this avoids most of the null 
+ * collisions. With \c decompositionTracking (the default), the minimum
+ * density of each cell is treated as a separate homogeneous component
+ * (Kutz et al., "Spectral and Decomposition Tracking for Rendering
+ * Heterogeneous Volumes"): its collisions are sampled analytically,
+ * without any density lookup, and delta tracking only handles the
+ * residual density above it, which makes dense and fairly uniform
+ * regions much cheaper. Transmittances are estimated using one of the following
+ * methods (\c transmittanceEstimator parameter):
+ *
+ * - \c delta: delta tracking, i.e. the transmittance is zero if a
+ *   real collision occurs before the end of the segment and one
+ *   otherwise (cheap, but binary and thus noisy)
+ * - \c ratio: ratio tracking, which multiplies the probabilities 
+ *   of the tentative collisions being null collisions (default)
+ * - \c residual: residual ratio tracking, which integrates the minimum
+ *   density of each cell (the control density) analytically and only
+ *   tracks the residual density above it. Tentative collisions are
+ *   sampled against the difference of the cell's bounds, so fairly
+ *   uniform regions need hardly any density lookups.
+ *
+ * For previews, \c rayMarching replaces both by ray marching, which
+ * trades bias for speed: the optical depth is integrated using steps
+ * whose length adapts to the range of densities of each cell of the
+ * majorant grid (at most \c marchingTolerance of optical depth per step,
+ * and a single step in uniform cells), evaluated at a jittered offset
+ * within every step. Transmittances are the exponential of the result,
+ * and collisions are placed where it reaches an exponentially
+ * distributed optical depth. This needs fewer lookups and random
+ * numbers than tracking and has no variance from binary or ratio
+ * estimates, but it underestimates the transmittance on average and
+ * misses features that are smaller than a step.
+ *
+ * The medium may emit light (e.g. fire), given by radiance values (times
+ * the color \c emissionScale) and/or temperatures (times \c temperatureScale
+ * to obtain Kelvin), which emit the radiance of a black body (times
+ * \c blackbodyScale, since physical values are large). Both are either
+ * channels of the volume, or separate VOL files with a single channel and
+ * the resolution of the density values (\c emissionFilename and 
+ * \c temperatureFilename), which are loaded into memory. The emission per unit length is sigma_a = 
+ * sigma_t * (1 - albedo) times the radiance, hence only absorbing regions
+ * emit. When loading the medium, the emitted power of every cell of the
+ * majorant grid is estimated, so that its luminaire (see \ref 
+ * Medium::getLuminaire()) samples a cell proportional to it and then
+ * a uniform position within the cell.
+ *
+ * Animated volumes are sequences of files, one per frame: a run of \c #
+ * characters in \c filename (and \c emissionFilename or 
+ * \c temperatureFilename) is replaced by the zero-padded integer
+ * \c frame, e.g. <tt>smoke_####.vol</tt>. While a frame renders, the 
+ * files of the next \c prefetchFrames frames (default: 1 for sequences)
+ * are read into the page cache in the background (on Linux), so that
+ * the medium of the next frame (which \c nori loads in the background
+ * when rendering several scene files) maps them without waiting for
+ * the disk. The mapping of
+ * a frame is released together with its scene. For motion blur,
+ * \c frameInterpolation also loads the next frame, and traces every ray 
+ * through it with a probability that rises linearly from 0 to 1 within
+ * \c frameDuration of the ray's time (the time of the frame is zero).
+ * The choice is a hash of the time, so that all rays of a path agree on
+ * it. This fades between the frames, rather than interpolating their
+ * densities, and emission is only taken from the current frame.
  */
 class HeterogeneousMedium : public Medium {
 public:
-	HeterogeneousMedium(const PropertyList &propList) {
-		// Denotes the scattering albedo
-		m_albedo = propList.getColor("albedo");
+	/// Method used to estimate transmittances
+	enum ETransmittanceEstimator {
+		EDeltaTracking = 0,
+		ERatioTracking,
+		EResidualRatioTracking
+	};
 
+	/**
+	 * \brief Load the medium, or with a nonzero \c frameOffset, a later
+	 * frame of its sequence (without interpolation and prefetching)
+	 */
+	HeterogeneousMedium(const PropertyList &propList, int frameOffset = 0) {
 		// An (optional) transformation that converts between medium and world coordinates
-		m_worldToMedium = propList.getTransform("toWorld", Transform()).inverse();
+		m_mediumToWorld = propList.getTransform("toWorld", Transform());
+		m_worldToMedium = m_mediumToWorld.inverse();
+		m_volumeScale = std::abs(m_mediumToWorld.getMatrix().topLeftCorner<3,3>().determinant());
 
 		// Optional multiplicative factor that will be applied to all density values in the file
 		m_densityMultiplier = propList.getFloat("densityMultiplier", 1.0f);
 
-		m_filename = propList.getString("filename");
+		/* Frame of a sequence of volumes (see the class description) */
+		QString pattern = propList.getString("filename");
+		m_frame = propList.getInteger("frame", 0) + frameOffset;
+		m_filename = frameFilename(pattern, m_frame);
 		QByteArray filename = m_filename.toLocal8Bit();
 		QFile file(m_filename);
 
 		if (!file.exists())
 			throw NoriException(QString("The file \"%1\" does not exist!").arg(m_filename));
+		m_fileSize = (size_t) file.size();
+
+		/* Read the bricks of sparse volumes through the VolumeCache instead
+		   of mapping the file (e.g. on network file systems) */
+		bool brickCache = propList.getBoolean("brickCache", false);
+		m_mapping = NULL;
+		m_brickFile = NULL;
+		std::vector<char> headerData;
+		const char *contents;
+		if (brickCache) {
+			cout << "Reading \"" << filename.data() << "\" through the volume cache .." << endl;
+			headerData.resize(std::min(m_fileSize, sizeof(SparseVolumeHeader)));
+			if (!file.open(QIODevice::ReadOnly) || file.read(&headerData[0],
+					(qint64) headerData.size()) != (qint64) headerData.size())
+				throw NoriException(QString("Could not read \"%1\"!").arg(m_filename));
+			contents = &headerData[0];
+		} else {
+			mapFile(propList);
+			contents = m_mapping;
+		}
 
 		/* Parse the file header */
-		file.open(QIODevice::ReadOnly);
-		QDataStream stream(&file);
-		stream.setByteOrder(QDataStream::LittleEndian);
+		m_data = NULL;
+		m_brickIndex = NULL;
+		m_bricks = NULL;
+		m_brickScales = NULL;
+		m_voxelScale = 1.0f;
+		if (m_fileSize >= 48 && memcmp(contents, "VOL", 3) == 0 && contents[3] == 3) {
+			if (brickCache)
+				throw NoriException("The brickCache requires a sparse volume "
+					"(see nori --convert)!");
+			int32_t type, channels;
+			memcpy(&type, contents + 4, sizeof(int32_t));
+			memcpy(m_resolution.data(), contents + 8, 3 * sizeof(int32_t));
+			memcpy(&channels, contents + 20, sizeof(int32_t));
+			if (voxelSize(type) == 0)
+				throw NoriException(QString("Unsupported volume data type %1 (must be "
+					"1 = float32, 2 = float16 or 3 = uint8)").arg(type));
+			if (channels < 1 || (m_resolution.array() < 2).any() || m_fileSize < 48 + voxelSize(type)
+					* (size_t) channels * m_resolution.x() * m_resolution.y() * m_resolution.z())
+				throw NoriException("This is not a valid volume data file!");
+			m_channels = channels;
+			m_data = contents + 48; // Shift past the header
+			m_encoding = type;
+			if (m_encoding == EUInt8)
+				m_voxelScale = 1.0f / 255.0f;
+			m_sparse = false;
+		} else if (m_fileSize >= sizeof(SparseVolumeHeader) && memcmp(contents, "NSV", 3) == 0
+				&& contents[3] == NORI_SPARSE_VOLUME_VERSION) {
+			SparseVolumeHeader header;
+			memcpy(&header, contents, sizeof(SparseVolumeHeader));
+			m_resolution = Vector3i(header.resolution[0], header.resolution[1], header.resolution[2]);
+			m_brickSize = header.brickSize;
+			m_encoding = (int) header.encoding;
+			size_t brickCount = (size_t) header.gridSize[0] * header.gridSize[1] * header.gridSize[2];
+			m_channels = (int) header.channels;
+			size_t brickVoxels = (size_t) (m_brickSize + 1) * (m_brickSize + 1) * (m_brickSize + 1);
+			bool valid = (m_resolution.array() >= 2).all() && m_brickSize >= 1 
+				&& m_channels >= 1 && voxelSize(m_encoding) != 0;
+			for (int i=0; i<3 && valid; ++i)
+				valid = header.gridSize[i] == (m_resolution[i] - 1 + m_brickSize - 1) / m_brickSize;
+			if (!valid || header.indexOffset + brickCount * sizeof(int32_t) > m_fileSize ||
+					header.brickOffset + header.brickCount * brickVoxels * m_channels
+						* voxelSize(m_encoding) > m_fileSize ||
+					(m_encoding == EUInt8 && header.scaleOffset + header.brickCount 
+						* m_channels * sizeof(float) > m_fileSize))
+				throw NoriException("This is not a valid sparse volume file!");
+			m_brickBytes = brickVoxels * m_channels * voxelSize(m_encoding);
+			if (brickCache) {
+				/* Keep the index and the scales in memory */
+				m_residentIndex.resize(brickCount);
+				readRange(file, header.indexOffset, &m_residentIndex[0], brickCount * sizeof(int32_t));
+				m_brickIndex = &m_residentIndex[0];
+				if (m_encoding == EUInt8) {
+					m_residentScales.resize((size_t) header.brickCount * m_channels);
+					readRange(file, header.scaleOffset, &m_residentScales[0],
+						m_residentScales.size() * sizeof(float));
+					m_brickScales = m_residentScales.empty() ? NULL : &m_residentScales[0];
+				}
+				m_brickFile = new BrickFile(m_filename, header.brickOffset, m_brickBytes);
+			} else {
+				m_brickIndex = (const int32_t *) (m_mapping + header.indexOffset);
+				m_bricks = m_mapping + header.brickOffset;
+				if (m_encoding == EUInt8)
+					m_brickScales = (const float *) (m_mapping + header.scaleOffset);
+			}
+			for (size_t i=0; i<brickCount; ++i) {
+				if (m_brickIndex[i] >= (int32_t) header.brickCount)
+					throw NoriException("The sparse volume file contains an invalid brick index!");
+			}
+			m_sparse = true;
+			cout << "Sparse volume: " << header.brickCount << " of " << brickCount 
+				 << " bricks are stored" << endl;
+		} else {
+			throw NoriException("This is not a valid volume data file!");
+		}
 
-		qint8 header[3], version; qint32 type;
-		stream >> header[0] >> header[1] >> header[2] >> version >> type;
+		cout << "Volume resolution: " << m_resolution.x() << "x" 
+			 << m_resolution.y() << "x" << m_resolution.z() << " ("
+			 << voxelEncodingName(m_encoding) << ", " << m_channels << " channel(s))" << endl;
 
-		if (memcmp(header, "VOL", 3) != 0 || version != 3)
-			throw NoriException("This is not a valid volume data file!");
+		/* Meaning of the channels of the voxels, e.g. "density, albedo, temperature" */
+		m_channelNames = propList.getString("channels", m_channels == 1 ? "density" : "");
+		parseChannels(m_channelNames);
 
-		stream >> m_resolution.x() >> m_resolution.y() >> m_resolution.z();
-		file.close();
+		// Denotes the scattering albedo (a factor of the albedo channel, if there is one)
+		m_albedo = m_albedoChannel >= 0 ? propList.getColor("albedo", Color3f(1.0f))
+			: propList.getColor("albedo");
 
-		cout << "Mapping \"" << filename.data() << "\" (" << m_resolution.x()
-			<< "x" << m_resolution.y() << "x" << m_resolution.z() << ") into memory .." << endl;
+		/* Edge length of the cells of the majorant grid in voxels */
+		m_majorantCellSize = m_sparse ? m_brickSize : propList.getInteger("majorantCellSize", 8);
+		if (m_majorantCellSize < 1)
+			throw NoriException(QString("Invalid majorantCellSize value %1 "
+				"(must be >= 1)").arg(m_majorantCellSize));
 
-		m_fileSize = (size_t) file.size();
+		/* Memory layout of dense volumes: "linear" (as in the file) or "tiled" */
+		QString layout = propList.getString("layout", "linear");
+		if (layout == "tiled") {
+			if (!m_sparse)
+				tileVolume();
+		} else if (layout != "linear") {
+			throw NoriException(QString("Unknown layout \"%1\" (must be "
+				"\"linear\" or \"tiled\")").arg(layout));
+		}
+
+		switch (m_encoding) {
+			case EFloat16: buildMajorants<half>(); break;
+			case EUInt8: buildMajorants<uint8_t>(); break;
+			default: buildMajorants<float>(); break;
+		}
+
+		/* Region covered by the voxels in local coordinates (see clipRay()) */
+		m_domain = BoundingBox3f(Point3f(0.0f), Point3f(
+			(m_resolution.x() - 1) / (float) m_resolution.x(),
+			(m_resolution.y() - 1) / (float) m_resolution.y(),
+			(m_resolution.z() - 1) / (float) m_resolution.z()));
+
+		/* Transmittance estimator: "delta", "ratio" or "residual" */
+		QString estimator = propList.getString("transmittanceEstimator", "ratio");
+		if (estimator == "delta")
+			m_estimator = EDeltaTracking;
+		else if (estimator == "ratio")
+			m_estimator = ERatioTracking;
+		else if (estimator == "residual")
+			m_estimator = EResidualRatioTracking;
+		else
+			throw NoriException(QString("Unknown transmittanceEstimator \"%1\" "
+				"(must be \"delta\", \"ratio\" or \"residual\")").arg(estimator));
+
+		/* Sample collisions with the minimum density of each cell analytically */
+		m_decomposition = propList.getBoolean("decompositionTracking", true);
+
+		/* Biased ray marching instead of tracking (for previews), and the
+		   largest variation of the optical depth within one step */
+		m_rayMarching = propList.getBoolean("rayMarching", false);
+		m_marchingTolerance = propList.getFloat("marchingTolerance", 0.05f);
+		if (m_marchingTolerance <= 0)
+			throw NoriException("The marchingTolerance must be positive!");
+
+		/* Optional emission: a grid of emitted radiance, and/or a grid of
+		   temperatures whose blackbody radiance is emitted */
+		m_absorption = Color3f(Color3f(1.0f) - m_albedo).clamp();
+		m_emissionFilename = frameFilename(propList.getString("emissionFilename", ""), m_frame);
+		m_emissionScale = propList.getColor("emissionScale", Color3f(1.0f));
+		m_temperatureFilename = frameFilename(propList.getString("temperatureFilename", ""), m_frame);
+		m_temperatureScale = propList.getFloat("temperatureScale", 1.0f);
+		m_blackbodyScale = propList.getFloat("blackbodyScale", 1.0f);
+		m_maxTemperature = m_emittedPower = 0.0f;
+		if (!m_emissionFilename.isEmpty()) {
+			if (m_emissionChannel >= 0)
+				throw NoriException("The emission is given both by a channel and a separate file!");
+			loadGrid(m_emission, m_emissionFilename);
+		}
+		if (!m_temperatureFilename.isEmpty()) {
+			if (m_temperatureChannel >= 0)
+				throw NoriException("The temperature is given both by a channel and a separate file!");
+			loadGrid(m_temperature, m_temperatureFilename);
+		}
+		bool hasEmission = m_emissionChannel >= 0 || !m_emission.values.empty(),
+		     hasTemperature = m_temperatureChannel >= 0 || !m_temperature.values.empty();
+		if (hasTemperature)
+			buildBlackbodyTable();
+		if (hasEmission || hasTemperature)
+			buildEmissionDistribution();
+
+		/* Animation: blend with the next frame, and read ahead the files 
+		   of the following ones while this frame renders */
+		m_nextFrame = NULL;
+		m_frameDuration = propList.getFloat("frameDuration", 1.0f);
+		bool sequence = pattern.contains('#'),
+		     blend = propList.getBoolean("frameInterpolation", false);
+		if (frameOffset != 0)
+			return;
+		if (blend) {
+			if (!sequence)
+				throw NoriException("frameInterpolation requires a sequence of volumes "
+					"(a filename containing '#')!");
+			if (m_frameDuration <= 0)
+				throw NoriException("The frameDuration must be positive!");
+			m_nextFrame = new HeterogeneousMedium(propList, 1);
+		}
+		int prefetchFrames = propList.getInteger("prefetchFrames", sequence ? 1 : 0);
+		for (int i=1; i<=prefetchFrames && sequence; ++i) {
+			int frame = m_frame + (blend ? 1 : 0) + i;
+			prefetchFile(frameFilename(pattern, frame));
+			if (!m_emissionFilename.isEmpty())
+				prefetchFile(frameFilename(propList.getString("emissionFilename"), frame));
+			if (!m_temperatureFilename.isEmpty())
+				prefetchFile(frameFilename(propList.getString("temperatureFilename"), frame));
+		}
+	}
+
+	/// Map the volume file into memory
+	void mapFile(const PropertyList &propList) {
+		QByteArray filename = m_filename.toLocal8Bit();
+		cout << "Mapping \"" << filename.data() << "\" into memory .." << endl;
 		#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
 			int fd = open(filename.data(), O_RDONLY);
 			if (fd == -1)
 				throw NoriException(QString("Could not open \"%1\"!").arg(m_filename));
-			m_data = (float *) mmap(NULL, m_fileSize, PROT_READ, MAP_SHARED, fd, 0);
-			if (m_data == NULL)
+			void *mapping = mmap(NULL, m_fileSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping == MAP_FAILED)
 				throw NoriException("mmap(): failed.");
 			if (close(fd) != 0)
 				throw NoriException("close(): unable to close file descriptor!");
+			m_mapping = (char *) mapping;
+
+			/* Optionally tell the kernel how the mapping will be used */
+			if (propList.getBoolean("preload", false))
+				adviseMapping(MADV_WILLNEED, "MADV_WILLNEED");
+			if (propList.getBoolean("hugePages", false)) {
+				#if defined(MADV_HUGEPAGE)
+					adviseMapping(MADV_HUGEPAGE, "MADV_HUGEPAGE");
+				#else
+					cerr << "Warning: huge pages aren't supported on this platform" << endl;
+				#endif
+			}
 		#elif defined(PLATFORM_WINDOWS)
 			m_file = CreateFileA(filename.data(), GENERIC_READ, 
 				FILE_SHARE_READ, NULL, OPEN_EXISTING, 
@@ -94,99 +881,1098 @@ public:
 			m_fileMapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
 			if (m_fileMapping == NULL)
 				throw NoriException("CreateFileMapping(): failed.");
-			m_data = (float *) MapViewOfFile(m_fileMapping, FILE_MAP_READ, 0, 0, 0);
-			if (m_data == NULL)
+			m_mapping = (char *) MapViewOfFile(m_fileMapping, FILE_MAP_READ, 0, 0, 0);
+			if (m_mapping == NULL)
 				throw NoriException("MapViewOfFile(): failed.");
 		#endif
+		PagedMemory::getInstance()->addRegion(m_mapping, m_fileSize);
+	}
+
+	/**
+	 * \brief Read a range of a file that is accessed through the \ref VolumeCache
+	 * (i.e. that isn't mapped) into memory
+	 */
+	void readRange(QFile &file, uint64_t offset, void *data, size_t size) {
+		if (size == 0)
+			return;
+		if (!file.seek((qint64) offset) || file.read((char *) data, (qint64) size) != (qint64) size)
+			throw NoriException(QString("Could not read \"%1\"!").arg(m_filename));
+	}
 
-		m_data += 12; // Shift past the header
+	/**
+	 * \brief Replace the last run of '#' characters in a filename by the
+	 * frame number, padded with zeros to the length of the run
+	 */
+	static QString frameFilename(const QString &pattern, int frame) {
+		int end = pattern.lastIndexOf('#');
+		if (end < 0)
+			return pattern;
+		int begin = end;
+		while (begin > 0 && pattern[begin - 1] == '#')
+			--begin;
+		return QString(pattern).replace(begin, end - begin + 1,
+			QString("%1").arg(frame, end - begin + 1, 10, QChar('0')));
+	}
+
+	/**
+	 * \brief Ask the kernel to read a file into the page cache in the
+	 * background (nothing happens if it doesn't exist, or elsewhere than
+	 * on Linux)
+	 */
+	static void prefetchFile(const QString &filename) {
+		#if defined(POSIX_FADV_WILLNEED)
+			int fd = open(filename.toLocal8Bit().data(), O_RDONLY);
+			if (fd == -1)
+				return;
+			if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0)
+				cout << "Prefetching \"" << qPrintable(filename) << "\" .." << endl;
+			close(fd);
+		#endif
+	}
+
+	/**
+	 * \brief Should a ray at the given time be traced through the next 
+	 * frame (see the class description)?
+	 */
+	inline bool useNextFrame(float time) const {
+		float weight = time / m_frameDuration;
+		if (weight <= 0)
+			return false;
+		else if (weight >= 1)
+			return true;
+		uint32_t h;
+		memcpy(&h, &time, sizeof(uint32_t));
+
+		/* Finalizer of MurmurHash3 */
+		h = (h ^ (h >> 16)) * 0x85ebca6bU;
+		h = (h ^ (h >> 13)) * 0xc2b2ae35U;
+		h ^= h >> 16;
+		return (h >> 8) * (1.0f / (1 << 24)) < weight;
+	}
+
+	/**
+	 * \brief Assign the channels of the voxels from a comma-separated list
+	 *
+	 * The first channel is always the \c density. Further channels are
+	 * \c albedo (a gray albedo), \c albedo.r, \c albedo.g and \c albedo.b
+	 * (in this order), \c emission and \c temperature.
+	 */
+	void parseChannels(const QString &layout) {
+		QStringList names = layout.split(",");
+		if (names.size() != m_channels)
+			throw NoriException(QString("The volume has %1 channel(s), but the \"channels\" "
+				"parameter lists %2 (e.g. \"density, albedo, temperature\")")
+				.arg(m_channels).arg(layout.trimmed().isEmpty() ? 0 : names.size()));
+		if (m_channels > NORI_MAX_VOLUME_CHANNELS)
+			throw NoriException(QString("Volumes with more than %1 channels are not "
+				"supported!").arg(NORI_MAX_VOLUME_CHANNELS));
+
+		m_albedoChannel = m_emissionChannel = m_temperatureChannel = -1;
+		m_albedoChannelCount = 0;
+		for (int i=0; i<names.size(); ++i) {
+			QString name = names[i].trimmed();
+			int *channel = NULL;
+			if ((i == 0) != (name == "density"))
+				throw NoriException("The first channel (and only that one) must be the density!");
+			else if (name == "density")
+				continue;
+			else if (name == "albedo" || name == "albedo.r")
+				channel = &m_albedoChannel;
+			else if (name == "emission")
+				channel = &m_emissionChannel;
+			else if (name == "temperature")
+				channel = &m_temperatureChannel;
+			else
+				throw NoriException(QString("Unknown channel \"%1\" (must be \"density\", "
+					"\"albedo\", \"albedo.r/g/b\", \"emission\" or \"temperature\")").arg(name));
+			if (*channel >= 0)
+				throw NoriException(QString("The channel \"%1\" is listed twice!").arg(name));
+			*channel = i;
+
+			if (name == "albedo.r") {
+				if (i + 2 >= names.size() || names[i+1].trimmed() != "albedo.g" 
+						|| names[i+2].trimmed() != "albedo.b")
+					throw NoriException("The channel \"albedo.r\" must be followed by "
+						"\"albedo.g\" and \"albedo.b\"!");
+				m_albedoChannelCount = 3;
+				i += 2;
+			} else if (name == "albedo") {
+				m_albedoChannelCount = 1;
+			}
+		}
 	}
 
 	virtual ~HeterogeneousMedium() {
-		if (m_data) {
-			m_data -= 12;
+		delete m_nextFrame;
+		delete m_brickFile;
+		unmap();
+	}
+
+	void unmap() {
+		if (!m_mapping)
+			return;
+		cout << "Unmapping \"" << qPrintable(m_filename) << "\" from memory.." << endl;
+		PagedMemory::getInstance()->removeRegion(m_mapping);
+		#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+			int retval = munmap(m_mapping, m_fileSize);
+			if (retval != 0)
+				throw NoriException("munmap(): unable to unmap memory!");
+		#elif defined(PLATFORM_WINDOWS)
+			if (!UnmapViewOfFile(m_mapping))
+				throw NoriException("UnmapViewOfFile(): unable to unmap memory region");
+			if (!CloseHandle(m_fileMapping))
+				throw NoriException("CloseHandle(): unable to close file mapping!");
+			if (!CloseHandle(m_file))
+				throw NoriException("CloseHandle(): unable to close file");
+		#endif
+		m_mapping = NULL;
+	}
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+	/// Pass a hint about the access pattern of the mapping to the kernel
+	void adviseMapping(int advice, const char *name) {
+		if (madvise(m_mapping, m_fileSize, advice) != 0)
+			cerr << "Warning: madvise(" << name << ") failed for \"" 
+				 << qPrintable(m_filename) << "\"" << endl;
+	}
+#endif
+
+	/**
+	 * \brief Copy a dense volume into bricks of \c m_majorantCellSize voxels
+	 * (without the empty ones), which are stored along a Morton curve
+	 *
+	 * Afterwards, the medium behaves like one loaded from a sparse volume,
+	 * and the file is no longer needed.
+	 */
+	void tileVolume() {
+		int B = m_majorantCellSize;
+		Vector3i gridSize;
+		for (int i=0; i<3; ++i)
+			gridSize[i] = (m_resolution[i] - 1 + B - 1) / B;
+		size_t brickVoxels = (size_t) (B + 1) * (B + 1) * (B + 1);
+		std::vector<uint32_t> order = mortonOrder(gridSize);
 
-			cout << "Unmapping \"" << qPrintable(m_filename) << "\" from memory.." << endl;
-			#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
-				int retval = munmap(m_data, m_fileSize);
-				if (retval != 0)
-					throw NoriException("munmap(): unable to unmap memory!");
-			#elif defined(PLATFORM_WINDOWS)
-				if (!UnmapViewOfFile(m_data))
-					throw NoriException("UnmapViewOfFile(): unable to unmap memory region");
-				if (!CloseHandle(m_fileMapping))
-					throw NoriException("CloseHandle(): unable to close file mapping!");
-				if (!CloseHandle(m_file))
-					throw NoriException("CloseHandle(): unable to close file");
-			#endif
+		/* Keep the quantized values of 8-bit volumes as they are */
+		float scale = m_encoding == EUInt8 ? 1.0f / 255.0f : 0.0f;
+		std::vector<float> brick(brickVoxels * m_channels);
+		std::vector<char> encoded;
+		m_tiledIndex.resize(order.size());
+		for (size_t i=0; i<order.size(); ++i) {
+			uint32_t cell = order[i];
+			Point3i p(cell % gridSize.x(), (cell / gridSize.x()) % gridSize.y(),
+				cell / gridSize.x() / gridSize.y());
+			if (!gatherBrick(m_data, m_encoding, m_channels, m_resolution, B, p, &brick[0])) {
+				m_tiledIndex[cell] = -1;
+				continue;
+			}
+			m_tiledIndex[cell] = (int32_t) (m_tiledScales.size() / m_channels);
+			m_tiledScales.resize(m_tiledScales.size() + m_channels);
+			encodeBrick(brick, m_channels, m_encoding, encoded,
+				&m_tiledScales[m_tiledScales.size() - m_channels], scale);
+			m_tiledBricks.insert(m_tiledBricks.end(), encoded.begin(), encoded.end());
 		}
+		unmap();
+
+		m_data = NULL;
+		m_sparse = true;
+		m_brickSize = B;
+		m_brickBytes = brickVoxels * m_channels * voxelSize(m_encoding);
+		m_brickIndex = &m_tiledIndex[0];
+		m_bricks = m_tiledBricks.empty() ? NULL : &m_tiledBricks[0];
+		m_brickScales = m_tiledScales.empty() ? NULL : &m_tiledScales[0];
+		cout << "Tiled layout: " << m_tiledScales.size() / m_channels << " of " << order.size() 
+			 << " bricks are stored" << endl;
 	}
 
 	/**
-	 * \brief Evaluate sigma_t(p), where 'p' is given in local coordinates
+	 * \brief Return the contents of a stored brick of a sparse volume
+	 *
+	 * Bricks that are read through the \ref VolumeCache remain valid
+	 * until the calling thread requests further bricks.
+	 */
+	inline const char *getBrick(int32_t brick) const {
+		if (m_brickFile)
+			return VolumeCache::getInstance()->getBrick(m_brickFile, (uint32_t) brick)->data;
+		return m_bricks + brick * m_brickBytes;
+	}
+
+	/**
+	 * \brief Prefetch the brick of a cell of the majorant grid (bricked
+	 * volumes only), or have it read in the background by the \ref VolumeCache
+	 */
+	inline void prefetchCell(int cell) const {
+		if (!m_sparse || cell < 0 || m_brickIndex[cell] < 0)
+			return;
+		if (m_brickFile) {
+			VolumeCache::getInstance()->prefetch(m_brickFile, (uint32_t) m_brickIndex[cell]);
+			return;
+		}
+		const char *brick = m_bricks + m_brickIndex[cell] * m_brickBytes;
+		for (size_t i=0; i<m_brickBytes; i += NORI_CACHE_LINE_SIZE)
+			PREFETCH(brick + i);
+	}
+
+	/**
+	 * \brief Compute the minimum and maximum density of every cell
+	 * of the majorant grid
+	 *
+	 * A cell covers the interpolation intervals of \c m_majorantCellSize 
+	 * voxels along each axis. Since trilinear interpolation stays within
+	 * the range of its inputs, the voxels that these intervals touch
+	 * bound the density within the cell. For sparse volumes, the cells
+	 * are the bricks, and empty bricks aren't accessed at all.
+	 */
+	template <typename T> void buildMajorants() {
+		int B = m_majorantCellSize;
+		for (int i=0; i<3; ++i)
+			m_gridSize[i] = std::max(1, (m_resolution[i] - 1 + B - 1) / B);
+		m_bounds.resize((size_t) m_gridSize.x() * m_gridSize.y() * m_gridSize.z());
+
+		const T *data = (const T *) m_data;
+		size_t row = m_resolution.x(), slab = row * m_resolution.y(), C = m_channels;
+		size_t brickVoxels = (size_t) (B + 1) * (B + 1) * (B + 1);
+		float maxMajorant = 0;
+		for (int cz=0; cz<m_gridSize.z(); ++cz) {
+			for (int cy=0; cy<m_gridSize.y(); ++cy) {
+				for (int cx=0; cx<m_gridSize.x(); ++cx) {
+					size_t cell = ((size_t) cz * m_gridSize.y() + cy) * m_gridSize.x() + cx;
+					DensityBounds bounds;
+					bounds.minimum = std::numeric_limits<float>::infinity();
+					bounds.maximum = 0;
+					if (m_sparse) {
+						/* Bricks at the end of the volume are padded with
+						   zeros, which merely loosens their lower bound */
+						if (m_brickIndex[cell] < 0) {
+							bounds.minimum = 0;
+						} else {
+							const T *brick = (const T *) getBrick(m_brickIndex[cell]);
+							float scale = VoxelTraits<T>::quantized ? m_brickScales[m_brickIndex[cell] * C] : 1.0f;
+							for (size_t i=0; i<brickVoxels; ++i) {
+								float value = VoxelTraits<T>::decode(brick[i * C]) * scale;
+								bounds.minimum = std::min(bounds.minimum, value);
+								bounds.maximum = std::max(bounds.maximum, value);
+							}
+						}
+					} else {
+						for (int z=cz*B; z<=std::min((cz+1)*B, m_resolution.z()-1); ++z) {
+							for (int y=cy*B; y<=std::min((cy+1)*B, m_resolution.y()-1); ++y) {
+								for (int x=cx*B; x<=std::min((cx+1)*B, m_resolution.x()-1); ++x) {
+									float value = VoxelTraits<T>::decode(data[(z*slab + y*row + x) * C]) * m_voxelScale;
+									bounds.minimum = std::min(bounds.minimum, value);
+									bounds.maximum = std::max(bounds.maximum, value);
+								}
+							}
+						}
+					}
+					/* Points outside of the interpolation domain have zero density */
+					bounds.minimum = std::max(bounds.minimum, 0.0f) * m_densityMultiplier;
+					bounds.maximum *= m_densityMultiplier;
+					m_bounds[cell] = bounds;
+					maxMajorant = std::max(maxMajorant, bounds.maximum);
+				}
+			}
+		}
+
+		cout << "Built a " << m_gridSize.x() << "x" << m_gridSize.y() << "x" 
+			 << m_gridSize.z() << " majorant grid (maximum density " 
+			 << maxMajorant << ")" << endl;
+	}
+
+	/// Load an emission or temperature grid, which must match the density grid
+	void loadGrid(DenseGrid &grid, const QString &filename) {
+		grid.load(filename);
+		if (grid.resolution != m_resolution)
+			throw NoriException(QString("The resolution of \"%1\" doesn't match that "
+				"of the density values!").arg(filename));
+	}
+
+	/**
+	 * \brief Return a value of a voxel, e.g. to build data structures
+	 * over the volume (slow)
+	 */
+	float voxelValue(int x, int y, int z, int channel) const {
+		float value;
+		if (m_sparse) {
+			Point3i p(x, y, z);
+			Point3i cell = (p / m_brickSize).cwiseMin(m_gridSize - Vector3i(1, 1, 1));
+			int32_t brick = m_brickIndex[(cell.z() * m_gridSize.y() 
+				+ cell.y()) * m_gridSize.x() + cell.x()];
+			if (brick < 0)
+				return 0.0f;
+			Point3i local = p - cell * m_brickSize;
+			size_t row = m_brickSize + 1, slab = row * row;
+			value = decodeVoxel(getBrick(brick), m_encoding, 
+				(local.z()*slab + local.y()*row + local.x()) * m_channels + channel);
+			if (m_encoding == EUInt8)
+				value *= 255.0f * m_brickScales[brick * m_channels + channel];
+		} else {
+			size_t row = m_resolution.x(), slab = row * m_resolution.y();
+			value = decodeVoxel(m_data, m_encoding, (z*slab + y*row + x) * m_channels + channel);
+		}
+		return channel == 0 ? value * m_densityMultiplier : value;
+	}
+
+	/**
+	 * \brief Tabulate the blackbody radiance up to the highest temperature
+	 * of the volume (times \c blackbodyScale)
+	 */
+	void buildBlackbodyTable() {
+		float maxTemperature = 0.0f;
+		if (m_temperatureChannel >= 0) {
+			for (int z=0; z<m_resolution.z(); ++z)
+				for (int y=0; y<m_resolution.y(); ++y)
+					for (int x=0; x<m_resolution.x(); ++x)
+						maxTemperature = std::max(maxTemperature, 
+							voxelValue(x, y, z, m_temperatureChannel));
+		} else {
+			for (size_t i=0; i<m_temperature.values.size(); ++i)
+				maxTemperature = std::max(maxTemperature, m_temperature.values[i]);
+		}
+		m_maxTemperature = maxTemperature * m_temperatureScale;
+		m_blackbody.resize(NORI_BLACKBODY_TABLE_SIZE);
+		for (int i=0; i<NORI_BLACKBODY_TABLE_SIZE; ++i)
+			m_blackbody[i] = blackbody(m_maxTemperature * i / (NORI_BLACKBODY_TABLE_SIZE - 1))
+				* m_blackbodyScale;
+	}
+
+	/// Look up the (scaled) blackbody radiance at the given temperature
+	inline Color3f lookupBlackbody(float temperature) const {
+		if (temperature <= 0 || m_maxTemperature <= 0)
+			return Color3f(0.0f);
+		float x = std::min(temperature / m_maxTemperature, 1.0f) * (NORI_BLACKBODY_TABLE_SIZE - 1);
+		int i = std::min((int) x, NORI_BLACKBODY_TABLE_SIZE - 2);
+		float w = x - i;
+		return m_blackbody[i] * (1 - w) + m_blackbody[i + 1] * w;
+	}
+
+	/**
+	 * \brief Return the albedo given the channels of a voxel or of
+	 * \ref lookupChannels()
+	 */
+	inline Color3f albedo(const float *values) const {
+		if (m_albedoChannelCount == 3)
+			return m_albedo * Color3f(values[m_albedoChannel],
+				values[m_albedoChannel + 1], values[m_albedoChannel + 2]);
+		else if (m_albedoChannelCount == 1)
+			return m_albedo * values[m_albedoChannel];
+		return m_albedo;
+	}
+
+	/// Return the absorbed fraction of sigma_t given the channels (see above)
+	inline Color3f absorption(const float *values) const {
+		if (m_albedoChannel < 0)
+			return m_absorption;
+		return Color3f(Color3f(1.0f) - albedo(values)).clamp();
+	}
+
+	/**
+	 * \brief Evaluate the emitted radiance Le(p) given the channels at
+	 * 'p' (in local coordinates, for the emission and temperature files)
+	 */
+	inline Color3f evalRadiance(const Point3f &p, const float *values) const {
+		Color3f result(0.0f);
+		if (m_emissionChannel >= 0)
+			result += m_emissionScale * std::max(values[m_emissionChannel], 0.0f);
+		else if (!m_emission.values.empty())
+			result += m_emissionScale * std::max(m_emission.lookup(p), 0.0f);
+		if (m_temperatureChannel >= 0)
+			result += lookupBlackbody(values[m_temperatureChannel] * m_temperatureScale);
+		else if (!m_temperature.values.empty())
+			result += lookupBlackbody(m_temperature.lookup(p) * m_temperatureScale);
+		return result;
+	}
+
+	/// Return the emitted radiance and the absorption at a voxel
+	inline Color3f voxelRadiance(int x, int y, int z, float &absorbed) const {
+		float values[NORI_MAX_VOLUME_CHANNELS];
+		for (int c=1; c<m_channels; ++c)
+			values[c] = voxelValue(x, y, z, c);
+		absorbed = absorption(values).getLuminance();
+
+		Color3f result(0.0f);
+		if (m_emissionChannel >= 0)
+			result += m_emissionScale * std::max(values[m_emissionChannel], 0.0f);
+		else if (!m_emission.values.empty())
+			result += m_emissionScale * std::max(m_emission.get(x, y, z), 0.0f);
+		if (m_temperatureChannel >= 0)
+			result += lookupBlackbody(values[m_temperatureChannel] * m_temperatureScale);
+		else if (!m_temperature.values.empty())
+			result += lookupBlackbody(m_temperature.get(x, y, z) * m_temperatureScale);
+		return result;
+	}
+
+	/// Return the extents of a cell of the majorant grid in local coordinates
+	inline void cellBounds(const Point3i &cell, Point3f &min, Point3f &max) const {
+		for (int i=0; i<3; ++i) {
+			min[i] = (float) (cell[i] * m_majorantCellSize) / m_resolution[i];
+			max[i] = (float) std::min((cell[i] + 1) * m_majorantCellSize, 
+				m_resolution[i] - 1) / m_resolution[i];
+		}
+	}
+
+	/**
+	 * \brief Build the distribution of \ref sampleEmissionPosition() over
+	 * the cells of the majorant grid
 	 *
-	 * You may assume that the maximum value returned by this function is
-	 * equal to 'm_densityMultiplier'
+	 * The weight of a cell estimates its emitted power: its volume times
+	 * the mean of its density bounds, and the mean absorption and radiance
+	 * of its voxels. It is nonzero wherever the emission may be, hence
+	 * sampling is unbiased, but the better it matches the product of the
+	 * interpolated density and radiance, the less noisy it is.
 	 */
-	float lookupSigmaT(const Point3f &_p) const {
+	void buildEmissionDistribution() {
+		int B = m_majorantCellSize;
+		m_emissionPDF.clear();
+		m_emissionPDF.reserve(m_bounds.size());
+		for (int cz=0; cz<m_gridSize.z(); ++cz) {
+			for (int cy=0; cy<m_gridSize.y(); ++cy) {
+				for (int cx=0; cx<m_gridSize.x(); ++cx) {
+					const DensityBounds &bounds = m_bounds[((size_t) cz * m_gridSize.y() 
+						+ cy) * m_gridSize.x() + cx];
+					if (bounds.maximum <= 0) {
+						m_emissionPDF.append(0.0f);
+						continue;
+					}
+					float radiance = 0.0f, absorption = 0.0f, absorbed;
+					int count = 0;
+					for (int z=cz*B; z<=std::min((cz+1)*B, m_resolution.z()-1); ++z) {
+						for (int y=cy*B; y<=std::min((cy+1)*B, m_resolution.y()-1); ++y) {
+							for (int x=cx*B; x<=std::min((cx+1)*B, m_resolution.x()-1); ++x) {
+								radiance += voxelRadiance(x, y, z, absorbed).getLuminance();
+								absorption += absorbed;
+								++count;
+							}
+						}
+					}
+					Point3f min, max;
+					cellBounds(Point3i(cx, cy, cz), min, max);
+					m_emissionPDF.append(0.5f * (bounds.minimum + bounds.maximum) 
+						* (absorption / count) * (radiance / count) * (max - min).prod());
+				}
+			}
+		}
+
+		/* Isotropic emission into the full sphere of directions */
+		m_emittedPower = m_emissionPDF.normalize() * m_volumeScale * 4 * (float) M_PI;
+		if (m_emittedPower > 0)
+			cout << "Built the emission distribution (power " << m_emittedPower << ")" << endl;
+		else
+			cerr << "Warning: the medium doesn't emit any light (the emission must overlap "
+				"with the density, and the albedo must be below one)" << endl;
+	}
+
+	/// Interpolate all channels for any encoding, where 'p' is given in local coordinates
+	inline void evalChannels(const Point3f &p, float *values) const {
+		switch (m_encoding) {
+			case EFloat16: lookupChannels<half>(p, values); break;
+			case EUInt8: lookupChannels<uint8_t>(p, values); break;
+			default: lookupChannels<float>(p, values); break;
+		}
+	}
+
+	Color3f evalEmission(const Point3f &_p) const {
+		if (m_emittedPower <= 0)
+			return Color3f(0.0f);
+		Point3f p = m_worldToMedium * _p;
+		float values[NORI_MAX_VOLUME_CHANNELS];
+		evalChannels(p, values);
+		return absorption(values) * evalRadiance(p, values) * values[0];
+	}
+
+	Color3f evalCollisionEmission(const Point3f &_p) const {
+		/* Collisions are sampled proportional to sigma_t, which cancels out */
+		if (m_emittedPower <= 0)
+			return Color3f(0.0f);
+		Point3f p = m_worldToMedium * _p;
+		float values[NORI_MAX_VOLUME_CHANNELS];
+		evalChannels(p, values);
+		return absorption(values) * evalRadiance(p, values);
+	}
+
+	float sampleEmissionPosition(const Point2f &_sample, Point3f &p) const {
+		if (m_emittedPower <= 0)
+			return 0.0f;
+		Point2f sample(_sample);
+		float pdf;
+		size_t index = m_emissionPDF.sampleReuse(sample.x(), pdf);
+		Point3i cell((int) (index % m_gridSize.x()), (int) ((index / m_gridSize.x()) % m_gridSize.y()),
+			(int) (index / ((size_t) m_gridSize.x() * m_gridSize.y())));
+		Point3f min, max;
+		cellBounds(cell, min, max);
+
+		/* Stretch the sample to three dimensions by splitting the
+		   second one into its leading and trailing digits */
+		float scaled = sample.y() * NORI_EMISSION_SAMPLE_SPLIT,
+		      leading = std::floor(scaled);
+		Vector3f u(sample.x(), (leading + 0.5f) / NORI_EMISSION_SAMPLE_SPLIT, scaled - leading);
+		p = m_mediumToWorld * Point3f(min + (max - min).cwiseProduct(u));
+		return pdf / ((max - min).prod() * m_volumeScale);
+	}
+
+	float pdfEmissionPosition(const Point3f &_p) const {
+		if (m_emittedPower <= 0)
+			return 0.0f;
+		Point3f p = (m_worldToMedium * _p).cwiseProduct(m_resolution.cast<float>());
+		if ((p.array() < 0).any() || (p.array() >= (m_resolution.array() - 1).cast<float>()).any())
+			return 0.0f;
+		Point3i cell = (p / (float) m_majorantCellSize).cast<int>();
+		cell = cell.cwiseMin(m_gridSize - Vector3i(1, 1, 1));
+		Point3f min, max;
+		cellBounds(cell, min, max);
+		return m_emissionPDF[((size_t) cell.z() * m_gridSize.y() + cell.y()) * m_gridSize.x()
+			+ cell.x()] / ((max - min).prod() * m_volumeScale);
+	}
+
+	float getEmittedPower() const {
+		return m_emittedPower;
+	}
+
+	/// Start traversing the majorant grid along a ray in local coordinates
+	inline MajorantTraversal traverse(const Ray3f &ray) const {
+		Vector3f scale = m_resolution.cast<float>();
+		return MajorantTraversal(ray.o.cwiseProduct(scale), ray.d.cwiseProduct(scale),
+			ray.mint, ray.maxt, &m_bounds[0], m_gridSize, m_majorantCellSize,
+			(m_resolution.array() - 1).cast<float>().matrix());
+	}
+
+	/**
+	 * \brief Find the eight voxels around 'p' (given in local coordinates)
+	 *
+	 * \param data
+	 *    Receives the first value of the voxel with the lowest coordinates.
+	 *    The values of the next voxels along x, y and z follow after
+	 *    \c m_channels, \c row and \c slab values.
+	 * \param brick
+	 *    Receives the index of the stored brick (-1 for dense volumes)
+	 * \param w
+	 *    Receives the interpolation weights of the upper voxels
+	 * \return \c false if 'p' lies outside of the volume or in an empty brick
+	 */
+	template <typename T> inline bool locateVoxels(const Point3f &_p, const T *&data,
+			size_t &row, size_t &slab, int32_t &brick, Vector3f &w) const {
 		Point3f p  = _p.cwiseProduct(m_resolution.cast<float>()),
 				pf = Point3f(std::floor(p.x()), std::floor(p.y()), std::floor(p.z()));
 		Point3i p0 = pf.cast<int>();
 
 		if ((p0.array() < 0).any() || (p0.array() >= m_resolution.array() - 1).any())
-			return 0.0f;
+			return false;
+		if (!locateVoxels<T>(p0, data, row, slab, brick))
+			return false;
+		w = p - pf;
+		return true;
+	}
 
-		size_t row    = m_resolution.x(),
-		       slab   = row * m_resolution.y(),
-		       offset = p0.z()*slab + p0.y()*row + p0.x();
+	/**
+	 * \brief Find the voxel values of the cell with lower corner \c p0
+	 * (which must lie inside of the volume, see \ref locateVoxels())
+	 */
+	template <typename T> inline bool locateVoxels(const Point3i &p0, const T *&data,
+			size_t &row, size_t &slab, int32_t &brick) const {
+		size_t offset;
+		if (m_sparse) {
+			/* All eight voxels lie within a single brick */
+			Point3i cell = p0 / m_brickSize;
+			brick = m_brickIndex[(cell.z() * m_gridSize.y() 
+				+ cell.y()) * m_gridSize.x() + cell.x()];
+			if (brick < 0)
+				return false;
 
-		const float
-			d000 = m_data[offset],
-			d001 = m_data[offset + 1],
-			d010 = m_data[offset + row],
-			d011 = m_data[offset + row + 1],
-			d100 = m_data[offset + slab],
-			d101 = m_data[offset + slab + 1],
-			d110 = m_data[offset + slab + row],
-			d111 = m_data[offset + slab + row + 1];
+			Point3i local = p0 - cell * m_brickSize;
+			row    = m_brickSize + 1;
+			slab   = row * row;
+			offset = local.z()*slab + local.y()*row + local.x();
+			data   = (const T *) getBrick(brick);
+		} else {
+			brick  = -1;
+			row    = m_resolution.x();
+			slab   = row * m_resolution.y();
+			offset = p0.z()*slab + p0.y()*row + p0.x();
+			data   = (const T *) m_data;
+		}
+		row *= m_channels;
+		slab *= m_channels;
+		data += offset * m_channels;
+		return true;
+	}
 
-		Vector3f w1 = p-pf, w0 = (1 - w1.array()).matrix();
+	/// Return the scale of the values of a channel in a brick (see \ref locateVoxels())
+	template <typename T> inline float channelScale(int32_t brick, int channel) const {
+		if (VoxelTraits<T>::quantized && brick >= 0)
+			return m_brickScales[brick * m_channels + channel];
+		return m_voxelScale;
+	}
+
+	/// Trilinearly interpolate the values of the voxels found by \ref locateVoxels()
+	template <typename T> inline float interpolate(const T *data, size_t row, size_t slab,
+			const Vector3f &w1) const {
+		typedef VoxelTraits<T> Traits;
+		size_t x = m_channels;
+		const float
+			d000 = Traits::decode(data[0]),
+			d001 = Traits::decode(data[x]),
+			d010 = Traits::decode(data[row]),
+			d011 = Traits::decode(data[row + x]),
+			d100 = Traits::decode(data[slab]),
+			d101 = Traits::decode(data[slab + x]),
+			d110 = Traits::decode(data[slab + row]),
+			d111 = Traits::decode(data[slab + row + x]);
 
-		/* Trilinearly interpolate */
+		Vector3f w0 = (1 - w1.array()).matrix();
 		return (((d000 * w0.x() + d001 * w1.x()) * w0.y() +
 		         (d010 * w0.x() + d011 * w1.x()) * w1.y()) * w0.z() +
 		        ((d100 * w0.x() + d101 * w1.x()) * w0.y() +
-		         (d110 * w0.x() + d111 * w1.x()) * w1.y()) * w1.z()) * m_densityMultiplier;
+		         (d110 * w0.x() + d111 * w1.x()) * w1.y()) * w1.z());
+	}
+
+	/**
+	 * \brief Evaluate sigma_t(p), where 'p' is given in local coordinates
+	 *
+	 * The value lies within the bounds of the enclosing cell 
+	 * of the majorant grid (see \ref buildMajorants()). \c T is the 
+	 * type of the stored values.
+	 */
+	template <typename T> float lookupSigmaT(const Point3f &p) const {
+		const T *data;
+		size_t row, slab;
+		int32_t brick;
+		Vector3f w;
+		if (!locateVoxels<T>(p, data, row, slab, brick, w))
+			return 0.0f;
+		return interpolate<T>(data, row, slab, w) * (channelScale<T>(brick, 0) * m_densityMultiplier);
+	}
+
+	/**
+	 * \brief Evaluate sigma_t at \c count points given in local
+	 * coordinates (same results as \ref lookupSigmaT() for each of them)
+	 *
+	 * Groups of four points compute their voxel indices and interpolation
+	 * weights, and interpolate, in SSE registers. Only the eight voxel
+	 * values of each point are loaded separately.
+	 */
+	template <typename T> void lookupSigmaT(const Point3f *p, float *sigmaT, int count) const {
+		int i = 0;
+#if defined(NORI_SSE)
+		for (; i + 4 <= count; i += 4)
+			lookupSigmaT4<T>(p + i, sigmaT + i);
+#endif
+		for (; i < count; ++i)
+			sigmaT[i] = lookupSigmaT<T>(p[i]);
+	}
+
+#if defined(NORI_SSE)
+	/// Evaluate sigma_t at four points (see \ref lookupSigmaT())
+	template <typename T> void lookupSigmaT4(const Point3f *p, float *sigmaT) const {
+		typedef VoxelTraits<T> Traits;
+		__m128 pos[3], w1[3], w0[3], valid = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		int32_t p0[3][4];
+		for (int axis=0; axis<3; ++axis) {
+			/* The points are non-negative when inside, hence truncation
+			   is the same as rounding down. NaNs fail the comparisons */
+			pos[axis] = _mm_mul_ps(_mm_setr_ps(p[0][axis], p[1][axis], p[2][axis], p[3][axis]),
+				_mm_set1_ps((float) m_resolution[axis]));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(pos[axis], _mm_setzero_ps()),
+				_mm_cmplt_ps(pos[axis], _mm_set1_ps((float) (m_resolution[axis] - 1)))));
+			__m128i cell = _mm_cvttps_epi32(pos[axis]);
+			_mm_storeu_si128((__m128i *) p0[axis], cell);
+			w1[axis] = _mm_sub_ps(pos[axis], _mm_cvtepi32_ps(cell));
+			w0[axis] = _mm_sub_ps(_mm_set1_ps(1.0f), w1[axis]);
+		}
+
+		/* Gather the voxels of every point */
+		float d[8][4], scale[4];
+		int mask = _mm_movemask_ps(valid);
+		size_t x = m_channels;
+		for (int i=0; i<4; ++i) {
+			const T *data;
+			size_t row, slab;
+			int32_t brick;
+			if (!(mask & (1 << i)) || !locateVoxels<T>(Point3i(p0[0][i], p0[1][i], p0[2][i]),
+					data, row, slab, brick)) {
+				for (int j=0; j<8; ++j)
+					d[j][i] = 0.0f;
+				scale[i] = 0.0f;
+				continue;
+			}
+			d[0][i] = Traits::decode(data[0]);
+			d[1][i] = Traits::decode(data[x]);
+			d[2][i] = Traits::decode(data[row]);
+			d[3][i] = Traits::decode(data[row + x]);
+			d[4][i] = Traits::decode(data[slab]);
+			d[5][i] = Traits::decode(data[slab + x]);
+			d[6][i] = Traits::decode(data[slab + row]);
+			d[7][i] = Traits::decode(data[slab + row + x]);
+			scale[i] = channelScale<T>(brick, 0) * m_densityMultiplier;
+		}
+
+		/* Interpolate in the same order as \ref interpolate() */
+		__m128 v[4];
+		for (int j=0; j<4; ++j)
+			v[j] = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(d[2*j]), w0[0]),
+			                  _mm_mul_ps(_mm_loadu_ps(d[2*j+1]), w1[0]));
+		__m128 lo = _mm_add_ps(_mm_mul_ps(v[0], w0[1]), _mm_mul_ps(v[1], w1[1])),
+		       hi = _mm_add_ps(_mm_mul_ps(v[2], w0[1]), _mm_mul_ps(v[3], w1[1])),
+		       result = _mm_add_ps(_mm_mul_ps(lo, w0[2]), _mm_mul_ps(hi, w1[2]));
+		result = _mm_and_ps(_mm_mul_ps(result, _mm_loadu_ps(scale)), valid);
+		_mm_storeu_ps(sigmaT, result);
+	}
+#endif
+
+	/**
+	 * \brief Interpolate all channels at 'p' (given in local coordinates)
+	 * with a single lookup of the interleaved voxels
+	 *
+	 * The first value is sigma_t. Returns zeros outside of the volume.
+	 */
+	template <typename T> void lookupChannels(const Point3f &p, float *values) const {
+		const T *data;
+		size_t row, slab;
+		int32_t brick;
+		Vector3f w;
+		if (!locateVoxels<T>(p, data, row, slab, brick, w)) {
+			for (int c=0; c<m_channels; ++c)
+				values[c] = 0.0f;
+			return;
+		}
+		for (int c=0; c<m_channels; ++c)
+			values[c] = interpolate<T>(data + c, row, slab, w) * channelScale<T>(brick, c);
+		values[0] *= m_densityMultiplier;
 	}
 
 	bool sampleDistance(const Ray3f &_ray, Sampler *sampler, float &t, Color3f &weight) const {
+		if (m_nextFrame && useNextFrame(_ray.time))
+			return m_nextFrame->sampleDistance(_ray, sampler, t, weight);
+
 		/* Transform the ray into the local coordinate system */
 		Ray3f ray = m_worldToMedium * _ray;
+		if (!clipRay(ray)) {
+			weight = Color3f(1.0f);
+			return false;
+		}
+
+		/* Select the instantiation for the encoding once per ray */
+		bool collided;
+		switch (m_encoding) {
+			case EFloat16: collided = sampleCollision<half>(ray, sampler, t); break;
+			case EUInt8: collided = sampleCollision<uint8_t>(ray, sampler, t); break;
+			default: collided = sampleCollision<float>(ray, sampler, t); break;
+		}
 
-		throw NoriException("HeterogeneousMedium::sampleDistance(): not implemented!");
+		if (collided) {
+			/* The transmittance and sigma_t cancel out */
+			if (m_albedoChannel >= 0) {
+				float values[NORI_MAX_VOLUME_CHANNELS];
+				evalChannels(ray(t), values);
+				weight = albedo(values);
+			} else {
+				weight = m_albedo;
+			}
+			return true;
+		}
+
+		weight = Color3f(1.0f);
+		return false;
 	}
 
 	Color3f evalTransmittance(const Ray3f &_ray, Sampler *sampler) const {
+		if (m_nextFrame && useNextFrame(_ray.time))
+			return m_nextFrame->evalTransmittance(_ray, sampler);
+
 		/* Transform the ray into the local coordinate system */
 		Ray3f ray = m_worldToMedium * _ray;
+		if (!clipRay(ray))
+			return Color3f(1.0f);
+
+		switch (m_encoding) {
+			case EFloat16: return Color3f(estimateTransmittance<half>(ray, sampler));
+			case EUInt8: return Color3f(estimateTransmittance<uint8_t>(ray, sampler));
+			default: return Color3f(estimateTransmittance<float>(ray, sampler));
+		}
+	}
+
+	/**
+	 * \brief Restrict a ray in local coordinates to the part that overlaps
+	 * the voxels, outside of which the density is zero
+	 *
+	 * \return \c false if the ray misses the volume, i.e. if the 
+	 *    transmittance is one and there can't be any collision
+	 */
+	inline bool clipRay(Ray3f &ray) const {
+		float nearT, farT;
+		if (!m_domain.rayIntersect(ray, ray.mint, ray.maxt, nearT, farT))
+			return false;
+		ray.mint = nearT;
+		ray.maxt = farT;
+		return true;
+	}
+
+	/// Estimate the transmittance along a ray in local coordinates
+	template <typename T> float estimateTransmittance(const Ray3f &ray, Sampler *sampler) const {
+		if (m_rayMarching) {
+			float t, opticalDepth;
+			rayMarch<T>(ray, sampler, std::numeric_limits<float>::infinity(), t, opticalDepth);
+			return fastExp(-opticalDepth);
+		}
+
+		switch (m_estimator) {
+			case EDeltaTracking: {
+					float t;
+					return deltaTracking<T>(ray, sampler, t) ? 0.0f : 1.0f;
+				}
+			case EResidualRatioTracking:
+				return ratioTracking<T>(ray, sampler, true);
+			case ERatioTracking:
+			default:
+				return ratioTracking<T>(ray, sampler, false);
+		}
+	}
+
+	/// Sample the first real collision along a ray in local coordinates
+	template <typename T> inline bool sampleCollision(const Ray3f &ray, Sampler *sampler, float &t) const {
+		if (m_rayMarching) {
+			float opticalDepth;
+			return rayMarch<T>(ray, sampler, -fastLog(1 - sampler->next1D()), t, opticalDepth);
+		}
+		return deltaTracking<T>(ray, sampler, t);
+	}
+
+	/**
+	 * \brief March along a ray in local coordinates until the optical
+	 * depth reaches \c target (biased, see the class description)
+	 *
+	 * Every cell of the majorant grid is divided into steps, whose number
+	 * grows with the range of its densities times the length of the ray
+	 * within it, such that the optical depth varies by at most about
+	 * \c m_marchingTolerance within a step. Cells with a uniform density
+	 * take a single step without any lookup. The density of a step is
+	 * looked up at the same jittered offset for all steps of the ray.
+	 *
+	 * \param opticalDepth
+	 *    Receives the optical depth up to \c t, or along the whole ray
+	 * \return \c true if the target was reached before \c ray.maxt
+	 */
+	template <typename T> bool rayMarch(const Ray3f &ray, Sampler *sampler, float target,
+			float &t, float &opticalDepth) const {
+		MajorantTraversal traversal = traverse(ray);
+		float t0, t1, jitter = sampler->next1D();
+		DensityBounds bounds;
+		opticalDepth = 0.0f;
+		while (traversal.next(t0, t1, bounds)) {
+			if (bounds.maximum <= 0)
+				continue;
+			prefetchCell(traversal.nextCell());
 
-		throw NoriException("HeterogeneousMedium::evalTransmittance(): not implemented!");
+			float variation = (bounds.maximum - bounds.minimum) * (t1 - t0);
+			int steps = variation <= m_marchingTolerance ? 1 : (int) std::min(
+				std::ceil(variation / m_marchingTolerance), (float) NORI_MAX_MARCHING_STEPS);
+			float dt = (t1 - t0) / steps;
+			bool uniform = bounds.minimum == bounds.maximum;
+			float densities[NORI_DENSITY_BATCH];
+			for (int i=0; i<steps; ++i) {
+				float ts = t0 + i * dt;
+				int k = i % NORI_DENSITY_BATCH;
+				if (!uniform && k == 0) {
+					/* Look up the densities of the next steps together */
+					Point3f points[NORI_DENSITY_BATCH];
+					int count = std::min(steps - i, NORI_DENSITY_BATCH);
+					for (int j=0; j<count; ++j)
+						points[j] = ray(t0 + (i + j) * dt + jitter * dt);
+					lookupSigmaT<T>(points, densities, count);
+				}
+				float sigmaT = uniform ? bounds.maximum : densities[k];
+				float tau = sigmaT * dt;
+				if (opticalDepth + tau >= target) {
+					/* Invert the (constant) density of the step */
+					t = ts + (target - opticalDepth) / sigmaT;
+					opticalDepth = target;
+					return true;
+				}
+				opticalDepth += tau;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * \brief Sample the first real collision along a ray in local 
+	 * coordinates using delta (or decomposition) tracking
+	 *
+	 * Tentative collisions are sampled proportional to the local 
+	 * majorant and accepted with probability sigma_t / majorant. Due 
+	 * to the memorylessness of the exponential distribution, the
+	 * sampling simply restarts at the boundary of every cell.
+	 *
+	 * In decomposition tracking, a collision with the control density
+	 * (the minimum of the cell) is sampled first, and tentative collisions
+	 * before it are sampled against the difference of the cell's bounds
+	 * and accepted with probability (sigma_t - control) / difference.
+	 * The first of both collisions is the real one.
+	 *
+	 * \return \c true if a collision occurred before \c ray.maxt
+	 */
+	template <typename T> bool deltaTracking(const Ray3f &ray, Sampler *sampler, float &t) const {
+		MajorantTraversal traversal = traverse(ray);
+		float t0, t1;
+		DensityBounds bounds;
+		while (traversal.next(t0, t1, bounds)) {
+			if (bounds.maximum <= 0)
+				continue;
+			prefetchCell(traversal.nextCell());
+
+			float control = m_decomposition ? bounds.minimum : 0.0f,
+			      majorant = bounds.maximum - control,
+			      end = t1;
+			if (control > 0)
+				end = std::min(t1, t0 - fastLog(1 - sampler->next1D()) / control);
+
+			/* Sample four tentative collisions at a time and look up their
+			   densities together. Those following the first accepted one
+			   are discarded, which doesn't change their distribution */
+			float tc = t0;
+			bool done = majorant <= 0;
+			while (!done) {
+				Point3f points[4];
+				float times[4], xi[4], densities[4];
+				int count = 0;
+				while (count < 4) {
+					tc -= fastLog(1 - sampler->next1D()) / majorant;
+					if (tc >= end) {
+						done = true;
+						break;
+					}
+					times[count] = tc;
+					xi[count] = sampler->next1D();
+					points[count++] = ray(tc);
+				}
+				lookupSigmaT<T>(points, densities, count);
+				for (int k=0; k<count; ++k) {
+					if (xi[k] * majorant < densities[k] - control) {
+						t = times[k];
+						return true;
+					}
+				}
+			}
+			if (end < t1) {
+				t = end;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * \brief Estimate the transmittance along a ray in local coordinates
+	 * using (residual) ratio tracking
+	 *
+	 * Every tentative collision scales the estimate by the probability
+	 * of it being a null collision. In the residual variant, the minimum
+	 * density of each cell is accounted for analytically, and collisions
+	 * are only sampled against the remaining range of densities.
+	 */
+	template <typename T> float ratioTracking(const Ray3f &ray, Sampler *sampler, bool residual) const {
+		MajorantTraversal traversal = traverse(ray);
+		float t0, t1, transmittance = 1.0f;
+		DensityBounds bounds;
+		while (traversal.next(t0, t1, bounds)) {
+			float control = 0.0f;
+			if (residual) {
+				control = bounds.minimum;
+				transmittance *= fastExp(-control * (t1 - t0));
+			}
+			float majorant = bounds.maximum - control;
+			if (majorant <= 0)
+				continue;
+			prefetchCell(traversal.nextCell());
+
+			/* Sample a batch of tentative collisions first, and look up
+			   their densities together */
+			float tc = t0;
+			bool done = false;
+			while (!done) {
+				Point3f points[NORI_DENSITY_BATCH];
+				float densities[NORI_DENSITY_BATCH];
+				int count = 0;
+				while (count < NORI_DENSITY_BATCH) {
+					tc -= fastLog(1 - sampler->next1D()) / majorant;
+					if (tc >= t1) {
+						done = true;
+						break;
+					}
+					points[count++] = ray(tc);
+				}
+				lookupSigmaT<T>(points, densities, count);
+
+				for (int k=0; k<count; ++k) {
+					transmittance *= 1 - (densities[k] - control) / majorant;
+
+					/* Stop tracking paths that hardly contribute (unbiased) */
+					if (transmittance < NORI_TRANSMITTANCE_RR_THRESHOLD) {
+						float q = std::max(0.05f, 1 - transmittance);
+						if (sampler->next1D() < q)
+							return 0.0f;
+						transmittance /= 1 - q;
+					}
+				}
+			}
+		}
+		return transmittance;
 	}
 
 	/// Return a human-readable summary
+	void reportMemory(MemoryReport &report) const {
+		/* Voxels (or bricks) that are mapped from the file, or were
+		   tiled, read through the volume cache's index, or loaded */
+		size_t resident = m_tiledIndex.capacity() * sizeof(int32_t) + m_tiledBricks.capacity()
+			+ m_tiledScales.capacity() * sizeof(float) + m_residentIndex.capacity() * sizeof(int32_t)
+			+ m_residentScales.capacity() * sizeof(float) + m_bounds.capacity() * sizeof(DensityBounds)
+			+ (m_emission.values.capacity() + m_temperature.values.capacity()) * sizeof(float)
+			+ m_blackbody.capacity() * sizeof(Color3f);
+		report.add("media", resident, m_mapping ? m_fileSize : 0);
+		report.add("pdfTables", m_emissionPDF.getMemoryUsage());
+		if (m_nextFrame)
+			m_nextFrame->reportMemory(report);
+	}
+
 	QString toString() const {
 		return QString(
 			"HeterogeneousMedium[\n"
 			"  filename = \"%1\",\n"
 			"  densityMultiplier = %2,\n"
-			"  albedo = %3\n"
+			"  albedo = %3,\n"
+			"  majorantCellSize = %4,\n"
+			"  transmittanceEstimator = %5,\n"
+			"  decompositionTracking = %6,\n"
+			"  encoding = %7,\n"
+			"  bricked = %8,\n"
+			"  emissionFilename = \"%9\",\n"
+			"  temperatureFilename = \"%10\",\n"
+			"  emittedPower = %11,\n"
+			"  channels = \"%12\",\n"
+			"  rayMarching = %13,\n"
+			"  frame = %14,\n"
+			"  brickCache = %15\n"
 			"]")
 		.arg(m_filename)
 		.arg(m_densityMultiplier)
-		.arg(m_albedo.toString());
+		.arg(m_albedo.toString())
+		.arg(m_majorantCellSize)
+		.arg(m_estimator == EDeltaTracking ? "delta" :
+			(m_estimator == ERatioTracking ? "ratio" : "residual"))
+		.arg(m_decomposition ? "true" : "false")
+		.arg(voxelEncodingName(m_encoding))
+		.arg(m_sparse ? "true" : "false")
+		.arg(m_emissionFilename)
+		.arg(m_temperatureFilename)
+		.arg(m_emittedPower)
+		.arg(m_channelNames)
+		.arg(m_rayMarching ? QString("true (tolerance %1)").arg(m_marchingTolerance) : QString("false"))
+		.arg(m_nextFrame ? QString("%1 (interpolated over %2)").arg(m_frame).arg(m_frameDuration)
+			: QString::number(m_frame))
+		.arg(m_brickFile ? "true" : "false");
 	}
 private:
-	Transform m_worldToMedium;
+	Transform m_mediumToWorld, m_worldToMedium;
+	/// Volume of the medium's unit cube in world space
+	float m_volumeScale;
 
 	/* Memory map-related attributes */
 #if defined(PLATFORM_WINDOWS)
@@ -195,13 +1981,174 @@ private:
 #endif
 	QString m_filename;
 	size_t m_fileSize;
-	float *m_data;
+	char *m_mapping;
+
+	/* Dense grid, or index and contents of the bricks of a sparse volume */
+	const char *m_data;
+	int m_encoding;
+	int m_channels;
+	float m_voxelScale;
+	bool m_sparse;
+	int m_brickSize;
+	size_t m_brickBytes;
+	const int32_t *m_brickIndex;
+	const char *m_bricks;
+	const float *m_brickScales;
+
+	/* Bricks of a dense volume that was tiled when loading it */
+	std::vector<int32_t> m_tiledIndex;
+	std::vector<char> m_tiledBricks;
+	std::vector<float> m_tiledScales;
+
+	/* Sparse volume whose bricks are read through the VolumeCache */
+	BrickFile *m_brickFile;
+	std::vector<int32_t> m_residentIndex;
+	std::vector<float> m_residentScales;
 
 	/* Heterogeneous medium attributes */
+	QString m_channelNames;
+	int m_albedoChannel, m_albedoChannelCount;
+	int m_emissionChannel, m_temperatureChannel;
 	Color3f m_albedo;
 	Vector3i m_resolution;
+	/// Region covered by the voxels in local coordinates
+	BoundingBox3f m_domain;
 	float m_densityMultiplier;
+
+	/* Grid of majorants */
+	int m_majorantCellSize;
+	Vector3i m_gridSize;
+	std::vector<DensityBounds> m_bounds;
+	ETransmittanceEstimator m_estimator;
+	bool m_decomposition;
+	bool m_rayMarching;
+	float m_marchingTolerance;
+
+	/* Emission */
+	QString m_emissionFilename, m_temperatureFilename;
+	DenseGrid m_emission, m_temperature;
+	Color3f m_absorption, m_emissionScale;
+	float m_temperatureScale, m_blackbodyScale, m_maxTemperature;
+	std::vector<Color3f> m_blackbody;
+	DiscretePDF m_emissionPDF;
+	float m_emittedPower;
+
+	/* Animation */
+	int m_frame;
+	float m_frameDuration;
+	HeterogeneousMedium *m_nextFrame;
 };
 
+void convertToSparseVolume(const QString &input, const QString &output, 
+		int brickSize, const QString &encodingName) {
+	if (brickSize < 1)
+		throw NoriException(QString("Invalid brick size %1 (must be >= 1)").arg(brickSize));
+
+	int encoding;
+	if (encodingName == "float32")
+		encoding = EFloat32;
+	else if (encodingName == "float16")
+		encoding = EFloat16;
+	else if (encodingName == "uint8")
+		encoding = EUInt8;
+	else
+		throw NoriException(QString("Unknown encoding \"%1\" (must be \"float32\", "
+			"\"float16\" or \"uint8\")").arg(encodingName));
+
+	QFile in(input);
+	if (!in.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Cannot open \"%1\"").arg(input));
+	qint64 size = in.size();
+	const uchar *mapping = size >= 48 ? in.map(0, size) : NULL;
+	if (!mapping || memcmp(mapping, "VOL", 3) != 0 || mapping[3] != 3)
+		throw NoriException(QString("\"%1\" is not a valid volume data file!").arg(input));
+
+	int32_t type, channels;
+	Vector3i resolution;
+	memcpy(&type, mapping + 4, sizeof(int32_t));
+	memcpy(resolution.data(), mapping + 8, 3 * sizeof(int32_t));
+	memcpy(&channels, mapping + 20, sizeof(int32_t));
+	if (voxelSize(type) == 0 || channels < 1)
+		throw NoriException("Only volumes with float32, float16 or uint8 channels are supported!");
+	if ((resolution.array() < 2).any() || size < 48 + (qint64) voxelSize(type)
+			* channels * resolution.x() * resolution.y() * resolution.z())
+		throw NoriException(QString("The volume data file \"%1\" is truncated!").arg(input));
+	const char *data = (const char *) (mapping + 48);
+
+	SparseVolumeHeader header;
+	memset(&header, 0, sizeof(SparseVolumeHeader));
+	memcpy(header.magic, "NSV", 3);
+	header.version = NORI_SPARSE_VOLUME_VERSION;
+	header.brickSize = brickSize;
+	header.encoding = (uint32_t) encoding;
+	header.channels = (uint32_t) channels;
+	for (int i=0; i<3; ++i) {
+		header.resolution[i] = resolution[i];
+		header.gridSize[i] = (resolution[i] - 1 + brickSize - 1) / brickSize;
+	}
+	Vector3i gridSize(header.gridSize[0], header.gridSize[1], header.gridSize[2]);
+	size_t brickCount = (size_t) gridSize.x() * gridSize.y() * gridSize.z();
+	size_t brickVoxels = (size_t) (brickSize + 1) * (brickSize + 1) * (brickSize + 1);
+
+	/* First pass: find the bricks that need to be stored, and number
+	   them along a Morton curve so that neighbors are stored nearby */
+	std::vector<uint32_t> order = mortonOrder(gridSize);
+	std::vector<int32_t> index(brickCount);
+	std::vector<float> brick(brickVoxels * channels);
+	uint32_t stored = 0;
+	for (size_t i=0; i<brickCount; ++i) {
+		uint32_t cell = order[i];
+		Point3i p(cell % gridSize.x(), (cell / gridSize.x()) % gridSize.y(),
+			cell / gridSize.x() / gridSize.y());
+		index[cell] = gatherBrick(data, type, channels, resolution, brickSize, p, &brick[0])
+			? (int32_t) stored++ : -1;
+	}
+
+	qint64 indexSize = (qint64) (brickCount * sizeof(int32_t)),
+	       brickBytes = (qint64) (brickVoxels * channels * voxelSize(encoding));
+	header.brickCount = stored;
+	header.indexOffset = sizeof(SparseVolumeHeader);
+	header.brickOffset = (header.indexOffset + indexSize + 63) / 64 * 64;
+	if (encoding == EUInt8)
+		header.scaleOffset = (header.brickOffset + stored * brickBytes + 63) / 64 * 64;
+
+	/* Second pass: write the header, the index, and the non-empty bricks */
+	QFile out(output);
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(output));
+	bool success = out.write((const char *) &header, sizeof(SparseVolumeHeader)) == sizeof(SparseVolumeHeader)
+		&& out.write((const char *) &index[0], indexSize) == indexSize
+		&& out.seek(header.brickOffset);
+	std::vector<char> encoded;
+	std::vector<float> scales;
+	for (size_t i=0; i<brickCount && success; ++i) {
+		uint32_t cell = order[i];
+		if (index[cell] < 0)
+			continue;
+		Point3i p(cell % gridSize.x(), (cell / gridSize.x()) % gridSize.y(),
+			cell / gridSize.x() / gridSize.y());
+		gatherBrick(data, type, channels, resolution, brickSize, p, &brick[0]);
+		scales.resize(scales.size() + channels);
+		encodeBrick(brick, channels, encoding, encoded, &scales[scales.size() - channels]);
+		success = out.write(&encoded[0], brickBytes) == brickBytes;
+	}
+	if (success && encoding == EUInt8 && stored > 0) {
+		qint64 scaleSize = (qint64) (stored * channels * sizeof(float));
+		success = out.seek(header.scaleOffset)
+			&& out.write((const char *) &scales[0], scaleSize) == scaleSize;
+	}
+	out.close();
+	in.unmap((uchar *) mapping);
+
+	if (!success) {
+		out.remove();
+		throw NoriException(QString("Unable to write \"%1\"").arg(output));
+	}
+
+	cout << "Stored " << stored << " of " << brickCount << " bricks ("
+		 << (100.0f * stored) / brickCount << "%) as " 
+		 << voxelEncodingName(encoding) << endl;
+}
+
 NORI_REGISTER_CLASS(HeterogeneousMedium, "heterogeneous");
 NORI_NAMESPACE_END
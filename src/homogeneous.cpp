@@ -17,11 +17,34 @@
 */
 
 #include <nori/medium.h>
+#include <nori/sampler.h>
+#include <nori/fastmath.h>
+#include <nori/bbox.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Box-shaped homogeneous participating medium
+ *
+ * The medium occupies the unit cube [0, 1]^3 in local coordinates, which
+ * the \c toWorld transformation places in the scene. Extinction and 
+ * scattering coefficients may differ between the color channels.
+ *
+ * Distances are sampled using spectral MIS: a channel is picked uniformly
+ * at random and drives the exponential distance sampling, and the sample
+ * is weighted by the balance heuristic over all three channels, i.e. its
+ * density is the average of the per-channel densities. All channels are
+ * thus handled in one pass, and, unlike sampling against the largest
+ * extinction coefficient, the weights stay bounded when the channels 
+ * differ strongly. For gray media, this reduces to standard exponential
+ * distance sampling with a weight equal to the albedo. This density is
+ * also available through \ref evalDistance(), so that the path tracer
+ * can combine it with equiangular sampling.
+ *
+ * In spectral mode, the coefficients are turned into spectra (see
+ * \ref Wavelengths), and the hero wavelength drives the distance
+ * sampling in the same way, with the density averaged over the four
+ * wavelengths of the path.
  */
 class HomogeneousMedium : public Medium {
 public:
@@ -30,14 +53,112 @@ public:
 		m_sigmaT = propList.getColor("sigmaA") + m_sigmaS;
 		// An (optional) transformation that converts between medium and world coordinates
 		m_worldToMedium = propList.getTransform("toWorld", Transform()).inverse();
+
+		if ((m_sigmaS.array() < 0).any() || (m_sigmaT.array() < m_sigmaS.array()).any())
+			throw NoriException("HomogeneousMedium: sigmaS and sigmaA must be nonnegative!");
 	}
 
 	bool sampleDistance(const Ray3f &ray, Sampler *sampler, float &t, Color3f &weight) const {
-		throw NoriException("HomogeneousMedium::sampleDistance(): not implemented!");
+		float mint, maxt;
+		if (!clip(ray, mint, maxt)) {
+			weight = Color3f(1.0f);
+			return false;
+		}
+
+		/* Sample a distance using the extinction coefficient of a random channel */
+		int channel = std::min((int) (sampler->next1D() * 3), 2);
+		float sigmaT = m_sigmaT[channel],
+		      dist = sigmaT > 0 ? -fastLog(1 - sampler->next1D()) / sigmaT 
+		                        : std::numeric_limits<float>::infinity();
+
+		if (mint + dist < maxt) {
+			/* Medium interaction: the density is the average over the channels */
+			Color3f transmittance = (-m_sigmaT * dist).exp();
+			float pdf = (m_sigmaT * transmittance).mean();
+			t = mint + dist;
+			weight = m_sigmaS * transmittance / pdf;
+			return true;
+		}
+
+		/* No interaction: divide by the average probability of passing through */
+		Color3f transmittance = (-m_sigmaT * (maxt - mint)).exp();
+		weight = transmittance / transmittance.mean();
+		return false;
+	}
+
+	bool sampleSpectralDistance(const Ray3f &ray, Sampler *sampler,
+			const Wavelengths &wl, float &t, Spectrum4f &weight) const {
+		float mint, maxt;
+		if (!clip(ray, mint, maxt)) {
+			weight = Spectrum4f(1.0f);
+			return false;
+		}
+
+		/* Sample a distance using the extinction coefficient of the hero wavelength */
+		Spectrum4f sigmaT = wl.fromRGB(m_sigmaT);
+		float dist = sigmaT[0] > 0 ? -fastLog(1 - sampler->next1D()) / sigmaT[0]
+		                           : std::numeric_limits<float>::infinity();
+
+		if (mint + dist < maxt) {
+			Spectrum4f transmittance = (-sigmaT * dist).exp();
+			float pdf = (sigmaT * transmittance).mean();
+			t = mint + dist;
+			weight = wl.fromRGB(m_sigmaS) * transmittance / pdf;
+			return true;
+		}
+
+		Spectrum4f transmittance = (-sigmaT * (maxt - mint)).exp();
+		weight = transmittance / transmittance.mean();
+		return false;
+	}
+
+	Spectrum4f evalSpectralTransmittance(const Ray3f &ray, Sampler *sampler,
+			const Wavelengths &wl) const {
+		float mint, maxt;
+		if (!clip(ray, mint, maxt))
+			return Spectrum4f(1.0f);
+		return (-wl.fromRGB(m_sigmaT) * (maxt - mint)).exp();
 	}
 
 	Color3f evalTransmittance(const Ray3f &ray, Sampler *sampler) const {
-		throw NoriException("HomogeneousMedium::evalTransmittance(): not implemented!");
+		float mint, maxt;
+		if (!clip(ray, mint, maxt))
+			return Color3f(1.0f);
+		return (-m_sigmaT * (maxt - mint)).exp();
+	}
+
+	bool evalDistance(const Ray3f &ray, float t, Color3f &value, float &pdf) const {
+		float mint, maxt;
+		if (!clip(ray, mint, maxt) || t < mint || t >= maxt) {
+			value = Color3f(0.0f);
+			pdf = 0.0f;
+			return true;
+		}
+
+		/* Same density as in sampleDistance() */
+		Color3f transmittance = (-m_sigmaT * (t - mint)).exp();
+		value = m_sigmaS * transmittance;
+		pdf = (m_sigmaT * transmittance).mean();
+		return true;
+	}
+
+	/**
+	 * \brief Clip a ray segment (in world coordinates) against the medium
+	 *
+	 * The transformation doesn't change the ray parameterization, hence
+	 * \c mint and \c maxt also refer to the original ray.
+	 *
+	 * \return \c false if the segment doesn't overlap the medium
+	 */
+	bool clip(const Ray3f &_ray, float &mint, float &maxt) const {
+		Ray3f ray = m_worldToMedium * _ray;
+		BoundingBox3f bbox(Point3f(0.0f, 0.0f, 0.0f), Point3f(1.0f, 1.0f, 1.0f));
+		float nearT, farT;
+		if (!bbox.rayIntersect(ray, nearT, farT))
+			return false;
+		mint = std::max(nearT, ray.mint);
+		maxt = std::min(farT, ray.maxt);
+		return mint < maxt;
 	}
 
 	/// Return a human-readable summary
@@ -45,7 +166,7 @@ public:
 		return QString(
 			"HomogeneousMedium[\n"
 			"  sigmaS = %1,\n"
-			"  sigmaT = %2,\n"
+			"  sigmaT = %2\n"
 			"]")
 		.arg(m_sigmaS.toString())
 		.arg(m_sigmaT.toString());
@@ -18,6 +18,7 @@
 
 #include <nori/sampler.h>
 #include <nori/random.h>
+#include <nori/pcg32.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -25,15 +26,24 @@ NORI_NAMESPACE_BEGIN
  * Independent sampling - returns independent uniformly distributed
  * random numbers on <tt>[0, 1)x[0, 1)</tt>.
  *
- * This class is essentially just a wrapper around the \ref Random
- * class. For more details on what sample generators do in general,
- * refer to the \ref Sampler class.
+ * This class is essentially just a wrapper around a pseudorandom number
+ * generator: either the Mersenne Twister in \ref Random (the default),
+ * or \ref PCG32 (<tt>generator="pcg32"</tt>), whose state is much
+ * smaller (16 bytes instead of 2.5 KiB). For more details on what 
+ * sample generators do in general, refer to the \ref Sampler class.
  */
 class Independent : public Sampler {
 public:
 	Independent(const PropertyList &propList) {
-		m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
-		m_random = new Random();
+		configure(propList);
+
+		QString generator = propList.getString("generator", "mt");
+		if (generator == "pcg32")
+			m_random = NULL;
+		else if (generator == "mt")
+			m_random = new Random();
+		else
+			throw NoriException(QString("Independent: unknown generator \"%1\"").arg(generator));
 	}
 
 	virtual ~Independent() {
@@ -42,33 +52,61 @@ public:
 
 	Sampler *clone() {
 		Independent *cloned = new Independent();
-		cloned->m_sampleCount = m_sampleCount;
-		cloned->m_random = new Random();
-		cloned->m_random->seed(m_random);
+		cloned->copySettings(this);
+		cloned->m_random = m_random ? new Random() : NULL;
 		return cloned;
 	}
 
-	void generate() { /* No-op for this sampler */ }
+	void generate(const Point2i &pixel, uint32_t firstSample) {
+		/* Restart the generator with a seed that only depends on the 
+		   pixel and the sample index. Reseeding the Mersenne Twister
+		   requires initializing its whole state, hence the PCG32 
+		   generator is much faster here */
+		uint64_t hash = hashPixel(pixel, firstSample);
+		if (m_random)
+			m_random->seed((uint32_t) (hash ^ (hash >> 32)));
+		else
+			m_pcg.seed(hash);
+	}
+
 	void advance()  { /* No-op for this sampler */ }
 
 	float next1D() {
-		return m_random->nextFloat();
+		return m_random ? m_random->nextFloat() : m_pcg.nextFloat();
 	}
 	
 	Point2f next2D() {
-		return Point2f(
-			m_random->nextFloat(),
-			m_random->nextFloat()
-		);
+		if (m_random) {
+			float x = m_random->nextFloat();
+			return Point2f(x, m_random->nextFloat());
+		} else {
+			float x = m_pcg.nextFloat();
+			return Point2f(x, m_pcg.nextFloat());
+		}
+	}
+
+	void next1DArray(float *values, size_t count) {
+		if (m_random)
+			m_random->nextFloat(values, count);
+		else
+			m_pcg.nextFloat(values, count);
+	}
+
+	void next2DArray(Point2f *values, size_t count) {
+		/* Point2f stores its two coordinates contiguously and without padding */
+		next1DArray(values[0].data(), 2*count);
 	}
 
 	QString toString() const {
-		return QString("Independent[sampleCount=%1]").arg(m_sampleCount);
+		return QString("Independent[sampleCount=%1, generator=%2, seed=%3]")
+			.arg(m_sampleCount).arg(m_random ? "mt" : "pcg32").arg(m_seed);
 	}
 protected:
 	Independent() { }
 protected:
+	/// Mersenne Twister (\c NULL when using \ref m_pcg)
 	Random *m_random;
+	PCG32 m_pcg;
 };
 
 NORI_REGISTER_CLASS(Independent, "independent");
@@ -0,0 +1,411 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/mesh.h>
+#include <nori/memreport.h>
+#include <QElapsedTimer>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) : m_cameraLOD(0) {
+	/* Transformation from the mesh's coordinate system into world space */
+	m_toWorld = propList.getTransform("toWorld", Transform());
+	m_toLocal = m_toWorld.inverse();
+
+	/* Optional second motion key at time 1 (default: the instance doesn't move) */
+	m_toWorldEnd = propList.getTransform("toWorldEnd", m_toWorld);
+	m_moving = m_toWorldEnd.getMatrix() != m_toWorld.getMatrix();
+
+	/* Level of detail selection (only relevant when several meshes are given) */
+	m_lodThreshold = propList.getFloat("lodThreshold", 1.0f);
+	QString selection = propList.getString("lodSelection", "camera");
+	if (selection == "camera")
+		m_footprintLOD = false;
+	else if (selection == "footprint")
+		m_footprintLOD = true;
+	else
+		throw NoriException(QString("Instance: unknown level of detail selection \"%1\" "
+			"(must be \"camera\" or \"footprint\")").arg(selection));
+	if (m_lodThreshold <= 0)
+		throw NoriException("Instance: lodThreshold must be positive!");
+}
+
+Transform Instance::getToWorld(float time) const {
+	if (!m_moving)
+		return m_toWorld;
+	float t = std::min(std::max(time, 0.0f), 1.0f);
+	return Transform(m_toWorld.getMatrix() * (1 - t) + m_toWorldEnd.getMatrix() * t);
+}
+
+Transform Instance::getToLocal(float time) const {
+	if (!m_moving)
+		return m_toLocal;
+	return getToWorld(time).inverse();
+}
+
+void Instance::addChild(NoriObject *obj) {
+	switch (obj->getClassType()) {
+		case EMesh:
+			if (m_lods.size() >= NORI_INSTANCE_MAX_LODS)
+				throw NoriException(QString("Instance: at most %1 levels of detail "
+					"are supported!").arg(NORI_INSTANCE_MAX_LODS));
+			if (static_cast<Mesh *>(obj)->isProcedural())
+				throw NoriException("Instance: procedural meshes (e.g. curves) can't be instanced!");
+			m_lods.push_back(static_cast<Mesh *>(obj));
+			break;
+
+		default:
+			throw NoriException(QString("Instance::addChild(<%1>) is not supported!").arg(
+				classTypeName(obj->getClassType())));
+	}
+}
+
+void Instance::activate() {
+	if (m_lods.empty())
+		throw NoriException("Instance: no mesh was specified!");
+
+	/* Bounding box of the transformed vertices of all levels of detail
+	   (tighter than transforming the object-space bounding box) */
+	m_keyBBox[0].reset();
+	m_keyBBox[1].reset();
+	for (size_t level=0; level<m_lods.size(); ++level) {
+		const Mesh *mesh = m_lods[level];
+		const Point3f *positions = mesh->getVertexPositions();
+		for (uint32_t i=0; i<mesh->getVertexCount(); ++i) {
+			m_keyBBox[0].expandBy(m_toWorld * positions[i]);
+			if (m_moving)
+				m_keyBBox[1].expandBy(m_toWorldEnd * positions[i]);
+		}
+	}
+	if (!m_moving)
+		m_keyBBox[1] = m_keyBBox[0];
+
+	/* Average edge length of each level of detail (one edge per triangle) */
+	m_lodEdgeLength.resize(m_lods.size());
+	for (size_t level=1; level<m_lods.size(); ++level) {
+		const Mesh *mesh = m_lods[level];
+		const Point3f *positions = mesh->getVertexPositions();
+		const uint32_t *indices = mesh->getIndices();
+		double sum = 0;
+		for (uint32_t i=0; i<mesh->getTriangleCount(); ++i)
+			sum += (m_toWorld * Vector3f(positions[indices[3*i+1]] - positions[indices[3*i]])).norm();
+		m_lodEdgeLength[level] = mesh->getTriangleCount() > 0
+			? (float) (sum / mesh->getTriangleCount()) : 0.0f;
+	}
+	m_lodEdgeLength[0] = 0.0f;
+	m_cameraLOD = std::min(m_cameraLOD, (int) m_lods.size() - 1);
+
+	/* The vertices move along straight lines, hence the two keys bound the whole motion */
+	m_bbox = m_keyBBox[0];
+	m_bbox.expandBy(m_keyBBox[1]);
+}
+
+int Instance::selectLOD(float footprint) const {
+	/* The levels are ordered from fine to coarse */
+	for (int level=(int) m_lods.size() - 1; level > 0; --level) {
+		if (m_lodEdgeLength[level] <= m_lodThreshold * footprint)
+			return level;
+	}
+	return 0;
+}
+
+void Instance::selectCameraLOD(const Point3f &origin, float pixelAngle) {
+	m_cameraLOD = 0;
+	if (m_lods.size() > 1 && pixelAngle > 0)
+		m_cameraLOD = selectLOD(m_bbox.distanceTo(origin) * pixelAngle);
+}
+
+QString Instance::toString() const {
+	QString lods;
+	for (size_t i=1; i<m_lods.size(); ++i)
+		lods += QString(i > 1 ? ", \"%1\"" : "\"%1\"").arg(m_lods[i]->getName());
+	return QString(
+		"Instance[\n"
+		"  mesh = \"%1\",\n"
+		"  levelsOfDetail = [%2],\n"
+		"  toWorld = %3,\n"
+		"  toWorldEnd = %4\n"
+		"]")
+	.arg(m_lods.empty() ? QString("null") : m_lods[0]->getName())
+	.arg(lods)
+	.arg(indent(m_toWorld.toString(), 12))
+	.arg(m_moving ? indent(m_toWorldEnd.toString(), 15) : QString("none"));
+}
+
+/// Orders instance records by the center of their bounding box along an axis
+struct InstanceOrdering {
+	int axis;
+
+	inline InstanceOrdering(int axis) : axis(axis) { }
+
+	template <typename Record> inline bool operator()(const Record &a, const Record &b) const {
+		const BoundingBox3f &bboxA = a.instance->getBoundingBox(),
+		                    &bboxB = b.instance->getBoundingBox();
+		return bboxA.min[axis] + bboxA.max[axis] < bboxB.min[axis] + bboxB.max[axis];
+	}
+};
+
+InstanceAccelerator::InstanceAccelerator(Accelerator *flat) 
+	: m_flat(flat), m_buildTime(0), m_moving(false) { }
+
+InstanceAccelerator::~InstanceAccelerator() {
+	delete m_flat;
+	for (size_t i=0; i<m_bottomLevel.size(); ++i)
+		delete m_bottomLevel[i];
+}
+
+void InstanceAccelerator::addBottomLevel(Accelerator *accel) {
+	m_bottomLevel.push_back(accel);
+}
+
+void InstanceAccelerator::addInstance(const Instance *instance, const Accelerator * const *accels) {
+	InstanceRecord record;
+	record.instance = instance;
+	record.lodOffset = (uint32_t) m_lodAccels.size();
+	m_lodAccels.insert(m_lodAccels.end(), accels, accels + instance->getLODCount());
+	m_instances.push_back(record);
+}
+
+void InstanceAccelerator::build() {
+	m_flat->build();
+	buildTopLevel();
+}
+
+bool InstanceAccelerator::update() {
+	bool incremental = m_flat->update();
+	for (size_t i=0; i<m_bottomLevel.size(); ++i)
+		incremental &= m_bottomLevel[i]->update();
+
+	/* The top level is tiny, simply build it again */
+	buildTopLevel();
+	return incremental;
+}
+
+void InstanceAccelerator::buildTopLevel() {
+	cout << "Constructing the top-level hierarchy (" << m_instances.size() 
+		 << " instances of " << m_bottomLevel.size() << " meshes) .." << endl;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	m_bbox.reset();
+	m_moving = false;
+	if (m_flat->getPrimitiveCount() > 0)
+		m_bbox.expandBy(m_flat->getBoundingBox());
+	for (size_t i=0; i<m_instances.size(); ++i) {
+		m_bbox.expandBy(m_instances[i].instance->getBoundingBox());
+		m_moving |= m_instances[i].instance->isMoving();
+	}
+
+	m_nodes.clear();
+	if (!m_instances.empty()) {
+		m_nodes.reserve(2 * m_instances.size());
+		buildRecursive(0, (uint32_t) m_instances.size(), 0);
+	}
+
+	m_buildTime = timer.elapsed();
+	cout << "Finished after " << m_buildTime << " ms (" 
+		 << m_nodes.size() << " nodes)" << endl;
+}
+
+uint32_t InstanceAccelerator::buildRecursive(uint32_t start, uint32_t end, int depth) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(InstanceNode());
+
+	BoundingBox3f bbox, bboxEnd, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		const Instance *instance = m_instances[i].instance;
+		bbox.expandBy(instance->getKeyBoundingBox(0));
+		bboxEnd.expandBy(instance->getKeyBoundingBox(1));
+		centroidBBox.expandBy(instance->getBoundingBox().getCenter());
+	}
+	m_nodes[nodeIndex].bbox = bbox;
+	m_nodes[nodeIndex].bboxEnd = bboxEnd;
+
+	if (end - start <= 2 || depth + 1 >= NORI_INSTANCE_MAXDEPTH) {
+		m_nodes[nodeIndex].offset = start;
+		m_nodes[nodeIndex].count = end - start;
+		return nodeIndex;
+	}
+
+	/* Split at the median along the axis of largest centroid extent */
+	int axis = centroidBBox.getMajorAxis();
+	uint32_t mid = (start + end) / 2;
+	std::nth_element(m_instances.begin() + start, m_instances.begin() + mid,
+		m_instances.begin() + end, InstanceOrdering(axis));
+
+	buildRecursive(start, mid, depth + 1);
+	uint32_t right = buildRecursive(mid, end, depth + 1);
+
+	m_nodes[nodeIndex].offset = right;
+	m_nodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+bool InstanceAccelerator::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+	Ray3f ray(_ray);
+	bool foundIntersection = false;
+	const Instance *foundInstance = NULL;
+
+	/* Determine the adaptive ray epsilon in world space -- the bottom-level
+	   structures would otherwise base it on the local ray origin */
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	/* First, intersect against the non-instanced geometry */
+	if (m_flat->getPrimitiveCount() > 0 && m_flat->rayIntersect(ray, its, shadowRay)) {
+		if (shadowRay)
+			return true;
+		ray.maxt = its.t;
+		foundIntersection = true;
+	}
+
+	if (m_nodes.empty())
+		return foundIntersection;
+
+	uint32_t stack[NORI_INSTANCE_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIndex = 0;
+	Intersection localIts;
+
+	while (true) {
+		const InstanceNode &node = m_nodes[nodeIndex];
+
+		if (rayIntersectNode(node, ray)) {
+			if (node.count == 0) {
+				stack[stackPos++] = node.offset;
+				nodeIndex = nodeIndex + 1;
+				continue;
+			}
+
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const InstanceRecord &record = m_instances[i];
+
+				/* The direction is not renormalized, hence distances
+				   along the local ray equal those along the world ray */
+				const Instance *instance = record.instance;
+				Ray3f localRay(instance->isMoving() ? instance->getToLocal(ray.time) * ray
+					: instance->getToLocal() * ray);
+				if (!getAccelerator(record, ray)->rayIntersect(localRay, localIts, shadowRay))
+					continue;
+				if (shadowRay)
+					return true;
+
+				its = localIts;
+				ray.maxt = localIts.t;
+				foundInstance = record.instance;
+				foundIntersection = true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIndex = stack[--stackPos];
+	}
+
+	/* The differential geometry is computed in local space and then 
+	   transformed into world space on demand. The transformation of
+	   a moving instance only exists temporarily, hence the differential
+	   geometry of its intersections is computed right away */
+	if (foundInstance && foundInstance->isMoving()) {
+		Transform toWorld = foundInstance->getToWorld(ray.time);
+		its.toWorldTrafo = &toWorld;
+		its.computeDifferentialGeometry();
+		its.toWorldTrafo = NULL;
+	} else if (foundInstance) {
+		its.toWorldTrafo = &foundInstance->getToWorld();
+	}
+
+	return foundIntersection;
+}
+
+bool InstanceAccelerator::rayOccluded(const Ray3f &_ray) const {
+	Ray3f ray(_ray);
+
+	/* Determine the adaptive ray epsilon in world space */
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	if (m_flat->getPrimitiveCount() > 0 && m_flat->rayOccluded(ray))
+		return true;
+
+	if (m_nodes.empty())
+		return false;
+
+	uint32_t stack[NORI_INSTANCE_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIndex = 0;
+
+	while (true) {
+		const InstanceNode &node = m_nodes[nodeIndex];
+
+		if (rayIntersectNode(node, ray)) {
+			if (node.count == 0) {
+				stack[stackPos++] = node.offset;
+				nodeIndex = nodeIndex + 1;
+				continue;
+			}
+
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const InstanceRecord &record = m_instances[i];
+				const Instance *instance = record.instance;
+				Ray3f localRay(instance->isMoving() ? instance->getToLocal(ray.time) * ray
+					: instance->getToLocal() * ray);
+				if (getAccelerator(record, ray)->rayOccluded(localRay))
+					return true;
+			}
+		}
+
+		if (stackPos == 0)
+			return false;
+		nodeIndex = stack[--stackPos];
+	}
+}
+
+void InstanceAccelerator::reportMemory(MemoryReport &report) const {
+	m_flat->reportMemory(report);
+	report.add("accel", m_nodes.size() * sizeof(InstanceNode)
+		+ m_instances.size() * sizeof(InstanceRecord)
+		+ m_lodAccels.size() * sizeof(const Accelerator *));
+	for (size_t i=0; i<m_bottomLevel.size(); ++i)
+		m_bottomLevel[i]->reportMemory(report);
+}
+
+size_t InstanceAccelerator::getMemoryUsage() const {
+	size_t result = m_flat->getMemoryUsage() 
+		+ m_nodes.size() * sizeof(InstanceNode)
+		+ m_instances.size() * sizeof(InstanceRecord)
+		+ m_lodAccels.size() * sizeof(const Accelerator *);
+	for (size_t i=0; i<m_bottomLevel.size(); ++i)
+		result += m_bottomLevel[i]->getMemoryUsage();
+	return result;
+}
+
+qint64 InstanceAccelerator::getBuildTime() const {
+	qint64 result = m_flat->getBuildTime() + m_buildTime;
+	for (size_t i=0; i<m_bottomLevel.size(); ++i)
+		result += m_bottomLevel[i]->getBuildTime();
+	return result;
+}
+
+QString InstanceAccelerator::getName() const {
+	return QString("two-level %1").arg(m_flat->getName());
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
@@ -0,0 +1,221 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/irrcache.h>
+#include <nori/fastmath.h>
+#include <QReadLocker>
+#include <QWriteLocker>
+
+NORI_NAMESPACE_BEGIN
+
+IrradianceCache::IrradianceCache(const BoundingBox3f &bbox, float error,
+		int sampleCount, float minSpacing, float maxSpacing)
+	: m_bbox(bbox), m_error(error), m_minSpacing(minSpacing), m_maxSpacing(maxSpacing) {
+	/* Use about pi times more strata in phi than in theta */
+	m_thetaRes = std::max(1, (int) (std::sqrt(sampleCount / M_PI) + 0.5f));
+	m_phiRes = std::max(1, (int) (M_PI * m_thetaRes + 0.5f));
+
+	/* Leave some room for positions that are slightly outside */
+	Vector3f margin = m_bbox.getExtents() * 1e-3f + Vector3f::Constant(Epsilon);
+	m_bbox.min -= margin;
+	m_bbox.max += margin;
+}
+
+IrradianceCache::~IrradianceCache() {
+}
+
+Vector3f IrradianceCache::sampleDirection(int index, const Point2f &sample) const {
+	int j = index / m_phiRes, k = index % m_phiRes;
+
+	/* Cosine-weighted stratification: uniform in cos^2(theta) and phi */
+	float cosTheta = std::sqrt(std::max(0.0f, 1 - (j + sample.x()) / m_thetaRes)),
+	      sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+	float sinPhi, cosPhi;
+	fastSinCos(2 * M_PI * (k + sample.y()) / m_phiRes, &sinPhi, &cosPhi);
+	return Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+}
+
+Color3f IrradianceCache::addRecord(const Point3f &p, const Frame &frame,
+		const Color3f *radiance, const float *dist) {
+	int M = m_thetaRes, N = m_phiRes;
+	IrradianceRecord rec;
+	rec.p = p;
+	rec.n = frame.n;
+	rec.E = Color3f(0.0f);
+	Vector3f rotGrad[3], transGrad[3];
+	for (int c=0; c<3; ++c)
+		rotGrad[c] = transGrad[c] = Vector3f::Zero();
+
+	float invDistSum = 0;
+	for (int k=0; k<N; ++k) {
+		/* Directions of the stratum's center and of its boundary to
+		   the previous stratum in phi (local frame) */
+		float phi = 2 * M_PI * (k + 0.5f) / N, phiMinus = 2 * M_PI * k / N;
+		Vector3f u(std::cos(phi), std::sin(phi), 0.0f),
+		         vMinus(-std::sin(phiMinus), std::cos(phiMinus), 0.0f);
+
+		Color3f rotSum(0.0f), thetaSum(0.0f), phiSum(0.0f);
+		for (int j=0; j<M; ++j) {
+			int index = j * N + k, prevK = j * N + (k + N - 1) % N;
+			const Color3f &L = radiance[index];
+			rec.E += L;
+			invDistSum += 1.0f / std::max(dist[index], Epsilon);
+
+			/* Rotational gradient (Ward and Heckbert, Eq. 6) */
+			float cosThetaJ = std::sqrt(std::max(0.0f, 1 - (j + 0.5f) / M)),
+			      sinThetaJ = std::sqrt(std::max(0.0f, 1 - cosThetaJ * cosThetaJ));
+			rotSum -= L * (sinThetaJ / std::max(cosThetaJ, Epsilon));
+
+			/* Translational gradient: changes across the boundaries in theta ... */
+			float cosMinus2 = 1 - (float) j / M, cosPlus2 = 1 - (float) (j + 1) / M;
+			if (j > 0) {
+				float sinMinus = std::sqrt((float) j / M);
+				float minDist = std::max(std::min(dist[index], dist[index - N]), Epsilon);
+				thetaSum += (L - radiance[index - N]) * (sinMinus * cosMinus2 / minDist);
+			}
+
+			/* ... and in phi */
+			float minDist = std::max(std::min(dist[index], dist[prevK]), Epsilon);
+			phiSum += (L - radiance[prevK]) * ((std::sqrt(cosMinus2) - std::sqrt(cosPlus2))
+				/ (std::max(sinThetaJ, Epsilon) * minDist));
+		}
+
+		Vector3f v(-std::sin(phi), std::cos(phi), 0.0f);
+		for (int c=0; c<3; ++c) {
+			rotGrad[c] += v * rotSum[c];
+			transGrad[c] += u * (thetaSum[c] * 2 * M_PI / N) + vMinus * phiSum[c];
+		}
+	}
+
+	float scale = M_PI / (M * N);
+	rec.E *= scale;
+	for (int c=0; c<3; ++c) {
+		rec.rotGrad[c] = frame.toWorld(rotGrad[c] * scale);
+		rec.transGrad[c] = frame.toWorld(transGrad[c]);
+	}
+
+	/* The record radius is the harmonic mean distance, limited such
+	   that the gradient doesn't extrapolate to a negative luminance */
+	rec.R = (M * N) / invDistSum;
+	float lum = rec.E.getLuminance();
+	Vector3f lumGrad = rec.transGrad[0] * 0.212671f + rec.transGrad[1] * 0.715160f
+		+ rec.transGrad[2] * 0.072169f;
+	if (lumGrad.norm() * rec.R > lum && lum > 0)
+		rec.R = lum / lumGrad.norm();
+	rec.R = clamp(rec.R, m_minSpacing, m_maxSpacing);
+
+	float radius = m_error * rec.R;
+	BoundingBox3f recordBounds(rec.p - Vector3f::Constant(radius),
+		rec.p + Vector3f::Constant(radius));
+
+	QWriteLocker locker(&m_lock);
+	m_records.push_back(rec);
+	insert(&m_root, m_bbox, (uint32_t) (m_records.size() - 1), recordBounds, 0);
+	return rec.E;
+}
+
+void IrradianceCache::insert(Node *node, const BoundingBox3f &nodeBounds, uint32_t index,
+		const BoundingBox3f &recordBounds, int depth) {
+	/* Store the record in nodes that are about as large as its sphere
+	   of influence, so that a lookup doesn't visit too many of them */
+	if (depth == NORI_IRRCACHE_MAX_DEPTH || nodeBounds.getExtents().squaredNorm()
+			< recordBounds.getExtents().squaredNorm()) {
+		node->records.push_back(index);
+		return;
+	}
+
+	bool stored = false;
+	for (int i=0; i<8; ++i) {
+		BoundingBox3f bounds = childBounds(nodeBounds, i);
+		if (!bounds.overlaps(recordBounds))
+			continue;
+		if (!node->children[i])
+			node->children[i] = new Node();
+		insert(node->children[i], bounds, index, recordBounds, depth + 1);
+		stored = true;
+	}
+	if (!stored)
+		node->records.push_back(index);
+}
+
+bool IrradianceCache::lookup(const Point3f &p, const Normal3f &n, Color3f &E) const {
+	QReadLocker locker(&m_lock);
+	Color3f sum(0.0f);
+	float weightSum = 0;
+
+	/* Check the records of all nodes along the path to the leaf containing p */
+	const Node *node = &m_root;
+	BoundingBox3f bounds = m_bbox;
+	while (node) {
+		for (size_t i=0; i<node->records.size(); ++i) {
+			const IrradianceRecord &rec = m_records[node->records[i]];
+			Vector3f d = p - rec.p;
+			float error = d.norm() / rec.R + std::sqrt(std::max(0.0f, 1 - n.dot(rec.n)));
+			if (error >= m_error)
+				continue;
+
+			/* Skip records in front of the point, which can't see what it sees */
+			if (0.5f * d.dot(n + rec.n) < -0.05f * rec.R)
+				continue;
+
+			Vector3f rotation = rec.n.cross(n);
+			Color3f value = rec.E;
+			for (int c=0; c<3; ++c)
+				value[c] += rotation.dot(rec.rotGrad[c]) + d.dot(rec.transGrad[c]);
+
+			float weight = 1.0f / std::max(error, 1e-4f);
+			sum += value.max(Color3f(0.0f)) * weight;
+			weightSum += weight;
+		}
+
+		Point3f center = bounds.getCenter();
+		int child = (p.x() > center.x() ? 1 : 0) | (p.y() > center.y() ? 2 : 0)
+			| (p.z() > center.z() ? 4 : 0);
+		bounds = childBounds(bounds, child);
+		node = node->children[child];
+	}
+
+	if (weightSum == 0)
+		return false;
+	E = sum / weightSum;
+	return true;
+}
+
+BoundingBox3f IrradianceCache::childBounds(const BoundingBox3f &bounds, int i) {
+	Point3f center = bounds.getCenter();
+	BoundingBox3f result(bounds);
+	for (int axis=0; axis<3; ++axis) {
+		if (i & (1 << axis))
+			result.min[axis] = center[axis];
+		else
+			result.max[axis] = center[axis];
+	}
+	return result;
+}
+
+size_t IrradianceCache::getRecordCount() const {
+	QReadLocker locker(&m_lock);
+	return m_records.size();
+}
+
+QString IrradianceCache::toString() const {
+	return QString("IrradianceCache[error=%1, samples=%2x%3, records=%4]")
+		.arg(m_error).arg(m_thetaRes).arg(m_phiRes).arg(getRecordCount());
+}
+
+NORI_NAMESPACE_END
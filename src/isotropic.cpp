@@ -48,6 +48,20 @@ public:
 		return 1.0f;
 	}
 
+	/// Batched version of \ref sample(), which warps four samples at a time
+	void sample(PhaseFunctionQueryRecord *pRecs, const Point2f *samples,
+			float *result, uint32_t count) const {
+		Vector3f wo[NORI_WARP_BATCH_SIZE];
+		for (uint32_t k=0; k<count; k+=NORI_WARP_BATCH_SIZE) {
+			uint32_t size = std::min(count - k, (uint32_t) NORI_WARP_BATCH_SIZE);
+			squareToUniformSphere(samples + k, wo, size);
+			for (uint32_t i=0; i<size; ++i) {
+				pRecs[k+i].wo = wo[i];
+				result[k+i] = 1.0f;
+			}
+		}
+	}
+
 	/// Return a human-readable summary
 	QString toString() const {
 		return QString("Isotropic[]");
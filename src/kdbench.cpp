@@ -0,0 +1,184 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/kdtree.h>
+#include <nori/random.h>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Benchmark that compares the traversal performance of the 
+ * depth-first and the clustered kd-tree node layouts
+ *
+ * All meshes nested inside the test are placed into a kd-tree, which is
+ * first built with the depth-first layout produced by the construction
+ * code and then rearranged using \ref KDTree::relayoutNodes(). For both
+ * layouts, the benchmark traces a set of incoherent rays (uniformly 
+ * distributed origins and directions) and of coherent rays (a pinhole
+ * camera looking at the geometry) and reports the achieved throughput.
+ *
+ * These two trees are built without huge pages (see \ref allocLarge()).
+ * A third one with the clustered layout is built with huge pages, which
+ * shows the effect of TLB misses on the traversal. The mesh buffers are
+ * allocated while loading, so they are shared by all three.
+ *
+ * Finally, the clustered tree is traced once more with mailboxing (see
+ * \ref KDTree::setMailboxing()), which skips triangles that a ray has
+ * already tested in another leaf. Setting \c precompute to \c false
+ * measures this with the scalar triangle tests, which mailboxing skips
+ * individually instead of in blocks of four.
+ */
+class KDTreeLayoutBenchmark : public NoriObject {
+public:
+	KDTreeLayoutBenchmark(const PropertyList &propList) {
+		/* Number of rays per ray set (default: 1M) */
+		m_rayCount = propList.getInteger("rayCount", 1000000);
+
+		/* Number of times each ray set is traced (the best time is reported) */
+		m_repetitions = propList.getInteger("repetitions", 3);
+
+		/* Pack the leaf triangles for SIMD intersection tests (default: true) */
+		bool precompute = propList.getBoolean("precompute", true);
+
+		m_kdtree = new KDTree();
+		m_kdtree->setClusteredLayout(false);
+		m_kdtree->setPrecomputeTriangles(precompute);
+		m_hugeKDTree = new KDTree();
+		m_hugeKDTree->setPrecomputeTriangles(precompute);
+	}
+
+	virtual ~KDTreeLayoutBenchmark() {
+		delete m_kdtree;
+		delete m_hugeKDTree;
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case EMesh:
+				m_kdtree->addMesh(static_cast<Mesh *>(obj));
+				m_hugeKDTree->addMesh(static_cast<Mesh *>(obj));
+				break;
+
+			default:
+				throw NoriException(QString("KDTreeLayoutBenchmark::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
+	/// Trace a set of rays several times and return the best time in milliseconds
+	qint64 trace(const KDTree *kdtree, const std::vector<Ray3f> &rays, size_t &hits) const {
+		qint64 best = std::numeric_limits<qint64>::max();
+		for (int k=0; k<m_repetitions; ++k) {
+			QElapsedTimer timer;
+			timer.start();
+			hits = 0;
+			for (size_t i=0; i<rays.size(); ++i) {
+				Intersection its;
+				if (kdtree->rayIntersect(rays[i], its, false))
+					++hits;
+			}
+			best = std::min(best, timer.elapsed());
+		}
+		return best;
+	}
+
+	void activate() {
+		if (m_kdtree->getPrimitiveCount() == 0)
+			throw NoriException("KDTreeLayoutBenchmark: no meshes were specified!");
+
+		bool hugePages = getHugePagesEnabled();
+		setHugePagesEnabled(false);
+		m_kdtree->build();
+		setHugePagesEnabled(true);
+		m_hugeKDTree->build();
+		setHugePagesEnabled(hugePages);
+
+		const BoundingBox3f &bbox = m_kdtree->getBoundingBox();
+		Vector3f extents = bbox.getExtents();
+		Random random;
+
+		/* Incoherent rays: random origins inside the scene, random directions */
+		std::vector<Ray3f> incoherent(m_rayCount);
+		for (int i=0; i<m_rayCount; ++i) {
+			Point3f o = bbox.min + extents.cwiseProduct(Vector3f(random.nextFloat(),
+				random.nextFloat(), random.nextFloat()));
+			Vector3f d = squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()));
+			incoherent[i] = Ray3f(o, d);
+		}
+
+		/* Coherent rays: a pinhole camera in front of the scene (along -Z) */
+		std::vector<Ray3f> coherent(m_rayCount);
+		int resolution = std::max(1, (int) std::sqrt((float) m_rayCount));
+		Point3f center = bbox.getCenter(),
+		        eye = center - Vector3f(0, 0, 2*extents.maxCoeff());
+		for (int i=0; i<m_rayCount; ++i) {
+			int x = i % resolution, y = (i / resolution) % resolution;
+			Point3f target = bbox.min + Vector3f(
+				extents.x() * (x + 0.5f) / resolution,
+				extents.y() * (y + 0.5f) / resolution,
+				0.0f);
+			coherent[i] = Ray3f(eye, (target - eye).normalized());
+		}
+
+		const char *names[] = { "depth-first", "clustered", "clustered+huge", "clustered+mailbox" };
+		qint64 time[4][2];
+		size_t hits[4][2];
+
+		cout << "Tracing " << m_rayCount << " rays per set (best of " 
+			 << m_repetitions << " runs) .." << endl;
+		for (int layout=0; layout<4; ++layout) {
+			if (layout == 1)
+				m_kdtree->relayoutNodes();
+			else if (layout == 3)
+				m_kdtree->setMailboxing(true);
+			const KDTree *kdtree = layout == 2 ? m_hugeKDTree : m_kdtree;
+			time[layout][0] = trace(kdtree, incoherent, hits[layout][0]);
+			time[layout][1] = trace(kdtree, coherent, hits[layout][1]);
+		}
+
+		cout << endl << "Layout             Incoherent (Mrays/s)   Coherent (Mrays/s)" << endl;
+		for (int layout=0; layout<4; ++layout) {
+			QString line = QString("%1 %2 %3")
+				.arg(names[layout], -18)
+				.arg(m_rayCount / (1000.0 * std::max(time[layout][0], (qint64) 1)), -22, 'f', 2)
+				.arg(m_rayCount / (1000.0 * std::max(time[layout][1], (qint64) 1)), -18, 'f', 2);
+			cout << qPrintable(line) << endl;
+		}
+
+		for (int layout=1; layout<4; ++layout) {
+			if (hits[0][0] != hits[layout][0] || hits[0][1] != hits[layout][1])
+				throw NoriException("KDTreeLayoutBenchmark: the trees produced different results!");
+		}
+	}
+
+	QString toString() const {
+		return QString("KDTreeLayoutBenchmark[rayCount=%1, repetitions=%2]")
+			.arg(m_rayCount).arg(m_repetitions);
+	}
+
+	EClassType getClassType() const { return ETest; }
+private:
+	KDTree *m_kdtree;
+	KDTree *m_hugeKDTree;
+	int m_rayCount;
+	int m_repetitions;
+};
+
+NORI_REGISTER_CLASS(KDTreeLayoutBenchmark, "kdbench");
+NORI_NAMESPACE_END
@@ -17,33 +17,946 @@
 */
 
 #include <nori/kdtree.h>
+#include <nori/triaccel.h>
+#include <nori/paging.h>
+#include <nori/profiler.h>
+#include <nori/memreport.h>
 #include <Eigen/Geometry>
+#include <QFile>
+#include <QElapsedTimer>
+#include <fstream>
+#include <deque>
+#include <stack>
+#include <queue>
+#include <boost/static_assert.hpp>
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#endif
+
+#if defined(NORI_SSE)
+/* The SSE traversal code is hard-wired to packets of four rays */
+BOOST_STATIC_ASSERT(NORI_PACKET_SIZE == 4);
+#endif
 
 NORI_NAMESPACE_BEGIN
 
-KDTree::KDTree() : m_primitiveCount(0) {
-	m_sizeMap.push_back(0);
+#if defined(NORI_TRAVERSAL_STATISTICS)
+/**
+ * \brief Counts the work done by one query and adds it to the calling
+ * thread's totals when the query returns
+ */
+struct QueryStatistics : public Accelerator::TraversalStatistics {
+	QThreadStorage<Accelerator::TraversalStatistics *> &storage;
+
+	QueryStatistics(QThreadStorage<Accelerator::TraversalStatistics *> &storage)
+		: storage(storage) {
+		queries = 1;
+	}
+
+	~QueryStatistics() {
+		if (!storage.hasLocalData())
+			storage.setLocalData(new Accelerator::TraversalStatistics());
+		*storage.localData() += *this;
+	}
+};
+
+#define NORI_STATS_QUERY()          QueryStatistics stats(m_statistics)
+#define NORI_STATS_ADD(field, n)    stats.field += (n)
+#else
+#define NORI_STATS_QUERY()
+#define NORI_STATS_ADD(field, n)
+#endif
+
+/**
+ * \brief Small hash of the triangles that one query has already tested
+ *
+ * Perfect splits reference a triangle from every leaf that it overlaps,
+ * hence a ray that passes through several of these leaves would test it
+ * again and again. A triangle is only recorded after it has been tested,
+ * and since the ray segment can only become shorter, repeating the test
+ * can never produce a new hit. Collisions simply evict older entries.
+ */
+struct Mailbox {
+	uint64_t keys[NORI_KD_MAILBOX_SIZE];
+
+	inline Mailbox() {
+		for (int i=0; i<NORI_KD_MAILBOX_SIZE; ++i)
+			keys[i] = (uint64_t) -1;
+	}
+
+	/// Return the slot of a key
+	inline uint64_t &slot(uint64_t key) {
+		return keys[(key ^ (key >> 32)) & (NORI_KD_MAILBOX_SIZE - 1)];
+	}
+
+	/// Was the key recorded before?
+	inline bool contains(uint64_t key) { return slot(key) == key; }
+
+	/// Record a key
+	inline void insert(uint64_t key) { slot(key) = key; }
+
+	/// Was the triangle of a \ref TriAccel4 lane recorded before?
+	inline bool contains(const TriAccel4 &block, int lane) {
+		return contains(((uint64_t) block.mesh[lane] << 32) | block.prim[lane]);
+	}
+
+	/// Were all used lanes of a \ref TriAccel4 block recorded before?
+	inline bool containsAll(const TriAccel4 &block) {
+		for (int i=0; i<4; ++i) {
+			if (block.mesh[i] != NORI_TRIACCEL_INVALID && !contains(block, i))
+				return false;
+		}
+		return true;
+	}
+
+	/// Record the triangles of a \ref TriAccel4 block
+	inline void insertAll(const TriAccel4 &block) {
+		for (int i=0; i<4; ++i) {
+			if (block.mesh[i] != NORI_TRIACCEL_INVALID)
+				insert(((uint64_t) block.mesh[i] << 32) | block.prim[i]);
+		}
+	}
+};
+
+/// Version of the tree cache file format (increase when changing the layout)
+#define NORI_KD_CACHE_VERSION 1
+
+/**
+ * \brief Header of a kd-tree cache file
+ *
+ * It is followed by <tt>nodeCount+1</tt> nodes (the first one is unused and
+ * reproduces the alignment shift of \ref GenericKDTree::buildInternal())
+ * and then by <tt>indexCount</tt> primitive indices.
+ */
+struct KDCacheHeader {
+	char magic[3];
+	uint8_t version;
+	uint32_t nodeCount;
+	uint32_t indexCount;
+	uint32_t primCount;
+	uint64_t hash;
+	float bbox[2][3];
+	float tightBBox[2][3];
+	float heuristicCost;
+	uint8_t reserved[52];
+};
+
+BOOST_STATIC_ASSERT(sizeof(KDCacheHeader) == 128);
+
+/// Incrementally compute a 64 bit FNV-1a hash of a buffer (processed in 32 bit words)
+static uint64_t hashBuffer(const void *ptr, size_t size, uint64_t hash) {
+	const uint32_t *words = (const uint32_t *) ptr;
+	for (size_t i=0; i<size/4; ++i) {
+		hash ^= words[i];
+		hash *= 0x100000001b3ULL;
+	}
+	const uint8_t *bytes = (const uint8_t *) ptr;
+	for (size_t i=size & ~((size_t) 3); i<size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/// Hash 64 bytes out of every \c stride bytes of a buffer (or all of it if \c stride is zero)
+static uint64_t hashSampled(const void *ptr, size_t size, size_t stride, uint64_t hash) {
+	if (stride == 0)
+		return hashBuffer(ptr, size, hash);
+	for (size_t offset=0; offset<size; offset += stride)
+		hash = hashBuffer((const char *) ptr + offset, std::min(size - offset, (size_t) 64), hash);
+	return hash;
+}
+
+KDTree::KDTree() : m_buildQuality(EDefault), m_precomputeTriangles(true),
+		m_outOfCore(false), m_clusteredLayout(true), m_mailboxing(false), m_alphaMasks(false), m_triAccel(NULL), m_triAccelOffset(NULL), m_triAccelCount(0),
+		m_splitThreshold(0), m_splitBudget(0.5f), m_shortRayLength(0), m_shortRayResolution(64),
+		m_shortRayMaxLength2(0), m_cached(false), m_cacheData(NULL), m_cacheSize(0) {
+	memset(m_phaseTime, 0, sizeof(m_phaseTime));
+#if defined(PLATFORM_WINDOWS)
+	m_cacheFile = m_cacheMapping = NULL;
+#endif
 }
 
 KDTree::~KDTree() {
-	for (size_t i=0; i<m_meshes.size(); ++i)
-		delete m_meshes[i];
+	unmapCache();
+	if (m_triAccel)
+		freeLarge(m_triAccel);
+	if (m_triAccelOffset)
+		delete[] m_triAccelOffset;
+}
+
+void KDTree::setBuildQuality(EBuildQuality quality) {
+	switch (quality) {
+		case EBinned:
+			setExactPrimitiveThreshold(0);
+			break;
+		case EDefault:
+			setExactPrimitiveThreshold(65536);
+			break;
+		case EExact:
+			setExactPrimitiveThreshold(std::numeric_limits<SizeType>::max());
+			break;
+		default:
+			throw NoriException(QString("Invalid kd-tree build quality %1!").arg((int) quality));
+	}
+	m_buildQuality = quality;
 }
 
+static const char *qualityNames[] = { "binned", "default", "exact" };
+static const char *phaseNames[KDTree::EBuildPhaseCount] = {
+	"references", "tree", "layout", "cache", "precompute"
+};
+
+/// Serializes the appends of concurrent builds to the metrics file
+static QMutex metricsMutex;
+
+/// Node on the stack of \ref KDTree::getMetricsJSON()
+struct MetricsEntry {
+	/// Index of the node in the tree
+	uint32_t node;
+	BoundingBox3f bbox;
+	int depth;
+};
+
 void KDTree::build() {
+	ProfileScope scope("Build kd-tree", "accel");
 	SizeType primCount = getPrimitiveCount();
+	bool rebuild = isBuilt();
+	if (rebuild)
+		clear();
+
+	if (m_outOfCore && m_cacheFilename.isEmpty())
+		throw NoriException("KDTree: an out-of-core tree requires a cache file!");
+
+	m_alphaMasks = false;
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		m_alphaMasks |= m_meshes[i]->getAlphaMask() != NULL;
+
+	/* The time of each phase is recorded for the quality metrics */
+	memset(m_phaseTime, 0, sizeof(m_phaseTime));
+	m_cached = false;
+	QElapsedTimer phaseTimer;
+	phaseTimer.start();
+
+	/* The cache only stores the tree of the initial geometry */
+	bool useCache = !m_cacheFilename.isEmpty() && primCount > 0 && !rebuild;
+	bool precompute = m_precomputeTriangles && !m_outOfCore;
+	uint64_t hash = 0;
+	if (useCache) {
+		QElapsedTimer timer;
+		timer.start();
+		hash = computeCacheHash();
+		if (loadCache(hash)) {
+			m_buildTime = timer.elapsed();
+			m_cached = true;
+			m_phaseTime[EPhaseCache] = phaseTimer.restart();
+			if (precompute)
+				precomputeTriangles();
+			buildShortRayGrid();
+			m_phaseTime[EPhasePrecompute] = phaseTimer.restart();
+			saveMetrics();
+			return;
+		}
+		m_phaseTime[EPhaseCache] = phaseTimer.restart();
+	}
+
 	cout << "Constructing a SAH kd-tree (" << primCount << " triangles, "
-		 << getCoreCount() << " threads) .." << endl;
+		 << getCoreCount() << " threads, " << qualityNames[m_buildQuality]
+		 << " quality) .." << endl;
+	if (primCount > 0)
+		createReferences();
+	if (m_splitThreshold > 0 && primCount > 0)
+		splitTriangles();
+	m_phaseTime[EPhaseReferences] = phaseTimer.restart();
+
 	Parent::buildInternal();
+	m_phaseTime[EPhaseTree] = phaseTimer.restart();
+
+	/* Only references added by early split clipping need to be remapped */
+	if (m_references.size() > primCount)
+		remapReferences();
+	else
+		std::vector<TriangleReference>().swap(m_references);
+
+	if (m_clusteredLayout && primCount > 0)
+		relayoutNodes();
+	m_phaseTime[EPhaseLayout] = phaseTimer.restart();
+
+	if (useCache) {
+		bool saved = saveCache(hash);
+		if (m_outOfCore) {
+			/* Continue with the mapped file, whose pages can be dropped */
+			if (!saved)
+				throw NoriException("KDTree: unable to write the out-of-core tree!");
+			clear();
+			if (!loadCache(hash))
+				throw NoriException("KDTree: unable to map the out-of-core tree!");
+		}
+		m_phaseTime[EPhaseCache] += phaseTimer.restart();
+	}
+
+	if (precompute && primCount > 0)
+		precomputeTriangles();
+	buildShortRayGrid();
+	m_phaseTime[EPhasePrecompute] = phaseTimer.restart();
+	saveMetrics();
 }
 
-void KDTree::addMesh(Mesh *mesh) {
-	m_primitiveCount += mesh->getTriangleCount();
-	m_meshes.push_back(mesh);
-	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+QString KDTree::getMetricsJSON() const {
+	/* Walk the final tree, tracking the bounding box of every node */
+	std::vector<MetricsEntry> stack;
+	std::vector<uint64_t> depths;
+	uint64_t innerNodes = 0, leaves = 0, emptyLeaves = 0, entries = 0, maxLeafSize = 0;
+	double cost = 0;
+
+	if (isBuilt()) {
+		MetricsEntry root = { 0, m_bbox, 0 };
+		stack.push_back(root);
+	}
+	while (!stack.empty()) {
+		MetricsEntry entry = stack.back();
+		stack.pop_back();
+		const KDNode *node = m_nodes + entry.node;
+		float area = entry.bbox.getSurfaceArea();
+		if (node->isLeaf()) {
+			uint64_t size = node->getPrimEnd() - node->getPrimStart();
+			++leaves;
+			if (size == 0)
+				++emptyLeaves;
+			entries += size;
+			maxLeafSize = std::max(maxLeafSize, size);
+			if ((size_t) entry.depth >= depths.size())
+				depths.resize(entry.depth + 1, 0);
+			++depths[entry.depth];
+			cost += (double) area * size * m_queryCost;
+		} else {
+			++innerNodes;
+			cost += (double) area * m_traversalCost;
+			int axis = node->getAxis();
+			float split = node->getSplit();
+			uint32_t leftIndex = (uint32_t) (node->getLeft() - m_nodes);
+			MetricsEntry left = { leftIndex, entry.bbox, entry.depth + 1 },
+			      right = { leftIndex + 1, entry.bbox, entry.depth + 1 };
+			left.bbox.max[axis] = split;
+			right.bbox.min[axis] = split;
+			stack.push_back(right);
+			stack.push_back(left);
+		}
+	}
+
+	/* The cost is relative to the root, like that of the builder */
+	float rootArea = m_bbox.getSurfaceArea();
+	if (rootArea > 0)
+		cost /= rootArea;
+
+	SizeType primCount = Accelerator::getPrimitiveCount();
+	uint64_t nonemptyLeaves = leaves - emptyLeaves;
+	QString depthList, phases;
+	for (size_t i=0; i<depths.size(); ++i)
+		depthList += QString(i > 0 ? ", %1" : "%1").arg((qulonglong) depths[i]);
+	qint64 totalTime = 0;
+	for (int i=0; i<EBuildPhaseCount; ++i) {
+		phases += QString("%1\"%2\": %3").arg(i > 0 ? ", " : "").arg(phaseNames[i])
+			.arg(m_phaseTime[i]);
+		totalTime += m_phaseTime[i];
+	}
+
+	return QString("{ \"mesh\": %1, \"meshes\": %2, \"triangles\": %3, \"quality\": \"%4\", "
+		"\"cached\": %5, \"sahCost\": %6, \"sahCostBuilder\": %7, \"innerNodes\": %8, "
+		"\"leaves\": %9, \"emptyLeaves\": %10, \"emptyLeafRatio\": %11, \"leafEntries\": %12, "
+		"\"duplication\": %13, \"averageLeafSize\": %14, \"maxLeafSize\": %15, "
+		"\"maxDepth\": %16, \"indirections\": %17, \"memory\": %18, \"buildTime\": %19, "
+		"\"phaseTime\": { %20 }, \"depths\": [%21] }")
+		.arg(QString::fromUtf8(toJSONString(m_meshes.empty() ? QString() : m_meshes[0]->getName()).c_str()))
+		.arg((qulonglong) m_meshes.size()).arg((qulonglong) primCount)
+		.arg(qualityNames[m_buildQuality]).arg(m_cached ? "true" : "false")
+		.arg(cost).arg(getHeuristicCost())
+		.arg((qulonglong) innerNodes).arg((qulonglong) leaves).arg((qulonglong) emptyLeaves)
+		.arg(leaves > 0 ? emptyLeaves / (double) leaves : 0.0)
+		.arg((qulonglong) entries)
+		.arg(primCount > 0 ? entries / (double) primCount : 0.0)
+		.arg(nonemptyLeaves > 0 ? entries / (double) nonemptyLeaves : 0.0)
+		.arg((qulonglong) maxLeafSize).arg((int) depths.size() - 1)
+		.arg((qulonglong) (m_cached ? 0 : getIndirectionCount()))
+		.arg((qulonglong) getMemoryUsage()).arg(totalTime)
+		.arg(phases).arg(depthList);
 }
 
-bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+void KDTree::saveMetrics() const {
+	if (m_metricsFilename.isEmpty())
+		return;
+	QString metrics = getMetricsJSON();
+
+	QMutexLocker locker(&metricsMutex);
+	std::ofstream out(m_metricsFilename.toLocal8Bit().data(), std::ios::app);
+	if (!out)
+		throw NoriException(QString("KDTree: cannot open \"%1\" for writing")
+			.arg(m_metricsFilename));
+	out << qPrintable(metrics) << std::endl;
+	if (!out)
+		throw NoriException(QString("KDTree: unable to write \"%1\"").arg(m_metricsFilename));
+}
+
+void KDTree::buildShortRayGrid() {
+	std::vector<uint32_t>().swap(m_shortRayCells);
+	Vector3f extents = m_bbox.getExtents();
+	if (m_shortRayLength <= 0 || m_shortRayResolution < 1 || getPrimitiveCount() == 0
+			|| !m_bbox.isValid() || extents.maxCoeff() <= 0)
+		return;
+
+	float length = m_shortRayLength * extents.norm(),
+	      cellSize = extents.maxCoeff() / m_shortRayResolution;
+	for (int i=0; i<3; ++i) {
+		m_shortRayCellCount[i] = std::max(1, (int) std::ceil(extents[i] / cellSize));
+		m_shortRayScale[i] = m_shortRayCellCount[i] / std::max(extents[i], Epsilon);
+	}
+	/* Queries are slightly shorter than the dilation of the cells, which
+	   absorbs the round-off of the cell lookup */
+	float margin = Epsilon * std::max(1.0f, m_bbox.min.array().abs()
+		.max(m_bbox.max.array().abs()).maxCoeff());
+	m_shortRayMaxLength2 = length * length;
+	length += cellSize * 1e-3f + margin;
+
+	size_t cellCount = (size_t) m_shortRayCellCount.x() * m_shortRayCellCount.y()
+		* m_shortRayCellCount.z(), emptyCells = 0;
+	m_shortRayCells.resize(cellCount);
+	for (size_t index=0; index<cellCount; ++index) {
+		Vector3i cell(
+			(int) (index % m_shortRayCellCount.x()),
+			(int) ((index / m_shortRayCellCount.x()) % m_shortRayCellCount.y()),
+			(int) (index / ((size_t) m_shortRayCellCount.x() * m_shortRayCellCount.y())));
+		Point3f cellMin, cellMax;
+		for (int i=0; i<3; ++i) {
+			cellMin[i] = m_bbox.min[i] + cell[i] / m_shortRayScale[i] - length;
+			cellMax[i] = m_bbox.min[i] + (cell[i] + 1) / m_shortRayScale[i] + length;
+		}
+
+		/* Descend as long as the grown cell lies on one side of the split plane */
+		const KDNode *node = m_nodes;
+		while (!node->isLeaf()) {
+			const float split = (float) node->getSplit();
+			const int axis = node->getAxis();
+			if (cellMax[axis] < split)
+				node = node->getLeft();
+			else if (cellMin[axis] > split)
+				node = node->getLeft() + 1;
+			else
+				break;
+		}
+		if (node->isLeaf() && node->getPrimStart() == node->getPrimEnd())
+			++emptyCells;
+		m_shortRayCells[index] = (uint32_t) (node - m_nodes);
+	}
+
+	cout << "Built a grid for short occlusion queries (" << m_shortRayCellCount.x() << "x"
+		 << m_shortRayCellCount.y() << "x" << m_shortRayCellCount.z() << " cells, "
+		 << (100.0f * emptyCells / cellCount) << "% empty)" << endl;
+}
+
+uint64_t KDTree::computeCacheHash() const {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	/* Construction parameters that influence the resulting tree */
+	uint32_t params[] = {
+		NORI_KD_CACHE_VERSION, (uint32_t) sizeof(KDNode), (uint32_t) sizeof(IndexType),
+		(uint32_t) m_buildQuality, (uint32_t) m_clip, (uint32_t) m_retract,
+		(uint32_t) m_maxDepth, (uint32_t) m_stopPrims, (uint32_t) m_maxBadRefines,
+		(uint32_t) m_exactPrimThreshold, (uint32_t) m_minMaxBins,
+		(uint32_t) m_clusteredLayout, (uint32_t) m_meshes.size()
+	};
+	float costs[] = { m_traversalCost, m_queryCost, m_emptySpaceBonus,
+		m_splitThreshold, m_splitBudget };
+	hash = hashBuffer(params, sizeof(params), hash);
+	hash = hashBuffer(costs, sizeof(costs), hash);
+
+	/* Geometry of all meshes, in the order in which they were added. Out of
+	   core, only 64 bytes per MiB are hashed, since reading everything
+	   would page in all geometry */
+	size_t stride = m_outOfCore ? (1 << 20) : 0;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Mesh *mesh = m_meshes[i];
+		uint32_t counts[] = { mesh->getVertexCount(), mesh->getTriangleCount() };
+		hash = hashBuffer(counts, sizeof(counts), hash);
+		hash = hashSampled(mesh->getVertexPositions(),
+			sizeof(Point3f) * mesh->getVertexCount(), stride, hash);
+		hash = hashSampled(mesh->getIndices(),
+			sizeof(uint32_t) * 3 * mesh->getTriangleCount(), stride, hash);
+	}
+
+	return hash;
+}
+
+void KDTree::relayoutNodes() {
+	const IndexType invalid = std::numeric_limits<IndexType>::max();
+
+	/* Mapping from new to old node indices and vice versa */
+	std::vector<IndexType> order, newIndex(m_nodeCount, invalid);
+	order.reserve(m_nodeCount);
+
+	/* Indices of the first node of sibling pairs that start a new cluster */
+	std::stack<IndexType> pending;
+	std::deque<IndexType> queue;
+
+	order.push_back(0);
+	newIndex[0] = 0;
+	if (!m_nodes[0].isLeaf())
+		pending.push((IndexType) (m_nodes[0].getLeft() - m_nodes));
+
+	while (!pending.empty()) {
+		/* Node indices are relative to m_nodes (which is shifted by one
+		   entry), hence cache lines start at indices 7, 15, 23, .. */
+		SizeType pos = (SizeType) order.size(),
+		         capacity = (2*NORI_KD_CLUSTER_PAIRS - (pos+1) % (2*NORI_KD_CLUSTER_PAIRS)) / 2;
+
+		queue.clear();
+		queue.push_back(pending.top());
+		pending.pop();
+
+		/* Fill the remainder of the current cache line in breadth-first order */
+		for (SizeType taken = 0; taken < capacity && !queue.empty(); ++taken) {
+			IndexType first = queue.front();
+			queue.pop_front();
+
+			for (IndexType i=first; i<first+2; ++i) {
+				newIndex[i] = (IndexType) order.size();
+				order.push_back(i);
+				if (!m_nodes[i].isLeaf())
+					queue.push_back((IndexType) (m_nodes[i].getLeft() - m_nodes));
+			}
+		}
+
+		/* Subtrees that did not fit start their own clusters (left to right) */
+		while (!queue.empty()) {
+			pending.push(queue.back());
+			queue.pop_back();
+		}
+	}
+
+	if (order.size() != m_nodeCount)
+		throw NoriException("KDTree::relayoutNodes(): internal error -- node count mismatch!");
+
+	/* Copy the nodes and rewrite the relative child offsets */
+	KDNode *nodes = static_cast<KDNode *> (allocLarge(
+			sizeof(KDNode) * (m_nodeCount+1)))+1;
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		const KDNode &node = m_nodes[order[i]];
+		if (node.isLeaf()) {
+			nodes[i] = node;
+		} else {
+			IndexType left = newIndex[node.getLeft() - m_nodes];
+			if (!nodes[i].initInnerNode(node.getAxis(), node.getSplit(), (ptrdiff_t) left - (ptrdiff_t) i)) {
+				/* Keep the original layout */
+				freeLarge(nodes-1);
+				return;
+			}
+		}
+	}
+
+	freeLarge(m_nodes-1);
+	m_nodes = nodes;
+}
+
+bool KDTree::loadCache(uint64_t hash) {
+	QFile file(m_cacheFilename);
+	if (!file.exists())
+		return false;
+
+	/* Validate the header before mapping anything */
+	KDCacheHeader header;
+	if (!file.open(QIODevice::ReadOnly) ||
+		file.read((char *) &header, sizeof(KDCacheHeader)) != sizeof(KDCacheHeader))
+		return false;
+	size_t fileSize = (size_t) file.size();
+	file.close();
+
+	if (memcmp(header.magic, "NKD", 3) != 0 || header.version != NORI_KD_CACHE_VERSION
+		|| header.hash != hash || header.primCount != getPrimitiveCount()
+		|| fileSize != sizeof(KDCacheHeader) + sizeof(KDNode) * (header.nodeCount + 1)
+				+ sizeof(IndexType) * header.indexCount) {
+		cout << "kd-tree cache \"" << qPrintable(m_cacheFilename)
+			 << "\" is out of date, rebuilding .." << endl;
+		return false;
+	}
+
+	QByteArray filename = m_cacheFilename.toLocal8Bit();
+	cout << "Mapping kd-tree cache \"" << filename.data() << "\" into memory .." << endl;
+
+	#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+		int fd = open(filename.data(), O_RDONLY);
+		if (fd == -1)
+			throw NoriException(QString("Could not open \"%1\"!").arg(m_cacheFilename));
+		void *data = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			throw NoriException("mmap(): failed.");
+		if (close(fd) != 0)
+			throw NoriException("close(): unable to close file descriptor!");
+		m_cacheData = (char *) data;
+	#elif defined(PLATFORM_WINDOWS)
+		m_cacheFile = CreateFileA(filename.data(), GENERIC_READ, 
+			FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_cacheFile == INVALID_HANDLE_VALUE)
+			throw NoriException(QString("Could not open \"%1\"!").arg(m_cacheFilename));
+		m_cacheMapping = CreateFileMapping(m_cacheFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (m_cacheMapping == NULL)
+			throw NoriException("CreateFileMapping(): failed.");
+		m_cacheData = (char *) MapViewOfFile(m_cacheMapping, FILE_MAP_READ, 0, 0, 0);
+		if (m_cacheData == NULL)
+			throw NoriException("MapViewOfFile(): failed.");
+	#endif
+	m_cacheSize = fileSize;
+	PagedMemory::getInstance()->addRegion(m_cacheData, m_cacheSize);
+
+	/* The mapping is page-aligned, hence the node array has the same
+	   alignment as one allocated by GenericKDTree::buildInternal() */
+	m_nodes = (KDNode *) (m_cacheData + sizeof(KDCacheHeader)) + 1;
+	m_indices = (IndexType *) (m_nodes + header.nodeCount);
+	m_nodeCount = header.nodeCount;
+	m_indexCount = header.indexCount;
+	m_heuristicCost = header.heuristicCost;
+	for (int i=0; i<3; ++i) {
+		m_bbox.min[i] = header.bbox[0][i];
+		m_bbox.max[i] = header.bbox[1][i];
+		m_tightBBox.min[i] = header.tightBBox[0][i];
+		m_tightBBox.max[i] = header.tightBBox[1][i];
+	}
+
+	cout << "The cached kd-tree requires " 
+		 << (fileSize - sizeof(KDCacheHeader)) / 1024 << " KiB of memory" << endl;
+	return true;
+}
+
+bool KDTree::saveCache(uint64_t hash) const {
+	KDCacheHeader header;
+	memset(&header, 0, sizeof(KDCacheHeader));
+	memcpy(header.magic, "NKD", 3);
+	header.version = NORI_KD_CACHE_VERSION;
+	header.nodeCount = m_nodeCount;
+	header.indexCount = m_indexCount;
+	header.primCount = getPrimitiveCount();
+	header.hash = hash;
+	header.heuristicCost = m_heuristicCost;
+	for (int i=0; i<3; ++i) {
+		header.bbox[0][i] = m_bbox.min[i];
+		header.bbox[1][i] = m_bbox.max[i];
+		header.tightBBox[0][i] = m_tightBBox.min[i];
+		header.tightBBox[1][i] = m_tightBBox.max[i];
+	}
+
+	/* A failure to write the cache is not fatal -- the tree is simply rebuilt next time */
+	QFile file(m_cacheFilename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		cerr << "Warning: unable to write the kd-tree cache \""
+			 << qPrintable(m_cacheFilename) << "\"" << endl;
+		return false;
+	}
+
+	qint64 nodeBytes = sizeof(KDNode) * (m_nodeCount + 1),
+		   indexBytes = sizeof(IndexType) * m_indexCount;
+	bool success = 
+		file.write((const char *) &header, sizeof(KDCacheHeader)) == sizeof(KDCacheHeader) &&
+		file.write((const char *) (m_nodes - 1), nodeBytes) == nodeBytes &&
+		file.write((const char *) m_indices, indexBytes) == indexBytes;
+	file.close();
+
+	if (!success) {
+		cerr << "Warning: unable to write the kd-tree cache \""
+			 << qPrintable(m_cacheFilename) << "\"" << endl;
+		file.remove();
+		return false;
+	}
+
+	cout << "Wrote the kd-tree to \"" << qPrintable(m_cacheFilename) << "\"" << endl;
+	return true;
+}
+
+void KDTree::unmapCache() {
+	if (!m_cacheData)
+		return;
+
+	/* The node and index arrays belong to the mapping, not to GenericKDTree */
+	m_nodes = NULL;
+	m_indices = NULL;
+	PagedMemory::getInstance()->removeRegion(m_cacheData);
+
+	#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+		if (munmap(m_cacheData, m_cacheSize) != 0)
+			throw NoriException("munmap(): unable to unmap memory!");
+	#elif defined(PLATFORM_WINDOWS)
+		if (!UnmapViewOfFile(m_cacheData))
+			throw NoriException("UnmapViewOfFile(): unable to unmap memory region");
+		if (!CloseHandle(m_cacheMapping))
+			throw NoriException("CloseHandle(): unable to close file mapping!");
+		if (!CloseHandle(m_cacheFile))
+			throw NoriException("CloseHandle(): unable to close file");
+	#endif
+	m_cacheData = NULL;
+	m_cacheSize = 0;
+}
+
+/// Computes the triangle references of a range of triangles
+class ReferenceThread : public QThread {
+public:
+	ReferenceThread(KDTree *tree, uint32_t start, uint32_t end)
+		: m_tree(tree), m_start(start), m_end(end) { }
+
+	void run() {
+		m_tree->createReferences(m_start, m_end);
+	}
+private:
+	KDTree *m_tree;
+	uint32_t m_start, m_end;
+};
+
+void KDTree::createReferences() {
+	SizeType primCount = Accelerator::getPrimitiveCount();
+	m_references.resize(primCount);
+
+	SizeType threadCount = std::max((SizeType) 1, std::min((SizeType) getCoreCount(),
+		primCount / (SizeType) NORI_KD_PARALLEL_GRAIN));
+	if (threadCount == 1) {
+		createReferences(0, primCount);
+		return;
+	}
+
+	std::vector<ReferenceThread *> threads(threadCount);
+	for (SizeType i=0; i<threadCount; ++i) {
+		threads[i] = new ReferenceThread(this,
+			(SizeType) (((uint64_t) primCount * i) / threadCount),
+			(SizeType) (((uint64_t) primCount * (i+1)) / threadCount));
+		threads[i]->start();
+	}
+	for (SizeType i=0; i<threadCount; ++i) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+void KDTree::createReferences(IndexType start, IndexType end) {
+	IndexType local = start, meshIndex = findMesh(local);
+	for (IndexType i=start; i<end; ++i) {
+		while (i >= m_sizeMap[meshIndex + 1])
+			++meshIndex;
+		TriangleReference &ref = m_references[i];
+		ref.bbox = m_meshes[meshIndex]->getBoundingBox(i - m_sizeMap[meshIndex]);
+		ref.index = i;
+		ref.mesh = meshIndex;
+	}
+}
+
+void KDTree::splitTriangles() {
+	QElapsedTimer timer;
+	timer.start();
+
+	SizeType primCount = Accelerator::getPrimitiveCount();
+	size_t maxReferences = primCount + (size_t) (m_splitBudget * primCount);
+	maxReferences = std::min(maxReferences, (size_t) std::numeric_limits<IndexType>::max());
+
+	/* Start with one reference per triangle (see \ref createReferences()).
+	   Those whose bounding box is too large compared to their area are
+	   queued, largest boxes first */
+	std::vector<float> maxArea(primCount);
+	std::priority_queue<std::pair<float, IndexType> > queue;
+	for (IndexType i=0; i<primCount; ++i) {
+		const TriangleReference &ref = m_references[i];
+		maxArea[i] = m_splitThreshold * m_meshes[ref.mesh]->surfaceArea(i - m_sizeMap[ref.mesh]);
+		float area = ref.bbox.getSurfaceArea();
+		if (area > maxArea[i] && maxArea[i] > 0)
+			queue.push(std::make_pair(area, i));
+	}
+
+	if (queue.empty())
+		return;
+
+	SizeType candidates = (SizeType) queue.size();
+	while (!queue.empty() && m_references.size() < maxReferences) {
+		IndexType refIndex = queue.top().second;
+		queue.pop();
+
+		/* Split the bounding box in half and clip the triangle to both sides */
+		TriangleReference ref = m_references[refIndex];
+		int axis = ref.bbox.getMajorAxis();
+		float split = 0.5f * (ref.bbox.min[axis] + ref.bbox.max[axis]);
+		BoundingBox3f leftClip(ref.bbox), rightClip(ref.bbox);
+		leftClip.max[axis] = split;
+		rightClip.min[axis] = split;
+
+		IndexType primIndex = ref.index - m_sizeMap[ref.mesh];
+		const Mesh *mesh = m_meshes[ref.mesh];
+		BoundingBox3f left = mesh->getClippedBoundingBox(primIndex, leftClip),
+		              right = mesh->getClippedBoundingBox(primIndex, rightClip);
+
+		/* Leave the reference alone when running out of precision */
+		if (!left.isValid() || !right.isValid())
+			continue;
+
+		m_references[refIndex].bbox = left;
+		TriangleReference newRef;
+		newRef.bbox = right;
+		newRef.index = ref.index;
+		newRef.mesh = ref.mesh;
+		m_references.push_back(newRef);
+
+		float leftArea = left.getSurfaceArea(), rightArea = right.getSurfaceArea();
+		if (leftArea > maxArea[ref.index])
+			queue.push(std::make_pair(leftArea, refIndex));
+		if (rightArea > maxArea[ref.index])
+			queue.push(std::make_pair(rightArea, (IndexType) (m_references.size() - 1)));
+	}
+
+	cout << "Early split clipping: " << candidates << " triangles exceed the threshold, "
+		 << m_references.size() - primCount << " references were added (took "
+		 << timer.elapsed() << " ms)" << endl;
+}
+
+void KDTree::remapReferences() {
+	std::vector<IndexType> indices, leafIndices;
+	indices.reserve(m_indexCount);
+
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		KDNode &node = m_nodes[i];
+		if (!node.isLeaf())
+			continue;
+
+		leafIndices.clear();
+		for (IndexType entry=node.getPrimStart(); entry != node.getPrimEnd(); ++entry)
+			leafIndices.push_back(m_references[m_indices[entry]].index);
+		std::sort(leafIndices.begin(), leafIndices.end());
+		leafIndices.erase(std::unique(leafIndices.begin(), leafIndices.end()), leafIndices.end());
+
+		node.initLeafNode((unsigned int) indices.size(), (unsigned int) leafIndices.size());
+		indices.insert(indices.end(), leafIndices.begin(), leafIndices.end());
+	}
+
+	cout << "Removed " << m_indexCount - indices.size() << " duplicate triangle "
+		 "references from the leaves" << endl;
+
+	freeLarge(m_indices);
+	m_indexCount = (SizeType) indices.size();
+	m_indices = static_cast<IndexType *>(allocLarge(sizeof(IndexType)
+		* std::max(m_indexCount, (SizeType) 1)));
+	if (m_indexCount > 0)
+		memcpy(m_indices, &indices[0], sizeof(IndexType) * m_indexCount);
+	std::vector<TriangleReference>().swap(m_references);
+}
+
+void KDTree::clear() {
+	if (m_cacheData) {
+		unmapCache();
+	} else {
+		if (m_nodes)
+			freeLarge(m_nodes-1); // undo alignment shift
+		if (m_indices)
+			freeLarge(m_indices);
+		m_nodes = NULL;
+		m_indices = NULL;
+	}
+	if (m_triAccel)
+		freeLarge(m_triAccel);
+	if (m_triAccelOffset)
+		delete[] m_triAccelOffset;
+	m_triAccel = NULL;
+	m_triAccelOffset = NULL;
+	m_triAccelCount = 0;
+}
+
+size_t KDTree::getMemoryUsage() const {
+	if (!isBuilt() || getPrimitiveCount() == 0)
+		return 0;
+	size_t result = (m_nodeCount + 1) * sizeof(KDNode) 
+		+ m_indexCount * sizeof(IndexType);
+	if (m_triAccel)
+		result += m_triAccelCount * sizeof(TriAccel4)
+			+ (m_indexCount + 1) * sizeof(IndexType);
+	result += m_shortRayCells.size() * sizeof(uint32_t);
+	return result;
+}
+
+void KDTree::reportMemory(MemoryReport &report) const {
+	if (!isBuilt() || getPrimitiveCount() == 0)
+		return;
+	size_t nodes = (m_nodeCount + 1) * sizeof(KDNode),
+	       indices = m_indexCount * sizeof(IndexType);
+	if (m_cacheData) {
+		report.add("kdNodes", 0, nodes);
+		report.add("kdIndices", 0, indices);
+	} else {
+		report.add("kdNodes", nodes);
+		report.add("kdIndices", indices);
+	}
+	/* Only used while building (hence usually empty) */
+	report.add("kdIndirections", m_indirections.capacity() * sizeof(KDNode *));
+	if (m_triAccel)
+		report.add("kdTriangles", m_triAccelCount * sizeof(TriAccel4)
+			+ (m_indexCount + 1) * sizeof(IndexType));
+	if (!m_shortRayCells.empty())
+		report.add("kdShortRayGrid", m_shortRayCells.size() * sizeof(uint32_t));
+}
+
+void KDTree::precomputeTriangles() {
+	/* Assign a contiguous range of blocks to each nonempty leaf */
+	m_triAccelOffset = new IndexType[m_indexCount + 1];
+	SizeType blockCount = 0;
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		const KDNode &node = m_nodes[i];
+		if (!node.isLeaf() || node.getPrimStart() == node.getPrimEnd())
+			continue;
+		m_triAccelOffset[node.getPrimStart()] = blockCount;
+		blockCount += (node.getPrimEnd() - node.getPrimStart() + 3) / 4;
+	}
+
+	m_triAccel = static_cast<TriAccel4 *>(allocLarge(sizeof(TriAccel4) * blockCount));
+	m_triAccelCount = blockCount;
+
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		const KDNode &node = m_nodes[i];
+		if (!node.isLeaf() || node.getPrimStart() == node.getPrimEnd())
+			continue;
+
+		TriAccel4 *block = m_triAccel + m_triAccelOffset[node.getPrimStart()];
+		int lane = 0;
+		for (IndexType entry=node.getPrimStart(); entry != node.getPrimEnd(); ++entry) {
+			IndexType primIndex = m_indices[entry];
+			IndexType meshIndex = findMesh(primIndex);
+			const Mesh *mesh = m_meshes[meshIndex];
+			const uint32_t *indices = mesh->getIndices() + 3*primIndex;
+			const Point3f *positions = mesh->getVertexPositions();
+			block->set(lane, positions[indices[0]], positions[indices[1]],
+				positions[indices[2]], meshIndex, primIndex);
+
+			if (++lane == 4) {
+				lane = 0;
+				++block;
+			}
+		}
+
+		/* Mark the remaining entries of the last block as unused */
+		for (; lane > 0 && lane < 4; ++lane)
+			block->clear(lane);
+	}
+
+	cout << "Precomputed triangle data requires " 
+		 << (blockCount * sizeof(TriAccel4)) / 1024 << " KiB of memory" << endl;
+}
+
+inline int KDTree::alphaTest(const TriAccel4 &block, int hits, const float *u,
+		const float *v, const Ray3f &ray, bool shadowRay) const {
+	for (int i=0; i<4; ++i) {
+		if ((hits & (1 << i)) && !m_meshes[block.mesh[i]]->alphaTest(
+				block.prim[i], u[i], v[i], ray, shadowRay))
+			hits &= ~(1 << i);
+	}
+	return hits;
+}
+
+template <bool ShadowRay> bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed *seed) const {
 	/// KD-tree traversal stack
 	struct {
 		/* Pointer to the far child */
@@ -56,6 +969,7 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		Point3f p;
 	} stack[NORI_KD_MAXDEPTH];
 
+	NORI_STATS_QUERY();
 	its.t = std::numeric_limits<float>::infinity();
 
 	/* Use an adaptive ray epsilon */
@@ -64,14 +978,10 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
 
 	float bboxMinT, bboxMaxT;
-	if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT))
-		return false;
-
-	mint = std::max(mint, bboxMinT);
-	maxt = std::min(maxt, bboxMaxT);
-
-	if (maxt < mint)
+	if (!m_bbox.rayIntersect(ray, mint, maxt, bboxMinT, bboxMaxT))
 		return false;
+	mint = bboxMinT;
+	maxt = bboxMaxT;
 
 	/* Set up the entry point */
 	uint32_t enPt = 0;
@@ -84,11 +994,56 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 	stack[exPt].p = ray(maxt);
 	stack[exPt].node = NULL;
 
+	const KDNode * __restrict currNode = m_nodes;
+
+	/* Camera ray that enters the tree strictly inside the leaf of the seed:
+	   every node along the path to it takes the child of the origin, so 
+	   only the nodes that the ray may cross need to be considered (the
+	   same cases as below, where the entry point is on the near side) */
+	if (seed && ray.o == seed->origin) {
+		const Point3f &enP = stack[enPt].p;
+		bool inside = true;
+		for (int i=0; i<3; ++i)
+			inside &= enP[i] > seed->region.min[i] && enP[i] < seed->region.max[i];
+		if (inside) {
+			for (size_t i=0; i+1<seed->nodes.size(); ++i) {
+				const KDNode * __restrict node = m_nodes + seed->nodes[i];
+				const float splitVal = (float) node->getSplit();
+				const int axis = node->getAxis();
+				const KDNode * __restrict farChild;
+				if (seed->origin[axis] < splitVal) {
+					/* Case N4 (or N1, N2, N3) */
+					if (stack[exPt].p[axis] <= splitVal)
+						continue;
+					farChild = node->getRight();
+				} else {
+					/* Case P4 (or P1, P2, P3) */
+					if (splitVal < stack[exPt].p[axis])
+						continue;
+					farChild = node->getLeft();
+				}
+
+				float distToSplit = (splitVal - ray.o[axis]) * ray.dRcp[axis];
+				const uint32_t tmp = exPt++;
+				if (exPt == enPt)
+					++exPt;
+				stack[exPt].prev = tmp;
+				stack[exPt].t = distToSplit;
+				stack[exPt].node = farChild;
+				stack[exPt].p = ray(distToSplit);
+				stack[exPt].p[axis] = splitVal;
+			}
+			currNode = m_nodes + seed->nodes.back();
+		}
+	}
+
 	bool foundIntersection = false;
 	uint32_t foundPrimIndex = 0;
-	const KDNode * __restrict currNode = m_nodes;
+	Mailbox mailbox;
+	const bool mailboxing = m_mailboxing, alphaMasks = m_alphaMasks;
 	while (currNode != NULL) {
 		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			NORI_STATS_ADD(nodes, 1);
 			const float splitVal = (float) currNode->getSplit();
 			const int axis = currNode->getAxis();
 			const KDNode * __restrict farChild;
@@ -139,24 +1094,71 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		}
 
 		/* Reached a leaf node */
-		for (IndexType entry=currNode->getPrimStart(),
-				last = currNode->getPrimEnd(); entry != last; entry++) {
-			IndexType primIndex = m_indices[entry];
-			IndexType meshIndex = findMesh(primIndex);
-			const Mesh *mesh = m_meshes[meshIndex];
+		NORI_STATS_ADD(leaves, 1);
+		if (m_triAccel) {
+			IndexType primStart = currNode->getPrimStart(),
+			          primEnd = currNode->getPrimEnd();
+			if (primStart != primEnd) {
+				const TriAccel4 *block = m_triAccel + m_triAccelOffset[primStart],
+				                *last = block + (primEnd - primStart + 3) / 4;
+				for (; block != last; ++block) {
+					if (mailboxing) {
+						if (mailbox.containsAll(*block))
+							continue;
+						mailbox.insertAll(*block);
+					}
+					NORI_STATS_ADD(triangles, 4);
+					float u[4], v[4], t[4];
+					int hits = block->rayIntersect(ray, mint, maxt, u, v, t);
+					if (hits && alphaMasks)
+						hits = alphaTest(*block, hits, u, v, ray, ShadowRay);
+					if (!hits)
+						continue;
+					if (ShadowRay) {
+						NORI_STATS_ADD(hits, 1);
+						return true;
+					}
+					for (int i=0; i<4; ++i) {
+						if ((hits & (1 << i)) && t[i] <= maxt) {
+							maxt = t[i];
+							its.t = t[i];
+							its.bary = Point2f(u[i], v[i]);
+							its.mesh = m_meshes[block->mesh[i]];
+							foundPrimIndex = block->prim[i];
+							foundIntersection = true;
+						}
+					}
+				}
+			}
+		} else {
+			for (IndexType entry=currNode->getPrimStart(),
+					last = currNode->getPrimEnd(); entry != last; entry++) {
+				IndexType primIndex = m_indices[entry];
+				if (mailboxing) {
+					if (mailbox.contains(primIndex))
+						continue;
+					mailbox.insert(primIndex);
+				}
+				IndexType meshIndex = findMesh(primIndex);
+				const Mesh *mesh = m_meshes[meshIndex];
+				NORI_STATS_ADD(triangles, 1);
 
-			float u, v, t;
-			bool success = mesh->rayIntersect(primIndex, ray, u, v, t);
+				float u, v, t;
+				bool success = mesh->rayIntersect(primIndex, ray, u, v, t);
 
-			if (success && t >= mint && t <= maxt) {
-				if (shadowRay)
-					return true;
-				maxt = t;
-				its.t = t;
-				its.uv = Point2f(u, v);
-				its.mesh = mesh;
-				foundPrimIndex = primIndex;
-				foundIntersection = true;
+				if (success && t >= mint && t <= maxt
+						&& mesh->alphaTest(primIndex, u, v, ray, ShadowRay)) {
+					if (ShadowRay) {
+						NORI_STATS_ADD(hits, 1);
+						return true;
+					}
+					maxt = t;
+					its.t = t;
+					its.bary = Point2f(u, v);
+					its.mesh = mesh;
+					foundPrimIndex = primIndex;
+					foundIntersection = true;
+				}
 			}
 		}
 
@@ -169,56 +1171,505 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		exPt = stack[enPt].prev;
 	}
 
-	if (foundIntersection && !shadowRay) {
-		/* Find the barycentric coordinates */
-		Vector3f bary;
-		bary << 1-its.uv.sum(), its.uv;
-
-		/* Look up the vertex indices */
-		const Mesh *mesh = its.mesh;
-		const uint32_t *indices = mesh->getIndices(),
-				  idx0 = indices[3*foundPrimIndex+0],
-				  idx1 = indices[3*foundPrimIndex+1],
-				  idx2 = indices[3*foundPrimIndex+2];
-
-		const Point3f  *positions = mesh->getVertexPositions();
-		const Normal3f *normals   = mesh->getVertexNormals();
-		const Point2f  *texCoords = mesh->getVertexTexCoords();
-
-		Point3f p0 = positions[idx0],
-			p1 = positions[idx1],
-			p2 = positions[idx2];
-
-		/* Compute the intersection positon accurately 
-		   using barycentric coordinates */
-		its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-		/* Compute proper texture coordinates if provided by the mesh */
-		if (texCoords) 
-			its.uv = bary.x() * texCoords[idx0] +
-				bary.y() * texCoords[idx1] +
-				bary.z() * texCoords[idx2];
-
-		/* Compute the geometry frame */
-		its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-		if (normals) {
-			/* Compute the shading frame. Note that for simplicity,
-			   the current implementation doesn't attempt to provide
-			   tangents that are continuous across the surface. That
-			   means that this code will need to be modified to be able
-			   use anisotropic BRDFs, which need tangent continuity */
-
-			its.shFrame = Frame(
-				(bary.x() * normals[idx0] +
-				 bary.y() * normals[idx1] +
-				 bary.z() * normals[idx2]).normalized());
+	if (foundIntersection && !ShadowRay)
+		fillIntersectionRecord(foundPrimIndex, its);
+
+	NORI_STATS_ADD(hits, foundIntersection ? 1 : 0);
+	return foundIntersection;
+}
+
+bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	return shadowRay ? rayIntersect<true>(ray, its) : rayIntersect<false>(ray, its);
+}
+
+bool KDTree::prepareCameraRays(const Point3f &origin, const Vector3f *corners,
+		CameraRaySeed &seed) const {
+	seed.accel = NULL;
+	seed.nodes.clear();
+	if (!m_nodes || !m_bbox.contains(origin))
+		return false;
+
+	BoundingBox3f region(m_bbox);
+	const KDNode *node = m_nodes;
+	while (!node->isLeaf()) {
+		const float splitVal = (float) node->getSplit();
+		const int axis = node->getAxis();
+		/* The near child of an origin on the plane depends on the ray */
+		if (origin[axis] == splitVal)
+			return false;
+		bool left = origin[axis] < splitVal, crosses = false;
+		for (int i=0; i<4; ++i)
+			crosses |= left ? corners[i][axis] > 0 : corners[i][axis] < 0;
+		if (crosses)
+			seed.nodes.push_back((uint32_t) (node - m_nodes));
+		if (left) {
+			region.max[axis] = splitVal;
+			node = node->getLeft();
 		} else {
-			its.shFrame = its.geoFrame;
+			region.min[axis] = splitVal;
+			node = node->getRight();
 		}
 	}
+	seed.nodes.push_back((uint32_t) (node - m_nodes));
+	seed.origin = origin;
+	seed.region = region;
+	seed.accel = this;
+	return true;
+}
 
-	return foundIntersection;
+bool KDTree::rayIntersectSeeded(const Ray3f &ray, Intersection &its,
+		const CameraRaySeed &seed) const {
+	return rayIntersect<false>(ray, its, seed.accel == this ? &seed : NULL);
+}
+
+bool KDTree::rayOccluded(const Ray3f &ray) const {
+	/// Traversal stack: far children along with the ray segment that overlaps them
+	struct {
+		const KDNode * __restrict node;
+		float mint, maxt;
+	} stack[NORI_KD_MAXDEPTH];
+
+	const IndexType invalid = std::numeric_limits<IndexType>::max();
+	NORI_STATS_QUERY();
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon) 
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	/* Short queries that start within the grid only traverse the subtree
+	   of their cell, which contains the entire ray segment */
+	const KDNode * __restrict startNode = m_nodes;
+	if (!m_shortRayCells.empty() && maxt * maxt * ray.d.squaredNorm() <= m_shortRayMaxLength2
+			&& m_bbox.contains(ray.o)) {
+		Vector3i cell;
+		for (int i=0; i<3; ++i)
+			cell[i] = std::min((int) ((ray.o[i] - m_bbox.min[i]) * m_shortRayScale[i]),
+				m_shortRayCellCount[i] - 1);
+		startNode = m_nodes + m_shortRayCells[cell.x() + m_shortRayCellCount.x()
+			* (cell.y() + m_shortRayCellCount.y() * (size_t) cell.z())];
+		if (startNode->isLeaf() && startNode->getPrimStart() == startNode->getPrimEnd())
+			return false;
+	}
+
+	/* First, try the triangles that blocked this thread's previous query */
+	if (EXPECT_NOT_TAKEN(!m_lastOccluder.hasLocalData()))
+		m_lastOccluder.setLocalData(new IndexType(invalid));
+	IndexType &lastOccluder = *m_lastOccluder.localData();
+
+	if (lastOccluder != invalid) {
+		/* The cached index may be stale if the tree was rebuilt in the meantime */
+		NORI_STATS_ADD(triangles, m_triAccel ? 4 : 1);
+		if (m_triAccel) {
+			float u[4], v[4], t[4];
+			int hits = lastOccluder < m_triAccelCount ?
+				m_triAccel[lastOccluder].rayIntersect(ray, mint, maxt, u, v, t) : 0;
+			if (hits && m_alphaMasks)
+				hits = alphaTest(m_triAccel[lastOccluder], hits, u, v, ray, true);
+			if (hits) {
+				NORI_STATS_ADD(hits, 1);
+				return true;
+			}
+		} else if (lastOccluder < getPrimitiveCount()) {
+			IndexType primIndex = lastOccluder;
+			const Mesh *mesh = m_meshes[findMesh(primIndex)];
+			float u, v, t;
+			if (mesh->rayIntersect(primIndex, ray, u, v, t) && t >= mint && t <= maxt
+					&& mesh->alphaTest(primIndex, u, v, ray, true)) {
+				NORI_STATS_ADD(hits, 1);
+				return true;
+			}
+		}
+	}
+
+	float nodeMinT = mint, nodeMaxT = maxt;
+	if (startNode == m_nodes && !m_bbox.rayIntersect(ray, mint, maxt, nodeMinT, nodeMaxT))
+		return false;
+
+	const int dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+	uint32_t stackPos = 0;
+	Mailbox mailbox;
+	const bool mailboxing = m_mailboxing, alphaMasks = m_alphaMasks;
+	const KDNode * __restrict currNode = startNode;
+
+	while (true) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			NORI_STATS_ADD(nodes, 1);
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			const float distToSplit = (splitVal - ray.o[axis]) * ray.dRcp[axis];
+
+			/* Children are ordered by the sign of the ray direction. A NaN
+			   distance (the origin lies on a plane that is parallel to the
+			   ray) makes both comparisons fail and visits both children */
+			const KDNode * __restrict nearChild = currNode->getLeft() + dirIsNeg[axis], 
+			             * __restrict farChild = currNode->getLeft() + (1 - dirIsNeg[axis]);
+
+			if (distToSplit >= nodeMaxT) {
+				currNode = nearChild;
+			} else if (distToSplit <= nodeMinT) {
+				currNode = farChild;
+			} else {
+				stack[stackPos].node = farChild;
+				stack[stackPos].mint = distToSplit;
+				stack[stackPos].maxt = nodeMaxT;
+				++stackPos;
+				currNode = nearChild;
+				nodeMaxT = distToSplit;
+			}
+		}
+
+		/* Reached a leaf node -- accept any hit along the entire ray segment */
+		NORI_STATS_ADD(leaves, 1);
+		if (m_triAccel) {
+			IndexType primStart = currNode->getPrimStart(),
+			          primEnd = currNode->getPrimEnd();
+			if (primStart != primEnd) {
+				IndexType first = m_triAccelOffset[primStart],
+				          last = first + (primEnd - primStart + 3) / 4;
+				for (IndexType block = first; block != last; ++block) {
+					if (mailboxing) {
+						if (mailbox.containsAll(m_triAccel[block]))
+							continue;
+						mailbox.insertAll(m_triAccel[block]);
+					}
+					NORI_STATS_ADD(triangles, 4);
+					float u[4], v[4], t[4];
+					int hits = m_triAccel[block].rayIntersect(ray, mint, maxt, u, v, t);
+					if (hits && alphaMasks)
+						hits = alphaTest(m_triAccel[block], hits, u, v, ray, true);
+					if (hits) {
+						lastOccluder = block;
+						NORI_STATS_ADD(hits, 1);
+						return true;
+					}
+				}
+			}
+		} else {
+			for (IndexType entry=currNode->getPrimStart(),
+					last = currNode->getPrimEnd(); entry != last; entry++) {
+				IndexType primIndex = m_indices[entry], localIndex = primIndex;
+				if (mailboxing) {
+					if (mailbox.contains(primIndex))
+						continue;
+					mailbox.insert(primIndex);
+				}
+				const Mesh *mesh = m_meshes[findMesh(localIndex)];
+				NORI_STATS_ADD(triangles, 1);
+
+				float u, v, t;
+				if (mesh->rayIntersect(localIndex, ray, u, v, t) && t >= mint && t <= maxt
+						&& mesh->alphaTest(localIndex, u, v, ray, true)) {
+					lastOccluder = primIndex;
+					NORI_STATS_ADD(hits, 1);
+					return true;
+				}
+			}
+		}
+
+		if (stackPos == 0)
+			return false;
+
+		--stackPos;
+		currNode = stack[stackPos].node;
+		nodeMinT = stack[stackPos].mint;
+		nodeMaxT = stack[stackPos].maxt;
+	}
+}
+
+bool KDTree::collectTraversalStatistics(TraversalStatistics &stats) const {
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	stats = TraversalStatistics();
+	if (m_statistics.hasLocalData()) {
+		stats = *m_statistics.localData();
+		*m_statistics.localData() = TraversalStatistics();
+	}
+	return true;
+#else
+	return Accelerator::collectTraversalStatistics(stats);
+#endif
+}
+
+#if defined(NORI_SSE)
+/// Intersect a triangle against four rays that are stored in SoA layout
+static inline __m128 rayIntersectTriangle4(const Point3f &p0, const Vector3f &e1,
+		const Vector3f &e2, const __m128 *o, const __m128 *d,
+		__m128 &u, __m128 &v, __m128 &t) {
+	const __m128
+		e1x = _mm_set1_ps(e1.x()), e1y = _mm_set1_ps(e1.y()), e1z = _mm_set1_ps(e1.z()),
+		e2x = _mm_set1_ps(e2.x()), e2y = _mm_set1_ps(e2.y()), e2z = _mm_set1_ps(e2.z());
+
+	/* pvec = d x edge2 */
+	const __m128
+		px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(d[2], e2y)),
+		py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(d[0], e2z)),
+		pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(d[1], e2x));
+
+	/* det = edge1 . pvec */
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px),
+		_mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	const __m128 degenerate = _mm_and_ps(
+		_mm_cmpgt_ps(det, _mm_set1_ps(-1e-8f)),
+		_mm_cmplt_ps(det, _mm_set1_ps(1e-8f)));
+	const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	/* tvec = o - p0 */
+	const __m128
+		tx = _mm_sub_ps(o[0], _mm_set1_ps(p0.x())),
+		ty = _mm_sub_ps(o[1], _mm_set1_ps(p0.y())),
+		tz = _mm_sub_ps(o[2], _mm_set1_ps(p0.z()));
+
+	u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px),
+		_mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+	/* qvec = tvec x edge1 */
+	const __m128
+		qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y)),
+		qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z)),
+		qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+	v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx),
+		_mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), invDet);
+
+	t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx),
+		_mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 mask = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	return _mm_andnot_ps(degenerate, mask);
+}
+#endif
+
+int KDTree::rayIntersectPacket(const Ray3f *rays, Intersection *its, bool shadowRay) const {
+#if defined(NORI_SSE)
+	/* The packet traversal doesn't filter hits by alpha masks */
+	if (m_alphaMasks)
+		return Accelerator::rayIntersectPacket(rays, its, shadowRay);
+
+	/* SoA copies of the ray origins, directions and reciprocals */
+	__m128 o[3], d[3], dRcp[3];
+	float mint[NORI_PACKET_SIZE], maxt[NORI_PACKET_SIZE];
+	int valid = 0, signs[3] = { 0, 0, 0 };
+
+	for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+		const Ray3f &ray = rays[i];
+		its[i].t = std::numeric_limits<float>::infinity();
+
+		/* Use an adaptive ray epsilon (same as in rayIntersect()) */
+		mint[i] = ray.mint; maxt[i] = ray.maxt;
+		if (mint[i] == Epsilon)
+			mint[i] = std::max(mint[i], mint[i] * ray.o.array().abs().maxCoeff());
+
+		float bboxMinT, bboxMaxT;
+		if (m_bbox.rayIntersect(ray, mint[i], maxt[i], bboxMinT, bboxMaxT)) {
+			mint[i] = bboxMinT;
+			maxt[i] = bboxMaxT;
+		} else {
+			maxt[i] = -std::numeric_limits<float>::infinity();
+		}
+
+		if (mint[i] <= maxt[i]) {
+			valid |= 1 << i;
+			for (int axis=0; axis<3; ++axis)
+				signs[axis] |= (ray.dRcp[axis] < 0 ? 2 : 1);
+		} else {
+			/* Make sure that this ray never registers a hit */
+			mint[i] = std::numeric_limits<float>::infinity();
+			maxt[i] = -std::numeric_limits<float>::infinity();
+		}
+	}
+
+	if (valid == 0)
+		return 0;
+
+	if (signs[0] == 3 || signs[1] == 3 || signs[2] == 3) {
+		/* The ray directions disagree, which prevents a shared
+		   front-to-back traversal order. Trace the rays separately */
+		int result = 0;
+		for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+			if ((valid & (1 << i)) && rayIntersect(rays[i], its[i], shadowRay))
+				result |= 1 << i;
+		}
+		return result;
+	}
+
+	for (int axis=0; axis<3; ++axis) {
+		o[axis]    = _mm_setr_ps(rays[0].o[axis],    rays[1].o[axis],    rays[2].o[axis],    rays[3].o[axis]);
+		d[axis]    = _mm_setr_ps(rays[0].d[axis],    rays[1].d[axis],    rays[2].d[axis],    rays[3].d[axis]);
+		dRcp[axis] = _mm_setr_ps(rays[0].dRcp[axis], rays[1].dRcp[axis], rays[2].dRcp[axis], rays[3].dRcp[axis]);
+	}
+
+	/// Shared kd-tree traversal stack
+	struct {
+		/* Pointer to the farT child */
+		const KDNode * __restrict node;
+		/* Per-ray entry and exit distances */
+		__m128 nearT, farT;
+	} stack[NORI_KD_MAXDEPTH];
+	int stackPos = 0;
+
+	const __m128 rayMinT = _mm_loadu_ps(mint);
+	__m128 nearT = rayMinT, farT = _mm_loadu_ps(maxt);
+
+	/* Distance to the closest intersection found so farT */
+	__m128 hitT = farT;
+
+	/* Per-ray barycentric coordinates and primitive of the closest hit */
+	float hitU[NORI_PACKET_SIZE], hitV[NORI_PACKET_SIZE];
+	uint32_t hitPrim[NORI_PACKET_SIZE];
+	const Mesh *hitMesh[NORI_PACKET_SIZE] = { NULL, NULL, NULL, NULL };
+	int result = 0;
+
+	const KDNode * __restrict currNode = m_nodes;
+	while (true) {
+		/* Bit mask of the rays that overlap the current node */
+		int active = _mm_movemask_ps(_mm_cmple_ps(nearT, farT));
+
+		if (active) {
+			while (EXPECT_TAKEN(!currNode->isLeaf())) {
+				const __m128 splitVal = _mm_set1_ps(currNode->getSplit());
+				const int axis = currNode->getAxis();
+
+				/* Distance to the split plane for each ray */
+				const __m128 distToSplit = _mm_mul_ps(
+					_mm_sub_ps(splitVal, o[axis]), dRcp[axis]);
+
+				/* The rays either all travel along the positive or
+				   the negative axis direction, which determines the
+				   order in which the children are encountered */
+				const KDNode * __restrict first = currNode->getLeft(),
+				             * __restrict second = first + 1;
+				if (signs[axis] == 2)
+					std::swap(first, second);
+
+				const int
+					onlySecond = _mm_movemask_ps(_mm_cmplt_ps(distToSplit, nearT)) & active,
+					onlyFirst = _mm_movemask_ps(_mm_cmpgt_ps(distToSplit, farT)) & active;
+
+				if (onlySecond == active) {
+					currNode = second;
+				} else if (onlyFirst == active) {
+					currNode = first;
+				} else {
+					/* The packet straddles the split plane: visit both children.
+					   NaN distances (rays lying within the plane) conservatively
+					   retain their full interval for both children */
+					stack[stackPos].node = second;
+					stack[stackPos].nearT = _mm_max_ps(distToSplit, nearT);
+					stack[stackPos].farT = farT;
+					++stackPos;
+
+					farT = _mm_min_ps(distToSplit, farT);
+					currNode = first;
+					active = _mm_movemask_ps(_mm_cmple_ps(nearT, farT));
+				}
+			}
+
+			/* Reached a leaf node */
+			const IndexType primStart = currNode->getPrimStart();
+			for (IndexType entry=primStart, last = currNode->getPrimEnd();
+					entry != last; entry++) {
+				IndexType primIndex;
+				const Mesh *mesh;
+				Point3f p0;
+				Vector3f e1, e2;
+
+				if (m_triAccel) {
+					/* Fetch the triangle from the precomputed leaf blocks */
+					const TriAccel4 &block = m_triAccel[m_triAccelOffset[primStart]
+						+ (entry - primStart) / 4];
+					const int lane = (entry - primStart) % 4;
+					p0 = Point3f(block.p0[0][lane], block.p0[1][lane], block.p0[2][lane]);
+					e1 = Vector3f(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+					e2 = Vector3f(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+					primIndex = block.prim[lane];
+					mesh = m_meshes[block.mesh[lane]];
+				} else {
+					primIndex = m_indices[entry];
+					mesh = m_meshes[findMesh(primIndex)];
+					const PackedTriangle *packed = mesh->getPackedTriangles();
+					if (packed) {
+						const PackedTriangle &tri = packed[primIndex];
+						p0 = Point3f(tri.p0[0], tri.p0[1], tri.p0[2]);
+						e1 = Vector3f(tri.e1[0], tri.e1[1], tri.e1[2]);
+						e2 = Vector3f(tri.e2[0], tri.e2[1], tri.e2[2]);
+					} else {
+						const uint32_t *indices = mesh->getIndices() + 3*primIndex;
+						const Point3f *positions = mesh->getVertexPositions();
+						p0 = positions[indices[0]];
+						e1 = positions[indices[1]] - p0;
+						e2 = positions[indices[2]] - p0;
+					}
+				}
+
+				__m128 u, v, t;
+				__m128 mask = rayIntersectTriangle4(p0, e1, e2, o, d, u, v, t);
+				mask = _mm_and_ps(mask, _mm_and_ps(
+					_mm_cmpge_ps(t, rayMinT), _mm_cmple_ps(t, hitT)));
+
+				int hits = _mm_movemask_ps(mask);
+				if (!hits)
+					continue;
+
+				result |= hits;
+				if (shadowRay) {
+					/* Any hit will do -- disable the affected rays */
+					hitT = _mm_or_ps(_mm_andnot_ps(mask, hitT), _mm_and_ps(mask,
+						_mm_set1_ps(-std::numeric_limits<float>::infinity())));
+					if (result == valid)
+						return result;
+					continue;
+				}
+
+				hitT = _mm_or_ps(_mm_andnot_ps(mask, hitT), _mm_and_ps(mask, t));
+
+				float tu[NORI_PACKET_SIZE], tv[NORI_PACKET_SIZE];
+				_mm_storeu_ps(tu, u);
+				_mm_storeu_ps(tv, v);
+				for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+					if (hits & (1 << i)) {
+						hitU[i] = tu[i]; hitV[i] = tv[i];
+						hitPrim[i] = primIndex;
+						hitMesh[i] = mesh;
+					}
+				}
+			}
+		}
+
+		/* Pop from the stack and continue with the next node, while
+		   ignoring rays whose closest hit precedes the node interval */
+		if (stackPos == 0)
+			break;
+		--stackPos;
+		currNode = stack[stackPos].node;
+		nearT = stack[stackPos].nearT;
+		farT = _mm_min_ps(stack[stackPos].farT, hitT);
+	}
+
+	if (!shadowRay) {
+		float t[NORI_PACKET_SIZE];
+		_mm_storeu_ps(t, hitT);
+		for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+			if (!(result & (1 << i)))
+				continue;
+			its[i].t = t[i];
+			its[i].bary = Point2f(hitU[i], hitV[i]);
+			its[i].mesh = hitMesh[i];
+			fillIntersectionRecord(hitPrim[i], its[i]);
+		}
+	}
+
+	return result;
+#else
+	int result = 0;
+	for (int i=0; i<NORI_PACKET_SIZE; ++i) {
+		if (rayIntersect(rays[i], its[i], shadowRay))
+			result |= 1 << i;
+	}
+	return result;
+#endif
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,248 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lightbvh.h>
+#include <nori/mesh.h>
+#include <nori/luminaire.h>
+#include <Eigen/Geometry>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/// Angle between two unit vectors
+static inline float angleBetween(const Vector3f &a, const Vector3f &b) {
+	return std::acos(std::min(std::max(a.dot(b), -1.0f), 1.0f));
+}
+
+/// Enlarge a normal cone so that it also bounds another one
+static void coneUnion(Vector3f &axis, float &thetaO, const Vector3f &axis2, float thetaO2) {
+	float theta = angleBetween(axis, axis2);
+	if (theta + thetaO2 <= thetaO)
+		return;
+	if (theta + thetaO <= thetaO2) {
+		axis = axis2;
+		thetaO = thetaO2;
+		return;
+	}
+
+	/* Bisect the axes; opposite axes need the whole sphere */
+	Vector3f sum = axis + axis2;
+	if (sum.squaredNorm() < 1e-8f) {
+		thetaO = (float) M_PI;
+		return;
+	}
+	Vector3f mid = sum.normalized();
+	thetaO = std::min((float) M_PI, std::max(angleBetween(mid, axis) + thetaO,
+		angleBetween(mid, axis2) + thetaO2));
+	axis = mid;
+}
+
+LightBVH::LightBVH(const std::vector<const Mesh *> &meshes) {
+	std::vector<BuildItem> items;
+	for (size_t i=0; i<meshes.size(); ++i) {
+		const Mesh *mesh = meshes[i];
+		const Luminaire *luminaire = mesh->getLuminaire();
+		const EmitterTriangle *triangles = mesh->getEmitterTriangles();
+		float area = mesh->surfaceArea();
+		if (!luminaire || !triangles || area <= 0)
+			continue;
+
+		/* Constant radiance: the power of a triangle is proportional to its area */
+		float powerPerArea = luminaire->getPower() / area;
+		m_offsets[luminaire] = (uint32_t) m_leaves.size();
+		m_leaves.resize(m_leaves.size() + mesh->getTriangleCount(), (uint32_t) -1);
+
+		for (uint32_t j=0; j<mesh->getTriangleCount(); ++j) {
+			const EmitterTriangle &tri = triangles[j];
+			if (tri.area * powerPerArea <= 0)
+				continue;
+
+			BuildItem item;
+			Point3f p0(tri.p0[0], tri.p0[1], tri.p0[2]);
+			Vector3f e1(tri.e1[0], tri.e1[1], tri.e1[2]),
+			         e2(tri.e2[0], tri.e2[1], tri.e2[2]);
+			item.bbox = BoundingBox3f(p0);
+			item.bbox.expandBy(p0 + e1);
+			item.bbox.expandBy(p0 + e2);
+			item.centroid = p0 + (e1 + e2) * (1.0f / 3.0f);
+
+			/* Interpolated normals stay within the cone of the vertex normals */
+			Normal3f n[3];
+			Vector3f sum(0.0f);
+			for (int k=0; k<3; ++k) {
+				n[k] = decodeNormal(tri.n[k]);
+				sum += n[k];
+			}
+			item.axis = sum.squaredNorm() > 1e-8f ? sum.normalized()
+				: Vector3f(e1.cross(e2).normalized());
+			item.thetaO = 0.0f;
+			for (int k=0; k<3; ++k)
+				item.thetaO = std::max(item.thetaO, angleBetween(item.axis, n[k]));
+
+			item.power = tri.area * powerPerArea;
+			item.emitter = (uint32_t) m_emitters.size();
+			items.push_back(item);
+
+			Emitter emitter;
+			emitter.luminaire = luminaire;
+			emitter.mesh = mesh;
+			emitter.triangle = j;
+			m_emitters.push_back(emitter);
+		}
+	}
+
+	if (items.empty())
+		return;
+	m_nodes.reserve(2 * items.size() - 1);
+	build(items, 0, items.size(), (uint32_t) -1);
+}
+
+uint32_t LightBVH::build(std::vector<BuildItem> &items, size_t begin, size_t end,
+		uint32_t parent) {
+	uint32_t index = (uint32_t) m_nodes.size();
+	m_nodes.push_back(Node());
+
+	if (end - begin == 1) {
+		const BuildItem &item = items[begin];
+		Node &node = m_nodes[index];
+		node.bbox = item.bbox;
+		node.axis = item.axis;
+		node.thetaO = item.thetaO;
+		node.power = item.power;
+		node.right = 0;
+		node.parent = parent;
+		node.emitter = item.emitter;
+		m_leaves[m_offsets[m_emitters[item.emitter].luminaire]
+			+ m_emitters[item.emitter].triangle] = index;
+		return index;
+	}
+
+	/* Split at the median along the longest axis of the centroid bounds */
+	BoundingBox3f centroids;
+	for (size_t i=begin; i<end; ++i)
+		centroids.expandBy(items[i].centroid);
+	int axis = centroids.getMajorAxis();
+	size_t mid = (begin + end) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + mid,
+		items.begin() + end, CentroidOrder(axis));
+
+	uint32_t left = build(items, begin, mid, index);
+	uint32_t right = build(items, mid, end, index);
+
+	Node &node = m_nodes[index];
+	const Node &l = m_nodes[left], &r = m_nodes[right];
+	node.bbox = l.bbox;
+	node.bbox.expandBy(r.bbox);
+	node.axis = l.axis;
+	node.thetaO = l.thetaO;
+	coneUnion(node.axis, node.thetaO, r.axis, r.thetaO);
+	node.power = l.power + r.power;
+	node.right = right;
+	node.parent = parent;
+	node.emitter = 0;
+	return index;
+}
+
+float LightBVH::importance(const Node &node, const Point3f &ref) const {
+	Vector3f d = ref - node.bbox.getCenter();
+	float distSquared = d.squaredNorm();
+	float radiusSquared = 0.25f * node.bbox.getExtents().squaredNorm();
+
+	/* Inside the bounding sphere, no direction can be excluded */
+	if (distSquared <= radiusSquared)
+		return radiusSquared > 0 ? node.power / radiusSquared : node.power;
+
+	/* Smallest angle between a normal of the cone and a direction
+	   from the bounding sphere towards the reference point */
+	float dist = std::sqrt(distSquared);
+	float theta = angleBetween(node.axis, d / dist);
+	float thetaU = std::asin(std::sqrt(radiusSquared) / dist);
+	float thetaP = std::max(0.0f, theta - node.thetaO - thetaU);
+	if (thetaP >= (float) (M_PI / 2))
+		return 0.0f;
+	return node.power * std::cos(thetaP) / distSquared;
+}
+
+int LightBVH::sample(const Point3f &ref, const Point2f &_sample, Point3f &p,
+		Normal3f &n, float &pdf) const {
+	if (m_nodes.empty())
+		return -1;
+
+	/* Descend, choosing the children proportional to their importance */
+	Point2f sample(_sample);
+	float choicePdf = 1.0f;
+	uint32_t index = 0;
+	while (m_nodes[index].right != 0) {
+		const Node &node = m_nodes[index];
+		float left = importance(m_nodes[index + 1], ref),
+		      right = importance(m_nodes[node.right], ref),
+		      total = left + right;
+		if (total <= 0)
+			return -1;
+
+		float pLeft = left / total;
+		if (sample.x() < pLeft) {
+			sample.x() = std::min(sample.x() / pLeft, OneMinusEpsilon);
+			choicePdf *= pLeft;
+			index = index + 1;
+		} else {
+			sample.x() = std::min((sample.x() - pLeft) / (1.0f - pLeft), OneMinusEpsilon);
+			choicePdf *= right / total;
+			index = node.right;
+		}
+	}
+
+	const Emitter &emitter = m_emitters[m_nodes[index].emitter];
+	emitter.mesh->sampleTrianglePosition(emitter.triangle, sample, p, n);
+	pdf = choicePdf / emitter.mesh->getEmitterTriangles()[emitter.triangle].area;
+	return (int) m_nodes[index].emitter;
+}
+
+float LightBVH::pdf(const Point3f &ref, const Luminaire *luminaire, uint32_t triangle) const {
+	std::map<const Luminaire *, uint32_t>::const_iterator it = m_offsets.find(luminaire);
+	if (it == m_offsets.end() || triangle == (uint32_t) -1
+			|| it->second + (size_t) triangle >= m_leaves.size())
+		return 0.0f;
+	uint32_t index = m_leaves[it->second + triangle];
+	if (index == (uint32_t) -1)
+		return 0.0f;
+	const Emitter &emitter = m_emitters[m_nodes[index].emitter];
+	float pdf = 1.0f / emitter.mesh->getEmitterTriangles()[emitter.triangle].area;
+
+	/* Multiply the probabilities of the decisions on the way from the root */
+	while (m_nodes[index].parent != (uint32_t) -1) {
+		uint32_t parent = m_nodes[index].parent;
+		float left = importance(m_nodes[parent + 1], ref),
+		      right = importance(m_nodes[m_nodes[parent].right], ref),
+		      total = left + right;
+		if (total <= 0)
+			return 0.0f;
+		pdf *= (index == parent + 1 ? left : right) / total;
+		index = parent;
+	}
+	return pdf;
+}
+
+QString LightBVH::toString() const {
+	return QString("LightBVH[emitters = %1, nodes = %2, power = %3]")
+		.arg(m_emitters.size())
+		.arg(m_nodes.size())
+		.arg(getPower());
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,232 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/bsdf.h>
+#include <nori/phase.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Light tracer: traces paths from the luminaires and connects
+ * every vertex to the camera
+ *
+ * Every pixel sample starts one light path (see \ref Scene::sampleEmission()),
+ * whose vertices are connected to a position on the camera's aperture
+ * using \ref Camera::sampleImportance(). The contributions land on
+ * arbitrary pixels and are splatted into a shared image (see
+ * \ref RenderContext::splats), which is added to the output when the
+ * rendering is done. This efficiently renders caustics as seen via
+ * diffuse surfaces, which a path tracer can only find by chance.
+ *
+ * Paths that reach the camera directly from an environment luminaire
+ * can't be sampled this way, hence the camera rays themselves only
+ * account for the visible environment. Surfaces are assumed to have
+ * symmetric BSDFs, and the shading normal correction of the adjoint
+ * BSDF is not applied. Media are handled as in the \c path integrator.
+ */
+class LightTracer : public Integrator {
+public:
+	LightTracer(const PropertyList &propList) {
+		/* Maximum number of path segments including the connection
+		   to the camera (-1 = unlimited) */
+		m_maxDepth = propList.getInteger("maxDepth", -1);
+
+		/* Number of segments after which Russian roulette starts */
+		m_rrDepth = propList.getInteger("rrDepth", 5);
+
+		if (m_maxDepth == 0 || m_maxDepth < -1)
+			throw NoriException(QString("LightTracer: invalid maxDepth %1 (must be "
+				"positive or -1)").arg(m_maxDepth));
+		if (m_rrDepth < 1)
+			throw NoriException(QString("LightTracer: invalid rrDepth %1 (must be >= 1)")
+				.arg(m_rrDepth));
+
+		m_splatting = true;
+	}
+
+	Color3f Li(RenderContext &context, const Ray3f &cameraRay) const {
+		const Scene *scene = context.scene;
+
+		/* The camera ray only sees the environment */
+		Color3f result(0.0f);
+		Intersection its;
+		context.rayCount++;
+		if (scene->rayIntersect(cameraRay, its)) {
+			its.computeDifferentialGeometry();
+			if (context.aov)
+				context.aov->set(its);
+		} else if (scene->getEnvironmentLuminaire()) {
+			const Luminaire *env = scene->getEnvironmentLuminaire();
+			result = env->eval(LuminaireQueryRecord(env, cameraRay.o, cameraRay.d));
+		}
+
+		if (context.splats)
+			traceLightPath(context);
+
+		return result;
+	}
+
+	QString toString() const {
+		return QString("LightTracer[maxDepth=%1, rrDepth=%2]")
+			.arg(m_maxDepth).arg(m_rrDepth);
+	}
+private:
+	/// Trace a path from a luminaire and splat its connections to the camera
+	void traceLightPath(RenderContext &context) const {
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+		const Camera *camera = context.camera;
+
+		LuminaireQueryRecord lRec(Point3f(0.0f, 0.0f, 0.0f));
+		Ray3f ray;
+		Color3f throughput = scene->sampleEmission(lRec, ray,
+			sampler->next2D(), sampler->next2D());
+		if (throughput.isZero())
+			return;
+		MediumStack media(scene->getMedium());
+
+		/* Connect the origin of the path to the camera (unless it lies on
+		   an environment luminaire, which is infinitely far away) */
+		if (lRec.pdf > 0) {
+			Point2f samplePosition;
+			Vector3f d;
+			float dist;
+			Color3f importance = camera->sampleImportance(lRec.p, sampler->next2D(),
+				samplePosition, d, dist);
+			if (!importance.isZero()) {
+				Color3f emitted = lRec.luminaire->eval(LuminaireQueryRecord(
+					lRec.luminaire, lRec.p + d * dist, lRec.p, lRec.n));
+				float cosine = lRec.luminaire->isVolume() ? 1.0f : std::abs(lRec.n.dot(d));
+				Color3f value = emitted * cosine * importance / lRec.pdf;
+				if (!value.isZero())
+					splat(context, lRec.p, d, dist, samplePosition, value, media);
+			}
+		}
+
+		Intersection its;
+		for (int depth = 1; m_maxDepth < 0 || depth < m_maxDepth; ++depth) {
+			context.rayCount++;
+			bool hit = scene->rayIntersect(ray, its);
+
+			/* Sample a medium interaction along the segment */
+			Ray3f segment(ray.o, ray.d, ray.mint, hit ? its.t : ray.maxt);
+			float t;
+			Color3f mediumWeight;
+			bool mediumInteraction = scene->sampleDistance(segment, sampler,
+				t, mediumWeight, media);
+			throughput *= mediumWeight;
+			if (throughput.isZero())
+				break;
+
+			Point2f samplePosition;
+			Vector3f d;
+			float dist;
+			if (mediumInteraction) {
+				Point3f p = ray(t);
+				const PhaseFunction *phase = media.top()->getPhaseFunction();
+
+				/* Connect to the camera */
+				Color3f importance = camera->sampleImportance(p, sampler->next2D(),
+					samplePosition, d, dist);
+				if (!importance.isZero()) {
+					float phaseVal = phase->eval(PhaseFunctionQueryRecord(-ray.d, d));
+					if (phaseVal > 0)
+						splat(context, p, d, dist, samplePosition,
+							throughput * phaseVal * importance, media);
+				}
+
+				/* Continue the path by sampling the phase function */
+				PhaseFunctionQueryRecord pRec(-ray.d);
+				float phaseWeight = phase->sample(pRec, sampler->next2D());
+				if (phaseWeight <= 0)
+					break;
+				throughput *= phaseWeight;
+				ray = Ray3f(p, pRec.wo);
+			} else if (!hit) {
+				break;
+			} else {
+				its.computeDifferentialGeometry();
+				const BSDF *bsdf = its.mesh->getBSDF();
+				if (!bsdf)
+					break;
+				Vector3f wi = its.toLocal(-ray.d);
+
+				/* Connect to the camera */
+				Color3f importance = camera->sampleImportance(its.p, sampler->next2D(),
+					samplePosition, d, dist);
+				if (!importance.isZero()) {
+					BSDFQueryRecord bRec(wi, its.toLocal(d), ESolidAngle);
+					bRec.uv = its.uv;
+					bRec.uvWidth = its.uvWidth;
+					Color3f bsdfVal = bsdf->eval(bRec);
+					if (!bsdfVal.isZero())
+						splat(context, its.p, d, dist, samplePosition, throughput * bsdfVal
+							* std::abs(Frame::cosTheta(bRec.wo)) * importance, media);
+				}
+
+				/* Continue the path by sampling the BSDF */
+				BSDFQueryRecord bRec(wi);
+				bRec.uv = its.uv;
+				bRec.uvWidth = its.uvWidth;
+				Color3f bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+				if (bsdfWeight.isZero())
+					break;
+				throughput *= bsdfWeight;
+
+				Vector3f wo = its.toWorld(bRec.wo);
+				if (its.geoFrame.n.dot(ray.d) * its.geoFrame.n.dot(wo) > 0)
+					media.update(its, wo);
+				ray = Ray3f(its.p, wo);
+			}
+
+			/* Russian roulette based on the throughput */
+			if (depth >= m_rrDepth) {
+				float q = std::min(throughput.maxCoeff(), 0.95f);
+				if (sampler->next1D() >= q)
+					break;
+				throughput /= q;
+			}
+		}
+	}
+
+	/**
+	 * \brief Trace the shadow ray of a connection to the camera and
+	 * splat its contribution when it is unoccluded
+	 */
+	inline void splat(RenderContext &context, const Point3f &p, const Vector3f &d,
+			float dist, const Point2f &samplePosition, const Color3f &value,
+			const MediumStack &media) const {
+		Ray3f shadowRay(p, d, Epsilon, dist * (1 - Epsilon));
+		context.shadowRayCount++;
+		Color3f tr = context.scene->evalVisibilityTransmittance(shadowRay,
+			context.sampler, media);
+		if (!tr.isZero())
+			context.splats->putSplat(samplePosition, value * tr);
+	}
+
+	int m_maxDepth;
+	int m_rrDepth;
+};
+
+NORI_REGISTER_CLASS(LightTracer, "light");
+NORI_NAMESPACE_END
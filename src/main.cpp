@@ -19,83 +19,1081 @@
 #include <nori/parser.h>
 #include <nori/scene.h>
 #include <nori/camera.h>
-#include <nori/block.h>
+#include <nori/render.h>
 #include <nori/bitmap.h>
+#include <nori/denoiser.h>
 #include <nori/integrator.h>
+#include <nori/mesh.h>
+#include <nori/medium.h>
+#include <nori/server.h>
+#include <nori/texcache.h>
+#include <nori/volcache.h>
+#include <nori/geocache.h>
+#include <nori/profiler.h>
+#include <nori/status.h>
+#include <nori/cluster.h>
 #include <nori/gui.h>
 #include <boost/scoped_ptr.hpp>
 #include <QFileInfo>
+#include <QFile>
 #include <QDir>
 #include <QApplication>
+#include <fstream>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 	
 using namespace nori;
 
-void render(Scene *scene, const QString &filename) {
-	const Camera *camera = scene->getCamera();
-	Vector2i outputSize = camera->getOutputSize();
+/// Command line options
+struct Options {
+	bool headless, resume, incremental;
+	Point2i cropOffset;
+	Vector2i cropSize;
+	int tileIndex, tileCount;
+	int loadFlags;
+	float statusInterval;
+	int statusPort;
+	float timeLimit;
+	int masterPort;
+	bool clusterHalf;
+	bool prefetch;
+	bool fullTeardown;
+	bool memoryReport;
+	QString filename;
 
-	/* Create a block generator (i.e. a work scheduler) */
-	BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+	Options() : headless(false), resume(false), incremental(false), cropOffset(0, 0), cropSize(0, 0),
+		tileIndex(0), tileCount(1), loadFlags(0), statusInterval(0), statusPort(0),
+		timeLimit(0), masterPort(0), clusterHalf(false), prefetch(true),
+		fullTeardown(false), memoryReport(false) { }
+};
 
-	/* Allocate memory for the entire output image */
-	ImageBlock result(outputSize, camera->getReconstructionFilter());
-	result.clear();
+/// Set by SIGINT and SIGTERM: stop rendering and save the image rendered so far
+static volatile sig_atomic_t stopRequested = 0;
 
-	/* Launch the GUI */
-	NoriWindow window(&result);
+void handleStopSignal(int signal) {
+	stopRequested = 1;
+	/* A second signal terminates the process right away */
+	std::signal(signal, SIG_DFL);
+}
 
-	/* Launch one render thread per core */
-	int nCores = getCoreCount();
-	std::vector<BlockRenderThread *> threads;
-	for (int i=0; i<nCores; ++i) {
-		BlockRenderThread *thread = new BlockRenderThread(
-			scene, scene->getSampler(), &blockGenerator, &result);
-		thread->start();
-		threads.push_back(thread);
+/**
+ * \brief Cancels render jobs when a stop signal arrives or when the
+ * time budget is used up, and then closes the preview window (if any)
+ */
+class StopWatcher : public QThread {
+public:
+	StopWatcher(const std::vector<RenderJob *> &jobs, float timeLimit) : m_jobs(jobs),
+			m_timeLimit(timeLimit), m_shutdown(false) {
+		m_timer.start();
+		start();
 	}
-		
-	window.startRefresh();
-	qApp->exec();
-	window.stopRefresh();
 
-	/* Wait for them to finish */
-	for (int i=0; i<nCores; ++i) {
-		threads[i]->wait();
-		delete threads[i];
+	~StopWatcher() {
+		m_shutdown = true;
+		wait();
+	}
+
+	void run() {
+		while (!m_shutdown && !allFinished()) {
+			bool timeout = m_timeLimit > 0 && m_timer.elapsed() > 1000 * m_timeLimit;
+			if (stopRequested || timeout) {
+				cout << (timeout ? "The time limit was reached" : "Stop requested")
+					 << ", finishing the blocks in flight .." << endl;
+				for (size_t i=0; i<m_jobs.size(); ++i)
+					m_jobs[i]->cancel();
+				QMetaObject::invokeMethod(QCoreApplication::instance(), "quit",
+					Qt::QueuedConnection);
+				return;
+			}
+			msleep(100);
+		}
 	}
+protected:
+	/// Have all jobs been rendered?
+	bool allFinished() const {
+		for (size_t i=0; i<m_jobs.size(); ++i) {
+			if (!m_jobs[i]->isFinished())
+				return false;
+		}
+		return true;
+	}
+private:
+	std::vector<RenderJob *> m_jobs;
+	float m_timeLimit;
+	QElapsedTimer m_timer;
+	volatile bool m_shutdown;
+};
 
-	/* Now turn the rendered image block into 
-	   a properly normalized bitmap */
-	Bitmap *bitmap = result.toBitmap();
+/**
+ * \brief Loads the scene of the next frame while the current one renders
+ *
+ * When the next scene has the same geometry as the current one, it takes
+ * over the current scene's meshes and acceleration data structure, but 
+ * only once the current frame has been rendered (see \ref release()). 
+ * Otherwise, it loads and builds its own geometry right away.
+ */
+class FramePrefetch : public QThread, public GeometrySource {
+public:
+	FramePrefetch(const QString &filename, int loadFlags, Scene *current)
+			: m_filename(filename), m_loadFlags(loadFlags), m_current(current),
+			m_root(NULL), m_releasedFlag(false), m_abandoned(false) {
+		start();
+	}
 
-	/* Determine the filename of the output bitmap */
-	QFileInfo inputInfo(filename);
-	QString outputName = inputInfo.path() 
+	/// Stop waiting for the current frame, and release the loaded scene (if any)
+	~FramePrefetch() {
+		m_mutex.lock();
+		m_abandoned = true;
+		m_released.wakeAll();
+		m_mutex.unlock();
+		wait();
+		delete m_root;
+	}
+
+	void run() {
+		Profiler::getInstance()->setThreadName("prefetch");
+		try {
+			ProfileScope scope("Load scene", "load");
+			scope.setDetail(m_filename);
+			m_root = loadScene(m_filename, m_loadFlags, *this);
+		} catch (const NoriException &ex) {
+			m_error = ex.getReason();
+		} catch (const std::exception &ex) {
+			m_error = ex.what();
+		}
+	}
+
+	Scene *getGeometrySource(const QByteArray &geometryKey) {
+		if (geometryKey != m_current->getGeometryKey())
+			return NULL;
+		QMutexLocker locker(&m_mutex);
+		while (!m_releasedFlag && !m_abandoned)
+			m_released.wait(&m_mutex);
+		if (m_abandoned)
+			throw NoriException("Loading the next scene was abandoned");
+		return m_current;
+	}
+
+	/// The current frame has been rendered: its geometry may be taken over
+	void release() {
+		QMutexLocker locker(&m_mutex);
+		m_releasedFlag = true;
+		m_released.wakeAll();
+	}
+
+	/// Wait for the scene to be loaded and return it (throws upon failure)
+	NoriObject *take() {
+		wait();
+		if (!m_error.isEmpty())
+			throw NoriException(m_error);
+		NoriObject *root = m_root;
+		m_root = NULL;
+		return root;
+	}
+private:
+	QString m_filename;
+	int m_loadFlags;
+	Scene *m_current;
+	NoriObject *m_root;
+	QString m_error;
+	QMutex m_mutex;
+	QWaitCondition m_released;
+	bool m_releasedFlag, m_abandoned;
+};
+
+/// Wait until an image is on disk, and then remove the checkpoint that it makes obsolete (if any)
+void finishWriting(boost::scoped_ptr<BitmapWriter> &writer, const QString &checkpoint) {
+	if (!writer)
+		return;
+	writer->wait();
+	QString error = writer->getError();
+	writer.reset();
+	if (!error.isEmpty())
+		throw NoriException(QString("Could not write the output image: %1").arg(error));
+	if (!checkpoint.isEmpty())
+		QFile::remove(checkpoint);
+}
+
+/// Return the name of the output image without extension (next to the scene file)
+QString getOutputName(const Options &options) {
+	QFileInfo inputInfo(options.filename);
+	return inputInfo.path() 
 		+ QDir::separator() 
-		+ inputInfo.completeBaseName() + ".exr";
+		+ inputInfo.completeBaseName();
+}
+
+/// Return the name of the checkpoint file (separate for every tile range)
+QString getCheckpointName(const Options &options) {
+	QString name = getOutputName(options);
+	if (options.tileCount > 1)
+		name += QString("_tile%1of%2").arg(options.tileIndex).arg(options.tileCount);
+	return name + ".checkpoint";
+}
+
+/// Reports the progress of a job to a status monitor (if any) while in scope
+struct MonitoredJob {
+	StatusMonitor *monitor;
+	const RenderJob *job;
+
+	MonitoredJob(StatusMonitor *monitor, const RenderJob *job, const QString &name)
+			: monitor(monitor), job(job) {
+		if (monitor)
+			monitor->addJob(job, name);
+	}
+
+	~MonitoredJob() {
+		if (monitor)
+			monitor->removeJob(job);
+	}
+};
+
+/// Turn a rendered image block into a properly normalized (and optionally denoised) bitmap
+Bitmap *develop(const Scene *scene, const ImageBlock &block) {
+	if (!scene->getDenoise())
+		return block.toBitmap();
+
+	ProfileScope scope("Denoise", "output");
+	Denoiser denoiser(scene->getDenoiseRadius(), scene->getDenoiseStrength());
+	cout << "Denoising .. ";
+	cout.flush();
+	QElapsedTimer timer;
+	timer.start();
+	Bitmap *bitmap = denoiser.denoise(block);
+	cout << "done (took " << timer.elapsed() << " ms)" << endl;
+	return bitmap;
+}
+
+/// Append the AOVs of a rendered image block to the parts of an output file, prefixing their names
+void addAOVLayers(const Scene *scene, const ImageBlock &block, const QString &prefix,
+		std::vector<BitmapLayer> &layers) {
+	for (int aov=EAOVDepth; aov<=EAOVRenderTime; aov <<= 1) {
+		if (scene->getAOVs() & aov)
+			layers.push_back(BitmapLayer(prefix + getAOVName((EAOV) aov),
+				block.toAOVBitmap((EAOV) aov), getAOVChannels((EAOV) aov)));
+	}
+}
+
+/**
+ * \brief Save a rendered image block (and its AOVs) using the OpenEXR
+ * format. This happens in the background, while the caller releases 
+ * the scene
+ */
+BitmapWriter *writeImage(const Scene *scene, const ImageBlock &block, const QString &filename) {
+	Bitmap *bitmap = develop(scene, block);
+	BitmapWriter *writer;
+	if (scene->getAOVs() == 0) {
+		writer = new BitmapWriter(bitmap, filename, scene->getOutputOptions());
+	} else {
+		/* Store the AOVs as additional parts of the file */
+		std::vector<BitmapLayer> layers;
+		layers.push_back(BitmapLayer("color", bitmap, QStringList() << "R" << "G" << "B"));
+		addAOVLayers(scene, block, "", layers);
+		writer = new BitmapWriter(layers, filename, scene->getOutputOptions());
+	}
+	writer->start();
+	return writer;
+}
+
+/// The render jobs of the views of a multi-view scene (deleted when out of scope)
+struct ViewJobs {
+	StatusMonitor *monitor;
+	std::vector<RenderJob *> jobs;
+
+	ViewJobs(StatusMonitor *monitor) : monitor(monitor) { }
+
+	~ViewJobs() {
+		for (size_t i=0; i<jobs.size(); ++i) {
+			if (monitor)
+				monitor->removeJob(jobs[i]);
+			delete jobs[i];
+		}
+	}
+};
+
+/**
+ * Render all views of a multi-view scene (e.g. a stereo pair, see
+ * \ref Scene::getCameras()) and write each of them as its own part of
+ * the output file, named after the view's camera. The views are 
+ * rendered by one engine, whose workers move on to the next view as
+ * the current one runs out of blocks. They share the scene and its 
+ * acceleration data structure, the texture and geometry caches, and
+ * the state of the integrator (e.g. an irradiance cache or the guiding
+ * data of the path tracer, which keeps learning from view to view).
+ */
+BitmapWriter *renderViews(Scene *scene, const Options &options, StatusMonitor *monitor,
+		bool &stopped) {
+	const std::vector<Camera *> &cameras = scene->getCameras();
+	if (options.tileCount > 1 || scene->getStreamOutput())
+		throw NoriException("Multi-view scenes can't be rendered in tiles or streamed");
+	if (scene->getCheckpointInterval() > 0 || options.resume)
+		throw NoriException("Multi-view scenes don't support checkpoints");
+	if (options.incremental)
+		throw NoriException("Multi-view scenes don't support incremental rendering");
+	for (size_t i=1; i<cameras.size(); ++i) {
+		if (cameras[i]->getOutputSize() != cameras[0]->getOutputSize())
+			throw NoriException("The views of a multi-view scene must have the same resolution");
+	}
+
+	RenderEngine engine(getCoreCount(), scene->getPinThreads());
+	ViewJobs views(monitor);
+	{
+		ProfileScope scope("Render", "render");
+		QString name = QFileInfo(options.filename).fileName();
+		for (size_t i=0; i<cameras.size(); ++i) {
+			RenderJob *job = new RenderJob(scene, cameras[i], 0,
+				options.cropOffset, options.cropSize);
+			views.jobs.push_back(job);
+			engine.submit(job);
+			if (monitor)
+				monitor->addJob(job, name + " (" + cameras[i]->getName() + ")");
+		}
+		StopWatcher watcher(views.jobs, options.timeLimit);
+
+		bool navigated = false;
+		if (!options.headless) {
+			/* The window previews the first view. Stopping it stops all of them */
+			NoriWindow window(&engine, views.jobs[0]);
+			window.startRefresh();
+			qApp->exec();
+			window.stopRefresh();
+			navigated = window.isNavigated();
+			if (views.jobs[0]->isCancelled()) {
+				for (size_t i=1; i<views.jobs.size(); ++i)
+					views.jobs[i]->cancel();
+			}
+		}
+
+		for (size_t i=0; i<views.jobs.size(); ++i)
+			views.jobs[i]->wait();
+
+		if (navigated) {
+			cout << "The camera was moved interactively, not writing the output" << endl;
+			return NULL;
+		}
+
+		if (views.jobs[0]->isCancelled()) {
+			stopped = true;
+			cout << "Rendering was stopped, saving the partially rendered views" << endl;
+			if (scene->getIntegrator()->usesSplatting())
+				cerr << "Warning: the splatted contributions assume that all "
+					"samples were taken and are too dark" << endl;
+		}
+	}
+
+	/* One part per view, followed by its AOVs (named e.g. "left.depth") */
+	std::vector<BitmapLayer> layers;
+	for (size_t i=0; i<views.jobs.size(); ++i) {
+		const QString &view = cameras[i]->getName();
+		layers.push_back(BitmapLayer(view, develop(scene, *views.jobs[i]->getOutput()),
+			QStringList() << "R" << "G" << "B"));
+		addAOVLayers(scene, *views.jobs[i]->getOutput(), view + ".", layers);
+	}
+	BitmapWriter *writer = new BitmapWriter(layers, getOutputName(options) + ".exr",
+		scene->getOutputOptions());
+	writer->start();
+	return writer;
+}
+
+/// Render the scene on the machines that connect as workers ('nori --master')
+BitmapWriter *renderCluster(Scene *scene, const Options &options, bool &stopped) {
+	if (scene->getCameras().size() > 1)
+		throw NoriException("Cluster renderings don't support scenes with several cameras");
+	if (options.tileCount > 1 || options.resume || scene->getCheckpointInterval() > 0
+			|| scene->getStreamOutput() || options.incremental)
+		throw NoriException("Cluster renderings don't support tiles, checkpoints, "
+			"streaming output or incremental rendering");
+
+	ProfileScope scope("Render", "render");
+	ClusterMaster master(options.masterPort, options.filename, scene,
+		options.cropOffset, options.cropSize, NORI_CLUSTER_UNIT_SIZE,
+		ImageBlock::ESerializeCompressed | (options.clusterHalf ? ImageBlock::ESerializeHalf : 0));
+	cout << "Waiting for workers on port " << options.masterPort
+		 << " (nori --worker <host> " << options.masterPort << ") .." << endl;
+
+	/* Report every 10% of the work units */
+	QElapsedTimer timer;
+	timer.start();
+	int reported = 0;
+	while (!master.waitDone(100)) {
+		bool timeout = options.timeLimit > 0 && timer.elapsed() > 1000 * options.timeLimit;
+		if ((stopRequested || timeout) && !master.isCancelled()) {
+			cout << (timeout ? "The time limit was reached" : "Stop requested")
+				 << ", not waiting for the remaining units" << endl;
+			master.cancel();
+		}
+		ClusterMaster::Progress progress = master.getProgress();
+		int percent = 10 * (10 * progress.finishedUnits / progress.unitCount);
+		if (percent > reported) {
+			cout << "Rendered " << progress.finishedUnits << "/" << progress.unitCount
+				 << " units (" << percent << "%, " << progress.workerCount << " workers)" << endl;
+			reported = percent;
+		}
+	}
+
+	ClusterMaster::Progress progress = master.getProgress();
+	if (master.isCancelled()) {
+		stopped = true;
+		cout << "Rendering was stopped after " << progress.finishedUnits << " of "
+			 << progress.unitCount << " units, saving the partial image" << endl;
+	} else {
+		cout << "Rendering took " << timer.elapsed() << " ms" << endl;
+	}
+
+	return writeImage(scene, *master.getOutput(), getOutputName(options) + ".exr");
+}
+
+/**
+ * Render the scene. When an image was rendered, the returned writer is
+ * still saving it in the background (or NULL otherwise). \c stopped is
+ * set when the rendering was stopped early, i.e. the image is incomplete.
+ */
+BitmapWriter *render(Scene *scene, const Options &options, StatusMonitor *monitor,
+		bool &stopped) {
+	/* Distribute the rendering over the workers of a cluster */
+	if (options.masterPort > 0)
+		return renderCluster(scene, options, stopped);
+
+	/* Scenes with several cameras are rendered as multi-view images */
+	if (scene->getCameras().size() > 1)
+		return renderViews(scene, options, monitor, stopped);
+
+	/* Launch one render thread per core */
+	RenderEngine engine(getCoreCount(), scene->getPinThreads());
+
+	/* Determine the filename of the output bitmap */
+	QString outputName = getOutputName(options);
+
+	/* Render the image (or the requested part of it) using the scene's camera */
+	RenderJob job(scene, NULL, 0, options.cropOffset, options.cropSize);
+	job.setTileRange(options.tileIndex, options.tileCount);
+
+	/* Periodically save the rendering state, e.g. to survive the loss 
+	   of a preemptible machine */
+	bool checkpoint = scene->getCheckpointInterval() > 0 || options.resume;
+	if (checkpoint)
+		job.setCheckpoint(getCheckpointName(options),
+			scene->getCheckpointInterval(), options.resume);
+
+	/* After an edit of the scene's materials, only render the affected 
+	   parts of the image again */
+	if (options.incremental)
+		job.setRenderCache(outputName + ".cache");
+
+	if (scene->getStreamOutput()) {
+		/* Write the blocks into the EXR file as they are finished */
+		if (!options.headless)
+			throw NoriException("Streaming output requires the --headless mode");
+		job.setStreamingOutput(outputName + ".exr", scene->getOutputOptions());
+		engine.submit(&job);
+		MonitoredJob monitored(monitor, &job, QFileInfo(options.filename).fileName());
+		StopWatcher watcher(std::vector<RenderJob *>(1, &job), options.timeLimit);
+		job.wait();
+		stopped = job.isCancelled();
+		return NULL;
+	}
+
+	{
+		ProfileScope scope("Render", "render");
+		engine.submit(&job);
+		MonitoredJob monitored(monitor, &job, QFileInfo(options.filename).fileName());
+		StopWatcher watcher(std::vector<RenderJob *>(1, &job), options.timeLimit);
+
+		bool navigated = false;
+		if (!options.headless) {
+			/* Launch the GUI */
+			NoriWindow window(&engine, &job);
+			window.startRefresh();
+			qApp->exec();
+			window.stopRefresh();
+			navigated = window.isNavigated();
+		}
+
+		/* Wait for the job to finish */
+		job.wait();
+
+		/* Moving the camera in the window cancelled the job */
+		if (navigated) {
+			cout << "The camera was moved interactively, not writing the output" << endl;
+			return NULL;
+		}
+
+		/* Keep the work of a job that was stopped early. The pixels are
+		   normalized by their own sample weights, so partially rendered 
+		   blocks and passes are fine; blocks that were never started 
+		   remain black */
+		if (job.isCancelled()) {
+			stopped = true;
+			RenderJob::Status status = job.getStatus();
+			cout << "Rendering was stopped after "
+				 << qPrintable(QString::number(100 * status.getProgress(), 'f', 1))
+				 << "% of the samples, saving the partial image" << endl;
+			if (scene->getIntegrator()->usesSplatting())
+				cerr << "Warning: the splatted contributions assume that all "
+					"samples were taken and are too dark" << endl;
+		}
+	}
+
+	if (options.tileCount > 1) {
+		/* Only a subset of the blocks was rendered. Keep the unnormalized
+		   pixels (and the border), so that 'nori --merge' can combine them */
+		outputName += QString("_tile%1of%2.nib").arg(options.tileIndex).arg(options.tileCount);
+		job.getOutput()->save(outputName, scene->getCamera()->getOutputSize());
+		cout << "Wrote partial image \"" << qPrintable(outputName) << "\"" << endl;
+		if (scene->getAOVs() != 0)
+			cerr << "Warning: partial images don't include the AOVs" << endl;
+		if (scene->getDenoise())
+			cerr << "Warning: partial images aren't denoised" << endl;
+		if (checkpoint && !stopped)
+			QFile::remove(getCheckpointName(options));
+		return NULL;
+	}
+
+	return writeImage(scene, *job.getOutput(), outputName + ".exr");
+}
+
+/**
+ * \brief Render scenes headless at a fixed sample count and write
+ * their performance figures to a JSON file
+ *
+ * Every scene is loaded from scratch (i.e. without taking over the
+ * geometry of its predecessor), and no image is written. The load
+ * time includes the construction of the acceleration data structure,
+ * which is also reported separately. The ray counts are only known
+ * for integrators that count their rays, and the path statistics for
+ * scenes that enable them (see \ref PathStatistics). The peak memory
+ * usage is that of the whole process so far.
+ */
+void benchmark(const QStringList &sceneFiles, int sampleCount,
+		const QString &reportFile, int loadFlags) {
+	std::ofstream out(reportFile.toLocal8Bit().data());
+	if (!out)
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(reportFile));
+
+	out << "{" << endl
+		<< "  \"threads\": " << getCoreCount() << "," << endl
+		<< "  \"sampleCount\": " << sampleCount << "," << endl
+		<< "  \"scenes\": [" << endl;
+
+	for (int i=0; i<sceneFiles.size(); ++i) {
+		cout << "Benchmarking \"" << qPrintable(sceneFiles[i]) << "\" .." << endl;
+		QElapsedTimer timer;
+		timer.start();
+		boost::scoped_ptr<NoriObject> root(loadScene(sceneFiles[i], loadFlags));
+		qint64 loadTime = timer.elapsed();
+		if (root->getClassType() != NoriObject::EScene)
+			throw NoriException(QString("\"%1\" does not contain a scene!").arg(sceneFiles[i]));
+		const Scene *scene = static_cast<const Scene *>(root.get());
+
+		RenderEngine engine(getCoreCount(), scene->getPinThreads());
+		RenderJob job(scene, NULL, (uint32_t) sampleCount);
+		engine.submit(&job);
+		job.wait();
+
+		double seconds = std::max(job.getRenderTime(), (qint64) 1) / 1000.0;
+		uint64_t rays = job.getRayCount() + job.getShadowRayCount();
+		out << "    {" << endl
+			<< "      \"scene\": " << toJSONString(sceneFiles[i]) << "," << endl
+			<< "      \"loadTime\": " << loadTime << "," << endl
+			<< "      \"buildTime\": " << scene->getAccelerator()->getBuildTime() << "," << endl
+			<< "      \"renderTime\": " << job.getRenderTime() << "," << endl
+			<< "      \"samples\": " << job.getSampleCount() << "," << endl
+			<< "      \"samplesPerSecond\": " << job.getSampleCount() / seconds << "," << endl
+			<< "      \"rays\": " << job.getRayCount() << "," << endl
+			<< "      \"shadowRays\": " << job.getShadowRayCount() << "," << endl
+			<< "      \"raysPerSecond\": " << rays / seconds << "," << endl;
+		if (scene->getPathStatistics())
+			out << "      \"pathStatistics\": "
+				<< qPrintable(job.getPathStatistics().toJSON(rays)) << "," << endl;
+		out << "      \"peakMemory\": " << getPeakMemoryUsage() << endl
+			<< "    }" << (i + 1 < sceneFiles.size() ? "," : "") << endl;
+	}
+
+	out << "  ]" << endl << "}" << endl;
+	out.close();
+	if (!out)
+		throw NoriException(QString("Unable to write \"%1\"").arg(reportFile));
+	cout << "Wrote \"" << qPrintable(reportFile) << "\"" << endl;
+}
+
+/// Gives access to the (protected) sleep function of QThread
+class ConvergenceSleep : public QThread {
+public:
+	static void msleep(unsigned long msecs) { QThread::msleep(msecs); }
+};
+
+/// One point of a convergence curve (see \ref convergence())
+struct ConvergencePoint {
+	qint64 time;
+	uint64_t samples;
+	double mse, relMSE;
+};
+
+/**
+ * \brief Compute the mean squared error of an image, and its relative
+ * variant (normalized by the squared reference value plus 0.01 per
+ * channel), which weighs dark and bright regions more evenly
+ */
+void computeError(const Bitmap &image, const Bitmap &reference, double &mse, double &relMSE) {
+	double sum = 0, relSum = 0;
+	for (int y=0; y<reference.rows(); ++y) {
+		for (int x=0; x<reference.cols(); ++x) {
+			const Color3f &value = image.coeff(y, x), &ref = reference.coeff(y, x);
+			for (int c=0; c<3; ++c) {
+				double diff = (double) value[c] - (double) ref[c];
+				sum += diff * diff;
+				relSum += diff * diff / ((double) ref[c] * ref[c] + 1e-2);
+			}
+		}
+	}
+	double count = 3.0 * std::max((double) reference.size(), 1.0);
+	mse = sum / count;
+	relMSE = relSum / count;
+}
+
+/**
+ * \brief Render scenes progressively and record their error with
+ * respect to a reference image over time (equal-time comparisons)
+ *
+ * Each scene is rendered headless in progressive passes of one sample
+ * per pixel, so that the whole image improves evenly. At each of the
+ * given times (in seconds after the start of the rendering), the image
+ * rendered so far is compared with the reference. A rendering stops
+ * after the last checkpoint, or when it reaches the sample count of its
+ * sampler (which adds a final point). The curves are written as CSV
+ * if the report's name ends with ".csv", and as JSON otherwise.
+ */
+void convergence(const QStringList &sceneFiles, const QString &referenceFile,
+		const std::vector<float> &checkpoints, const QString &reportFile, int loadFlags) {
+	Bitmap reference(referenceFile);
+	bool csv = reportFile.endsWith(".csv", Qt::CaseInsensitive);
+	std::ofstream out(reportFile.toLocal8Bit().data());
+	if (!out)
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(reportFile));
+
+	if (csv)
+		out << "scene,time,samples,mse,relMSE" << endl;
+	else
+		out << "{" << endl
+			<< "  \"reference\": " << toJSONString(referenceFile) << "," << endl
+			<< "  \"threads\": " << getCoreCount() << "," << endl
+			<< "  \"scenes\": [" << endl;
+
+	for (int i=0; i<sceneFiles.size(); ++i) {
+		cout << "Measuring the convergence of \"" << qPrintable(sceneFiles[i]) << "\" .." << endl;
+		boost::scoped_ptr<NoriObject> root(loadScene(sceneFiles[i], loadFlags));
+		if (root->getClassType() != NoriObject::EScene)
+			throw NoriException(QString("\"%1\" does not contain a scene!").arg(sceneFiles[i]));
+		const Scene *scene = static_cast<const Scene *>(root.get());
+		const Vector2i &size = scene->getCamera()->getOutputSize();
+		if (size.x() != reference.cols() || size.y() != reference.rows())
+			throw NoriException(QString("The reference image has a size of %1x%2, but \"%3\" "
+				"renders %4x%5 pixels!").arg(reference.cols()).arg(reference.rows())
+				.arg(sceneFiles[i]).arg(size.x()).arg(size.y()));
+
+		RenderEngine engine(getCoreCount(), scene->getPinThreads());
+		RenderJob job(scene);
+		job.setProgressive(1);
+		QElapsedTimer timer;
+		timer.start();
+		engine.submit(&job);
 
-	/* Save using the OpenEXR format */
-	bitmap->save(outputName);
+		std::vector<ConvergencePoint> points;
+		for (size_t j=0; j<checkpoints.size(); ++j) {
+			qint64 target = (qint64) (1000 * checkpoints[j]);
+			bool finished = job.isFinished();
+			while (!finished && timer.elapsed() < target) {
+				ConvergenceSleep::msleep(5);
+				finished = job.isFinished();
+			}
+			if (finished)
+				break;
 
-	delete bitmap;
+			/* The workers keep writing into the image meanwhile */
+			ConvergencePoint point;
+			point.time = timer.elapsed();
+			point.samples = job.getSampleCount();
+			boost::scoped_ptr<Bitmap> image(job.getOutput()->toBitmap());
+			computeError(*image, reference, point.mse, point.relMSE);
+			points.push_back(point);
+			cout << "  " << point.time << " ms: relative MSE " << point.relMSE << endl;
+		}
+		job.cancel();
+		job.wait();
+		if (job.getSampleCount() > (points.empty() ? 0 : points.back().samples)
+				&& (points.size() < checkpoints.size())) {
+			ConvergencePoint point;
+			point.time = job.getRenderTime();
+			point.samples = job.getSampleCount();
+			boost::scoped_ptr<Bitmap> image(job.getOutput()->toBitmap());
+			computeError(*image, reference, point.mse, point.relMSE);
+			points.push_back(point);
+			cout << "  " << point.time << " ms (finished): relative MSE " << point.relMSE << endl;
+		}
+
+		if (csv) {
+			for (size_t j=0; j<points.size(); ++j)
+				out << toJSONString(sceneFiles[i]) << "," << points[j].time << ","
+					<< points[j].samples << "," << points[j].mse << "," << points[j].relMSE << endl;
+			continue;
+		}
+		out << "    {" << endl
+			<< "      \"scene\": " << toJSONString(sceneFiles[i]) << "," << endl
+			<< "      \"points\": [" << endl;
+		for (size_t j=0; j<points.size(); ++j)
+			out << "        { \"time\": " << points[j].time << ", \"samples\": " << points[j].samples
+				<< ", \"mse\": " << points[j].mse << ", \"relMSE\": " << points[j].relMSE << " }"
+				<< (j + 1 < points.size() ? "," : "") << endl;
+		out << "      ]" << endl
+			<< "    }" << (i + 1 < sceneFiles.size() ? "," : "") << endl;
+	}
+
+	if (!csv)
+		out << "  ]" << endl << "}" << endl;
+	out.close();
+	if (!out)
+		throw NoriException(QString("Unable to write \"%1\"").arg(reportFile));
+	cout << "Wrote \"" << qPrintable(reportFile) << "\"" << endl;
+}
+
+/// Writes the recorded trace (see \ref Profiler) when main() returns
+struct TraceWriter {
+	QString filename;
+
+	~TraceWriter() {
+		save();
+	}
+
+	/// Write the trace now (if one was requested and not written yet)
+	void save() {
+		if (filename.isEmpty())
+			return;
+		try {
+			Profiler::getInstance()->save(filename);
+			cout << "Wrote the trace \"" << qPrintable(filename) << "\"" << endl;
+		} catch (const NoriException &ex) {
+			cerr << "Could not write the trace: " << qPrintable(ex.getReason()) << endl;
+		}
+		filename = QString();
+	}
+};
+
+/**
+ * \brief Terminate the process without tearing down the scene
+ *
+ * Deleting a large scene (the kd-tree, the mesh buffers, mapped volumes,
+ * ..) can take seconds, while the operating system reclaims all of that
+ * at once. The images must be on disk already; the trace and the output
+ * streams are flushed here. Destructors don't run, hence leak checkers 
+ * need <tt>--full-teardown</tt>.
+ */
+void fastExit(TraceWriter &traceWriter) {
+	traceWriter.save();
+	cout.flush();
+	cerr.flush();
+	std::fflush(NULL);
+	_Exit(0);
 }
 
 int main(int argc, char **argv) {
-	QApplication app(argc, argv);
+	Options options;
+	QStringList mergeInputs, sceneFiles;
+	QString convertInput, convertEncoding("float32"), serverDirectory, benchmarkReport;
+	QString workerHost, convergenceReference, convergenceReport;
+	std::vector<float> convergenceCheckpoints;
+	int benchmarkSamples = 0, workerPort = 0;
+	bool valid = argc >= 2;
+	TraceWriter traceWriter;
+
+	for (int i=1; i<argc && valid; ++i) {
+		QString arg(argv[i]);
+		if (arg == "--headless") {
+			options.headless = true;
+		} else if (arg == "--resume") {
+			options.resume = true;
+		} else if (arg == "--incremental") {
+			/* Reuse the parts of the previous image that an edit doesn't affect */
+			options.incremental = true;
+		} else if (arg == "--no-validate") {
+			options.loadFlags |= ESkipValidation;
+		} else if (arg == "--scene-cache") {
+			options.loadFlags |= EUseSceneCache;
+		} else if (arg == "--crop" && i + 4 < argc) {
+			options.cropOffset = Point2i(atoi(argv[i+1]), atoi(argv[i+2]));
+			options.cropSize = Vector2i(atoi(argv[i+3]), atoi(argv[i+4]));
+			valid = (options.cropSize.array() > 0).all();
+			i += 4;
+		} else if (arg == "--texture-cache" && i + 1 < argc) {
+			/* Memory budget of the texture tiles in MiB */
+			int budget = atoi(argv[++i]);
+			valid = budget > 0;
+			TextureCache::getInstance()->setMemoryBudget((size_t) budget << 20);
+		} else if (arg == "--geometry-cache" && i + 1 < argc) {
+			/* Memory budget of the tessellated patches in MiB */
+			int budget = atoi(argv[++i]);
+			valid = budget > 0;
+			GeometryCache::getInstance()->setMemoryBudget((size_t) budget << 20);
+		} else if (arg == "--volume-cache" && i + 1 < argc) {
+			/* Memory budget of the bricks of volumes read through the cache in MiB */
+			int budget = atoi(argv[++i]);
+			valid = budget > 0;
+			VolumeCache::getInstance()->setMemoryBudget((size_t) budget << 20);
+		} else if (arg == "--trace" && i + 1 < argc) {
+			/* Record the phases of the run for about:tracing */
+			traceWriter.filename = argv[++i];
+			Profiler::getInstance()->enable();
+			Profiler::getInstance()->setThreadName("main");
+		} else if (arg == "--status" && i + 1 < argc) {
+			/* Print a machine-readable status line every few seconds */
+			options.statusInterval = (float) atof(argv[++i]);
+			valid = options.statusInterval > 0;
+		} else if (arg == "--status-port" && i + 1 < argc) {
+			/* Serve the status over HTTP (e.g. for Prometheus) */
+			options.statusPort = atoi(argv[++i]);
+			valid = options.statusPort > 0 && options.statusPort < 65536;
+		} else if (arg == "--time-limit" && i + 1 < argc) {
+			/* Stop rendering each scene after this many seconds, saving what is there */
+			options.timeLimit = (float) atof(argv[++i]);
+			valid = options.timeLimit > 0;
+		} else if (arg == "--tiles" && i + 2 < argc) {
+			options.tileIndex = atoi(argv[i+1]);
+			options.tileCount = atoi(argv[i+2]);
+			i += 2;
+		} else if (arg == "--benchmark" && i + 2 < argc) {
+			/* nori --benchmark <spp> <report.json> [<scene.xml> ..] */
+			options.headless = true;
+			benchmarkSamples = atoi(argv[i+1]);
+			benchmarkReport = argv[i+2];
+			valid = benchmarkSamples > 0;
+			i += 2;
+		} else if (arg == "--convergence" && i + 3 < argc) {
+			/* nori --convergence <reference.exr> <seconds,..> <report.json|csv> <scene.xml> [..] */
+			options.headless = true;
+			convergenceReference = argv[i+1];
+			QStringList times = QString(argv[i+2]).split(",");
+			for (int j=0; j<times.size() && valid; ++j) {
+				float time = times[j].toFloat(&valid);
+				valid &= time > 0 && (convergenceCheckpoints.empty()
+					|| time > convergenceCheckpoints.back());
+				convergenceCheckpoints.push_back(time);
+			}
+			convergenceReport = argv[i+3];
+			i += 3;
+		} else if (arg == "--server" && i + 1 < argc) {
+			/* nori --server <job directory> */
+			options.headless = true;
+			serverDirectory = argv[++i];
+		} else if (arg == "--master" && i + 1 < argc) {
+			/* nori --master <port> <scene.xml>: render on the machines that connect */
+			options.headless = true;
+			options.masterPort = atoi(argv[++i]);
+			valid = options.masterPort > 0 && options.masterPort < 65536;
+		} else if (arg == "--memory-report") {
+			/* Write the memory report of every scene as JSON (next to its image) */
+			options.memoryReport = true;
+		} else if (arg == "--full-teardown") {
+			/* Delete the scene before exiting (e.g. for leak checking) */
+			options.fullTeardown = true;
+		} else if (arg == "--no-huge-pages") {
+			/* Back kd-trees and mesh buffers by ordinary pages */
+			setHugePagesEnabled(false);
+		} else if (arg == "--no-prefetch") {
+			/* Don't load the next scene while the current one renders (saves memory) */
+			options.prefetch = false;
+		} else if (arg == "--cluster-half") {
+			/* Workers send their results as half floats (lossy, but smaller) */
+			options.clusterHalf = true;
+		} else if (arg == "--worker" && i + 2 < argc) {
+			/* nori --worker <host> <port>: render for a master */
+			options.headless = true;
+			workerHost = argv[i+1];
+			workerPort = atoi(argv[i+2]);
+			valid = workerPort > 0 && workerPort < 65536;
+			i += 2;
+		} else if (arg == "--merge" && i == 1 && argc >= 4) {
+			/* nori --merge <output.exr> <partial images..> */
+			options.headless = true;
+			options.filename = argv[2];
+			for (int j=3; j<argc; ++j)
+				mergeInputs << argv[j];
+			break;
+		} else if (arg == "--convert" && i == 1 && (argc == 4 || argc == 5)) {
+			/* nori --convert <input.obj|input.vol> <output.nbm|output.nsv> [encoding] */
+			options.headless = true;
+			convertInput = argv[2];
+			options.filename = argv[3];
+			if (argc == 5)
+				convertEncoding = argv[4];
+			valid = argc == 4 || convertInput.endsWith(".vol", Qt::CaseInsensitive);
+			break;
+		} else if (!arg.startsWith("--")) {
+			sceneFiles << arg;
+		} else {
+			valid = false;
+		}
+	}
+
+	/* In headless mode, there is no window and no dependency on 
+	   an X server -- the image is only written to disk */
+	boost::scoped_ptr<QCoreApplication> app(options.headless
+		? new QCoreApplication(argc, argv) : new QApplication(argc, argv));
 	Q_INIT_RESOURCE(resources);
 
 	try {
-		if (argc != 2) {
-			cerr << "Syntax: nori <scene.xml>" << endl;
+		if (!valid || (options.filename.isEmpty() && sceneFiles.isEmpty() 
+				&& serverDirectory.isEmpty() && benchmarkReport.isEmpty() && workerHost.isEmpty())
+				|| (!convergenceReport.isEmpty() && sceneFiles.isEmpty())) {
+			cerr << "Syntax: nori [--headless] [--resume] [--incremental] [--crop <x> <y> <width> <height>] "
+				"[--tiles <index> <count>] [--texture-cache <MiB>] [--geometry-cache <MiB>] "
+				"[--volume-cache <MiB>] "
+				"[--no-validate] [--scene-cache] [--trace <trace.json>] "
+				"[--status <seconds>] [--status-port <port>] [--time-limit <seconds>] "
+				"[--no-prefetch] [--no-huge-pages] [--full-teardown] [--memory-report] "
+				"<scene.xml> [<scene2.xml> ..]" << endl;
+			cerr << "        nori --merge <output.exr> <partial image 1> <partial image 2> .." << endl;
+			cerr << "        nori --convert <input.obj> <output.nbm>" << endl;
+			cerr << "        nori --convert <input.vol> <output.nsv> [float32|float16|uint8]" << endl;
+			cerr << "        nori [--no-validate] [--scene-cache] [--trace <trace.json>] "
+				"[--status <seconds>] [--status-port <port>] --server <job directory>" << endl;
+			cerr << "        nori --benchmark <spp> <report.json> [<scene.xml> ..]" << endl;
+			cerr << "        nori --convergence <reference.exr> <seconds,..> <report.json|report.csv> "
+				"<scene.xml> [<scene2.xml> ..]" << endl;
+			cerr << "        nori [--no-validate] [--scene-cache] [--crop <x> <y> <width> <height>] "
+				"[--time-limit <seconds>] [--cluster-half] --master <port> <scene.xml> [<scene2.xml> ..]" << endl;
+			cerr << "        nori [--no-validate] [--scene-cache] --worker <host> <port>" << endl;
 			return -1;
 		}
 
-		boost::scoped_ptr<NoriObject> root(loadScene(argv[1]));
+		if (!benchmarkReport.isEmpty()) {
+			/* Without scene arguments, use the bundled scenes (from the source directory) */
+			if (sceneFiles.isEmpty())
+				sceneFiles << "scenes/cbox/cbox.xml" << "scenes/ajax/ajax-path.xml"
+					<< "scenes/veach_mi/mi.xml" << "scenes/table/table-path.xml"
+					<< "scenes/odyssey/odyssey.xml";
+			benchmark(sceneFiles, benchmarkSamples, benchmarkReport, options.loadFlags);
+			return 0;
+		}
+
+		if (!convergenceReport.isEmpty()) {
+			/* Error over time of each scene, e.g. with different samplers or integrators */
+			convergence(sceneFiles, convergenceReference, convergenceCheckpoints,
+				convergenceReport, options.loadFlags);
+			return 0;
+		}
+
+		if (!mergeInputs.isEmpty()) {
+			/* Combine partial images rendered by several machines */
+			boost::scoped_ptr<Bitmap> bitmap(ImageBlock::merge(mergeInputs));
+			bitmap->save(options.filename);
+			return 0;
+		}
+
+		/* Report the progress of the render jobs, e.g. to a render farm's scheduler */
+		boost::scoped_ptr<StatusMonitor> monitor;
+		if (options.statusInterval > 0 || options.statusPort > 0)
+			monitor.reset(new StatusMonitor(options.statusInterval, options.statusPort));
+
+		if (!serverDirectory.isEmpty()) {
+			/* Render the jobs dropped into the directory, keeping the scenes loaded */
+			RenderServer server(serverDirectory, options.loadFlags);
+			server.setStatusMonitor(monitor.get());
+			server.run();
+			return 0;
+		}
+
+		if (!workerHost.isEmpty()) {
+			/* Render for a master until interrupted */
+			std::signal(SIGINT, handleStopSignal);
+			std::signal(SIGTERM, handleStopSignal);
+			ClusterWorker worker(workerHost, workerPort, options.loadFlags);
+			worker.run(&stopRequested);
+			return 0;
+		}
+
+		if (convertInput.endsWith(".vol", Qt::CaseInsensitive)) {
+			/* Turn a dense volume into a sparse (bricked) one */
+			convertToSparseVolume(convertInput, options.filename, 8, convertEncoding);
+			cout << "Wrote \"" << qPrintable(options.filename) << "\"" << endl;
+			return 0;
+		} else if (!convertInput.isEmpty()) {
+			/* Turn an OBJ file into a binary mesh that can be mapped into memory */
+			PropertyList propList;
+			propList.setString("filename", convertInput);
+			boost::scoped_ptr<Mesh> mesh(static_cast<Mesh *>(
+				NoriObjectFactory::createInstance("obj", propList)));
+			mesh->saveBinary(options.filename);
+			cout << "Wrote \"" << qPrintable(options.filename) << "\"" << endl;
+			return 0;
+		}
+
+		/* Scenes that only differ from their predecessor in e.g. the camera 
+		   or the integrator take over its meshes and acceleration data 
+		   structure (see loadScene()), so the previous one is kept around */
+		boost::scoped_ptr<NoriObject> root;
+
+		/* The image of the previous scene is written while the next one
+		   renders, and the scene after that is loaded meanwhile */
+		boost::scoped_ptr<BitmapWriter> writer;
+		QString writerCheckpoint;
+		boost::scoped_ptr<FramePrefetch> prefetch;
+
+		/* On SIGINT or SIGTERM (e.g. when a farm preempts the machine), stop
+		   rendering and save what was rendered so far */
+		std::signal(SIGINT, handleStopSignal);
+		std::signal(SIGTERM, handleStopSignal);
+
+		for (int i=0; i<sceneFiles.size() && !stopRequested; ++i) {
+			options.filename = sceneFiles[i];
+			if (prefetch) {
+				ProfileScope scope("Wait for the next scene", "load");
+				NoriObject *next = prefetch->take();
+				prefetch.reset();
+				root.reset(next);
+			} else {
+				Scene *previous = NULL;
+				if (root && root->getClassType() == NoriObject::EScene)
+					previous = static_cast<Scene *>(root.get());
+				ProfileScope scope("Load scene", "load");
+				scope.setDetail(options.filename);
+				root.reset(loadScene(options.filename, options.loadFlags, previous));
+			}
+
+			boost::scoped_ptr<BitmapWriter> frameWriter;
+			bool stopped = false;
+			if (root->getClassType() == NoriObject::EScene) {
+				Scene *scene = static_cast<Scene *>(root.get());
+				if (options.memoryReport) {
+					QString reportName = getOutputName(options) + ".memory.json";
+					scene->getMemoryReport().save(reportName);
+					cout << "Wrote the memory report \"" << qPrintable(reportName) << "\"" << endl;
+				}
+				if (options.prefetch && i + 1 < sceneFiles.size())
+					prefetch.reset(new FramePrefetch(sceneFiles[i+1], options.loadFlags, scene));
+
+				/* The root object is a scene! Start rendering it.. */
+				frameWriter.reset(render(scene, options, monitor.get(), stopped));
+				if (prefetch)
+					prefetch->release();
+			}
+
+			/* Release the last scene while the image is being written,
+			   unless the process exits right away (see fastExit()) */
+			if (i == sceneFiles.size() - 1 || stopRequested) {
+				prefetch.reset();
+				if (options.fullTeardown)
+					root.reset();
+			}
 
-		if (root->getClassType() == NoriObject::EScene) {
-			/* The root object is a scene! Start rendering it.. */
-			render(static_cast<Scene *>(root.get()), argv[1]);
+			/* Keep at most one image in flight. The checkpoint (if any) is 
+			   obsolete once the complete image is on disk. A stopped 
+			   rendering can be resumed from it */
+			finishWriting(writer, writerCheckpoint);
+			writer.swap(frameWriter);
+			writerCheckpoint = stopped ? QString() : getCheckpointName(options);
 		}
+		finishWriting(writer, writerCheckpoint);
+		if (root)
+			fastExit(traceWriter);
 	} catch (const NoriException &ex) {
 		cerr << "Caught a critical exception: " << qPrintable(ex.getReason()) << endl;
 		return -1;
@@ -18,14 +18,79 @@
 
 #include <nori/medium.h>
 #include <nori/phase.h>
+#include <nori/mesh.h>
+#include <nori/luminaire.h>
 
 NORI_NAMESPACE_BEGIN
 
-Medium::Medium() : m_phaseFunction(NULL) { }
+/**
+ * \brief Luminaire that samples the emission of a medium (see
+ * \ref Medium::getLuminaire())
+ *
+ * Positions are sampled using \ref Medium::sampleEmissionPosition(),
+ * and their density wrt. volume is converted to one wrt. solid angles
+ * (times distance) at the illuminated point by multiplying it with the
+ * squared distance. The emission is isotropic.
+ */
+class MediumLuminaire : public Luminaire {
+public:
+	MediumLuminaire(const Medium *medium) : m_medium(medium) { }
+
+	Color3f sample(LuminaireQueryRecord &lRec, const Point2f &sample) const {
+		float pdf = m_medium->sampleEmissionPosition(sample, lRec.p);
+		if (pdf <= 0)
+			return Color3f(0.0f);
+		lRec.luminaire = this;
+		lRec.n = Normal3f(0.0f);
+		lRec.d = lRec.p - lRec.ref;
+		lRec.dist = lRec.d.norm();
+		if (lRec.dist <= 0)
+			return Color3f(0.0f);
+		lRec.d /= lRec.dist;
+		lRec.pdf = pdf * lRec.dist * lRec.dist;
+		return eval(lRec) / lRec.pdf;
+	}
+
+	Color3f sampleRay(LuminaireQueryRecord &lRec, Ray3f &ray,
+			const Point2f &positionSample, const Point2f &directionSample) const {
+		float pdf = m_medium->sampleEmissionPosition(positionSample, lRec.p);
+		if (pdf <= 0)
+			return Color3f(0.0f);
+		lRec.luminaire = this;
+		lRec.n = Normal3f(0.0f);
+		lRec.pdf = pdf;
+		ray = Ray3f(lRec.p, squareToUniformSphere(directionSample));
+		return m_medium->evalEmission(lRec.p) * (4 * M_PI / pdf);
+	}
+
+	Color3f eval(const LuminaireQueryRecord &lRec) const {
+		return m_medium->evalEmission(lRec.p);
+	}
+
+	float pdf(const LuminaireQueryRecord &lRec) const {
+		return m_medium->pdfEmissionPosition(lRec.p) * lRec.dist * lRec.dist;
+	}
+
+	float getPower() const {
+		return m_medium->getEmittedPower();
+	}
+
+	bool isVolume() const { return true; }
+
+	QString toString() const {
+		return QString("MediumLuminaire[power = %1]").arg(getPower());
+	}
+private:
+	const Medium *m_medium;
+};
+
+Medium::Medium() : m_phaseFunction(NULL), m_luminaire(NULL) { }
 
 Medium::~Medium() {
 	if (m_phaseFunction)
 		delete m_phaseFunction;
+	if (m_luminaire)
+		delete m_luminaire;
 }
 	
 void Medium::addChild(NoriObject *child) {
@@ -46,6 +111,69 @@ void Medium::activate() {
 	if (!m_phaseFunction)
 		m_phaseFunction = static_cast<PhaseFunction *>(
 			NoriObjectFactory::createInstance("isotropic", PropertyList()));
+	if (!m_luminaire && getEmittedPower() > 0)
+		m_luminaire = new MediumLuminaire(this);
+}
+
+bool Medium::evalDistance(const Ray3f &, float, Color3f &, float &) const {
+	return false;
+}
+
+bool Medium::sampleSpectralDistance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl, float &t, Spectrum4f &weight) const {
+	Color3f rgbWeight;
+	bool success = sampleDistance(ray, sampler, t, rgbWeight);
+	weight = wl.fromRGB(rgbWeight);
+	return success;
+}
+
+Spectrum4f Medium::evalSpectralTransmittance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl) const {
+	return wl.fromRGB(evalTransmittance(ray, sampler));
+}
+
+Color3f Medium::evalEmission(const Point3f &) const {
+	return Color3f(0.0f);
+}
+
+Color3f Medium::evalCollisionEmission(const Point3f &) const {
+	return Color3f(0.0f);
+}
+
+float Medium::sampleEmissionPosition(const Point2f &, Point3f &) const {
+	return 0.0f;
+}
+
+float Medium::pdfEmissionPosition(const Point3f &) const {
+	return 0.0f;
+}
+
+float Medium::getEmittedPower() const {
+	return 0.0f;
+}
+
+void MediumStack::leave(const Medium *medium) {
+	/* Remove the innermost occurrence, but never the exterior medium */
+	for (int i=m_size-1; i>0; --i) {
+		if (m_media[i] == medium) {
+			for (int j=i; j<m_size-1; ++j)
+				m_media[j] = m_media[j+1];
+			--m_size;
+			return;
+		}
+	}
+}
+
+void MediumStack::update(Intersection &its, const Vector3f &d) {
+	const Medium *medium = its.mesh->getInteriorMedium();
+	if (!medium)
+		return;
+
+	its.computeDifferentialGeometry();
+	if (its.geoFrame.n.dot(d) < 0)
+		enter(medium);
+	else
+		leave(medium);
 }
 
 NORI_NAMESPACE_END
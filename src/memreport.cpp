@@ -0,0 +1,107 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/memreport.h>
+#include <fstream>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+void MemoryReport::add(const QString &category, size_t bytes, size_t mappedBytes) {
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		if (m_entries[i].category == category) {
+			m_entries[i].resident += bytes;
+			m_entries[i].mapped += mappedBytes;
+			return;
+		}
+	}
+	Entry entry;
+	entry.category = category;
+	entry.resident = bytes;
+	entry.mapped = mappedBytes;
+	m_entries.push_back(entry);
+}
+
+size_t MemoryReport::getResident(const QString &category) const {
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		if (m_entries[i].category == category)
+			return m_entries[i].resident;
+	}
+	return 0;
+}
+
+size_t MemoryReport::getTotalResident() const {
+	size_t result = 0;
+	for (size_t i=0; i<m_entries.size(); ++i)
+		result += m_entries[i].resident;
+	return result;
+}
+
+size_t MemoryReport::getTotalMapped() const {
+	size_t result = 0;
+	for (size_t i=0; i<m_entries.size(); ++i)
+		result += m_entries[i].mapped;
+	return result;
+}
+
+void MemoryReport::save(const QString &filename) const {
+	std::ofstream out(filename.toLocal8Bit().data());
+	if (!out)
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(filename));
+	out << toJSON() << std::endl;
+	out.close();
+	if (!out)
+		throw NoriException(QString("Unable to write \"%1\"").arg(filename));
+}
+
+std::string MemoryReport::toJSON() const {
+	std::ostringstream out;
+	out << "{" << std::endl
+		<< "  \"resident\": " << getTotalResident() << "," << std::endl
+		<< "  \"mapped\": " << getTotalMapped() << "," << std::endl
+		<< "  \"categories\": {";
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		out << (i > 0 ? "," : "") << std::endl
+			<< "    " << toJSONString(m_entries[i].category)
+			<< ": {\"resident\": " << m_entries[i].resident
+			<< ", \"mapped\": " << m_entries[i].mapped << "}";
+	}
+	out << std::endl << "  }" << std::endl << "}";
+	return out.str();
+}
+
+QString MemoryReport::toString() const {
+	QString result;
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		const Entry &entry = m_entries[i];
+		if (entry.resident == 0 && entry.mapped == 0)
+			continue;
+		result += QString("  %1 %2 MiB").arg(entry.category, -16)
+			.arg(entry.resident / (1024.0 * 1024.0), 10, 'f', 1);
+		if (entry.mapped > 0)
+			result += QString(" (+ %1 MiB mapped)").arg(entry.mapped / (1024.0 * 1024.0), 0, 'f', 1);
+		result += "\n";
+	}
+	result += QString("  %1 %2 MiB").arg("total", -16)
+		.arg(getTotalResident() / (1024.0 * 1024.0), 10, 'f', 1);
+	if (getTotalMapped() > 0)
+		result += QString(" (+ %1 MiB mapped)").arg(getTotalMapped() / (1024.0 * 1024.0), 0, 'f', 1);
+	return result;
+}
+
+NORI_NAMESPACE_END
@@ -19,36 +19,69 @@
 #include <nori/mesh.h>
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
+#include <nori/medium.h>
+#include <nori/luminaire.h>
+#include <nori/texture.h>
+#include <nori/profiler.h>
+#include <nori/memreport.h>
 #include <Eigen/Geometry>
+#include <QThread>
+
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
 
 #define NORI_TRICLIP_MAXVERTS 10
 
 NORI_NAMESPACE_BEGIN
 
 Mesh::Mesh() : m_vertexPositions(0), m_vertexNormals(0),
-  m_vertexTexCoords(0), m_indices(0), m_vertexCount(0),
-  m_triangleCount(0), m_bsdf(NULL) { }
+  m_vertexTexCoords(0), m_packedNormals(NULL), m_packedTexCoords(NULL),
+  m_compressAttributes(false), m_indices(0), m_packedTriangles(NULL), m_emitterTriangles(NULL),
+  m_packTriangles(false), m_faceFrames(NULL), m_vertexCount(0), m_triangleCount(0), m_bsdf(NULL), 
+  m_interiorMedium(NULL), m_luminaire(NULL), m_alphaMask(NULL), m_id(0) { }
 
 Mesh::~Mesh() {
-	delete[] m_vertexPositions;
+	freeLarge(m_vertexPositions);
 	if (m_vertexNormals)
 		delete[] m_vertexNormals;
 	if (m_vertexTexCoords)
 		delete[] m_vertexTexCoords;
-	delete[] m_indices;
+	if (m_packedNormals)
+		delete[] m_packedNormals;
+	if (m_packedTexCoords)
+		delete[] m_packedTexCoords;
+	freeLarge(m_indices);
+	if (m_packedTriangles)
+		freeLarge(m_packedTriangles);
+	if (m_emitterTriangles)
+		freeAligned(m_emitterTriangles);
+	if (m_faceFrames)
+		delete[] m_faceFrames;
 
 	if (m_bsdf)
 		delete m_bsdf;
+	if (m_interiorMedium)
+		delete m_interiorMedium;
+	if (m_luminaire)
+		delete m_luminaire;
+	if (m_alphaMask)
+		delete m_alphaMask;
 }
 
 void Mesh::activate() {
-	/* Create a discrete distribution for sampling triangles
-	   with respect to their surface area */
-	m_distr.clear();
-	m_distr.reserve(m_triangleCount);
-	for (uint32_t i=0; i<m_triangleCount; ++i)
-		m_distr.append(surfaceArea(i));
-	m_distr.normalize();
+	ProfileScope scope("Mesh::activate", "load");
+	if (scope.isActive())
+		scope.setDetail(getName());
+	computeAreaDistribution();
+	if (m_packTriangles)
+		packTriangles();
+	if (m_compressAttributes)
+		compressAttributes();
+	if (!hasVertexNormals())
+		computeFaceFrames();
+	if (m_luminaire)
+		buildEmitterTable();
 
 	if (!m_bsdf) {
 		/* If no material was assigned, instantiate a diffuse BRDF */
@@ -57,9 +90,341 @@ void Mesh::activate() {
 	}
 }
 
+/**
+ * \brief Helper thread of \ref Mesh::computeAreaDistribution(), which
+ * processes every \c step-th chunk of triangles starting at \c start
+ *
+ * The first pass stores the running sums of the triangle areas within
+ * each chunk and its total, the second one adds the offset of each chunk
+ * (i.e. the total of the chunks before it) to its running sums.
+ */
+class AreaThread : public QThread {
+public:
+	AreaThread(const Mesh *mesh, float *cdf, float *chunkSums, bool offsetPass,
+		uint32_t start, uint32_t step) : m_mesh(mesh), m_cdf(cdf), m_chunkSums(chunkSums),
+		m_offsetPass(offsetPass), m_start(start), m_step(step) { }
+
+	void run() {
+		uint32_t triangleCount = m_mesh->getTriangleCount(),
+		         chunkCount = (triangleCount + NORI_MESH_AREA_CHUNK - 1) / NORI_MESH_AREA_CHUNK;
+		for (uint32_t chunk=m_start; chunk<chunkCount; chunk+=m_step) {
+			uint32_t begin = chunk * NORI_MESH_AREA_CHUNK,
+			         end = std::min(begin + NORI_MESH_AREA_CHUNK, triangleCount);
+			if (!m_offsetPass) {
+				float sum = 0.0f;
+				for (uint32_t i=begin; i<end; ++i) {
+					sum += m_mesh->surfaceArea(i);
+					m_cdf[i+1] = sum;
+				}
+				m_chunkSums[chunk] = sum;
+			} else {
+				float offset = m_chunkSums[chunk];
+				for (uint32_t i=begin; i<end; ++i)
+					m_cdf[i+1] += offset;
+			}
+		}
+	}
+private:
+	const Mesh *m_mesh;
+	float *m_cdf, *m_chunkSums;
+	bool m_offsetPass;
+	uint32_t m_start, m_step;
+};
+
+/// Run a pass of \ref AreaThread over all chunks using \c threadCount threads
+static void runAreaThreads(const Mesh *mesh, float *cdf, float *chunkSums,
+		bool offsetPass, int threadCount) {
+	std::vector<AreaThread *> threads;
+	for (int i=1; i<threadCount; ++i) {
+		threads.push_back(new AreaThread(mesh, cdf, chunkSums, offsetPass, i, threadCount));
+		threads.back()->start();
+	}
+	AreaThread(mesh, cdf, chunkSums, offsetPass, 0, threadCount).run();
+	for (size_t i=0; i<threads.size(); ++i) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+void Mesh::computeAreaDistribution() {
+	/* Create a discrete distribution for sampling triangles with
+	   respect to their surface area (a parallel prefix sum of the 
+	   areas, see the header). A mesh with a single chunk is summed 
+	   up sequentially on this thread */
+	m_distr.resize(m_triangleCount);
+	float *cdf = m_distr.getCDF();
+	uint32_t chunkCount = (m_triangleCount + NORI_MESH_AREA_CHUNK - 1) / NORI_MESH_AREA_CHUNK;
+	std::vector<float> chunkSums(std::max(chunkCount, (uint32_t) 1));
+	int threadCount = std::max(1, std::min(getCoreCount(), (int) chunkCount));
+	runAreaThreads(this, cdf, &chunkSums[0], false, threadCount);
+
+	if (chunkCount > 1) {
+		/* Turn the totals of the chunks into their offsets */
+		float offset = 0.0f;
+		for (uint32_t i=0; i<chunkCount; ++i) {
+			float sum = chunkSums[i];
+			chunkSums[i] = offset;
+			offset += sum;
+		}
+		runAreaThreads(this, cdf, &chunkSums[0], true, threadCount);
+	}
+	m_distr.normalize();
+}
+
+void Mesh::setVertexPositions(const Point3f *positions, const Normal3f *normals) {
+	memcpy(m_vertexPositions, positions, sizeof(Point3f) * m_vertexCount);
+	if (normals && m_vertexNormals)
+		memcpy(m_vertexNormals, normals, sizeof(Normal3f) * m_vertexCount);
+	else if (normals && m_packedNormals)
+		for (uint32_t i=0; i<m_vertexCount; ++i)
+			m_packedNormals[i] = encodeNormal(normals[i]);
+	computeAreaDistribution();
+	if (m_packedTriangles)
+		packTriangles();
+	if (m_faceFrames)
+		computeFaceFrames();
+	if (m_emitterTriangles)
+		buildEmitterTable();
+}
+
+void Mesh::reportMemory(MemoryReport &report) const {
+	/* Arrays of a mapped mesh that were not replaced (e.g. by
+	   compressed attributes) still belong to the mapping */
+	bool mapped = isMapped();
+	size_t positions = m_vertexPositions ? m_vertexCount * sizeof(Point3f) : 0,
+	       normals = m_vertexNormals ? m_vertexCount * sizeof(Normal3f) : 0,
+	       texCoords = m_vertexTexCoords ? m_vertexCount * sizeof(Point2f) : 0,
+	       indices = m_indices ? 3 * (size_t) m_triangleCount * sizeof(uint32_t) : 0;
+	report.add("meshPositions", mapped ? 0 : positions, mapped ? positions : 0);
+	report.add("meshNormals", (mapped ? 0 : normals)
+		+ (m_packedNormals ? m_vertexCount * sizeof(uint32_t) : 0), mapped ? normals : 0);
+	report.add("meshTexCoords", (mapped ? 0 : texCoords)
+		+ (m_packedTexCoords ? m_vertexCount * sizeof(uint32_t) : 0), mapped ? texCoords : 0);
+	report.add("meshIndices", mapped ? 0 : indices, mapped ? indices : 0);
+
+	size_t triangles = 0;
+	if (m_packedTriangles)
+		triangles += m_triangleCount * sizeof(PackedTriangle);
+	if (m_faceFrames)
+		triangles += m_triangleCount * sizeof(Frame);
+	if (m_emitterTriangles)
+		triangles += m_triangleCount * sizeof(EmitterTriangle);
+	report.add("meshTriangles", triangles);
+	report.add("pdfTables", m_distr.getMemoryUsage());
+}
+
+void Mesh::packTriangles() {
+	if (!m_packedTriangles)
+		m_packedTriangles = static_cast<PackedTriangle *>(allocLarge(
+			sizeof(PackedTriangle) * std::max(m_triangleCount, (uint32_t) 1)));
+
+	for (uint32_t i=0; i<m_triangleCount; ++i) {
+		const Point3f
+			&p0 = m_vertexPositions[m_indices[3*i]],
+			&p1 = m_vertexPositions[m_indices[3*i+1]],
+			&p2 = m_vertexPositions[m_indices[3*i+2]];
+		Vector3f e1 = p1 - p0, e2 = p2 - p0;
+
+		PackedTriangle &tri = m_packedTriangles[i];
+		for (int k=0; k<3; ++k) {
+			tri.p0[k] = p0[k];
+			tri.e1[k] = e1[k];
+			tri.e2[k] = e2[k];
+		}
+		tri.p0[3] = tri.e1[3] = tri.e2[3] = 0.0f;
+	}
+}
+
+void Mesh::computeFaceFrames() {
+	if (!m_faceFrames)
+		m_faceFrames = new Frame[std::max(m_triangleCount, (uint32_t) 1)];
+
+	for (uint32_t i=0; i<m_triangleCount; ++i) {
+		const Point3f
+			&p0 = m_vertexPositions[m_indices[3*i]],
+			&p1 = m_vertexPositions[m_indices[3*i+1]],
+			&p2 = m_vertexPositions[m_indices[3*i+2]];
+		m_faceFrames[i] = Frame((p1-p0).cross(p2-p0).normalized());
+	}
+}
+
+/// Spread the lower 10 bits of a value so that there are two zero bits between each one
+static inline uint64_t spreadBits(uint32_t value) {
+	uint64_t x = value & 0x3FF;
+	x = (x | (x << 16)) & 0x30000FF;
+	x = (x | (x << 8))  & 0x300F00F;
+	x = (x | (x << 4))  & 0x30C30C3;
+	x = (x | (x << 2))  & 0x9249249;
+	return x;
+}
+
+void Mesh::computeLocalityOrder(std::vector<uint32_t> &indices,
+		std::vector<uint32_t> &vertexOrder) const {
+	/* Order the triangles along a Morton curve through their centroids,
+	   and the vertices in the order of their first use */
+	BoundingBox3f bbox;
+	for (uint32_t i=0; i<m_vertexCount; ++i)
+		bbox.expandBy(m_vertexPositions[i]);
+	Vector3f extents = bbox.getExtents(), scale;
+	for (int k=0; k<3; ++k)
+		scale[k] = extents[k] > 0 ? 1023 / extents[k] : 0.0f;
+
+	std::vector<std::pair<uint64_t, uint32_t> > keys(m_triangleCount);
+	for (uint32_t i=0; i<m_triangleCount; ++i) {
+		Point3f center = (m_vertexPositions[m_indices[3*i]] + m_vertexPositions[m_indices[3*i+1]]
+			+ m_vertexPositions[m_indices[3*i+2]]) * (1.0f / 3.0f);
+		uint32_t cell[3];
+		for (int k=0; k<3; ++k)
+			cell[k] = (uint32_t) std::max(0, std::min((int) ((center[k] - bbox.min[k]) * scale[k]), 1023));
+		keys[i] = std::make_pair((spreadBits(cell[0]) << 2)
+			| (spreadBits(cell[1]) << 1) | spreadBits(cell[2]), i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	const uint32_t unused = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> vertexMap(m_vertexCount, unused);
+	indices.resize(3 * (size_t) m_triangleCount);
+	vertexOrder.clear();
+	vertexOrder.reserve(m_vertexCount);
+	for (uint32_t i=0; i<m_triangleCount; ++i) {
+		for (int k=0; k<3; ++k) {
+			uint32_t vertex = m_indices[3*keys[i].second + k];
+			if (vertexMap[vertex] == unused) {
+				vertexMap[vertex] = (uint32_t) vertexOrder.size();
+				vertexOrder.push_back(vertex);
+			}
+			indices[3*i + k] = vertexMap[vertex];
+		}
+	}
+	for (uint32_t i=0; i<m_vertexCount; ++i) {
+		/* Keep unreferenced vertices at the end */
+		if (vertexMap[i] == unused)
+			vertexOrder.push_back(i);
+	}
+
+}
+
+/// Apply a vertex permutation to an (optional) per-vertex array
+template <typename T> static void permuteVertices(T *data, const std::vector<uint32_t> &order) {
+	if (!data || order.empty())
+		return;
+	std::vector<T> tmp(data, data + order.size());
+	for (size_t i=0; i<order.size(); ++i)
+		data[i] = tmp[order[i]];
+}
+
+void Mesh::reorderForLocality() {
+	std::vector<uint32_t> indices, vertexOrder;
+	computeLocalityOrder(indices, vertexOrder);
+
+	if (!indices.empty())
+		memcpy(m_indices, &indices[0], sizeof(uint32_t) * indices.size());
+	permuteVertices(m_vertexPositions, vertexOrder);
+	permuteVertices(m_vertexNormals, vertexOrder);
+	permuteVertices(m_vertexTexCoords, vertexOrder);
+	permuteVertices(m_packedNormals, vertexOrder);
+	permuteVertices(m_packedTexCoords, vertexOrder);
+}
+
+void Mesh::compressAttributes() {
+	if (m_vertexNormals) {
+		m_packedNormals = new uint32_t[std::max(m_vertexCount, (uint32_t) 1)];
+		for (uint32_t i=0; i<m_vertexCount; ++i) {
+			/* Vertices without a normal in the OBJ file have a zero one */
+			const Normal3f &n = m_vertexNormals[i];
+			m_packedNormals[i] = encodeNormal(n.isZero() ? Normal3f(0.0f, 0.0f, 1.0f) : n);
+		}
+		delete[] m_vertexNormals;
+		m_vertexNormals = NULL;
+	}
+
+	if (m_vertexTexCoords) {
+		/* Quantize relative to the bounding rectangle of all coordinates */
+		Point2f min = Point2f::Constant( std::numeric_limits<float>::infinity()),
+		        max = Point2f::Constant(-std::numeric_limits<float>::infinity());
+		for (uint32_t i=0; i<m_vertexCount; ++i) {
+			min = min.cwiseMin(m_vertexTexCoords[i]);
+			max = max.cwiseMax(m_vertexTexCoords[i]);
+		}
+		if (m_vertexCount == 0)
+			min = max = Point2f::Zero();
+		m_texCoordOffset = min;
+		m_texCoordScale = (max - min) / 65535.0f;
+
+		m_packedTexCoords = new uint32_t[std::max(m_vertexCount, (uint32_t) 1)];
+		for (uint32_t i=0; i<m_vertexCount; ++i) {
+			uint32_t q[2];
+			for (int k=0; k<2; ++k)
+				q[k] = m_texCoordScale[k] > 0 ? (uint32_t) std::min(65535.0f,
+					(m_vertexTexCoords[i][k] - min[k]) / m_texCoordScale[k] + 0.5f) : 0;
+			m_packedTexCoords[i] = q[0] | (q[1] << 16);
+		}
+		delete[] m_vertexTexCoords;
+		m_vertexTexCoords = NULL;
+	}
+}
+
+void Mesh::buildEmitterTable() {
+	if (!m_emitterTriangles)
+		m_emitterTriangles = static_cast<EmitterTriangle *>(allocAligned(
+			sizeof(EmitterTriangle) * std::max(m_triangleCount, (uint32_t) 1)));
+
+	for (uint32_t i=0; i<m_triangleCount; ++i) {
+		const uint32_t *idx = m_indices + 3*i;
+		const Point3f
+			&p0 = m_vertexPositions[idx[0]],
+			&p1 = m_vertexPositions[idx[1]],
+			&p2 = m_vertexPositions[idx[2]];
+		Vector3f e1 = p1 - p0, e2 = p2 - p0;
+		Normal3f faceNormal = e1.cross(e2).normalized();
+
+		EmitterTriangle &tri = m_emitterTriangles[i];
+		for (int k=0; k<3; ++k) {
+			tri.p0[k] = p0[k];
+			tri.e1[k] = e1[k];
+			tri.e2[k] = e2[k];
+			tri.n[k] = encodeNormal(hasVertexNormals() ?
+				getVertexNormal(idx[k]) : faceNormal);
+		}
+		tri.area = surfaceArea(i);
+		m_distr.getAliasEntry(i, tri.aliasProb, tri.alias);
+		tri.unused = 0;
+	}
+}
+
+void Mesh::sampleTrianglePosition(uint32_t index, const Point2f &sample,
+		Point3f &p, Normal3f &n) const {
+	const EmitterTriangle *tri = m_emitterTriangles + index;
+	Point2f b = squareToUniformTriangle(sample);
+	float b0 = 1.0f - b.x() - b.y();
+	p = Point3f(
+		tri->p0[0] + tri->e1[0] * b.x() + tri->e2[0] * b.y(),
+		tri->p0[1] + tri->e1[1] * b.x() + tri->e2[1] * b.y(),
+		tri->p0[2] + tri->e1[2] * b.x() + tri->e2[2] * b.y());
+	n = (decodeNormal(tri->n[0]) * b0 + decodeNormal(tri->n[1]) * b.x()
+		+ decodeNormal(tri->n[2]) * b.y()).normalized();
+}
+
 void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const {
 	Point2f sample(_sample);
 
+	if (m_emitterTriangles) {
+		/* Choose a triangle using the alias table cells in the records */
+		float scaled = sample.x() * m_triangleCount;
+		uint32_t index = std::min((uint32_t) std::max(scaled, 0.0f), m_triangleCount - 1);
+		float remainder = std::min(std::max(scaled - index, 0.0f), OneMinusEpsilon);
+		const EmitterTriangle *tri = m_emitterTriangles + index;
+		if (remainder < tri->aliasProb) {
+			sample.x() = remainder / tri->aliasProb;
+		} else {
+			sample.x() = std::min((remainder - tri->aliasProb)
+				/ (1.0f - tri->aliasProb), OneMinusEpsilon);
+			tri = m_emitterTriangles + tri->alias;
+		}
+		sampleTrianglePosition((uint32_t) (tri - m_emitterTriangles), sample, p, n);
+		return;
+	}
+
 	/* First, sample a triangle with respect to surface area */
 	size_t index = m_distr.sampleReuse(sample.x());
 
@@ -79,11 +444,11 @@ void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const
 	p = p0 * (1.0f - b.x() - b.y()) + p1 * b.x() + p2 * b.y();
 
 	/* Also provide a normal (interpolated if vertex normals are provided) */
-	if (m_vertexNormals) {
-		const Normal3f 
-			&n0 = m_vertexNormals[i0],
-			&n1 = m_vertexNormals[i1],
-			&n2 = m_vertexNormals[i2];
+	if (hasVertexNormals()) {
+		Normal3f
+			n0 = getVertexNormal(i0),
+			n1 = getVertexNormal(i1),
+			n2 = getVertexNormal(i2);
 		n = (n0 * (1.0f - b.x() - b.y()) + n1 * b.x() + n2 * b.y()).normalized();
 	} else {
 		n = (p1-p0).cross(p2-p0).normalized();
@@ -104,17 +469,26 @@ float Mesh::surfaceArea(uint32_t index) const {
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-	int i0 = m_indices[3*index],
-		i1 = m_indices[3*index+1],
-		i2 = m_indices[3*index+2];
+	Point3f p0;
+	Vector3f edge1, edge2;
+
+	if (m_packedTriangles) {
+		/* Use the pre-gathered vertex data */
+		const PackedTriangle &tri = m_packedTriangles[index];
+		p0 = Point3f(tri.p0[0], tri.p0[1], tri.p0[2]);
+		edge1 = Vector3f(tri.e1[0], tri.e1[1], tri.e1[2]);
+		edge2 = Vector3f(tri.e2[0], tri.e2[1], tri.e2[2]);
+	} else {
+		int i0 = m_indices[3*index],
+			i1 = m_indices[3*index+1],
+			i2 = m_indices[3*index+2];
 
-	const Point3f
-		&p0 = m_vertexPositions[i0],
-		&p1 = m_vertexPositions[i1],
-		&p2 = m_vertexPositions[i2];
+		p0 = m_vertexPositions[i0];
 
-	/* find vectors for two edges sharing v[0] */
-	Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+		/* find vectors for two edges sharing v[0] */
+		edge1 = m_vertexPositions[i1] - p0;
+		edge2 = m_vertexPositions[i2] - p0;
+	}
 
 	/* begin calculating determinant - also used to calculate U parameter */
 	Vector3f pvec = ray.d.cross(edge2);
@@ -155,6 +529,105 @@ BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
 	return result;
 }
 
+#if defined(NORI_SSE)
+/**
+ * \brief Vertex of a polygon clipped by getClippedBoundingBox(), whose
+ * coordinates are stored in two SSE registers (x/y and z/unused)
+ */
+union ClipVertex {
+	__m128d v[2];
+	double c[4];
+};
+
+/// Compute the bounds of a clipped polygon
+static inline void clipBounds(const ClipVertex *vertices, int count,
+		ClipVertex &lo, ClipVertex &hi) {
+	lo = hi = vertices[0];
+	for (int i=1; i<count; ++i) {
+		lo.v[0] = _mm_min_pd(lo.v[0], vertices[i].v[0]);
+		lo.v[1] = _mm_min_pd(lo.v[1], vertices[i].v[1]);
+		hi.v[0] = _mm_max_pd(hi.v[0], vertices[i].v[0]);
+		hi.v[1] = _mm_max_pd(hi.v[1], vertices[i].v[1]);
+	}
+}
+
+/// Internally used by getClippedBoundingBox()
+static int sutherlandHodgman(const ClipVertex *input, int inCount, ClipVertex *output,
+		int axis, double splitPos, bool isMinimum) {
+	const double sign = isMinimum ? 1.0 : -1.0;
+	const ClipVertex *cur = &input[inCount-1];
+	bool curIsInside = sign * (cur->c[axis] - splitPos) >= 0;
+	int outCount = 0;
+
+	for (int i=0; i<inCount; ++i) {
+		const ClipVertex *next = &input[i];
+		bool nextIsInside = sign * (next->c[axis] - splitPos) >= 0;
+
+		if (curIsInside != nextIsInside) {
+			/* Crossing the plane -- add the intersection */
+			__m128d t = _mm_set1_pd((splitPos - cur->c[axis]) / (next->c[axis] - cur->c[axis]));
+			assert(outCount + 1 < NORI_TRICLIP_MAXVERTS);
+			ClipVertex &p = output[outCount++];
+			p.v[0] = _mm_add_pd(cur->v[0], _mm_mul_pd(_mm_sub_pd(next->v[0], cur->v[0]), t));
+			p.v[1] = _mm_add_pd(cur->v[1], _mm_mul_pd(_mm_sub_pd(next->v[1], cur->v[1]), t));
+			p.c[axis] = splitPos; // Avoid roundoff errors
+		}
+		if (nextIsInside) {
+			assert(outCount + 1 < NORI_TRICLIP_MAXVERTS);
+			output[outCount++] = *next;
+		}
+		cur = next;
+		curIsInside = nextIsInside;
+	}
+	return outCount;
+}
+
+BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &bbox) const {
+	/* Reserve room for some additional vertices */
+	ClipVertex vertices[2][NORI_TRICLIP_MAXVERTS];
+	int nVertices = 3, current = 0;
+
+	/* The kd-tree code will frequently call this function with
+	   almost-collapsed bounding boxes. It's extremely important not to introduce
+	   errors in such cases, otherwise the resulting tree will incorrectly
+	   remove triangles from the associated nodes. Hence, do the
+	   following computation in double precision (two lanes per register) */
+	for (int i=0; i<3; ++i) {
+		const Point3f &p = m_vertexPositions[m_indices[3*index+i]];
+		vertices[0][i].v[0] = _mm_setr_pd(p.x(), p.y());
+		vertices[0][i].v[1] = _mm_setr_pd(p.z(), 0.0);
+	}
+
+	/* Planes that don't cross the polygon leave it unchanged and are skipped
+	   (usually, only one or two of them intersect a straddling triangle) */
+	ClipVertex lo, hi;
+	clipBounds(vertices[0], nVertices, lo, hi);
+	for (int axis=0; axis<3; ++axis) {
+		for (int side=0; side<2; ++side) {
+			/* Degenerate polygons are discarded, like an empty one */
+			if (nVertices < 3)
+				return BoundingBox3f();
+
+			double splitPos = side == 0 ? bbox.min[axis] : bbox.max[axis];
+			if (side == 0 ? lo.c[axis] >= splitPos : hi.c[axis] <= splitPos)
+				continue;
+			nVertices = sutherlandHodgman(vertices[current], nVertices,
+				vertices[1-current], axis, splitPos, side == 0);
+			current = 1-current;
+			if (nVertices > 0)
+				clipBounds(vertices[current], nVertices, lo, hi);
+		}
+	}
+
+	if (nVertices == 0)
+		return BoundingBox3f();
+	BoundingBox3f result(
+		Point3f((float) lo.c[0], (float) lo.c[1], (float) lo.c[2]),
+		Point3f((float) hi.c[0], (float) hi.c[1], (float) hi.c[2]));
+	result.clip(bbox);
+	return result;
+}
+#else
 /// Internally used by getClippedBoundingBox()
 static int sutherlandHodgman(Point3d *input, int inCount, Point3d *output, int axis, 
 		double splitPos, bool isMinimum) {
@@ -227,6 +700,41 @@ BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &b
 	result.clip(bbox);
 	return result;
 }
+#endif
+
+/// Finalizer of the SplitMix64 generator (see \ref Mesh::evalAlphaTest())
+static inline uint64_t mixBits(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+bool Mesh::evalAlphaTest(uint32_t index, float u, float v, const Ray3f &ray,
+		bool shadowRay) const {
+	Point2f uv(u, v);
+	if (hasVertexTexCoords()) {
+		const uint32_t *idx = m_indices + 3*index;
+		uv = getVertexTexCoord(idx[0]) * (1 - u - v)
+			+ getVertexTexCoord(idx[1]) * u + getVertexTexCoord(idx[2]) * v;
+	}
+	float alpha = m_alphaMask->eval(uv).getLuminance();
+	if (!shadowRay)
+		return alpha >= 0.5f;
+	if (alpha >= 1)
+		return true;
+	if (alpha <= 0)
+		return false;
+
+	/* Hash the ray and the triangle into a uniform number in [0, 1) */
+	uint32_t bits[7];
+	memcpy(bits, ray.o.data(), 3 * sizeof(float));
+	memcpy(bits + 3, ray.d.data(), 3 * sizeof(float));
+	bits[6] = index;
+	uint64_t hash = m_id;
+	for (int i=0; i<7; ++i)
+		hash = mixBits(hash ^ (bits[i] + 0x9e3779b97f4a7c15ULL));
+	return (hash >> 40) * (1.0f / (1 << 24)) < alpha;
+}
 
 void Mesh::addChild(NoriObject *obj) {
 	switch (obj->getClassType()) {
@@ -236,6 +744,24 @@ void Mesh::addChild(NoriObject *obj) {
 			m_bsdf = static_cast<BSDF *>(obj);
 			break;
 
+		case EMedium:
+			if (m_interiorMedium)
+				throw NoriException("Mesh: tried to register multiple interior media!");
+			m_interiorMedium = static_cast<Medium *>(obj);
+			break;
+
+		case ELuminaire:
+			if (m_luminaire)
+				throw NoriException("Mesh: tried to register multiple luminaires!");
+			m_luminaire = static_cast<Luminaire *>(obj);
+			break;
+
+		case ETexture:
+			if (m_alphaMask)
+				throw NoriException("Mesh: tried to register multiple alpha masks!");
+			m_alphaMask = static_cast<Texture *>(obj);
+			break;
+
 		default:
 			throw NoriException(QString("Mesh::addChild(<%1>) is not supported!").arg(
 				classTypeName(obj->getClassType())));
@@ -248,14 +774,203 @@ QString Mesh::toString() const {
 		"  name = \"%1\",\n"
 		"  vertexCount = %2,\n"
 		"  triangleCount = %3,\n"
-		"  bsdf = %4\n"
+		"  bsdf = %4,\n"
+		"  interiorMedium = %5,\n"
+		"  luminaire = %6,\n"
+		"  alphaMask = %7\n"
 		"]")
 	.arg(m_name)
 	.arg(m_vertexCount)
 	.arg(m_triangleCount)
-	.arg(indent(m_bsdf->toString()));
+	.arg(indent(m_bsdf->toString()))
+	.arg(m_interiorMedium ? indent(m_interiorMedium->toString()) : QString("null"))
+	.arg(m_luminaire ? indent(m_luminaire->toString()) : QString("null"))
+	.arg(m_alphaMask ? indent(m_alphaMask->toString()) : QString("null"));
 }
 
+void Intersection::computeDifferentialGeometryInternal(bool buildFrames) {
+	/* Find the barycentric coordinates */
+	Vector3f b;
+	b << 1-bary.sum(), bary;
+
+	/* Look up the vertex indices */
+	const uint32_t *indices = mesh->getIndices(),
+			  idx0 = indices[3*primIndex+0],
+			  idx1 = indices[3*primIndex+1],
+			  idx2 = indices[3*primIndex+2];
+
+	const Point3f  *positions = mesh->getVertexPositions();
+	bool normals   = mesh->hasVertexNormals(),
+	     texCoords = mesh->hasVertexTexCoords();
+
+	Point3f p0 = positions[idx0],
+		p1 = positions[idx1],
+		p2 = positions[idx2];
+
+	/* Compute the intersection positon accurately 
+	   using barycentric coordinates */
+	p = b.x() * p0 + b.y() * p1 + b.z() * p2;
+
+	/* Compute proper texture coordinates if provided by the mesh */
+	Vector2f duv1 = Vector2f(1.0f, 0.0f), duv2 = Vector2f(0.0f, 1.0f);
+	if (texCoords) {
+		Point2f uv0 = mesh->getVertexTexCoord(idx0),
+		        uv1 = mesh->getVertexTexCoord(idx1),
+		        uv2 = mesh->getVertexTexCoord(idx2);
+		uv = b.x() * uv0 + b.y() * uv1 + b.z() * uv2;
+
+		/* Partial derivatives of the position wrt. the texture coordinates */
+		duv1 = uv1 - uv0;
+		duv2 = uv2 - uv0;
+	} else {
+		uv = bary;
+	}
+	float det = duv1.x() * duv2.y() - duv1.y() * duv2.x();
+	if (std::abs(det) > 1e-12f) {
+		float invDet = 1.0f / det;
+		dpdu = ((p1 - p0) * duv2.y() - (p2 - p0) * duv1.y()) * invDet;
+		dpdv = ((p2 - p0) * duv1.x() - (p1 - p0) * duv2.x()) * invDet;
+	} else {
+		/* Degenerate parameterization */
+		dpdu = dpdv = Vector3f::Zero();
+	}
+	dpdx = dpdy = Vector3f::Zero();
+	uvWidth = 0.0f;
+
+	/* Compute the geometry frame (precomputed by meshes without normals) */
+	const Frame *faceFrames = mesh->getFaceFrames();
+	Normal3f geoNormal = faceFrames ? faceFrames[primIndex].n
+		: Normal3f((p1-p0).cross(p2-p0).normalized());
+
+	/* Compute the shading frame. Note that for simplicity,
+	   the current implementation doesn't attempt to provide
+	   tangents that are continuous across the surface. That
+	   means that this code will need to be modified to be able
+	   use anisotropic BRDFs, which need tangent continuity */
+	Normal3f shNormal = geoNormal;
+	if (normals)
+		shNormal = (b.x() * mesh->getVertexNormal(idx0) +
+			 b.y() * mesh->getVertexNormal(idx1) +
+			 b.z() * mesh->getVertexNormal(idx2)).normalized();
+
+	/* Transform intersections with instances into world space */
+	if (toWorldTrafo) {
+		const Transform &trafo = *toWorldTrafo;
+		p = trafo * p;
+		geoNormal = (trafo * geoNormal).normalized();
+		shNormal = normals ? Normal3f((trafo * shNormal).normalized()) : geoNormal;
+		dpdu = trafo * dpdu;
+		dpdv = trafo * dpdv;
+	} else if (faceFrames) {
+		/* Nothing left to compute */
+		geoFrame = shFrame = faceFrames[primIndex];
+		hasDifferentials = true;
+		return;
+	}
+
+	geoFrame.n = geoNormal;
+	shFrame.n = shNormal;
+	if (buildFrames) {
+		coordinateSystem(geoFrame.n, geoFrame.s, geoFrame.t);
+		if (normals)
+			coordinateSystem(shFrame.n, shFrame.s, shFrame.t);
+		else
+			shFrame = geoFrame;
+	}
+
+	hasDifferentials = true;
+}
+
+/// Complete a list of frames whose normals are set, and copy some of them
+static void completeFrames(Frame **frames, Frame **copies, Vector3f *n,
+		Vector3f *s, Vector3f *t, uint32_t count) {
+	coordinateSystem(n, s, t, count);
+	for (uint32_t i=0; i<count; ++i) {
+		frames[i]->s = s[i];
+		frames[i]->t = t[i];
+		if (copies[i])
+			*copies[i] = *frames[i];
+	}
+}
+
+void Intersection::computeDifferentialGeometry(Intersection *its,
+		const uint32_t *indices, uint32_t count) {
+	/* Frames whose normals are known, and frames that equal them */
+	const uint32_t batchSize = 64;
+	Frame *frames[batchSize], *copies[batchSize];
+	Vector3f n[batchSize], s[batchSize], t[batchSize];
+	uint32_t pending = 0;
+
+	for (uint32_t i=0; i<count; ++i) {
+		Intersection &it = its[indices[i]];
+		if (it.hasDifferentials)
+			continue;
+		it.computeDifferentialGeometryInternal(false);
+
+		/* Meshes without normals provide complete frames (unless instanced) */
+		bool smooth = it.mesh->hasVertexNormals();
+		if (it.mesh->getFaceFrames() && !it.toWorldTrafo)
+			continue;
+		frames[pending] = &it.geoFrame;
+		copies[pending] = smooth ? NULL : &it.shFrame;
+		n[pending++] = it.geoFrame.n;
+		if (smooth) {
+			frames[pending] = &it.shFrame;
+			copies[pending] = NULL;
+			n[pending++] = it.shFrame.n;
+		}
+
+		if (pending + 2 > batchSize) {
+			completeFrames(frames, copies, n, s, t, pending);
+			pending = 0;
+		}
+	}
+	completeFrames(frames, copies, n, s, t, pending);
+}
+
+void Intersection::computeFootprint(const Ray3f &ray) {
+	dpdx = dpdy = Vector3f::Zero();
+	uvWidth = 0.0f;
+	if (!ray.hasDifferentials)
+		return;
+
+	/* Intersect the differential rays with the tangent plane */
+	const Normal3f &n = geoFrame.n;
+	float cosX = n.dot(ray.rxDirection), cosY = n.dot(ray.ryDirection);
+	if (cosX == 0 || cosY == 0)
+		return;
+	float tx = n.dot(p - ray.rxOrigin) / cosX,
+	      ty = n.dot(p - ray.ryOrigin) / cosY;
+	dpdx = ray.rxOrigin + ray.rxDirection * tx - p;
+	dpdy = ray.ryOrigin + ray.ryDirection * ty - p;
+
+	/* Express the offsets in UV space (least squares solution) */
+	float a00 = dpdu.dot(dpdu), a01 = dpdu.dot(dpdv), a11 = dpdv.dot(dpdv),
+	      det = a00 * a11 - a01 * a01;
+	if (std::abs(det) < 1e-20f)
+		return;
+	float invDet = 1.0f / det;
+	float bx0 = dpdu.dot(dpdx), bx1 = dpdv.dot(dpdx),
+	      by0 = dpdu.dot(dpdy), by1 = dpdv.dot(dpdy);
+	Vector2f duvdx((a11 * bx0 - a01 * bx1) * invDet, (a00 * bx1 - a01 * bx0) * invDet),
+	         duvdy((a11 * by0 - a01 * by1) * invDet, (a00 * by1 - a01 * by0) * invDet);
+	uvWidth = std::max(duvdx.norm(), duvdy.norm());
+	if (!(uvWidth < std::numeric_limits<float>::infinity()))
+		uvWidth = 0.0f;
+}
+
+void Intersection::reflectDifferentials(const Ray3f &ray, Ray3f &reflected) const {
+	reflected.hasDifferentials = ray.hasDifferentials;
+	if (!ray.hasDifferentials)
+		return;
+	const Normal3f &n = shFrame.n;
+	reflected.rxOrigin = p + dpdx;
+	reflected.ryOrigin = p + dpdy;
+	reflected.rxDirection = ray.rxDirection - 2 * n.dot(ray.rxDirection) * n;
+	reflected.ryDirection = ray.ryDirection - 2 * n.dot(ray.ryDirection) * n;
+}
+
+
 QString Intersection::toString() const {
 	if (!mesh)
 		return "Intersection[invalid]";
@@ -18,9 +18,30 @@
 
 #include <nori/bsdf.h>
 #include <nori/frame.h>
+#include <nori/fastmath.h>
+#include <nori/albedo.h>
+
+/// Number of entries of the Fresnel and shadowing tables of \ref Microfacet
+#define NORI_MICROFACET_TABLE_RES 256
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Diffuse base material with a rough dielectric coating
+ *
+ * The specular component uses the Beckmann microfacet distribution,
+ * the Fresnel reflectance of the interface between \c extIOR and
+ * \c intIOR, and the rational approximation of Smith's shadowing
+ * function by Walter et al. \ref sample() chooses between the two
+ * components in proportion to \c ks.
+ *
+ * Everything that only depends on the parameters is computed when the
+ * material is created: the normalization of the distribution, and
+ * tables of the Fresnel reflectance and the shadowing term over
+ * \f$\cos\theta\f$ (with \c NORI_MICROFACET_TABLE_RES entries), which
+ * are interpolated linearly. The batched \ref eval() shades all
+ * direction pairs of a wavefront with a single virtual call.
+ */
 class Microfacet : public BSDF {
 public:
 	Microfacet(const PropertyList &propList) {
@@ -45,21 +66,111 @@ public:
 		   interested in implementing a more realistic version 
 		   of this BRDF. */
 		m_ks = 1 - m_kd.maxCoeff();
+
+		/* Optional table of the albedo of the specular component */
+		m_albedoTableFilename = propList.getString("albedoTable", "");
+
+		if (m_alpha <= 0)
+			throw NoriException(QString("Microfacet: invalid alpha %1 (must be positive)")
+				.arg(m_alpha));
+
+		/* Constants of the Beckmann distribution */
+		m_invAlpha2 = 1.0f / (m_alpha * m_alpha);
+		m_beckmannNorm = INV_PI * m_invAlpha2;
+
+		/* Tabulate the Fresnel reflectance and the shadowing term */
+		for (int i=0; i<NORI_MICROFACET_TABLE_RES; ++i) {
+			float cosTheta = (float) i / (NORI_MICROFACET_TABLE_RES - 1);
+			m_fresnel[i] = fresnel(cosTheta, m_extIOR, m_intIOR);
+			m_shadowing[i] = smithG1(cosTheta);
+		}
+	}
+
+	/// Load the albedo table (if any)
+	void activate() {
+		if (!m_albedoTableFilename.isEmpty())
+			m_albedoTable.load(m_albedoTableFilename);
 	}
 
 	/// Evaluate the BRDF for the given pair of directions
 	Color3f eval(const BSDFQueryRecord &bRec) const {
-		throw NoriException("Uh oh -- Microfacet::eval() is not implemented!");
+		if (bRec.measure != ESolidAngle
+			|| Frame::cosTheta(bRec.wi) <= 0
+			|| Frame::cosTheta(bRec.wo) <= 0)
+			return Color3f(0.0f);
+
+		return m_kd * INV_PI + Color3f(specular(bRec.wi, bRec.wo));
+	}
+
+	/// Evaluate the BRDF for a batch of direction pairs
+	void eval(const BSDFQueryRecord *bRecs, Color3f *result, uint32_t count) const {
+		Color3f diffuse = m_kd * INV_PI;
+		for (uint32_t i=0; i<count; ++i) {
+			const BSDFQueryRecord &bRec = bRecs[i];
+			if (bRec.measure != ESolidAngle
+				|| Frame::cosTheta(bRec.wi) <= 0
+				|| Frame::cosTheta(bRec.wo) <= 0)
+				result[i] = Color3f(0.0f);
+			else
+				result[i] = diffuse + Color3f(specular(bRec.wi, bRec.wo));
+		}
 	}
 
 	/// Evaluate the sampling density of \ref sample() wrt. solid angles
 	float pdf(const BSDFQueryRecord &bRec) const {
-		throw NoriException("Uh oh -- Microfacet::pdf() is not implemented!");
+		if (bRec.measure != ESolidAngle
+			|| Frame::cosTheta(bRec.wi) <= 0
+			|| Frame::cosTheta(bRec.wo) <= 0)
+			return 0.0f;
+
+		/* Density of the half vector, times the Jacobian of the reflection */
+		Vector3f wh = (bRec.wi + bRec.wo).normalized();
+		float specularPdf = beckmann(wh) * Frame::cosTheta(wh) / (4 * wh.dot(bRec.wo));
+
+		float specularProb = specularProbability(Frame::cosTheta(bRec.wi));
+		return specularProb * specularPdf + (1 - specularProb) * INV_PI * Frame::cosTheta(bRec.wo);
+	}
+
+	/// Evaluate the sampling densities of a batch of queries
+	void pdf(const BSDFQueryRecord *bRecs, float *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = Microfacet::pdf(bRecs[i]);
 	}
 
 	/// Sample the BRDF
 	Color3f sample(BSDFQueryRecord &bRec, const Point2f &sample) const {
-		throw NoriException("Uh oh -- Microfacet::sample() is not implemented!");
+		if (Frame::cosTheta(bRec.wi) <= 0)
+			return Color3f(0.0f);
+
+		bRec.measure = ESolidAngle;
+		float specularProb = specularProbability(Frame::cosTheta(bRec.wi));
+		if (sample.x() < specularProb) {
+			/* Reflect about a half vector sampled from the Beckmann distribution */
+			Vector3f wh = sampleBeckmann(Point2f(sample.x() / specularProb, sample.y()));
+			bRec.wo = 2 * bRec.wi.dot(wh) * wh - bRec.wi;
+		} else {
+			bRec.wo = squareToCosineHemisphere(
+				Point2f((sample.x() - specularProb) / (1 - specularProb), sample.y()));
+		}
+
+		float pdf = this->pdf(bRec);
+		if (pdf <= 0)
+			return Color3f(0.0f);
+		return eval(bRec) * Frame::cosTheta(bRec.wo) / pdf;
+	}
+
+	/// Sample the BRDF for a batch of queries
+	void sample(BSDFQueryRecord *bRecs, const Point2f *samples,
+			Color3f *result, uint32_t count) const {
+		for (uint32_t i=0; i<count; ++i)
+			result[i] = Microfacet::sample(bRecs[i], samples[i]);
+	}
+
+	/// Diffuse base plus the (white) specular component
+	Color3f getAlbedo() const {
+		if (m_albedoTable.isValid())
+			return m_kd + Color3f(m_ks * m_albedoTable.evalAverage(m_alpha));
+		return m_kd + Color3f(m_ks);
 	}
 
 	QString toString() const {
@@ -70,18 +181,90 @@ public:
 			"  extIOR = %3,\n"
 			"  kd = %4\n"
 			"  ks = %5,\n"
+			"  albedoTable = \"%6\"\n"
 			"]")
 		.arg(m_alpha)
 		.arg(m_intIOR)
 		.arg(m_extIOR)
 		.arg(m_kd.toString())
-		.arg(m_ks);
+		.arg(m_ks)
+		.arg(m_albedoTableFilename);
 	}
 private:
+	/**
+	 * \brief Return the probability of sampling the specular component
+	 *
+	 * This is \c ks, or the share of the specular component in the
+	 * total albedo when an albedo table is available.
+	 */
+	inline float specularProbability(float cosThetaI) const {
+		if (!m_albedoTable.isValid())
+			return m_ks;
+		float specular = m_ks * m_albedoTable.eval(cosThetaI, m_alpha),
+		      total = specular + (1 - m_ks);
+		return total > 0 ? specular / total : 0.0f;
+	}
+
+	/// Beckmann distribution of the microfacet normals
+	inline float beckmann(const Vector3f &wh) const {
+		float cosTheta = Frame::cosTheta(wh);
+		if (cosTheta <= 0)
+			return 0.0f;
+		float cosTheta2 = cosTheta * cosTheta,
+		      tanTheta2 = (1 - cosTheta2) / cosTheta2;
+		return m_beckmannNorm * fastExp(-tanTheta2 * m_invAlpha2)
+			/ (cosTheta2 * cosTheta2);
+	}
+
+	/// Sample a microfacet normal proportional to \ref beckmann() times its cosine
+	inline Vector3f sampleBeckmann(const Point2f &sample) const {
+		float tanTheta2 = -m_alpha * m_alpha * fastLog(1 - sample.x()),
+		      cosTheta = 1.0f / std::sqrt(1 + tanTheta2),
+		      sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+		float sinPhi, cosPhi;
+		fastSinCos(2 * M_PI * sample.y(), &sinPhi, &cosPhi);
+		return Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+	}
+
+	/// Smith's shadowing term of one direction (rational approximation)
+	inline float smithG1(float cosTheta) const {
+		if (cosTheta <= 0)
+			return 0.0f;
+		float sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+		if (sinTheta == 0)
+			return 1.0f;
+		float b = cosTheta / (m_alpha * sinTheta);
+		if (b >= 1.6f)
+			return 1.0f;
+		return (3.535f * b + 2.181f * b * b) / (1 + 2.276f * b + 2.577f * b * b);
+	}
+
+	/// Linearly interpolate a table over \f$\cos\theta \in [0, 1]\f$
+	inline float lookup(const float *table, float cosTheta) const {
+		float x = clamp(cosTheta, 0.0f, 1.0f) * (NORI_MICROFACET_TABLE_RES - 1);
+		int i = std::min((int) x, NORI_MICROFACET_TABLE_RES - 2);
+		float t = x - i;
+		return (1 - t) * table[i] + t * table[i + 1];
+	}
+
+	/// Specular component for two directions in the upper hemisphere
+	inline float specular(const Vector3f &wi, const Vector3f &wo) const {
+		Vector3f wh = (wi + wo).normalized();
+		float cosThetaI = Frame::cosTheta(wi), cosThetaO = Frame::cosTheta(wo);
+		return m_ks * beckmann(wh) * lookup(m_fresnel, wh.dot(wi))
+			* lookup(m_shadowing, cosThetaI) * lookup(m_shadowing, cosThetaO)
+			/ (4 * cosThetaI * cosThetaO);
+	}
+
 	float m_alpha;
 	float m_intIOR, m_extIOR;
 	float m_ks;
 	Color3f m_kd;
+	float m_invAlpha2, m_beckmannNorm;
+	float m_fresnel[NORI_MICROFACET_TABLE_RES];
+	float m_shadowing[NORI_MICROFACET_TABLE_RES];
+	QString m_albedoTableFilename;
+	AlbedoTable m_albedoTable;
 };
 
 NORI_REGISTER_CLASS(Microfacet, "microfacet");
@@ -51,6 +51,10 @@ public:
 		return Color3f(1.0f);
 	}
 
+	bool isDiscrete() const {
+		return true;
+	}
+
 	QString toString() const {
 		return "Mirror[]";
 	}
@@ -0,0 +1,64 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bsdf.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Invisible surface that only marks the boundary of a medium
+ * (e.g. smoke in a box), and which light passes unchanged
+ *
+ * Shadow rays are traced through such surfaces (see
+ * \ref Scene::evalVisibilityTransmittance()).
+ */
+class NullBSDF : public BSDF {
+public:
+	NullBSDF(const PropertyList &) { }
+
+	Color3f eval(const BSDFQueryRecord &) const {
+		/* Discrete BRDFs always evaluate to zero in Nori */
+		return Color3f(0.0f);
+	}
+
+	float pdf(const BSDFQueryRecord &) const {
+		/* Discrete BRDFs always evaluate to zero in Nori */
+		return 0.0f;
+	}
+
+	Color3f sample(BSDFQueryRecord &bRec, const Point2f &) const {
+		bRec.wo = -bRec.wi;
+		bRec.measure = EDiscrete;
+		return Color3f(1.0f);
+	}
+
+	bool isDiscrete() const {
+		return true;
+	}
+
+	bool isNull() const {
+		return true;
+	}
+
+	QString toString() const {
+		return "NullBSDF[]";
+	}
+};
+
+NORI_REGISTER_CLASS(NullBSDF, "null");
+NORI_NAMESPACE_END
@@ -17,124 +17,272 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/profiler.h>
 #include <boost/unordered_map.hpp>
-#include <QTextStream>
-#include <QStringList>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QThread>
 #include <QFile>
 
+#define NORI_OBJ_CHUNK_SIZE (4*1024*1024) /* Approximate size of the chunks parsed in parallel (in bytes) */
+
 NORI_NAMESPACE_BEGIN
 
+/* =======================================================================
+ *  Scanner functions: these work directly on the mapped file and don't
+ *  allocate memory. They skip leading whitespace and advance \c p past
+ *  the parsed value.
+ * ======================================================================= */
+
+static inline bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static inline void skipSpace(const char *&p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+}
+
+static bool parseInt(const char *&p, const char *end, int &value) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p == end || !isDigit(*p))
+		return false;
+	int result = 0;
+	while (p < end && isDigit(*p))
+		result = result * 10 + (*p++ - '0');
+	value = negative ? -result : result;
+	return true;
+}
+
+static bool parseFloat(const char *&p, const char *end, float &value) {
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	skipSpace(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	/* Accumulate up to 19 significant digits in an integer */
+	uint64_t mantissa = 0;
+	int exponent = 0, significant = 0;
+	bool hasDigits = false;
+	for (; p < end && isDigit(*p); ++p) {
+		hasDigits = true;
+		if (significant < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			significant += mantissa > 0;
+		} else {
+			++exponent;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (++p; p < end && isDigit(*p); ++p) {
+			hasDigits = true;
+			if (significant < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				significant += mantissa > 0;
+				--exponent;
+			}
+		}
+	}
+	if (!hasDigits)
+		return false;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int e;
+		++p;
+		if (!parseInt(p, end, e))
+			return false;
+		exponent += e;
+	}
+
+	double result = (double) mantissa;
+	if (mantissa != 0) {
+		/* Dividing by an exact power of ten is more accurate than
+		   multiplying by an inexact negative one */
+		for (; exponent > 22; exponent -= 22)
+			result *= 1e22;
+		for (; exponent < -22; exponent += 22)
+			result /= 1e22;
+		if (exponent >= 0)
+			result *= powersOf10[exponent];
+		else
+			result /= powersOf10[-exponent];
+	}
+	value = (float) (negative ? -result : result);
+	return true;
+}
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is mapped into memory and split into chunks at line
+ * boundaries, which are parsed in parallel. Afterwards, the chunks are
+ * merged in order, which also turns the OBJ indexing scheme (separate
+ * indices for positions, normals and texture coordinates) into a
+ * single index per vertex. Finally, the triangles and vertices are
+ * reordered for memory locality (see \ref Mesh::computeLocalityOrder()),
+ * unless the \c reorder property is set to \c false.
  */
 class WavefrontOBJ : public Mesh {
 public:
 	WavefrontOBJ(const PropertyList &propList) {
 		typedef boost::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
 
-		/* Process the OBJ-file line by line */	
 		QString filename = propList.getString("filename");
+		ProfileScope scope("Load OBJ", "load");
+		scope.setDetail(filename);
 		QFile input(filename);
-		if (!input.open(QIODevice::ReadOnly | QIODevice::Text))
+		if (!input.open(QIODevice::ReadOnly))
 			throw NoriException(QString("Cannot open \"%1\"").arg(filename));
 
 		Transform trafo = propList.getTransform("toWorld", Transform());
 
+		/* Gather the vertices of every triangle to speed up intersection tests */
+		m_packTriangles = propList.getBoolean("packTriangles", false);
+
+		/* Quantize the normals and texture coordinates to save memory */
+		m_compressAttributes = propList.getBoolean("compressAttributes", false);
+
 		cout << "Loading \"" << qPrintable(filename) << "\" .." << endl;
 		m_name = filename;
 
-		QTextStream stream(&input);
-		QTextStream line;
-		QString temp, prefix;
+		QElapsedTimer timer;
+		timer.start();
+
+		qint64 size = input.size();
+		const char *data = size > 0 ? (const char *) input.map(0, size) : NULL;
+		if (size > 0 && !data)
+			throw NoriException(QString("Unable to map \"%1\" into memory").arg(filename));
+
+		/* Split the file into chunks that end at a newline */
+		std::vector<OBJChunk> chunks;
+		const char *pos = data, *end = data + size;
+		while (pos < end) {
+			const char *chunkEnd = pos + std::min((qint64) NORI_OBJ_CHUNK_SIZE, (qint64) (end - pos));
+			chunkEnd = (const char *) memchr(chunkEnd - 1, '\n', end - chunkEnd + 1);
+			chunkEnd = chunkEnd ? chunkEnd + 1 : end;
+			chunks.push_back(OBJChunk());
+			chunks.back().start = pos;
+			chunks.back().end = chunkEnd;
+			pos = chunkEnd;
+		}
+
+		/* Parse them in parallel */
+		QAtomicInt nextChunk(0);
+		int threadCount = std::max(1, std::min(getCoreCount(), (int) chunks.size()));
+		std::vector<OBJParser *> parsers(threadCount);
+		for (int i=0; i<threadCount; ++i) {
+			parsers[i] = new OBJParser(chunks, nextChunk, trafo);
+			parsers[i]->start();
+		}
+		for (int i=0; i<threadCount; ++i) {
+			parsers[i]->wait();
+			delete parsers[i];
+		}
+		if (data)
+			input.unmap((uchar *) data);
+		input.close();
+
+		size_t positionCount = 0, texcoordCount = 0, normalCount = 0, vertexCount = 0;
+		for (size_t i=0; i<chunks.size(); ++i) {
+			const OBJChunk &chunk = chunks[i];
+			if (!chunk.error.isEmpty())
+				throw NoriException(QString("Error while parsing \"%1\": %2").arg(filename).arg(chunk.error));
+			positionCount += chunk.positions.size();
+			texcoordCount += chunk.texcoords.size();
+			normalCount += chunk.normals.size();
+			vertexCount += chunk.vertices.size();
+		}
 
+		/* Concatenate the attribute arrays of all chunks */
 		std::vector<Point3f>   positions;
 		std::vector<Point2f>   texcoords;
 		std::vector<Normal3f>  normals;
+		positions.reserve(positionCount);
+		texcoords.reserve(texcoordCount);
+		normals.reserve(normalCount);
+		for (size_t i=0; i<chunks.size(); ++i) {
+			OBJChunk &chunk = chunks[i];
+			positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+			texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+			normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+			std::vector<Point3f>().swap(chunk.positions);
+			std::vector<Point2f>().swap(chunk.texcoords);
+			std::vector<Normal3f>().swap(chunk.normals);
+		}
+
+		/* Now convert from the Wavefront OBJ indexing scheme to a good
+		   old indexed vertex list (i.e. just one index per vertex) */
 		std::vector<uint32_t>  indices;
 		std::vector<OBJVertex> vertices;
 		VertexMap vertexMap;
-
-		while (!(temp = stream.readLine()).isNull()) {
-			line.setString(&temp);
-
-			line >> prefix;
-			if (prefix == "v") {
-				Point3f p;
-				line >> p.x() >> p.y() >> p.z();
-				p = trafo * p;
-				positions.push_back(p);
-			} else if (prefix == "vt") {
-				Point2f tc;
-				line >> tc.x() >> tc.y();
-				texcoords.push_back(tc);
-			} else if (prefix == "vn") {
-				Normal3f n;
-				line >> n.x() >> n.y() >> n.z();
-				n = (trafo * n).normalized();
-				normals.push_back(n);
-			} else if (prefix == "f") {
-				QString v1, v2, v3, v4;
-				line >> v1 >> v2 >> v3 >> v4;
-				OBJVertex tri[6];
-				int nVertices = 3;
-
-				tri[0] = OBJVertex(v1);
-				tri[1] = OBJVertex(v2);
-				tri[2] = OBJVertex(v3);
-
-				if (!v4.isNull()) {
-					/* This is a quad, split into two triangles */
-					tri[3] = OBJVertex(v4);
-					tri[4] = tri[0];
-					tri[5] = tri[2];
-					nVertices = 6;
-				}
-
-				/* Now convert from the Wavefront OBJ indexing scheme to a good
-				   old indexed vertex list (i.e. just one index per vertex) */
-				for (int i=0; i<nVertices; ++i) {
-					const OBJVertex &v = tri[i];
-					VertexMap::const_iterator it = vertexMap.find(v);
-					if (it == vertexMap.end()) {
-						vertexMap[v] = (uint32_t) vertices.size();
-						indices.push_back((uint32_t) vertices.size());
-						vertices.push_back(v);
-					} else {
-						indices.push_back(it->second);
-					}
-				}
+		indices.reserve(vertexCount);
+		vertices.reserve(vertexCount / 2);
+		vertexMap.rehash(vertexCount / 2);
+		for (size_t i=0; i<chunks.size(); ++i) {
+			const std::vector<OBJVertex> &chunkVertices = chunks[i].vertices;
+			for (size_t j=0; j<chunkVertices.size(); ++j) {
+				const OBJVertex &v = chunkVertices[j];
+				if (v.p >= positions.size() ||
+					(v.uv != (uint32_t) -1 && v.uv >= texcoords.size()) ||
+					(v.n != (uint32_t) -1 && v.n >= normals.size()))
+					throw NoriException(QString("Error while parsing \"%1\": a face refers "
+						"to a nonexistent vertex").arg(filename));
+
+				std::pair<VertexMap::iterator, bool> result =
+					vertexMap.insert(std::make_pair(v, (uint32_t) vertices.size()));
+				if (result.second)
+					vertices.push_back(v);
+				indices.push_back(result.first->second);
 			}
+			std::vector<OBJVertex>().swap(chunks[i].vertices);
 		}
 
 		m_triangleCount = (uint32_t) (indices.size() / 3);
 		m_vertexCount = (uint32_t) vertices.size();
 
 		cout << "Read " << m_triangleCount << " triangles and "
-			 << m_vertexCount << " vertices." << endl;
+			 << m_vertexCount << " vertices (took " << timer.elapsed() << " ms)." << endl;
 
-		/* Create the compact in-memory representation (i.e. without 
+		/* Create the compact in-memory representation (i.e. without
 		   unused buffer space). This involves some copying and following
 		   of indirections. */
 
-		m_indices = new uint32_t[indices.size()];
-		for (size_t i=0; i<indices.size(); ++i)
-			m_indices[i] = indices[i];
+		/* The buffers that are accessed during traversal may be backed by
+		   huge pages (see allocLarge()) */
+		m_indices = static_cast<uint32_t *>(allocLarge(sizeof(uint32_t) * indices.size()));
+		if (!indices.empty())
+			memcpy(m_indices, &indices[0], sizeof(uint32_t) * indices.size());
 
-		m_vertexPositions = new Point3f[m_vertexCount];
+		m_vertexPositions = static_cast<Point3f *>(allocLarge(sizeof(Point3f) * m_vertexCount));
 		for (size_t i=0; i<m_vertexCount; ++i)
-			m_vertexPositions[i] = positions.at(vertices[i].p);
+			m_vertexPositions[i] = positions[vertices[i].p];
 
 		if (!normals.empty()) {
 			m_vertexNormals = new Normal3f[m_vertexCount];
 			for (size_t i=0; i<m_vertexCount; ++i)
-				m_vertexNormals[i] = normals.at(vertices[i].n);
+				m_vertexNormals[i] = vertices[i].n != (uint32_t) -1
+					? normals[vertices[i].n] : Normal3f(0.0f, 0.0f, 0.0f);
 		}
 
 		if (!texcoords.empty()) {
 			m_vertexTexCoords = new Point2f[m_vertexCount];
 			for (size_t i=0; i<m_vertexCount; ++i)
-				m_vertexTexCoords[i] = texcoords.at(vertices[i].uv);
+				m_vertexTexCoords[i] = vertices[i].uv != (uint32_t) -1
+					? texcoords[vertices[i].uv] : Point2f(0.0f, 0.0f);
 		}
+
+		/* Sort the triangles spatially, so that the triangles referenced
+		   by an acceleration data structure node and their vertices lie
+		   close to each other in memory */
+		if (propList.getBoolean("reorder", true))
+			reorderForLocality();
 	}
 
 protected:
@@ -142,31 +290,7 @@ protected:
 	struct OBJVertex {
 		uint32_t p, n, uv;
 
-		inline OBJVertex() { }
-
-		OBJVertex(const QString &string) 
-			: n((uint32_t) -1), uv((uint32_t) -1) {
-			QStringList tokens = string.split("/");
-
-			if (tokens.size() != 1 && tokens.size() != 3)
-				goto fail;
-
-			bool ok;
-			p  = (uint32_t) tokens[0].toInt(&ok) - 1; if (!ok) goto fail;
-
-			if (tokens.size() == 3) {
-				if (tokens[1].length() > 0) {
-					uv = (uint32_t) tokens[1].toInt(&ok) - 1; if (!ok) goto fail;
-				}
-				if (tokens[2].length() > 0) {
-					n  = (uint32_t) tokens[2].toInt(&ok) - 1; if (!ok) goto fail;
-				}
-			}
-
-			return;
-		fail:
-			throw NoriException(QString("Could not parse vertex data: '%1'!").arg(string));
-		}
+		inline OBJVertex() : p(0), n((uint32_t) -1), uv((uint32_t) -1) { }
 
 		inline bool operator==(const OBJVertex &v) const {
 			return v.p == p && v.n == n && v.uv == uv;
@@ -183,6 +307,120 @@ protected:
 			return hash;
 		}
 	};
+
+	/// A range of lines of the file along with the data parsed from it
+	struct OBJChunk {
+		const char *start, *end;
+		std::vector<Point3f>   positions;
+		std::vector<Point2f>   texcoords;
+		std::vector<Normal3f>  normals;
+		/// Three vertices per triangle
+		std::vector<OBJVertex> vertices;
+		/// Error message (empty on success)
+		QString error;
+	};
+
+	/// Parses chunks until none are left
+	class OBJParser : public QThread {
+	public:
+		OBJParser(std::vector<OBJChunk> &chunks, QAtomicInt &nextChunk, const Transform &trafo)
+			: m_chunks(chunks), m_nextChunk(nextChunk), m_trafo(trafo) { }
+
+		void run() {
+			int index;
+			while ((index = m_nextChunk.fetchAndAddOrdered(1)) < (int) m_chunks.size()) {
+				OBJChunk &chunk = m_chunks[index];
+				const char *line = chunk.start;
+				while (line < chunk.end && chunk.error.isEmpty()) {
+					const char *lineEnd = (const char *) memchr(line, '\n', chunk.end - line);
+					if (!lineEnd)
+						lineEnd = chunk.end;
+					if (!parseLine(chunk, line, lineEnd))
+						chunk.error = QString("could not parse the line \"%1\"")
+							.arg(QString::fromLatin1(line, (int) (lineEnd - line)).trimmed());
+					line = lineEnd + 1;
+				}
+			}
+		}
+	private:
+		bool parseLine(OBJChunk &chunk, const char *p, const char *end) {
+			skipSpace(p, end);
+			if (end - p < 2 || (p[1] != ' ' && p[1] != '\t' && p[1] != 't' && p[1] != 'n'))
+				return true;
+
+			if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+				Point3f v;
+				p += 1;
+				if (!parseFloat(p, end, v.x()) || !parseFloat(p, end, v.y()) || !parseFloat(p, end, v.z()))
+					return false;
+				chunk.positions.push_back(m_trafo * v);
+			} else if (p[0] == 'v' && p[1] == 't') {
+				Point2f tc;
+				p += 2;
+				if (!parseFloat(p, end, tc.x()) || !parseFloat(p, end, tc.y()))
+					return false;
+				chunk.texcoords.push_back(tc);
+			} else if (p[0] == 'v' && p[1] == 'n') {
+				Normal3f n;
+				p += 2;
+				if (!parseFloat(p, end, n.x()) || !parseFloat(p, end, n.y()) || !parseFloat(p, end, n.z()))
+					return false;
+				chunk.normals.push_back((m_trafo * n).normalized());
+			} else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+				OBJVertex first, prev, v;
+				int count = 0;
+				p += 1;
+				for (skipSpace(p, end); p < end; skipSpace(p, end)) {
+					if (!parseVertex(p, end, v))
+						return false;
+					/* Split polygons into a fan of triangles (for quads, this
+					   yields the triangles 1-2-3 and 4-1-3) */
+					if (count < 3) {
+						chunk.vertices.push_back(v);
+					} else {
+						chunk.vertices.push_back(v);
+						chunk.vertices.push_back(first);
+						chunk.vertices.push_back(prev);
+					}
+					if (count == 0)
+						first = v;
+					prev = v;
+					++count;
+				}
+				if (count < 3)
+					return false;
+			}
+			return true;
+		}
+
+		/// Parse a face vertex of the form p, p/uv, p//n or p/uv/n
+		static bool parseVertex(const char *&p, const char *end, OBJVertex &v) {
+			int value;
+			v = OBJVertex();
+			if (!parseInt(p, end, value) || value <= 0)
+				return false;
+			v.p = (uint32_t) value - 1;
+			if (p < end && *p == '/') {
+				++p;
+				if (p < end && *p != '/') {
+					if (!parseInt(p, end, value) || value <= 0)
+						return false;
+					v.uv = (uint32_t) value - 1;
+				}
+				if (p < end && *p == '/') {
+					++p;
+					if (!parseInt(p, end, value) || value <= 0)
+						return false;
+					v.n = (uint32_t) value - 1;
+				}
+			}
+			return p == end || *p == ' ' || *p == '\t' || *p == '\r';
+		}
+	private:
+		std::vector<OBJChunk> &m_chunks;
+		QAtomicInt &m_nextChunk;
+		const Transform &m_trafo;
+	};
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -17,9 +17,103 @@
 */
 
 #include <nori/object.h>
+#include <QThreadStorage>
+#include <new>
 
 NORI_NAMESPACE_BEGIN
 
+/// Per-thread slot that holds the active pool (QThreadStorage requires a pointer type)
+struct ObjectPoolSlot {
+	ObjectPool *pool;
+};
+
+static QThreadStorage<ObjectPoolSlot *> activePool;
+
+/* Every allocation is preceded by a header that holds its pool (NULL = heap) */
+union ObjectPoolHeader {
+	ObjectPool *pool;
+	uint8_t padding[NORI_POOL_ALIGNMENT];
+};
+
+ObjectPool::ObjectPool() : m_current(NULL), m_end(NULL), m_refCount(1) {
+	if (!activePool.hasLocalData()) {
+		ObjectPoolSlot *slot = new ObjectPoolSlot();
+		slot->pool = NULL;
+		activePool.setLocalData(slot);
+	}
+	m_previous = activePool.localData()->pool;
+	activePool.localData()->pool = this;
+}
+
+ObjectPool::~ObjectPool() {
+	for (size_t i=0; i<m_chunks.size(); ++i)
+		freeAligned(m_chunks[i]);
+}
+
+void ObjectPool::close() {
+	if (getActive() != this)
+		throw NoriException("ObjectPool::close(): the pool is not active on this thread!");
+	activePool.localData()->pool = m_previous;
+	release();
+}
+
+ObjectPool *ObjectPool::getActive() {
+	if (!activePool.hasLocalData())
+		return NULL;
+	return activePool.localData()->pool;
+}
+
+void ObjectPool::release() {
+	if (!m_refCount.deref())
+		delete this;
+}
+
+void *ObjectPool::allocateLocal(size_t size) {
+	size = (size + NORI_POOL_ALIGNMENT - 1) & ~((size_t) NORI_POOL_ALIGNMENT - 1);
+
+	/* Large objects get a chunk of their own, leaving the current one as it is */
+	if (size > NORI_POOL_CHUNK_SIZE / 4) {
+		uint8_t *chunk = static_cast<uint8_t *>(allocAligned(size));
+		m_chunks.push_back(chunk);
+		return chunk;
+	}
+
+	if (m_current + size > m_end) {
+		m_current = static_cast<uint8_t *>(allocAligned(NORI_POOL_CHUNK_SIZE));
+		m_end = m_current + NORI_POOL_CHUNK_SIZE;
+		m_chunks.push_back(m_current);
+	}
+	void *ptr = m_current;
+	m_current += size;
+	return ptr;
+}
+
+void *ObjectPool::allocate(size_t size) {
+	ObjectPool *pool = getActive();
+	size += sizeof(ObjectPoolHeader);
+	ObjectPoolHeader *header;
+	if (pool) {
+		header = static_cast<ObjectPoolHeader *>(pool->allocateLocal(size));
+		pool->m_refCount.ref();
+	} else {
+		header = static_cast<ObjectPoolHeader *>(allocAligned(size));
+		if (!header)
+			throw std::bad_alloc();
+	}
+	header->pool = pool;
+	return header + 1;
+}
+
+void ObjectPool::deallocate(void *ptr) {
+	if (!ptr)
+		return;
+	ObjectPoolHeader *header = static_cast<ObjectPoolHeader *>(ptr) - 1;
+	if (header->pool)
+		header->pool->release();
+	else
+		freeAligned(header);
+}
+
 void NoriObject::addChild(NoriObject *) {
 	throw NoriException(QString("NoriObject::addChild() is not "
 		"implemented for objects of type '%1'!").arg(
@@ -29,6 +123,8 @@ void NoriObject::addChild(NoriObject *) {
 void NoriObject::activate() { /* Do nothing */ }
 void NoriObject::setParent(NoriObject *) { /* Do nothing */ }
 
+void NoriObject::reportMemory(MemoryReport &) const { /* Do nothing */ }
+
 std::map<QString, NoriObjectFactory::Constructor> *NoriObjectFactory::m_constructors = NULL;
 
 void NoriObjectFactory::registerClass(const QString &name, const Constructor &constr) {
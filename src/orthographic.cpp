@@ -0,0 +1,147 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/camera.h>
+#include <nori/rfilter.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Orthographic camera
+ *
+ * All rays are parallel to the camera's z axis. They start on a rectangle
+ * in the camera's xy plane that is \c extent scene units wide (2 by 
+ * default), and whose height follows from the aspect ratio of the image.
+ * The image is oriented like that of the perspective camera, i.e. the
+ * same \c toWorld transformation (e.g. a <tt>&lt;lookat&gt;</tt>) gives
+ * the same view direction and up vector.
+ *
+ * The clipping planes and the shutter interval are specified as for the
+ * perspective camera.
+ */
+class OrthographicCamera : public Camera {
+public:
+	OrthographicCamera(const PropertyList &propList) {
+		/* Width and height in pixels. Default: 720p */
+		m_outputSize.x() = propList.getInteger("width", 1280);
+		m_outputSize.y() = propList.getInteger("height", 720);
+
+		/* Name of the view in a multi-view rendering. Default: none */
+		m_name = propList.getString("name", "");
+
+		/* Specifies an optional camera-to-world transformation. Default: none */
+		m_cameraToWorld = propList.getTransform("toWorld", Transform());
+
+		/* Width of the viewed rectangle in scene units */
+		m_extent = propList.getFloat("extent", 2.0f);
+
+		/* Near and far clipping planes in world-space units */
+		m_nearClip = propList.getFloat("nearClip", 1e-4f);
+		m_farClip = propList.getFloat("farClip", 1e4f);
+
+		/* Shutter interval (in the time units of the instance motion keys) */
+		m_shutterOpen = propList.getFloat("shutterOpen", 0.0f);
+		m_shutterClose = propList.getFloat("shutterClose", m_shutterOpen);
+		if (m_shutterClose < m_shutterOpen)
+			throw NoriException(QString("OrthographicCamera: the shutter closes (%1) "
+				"before it opens (%2)!").arg(m_shutterClose).arg(m_shutterOpen));
+		if (m_extent <= 0)
+			throw NoriException("OrthographicCamera: the extent must be positive!");
+
+		m_rfilter = NULL;
+	}
+
+	void activate() {
+		float aspect = m_outputSize.x() / (float) m_outputSize.y();
+
+		/* The film maps affinely onto the rectangle. Precompute the world
+		   space position of its origin and its change per pixel */
+		m_origin = m_cameraToWorld * Point3f(-0.5f * m_extent, 0.5f * m_extent / aspect, 0.0f);
+		m_dx = m_cameraToWorld * Vector3f(m_extent / m_outputSize.x(), 0.0f, 0.0f);
+		m_dy = m_cameraToWorld * Vector3f(0.0f, -m_extent / (aspect * m_outputSize.y()), 0.0f);
+		m_direction = (m_cameraToWorld * Vector3f(0.0f, 0.0f, 1.0f)).normalized();
+
+		/* If no reconstruction filter was assigned, instantiate a Gaussian filter */
+		if (!m_rfilter)
+			m_rfilter = static_cast<ReconstructionFilter *>(
+				NoriObjectFactory::createInstance("gaussian", PropertyList()));
+	}
+
+	Color3f sampleRay(Ray3f &ray,
+			const Point2f &samplePosition,
+			const Point2f &apertureSample) const {
+		ray.o = m_origin + m_dx * samplePosition.x() + m_dy * samplePosition.y();
+		ray.d = m_direction;
+		ray.mint = m_nearClip;
+		ray.maxt = m_farClip;
+		ray.update();
+
+		/* Ray differentials: parallel rays through the neighboring pixels */
+		ray.rxOrigin = ray.o + m_dx;
+		ray.ryOrigin = ray.o + m_dy;
+		ray.rxDirection = ray.ryDirection = ray.d;
+		ray.hasDifferentials = true;
+
+		return Color3f(1.0f);
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case EReconstructionFilter:
+				if (m_rfilter)
+					throw NoriException("Camera: tried to register multiple reconstruction filters!");
+				m_rfilter = static_cast<ReconstructionFilter *>(obj);
+				break;
+
+			default:
+				throw NoriException(QString("Camera::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString(
+			"OrthographicCamera[\n"
+			"  cameraToWorld = %1,\n"
+			"  outputSize = %2,\n"
+			"  extent = %3,\n"
+			"  clip = [%4, %5],\n"
+			"  shutter = [%6, %7],\n"
+			"  rfilter = %8\n"
+			"]")
+		.arg(indent(m_cameraToWorld.toString(), 18))
+		.arg(m_outputSize.toString())
+		.arg(m_extent)
+		.arg(m_nearClip)
+		.arg(m_farClip)
+		.arg(m_shutterOpen)
+		.arg(m_shutterClose)
+		.arg(indent(m_rfilter->toString()));
+	}
+private:
+	Transform m_cameraToWorld;
+	Point3f m_origin;
+	Vector3f m_dx, m_dy, m_direction;
+	float m_extent;
+	float m_nearClip;
+	float m_farClip;
+};
+
+NORI_REGISTER_CLASS(OrthographicCamera, "orthographic");
+NORI_NAMESPACE_END
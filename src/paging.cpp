@@ -0,0 +1,104 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/paging.h>
+#include <QMutexLocker>
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+PagedMemory *PagedMemory::getInstance() {
+	static PagedMemory registry;
+	return &registry;
+}
+
+void PagedMemory::addRegion(const void *data, size_t size) {
+	QMutexLocker locker(&m_mutex);
+	m_regions[data] = size;
+}
+
+void PagedMemory::removeRegion(const void *data) {
+	QMutexLocker locker(&m_mutex);
+	m_regions.erase(data);
+}
+
+bool PagedMemory::hasRegions() const {
+	QMutexLocker locker(&m_mutex);
+	return !m_regions.empty();
+}
+
+PagedMemory::Statistics PagedMemory::getStatistics() const {
+	Statistics stats;
+	QMutexLocker locker(&m_mutex);
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+	size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+	std::vector<char> residency;
+	for (std::map<const void *, size_t>::const_iterator it = m_regions.begin();
+			it != m_regions.end(); ++it) {
+		size_t pageCount = (it->second + pageSize - 1) / pageSize;
+		stats.mappedBytes += it->second;
+		residency.resize(pageCount);
+		#if defined(PLATFORM_MACOS)
+			int result = mincore((caddr_t) it->first, it->second, &residency[0]);
+		#else
+			int result = mincore((void *) it->first, it->second, (unsigned char *) &residency[0]);
+		#endif
+		if (result != 0)
+			continue;
+		for (size_t i=0; i<pageCount; ++i) {
+			if (residency[i] & 1)
+				stats.residentBytes += pageSize;
+		}
+	}
+	/* The last page of a mapping may only be partially used */
+	stats.residentBytes = std::min(stats.residentBytes, stats.mappedBytes);
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		stats.majorFaults = (uint64_t) usage.ru_majflt;
+		stats.minorFaults = (uint64_t) usage.ru_minflt;
+	}
+#else
+	for (std::map<const void *, size_t>::const_iterator it = m_regions.begin();
+			it != m_regions.end(); ++it)
+		stats.mappedBytes += it->second;
+#endif
+
+	return stats;
+}
+
+QString PagedMemory::toString(const Statistics &start, const Statistics &end, float seconds) {
+	uint64_t majorFaults = end.majorFaults - start.majorFaults,
+	         minorFaults = end.minorFaults - start.minorFaults;
+	return QString("Mapped geometry: %1 MiB, %2 MiB resident (%3%), "
+			"%4 major page faults (%5/s), %6 minor page faults")
+		.arg(end.mappedBytes / (1024.0 * 1024.0), 0, 'f', 1)
+		.arg(end.residentBytes / (1024.0 * 1024.0), 0, 'f', 1)
+		.arg(end.mappedBytes > 0 ? 100.0 * end.residentBytes / end.mappedBytes : 0.0, 0, 'f', 1)
+		.arg(majorFaults)
+		.arg(majorFaults / std::max(seconds, 1e-3f), 0, 'f', 1)
+		.arg(minorFaults);
+}
+
+NORI_NAMESPACE_END
@@ -17,14 +17,305 @@
 */
 
 #include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/profiler.h>
 #include <Eigen/Geometry>
 #include <QtGui>
 #include <QtXml>
 #include <QtXmlPatterns>
 #include <stack>
 
+/// Version of the scene cache file format (increase when changing the layout)
+#define NORI_SCENE_CACHE_VERSION 1
+
 NORI_NAMESPACE_BEGIN
 
+/// Signals the completion of objects that are constructed on worker threads
+struct ObjectSync {
+	QMutex mutex;
+	QWaitCondition finished;
+};
+
+/// Is the character one of the ASCII digits?
+static inline bool isDecimalDigit(const QChar &c) {
+	return c.unicode() >= '0' && c.unicode() <= '9';
+}
+
+/**
+ * \brief Convert a decimal number (e.g. "-1.5e3") given by the characters
+ * in <tt>[start, end)</tt> without creating a string
+ *
+ * Returns \c false for other notations (e.g. "inf"), and for numbers
+ * that can't be converted exactly in double precision this way (more than
+ * 15 significant digits or exponents beyond 10^22). The caller then falls
+ * back to \c QString::toFloat(), which also rounds via double precision.
+ */
+static bool parseDecimal(const QChar *start, const QChar *end, float &value) {
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const QChar *pos = start;
+	bool negative = false;
+	if (pos < end && (*pos == '-' || *pos == '+'))
+		negative = *pos++ == '-';
+
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	for (; pos < end && isDecimalDigit(*pos); ++pos, ++digits)
+		mantissa = mantissa * 10 + (pos->unicode() - '0');
+	if (pos < end && *pos == '.') {
+		for (++pos; pos < end && isDecimalDigit(*pos); ++pos, ++digits, --exponent)
+			mantissa = mantissa * 10 + (pos->unicode() - '0');
+	}
+	if (digits == 0 || digits > 15)
+		return false;
+
+	if (pos < end && (*pos == 'e' || *pos == 'E')) {
+		bool negativeExponent = false;
+		if (++pos < end && (*pos == '-' || *pos == '+'))
+			negativeExponent = *pos++ == '-';
+		int exponentValue = 0, exponentDigits = 0;
+		for (; pos < end && isDecimalDigit(*pos) && exponentDigits < 4; ++pos, ++exponentDigits)
+			exponentValue = exponentValue * 10 + (pos->unicode() - '0');
+		if (exponentDigits == 0)
+			return false;
+		exponent += negativeExponent ? -exponentValue : exponentValue;
+	}
+	if (pos != end || exponent < -22 || exponent > 22)
+		return false;
+
+	/* Both operands are exact, so the result is correctly rounded */
+	double result = exponent < 0 ? mantissa / powersOf10[-exponent]
+		: mantissa * powersOf10[exponent];
+	value = (float) (negative ? -result : result);
+	return true;
+}
+
+/**
+ * \brief Parse exactly \c count numbers separated by whitespace and/or
+ * commas (e.g. "1, 0.5, 2"). Returns \c false if the string contains 
+ * anything else.
+ *
+ * Scenes generated by scripts specify a vector or a number for almost 
+ * every property, so the tokens are converted in place instead of 
+ * splitting the string.
+ */
+static bool parseFloats(const QString &str, float *values, int count) {
+	const QChar *pos = str.constData(), *end = pos + str.size();
+	int index = 0;
+	while (true) {
+		while (pos < end && (*pos == ',' || pos->isSpace()))
+			++pos;
+		if (pos == end)
+			break;
+		const QChar *start = pos;
+		while (pos < end && *pos != ',' && !pos->isSpace())
+			++pos;
+		if (index == count)
+			return false;
+
+		if (!parseDecimal(start, pos, values[index])) {
+			bool success;
+			values[index] = QString(start, (int) (pos - start)).toFloat(&success);
+			if (!success)
+				return false;
+		}
+		++index;
+	}
+	return index == count;
+}
+
+/**
+ * \brief Object declared in the scene file, whose construction is
+ * deferred until the whole file has been parsed
+ */
+struct ObjectNode {
+	/// Expected class type of the object
+	NoriObject::EClassType classType;
+	/// Plugin name and parameters
+	QString type;
+	PropertyList propList;
+	/// Nested objects (in document order)
+	std::vector<ObjectNode *> children;
+	/// The constructed and activated object (or \c NULL)
+	NoriObject *object;
+	/// Has this node been scheduled for construction on a worker thread?
+	bool scheduled;
+	/// Used to wait for the worker thread (\c NULL if built by the caller)
+	ObjectSync *sync;
+	/// Has the worker thread finished? (protected by \ref sync)
+	bool done;
+	/// Error message of a failed construction on a worker thread
+	QString error;
+	/// Is the object taken over from a previously loaded scene instead? 
+	bool shared;
+
+	inline ObjectNode(NoriObject::EClassType classType, const QString &type,
+		const PropertyList &propList) : classType(classType), type(type), 
+		propList(propList), object(NULL), scheduled(false), sync(NULL), done(false),
+		shared(false) { }
+
+	/**
+	 * \brief Are objects of this type expensive to construct? (e.g. 
+	 * because they load or map a file). These are constructed in parallel.
+	 *
+	 * Luminaires that aren't part of a mesh are included, since the
+	 * environment luminaire decodes its map when it is activated.
+	 */
+	inline bool isExpensive() const {
+		return classType == NoriObject::EMesh || classType == NoriObject::EMedium
+			|| classType == NoriObject::ETexture || classType == NoriObject::ELuminaire;
+	}
+
+	/// Is this part of the scene geometry? (see \ref Scene::adoptGeometry())
+	inline bool isGeometry() const {
+		return classType == NoriObject::EMesh || classType == NoriObject::EInstance;
+	}
+
+	/// Construct the object without adding its children
+	NoriObject *create() const {
+		NoriObject *obj = NoriObjectFactory::createInstance(type, propList);
+
+		if (obj->getClassType() != classType)
+			throw NoriException(QString("Unexpectedly constructed an object "
+				"of type <%1> (expected type <%2>): %3")
+			.arg(NoriObject::classTypeName(obj->getClassType()))
+			.arg(NoriObject::classTypeName(classType))
+			.arg(obj->toString()));
+
+		return obj;
+	}
+
+	/**
+	 * \brief Construct the object after its children, add them, and activate it
+	 *
+	 * \param obj
+	 *    The object, if it was already created by the caller (see \ref create())
+	 */
+	NoriObject *build(NoriObject *obj = NULL) {
+		if (object)
+			return object;
+
+		if (!obj)
+			obj = create();
+
+		/* Add all children (as soon as they are available) */
+		for (size_t i=0; i<children.size(); ++i) {
+			if (children[i]->shared)
+				continue;
+			NoriObject *child = children[i]->get();
+			obj->addChild(child);
+			child->setParent(obj);
+		}
+
+		/* Activate / configure the object */
+		obj->activate();
+
+		object = obj;
+		return obj;
+	}
+
+	/// Return the object, waiting for its worker thread if necessary
+	NoriObject *get() {
+		if (!sync)
+			return build();
+
+		QMutexLocker locker(&sync->mutex);
+		while (!done)
+			sync->finished.wait(&sync->mutex);
+		if (!error.isEmpty())
+			throw NoriException(error);
+		return object;
+	}
+};
+
+/// Constructs scheduled objects until none are left
+class ObjectBuilder : public QThread {
+public:
+	ObjectBuilder(const std::vector<ObjectNode *> &nodes, QAtomicInt &nextNode)
+		: m_nodes(nodes), m_nextNode(nextNode) { }
+
+	void run() {
+		Profiler::getInstance()->setThreadName("scene loader");
+		int index;
+		while ((index = m_nextNode.fetchAndAddOrdered(1)) < (int) m_nodes.size()) {
+			ObjectNode *node = m_nodes[index];
+			QString error;
+			try {
+				node->build();
+			} catch (const NoriException &ex) {
+				error = ex.getReason();
+			} catch (const std::exception &ex) {
+				error = ex.what();
+			}
+
+			QMutexLocker locker(&node->sync->mutex);
+			node->error = error;
+			node->done = true;
+			node->sync->finished.wakeAll();
+		}
+	}
+private:
+	const std::vector<ObjectNode *> &m_nodes;
+	QAtomicInt &m_nextNode;
+};
+
+/// Objects declared in an included scene file (see \ref IncludeCache)
+struct IncludedFile {
+	/// Declaration of an object, whose children are given by their indices
+	struct Node {
+		NoriObject::EClassType classType;
+		QString type;
+		PropertyList propList;
+		std::vector<int> children;
+	};
+
+	/// All objects of the file in post-order (children precede their parents)
+	std::vector<Node> nodes;
+	/// Indices of the objects nested directly in the file's <scene> element
+	std::vector<int> roots;
+};
+
+/**
+ * \brief Parsed contents of the files referenced by <tt>&lt;include&gt;</tt>
+ * tags, shared by all scenes loaded by the process (e.g. the shots of a 
+ * render server, or the scenes given on the command line)
+ *
+ * Files are identified by their canonical path, and parsed again when
+ * their contents change.
+ */
+class IncludeCache {
+public:
+	static IncludeCache *getInstance() {
+		static IncludeCache cache;
+		return &cache;
+	}
+
+	/**
+	 * \brief Return the parsed contents of a file, parsing it if necessary
+	 *
+	 * \param path
+	 *    Canonical path of the file
+	 * \param flags
+	 *    Flags used to validate the file (see \ref ESceneLoadFlags)
+	 * \param includeStack
+	 *    Canonical paths of the files that include this one (to detect cycles)
+	 */
+	void get(const QString &path, int flags, const QStringList &includeStack,
+		IncludedFile &result);
+private:
+	struct Entry {
+		uint64_t hash;
+		IncludedFile contents;
+	};
+
+	IncludeCache() { }
+
+	QMutex m_mutex;
+	std::map<QString, Entry> m_files;
+};
+
 class NoriParser : public QXmlDefaultHandler {
 public:
 	/// Set of supported XML tags
@@ -41,6 +332,8 @@ public:
 		ESampler              = NoriObject::ESampler,
 		ETest                 = NoriObject::ETest, 
 		EReconstructionFilter = NoriObject::EReconstructionFilter,
+		EInstance             = NoriObject::EInstance,
+		ETexture              = NoriObject::ETexture,
 
 		/* Properties */
 		EBoolean = NoriObject::EClassTypeCount,
@@ -54,10 +347,22 @@ public:
 		ETranslate,
 		ERotate,
 		EScale,
-		ELookAt
+		ELookAt,
+
+		/* References to named objects and other files */
+		ERef,
+		EInclude
 	};
 
-	NoriParser() : m_root(NULL) {
+	/**
+	 * \param flags
+	 *    Flags used to validate included files (see \ref ESceneLoadFlags)
+	 * \param includeStack
+	 *    Canonical paths of the file being parsed and the files that include it
+	 */
+	NoriParser(int flags = 0, const QStringList &includeStack = QStringList())
+			: m_flags(flags), m_includeStack(includeStack), m_hasIncludes(false),
+			  m_root(NULL) {
 		/* Mapping from tag names to tag IDs */
 		m_tags["scene"]      = EScene;
 		m_tags["mesh"]       = EMesh;
@@ -70,6 +375,8 @@ public:
 		m_tags["sampler"]    = ESampler;
 		m_tags["rfilter"]    = EReconstructionFilter;
 		m_tags["test"]       = ETest;
+		m_tags["instance"]   = EInstance;
+		m_tags["texture"]    = ETexture;
 		m_tags["boolean"]    = EBoolean;
 		m_tags["integer"]    = EInteger;
 		m_tags["float"]      = EFloat;
@@ -82,45 +389,45 @@ public:
 		m_tags["rotate"]     = ERotate;
 		m_tags["scale"]      = EScale;
 		m_tags["lookat"]     = ELookAt;
+		m_tags["ref"]        = ERef;
+		m_tags["include"]    = EInclude;
 	}
 
 	struct ParserContext {
+		QString name;
 		QXmlAttributes attr;
 		PropertyList propList;
-		std::vector<NoriObject *> children;
+		std::vector<ObjectNode *> children;
 
-		inline ParserContext(const QXmlAttributes &attr) : attr(attr) { }
+		inline ParserContext(const QString &name, const QXmlAttributes &attr) 
+			: name(name), attr(attr) { }
 	};
 
 	float parseFloat(const QString &str) const {
-		bool success;
-		float result = str.toFloat(&success);
-		if (!success)
+		float result;
+		if (!parseFloats(str, &result, 1))
 			throw NoriException(QString("Unable to parse floating point value '%1'!").arg(str));
 		return result;
 	}
 
 	Vector3f parseVector(const QString &str) const {
-		QRegExp re("[\\s,]+");
-		QStringList list = str.split(re);
-		if (list.size() != 3)
-			throw NoriException(QString("Cannot parse 3-vector '%1'!").arg(str));
-						
 		Vector3f result;
-		for (int i=0; i<3; ++i)
-			result[i] = parseFloat(list[i]);
+		if (!parseFloats(str, result.data(), 3))
+			throw NoriException(QString("Cannot parse 3-vector '%1'!").arg(str));
 		return result;
 	}
 
 	bool startElement(const QString & /* unused */, const QString &name,
 		const QString& /* unused */, const QXmlAttributes &attr) {
 
-		ParserContext ctx(attr);
+		ParserContext ctx(name, attr);
 
 		if (name == "transform")
 			m_transform.setIdentity();
 		else if (name == "scene")
 			ctx.attr.append("type", "", "type", "scene");
+		else if (name == "instance")
+			ctx.attr.append("type", "", "type", "instance");
 
 		m_context.push_back(ctx);
 		return true;
@@ -137,33 +444,52 @@ public:
 		int tag = (int) it->second;
 
 		if (tag < NoriObject::EClassTypeCount) {
-			/* This is an object, first instantiate it */
-			NoriObject *obj = NoriObjectFactory::createInstance(
-				context.attr.value("type"),
-				context.propList
-			);
-
-			if (obj->getClassType() != (int) tag)
-				throw NoriException(QString("Unexpectedly constructed an object "
-					"of type <%1> (expected type <%2>): %3")
-				.arg(NoriObject::classTypeName(obj->getClassType()))
-				.arg(NoriObject::classTypeName((NoriObject::EClassType) tag))
-				.arg(obj->toString()));
-
-			/* Add all children */
-			for (size_t i=0; i<context.children.size(); ++i) {
-				obj->addChild(context.children[i]);
-				context.children[i]->setParent(obj);
-			}
+			/* This is an object. Record it -- it is constructed once the 
+			   whole file has been parsed (see \ref instantiate()) */
+			ObjectNode *obj = new ObjectNode((NoriObject::EClassType) tag,
+				context.attr.value("type"), context.propList);
+			obj->children = context.children;
+			m_nodes.push_back(obj);
 
-			/* Activate / configure the object */
-			obj->activate();
+			/* Remember named meshes of instances so that other instances 
+			   can share them. They are never added to the scene directly,
+			   which keeps the ownership unambiguous. */
+			QString id = context.attr.value("id");
+			if (!id.isEmpty()) {
+				if (tag != EMesh || m_context.size() < 2 || 
+						m_context[m_context.size() - 2].name != "instance")
+					throw NoriException(QString("Object id '%1': only meshes nested "
+						"inside an <instance> can be named!").arg(id));
+				if (m_ids.find(id) != m_ids.end())
+					throw NoriException(QString("Duplicate object id '%1'!").arg(id));
+				m_ids[id] = obj;
+			}
 
 			/* Add it to its parent, if there is one */
 			if (m_context.size() >= 2)
 				m_context[m_context.size() - 2].children.push_back(obj);
 			else
 				m_root = obj;
+		} else if (tag == ERef) {
+			/* Add a previously declared mesh to another instance */
+			QString id = context.attr.value("id");
+			if (m_context.size() < 2 || m_context[m_context.size() - 2].name != "instance")
+				throw NoriException(QString("Reference to object id '%1': <ref> "
+					"is only supported inside an <instance>!").arg(id));
+			std::map<QString, ObjectNode *>::const_iterator it2 = m_ids.find(id);
+			if (it2 == m_ids.end())
+				throw NoriException(QString("Reference to an unknown object id '%1'!").arg(id));
+			m_context[m_context.size() - 2].children.push_back(it2->second);
+		} else if (tag == EInclude) {
+			/* Add the objects declared in another scene file */
+			QString filename = context.attr.value("filename");
+			if (m_context.size() < 2 || (m_context[m_context.size() - 2].name != "scene"
+					&& m_context[m_context.size() - 2].name != "instance"))
+				throw NoriException(QString("Include of \"%1\": <include> is only "
+					"supported inside a <scene> or an <instance>!").arg(filename));
+			ParserContext &parent = m_context[m_context.size() - 2];
+			std::vector<ObjectNode *> nodes = include(filename, parent.name == "instance");
+			parent.children.insert(parent.children.end(), nodes.begin(), nodes.end());
 		} else {
 			/* This is a property */
 			PropertyList &propList = m_context[m_context.size() - 2].propList;
@@ -187,8 +513,8 @@ public:
 
 				case EFloat: {
 						QString value = context.attr.value("value");
-						float result = value.toFloat(&success);
-						if (!success)
+						float result;
+						if (!parseFloats(value, &result, 1))
 							throw NoriException(QString("Unable to parse float value '%1'!").arg(value));
 						propList.setFloat(context.attr.value("name"), result);
 					}
@@ -269,14 +595,470 @@ public:
 		return true;
 	}
 
-	inline NoriObject *getRoot() const {
-		return m_root;
+	~NoriParser() {
+		for (size_t i=0; i<m_nodes.size(); ++i)
+			delete m_nodes[i];
+	}
+
+	/**
+	 * \brief Construct the objects declared in the file and return the root
+	 *
+	 * Expensive objects (meshes and media, which e.g. load files) are
+	 * constructed in parallel on a pool of threads. Meanwhile, everything
+	 * else is assembled on the calling thread in document order, so that
+	 * e.g. the scene sees its children in the same order as before. 
+	 * Every object is handed to its parent as soon as it is ready, which
+	 * lets the scene start work on the first meshes (see 
+	 * \ref Scene::addChild()) while the others are still loading.
+	 *
+	 * \param geometrySource
+	 *    A previously loaded scene, whose geometry may be reused
+	 *    (see \ref loadScene())
+	 * \param sourceProvider
+	 *    Picks the previously loaded scene instead, once the geometry
+	 *    key is known (optional)
+	 */
+	NoriObject *instantiate(Scene *geometrySource = NULL, GeometrySource *sourceProvider = NULL) {
+		if (!m_root)
+			return NULL;
+
+		/* Create the scene first, so that it can take over the geometry 
+		   of the previous one. Its meshes and instances are then skipped */
+		NoriObject *rootObject = NULL;
+		if (m_root->classType == NoriObject::EScene) {
+			Scene *scene = static_cast<Scene *>(m_root->create());
+			scene->setGeometryKey(getGeometryKey());
+			if (sourceProvider) {
+				try {
+					geometrySource = sourceProvider->getGeometrySource(scene->getGeometryKey());
+				} catch (...) {
+					delete scene;
+					throw;
+				}
+			}
+			if (geometrySource && scene->adoptGeometry(geometrySource)) {
+				for (size_t i=0; i<m_root->children.size(); ++i) {
+					if (m_root->children[i]->isGeometry())
+						m_root->children[i]->shared = true;
+				}
+			} else if (scene->getShareMeshes()) {
+				shareMeshes();
+			}
+			rootObject = scene;
+		}
+
+		std::vector<ObjectNode *> scheduled;
+		schedule(m_root, scheduled);
+
+		int threadCount = std::min(getCoreCount(), (int) scheduled.size());
+		if (threadCount <= 1)
+			return m_root->build(rootObject);
+
+		ObjectSync sync;
+		for (size_t i=0; i<scheduled.size(); ++i)
+			scheduled[i]->sync = &sync;
+
+		QAtomicInt nextNode(0);
+		std::vector<ObjectBuilder *> builders(threadCount);
+		for (int i=0; i<threadCount; ++i) {
+			builders[i] = new ObjectBuilder(scheduled, nextNode);
+			builders[i]->start();
+		}
+
+		NoriObject *root = NULL;
+		QString error;
+		try {
+			root = m_root->build(rootObject);
+		} catch (const NoriException &ex) {
+			error = ex.getReason();
+		} catch (const std::exception &ex) {
+			error = ex.what();
+		}
+
+		/* The workers must be done before the nodes are released */
+		for (int i=0; i<threadCount; ++i) {
+			builders[i]->wait();
+			delete builders[i];
+		}
+		if (!error.isEmpty())
+			throw NoriException(error);
+
+		return root;
+	}
+	/**
+	 * \brief Write the parsed object graph to a binary cache file
+	 *
+	 * \param hash
+	 *    Hash of the scene file's contents, which identifies
+	 *    the version of the file that the cache belongs to
+	 */
+	void saveCache(const QString &filename, uint64_t hash) const {
+		/* A failure to write the cache is not fatal -- the file is simply parsed next time */
+		QFile file(filename);
+		if (!m_root || !file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+			cerr << "Warning: unable to write the scene cache \"" 
+				 << qPrintable(filename) << "\"" << endl;
+			return;
+		}
+
+		/* Nodes were created in post-order, so children always precede their parents */
+		std::map<const ObjectNode *, quint32> indices;
+		for (size_t i=0; i<m_nodes.size(); ++i)
+			indices[m_nodes[i]] = (quint32) i;
+
+		QDataStream stream(&file);
+		stream.setByteOrder(QDataStream::LittleEndian);
+		stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+		stream.writeRawData("NSC", 3);
+		stream << (quint8) NORI_SCENE_CACHE_VERSION << (quint64) hash
+			   << (quint32) m_nodes.size() << indices[m_root];
+
+		for (size_t i=0; i<m_nodes.size(); ++i) {
+			const ObjectNode *node = m_nodes[i];
+			stream << (qint32) node->classType << node->type;
+			node->propList.write(stream);
+			stream << (quint32) node->children.size();
+			for (size_t j=0; j<node->children.size(); ++j)
+				stream << indices[node->children[j]];
+		}
+
+		bool success = stream.status() == QDataStream::Ok;
+		file.close();
+		if (!success) {
+			cerr << "Warning: unable to write the scene cache \"" 
+				 << qPrintable(filename) << "\"" << endl;
+			file.remove();
+		}
+	}
+
+	/**
+	 * \brief Load the object graph from a cache file written by \ref saveCache()
+	 *
+	 * \return \c false if the file doesn't exist, is invalid, or 
+	 *    belongs to a different version of the scene
+	 */
+	bool loadCache(const QString &filename, uint64_t hash) {
+		QFile file(filename);
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+
+		QDataStream stream(&file);
+		stream.setByteOrder(QDataStream::LittleEndian);
+		stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+		char magic[3];
+		quint8 version;
+		quint64 fileHash;
+		quint32 nodeCount, rootIndex;
+		if (stream.readRawData(magic, 3) != 3)
+			return false;
+		stream >> version >> fileHash >> nodeCount >> rootIndex;
+		if (memcmp(magic, "NSC", 3) != 0 || version != NORI_SCENE_CACHE_VERSION 
+				|| fileHash != hash || rootIndex >= nodeCount) {
+			cout << "Scene cache \"" << qPrintable(filename) 
+				 << "\" is out of date, parsing the scene file .." << endl;
+			return false;
+		}
+
+		try {
+			for (quint32 i=0; i<nodeCount; ++i) {
+				qint32 classType;
+				QString type;
+				PropertyList propList;
+				stream >> classType >> type;
+				propList.read(stream);
+				if (classType < 0 || classType >= NoriObject::EClassTypeCount)
+					throw NoriException("invalid object type");
+
+				ObjectNode *node = new ObjectNode((NoriObject::EClassType) classType, type, propList);
+				m_nodes.push_back(node);
+
+				quint32 childCount;
+				stream >> childCount;
+				for (quint32 j=0; j<childCount && stream.status() == QDataStream::Ok; ++j) {
+					quint32 index;
+					stream >> index;
+					if (index >= i)
+						throw NoriException("invalid child index");
+					node->children.push_back(m_nodes[index]);
+				}
+				if (stream.status() != QDataStream::Ok)
+					throw NoriException("unexpected end of data");
+			}
+		} catch (const NoriException &ex) {
+			cerr << "Warning: ignoring the invalid scene cache \"" << qPrintable(filename)
+				 << "\" (" << qPrintable(ex.getReason()) << ")" << endl;
+			for (size_t i=0; i<m_nodes.size(); ++i)
+				delete m_nodes[i];
+			m_nodes.clear();
+			return false;
+		}
+
+		m_root = m_nodes[rootIndex];
+		cout << "Loaded the scene from the cache \"" << qPrintable(filename) << "\"" << endl;
+		return true;
+	}
+	/// Does the file include other files? (see \ref include())
+	inline bool hasIncludes() const { return m_hasIncludes; }
+
+	/**
+	 * \brief Return the objects nested in the root <tt>&lt;scene&gt;</tt>
+	 * element (for an included file)
+	 */
+	void getContents(const QString &filename, IncludedFile &contents) const {
+		if (!m_root || m_root->classType != NoriObject::EScene)
+			throw NoriException(QString("The included file \"%1\" must "
+				"contain a <scene>!").arg(filename));
+
+		/* Nodes were created in post-order; the root comes last */
+		std::map<const ObjectNode *, int> indices;
+		for (size_t i=0; i<m_nodes.size(); ++i) {
+			if (m_nodes[i] == m_root)
+				continue;
+			IncludedFile::Node node;
+			node.classType = m_nodes[i]->classType;
+			node.type = m_nodes[i]->type;
+			node.propList = m_nodes[i]->propList;
+			for (size_t j=0; j<m_nodes[i]->children.size(); ++j)
+				node.children.push_back(indices[m_nodes[i]->children[j]]);
+			indices[m_nodes[i]] = (int) contents.nodes.size();
+			contents.nodes.push_back(node);
+		}
+		for (size_t i=0; i<m_root->children.size(); ++i)
+			contents.roots.push_back(indices[m_root->children[i]]);
+	}
+private:
+	/**
+	 * \brief Create nodes for the objects declared in an included file,
+	 * and return those nested directly in its <tt>&lt;scene&gt;</tt>
+	 *
+	 * The file is only parsed once per process (see \ref IncludeCache).
+	 * Includes in instances share their nodes, i.e. all instances that 
+	 * include the same file refer to a single mesh. Includes in the
+	 * scene itself get their own objects each time.
+	 */
+	std::vector<ObjectNode *> include(const QString &filename, bool shared) {
+		QString path = QFileInfo(filename).canonicalFilePath();
+		if (path.isEmpty())
+			throw NoriException(QString("Unable to open the included file \"%1\"").arg(filename));
+		if (shared) {
+			std::map<QString, std::vector<ObjectNode *> >::const_iterator it 
+				= m_sharedIncludes.find(path);
+			if (it != m_sharedIncludes.end())
+				return it->second;
+		}
+		if (m_includeStack.contains(path))
+			throw NoriException(QString("The file \"%1\" includes itself!").arg(filename));
+
+		IncludedFile contents;
+		IncludeCache::getInstance()->get(path, m_flags, m_includeStack, contents);
+
+		/* The nodes are in post-order, so children are created first */
+		std::vector<ObjectNode *> nodes(contents.nodes.size());
+		for (size_t i=0; i<contents.nodes.size(); ++i) {
+			const IncludedFile::Node &node = contents.nodes[i];
+			nodes[i] = new ObjectNode(node.classType, node.type, node.propList);
+			for (size_t j=0; j<node.children.size(); ++j)
+				nodes[i]->children.push_back(nodes[node.children[j]]);
+			m_nodes.push_back(nodes[i]);
+		}
+
+		std::vector<ObjectNode *> roots;
+		for (size_t i=0; i<contents.roots.size(); ++i)
+			roots.push_back(nodes[contents.roots[i]]);
+		if (shared)
+			m_sharedIncludes[path] = roots;
+		m_hasIncludes = true;
+		return roots;
+	}
+
+	/// Collect the outermost expensive objects of a subtree in document order
+	void schedule(ObjectNode *node, std::vector<ObjectNode *> &scheduled) {
+		if (node->scheduled || node->shared)
+			return;
+		node->scheduled = true;
+		if (node->isExpensive()) {
+			scheduled.push_back(node);
+			return;
+		}
+		for (size_t i=0; i<node->children.size(); ++i)
+			schedule(node->children[i], scheduled);
+	}
+
+	/**
+	 * \brief Turn meshes of the scene that load the same geometry into
+	 * instances of one shared mesh
+	 *
+	 * Generated scenes often load the same OBJ or binary mesh several times
+	 * with different \c toWorld transformations, which are baked into the
+	 * vertices. Meshes whose parameters (apart from \c toWorld) and children
+	 * (BSDFs, textures, ..) are identical, and whose files are the same or
+	 * have the same contents, are replaced by instances of one mesh in
+	 * object space. It is then loaded, stored, and built only once. Meshes
+	 * with luminaires or media are left alone, since instances support
+	 * neither. The geometry key has already been computed at this point,
+	 * so it still describes the scene as written.
+	 */
+	void shareMeshes() {
+		/* Group the candidates by their parameters (without the filename) */
+		std::map<QByteArray, std::vector<size_t> > groups;
+		std::vector<ObjectNode *> &children = m_root->children;
+		for (size_t i=0; i<children.size(); ++i) {
+			const ObjectNode *node = children[i];
+			if (node->classType != NoriObject::EMesh || (node->type != "obj" && node->type != "binary"))
+				continue;
+			bool supported = true;
+			for (size_t j=0; j<node->children.size(); ++j) {
+				NoriObject::EClassType type = node->children[j]->classType;
+				supported &= type != NoriObject::ELuminaire && type != NoriObject::EMedium;
+			}
+			if (!supported)
+				continue;
+
+			PropertyList propList = node->propList;
+			propList.remove("toWorld");
+			propList.remove("filename");
+			QByteArray key;
+			QDataStream stream(&key, QIODevice::WriteOnly);
+			std::map<const ObjectNode *, quint32> written;
+			stream << node->type;
+			propList.write(stream);
+			stream << (quint32) node->children.size();
+			for (size_t j=0; j<node->children.size(); ++j)
+				writeGeometry(node->children[j], stream, written);
+			groups[key].push_back(i);
+		}
+
+		size_t sharedMeshes = 0, instances = 0;
+		std::map<QString, QByteArray> contentHashes;
+		for (std::map<QByteArray, std::vector<size_t> >::const_iterator it = groups.begin();
+				it != groups.end(); ++it) {
+			if (it->second.size() < 2)
+				continue;
+
+			/* Split the group by file (identified by its contents if
+			   several files have the same size) */
+			std::map<QString, std::vector<size_t> > files;
+			std::map<qint64, QStringList> sizes;
+			for (size_t j=0; j<it->second.size(); ++j) {
+				QFileInfo info(children[it->second[j]]->propList.getString("filename", ""));
+				QString path = info.canonicalFilePath();
+				if (path.isEmpty())
+					continue; /* Reported when the mesh is loaded */
+				if (files.find(path) == files.end() && !sizes[info.size()].contains(path))
+					sizes[info.size()] << path;
+				files[path].push_back(it->second[j]);
+			}
+			for (std::map<qint64, QStringList>::const_iterator it2 = sizes.begin();
+					it2 != sizes.end(); ++it2) {
+				const QStringList &paths = it2->second;
+				for (int j=1; j<paths.size(); ++j) {
+					for (int k=0; k<j; ++k) {
+						if (files[paths[k]].empty() || getContentHash(paths[j], contentHashes)
+								!= getContentHash(paths[k], contentHashes))
+							continue;
+						files[paths[k]].insert(files[paths[k]].end(),
+							files[paths[j]].begin(), files[paths[j]].end());
+						files[paths[j]].clear();
+						break;
+					}
+				}
+			}
+
+			for (std::map<QString, std::vector<size_t> >::const_iterator it2 = files.begin();
+					it2 != files.end(); ++it2) {
+				const std::vector<size_t> &indices = it2->second;
+				if (indices.size() < 2)
+					continue;
+
+				/* One mesh in object space, placed by an instance per copy */
+				const ObjectNode *first = children[indices[0]];
+				PropertyList meshProps = first->propList;
+				meshProps.remove("toWorld");
+				ObjectNode *mesh = new ObjectNode(NoriObject::EMesh, first->type, meshProps);
+				mesh->children = first->children;
+				m_nodes.push_back(mesh);
+
+				for (size_t j=0; j<indices.size(); ++j) {
+					PropertyList instanceProps;
+					instanceProps.setTransform("toWorld",
+						children[indices[j]]->propList.getTransform("toWorld", Transform()));
+					ObjectNode *instance = new ObjectNode(NoriObject::EInstance,
+						"instance", instanceProps);
+					instance->children.push_back(mesh);
+					m_nodes.push_back(instance);
+					children[indices[j]] = instance;
+				}
+				++sharedMeshes;
+				instances += indices.size();
+			}
+		}
+
+		if (sharedMeshes > 0)
+			cout << "Sharing " << sharedMeshes << " meshes between " << instances
+				 << " instances" << endl;
+	}
+
+	/// Return the MD5 hash of a file's contents (computed once per file)
+	static QByteArray getContentHash(const QString &path, std::map<QString, QByteArray> &hashes) {
+		std::map<QString, QByteArray>::const_iterator it = hashes.find(path);
+		if (it != hashes.end())
+			return it->second;
+		QCryptographicHash hash(QCryptographicHash::Md5);
+		QFile file(path);
+		if (file.open(QIODevice::ReadOnly)) {
+			while (!file.atEnd())
+				hash.addData(file.read(1 << 20));
+		}
+		QByteArray result = file.error() == QFile::NoError ? hash.result() : path.toUtf8();
+		hashes[path] = result;
+		return result;
+	}
+
+	/**
+	 * \brief Serialize the meshes and instances of the scene (including 
+	 * their BSDFs, luminaires etc.), which identifies its geometry
+	 */
+	QByteArray getGeometryKey() const {
+		QByteArray key;
+		QDataStream stream(&key, QIODevice::WriteOnly);
+		std::map<const ObjectNode *, quint32> written;
+		for (size_t i=0; i<m_root->children.size(); ++i) {
+			if (m_root->children[i]->isGeometry())
+				writeGeometry(m_root->children[i], stream, written);
+		}
+		return key;
+	}
+
+	/// Recursively write an object and its children (see \ref getGeometryKey())
+	void writeGeometry(const ObjectNode *node, QDataStream &stream,
+			std::map<const ObjectNode *, quint32> &written) const {
+		/* Meshes that are shared by several instances are only written once */
+		std::map<const ObjectNode *, quint32>::const_iterator it = written.find(node);
+		if (it != written.end()) {
+			stream << (qint32) -1 << it->second;
+			return;
+		}
+		quint32 index = (quint32) written.size();
+		written[node] = index;
+
+		stream << (qint32) node->classType << node->type;
+		node->propList.write(stream);
+		stream << (quint32) node->children.size();
+		for (size_t i=0; i<node->children.size(); ++i)
+			writeGeometry(node->children[i], stream, written);
 	}
 private:
+	int m_flags;
+	QStringList m_includeStack;
+	bool m_hasIncludes;
 	std::map<QString, ETag> m_tags;
+	std::map<QString, ObjectNode *> m_ids;
+	std::map<QString, std::vector<ObjectNode *> > m_sharedIncludes;
 	std::vector<ParserContext> m_context;
+	std::vector<ObjectNode *> m_nodes;
 	Eigen::Affine3f m_transform;
-	NoriObject *m_root;
+	ObjectNode *m_root;
 };
 
 /// Handle XML schema verification errors
@@ -307,38 +1089,135 @@ public:
 	}
 };
 
-NoriObject *loadScene(const QString &filename) {
-	NoriParser parser;
-	QFile schemaFile(":/schema.xsd");
-	QXmlSchema schema;
+/// Compute a 64 bit FNV-1a hash of the contents of a scene file
+static uint64_t hashScene(const QByteArray &data) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i=0; i<data.size(); ++i) {
+		hash ^= (uint8_t) data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/// Validate (unless disabled by \c flags) and parse the contents of a scene file
+static void parseScene(NoriParser &parser, const QString &filename,
+		const QByteArray &contents, int flags) {
+	if (!(flags & ESkipValidation)) {
+		ProfileScope scope("Validate XML", "load");
+		QFile schemaFile(":/schema.xsd");
+		QXmlSchema schema;
+		NoriMessageHandler handler;
+		schema.setMessageHandler(&handler);
+		if (!schemaFile.open(QIODevice::ReadOnly))
+			throw NoriException("Unable to open the XML schema!");
+		if (!schema.load(schemaFile.readAll()))
+			throw NoriException("Unable to parse the XML schema!");
+
+		QXmlSchemaValidator validator(schema);
+		if (!validator.validate(contents, QUrl::fromLocalFile(filename)))
+			throw NoriException(QString("Unable to validate the file \"%1\"").arg(filename));
+	}
+
+	ProfileScope scope("Parse XML", "load");
+	scope.setDetail(filename);
+	QXmlInputSource source;
+	source.setData(contents);
+	QXmlSimpleReader reader;
+	reader.setContentHandler(&parser);
+	if (!reader.parse(source)) 
+		throw NoriException(QString("Unable to parse the file \"%1\"").arg(filename));
+}
+
+void IncludeCache::get(const QString &path, int flags, 
+		const QStringList &includeStack, IncludedFile &result) {
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Unable to open the included file \"%1\"").arg(path));
+	QByteArray contents = file.readAll();
+	file.close();
+	uint64_t hash = hashScene(contents);
+
+	{
+		QMutexLocker locker(&m_mutex);
+		std::map<QString, Entry>::const_iterator it = m_files.find(path);
+		if (it != m_files.end() && it->second.hash == hash) {
+			result = it->second.contents;
+			return;
+		}
+	}
+
+	/* Parse without holding the lock, since the file may include others.
+	   Concurrent loads of the same file each parse it, which is harmless */
+	NoriParser parser(flags, QStringList(includeStack) << path);
+	parseScene(parser, path, contents, flags);
+	Entry entry;
+	entry.hash = hash;
+	parser.getContents(path, entry.contents);
+	result = entry.contents;
+
+	QMutexLocker locker(&m_mutex);
+	m_files[path] = entry;
+}
+
+/// Implementation of both versions of \ref loadScene()
+/// Create the objects of a parsed scene, taking their memory from a new pool (see \ref ObjectPool)
+static NoriObject *instantiateScene(NoriParser &parser, Scene *geometrySource,
+		GeometrySource *sourceProvider) {
+	ProfileScope scope("Create objects", "load");
+	ObjectPool *pool = new ObjectPool();
+	NoriObject *root;
+	try {
+		root = parser.instantiate(geometrySource, sourceProvider);
+	} catch (...) {
+		pool->close();
+		throw;
+	}
+	pool->close();
+	return root;
+}
+
+static NoriObject *loadSceneFile(const QString &filename, int flags, Scene *geometrySource,
+		GeometrySource *sourceProvider) {
+	QString path = QFileInfo(filename).canonicalFilePath();
+	NoriParser parser(flags, QStringList() << (path.isEmpty() ? filename : path));
 
 	#if !defined(PLATFORM_WINDOWS)
 		/* Fixes number parsing on some machines (notably those with locale ru_RU) */
 		setlocale(LC_NUMERIC, "C");
 	#endif
 
-	NoriMessageHandler handler;
-	schema.setMessageHandler(&handler);
-	if (!schemaFile.open(QIODevice::ReadOnly))
-		throw NoriException("Unable to open the XML schema!");
-	if (!schema.load(schemaFile.readAll()))
-		throw NoriException("Unable to parse the XML schema!");
-
-	QXmlSchemaValidator validator(schema);
 	QFile file(filename);
 	if (!file.open(QIODevice::ReadOnly))
 		throw NoriException(QString("Unable to open the file \"%1\"").arg(filename));
-	if (!validator.validate(&file))
-		throw NoriException(QString("Unable to validate the file \"%1\"").arg(filename));
+	QByteArray contents = file.readAll();
+	file.close();
 
-	QXmlInputSource source(&file);
-	file.seek(0);
-	QXmlSimpleReader reader;
-	reader.setContentHandler(&parser);
-	if (!reader.parse(source)) 
-		throw NoriException(QString("Unable to parse the file \"%1\"").arg(filename));
+	/* The cache skips both the validation and the parsing */
+	QString cacheFilename = filename + ".cache";
+	uint64_t hash = 0;
+	if (flags & EUseSceneCache) {
+		hash = hashScene(contents);
+		if (parser.loadCache(cacheFilename, hash))
+			return instantiateScene(parser, geometrySource, sourceProvider);
+	}
+
+	parseScene(parser, filename, contents, flags);
+
+	/* The cache only tracks the file itself, not the files that it includes */
+	if ((flags & EUseSceneCache) && !parser.hasIncludes())
+		parser.saveCache(cacheFilename, hash);
+	else if (flags & EUseSceneCache)
+		cout << "Not caching \"" << qPrintable(filename) << "\", since it includes other files" << endl;
+
+	return instantiateScene(parser, geometrySource, sourceProvider);
+}
+
+NoriObject *loadScene(const QString &filename, int flags, Scene *geometrySource) {
+	return loadSceneFile(filename, flags, geometrySource, NULL);
+}
 
-	return parser.getRoot();
+NoriObject *loadScene(const QString &filename, int flags, GeometrySource &geometrySource) {
+	return loadSceneFile(filename, flags, NULL, &geometrySource);
 }
 
 NORI_NAMESPACE_END
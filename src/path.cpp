@@ -0,0 +1,1470 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/bsdf.h>
+#include <nori/bssrdf.h>
+#include <nori/phase.h>
+#include <nori/accel.h>
+#include <nori/arena.h>
+#include <nori/sdtree.h>
+#include <nori/spectrum.h>
+#include <QElapsedTimer>
+
+/// Maximum number of interactions per path (including split-off paths) that teach the SD-tree
+#define NORI_GUIDING_MAX_VERTICES 32
+
+/// Maximum number of split-off paths per camera ray that wait to be traced
+#define NORI_SPLITTING_MAX_BRANCHES 16
+
+/// Width and height of the image regions whose contributions are estimated for splitting
+#define NORI_SPLITTING_TILE_SIZE 8
+
+NORI_NAMESPACE_BEGIN
+
+/// Interaction of a path whose incident radiance is recorded into the SD-tree
+struct GuidingVertex {
+	/// Leaf of the SD-tree containing the interaction
+	SDTreeLeaf *leaf;
+	/// Sampled direction (world space)
+	Vector3f d;
+	/// Throughput of the path up to the interaction, excluding the sampled direction
+	Color3f prefix;
+	/// Throughput of the path up to the interaction, including the sampled direction
+	Color3f throughput;
+	/// Radiance that the luminaire sample reflected toward the path (excluding its throughput)
+	Color3f direct;
+	/// Sum of the contributions of the path that arrived along \c d
+	Color3f radiance;
+	/// Index of the previous vertex along the path (-1 = none)
+	int parent;
+};
+
+/// State of a path that was split off at an interaction (see \ref PathTracer::splitPath())
+struct PathBranch {
+	Ray3f ray;
+	Color3f throughput;
+	float dirPdf;
+	MediumStack media;
+	/// Depth of the next segment
+	int depth;
+	/// Index of the last vertex along the path (-1 = none)
+	int vertex;
+};
+
+/**
+ * \brief Coarse estimate of the image, learned during the passes of a
+ * progressive rendering (the mean luminance of square regions of
+ * \ref NORI_SPLITTING_TILE_SIZE pixels)
+ */
+class ImageEstimate {
+public:
+	ImageEstimate(const Vector2i &size) {
+		m_columns = std::max(1, (size.x() + NORI_SPLITTING_TILE_SIZE - 1) / NORI_SPLITTING_TILE_SIZE);
+		m_rows = std::max(1, (size.y() + NORI_SPLITTING_TILE_SIZE - 1) / NORI_SPLITTING_TILE_SIZE);
+		m_sum.resize(m_columns * m_rows, 0.0f);
+		m_count.resize(m_columns * m_rows, 0.0f);
+		m_estimate.resize(m_columns * m_rows, 0.0f);
+	}
+
+	/// Return the estimate of the region containing \c pixel (zero = unknown)
+	inline float lookup(const Point2f &pixel) const {
+		return m_estimate[index(pixel)];
+	}
+
+	/// Record the contribution of a sample of the current pass (thread-safe)
+	inline void record(const Point2f &pixel, float value) {
+		if (!(value >= 0 && value < std::numeric_limits<float>::infinity()))
+			return;
+		int i = index(pixel);
+		atomicAdd(&m_sum[i], value);
+		atomicAdd(&m_count[i], 1.0f);
+	}
+
+	/// Replace the estimates by the means of the pass that just ended
+	void update() {
+		for (size_t i=0; i<m_estimate.size(); ++i) {
+			if (m_count[i] > 0)
+				m_estimate[i] = m_sum[i] / m_count[i];
+			m_sum[i] = m_count[i] = 0.0f;
+		}
+	}
+private:
+	inline int index(const Point2f &pixel) const {
+		int x = clamp((int) pixel.x() / NORI_SPLITTING_TILE_SIZE, 0, m_columns - 1),
+		    y = clamp((int) pixel.y() / NORI_SPLITTING_TILE_SIZE, 0, m_rows - 1);
+		return x + y * m_columns;
+	}
+
+	int m_columns, m_rows;
+	std::vector<float> m_sum, m_count, m_estimate;
+};
+
+/**
+ * \brief Unidirectional volumetric path tracer
+ *
+ * At every surface and medium interaction, the path tracer samples a
+ * luminaire (next-event estimation, see \ref Scene::sampleLuminaire())
+ * and traces a shadow ray. It then continues the path by sampling the
+ * BSDF or phase function, and the radiance found this way is combined
+ * with that of the luminaire samples using multiple importance sampling
+ * (power heuristic). Distances to medium interactions are sampled
+ * using \ref Scene::sampleDistance(), where a \ref MediumStack keeps
+ * track of the media bound to mesh interiors.
+ *
+ * Distance sampling rarely places interactions close to small luminaires
+ * in thin media (e.g. fog). With \c equiangular (the default), every
+ * segment through a medium that exposes the density of its distance
+ * samples (see \ref Medium::evalDistance()) additionally samples a
+ * luminaire, and then a distance along the segment proportional to the
+ * inverse squared distance to it (Kulla and Fajardo, "Importance Sampling
+ * Techniques for Path Tracing in Participating Media"). The share of
+ * the luminaire samples in the MIS weights is divided between both
+ * strategies using the power heuristic.
+ *
+ * Emitting media are sampled by their luminaires (see \ref 
+ * Medium::getLuminaire()) at every interaction. Medium interactions only
+ * gather their emission along the camera ray and after discrete BSDF
+ * components, where no luminaire sample was taken, since the density
+ * of reaching a point by distance sampling is unknown in general.
+ *
+ * After \c rrDepth segments, paths are terminated using Russian roulette
+ * with a survival probability given by their throughput. The state of
+ * a path lives on the stack, so that no memory is allocated per path.
+ *
+ * In wavefront mode (\c wavefront property), the render threads pass
+ * whole batches of camera rays, and all paths of a batch are advanced
+ * together one stage at a time: intersection (as packets for the camera
+ * rays, then in sorted order), medium sampling, shading of the surface
+ * interactions sorted by BSDF and of the medium interactions, and
+ * finally all shadow rays in sorted order. The sorted rays are passed
+ * to the acceleration data structure as whole batches (see \ref
+ * Accelerator::rayIntersectBatch()). Each BSDF evaluates the
+ * luminaire samples and draws the continuation directions of all of its
+ * interactions in batched calls (see \ref BSDF::eval()). The path states
+ * are kept in arrays per field that are allocated from the memory arena
+ * of the render thread.
+ *
+ * With path guiding (\c guiding property), the path tracer learns the
+ * incident radiance field of the scene in an \ref SDTree while it renders
+ * progressive passes (Mueller et al., "Practical Path Guiding"). At
+ * surfaces with a non-discrete BSDF, a direction is then sampled from the
+ * distribution learned in the previous pass with probability
+ * \c guidingFraction, and from the BSDF otherwise; both the sample weight
+ * and the MIS weights of the luminaire samples use the density of this
+ * mixture. The radiance that the paths find along their sampled directions
+ * is recorded into the tree at the same time (using atomic additions),
+ * and the tree is refined between passes. Guided paths are always traced
+ * one at a time, also in wavefront mode.
+ *
+ * Translucent materials with a diffusion profile (see \ref DiffusionProfile)
+ * are supported by the scalar path tracer: light that is transmitted
+ * through their boundary continues from an exit point that is found
+ * using probe rays. The spectral and wavefront modes only see the
+ * specular reflection of their boundary.
+ *
+ * With \c splitting, Russian roulette and splitting are driven by the
+ * expected contribution of a path instead of its throughput (Vorba and
+ * Krivanek, "Adjoint-Driven Russian Roulette and Splitting in Light 
+ * Transport Simulation"). During the passes of a progressive rendering,
+ * the leaves of the SD-tree learn the mean radiance that leaves their
+ * region toward the paths, and a coarse image learns the contribution of
+ * each region of pixels. At every interaction, the throughput times the
+ * radiance of the leaf is compared with the estimate of the pixel: paths
+ * expected to contribute much less are terminated with a probability,
+ * and those expected to contribute much more are split into several
+ * (at most \c maxSplits), so that the effort goes where the variance
+ * comes from. Until the estimates exist (i.e. in the first pass), the 
+ * throughput-based roulette applies. Such paths are traced one at a time,
+ * wavefront mode is not supported.
+ *
+ * In spectral mode (\c spectral property), every path carries four
+ * wavelengths instead of the three color channels (see \ref Wavelengths):
+ * the colors of BSDFs, luminaires, and media are turned into spectra at
+ * the wavelengths, chromatic media sample distances for the hero 
+ * wavelength (see \ref Medium::sampleSpectralDistance()), and the
+ * radiance of the path is turned back into a color at the end. This
+ * handles media whose extinction strongly depends on the wavelength 
+ * without separate passes per channel. Spectral paths are traced one at
+ * a time, without guiding, splitting, or equiangular sampling.
+ */
+class PathTracer : public Integrator {
+public:
+	PathTracer(const PropertyList &propList) {
+		/* Maximum number of path segments (-1 = unlimited) */
+		m_maxDepth = propList.getInteger("maxDepth", -1);
+
+		/* Number of segments after which Russian roulette starts */
+		m_rrDepth = propList.getInteger("rrDepth", 5);
+
+		if (m_maxDepth == 0 || m_maxDepth < -1)
+			throw NoriException(QString("PathTracer: invalid maxDepth %1 (must be "
+				"positive or -1)").arg(m_maxDepth));
+		if (m_rrDepth < 1)
+			throw NoriException(QString("PathTracer: invalid rrDepth %1 (must be >= 1)")
+				.arg(m_rrDepth));
+
+		/* Advance the paths of whole batches of pixel samples stage by stage */
+		m_wavefront = propList.getBoolean("wavefront", false);
+
+		/* Learn the incident radiance during progressive passes and
+		   sample directions from it */
+		m_guiding = propList.getBoolean("guiding", false);
+
+		/* Probability of sampling a direction from the learned distribution */
+		m_guidingFraction = propList.getFloat("guidingFraction", 0.5f);
+
+		/* Number of samples per pass after which a spatial leaf of the SD-tree is split */
+		m_spatialThreshold = propList.getFloat("spatialThreshold", 12000.0f);
+
+		/* Fraction of the recorded radiance above which a directional node is split */
+		m_directionalThreshold = propList.getFloat("directionalThreshold", 0.01f);
+
+		if (m_guidingFraction <= 0 || m_guidingFraction >= 1)
+			throw NoriException(QString("PathTracer: invalid guidingFraction %1 (must be "
+				"in (0, 1))").arg(m_guidingFraction));
+		if (m_spatialThreshold < 1)
+			throw NoriException(QString("PathTracer: invalid spatialThreshold %1 (must be >= 1)")
+				.arg(m_spatialThreshold));
+		if (m_directionalThreshold <= 0 || m_directionalThreshold >= 1)
+			throw NoriException(QString("PathTracer: invalid directionalThreshold %1 (must be "
+				"in (0, 1))").arg(m_directionalThreshold));
+
+		/* Split and terminate paths based on their expected contribution */
+		m_splitting = propList.getBoolean("splitting", false);
+
+		/* Maximum number of paths that a path is split into at one interaction */
+		m_maxSplits = propList.getInteger("maxSplits", 8);
+
+		/* Ratio between the largest and the smallest expected contribution
+		   of the paths that are left as they are */
+		m_windowSize = propList.getFloat("windowSize", 5.0f);
+
+		if (m_maxSplits < 1)
+			throw NoriException(QString("PathTracer: invalid maxSplits %1 (must be >= 1)")
+				.arg(m_maxSplits));
+		if (m_windowSize < 1)
+			throw NoriException(QString("PathTracer: invalid windowSize %1 (must be >= 1)")
+				.arg(m_windowSize));
+
+		/* Splitting needs the pixel of every sample */
+		if (m_splitting && m_wavefront) {
+			cout << "PathTracer: splitting is not supported in wavefront mode, "
+				"tracing one path at a time" << endl;
+			m_wavefront = false;
+		}
+
+		/* Sample single scattering toward luminaires equiangularly in media */
+		m_equiangular = propList.getBoolean("equiangular", true);
+
+		/* Carry four wavelengths per path instead of RGB */
+		m_spectral = propList.getBoolean("spectral", false);
+		if (m_spectral && (m_wavefront || m_guiding || m_splitting)) {
+			cout << "PathTracer: wavefront mode, guiding, and splitting are not "
+				"supported in spectral mode, disabling them" << endl;
+			m_wavefront = m_guiding = m_splitting = false;
+		}
+
+		m_passes = m_guiding || m_splitting;
+		m_sdtree = NULL;
+		m_image = NULL;
+	}
+
+	virtual ~PathTracer() {
+		delete m_sdtree;
+		delete m_image;
+	}
+
+	void preprocess(const Scene *scene, int pass) {
+		if (!m_sdtree) {
+			m_sdtree = new SDTree(scene->getBoundingBox());
+			if (m_splitting)
+				m_image = new ImageEstimate(scene->getCamera()->getOutputSize());
+			return;
+		}
+
+		/* Learn from the pass that just ended. No render thread
+		   accesses the tree at this point */
+		QElapsedTimer timer;
+		timer.start();
+		m_sdtree->refine(m_spatialThreshold, m_directionalThreshold);
+		if (m_image)
+			m_image->update();
+		cout << "Pass " << pass + 1 << ": refined the SD-tree (" << m_sdtree->getLeafCount()
+			 << " leaves, " << m_sdtree->getDirectionalNodeCount() << " directional nodes, "
+			 << timer.elapsed() << " ms)" << endl;
+	}
+
+	Color3f Li(RenderContext &context, const Ray3f &_ray) const {
+		if (m_spectral)
+			return LiSpectral(context, _ray);
+
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+		const Luminaire *env = scene->getEnvironmentLuminaire();
+		bool hasLuminaires = !scene->getLuminaires().empty();
+
+		Ray3f ray(_ray);
+		Color3f result(0.0f), throughput(1.0f);
+		MediumStack media(scene->getMedium());
+		Intersection its;
+
+		/* Density of the direction of the current segment (wrt. solid angles
+		   at its origin), or zero if it can't be sampled by the luminaires */
+		float dirPdf = 0.0f;
+
+		/* Interactions that record their incident radiance, and the last
+		   one along the current path (-1 = none) */
+		GuidingVertex vertices[NORI_GUIDING_MAX_VERTICES];
+		int vertexCount = 0, vertex = -1;
+
+		/* Paths that were split off and remain to be traced */
+		PathBranch branches[NORI_SPLITTING_MAX_BRANCHES];
+		int branchCount = 0;
+
+		/* Expected contribution of the pixel (zero = unknown) */
+		float pixelEstimate = m_image ? m_image->lookup(context.pixel) : 0.0f;
+
+		int depth = 1;
+		while (true) {
+			for (; ; ++depth) {
+				context.rayCount++;
+				bool hit;
+				{
+					PathStageTimer stageTimer(context.pathStats, PathStatistics::ETraversal);
+					hit = context.rayIntersect(ray, its);
+				}
+				bool canExtend = m_maxDepth < 0 || depth < m_maxDepth;
+
+				/* Sample a medium interaction along the segment */
+				Ray3f segment(ray.o, ray.d, ray.mint, hit ? its.t : ray.maxt);
+				segment.time = ray.time;
+				if (m_equiangular && hasLuminaires && canExtend && media.top())
+					addRadiance(result, throughput * sampleEquiangular(context, segment, media),
+						vertices, vertex);
+				float t;
+				Color3f mediumWeight;
+				bool mediumInteraction;
+				{
+					PathStageTimer stageTimer(context.pathStats, PathStatistics::EMedium);
+					mediumInteraction = scene->sampleDistance(segment, sampler,
+						t, mediumWeight, media);
+				}
+				if (mediumInteraction && context.pathStats)
+					context.pathStats->mediumInteractions++;
+
+				/* Radiance emitted by the medium, unless luminaire samples
+				   from the origin of the segment account for it */
+				if (mediumInteraction && dirPdf == 0 && media.top()->getLuminaire())
+					addRadiance(result, throughput * media.top()->evalCollisionEmission(ray(t)),
+						vertices, vertex);
+
+				throughput *= mediumWeight;
+				if (throughput.isZero())
+					break;
+
+				/* Number of continuations chosen by splitPath() (-1 = none) */
+				int splits = -1;
+
+				if (mediumInteraction) {
+					if (!canExtend)
+						break;
+					Point3f p = ray(t);
+					const PhaseFunction *phase = media.top()->getPhaseFunction();
+					SDTreeLeaf *leaf = m_splitting && m_sdtree ? m_sdtree->lookup(p) : NULL;
+
+					/* Next-event estimation */
+					Color3f direct(0.0f);
+					if (hasLuminaires) {
+						LuminaireQueryRecord lRec(p);
+						Color3f value = sampleLuminaire(scene, sampler, phase, -ray.d, lRec);
+						if (!value.isZero() && m_equiangular)
+							value *= distanceWeight(scene, segment, t, lRec, media.top());
+						if (!value.isZero()) {
+							direct = value * transmittance(context, lRec, media, ray.time);
+							addRadiance(result, throughput * direct, vertices, vertex);
+						}
+					}
+
+					splits = splitPath(sampler, leaf, pixelEstimate, branchCount, throughput);
+					if (splits == 0)
+						break;
+
+					/* Continue the path by sampling the phase function, once
+					   for each path that was split off and then for this one */
+					for (int k=1; k<splits; ++k) {
+						PathBranch &branch = branches[branchCount];
+						branch.ray = ray;
+						branch.throughput = throughput;
+						branch.media = media;
+						if (!samplePhase(sampler, phase, p, branch.ray, branch.throughput, branch.dirPdf)) {
+							countFailure(context);
+							continue;
+						}
+						branch.depth = depth + 1;
+						branch.vertex = addVertex(vertices, vertexCount, vertex, leaf,
+							branch.ray.d, throughput, branch.throughput, direct);
+						++branchCount;
+					}
+					Color3f prefix(throughput);
+					if (!samplePhase(sampler, phase, p, ray, throughput, dirPdf)) {
+						countFailure(context);
+						break;
+					}
+					vertex = addVertex(vertices, vertexCount, vertex, leaf,
+						ray.d, prefix, throughput, direct);
+				} else if (!hit) {
+					/* The path leaves the scene */
+					if (env) {
+						LuminaireQueryRecord lRec(env, ray.o, ray.d);
+						addRadiance(result, throughput * env->eval(lRec)
+							* emitterWeight(scene, lRec, dirPdf), vertices, vertex);
+					}
+					break;
+				} else {
+					its.computeDifferentialGeometry();
+
+					/* Pass through null interfaces without counting a bounce. The
+					   segment keeps its origin, and hence the MIS weight of
+					   luminaires that are hit further along */
+					const BSDF *bsdf = its.mesh->getBSDF();
+					if (bsdf && bsdf->isNull()) {
+						media.update(its, ray.d);
+						ray.mint = its.t + Epsilon;
+						--depth;
+						continue;
+					}
+
+					its.computeFootprint(ray);
+					if (depth == 1 && context.aov)
+						context.aov->set(its);
+
+					/* Radiance emitted by the surface */
+					const Luminaire *luminaire = its.mesh->getLuminaire();
+					if (luminaire) {
+						LuminaireQueryRecord lRec(luminaire, ray.o, its.p, its.shFrame.n);
+						lRec.triangle = its.primIndex;
+						addRadiance(result, throughput * luminaire->eval(lRec)
+							* emitterWeight(scene, lRec, dirPdf), vertices, vertex);
+					}
+
+					if (!canExtend || !bsdf)
+						break;
+					Vector3f wi = its.toLocal(-ray.d);
+
+					/* Translucent material: the light that is transmitted through
+					   its boundary (chosen with that probability) leaves it at a
+					   point nearby, where the path continues with the exit BSDF */
+					const DiffusionProfile *profile = bsdf->getDiffusionProfile();
+					if (profile && Frame::cosTheta(wi) > 0) {
+						float reflectance = profile->fresnel(Frame::cosTheta(wi));
+						if (sampler->next1D() < reflectance) {
+							throughput /= reflectance;
+						} else {
+							Color3f weight;
+							if (!profile->sampleExit(scene, sampler, ray.time, its,
+									weight, context.rayCount))
+								break;
+							throughput *= weight;
+							if (throughput.isZero())
+								break;
+							bsdf = profile->getExitBSDF();
+							wi = Vector3f(0.0f, 0.0f, 1.0f);
+						}
+					}
+
+					/* Guide the sampling once the leaf has learned something */
+					SDTreeLeaf *leaf = NULL;
+					if (m_sdtree && (m_splitting || !bsdf->isDiscrete()))
+						leaf = m_sdtree->lookup(its.p);
+					const SDTreeLeaf *guide = m_guiding && leaf && !bsdf->isDiscrete()
+						&& leaf->canSample() ? leaf : NULL;
+
+					/* Next-event estimation */
+					Color3f direct(0.0f);
+					if (hasLuminaires) {
+						LuminaireQueryRecord lRec(its.p);
+						Color3f value = sampleLuminaire(scene, sampler, its, bsdf, wi, lRec, guide);
+						if (!value.isZero()) {
+							direct = value * transmittance(context, lRec, media, ray.time);
+							addRadiance(result, throughput * direct, vertices, vertex);
+						}
+					}
+
+					splits = splitPath(sampler, leaf, pixelEstimate, branchCount, throughput);
+					if (splits == 0)
+						break;
+
+					/* Continue the path by sampling the BSDF (see above) */
+					for (int k=1; k<splits; ++k) {
+						PathBranch &branch = branches[branchCount];
+						branch.ray = ray;
+						branch.throughput = throughput;
+						branch.media = media;
+						if (!sampleBSDF(sampler, its, bsdf, wi, branch.ray, branch.throughput,
+								branch.dirPdf, branch.media, guide)) {
+							countFailure(context);
+							continue;
+						}
+						branch.depth = depth + 1;
+						branch.vertex = addVertex(vertices, vertexCount, vertex, leaf,
+							branch.ray.d, throughput, branch.throughput, direct);
+						++branchCount;
+					}
+					Color3f prefix(throughput);
+					if (!sampleBSDF(sampler, its, bsdf, wi, ray, throughput, dirPdf, media, guide)) {
+						countFailure(context);
+						break;
+					}
+					vertex = addVertex(vertices, vertexCount, vertex, leaf,
+						ray.d, prefix, throughput, direct);
+				}
+
+				if (splits < 0 && !russianRoulette(sampler, depth, throughput))
+					break;
+			}
+			if (context.pathStats)
+				context.pathStats->addPath(depth);
+
+			if (branchCount == 0)
+				break;
+
+			/* Trace the next path that was split off */
+			const PathBranch &branch = branches[--branchCount];
+			ray = branch.ray;
+			throughput = branch.throughput;
+			dirPdf = branch.dirPdf;
+			media = branch.media;
+			depth = branch.depth;
+			vertex = branch.vertex;
+		}
+
+		/* Record the radiance that arrived along the sampled directions,
+		   and the radiance that left the interactions toward the paths */
+		for (int i=0; i<vertexCount; ++i) {
+			const GuidingVertex &v = vertices[i];
+			Color3f radiance(0.0f), reflected(v.direct);
+			for (int c=0; c<3; ++c) {
+				if (v.throughput[c] > 0)
+					radiance[c] = v.radiance[c] / v.throughput[c];
+				if (v.prefix[c] > 0)
+					reflected[c] += v.radiance[c] / v.prefix[c];
+			}
+			v.leaf->record(v.d, radiance.getLuminance());
+			if (m_splitting)
+				v.leaf->recordReflected(reflected.getLuminance());
+		}
+
+		if (m_image)
+			m_image->record(context.pixel, result.getLuminance());
+
+		return result;
+	}
+
+	void Li(RenderContext &context, const Ray3f *cameraRays,
+			Color3f *result, uint32_t count) const {
+		/* Guided paths, paths that may pass through null interfaces (see
+		   below), equiangular sampling and emitting media are handled one
+		   path at a time */
+		if (m_guiding || context.scene->hasNullInterfaces() || context.scene->hasVolumeEmission()
+				|| (m_equiangular && context.scene->hasMedia())) {
+			Integrator::Li(context, cameraRays, result, count);
+			return;
+		}
+
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+		MemoryArena &arena = *context.arena;
+		const Luminaire *env = scene->getEnvironmentLuminaire();
+		bool hasLuminaires = !scene->getLuminaires().empty();
+
+		/* Path states */
+		Ray3f *rays = arena.alloc<Ray3f>(count);
+		Color3f *throughput = arena.alloc<Color3f>(count);
+		float *dirPdf = arena.alloc<float>(count);
+		MediumStack *media = arena.alloc<MediumStack>(count);
+		Intersection *its = arena.alloc<Intersection>(count);
+		bool *hit = arena.alloc<bool>(count);
+
+		/* Queues: active paths, surface interactions (keyed by BSDF)
+		   and medium interactions */
+		uint32_t *active = arena.alloc<uint32_t>(count);
+		std::pair<const BSDF *, uint32_t> *surfaceQueue =
+			arena.alloc<std::pair<const BSDF *, uint32_t> >(count);
+		uint32_t *hitIndices = arena.alloc<uint32_t>(count);
+		uint32_t *mediumQueue = arena.alloc<uint32_t>(count);
+		Point3f *mediumPoints = arena.alloc<Point3f>(count);
+
+		/* Shadow rays and the contributions of their luminaire samples */
+		Ray3f *shadowRays = arena.alloc<Ray3f>(count);
+		Color3f *shadowValues = arena.alloc<Color3f>(count);
+		const Medium **shadowMedia = arena.alloc<const Medium *>(count);
+		uint32_t *shadowOwners = arena.alloc<uint32_t>(count);
+		bool *occluded = arena.alloc<bool>(count);
+
+		/* Batched BSDF queries: luminaire samples, then BSDF samples of one material */
+		BSDFQueryRecord *bsdfQueries = arena.alloc<BSDFQueryRecord>(count);
+		Color3f *bsdfValues = arena.alloc<Color3f>(count);
+		float *bsdfPdfs = arena.alloc<float>(count);
+		float *luminairePdfs = arena.alloc<float>(count);
+		Point2f *bsdfSamples = arena.alloc<Point2f>(count);
+
+		/* Batched phase function samples of the medium interactions */
+		PhaseFunctionQueryRecord *phaseQueries = arena.alloc<PhaseFunctionQueryRecord>(count);
+		float *phaseValues = arena.alloc<float>(count);
+		std::vector<uint32_t> order;
+
+		for (uint32_t i=0; i<count; ++i) {
+			rays[i] = cameraRays[i];
+			throughput[i] = Color3f(1.0f);
+			dirPdf[i] = 0.0f;
+			media[i] = MediumStack(scene->getMedium());
+			result[i] = Color3f(0.0f);
+			active[i] = i;
+		}
+		uint32_t activeCount = count;
+
+		for (int depth = 1; activeCount > 0; ++depth) {
+			bool canExtend = m_maxDepth < 0 || depth < m_maxDepth;
+
+			/* Stage 1: intersection. Camera rays are coherent and traced as
+			   packets, the others are traced in sorted order */
+			context.rayCount += activeCount;
+			uint32_t k = 0;
+			if (depth == 1) {
+				for (; k + NORI_PACKET_SIZE <= activeCount; k += NORI_PACKET_SIZE) {
+					int hits = scene->rayIntersectPacket(rays + k, its + k);
+					for (int j=0; j<NORI_PACKET_SIZE; ++j)
+						hit[k+j] = (hits & (1 << j)) != 0;
+				}
+				for (; k<activeCount; ++k)
+					hit[k] = scene->rayIntersect(rays[k], its[k]);
+			} else {
+				/* (The shadow ray queue is empty at this point) */
+				sortActive(rays, active, activeCount, shadowRays, shadowOwners,
+					context.sceneBounds, order);
+				scene->rayIntersectBatch(rays, active, activeCount, its, hit);
+			}
+
+			/* Stage 2: medium sampling, which sorts the paths into queues */
+			uint32_t surfaceCount = 0, mediumCount = 0;
+			for (k=0; k<activeCount; ++k) {
+				uint32_t i = active[k];
+				const Ray3f &ray = rays[i];
+				Ray3f segment(ray.o, ray.d, ray.mint, hit[i] ? its[i].t : ray.maxt);
+				float t;
+				Color3f mediumWeight;
+				bool mediumInteraction = scene->sampleDistance(segment, sampler,
+					t, mediumWeight, media[i]);
+				throughput[i] *= mediumWeight;
+				if (throughput[i].isZero())
+					continue;
+
+				if (mediumInteraction) {
+					if (canExtend) {
+						mediumPoints[mediumCount] = ray(t);
+						mediumQueue[mediumCount++] = i;
+					}
+				} else if (!hit[i]) {
+					if (env) {
+						LuminaireQueryRecord lRec(env, ray.o, ray.d);
+						result[i] += throughput[i] * env->eval(lRec)
+							* emitterWeight(scene, lRec, dirPdf[i]);
+					}
+				} else {
+					surfaceQueue[surfaceCount++] =
+						std::make_pair(its[i].mesh->getBSDF(), i);
+				}
+			}
+
+			/* Stage 3: shading of the surface interactions, grouped by material. Each
+			   BSDF evaluates and samples the queries of its interactions as batches */
+			std::sort(surfaceQueue, surfaceQueue + surfaceCount);
+			for (k=0; k<surfaceCount; ++k)
+				hitIndices[k] = surfaceQueue[k].second;
+			Intersection::computeDifferentialGeometry(its, hitIndices, surfaceCount);
+			uint32_t shadowCount = 0, nextCount = 0;
+			for (k=0; k<surfaceCount; ) {
+				const BSDF *bsdf = surfaceQueue[k].first;
+				uint32_t end = k + 1;
+				while (end < surfaceCount && surfaceQueue[end].first == bsdf)
+					++end;
+				bool extend = canExtend && bsdf;
+
+				/* Emission, and luminaire samples (stored in the shadow ray queue) */
+				uint32_t queryEnd = shadowCount;
+				for (uint32_t j=k; j<end; ++j) {
+					uint32_t i = surfaceQueue[j].second;
+					Intersection &hitIts = its[i];
+					hitIts.computeFootprint(rays[i]);
+					if (depth == 1 && context.aov)
+						context.aov[i].set(hitIts);
+
+					const Luminaire *luminaire = hitIts.mesh->getLuminaire();
+					if (luminaire) {
+						LuminaireQueryRecord lRec(luminaire, rays[i].o, hitIts.p, hitIts.shFrame.n);
+						lRec.triangle = hitIts.primIndex;
+						result[i] += throughput[i] * luminaire->eval(lRec)
+							* emitterWeight(scene, lRec, dirPdf[i]);
+					}
+
+					if (!extend || !hasLuminaires)
+						continue;
+					LuminaireQueryRecord lRec(hitIts.p);
+					Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+					if (value.isZero())
+						continue;
+					BSDFQueryRecord &bRec = bsdfQueries[queryEnd];
+					bRec = BSDFQueryRecord(hitIts.toLocal(-rays[i].d),
+						hitIts.toLocal(lRec.d), ESolidAngle);
+					bRec.uv = hitIts.uv;
+					bRec.uvWidth = hitIts.uvWidth;
+					luminairePdfs[queryEnd] = lRec.pdf;
+					shadowRays[queryEnd] = Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+					shadowRays[queryEnd].time = rays[i].time;
+					shadowValues[queryEnd] = throughput[i] * value;
+					shadowMedia[queryEnd] = media[i].top();
+					shadowOwners[queryEnd++] = i;
+				}
+
+				/* Weight the luminaire samples by the BSDF, and drop those without contribution */
+				if (queryEnd > shadowCount) {
+					uint32_t queryCount = queryEnd - shadowCount;
+					bsdf->eval(bsdfQueries + shadowCount, bsdfValues + shadowCount, queryCount);
+					bsdf->pdf(bsdfQueries + shadowCount, bsdfPdfs + shadowCount, queryCount);
+					for (uint32_t q=shadowCount; q<queryEnd; ++q) {
+						if (bsdfValues[q].isZero())
+							continue;
+						shadowRays[shadowCount] = shadowRays[q];
+						shadowValues[shadowCount] = shadowValues[q] * bsdfValues[q]
+							* std::abs(Frame::cosTheta(bsdfQueries[q].wo))
+							* miWeight(luminairePdfs[q], bsdfPdfs[q]);
+						shadowMedia[shadowCount] = shadowMedia[q];
+						shadowOwners[shadowCount++] = shadowOwners[q];
+					}
+				}
+				if (!extend) {
+					k = end;
+					continue;
+				}
+
+				/* Continue the paths by sampling the BSDF */
+				uint32_t groupSize = end - k;
+				for (uint32_t j=0; j<groupSize; ++j) {
+					uint32_t i = surfaceQueue[k + j].second;
+					BSDFQueryRecord &bRec = bsdfQueries[j];
+					bRec = BSDFQueryRecord(its[i].toLocal(-rays[i].d));
+					bRec.uv = its[i].uv;
+					bRec.uvWidth = its[i].uvWidth;
+					bsdfSamples[j] = sampler->next2D();
+				}
+				bsdf->sample(bsdfQueries, bsdfSamples, bsdfValues, groupSize);
+				bsdf->pdf(bsdfQueries, bsdfPdfs, groupSize);
+
+				for (uint32_t j=0; j<groupSize; ++j) {
+					uint32_t i = surfaceQueue[k + j].second;
+					if (bsdfValues[j].isZero())
+						continue;
+					const BSDFQueryRecord &bRec = bsdfQueries[j];
+					throughput[i] *= bsdfValues[j];
+
+					/* Discrete components can't be sampled by the luminaires */
+					dirPdf[i] = bRec.measure == EDiscrete ? 0.0f : bsdfPdfs[j];
+					continuePath(its[i], bRec, rays[i], media[i]);
+					if (russianRoulette(sampler, depth, throughput[i]))
+						active[nextCount++] = i;
+				}
+				k = end;
+			}
+
+			/* Stage 4: shading of the medium interactions */
+			for (k=0; k<mediumCount; ++k) {
+				uint32_t i = mediumQueue[k];
+				const Point3f &p = mediumPoints[k];
+				const PhaseFunction *phase = media[i].top()->getPhaseFunction();
+
+				if (hasLuminaires) {
+					LuminaireQueryRecord lRec(p);
+					Color3f value = sampleLuminaire(scene, sampler, phase, -rays[i].d, lRec);
+					if (!value.isZero()) {
+						shadowRays[shadowCount] = Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+						shadowRays[shadowCount].time = rays[i].time;
+						shadowValues[shadowCount] = throughput[i] * value;
+						shadowMedia[shadowCount] = media[i].top();
+						shadowOwners[shadowCount++] = i;
+					}
+				}
+			}
+
+			/* Continue the paths by sampling the phase functions, in
+			   batches of consecutive interactions with the same one */
+			for (k=0; k<mediumCount; ) {
+				const PhaseFunction *phase = media[mediumQueue[k]].top()->getPhaseFunction();
+				uint32_t end = k + 1;
+				while (end < mediumCount && media[mediumQueue[end]].top()->getPhaseFunction() == phase)
+					++end;
+
+				uint32_t groupSize = end - k;
+				for (uint32_t j=0; j<groupSize; ++j) {
+					phaseQueries[j] = PhaseFunctionQueryRecord(-rays[mediumQueue[k + j]].d);
+					bsdfSamples[j] = sampler->next2D();
+				}
+				phase->sample(phaseQueries, bsdfSamples, phaseValues, groupSize);
+
+				for (uint32_t j=0; j<groupSize; ++j) {
+					uint32_t i = mediumQueue[k + j];
+					if (phaseValues[j] <= 0)
+						continue;
+					throughput[i] *= phaseValues[j];
+					dirPdf[i] = phase->pdf(phaseQueries[j]);
+					float time = rays[i].time;
+					rays[i] = Ray3f(mediumPoints[k + j], phaseQueries[j].wo);
+					rays[i].time = time;
+					if (russianRoulette(sampler, depth, throughput[i]))
+						active[nextCount++] = i;
+				}
+				k = end;
+			}
+
+			/* Stage 5: shadow rays, which are incoherent -- trace them in sorted order */
+			if (shadowCount > 0) {
+				sortRays(shadowRays, shadowCount, context.sceneBounds, order);
+				context.shadowRayCount += shadowCount;
+
+				/* Without null interfaces, the visibility of the whole queue
+				   is one batch query, and only the media remain per ray */
+				if (!scene->hasNullInterfaces())
+					scene->rayIntersectBatch(shadowRays, &order[0], shadowCount, occluded);
+				for (size_t j=0; j<order.size(); ++j) {
+					uint32_t index = order[j];
+					Color3f tr;
+					if (scene->hasNullInterfaces())
+						tr = scene->evalVisibilityTransmittance(shadowRays[index],
+							sampler, MediumStack(shadowMedia[index]));
+					else if (!occluded[index])
+						tr = scene->evalTransmittance(shadowRays[index],
+							sampler, MediumStack(shadowMedia[index]));
+					else
+						continue;
+					if (!tr.isZero())
+						result[shadowOwners[index]] += shadowValues[index] * tr;
+				}
+			}
+
+			activeCount = nextCount;
+		}
+	}
+
+	QString toString() const {
+		return QString("PathTracer[maxDepth=%1, rrDepth=%2, guiding=%3, guidingFraction=%4, "
+			"splitting=%5, maxSplits=%6, windowSize=%7, spectral=%8]")
+			.arg(m_maxDepth).arg(m_rrDepth).arg(m_guiding).arg(m_guidingFraction)
+			.arg(m_splitting).arg(m_maxSplits).arg(m_windowSize).arg(m_spectral);
+	}
+private:
+	/// Spectral version of \ref Li() (see the class description)
+	Color3f LiSpectral(RenderContext &context, const Ray3f &_ray) const {
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+		const Luminaire *env = scene->getEnvironmentLuminaire();
+		bool hasLuminaires = !scene->getLuminaires().empty();
+		Wavelengths wl(sampler->next1D());
+
+		Ray3f ray(_ray);
+		Spectrum4f result(0.0f), throughput(1.0f);
+		MediumStack media(scene->getMedium());
+		Intersection its;
+		float dirPdf = 0.0f;
+
+		int depth = 1;
+		for (; ; ++depth) {
+			context.rayCount++;
+			bool hit;
+			{
+				PathStageTimer stageTimer(context.pathStats, PathStatistics::ETraversal);
+				hit = context.rayIntersect(ray, its);
+			}
+			bool canExtend = m_maxDepth < 0 || depth < m_maxDepth;
+
+			/* Sample a medium interaction along the segment */
+			Ray3f segment(ray.o, ray.d, ray.mint, hit ? its.t : ray.maxt);
+			segment.time = ray.time;
+			float t;
+			Spectrum4f mediumWeight;
+			bool mediumInteraction;
+			{
+				PathStageTimer stageTimer(context.pathStats, PathStatistics::EMedium);
+				mediumInteraction = scene->sampleSpectralDistance(segment, sampler,
+					wl, t, mediumWeight, media);
+			}
+			if (mediumInteraction && context.pathStats)
+				context.pathStats->mediumInteractions++;
+
+			if (mediumInteraction && dirPdf == 0 && media.top()->getLuminaire())
+				result += throughput * wl.fromRGB(media.top()->evalCollisionEmission(ray(t)));
+
+			throughput *= mediumWeight;
+			if (throughput.isZero())
+				break;
+
+			if (mediumInteraction) {
+				if (!canExtend)
+					break;
+				Point3f p = ray(t);
+				const PhaseFunction *phase = media.top()->getPhaseFunction();
+
+				/* Next-event estimation */
+				if (hasLuminaires) {
+					LuminaireQueryRecord lRec(p);
+					Spectrum4f value = sampleLuminaire(scene, sampler, wl, phase, -ray.d, lRec);
+					if (!value.isZero())
+						result += throughput * value * transmittance(context, wl, lRec,
+							media, ray.time);
+				}
+
+				if (!samplePhase(sampler, phase, p, ray, throughput, dirPdf)) {
+					countFailure(context);
+					break;
+				}
+			} else if (!hit) {
+				/* The path leaves the scene */
+				if (env) {
+					LuminaireQueryRecord lRec(env, ray.o, ray.d);
+					result += throughput * wl.fromRGB(env->eval(lRec))
+						* emitterWeight(scene, lRec, dirPdf);
+				}
+				break;
+			} else {
+				its.computeDifferentialGeometry();
+
+				/* Pass through null interfaces without counting a bounce */
+				const BSDF *bsdf = its.mesh->getBSDF();
+				if (bsdf && bsdf->isNull()) {
+					media.update(its, ray.d);
+					ray.mint = its.t + Epsilon;
+					--depth;
+					continue;
+				}
+
+				its.computeFootprint(ray);
+				if (depth == 1 && context.aov)
+					context.aov->set(its);
+
+				/* Radiance emitted by the surface */
+				const Luminaire *luminaire = its.mesh->getLuminaire();
+				if (luminaire) {
+					LuminaireQueryRecord lRec(luminaire, ray.o, its.p, its.shFrame.n);
+					lRec.triangle = its.primIndex;
+					result += throughput * wl.fromRGB(luminaire->eval(lRec))
+						* emitterWeight(scene, lRec, dirPdf);
+				}
+
+				if (!canExtend || !bsdf)
+					break;
+				Vector3f wi = its.toLocal(-ray.d);
+
+				/* Next-event estimation */
+				if (hasLuminaires) {
+					LuminaireQueryRecord lRec(its.p);
+					Spectrum4f value = sampleLuminaire(scene, sampler, wl, its, bsdf, wi, lRec);
+					if (!value.isZero())
+						result += throughput * value * transmittance(context, wl, lRec,
+							media, ray.time);
+				}
+
+				/* Continue the path by sampling the BSDF */
+				BSDFQueryRecord bRec(wi);
+				bRec.uv = its.uv;
+				bRec.uvWidth = its.uvWidth;
+				Color3f bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+				if (bsdfWeight.isZero()) {
+					countFailure(context);
+					break;
+				}
+				dirPdf = bRec.measure == EDiscrete ? 0.0f : bsdf->pdf(bRec);
+				throughput *= wl.fromRGB(bsdfWeight);
+				continuePath(its, bRec, ray, media);
+			}
+
+			if (!russianRoulette(sampler, depth, throughput))
+				break;
+		}
+		if (context.pathStats)
+			context.pathStats->addPath(depth);
+
+		return wl.toRGB(result);
+	}
+
+	/// Power heuristic
+	inline float miWeight(float pdfA, float pdfB) const {
+		pdfA *= pdfA; pdfB *= pdfB;
+		return pdfA > 0 ? pdfA / (pdfA + pdfB) : 0.0f;
+	}
+
+	/**
+	 * \brief MIS weight of radiance that was found by sampling the
+	 * direction of a segment with density \c dirPdf (zero for the camera
+	 * ray and discrete BSDF components, which get the full weight)
+	 */
+	inline float emitterWeight(const Scene *scene, const LuminaireQueryRecord &lRec,
+			float dirPdf) const {
+		if (dirPdf == 0)
+			return 1.0f;
+		return miWeight(dirPdf, scene->pdfLuminaire(lRec));
+	}
+
+	/**
+	 * \brief Add a contribution of the path to its result, and to the
+	 * radiance found by its guiding vertices (the last one is \c vertex)
+	 */
+	inline void addRadiance(Color3f &result, const Color3f &value,
+			GuidingVertex *vertices, int vertex) const {
+		result += value;
+		for (int i=vertex; i >= 0; i = vertices[i].parent)
+			vertices[i].radiance += value;
+	}
+
+	/**
+	 * \brief Add a guiding vertex for the direction \c d that was sampled
+	 * at an interaction in \c leaf (if not \c NULL)
+	 *
+	 * \return The index of the last vertex along the path: the new one,
+	 *    or \c parent if there is none or no room is left
+	 */
+	inline int addVertex(GuidingVertex *vertices, int &vertexCount, int parent,
+			SDTreeLeaf *leaf, const Vector3f &d, const Color3f &prefix,
+			const Color3f &throughput, const Color3f &direct) const {
+		if (!leaf || vertexCount >= NORI_GUIDING_MAX_VERTICES)
+			return parent;
+		GuidingVertex &vertex = vertices[vertexCount];
+		vertex.leaf = leaf;
+		vertex.d = d;
+		vertex.prefix = prefix;
+		vertex.throughput = throughput;
+		vertex.direct = direct;
+		vertex.radiance = Color3f(0.0f);
+		vertex.parent = parent;
+		return vertexCount++;
+	}
+
+	/**
+	 * \brief Russian roulette and splitting based on the expected
+	 * contribution of the path (see the class description)
+	 *
+	 * The expected contribution is kept within a window around the
+	 * estimate of the pixel, whose mean is the estimate itself. Paths 
+	 * below it survive with a probability that lifts their contribution 
+	 * to the estimate, and paths above it are split.
+	 *
+	 * \return The number of paths to continue with, whose throughput
+	 *    was scaled accordingly (0 = the path ends), or -1 when nothing
+	 *    is known about the path's contribution
+	 */
+	inline int splitPath(Sampler *sampler, const SDTreeLeaf *leaf, float pixelEstimate,
+			int branchCount, Color3f &throughput) const {
+		if (!leaf || leaf->reflected <= 0 || pixelEstimate <= 0)
+			return -1;
+		float ratio = throughput.getLuminance() * leaf->reflected / pixelEstimate;
+		float lower = 2 / (1 + m_windowSize), upper = lower * m_windowSize;
+		if (ratio < lower) {
+			if (sampler->next1D() >= ratio)
+				return 0;
+			throughput /= ratio;
+			return 1;
+		} else if (ratio > upper) {
+			int splits = std::min((int) std::min(std::ceil(ratio), (float) m_maxSplits),
+				NORI_SPLITTING_MAX_BRANCHES - branchCount + 1);
+			throughput /= (float) splits;
+			return splits;
+		}
+		return 1;
+	}
+
+	/**
+	 * \brief Density of sampling the direction \c bRec.wo at a surface
+	 * interaction: that of the BSDF, or of its mixture with the learned
+	 * distribution \c guide (if not \c NULL)
+	 */
+	inline float surfacePdf(const Intersection &its, const BSDF *bsdf,
+			const BSDFQueryRecord &bRec, const SDTreeLeaf *guide) const {
+		float pdf = bsdf->pdf(bRec);
+		if (guide)
+			pdf = m_guidingFraction * guide->pdf(its.toWorld(bRec.wo))
+				+ (1 - m_guidingFraction) * pdf;
+		return pdf;
+	}
+
+	/// Count a BSDF or phase function sample that failed (see \ref PathStatistics)
+	inline void countFailure(RenderContext &context) const {
+		if (context.pathStats)
+			context.pathStats->bsdfFailures++;
+	}
+
+	/**
+	 * \brief Trace the shadow ray of a luminaire sample and return the
+	 * transmittance along it through \c media (zero if it is occluded)
+	 */
+	inline Color3f transmittance(RenderContext &context, const LuminaireQueryRecord &lRec,
+			const MediumStack &media, float time) const {
+		Ray3f shadowRay(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+		shadowRay.time = time;
+		context.shadowRayCount++;
+		PathStageTimer stageTimer(context.pathStats, PathStatistics::ETraversal);
+		return context.scene->evalVisibilityTransmittance(shadowRay, context.sampler, media);
+	}
+
+	/// Spectral version of \ref transmittance()
+	inline Spectrum4f transmittance(RenderContext &context, const Wavelengths &wl,
+			const LuminaireQueryRecord &lRec, const MediumStack &media, float time) const {
+		Ray3f shadowRay(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+		shadowRay.time = time;
+		context.shadowRayCount++;
+		PathStageTimer stageTimer(context.pathStats, PathStatistics::ETraversal);
+		return context.scene->evalSpectralVisibilityTransmittance(shadowRay,
+			context.sampler, wl, media);
+	}
+
+	/**
+	 * \brief Sample a luminaire from a surface interaction
+	 *
+	 * \return The MIS-weighted contribution of the sample, which still
+	 *    needs to be multiplied by the throughput of the path and the 
+	 *    transmittance along the shadow ray
+	 */
+	inline Color3f sampleLuminaire(const Scene *scene, Sampler *sampler,
+			const Intersection &its, const BSDF *bsdf, const Vector3f &wi,
+			LuminaireQueryRecord &lRec, const SDTreeLeaf *guide = NULL) const {
+		Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+		if (value.isZero())
+			return value;
+		BSDFQueryRecord bRec(wi, its.toLocal(lRec.d), ESolidAngle);
+		bRec.uv = its.uv;
+		bRec.uvWidth = its.uvWidth;
+		Color3f bsdfVal = bsdf->eval(bRec);
+		if (bsdfVal.isZero())
+			return bsdfVal;
+		if (lRec.luminaire->isVolume())
+			return value * bsdfVal * std::abs(Frame::cosTheta(bRec.wo));
+		return value * bsdfVal * std::abs(Frame::cosTheta(bRec.wo))
+			* miWeight(lRec.pdf, surfacePdf(its, bsdf, bRec, guide));
+	}
+
+	/// Sample a luminaire from a medium interaction (see above)
+	inline Color3f sampleLuminaire(const Scene *scene, Sampler *sampler,
+			const PhaseFunction *phase, const Vector3f &wi,
+			LuminaireQueryRecord &lRec) const {
+		Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+		if (value.isZero())
+			return value;
+		PhaseFunctionQueryRecord pRec(wi, lRec.d);
+		float phaseVal = phase->eval(pRec);
+		if (phaseVal <= 0)
+			return Color3f(0.0f);
+		if (lRec.luminaire->isVolume())
+			return value * phaseVal;
+		return value * phaseVal * miWeight(lRec.pdf, phase->pdf(pRec));
+	}
+
+	/**
+	 * \brief Spectral version of \ref sampleLuminaire() at a surface
+	 * interaction: the emitted radiance and the BSDF are turned into
+	 * spectra separately, so that their product is taken per wavelength
+	 */
+	inline Spectrum4f sampleLuminaire(const Scene *scene, Sampler *sampler,
+			const Wavelengths &wl, const Intersection &its, const BSDF *bsdf,
+			const Vector3f &wi, LuminaireQueryRecord &lRec) const {
+		Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+		if (value.isZero())
+			return Spectrum4f(0.0f);
+		BSDFQueryRecord bRec(wi, its.toLocal(lRec.d), ESolidAngle);
+		bRec.uv = its.uv;
+		bRec.uvWidth = its.uvWidth;
+		Color3f bsdfVal = bsdf->eval(bRec);
+		if (bsdfVal.isZero())
+			return Spectrum4f(0.0f);
+		float weight = std::abs(Frame::cosTheta(bRec.wo));
+		if (!lRec.luminaire->isVolume())
+			weight *= miWeight(lRec.pdf, bsdf->pdf(bRec));
+		return wl.fromRGB(value) * wl.fromRGB(bsdfVal) * weight;
+	}
+
+	/// Spectral version of \ref sampleLuminaire() at a medium interaction
+	inline Spectrum4f sampleLuminaire(const Scene *scene, Sampler *sampler,
+			const Wavelengths &wl, const PhaseFunction *phase, const Vector3f &wi,
+			LuminaireQueryRecord &lRec) const {
+		return wl.fromRGB(sampleLuminaire(scene, sampler, phase, wi, lRec));
+	}
+
+	/**
+	 * \brief Parameters of equiangular sampling along a ray segment
+	 * toward \c p: the distance of the point on the ray that is closest
+	 * to \c p, the distance between both, and the angles under which the
+	 * ends of the segment are seen from \c p
+	 *
+	 * \return \c false if \c p lies on the line of the ray
+	 */
+	static inline bool equiangularBounds(const Ray3f &segment, const Point3f &p,
+			float &delta, float &dist, float &thetaA, float &thetaB) {
+		delta = (p - segment.o).dot(segment.d);
+		dist = (p - segment(delta)).norm();
+		if (dist <= 0)
+			return false;
+		thetaA = std::atan((segment.mint - delta) / dist);
+		thetaB = std::atan((segment.maxt - delta) / dist);
+		return thetaA < thetaB;
+	}
+
+	/// Density of equiangular sampling of distance \c t toward \c p (see above)
+	static inline float pdfEquiangular(const Ray3f &segment, const Point3f &p, float t) {
+		float delta, dist, thetaA, thetaB;
+		if (!equiangularBounds(segment, p, delta, dist, thetaA, thetaB))
+			return 0.0f;
+		return dist / ((thetaB - thetaA) * (dist * dist + (t - delta) * (t - delta)));
+	}
+
+	/**
+	 * \brief Sample a luminaire from the origin of a segment through the
+	 * medium on top of \c media, and a distance along the segment using
+	 * equiangular sampling toward it
+	 *
+	 * \return The MIS-weighted single scattered radiance, which still
+	 *    needs to be multiplied by the throughput of the path
+	 */
+	Color3f sampleEquiangular(RenderContext &context, const Ray3f &segment,
+			const MediumStack &media) const {
+		const Scene *scene = context.scene;
+		const Medium *medium = media.top();
+		LuminaireQueryRecord lRec(segment.o);
+		Color3f value = scene->sampleLuminaire(lRec, context.sampler->next2D());
+		float sample = context.sampler->next1D();
+
+		/* Environment luminaires have no position to sample toward */
+		float cosTheta = -lRec.n.dot(lRec.d);
+		if (value.isZero() || lRec.dist == std::numeric_limits<float>::infinity()
+				|| cosTheta <= 0)
+			return Color3f(0.0f);
+		float areaPdf = lRec.pdf * cosTheta / (lRec.dist * lRec.dist);
+
+		float delta, dist, thetaA, thetaB;
+		if (!equiangularBounds(segment, lRec.p, delta, dist, thetaA, thetaB))
+			return Color3f(0.0f);
+		float t = delta + dist * std::tan(thetaA + sample * (thetaB - thetaA));
+		t = std::min(std::max(t, segment.mint), segment.maxt);
+		float pdf = dist / ((thetaB - thetaA) * (dist * dist + (t - delta) * (t - delta)));
+
+		Color3f mediumValue;
+		float distancePdf;
+		if (!medium->evalDistance(segment, t, mediumValue, distancePdf) || mediumValue.isZero())
+			return Color3f(0.0f);
+
+		/* Connect the interaction to the luminaire sample */
+		LuminaireQueryRecord connection(lRec.luminaire, segment(t), lRec.p, lRec.n);
+		connection.triangle = lRec.triangle;
+		cosTheta = -connection.n.dot(connection.d);
+		if (cosTheta <= 0 || connection.dist == 0)
+			return Color3f(0.0f);
+		const PhaseFunction *phase = medium->getPhaseFunction();
+		PhaseFunctionQueryRecord pRec(-segment.d, connection.d);
+		float phaseVal = phase->eval(pRec);
+		Color3f radiance = lRec.luminaire->eval(connection);
+		if (phaseVal <= 0 || radiance.isZero())
+			return Color3f(0.0f);
+
+		/* Densities wrt. distance and solid angles at the interaction */
+		float geometry = cosTheta / (connection.dist * connection.dist);
+		float luminairePdf = scene->pdfLuminaire(connection);
+		float weight = miWeight(luminairePdf, phase->pdf(pRec))
+			* miWeight(pdf * areaPdf / geometry, distancePdf * luminairePdf);
+		if (weight <= 0)
+			return Color3f(0.0f);
+
+		return mediumValue * radiance * (phaseVal * geometry * weight / (pdf * areaPdf))
+			* transmittance(context, connection, media, segment.time);
+	}
+
+	/**
+	 * \brief MIS weight of a luminaire sample \c lRec at an interaction
+	 * that \c medium sampled at distance \c t along \c segment, against
+	 * equiangular sampling (see \ref sampleEquiangular())
+	 */
+	float distanceWeight(const Scene *scene, const Ray3f &segment, float t,
+			const LuminaireQueryRecord &lRec, const Medium *medium) const {
+		Color3f mediumValue;
+		float distancePdf;
+		if (lRec.dist == std::numeric_limits<float>::infinity()
+				|| !medium->evalDistance(segment, t, mediumValue, distancePdf))
+			return 1.0f;
+
+		/* Density of choosing the same luminaire sample from the origin
+		   of the segment, wrt. surface area */
+		LuminaireQueryRecord origin(lRec.luminaire, segment.o, lRec.p, lRec.n);
+		origin.triangle = lRec.triangle;
+		float cosOrigin = -origin.n.dot(origin.d), cosTheta = -lRec.n.dot(lRec.d);
+		if (cosOrigin <= 0 || cosTheta <= 0)
+			return 1.0f;
+		float areaPdf = scene->pdfLuminaire(origin) * cosOrigin / (origin.dist * origin.dist);
+
+		float equiangularPdf = pdfEquiangular(segment, lRec.p, t)
+			* areaPdf * lRec.dist * lRec.dist / cosTheta;
+		return miWeight(distancePdf * lRec.pdf, equiangularPdf);
+	}
+
+	/**
+	 * \brief Extend a path at a surface interaction by sampling the BSDF
+	 * (or its mixture with the learned distribution \c guide, if not \c NULL)
+	 *
+	 * Updates the ray, throughput, direction density and media of the
+	 * path, and returns \c false when the path ends.
+	 */
+	inline bool sampleBSDF(Sampler *sampler, Intersection &its, const BSDF *bsdf,
+			const Vector3f &wi, Ray3f &ray, Color3f &throughput, float &dirPdf,
+			MediumStack &media, const SDTreeLeaf *guide = NULL) const {
+		BSDFQueryRecord bRec(wi);
+		bRec.uv = its.uv;
+		bRec.uvWidth = its.uvWidth;
+		Color3f bsdfWeight;
+		if (guide && sampler->next1D() < m_guidingFraction) {
+			/* Sample the learned distribution of the incident radiance */
+			bRec.wo = its.toLocal(guide->sample(sampler->next2D()));
+			bRec.measure = ESolidAngle;
+			dirPdf = surfacePdf(its, bsdf, bRec, guide);
+			if (dirPdf <= 0)
+				return false;
+			bsdfWeight = bsdf->eval(bRec) * std::abs(Frame::cosTheta(bRec.wo)) / dirPdf;
+		} else {
+			bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+			if (bsdfWeight.isZero())
+				return false;
+
+			/* Discrete components can't be sampled by the luminaires */
+			if (bRec.measure == EDiscrete) {
+				dirPdf = 0.0f;
+			} else if (guide) {
+				float bsdfPdf = bsdf->pdf(bRec);
+				dirPdf = surfacePdf(its, bsdf, bRec, guide);
+				bsdfWeight *= dirPdf > 0 ? bsdfPdf / dirPdf : 0.0f;
+			} else {
+				dirPdf = bsdf->pdf(bRec);
+			}
+		}
+		if (bsdfWeight.isZero())
+			return false;
+		throughput *= bsdfWeight;
+		continuePath(its, bRec, ray, media);
+		return true;
+	}
+
+	/**
+	 * \brief Replace the ray of a path by the one leaving a surface
+	 * interaction in the sampled direction \c bRec.wo
+	 */
+	inline void continuePath(Intersection &its, const BSDFQueryRecord &bRec,
+			Ray3f &ray, MediumStack &media) const {
+		/* Enter or leave the interior medium of the mesh when the
+		   path passes through its surface */
+		Vector3f wo = its.toWorld(bRec.wo);
+		if (its.geoFrame.n.dot(ray.d) * its.geoFrame.n.dot(wo) > 0)
+			media.update(its, wo);
+
+		/* Only specular reflections keep the ray differentials */
+		Ray3f next(its.p, wo);
+		next.time = ray.time;
+		if (bRec.measure == EDiscrete && Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) > 0)
+			its.reflectDifferentials(ray, next);
+		ray = next;
+	}
+
+	/// Extend a path at a medium interaction by sampling the phase function
+	template <typename Value> inline bool samplePhase(Sampler *sampler,
+			const PhaseFunction *phase, const Point3f &p, Ray3f &ray,
+			Value &throughput, float &dirPdf) const {
+		PhaseFunctionQueryRecord pRec(-ray.d);
+		float phaseWeight = phase->sample(pRec, sampler->next2D());
+		if (phaseWeight <= 0)
+			return false;
+		throughput *= phaseWeight;
+		dirPdf = phase->pdf(pRec);
+		float time = ray.time;
+		ray = Ray3f(p, pRec.wo);
+		ray.time = time;
+		return true;
+	}
+
+	/// Russian roulette based on the throughput (returns \c false when the path ends)
+	template <typename Value> inline bool russianRoulette(Sampler *sampler, int depth,
+			Value &throughput) const {
+		if (depth < m_rrDepth)
+			return true;
+		float q = std::min(throughput.maxCoeff(), 0.95f);
+		if (sampler->next1D() >= q)
+			return false;
+		throughput /= q;
+		return true;
+	}
+
+	/**
+	 * \brief Reorder the active paths by the origins and directions of 
+	 * their rays (see \ref sortRays())
+	 *
+	 * The rays are gathered into \c scratchRays first, and \c scratchIndices
+	 * must also have room for \c activeCount entries.
+	 */
+	inline void sortActive(const Ray3f *rays, uint32_t *active, uint32_t activeCount,
+			Ray3f *scratchRays, uint32_t *scratchIndices, const BoundingBox3f &bbox,
+			std::vector<uint32_t> &order) const {
+		for (uint32_t k=0; k<activeCount; ++k) {
+			scratchRays[k] = rays[active[k]];
+			scratchIndices[k] = active[k];
+		}
+		sortRays(scratchRays, activeCount, bbox, order);
+		for (uint32_t k=0; k<activeCount; ++k)
+			active[k] = scratchIndices[order[k]];
+	}
+
+protected:
+	int m_maxDepth;
+	int m_rrDepth;
+	bool m_guiding;
+	float m_guidingFraction;
+	float m_spatialThreshold;
+	float m_directionalThreshold;
+	bool m_splitting;
+	int m_maxSplits;
+	float m_windowSize;
+	bool m_equiangular;
+	bool m_spectral;
+	SDTree *m_sdtree;
+	ImageEstimate *m_image;
+};
+
+/**
+ * \brief The path tracer under the name used by the scenes of the
+ * exercises, where "mipath" stands for the variant with multiple
+ * importance sampling
+ */
+class MIPathTracer : public PathTracer {
+public:
+	MIPathTracer(const PropertyList &propList) : PathTracer(propList) { }
+};
+
+NORI_REGISTER_CLASS(PathTracer, "path");
+NORI_REGISTER_CLASS(MIPathTracer, "mipath");
+NORI_NAMESPACE_END
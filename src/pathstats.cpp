@@ -0,0 +1,109 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/pathstats.h>
+
+NORI_NAMESPACE_BEGIN
+
+static const char *stageNames[PathStatistics::EStageCount] = {
+	"traversal", "medium", "shading"
+};
+
+void PathStatistics::reset() {
+	memset(depths, 0, sizeof(depths));
+	samples = paths = mediumInteractions = bsdfFailures = 0;
+	memset(stageTime, 0, sizeof(stageTime));
+	timedSamples = 0;
+	sampleStart = sampleStaged = 0;
+	timed = false;
+}
+
+PathStatistics &PathStatistics::operator+=(const PathStatistics &stats) {
+	for (int i=0; i<NORI_PATH_DEPTH_BINS; ++i)
+		depths[i] += stats.depths[i];
+	samples += stats.samples;
+	paths += stats.paths;
+	mediumInteractions += stats.mediumInteractions;
+	bsdfFailures += stats.bsdfFailures;
+	for (int i=0; i<EStageCount; ++i)
+		stageTime[i] += stats.stageTime[i];
+	timedSamples += stats.timedSamples;
+	return *this;
+}
+
+float PathStatistics::getAverageDepth() const {
+	double sum = 0;
+	for (int i=0; i<NORI_PATH_DEPTH_BINS; ++i)
+		sum += (double) i * depths[i];
+	return paths > 0 ? (float) (sum / paths) : 0.0f;
+}
+
+QString PathStatistics::toString(uint64_t rayCount) const {
+	double n = (double) std::max(samples, (uint64_t) 1);
+	QString result = QString("Paths: %1 per sample, %2 rays per sample, average depth %3, "
+		"%4 medium interactions and %5 failed BSDF samples per sample")
+		.arg(paths / n, 0, 'f', 2).arg(rayCount / n, 0, 'f', 2)
+		.arg(getAverageDepth(), 0, 'f', 2).arg(mediumInteractions / n, 0, 'f', 2)
+		.arg(bsdfFailures / n, 0, 'f', 3);
+
+	/* Time per stage, averaged over the timed samples */
+	if (timedSamples > 0) {
+		qint64 total = 0;
+		for (int i=0; i<EStageCount; ++i)
+			total += stageTime[i];
+		result += "\nTime per sample:";
+		for (int i=0; i<EStageCount; ++i)
+			result += QString(" %1 %2 us (%3%)%4").arg(stageNames[i])
+				.arg(stageTime[i] / 1e3 / timedSamples, 0, 'f', 2)
+				.arg(100.0 * stageTime[i] / std::max(total, (qint64) 1), 0, 'f', 1)
+				.arg(i + 1 < EStageCount ? "," : "");
+	}
+
+	/* Fraction of the paths per depth (empty bins are left out) */
+	if (paths > 0) {
+		result += "\nPath depths:";
+		for (int i=0; i<NORI_PATH_DEPTH_BINS; ++i) {
+			if (depths[i] == 0)
+				continue;
+			result += QString(" %1%2: %3%").arg(i).arg(i + 1 < NORI_PATH_DEPTH_BINS ? "" : "+")
+				.arg(100.0 * depths[i] / paths, 0, 'f', 1);
+		}
+	}
+	return result;
+}
+
+QString PathStatistics::toJSON(uint64_t rayCount) const {
+	double n = (double) std::max(samples, (uint64_t) 1);
+	QString depthList;
+	for (int i=0; i<NORI_PATH_DEPTH_BINS; ++i)
+		depthList += QString(i > 0 ? ", %1" : "%1").arg((qulonglong) depths[i]);
+	QString stages;
+	for (int i=0; i<EStageCount; ++i)
+		stages += QString("%1\"%2\": %3").arg(i > 0 ? ", " : "").arg(stageNames[i])
+			.arg(timedSamples > 0 ? stageTime[i] / (double) timedSamples : 0.0);
+
+	return QString("{ \"samples\": %1, \"paths\": %2, \"raysPerSample\": %3, "
+		"\"averageDepth\": %4, \"mediumInteractions\": %5, \"bsdfFailures\": %6, "
+		"\"timedSamples\": %7, \"nsPerSample\": { %8 }, \"depths\": [%9] }")
+		.arg((qulonglong) samples).arg((qulonglong) paths).arg(rayCount / n)
+		.arg(getAverageDepth()).arg((qulonglong) mediumInteractions)
+		.arg((qulonglong) bsdfFailures).arg((qulonglong) timedSamples)
+		.arg(stages).arg(depthList);
+}
+
+NORI_NAMESPACE_END
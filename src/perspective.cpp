@@ -29,6 +29,11 @@ NORI_NAMESPACE_BEGIN
  * it uses an infinitesimally small aperture, creating an infinite depth 
  * of field. Use the <tt>apertureRadius</tt> and <tt>focusDistance</tt>
  * parameters to change this behavior.
+ *
+ * The shutter is open from <tt>shutterOpen</tt> to <tt>shutterClose</tt>
+ * (both 0 by default). When this interval is nonempty, every camera ray
+ * is traced at a uniformly sampled time within it, which blurs moving
+ * instances (see \ref Instance).
  */
 class PerspectiveCamera : public Camera {
 public:
@@ -38,6 +43,9 @@ public:
 		m_outputSize.y() = propList.getInteger("height", 720);
 		m_invOutputSize = m_outputSize.cast<float>().cwiseInverse();
 
+		/* Name of the view in a multi-view rendering. Default: none */
+		m_name = propList.getString("name", "");
+
 		/* Specifies an optional camera-to-world transformation. Default: none */
 		m_cameraToWorld = propList.getTransform("toWorld", Transform());
 
@@ -56,6 +64,13 @@ public:
 		   to the focal plane */
 		m_focusDistance = propList.getFloat("focusDistance", m_farClip);
 
+		/* Shutter interval (in the time units of the instance motion keys) */
+		m_shutterOpen = propList.getFloat("shutterOpen", 0.0f);
+		m_shutterClose = propList.getFloat("shutterClose", m_shutterOpen);
+		if (m_shutterClose < m_shutterOpen)
+			throw NoriException(QString("PerspectiveCamera: the shutter closes (%1) "
+				"before it opens (%2)!").arg(m_shutterClose).arg(m_shutterOpen));
+
 		m_rfilter = NULL;
 	}
 
@@ -87,6 +102,34 @@ public:
 		m_sampleToCamera = Transform( 
 			Eigen::DiagonalMatrix<float, 3>(Vector3f(0.5f, -0.5f * aspect, 1.0f)) *
 			Eigen::Translation<float, 3>(1.0f, -1.0f/aspect, 0.0f) * perspective).inverse();
+		m_cameraToSample = m_sampleToCamera.inverse();
+		m_worldToCamera = m_cameraToWorld.inverse();
+
+		/* The film maps onto the near plane affinely. Precompute the focal
+		   plane position of the film origin and its change per pixel, so
+		   that sampleRay() needs no projective transformation */
+		Point3f nearOrigin = m_sampleToCamera * Point3f(0.0f, 0.0f, 0.0f);
+		float focusScale = m_focusDistance / nearOrigin.z();
+		m_focusOrigin = nearOrigin * focusScale;
+		m_focusDx = (m_sampleToCamera * Point3f(m_invOutputSize.x(), 0.0f, 0.0f)
+			- nearOrigin) * focusScale;
+		m_focusDy = (m_sampleToCamera * Point3f(0.0f, m_invOutputSize.y(), 0.0f)
+			- nearOrigin) * focusScale;
+
+		/* The same in world space, along with the world space aperture
+		   center and axes (used by sampleRays()) */
+		m_worldFocusOrigin = m_cameraToWorld * Vector3f(m_focusOrigin);
+		m_worldFocusDx = m_cameraToWorld * m_focusDx;
+		m_worldFocusDy = m_cameraToWorld * m_focusDy;
+		m_worldApertureCenter = m_cameraToWorld * Point3f(0.0f, 0.0f, 0.0f);
+		m_worldApertureX = m_cameraToWorld * Vector3f(1.0f, 0.0f, 0.0f);
+		m_worldApertureY = m_cameraToWorld * Vector3f(0.0f, 1.0f, 0.0f);
+
+		/* Area of the film when projected onto the plane z=1 */
+		Point3f min = m_sampleToCamera * Point3f(0.0f, 0.0f, 0.0f),
+		        max = m_sampleToCamera * Point3f(1.0f, 1.0f, 0.0f);
+		m_imagePlaneArea = std::abs((max.x() / max.z() - min.x() / min.z())
+			* (max.y() / max.z() - min.y() / min.z()));
 
 		/* If no reconstruction filter was assigned, instantiate a Gaussian filter */
 		if (!m_rfilter)
@@ -100,16 +143,11 @@ public:
 		Point2f tmp = squareToUniformDiskConcentric(apertureSample)
 			* m_apertureRadius;
 	
-		/* Compute the corresponding position on the 
-		   near plane (in local camera space) */
-		Point3f nearP = m_sampleToCamera * Point3f(
-			samplePosition.x() * m_invOutputSize.x(),
-			samplePosition.y() * m_invOutputSize.y(), 0.0f);
-
 		Point3f apertureP(tmp.x(), tmp.y(), 0.0f);
 
-		/* Sampled position on the focal plane */
-		Point3f focusP = nearP * (m_focusDistance / nearP.z());
+		/* Sampled position on the focal plane (in local camera space) */
+		Point3f focusP = m_focusOrigin + m_focusDx * samplePosition.x()
+			+ m_focusDy * samplePosition.y();
 
 		/* Aperture position */
 		/* Turn these into a normalized ray direction, and
@@ -123,9 +161,114 @@ public:
 		ray.maxt = m_farClip * invZ;
 		ray.update();
 
+		/* Ray differentials: rays through the same aperture position and
+		   the focal plane positions of the neighboring pixels */
+		Vector3f dx = (focusP + m_focusDx - apertureP).normalized(),
+		         dy = (focusP + m_focusDy - apertureP).normalized();
+		ray.rxOrigin = ray.ryOrigin = ray.o;
+		ray.rxDirection = m_cameraToWorld * dx;
+		ray.ryDirection = m_cameraToWorld * dy;
+		ray.hasDifferentials = true;
+
 		return Color3f(1.0f);
 	}
 
+	/// A pinhole camera's rays start at its position (see \ref Camera::getFrustum())
+	bool getFrustum(const Point2f &min, const Point2f &max,
+			Point3f &origin, Vector3f *corners) const {
+		if (m_apertureRadius > 0)
+			return false;
+		origin = m_cameraToWorld * Point3f(0.0f, 0.0f, 0.0f);
+		for (int i=0; i<4; ++i) {
+			Point3f focusP = m_focusOrigin + m_focusDx * ((i & 1) ? max.x() : min.x())
+				+ m_focusDy * ((i & 2) ? max.y() : min.y());
+			corners[i] = m_cameraToWorld * Vector3f(focusP);
+		}
+		return true;
+	}
+
+	/**
+	 * Same as sampleRay(), but applies the camera-to-world transformation
+	 * to the precomputed focal plane and aperture axes instead of every ray.
+	 * The directions are normalized by their camera space length, which 
+	 * also gives the clipping distances. Pinhole cameras skip the aperture.
+	 */
+	void sampleRays(uint32_t count, const Point2f *samplePositions,
+			const Point2f *apertureSamples, Ray3f *rays, Color3f *weights) const {
+		bool pinhole = m_apertureRadius == 0;
+		for (uint32_t i=0; i<count; ++i) {
+			const Point2f &sample = samplePositions[i];
+			Ray3f &ray = rays[i];
+
+			/* Camera and world space offset from the aperture to the focal plane */
+			Vector3f local = m_focusOrigin + m_focusDx * sample.x() + m_focusDy * sample.y();
+			Vector3f world = m_worldFocusOrigin + m_worldFocusDx * sample.x()
+				+ m_worldFocusDy * sample.y();
+			ray.o = m_worldApertureCenter;
+			if (!pinhole) {
+				Point2f tmp = squareToUniformDiskConcentric(apertureSamples[i])
+					* m_apertureRadius;
+				local.x() -= tmp.x();
+				local.y() -= tmp.y();
+				Vector3f offset = m_worldApertureX * tmp.x() + m_worldApertureY * tmp.y();
+				world -= offset;
+				ray.o += offset;
+			}
+
+			float invLength = 1.0f / local.norm(),
+			      invZ = 1.0f / (local.z() * invLength);
+			ray.d = world * invLength;
+			ray.mint = m_nearClip * invZ;
+			ray.maxt = m_farClip * invZ;
+			ray.update();
+
+			/* Ray differentials through the neighboring pixels */
+			ray.rxOrigin = ray.ryOrigin = ray.o;
+			ray.rxDirection = (world + m_worldFocusDx) / (local + m_focusDx).norm();
+			ray.ryDirection = (world + m_worldFocusDy) / (local + m_focusDy).norm();
+			ray.hasDifferentials = true;
+
+			weights[i] = Color3f(1.0f);
+		}
+	}
+
+	Color3f sampleImportance(const Point3f &ref, const Point2f &apertureSample,
+			Point2f &samplePosition, Vector3f &d, float &dist) const {
+		Point2f tmp = squareToUniformDiskConcentric(apertureSample)
+			* m_apertureRadius;
+		Point3f apertureP(tmp.x(), tmp.y(), 0.0f);
+
+		/* Direction from the aperture towards the point (in local camera space) */
+		Vector3f local = m_worldToCamera * ref - apertureP;
+		float localDist = local.norm();
+		if (local.z() <= 0 || localDist == 0)
+			return Color3f(0.0f);
+		local /= localDist;
+		float invZ = 1.0f / local.z();
+		if (localDist * local.z() < m_nearClip || localDist * local.z() > m_farClip)
+			return Color3f(0.0f);
+
+		/* Position on the focal plane, and the corresponding film position */
+		Point3f focusP = apertureP + local * (m_focusDistance * invZ);
+		Point3f sample = m_cameraToSample * Point3f(focusP * (m_nearClip / focusP.z()));
+		samplePosition = Point2f(sample.x() * m_outputSize.x(), sample.y() * m_outputSize.y());
+		if (samplePosition.x() < 0 || samplePosition.x() >= m_outputSize.x() ||
+			samplePosition.y() < 0 || samplePosition.y() >= m_outputSize.y())
+			return Color3f(0.0f);
+
+		Point3f apertureWorld = m_cameraToWorld * apertureP;
+		d = apertureWorld - ref;
+		dist = d.norm();
+		d /= dist;
+
+		/* The importance (1 / (A cos^4 theta) for a film of area A at z=1,
+		   times 1 / (pi r^2) for a lens) times cos(theta) / dist^2, divided
+		   by the density 1 / (pi r^2) of the aperture position */
+		float cosTheta = local.z();
+		return Color3f(1.0f / (m_imagePlaneArea * cosTheta * cosTheta * cosTheta
+			* dist * dist));
+	}
+
 	void addChild(NoriObject *obj) {
 		switch (obj->getClassType()) {
 			case EReconstructionFilter:
@@ -150,7 +293,8 @@ public:
 			"  apertureRadius = %4,\n"
 			"  focusDistance = %5,\n"
 			"  clip = [%6, %7],\n"
-			"  rfilter = %8\n"
+			"  shutter = [%8, %9],\n"
+			"  rfilter = %10\n"
 			"]")
 		.arg(indent(m_cameraToWorld.toString(), 18))
 		.arg(m_outputSize.toString())
@@ -159,12 +303,22 @@ public:
 		.arg(m_focusDistance)
 		.arg(m_nearClip)
 		.arg(m_farClip)
+		.arg(m_shutterOpen)
+		.arg(m_shutterClose)
 		.arg(indent(m_rfilter->toString()));
 	}
 private:
 	Vector2f m_invOutputSize;
 	Transform m_sampleToCamera;
+	Transform m_cameraToSample;
 	Transform m_cameraToWorld;
+	Transform m_worldToCamera;
+	Point3f m_focusOrigin;
+	Vector3f m_focusDx, m_focusDy;
+	Vector3f m_worldFocusOrigin, m_worldFocusDx, m_worldFocusDy;
+	Point3f m_worldApertureCenter;
+	Vector3f m_worldApertureX, m_worldApertureY;
+	float m_imagePlaneArea;
 	float m_fov;
 	float m_apertureRadius;
 	float m_focusDistance;
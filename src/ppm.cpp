@@ -0,0 +1,562 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
+#include <nori/phase.h>
+#include <QThread>
+
+NORI_NAMESPACE_BEGIN
+
+/// A photon that was stored at a surface interaction
+struct Photon {
+	/// Position of the interaction
+	Point3f p;
+	/// Direction towards the previous vertex of the photon path
+	Vector3f d;
+	/// Power carried by the photon (before dividing by the number of paths)
+	Color3f power;
+};
+
+/**
+ * \brief Hashed uniform grid over a set of photons for lookups within
+ * a fixed radius
+ *
+ * The grid cells are twice as large as the lookup radius, hence a
+ * lookup visits the 2x2x2 cells that overlap its sphere. Cells are
+ * hashed into a table with one bucket per photon (rounded up to a power
+ * of two), and the photons are sorted by their buckets using a counting
+ * sort, so that each bucket is a contiguous range of the photon array.
+ * Buckets that are shared by several cells simply contain more photons
+ * than necessary -- the lookup checks the distance of each one anyway.
+ */
+class PhotonGrid {
+public:
+	PhotonGrid() : m_radius(0), m_invCellSize(0), m_mask(0) { }
+
+	/// Build the grid for a lookup radius (releases the memory of \c photons)
+	void build(std::vector<Photon> &photons, float radius) {
+		m_radius = radius;
+		m_invCellSize = 1.0f / (2 * radius);
+		m_bbox.reset();
+		for (size_t i=0; i<photons.size(); ++i)
+			m_bbox.expandBy(photons[i].p);
+
+		uint32_t tableSize = 1;
+		while (tableSize < photons.size())
+			tableSize <<= 1;
+		m_mask = tableSize - 1;
+
+		/* Count the photons of each bucket, turn the counts into the
+		   start indices, and scatter the photons into place */
+		std::vector<uint32_t> buckets(photons.size());
+		m_bucketStart.assign(tableSize + 1, 0);
+		for (size_t i=0; i<photons.size(); ++i) {
+			buckets[i] = bucket(cell(photons[i].p));
+			m_bucketStart[buckets[i] + 1]++;
+		}
+		for (uint32_t i=0; i<tableSize; ++i)
+			m_bucketStart[i + 1] += m_bucketStart[i];
+
+		std::vector<uint32_t> next(m_bucketStart.begin(), m_bucketStart.end() - 1);
+		m_photons.resize(photons.size());
+		for (size_t i=0; i<photons.size(); ++i)
+			m_photons[next[buckets[i]]++] = photons[i];
+
+		std::vector<Photon>().swap(photons);
+	}
+
+	/// Release all memory
+	void clear() {
+		std::vector<Photon>().swap(m_photons);
+		std::vector<uint32_t>().swap(m_bucketStart);
+	}
+
+	/**
+	 * \brief Find the distinct buckets of the cells that overlap the
+	 * lookup sphere around \c p
+	 *
+	 * \return The number of buckets written to \c buckets (at most 8)
+	 */
+	inline int lookup(const Point3f &p, uint32_t *buckets) const {
+		if (m_photons.empty())
+			return 0;
+		Vector3i lo = cell(p - Vector3f::Constant(m_radius));
+		int count = 0;
+		for (int i=0; i<8; ++i) {
+			uint32_t index = bucket(Vector3i(lo.x() + (i & 1),
+				lo.y() + ((i >> 1) & 1), lo.z() + (i >> 2)));
+			if (m_bucketStart[index] == m_bucketStart[index + 1] ||
+				std::find(buckets, buckets + count, index) != buckets + count)
+				continue;
+			buckets[count++] = index;
+		}
+		return count;
+	}
+
+	/// Return the first photon of a bucket
+	inline const Photon *begin(uint32_t bucket) const { return &m_photons[0] + m_bucketStart[bucket]; }
+
+	/// Return the end of the photons of a bucket
+	inline const Photon *end(uint32_t bucket) const { return &m_photons[0] + m_bucketStart[bucket + 1]; }
+
+	/// Return the lookup radius
+	inline float getRadius() const { return m_radius; }
+
+	/// Return the number of photons
+	inline size_t getPhotonCount() const { return m_photons.size(); }
+
+	/// Return the memory used by the grid in bytes
+	inline size_t getMemoryUsage() const {
+		return m_photons.size() * sizeof(Photon) + m_bucketStart.size() * sizeof(uint32_t);
+	}
+private:
+	/// Return the integer coordinates of the cell containing \c p
+	inline Vector3i cell(const Point3f &p) const {
+		Vector3f rel = (p - m_bbox.min) * m_invCellSize;
+		return Vector3i((int) std::floor(rel.x()), (int) std::floor(rel.y()),
+			(int) std::floor(rel.z()));
+	}
+
+	/// Hash the coordinates of a cell to a bucket
+	inline uint32_t bucket(const Vector3i &c) const {
+		return (((uint32_t) c.x() * 73856093u) ^ ((uint32_t) c.y() * 19349663u)
+			^ ((uint32_t) c.z() * 83492791u)) & m_mask;
+	}
+
+	float m_radius, m_invCellSize;
+	BoundingBox3f m_bbox;
+	uint32_t m_mask;
+	std::vector<uint32_t> m_bucketStart;
+	std::vector<Photon> m_photons;
+};
+
+class ProgressivePhotonMapper;
+
+/// Traces a range of the photon paths of a pass
+class PhotonThread : public QThread {
+public:
+	PhotonThread(const ProgressivePhotonMapper *integrator, const Scene *scene,
+			Sampler *sampler, int pass, size_t first, size_t last)
+		: m_integrator(integrator), m_scene(scene), m_sampler(sampler),
+		  m_pass(pass), m_first(first), m_last(last) { }
+
+	void run();
+
+	inline std::vector<Photon> &getPhotons() { return m_photons; }
+	inline const QString &getError() const { return m_error; }
+private:
+	const ProgressivePhotonMapper *m_integrator;
+	const Scene *m_scene;
+	Sampler *m_sampler;
+	int m_pass;
+	size_t m_first, m_last;
+	std::vector<Photon> m_photons;
+	QString m_error;
+};
+
+/**
+ * \brief Progressive photon mapping
+ *
+ * Implements the probabilistic formulation of progressive photon
+ * mapping by Knaus and Zwicker: before every pass of a progressive
+ * rendering (see \ref Integrator::preprocess()), a new set of
+ * \c photonCount paths is traced from the luminaires, using one thread
+ * per core. Their surface interactions after the first bounce are
+ * stored as photons in a hashed grid (see \ref PhotonGrid), replacing
+ * the photons of the previous pass, so that the memory use stays
+ * bounded. The lookup radius shrinks from pass to pass as
+ * \f$r_{i+1}^2 = r_i^2 (i + \alpha) / (i + 1)\f$, which makes the
+ * average of the passes converge to the correct solution.
+ *
+ * Camera paths follow specular reflections and scatter through media
+ * (sampling luminaires at medium interactions) until they reach a
+ * non-specular surface. There, the direct illumination is computed by
+ * sampling a luminaire, and the indirect illumination is estimated
+ * from the photons within the lookup radius. The render threads do
+ * the lookups in parallel, as the grid is read-only during a pass.
+ * Paths that travel from a luminaire via specular surfaces or media to
+ * a diffuse surface (e.g. caustics) are thus found efficiently.
+ *
+ * The lookup does not use a medium radiance estimate; light scattered
+ * in media is carried by the photons to the surfaces, and by the
+ * camera paths' luminaire samples.
+ */
+class ProgressivePhotonMapper : public Integrator {
+public:
+	ProgressivePhotonMapper(const PropertyList &propList) {
+		/* Number of photon paths traced before every pass */
+		m_photonCount = propList.getInteger("photonCount", 250000);
+
+		/* Lookup radius of the first pass (0 = 1/200 of the scene's diagonal) */
+		m_initialRadius = propList.getFloat("initialRadius", 0.0f);
+
+		/* Fraction of the photons that is kept from one pass to the next */
+		m_alpha = propList.getFloat("alpha", 0.7f);
+
+		/* Maximum number of segments of the camera and photon paths (-1 = unlimited) */
+		m_maxDepth = propList.getInteger("maxDepth", -1);
+
+		/* Number of photon path segments after which Russian roulette starts */
+		m_rrDepth = propList.getInteger("rrDepth", 5);
+
+		if (m_photonCount <= 0)
+			throw NoriException(QString("ProgressivePhotonMapper: invalid photonCount %1 "
+				"(must be positive)").arg(m_photonCount));
+		if (m_initialRadius < 0)
+			throw NoriException(QString("ProgressivePhotonMapper: invalid initialRadius %1 "
+				"(must be >= 0)").arg(m_initialRadius));
+		if (m_alpha <= 0 || m_alpha >= 1)
+			throw NoriException(QString("ProgressivePhotonMapper: invalid alpha %1 "
+				"(must be in (0, 1))").arg(m_alpha));
+		if (m_maxDepth == 0 || m_maxDepth < -1)
+			throw NoriException(QString("ProgressivePhotonMapper: invalid maxDepth %1 "
+				"(must be positive or -1)").arg(m_maxDepth));
+		if (m_rrDepth < 1)
+			throw NoriException(QString("ProgressivePhotonMapper: invalid rrDepth %1 "
+				"(must be >= 1)").arg(m_rrDepth));
+
+		m_passes = true;
+	}
+
+	virtual ~ProgressivePhotonMapper() {
+		for (size_t i=0; i<m_samplers.size(); ++i)
+			delete m_samplers[i];
+	}
+
+	void preprocess(const Scene *scene, int pass) {
+		QElapsedTimer timer;
+		timer.start();
+		m_grid.clear();
+		if (scene->getLuminaires().empty())
+			return;
+
+		/* Shrink the radius of the first pass according to the pass index */
+		float radius = m_initialRadius > 0 ? m_initialRadius
+			: scene->getBoundingBox().getExtents().norm() / 200;
+		float radiusSquared = radius * radius;
+		for (int i=1; i<=pass; ++i)
+			radiusSquared *= (i + m_alpha) / (i + 1);
+
+		/* Trace the photon paths using one thread (and sampler) per core.
+		   The samples only depend on the pass and the path index */
+		int threadCount = std::max(1, std::min(getCoreCount(), m_photonCount));
+		while ((int) m_samplers.size() < threadCount)
+			m_samplers.push_back(const_cast<Sampler *>(scene->getSampler())->clone());
+
+		std::vector<PhotonThread *> threads(threadCount);
+		for (int i=0; i<threadCount; ++i) {
+			threads[i] = new PhotonThread(this, scene, m_samplers[i], pass,
+				(size_t) m_photonCount * i / threadCount,
+				(size_t) m_photonCount * (i + 1) / threadCount);
+			threads[i]->start();
+		}
+
+		QString error;
+		size_t photonCount = 0;
+		for (int i=0; i<threadCount; ++i) {
+			threads[i]->wait();
+			photonCount += threads[i]->getPhotons().size();
+			if (error.isEmpty())
+				error = threads[i]->getError();
+		}
+
+		std::vector<Photon> photons;
+		if (error.isEmpty()) {
+			photons.reserve(photonCount);
+			for (int i=0; i<threadCount; ++i)
+				photons.insert(photons.end(), threads[i]->getPhotons().begin(),
+					threads[i]->getPhotons().end());
+		}
+		for (int i=0; i<threadCount; ++i)
+			delete threads[i];
+		if (!error.isEmpty())
+			throw NoriException(QString("ProgressivePhotonMapper: %1").arg(error));
+
+		m_grid.build(photons, std::sqrt(radiusSquared));
+		cout << "Pass " << pass + 1 << ": traced " << m_photonCount << " photon paths, stored "
+			 << m_grid.getPhotonCount() << " photons (radius " << m_grid.getRadius()
+			 << ", " << m_grid.getMemoryUsage() / 1024 << " KiB, " << timer.elapsed()
+			 << " ms)" << endl;
+	}
+
+	Color3f Li(RenderContext &context, const Ray3f &_ray) const {
+		const Scene *scene = context.scene;
+		Sampler *sampler = context.sampler;
+		const Luminaire *env = scene->getEnvironmentLuminaire();
+		bool hasLuminaires = !scene->getLuminaires().empty();
+
+		Ray3f ray(_ray);
+		Color3f result(0.0f), throughput(1.0f);
+		MediumStack media(scene->getMedium());
+		Intersection its;
+
+		/* Emission is only counted where it wasn't found by a luminaire
+		   sample, i.e. along the camera ray and after specular reflections */
+		bool countEmission = true;
+
+		for (int depth = 1; m_maxDepth < 0 || depth <= m_maxDepth; ++depth) {
+			context.rayCount++;
+			bool hit = scene->rayIntersect(ray, its);
+
+			/* Sample a medium interaction along the segment */
+			Ray3f segment(ray.o, ray.d, ray.mint, hit ? its.t : ray.maxt);
+			float t;
+			Color3f mediumWeight;
+			bool mediumInteraction = scene->sampleDistance(segment, sampler,
+				t, mediumWeight, media);
+			if (mediumInteraction && countEmission && media.top()->getLuminaire())
+				result += throughput * media.top()->evalCollisionEmission(ray(t));
+			throughput *= mediumWeight;
+			if (throughput.isZero())
+				break;
+
+			if (mediumInteraction) {
+				Point3f p = ray(t);
+				const PhaseFunction *phase = media.top()->getPhaseFunction();
+
+				/* Direct illumination */
+				if (hasLuminaires) {
+					LuminaireQueryRecord lRec(p);
+					Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+					float phaseVal = value.isZero() ? 0.0f
+						: phase->eval(PhaseFunctionQueryRecord(-ray.d, lRec.d));
+					if (phaseVal > 0)
+						result += throughput * value * phaseVal
+							* transmittance(context, lRec, media);
+				}
+
+				/* Continue the path by sampling the phase function */
+				PhaseFunctionQueryRecord pRec(-ray.d);
+				float phaseWeight = phase->sample(pRec, sampler->next2D());
+				if (phaseWeight <= 0)
+					break;
+				throughput *= phaseWeight;
+				ray = Ray3f(p, pRec.wo);
+				countEmission = false;
+			} else if (!hit) {
+				if (env && countEmission)
+					result += throughput * env->eval(LuminaireQueryRecord(env, ray.o, ray.d));
+				break;
+			} else {
+				its.computeDifferentialGeometry();
+				its.computeFootprint(ray);
+				if (depth == 1 && context.aov)
+					context.aov->set(its);
+
+				const Luminaire *luminaire = its.mesh->getLuminaire();
+				if (luminaire && countEmission)
+					result += throughput * luminaire->eval(LuminaireQueryRecord(luminaire,
+						ray.o, its.p, its.shFrame.n));
+
+				const BSDF *bsdf = its.mesh->getBSDF();
+				if (!bsdf)
+					break;
+				Vector3f wi = its.toLocal(-ray.d);
+
+				/* Follow specular reflections */
+				BSDFQueryRecord bRec(wi);
+				bRec.uv = its.uv;
+				bRec.uvWidth = its.uvWidth;
+				Color3f bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+				if (bRec.measure == EDiscrete) {
+					if (bsdfWeight.isZero())
+						break;
+					throughput *= bsdfWeight;
+					Vector3f wo = its.toWorld(bRec.wo);
+					if (its.geoFrame.n.dot(ray.d) * its.geoFrame.n.dot(wo) > 0)
+						media.update(its, wo);
+					Ray3f next(its.p, wo);
+					if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) > 0)
+						its.reflectDifferentials(ray, next);
+					ray = next;
+					countEmission = true;
+					continue;
+				}
+
+				/* Direct illumination */
+				if (hasLuminaires) {
+					LuminaireQueryRecord lRec(its.p);
+					Color3f value = scene->sampleLuminaire(lRec, sampler->next2D());
+					if (!value.isZero()) {
+						BSDFQueryRecord lumRec(wi, its.toLocal(lRec.d), ESolidAngle);
+						lumRec.uv = its.uv;
+						lumRec.uvWidth = its.uvWidth;
+						Color3f bsdfVal = bsdf->eval(lumRec);
+						if (!bsdfVal.isZero())
+							result += throughput * value * bsdfVal
+								* std::abs(Frame::cosTheta(lumRec.wo))
+								* transmittance(context, lRec, media);
+					}
+				}
+
+				/* Indirect illumination from the photons */
+				result += throughput * gather(its, bsdf, wi);
+				break;
+			}
+		}
+
+		return result;
+	}
+
+	/**
+	 * \brief Trace the photon paths with indices in [first, last) of a
+	 * pass, and append their photons to \c photons
+	 */
+	void tracePhotons(const Scene *scene, Sampler *sampler, int pass,
+			size_t first, size_t last, std::vector<Photon> &photons) const {
+		Intersection its;
+		for (size_t index=first; index<last; ++index) {
+			sampler->generate(Point2i(-1 - pass, 0), (uint32_t) index);
+
+			LuminaireQueryRecord lRec(Point3f(0.0f, 0.0f, 0.0f));
+			Ray3f ray;
+			Color3f power = scene->sampleEmission(lRec, ray,
+				sampler->next2D(), sampler->next2D());
+			if (power.isZero())
+				continue;
+			MediumStack media(scene->getMedium());
+
+			for (int depth = 1; m_maxDepth < 0 || depth <= m_maxDepth; ++depth) {
+				bool hit = scene->rayIntersect(ray, its);
+
+				Ray3f segment(ray.o, ray.d, ray.mint, hit ? its.t : ray.maxt);
+				float t;
+				Color3f mediumWeight;
+				bool mediumInteraction = scene->sampleDistance(segment, sampler,
+					t, mediumWeight, media);
+				power *= mediumWeight;
+				if (power.isZero())
+					break;
+
+				if (mediumInteraction) {
+					PhaseFunctionQueryRecord pRec(-ray.d);
+					float phaseWeight = media.top()->getPhaseFunction()->sample(
+						pRec, sampler->next2D());
+					if (phaseWeight <= 0)
+						break;
+					power *= phaseWeight;
+					ray = Ray3f(ray(t), pRec.wo);
+				} else if (!hit) {
+					break;
+				} else {
+					its.computeDifferentialGeometry();
+					const BSDF *bsdf = its.mesh->getBSDF();
+					if (!bsdf)
+						break;
+
+					/* The direct illumination is computed by the camera paths */
+					if (depth > 1) {
+						Photon photon;
+						photon.p = its.p;
+						photon.d = -ray.d;
+						photon.power = power;
+						photons.push_back(photon);
+					}
+
+					BSDFQueryRecord bRec(its.toLocal(-ray.d));
+					bRec.uv = its.uv;
+					bRec.uvWidth = its.uvWidth;
+					Color3f bsdfWeight = bsdf->sample(bRec, sampler->next2D());
+					if (bsdfWeight.isZero())
+						break;
+					power *= bsdfWeight;
+
+					Vector3f wo = its.toWorld(bRec.wo);
+					if (its.geoFrame.n.dot(ray.d) * its.geoFrame.n.dot(wo) > 0)
+						media.update(its, wo);
+					ray = Ray3f(its.p, wo);
+				}
+
+				/* Russian roulette based on the power */
+				if (depth >= m_rrDepth) {
+					float q = std::min(power.maxCoeff(), 0.95f);
+					if (sampler->next1D() >= q)
+						break;
+					power /= q;
+				}
+			}
+		}
+	}
+
+	QString toString() const {
+		return QString("ProgressivePhotonMapper[photonCount=%1, initialRadius=%2, "
+			"alpha=%3, maxDepth=%4, rrDepth=%5]")
+			.arg(m_photonCount).arg(m_initialRadius).arg(m_alpha)
+			.arg(m_maxDepth).arg(m_rrDepth);
+	}
+private:
+	/**
+	 * \brief Estimate the radiance reflected towards \c wi from the
+	 * photons within the lookup radius
+	 */
+	inline Color3f gather(const Intersection &its, const BSDF *bsdf,
+			const Vector3f &wi) const {
+		uint32_t buckets[8];
+		int bucketCount = m_grid.lookup(its.p, buckets);
+		float radiusSquared = m_grid.getRadius() * m_grid.getRadius();
+
+		Color3f result(0.0f);
+		for (int i=0; i<bucketCount; ++i) {
+			for (const Photon *photon = m_grid.begin(buckets[i]);
+					photon != m_grid.end(buckets[i]); ++photon) {
+				if ((photon->p - its.p).squaredNorm() > radiusSquared)
+					continue;
+				BSDFQueryRecord bRec(wi, its.toLocal(photon->d), ESolidAngle);
+				bRec.uv = its.uv;
+				bRec.uvWidth = its.uvWidth;
+				result += bsdf->eval(bRec) * photon->power;
+			}
+		}
+		return result / (M_PI * radiusSquared * m_photonCount);
+	}
+
+	/**
+	 * \brief Trace the shadow ray of a luminaire sample and return the
+	 * transmittance along it through \c media (zero if it is occluded)
+	 */
+	inline Color3f transmittance(RenderContext &context, const LuminaireQueryRecord &lRec,
+			const MediumStack &media) const {
+		Ray3f shadowRay(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - Epsilon));
+		context.shadowRayCount++;
+		return context.scene->evalVisibilityTransmittance(shadowRay, context.sampler, media);
+	}
+
+	int m_photonCount;
+	float m_initialRadius;
+	float m_alpha;
+	int m_maxDepth;
+	int m_rrDepth;
+	PhotonGrid m_grid;
+	std::vector<Sampler *> m_samplers;
+};
+
+void PhotonThread::run() {
+	try {
+		m_integrator->tracePhotons(m_scene, m_sampler, m_pass, m_first, m_last, m_photons);
+	} catch (const NoriException &ex) {
+		m_error = ex.getReason();
+	} catch (const std::exception &ex) {
+		m_error = ex.what();
+	}
+}
+
+NORI_REGISTER_CLASS(ProgressivePhotonMapper, "ppm");
+NORI_NAMESPACE_END
@@ -0,0 +1,213 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/procedural.h>
+#include <nori/memreport.h>
+#include <QElapsedTimer>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/// Orders shape references by the center of their bounding box along an axis
+struct ShapeRefOrdering {
+	int axis;
+
+	inline ShapeRefOrdering(int axis) : axis(axis) { }
+
+	template <typename Ref> inline bool operator()(const Ref &a, const Ref &b) const {
+		return a.bbox.min[axis] + a.bbox.max[axis] < b.bbox.min[axis] + b.bbox.max[axis];
+	}
+};
+
+ProceduralAccelerator::ProceduralAccelerator(Accelerator *inner)
+	: m_inner(inner), m_buildTime(0) { }
+
+ProceduralAccelerator::~ProceduralAccelerator() {
+	delete m_inner;
+}
+
+void ProceduralAccelerator::build() {
+	m_inner->build();
+
+	QElapsedTimer timer;
+	timer.start();
+
+	m_refs.clear();
+	for (SizeType i=0; i<m_inner->getMeshCount(); ++i) {
+		const Mesh *mesh = m_inner->getMesh(i);
+		if (!mesh->isProcedural())
+			continue;
+		const ProceduralMesh *procMesh = static_cast<const ProceduralMesh *>(mesh);
+		for (uint32_t j=0; j<procMesh->getShapeCount(); ++j) {
+			ShapeRef ref;
+			ref.bbox = procMesh->getBoundingBox(j);
+			ref.mesh = procMesh;
+			ref.index = j;
+			m_refs.push_back(ref);
+		}
+	}
+	m_primitiveCount = m_inner->getPrimitiveCount() + (SizeType) m_refs.size();
+
+	cout << "Constructing a hierarchy over " << m_refs.size() << " procedural shapes .." << endl;
+	m_nodes.clear();
+	if (!m_refs.empty()) {
+		m_nodes.reserve(2 * m_refs.size());
+		buildRecursive(0, (uint32_t) m_refs.size(), 0);
+	}
+
+	m_bbox.reset();
+	if (m_inner->getPrimitiveCount() > 0)
+		m_bbox.expandBy(m_inner->getBoundingBox());
+	if (!m_nodes.empty())
+		m_bbox.expandBy(m_nodes[0].bbox);
+
+	m_buildTime = timer.elapsed();
+	cout << "Finished after " << m_buildTime << " ms ("
+		 << m_nodes.size() << " nodes)" << endl;
+}
+
+bool ProceduralAccelerator::update() {
+	bool incremental = m_inner->update();
+	m_bbox.reset();
+	if (m_inner->getPrimitiveCount() > 0)
+		m_bbox.expandBy(m_inner->getBoundingBox());
+	if (!m_nodes.empty())
+		m_bbox.expandBy(m_nodes[0].bbox);
+	return incremental;
+}
+
+uint32_t ProceduralAccelerator::buildRecursive(uint32_t start, uint32_t end, int depth) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(ShapeNode());
+
+	BoundingBox3f bbox, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(m_refs[i].bbox);
+		centroidBBox.expandBy(m_refs[i].bbox.getCenter());
+	}
+	m_nodes[nodeIndex].bbox = bbox;
+
+	if (end - start <= 2 || depth + 1 >= NORI_PROCEDURAL_MAXDEPTH) {
+		m_nodes[nodeIndex].offset = start;
+		m_nodes[nodeIndex].count = end - start;
+		return nodeIndex;
+	}
+
+	/* Split at the median along the axis of largest centroid extent */
+	int axis = centroidBBox.getMajorAxis();
+	uint32_t mid = (start + end) / 2;
+	std::nth_element(m_refs.begin() + start, m_refs.begin() + mid,
+		m_refs.begin() + end, ShapeRefOrdering(axis));
+
+	buildRecursive(start, mid, depth + 1);
+	uint32_t right = buildRecursive(mid, end, depth + 1);
+
+	m_nodes[nodeIndex].offset = right;
+	m_nodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+bool ProceduralAccelerator::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+	Ray3f ray(_ray);
+	bool foundIntersection = false;
+	const ShapeRef *foundRef = NULL;
+	Point2f foundUV;
+
+	/* Determine the adaptive ray epsilon here, since the shapes use it as well */
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	/* First, intersect against the wrapped structure */
+	if (m_inner->getPrimitiveCount() > 0 && m_inner->rayIntersect(ray, its, shadowRay)) {
+		if (shadowRay)
+			return true;
+		ray.maxt = its.t;
+		foundIntersection = true;
+	}
+
+	if (m_nodes.empty())
+		return foundIntersection;
+
+	uint32_t stack[NORI_PROCEDURAL_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIndex = 0;
+
+	while (true) {
+		const ShapeNode &node = m_nodes[nodeIndex];
+		float nearT, farT;
+
+		if (node.bbox.rayIntersect(ray, ray.mint, ray.maxt, nearT, farT)) {
+			if (node.count == 0) {
+				stack[stackPos++] = node.offset;
+				nodeIndex = nodeIndex + 1;
+				continue;
+			}
+
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const ShapeRef &ref = m_refs[i];
+				float t;
+				Point2f uv;
+				if (!ref.mesh->rayIntersect(ref.index, ray, ray.maxt, t, uv))
+					continue;
+				if (shadowRay)
+					return true;
+				ray.maxt = t;
+				foundRef = &ref;
+				foundUV = uv;
+				foundIntersection = true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIndex = stack[--stackPos];
+	}
+
+	/* The geometry of procedural shapes may only exist during the query
+	   (e.g. ribbons that face the ray), hence their differential
+	   geometry is computed right away */
+	if (foundRef) {
+		its.t = ray.maxt;
+		its.mesh = foundRef->mesh;
+		its.primIndex = foundRef->index;
+		its.bary = foundUV;
+		foundRef->mesh->computeDifferentialGeometry(ray, its);
+	}
+
+	return foundIntersection;
+}
+
+void ProceduralAccelerator::reportMemory(MemoryReport &report) const {
+	m_inner->reportMemory(report);
+	report.add("accel", m_nodes.size() * sizeof(ShapeNode) + m_refs.size() * sizeof(ShapeRef));
+}
+
+size_t ProceduralAccelerator::getMemoryUsage() const {
+	return m_inner->getMemoryUsage()
+		+ m_nodes.size() * sizeof(ShapeNode)
+		+ m_refs.size() * sizeof(ShapeRef);
+}
+
+qint64 ProceduralAccelerator::getBuildTime() const {
+	return m_inner->getBuildTime() + m_buildTime;
+}
+
+QString ProceduralAccelerator::getName() const {
+	return QString("%1 with procedural shapes").arg(m_inner->getName());
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,109 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/profiler.h>
+#include <QMutexLocker>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+Profiler *Profiler::getInstance() {
+	static Profiler profiler;
+	return &profiler;
+}
+
+Profiler::~Profiler() {
+	for (size_t i=0; i<m_threads.size(); ++i)
+		delete m_threads[i];
+}
+
+void Profiler::enable() {
+	m_timer.start();
+	m_enabled = true;
+}
+
+Profiler::ThreadEvents *Profiler::getThreadEvents() {
+	if (EXPECT_NOT_TAKEN(!m_slot.hasLocalData())) {
+		ThreadEvents *events = new ThreadEvents();
+		QMutexLocker locker(&m_mutex);
+		events->id = (int) m_threads.size();
+		events->name = QString("thread %1").arg(events->id);
+		m_threads.push_back(events);
+
+		ThreadSlot *slot = new ThreadSlot();
+		slot->events = events;
+		m_slot.setLocalData(slot);
+	}
+	return m_slot.localData()->events;
+}
+
+void Profiler::record(const char *name, const char *category, qint64 start,
+		qint64 duration, const QString &detail) {
+	if (!m_enabled)
+		return;
+	Event event;
+	event.name = name;
+	event.category = category;
+	event.start = start;
+	event.duration = duration;
+	event.detail = detail;
+	getThreadEvents()->events.push_back(event);
+}
+
+void Profiler::setThreadName(const QString &name) {
+	if (m_enabled)
+		getThreadEvents()->name = name;
+}
+
+void Profiler::save(const QString &filename) const {
+	std::ofstream out(filename.toLocal8Bit().data());
+	if (!out)
+		throw NoriException(QString("Cannot open \"%1\" for writing").arg(filename));
+
+	/* Time stamps are in microseconds */
+	QMutexLocker locker(&m_mutex);
+	out.setf(std::ios::fixed);
+	out.precision(3);
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+	bool first = true;
+	for (size_t i=0; i<m_threads.size(); ++i) {
+		const ThreadEvents *thread = m_threads[i];
+		out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+			"\"pid\": 1, \"tid\": " << thread->id << ", \"args\": {\"name\": "
+			<< toJSONString(thread->name) << "}}";
+		first = false;
+
+		for (size_t j=0; j<thread->events.size(); ++j) {
+			const Event &event = thread->events[j];
+			out << ",\n{\"name\": " << toJSONString(event.name) << ", \"cat\": \""
+				<< event.category << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+				<< thread->id << ", \"ts\": " << event.start / 1000.0 << ", \"dur\": "
+				<< event.duration / 1000.0;
+			if (!event.detail.isEmpty())
+				out << ", \"args\": {\"detail\": " << toJSONString(event.detail) << "}";
+			out << "}";
+		}
+	}
+	out << endl << "]}" << endl;
+
+	out.close();
+	if (!out)
+		throw NoriException(QString("Unable to write \"%1\"").arg(filename));
+}
+
+NORI_NAMESPACE_END
@@ -17,32 +17,134 @@
 */
 
 #include <nori/proplist.h>
+#include <QDataStream>
+#include <QReadWriteLock>
+#include <deque>
+#include <map>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Assigns small integer identifiers to property names (shared by
+ * all property lists of the process)
+ *
+ * Names are looked up as UTF-8 strings, so that lookups by a string 
+ * constant don't have to construct a \c QString first.
+ */
+class PropertyNames {
+public:
+	static PropertyNames *getInstance() {
+		static PropertyNames names;
+		return &names;
+	}
+
+	/// Return the identifier of a name (or -1 if it was never interned)
+	int find(const char *name) const {
+		QReadLocker locker(&m_lock);
+		std::map<const char *, int, StringLess>::const_iterator it = m_ids.find(name);
+		return it == m_ids.end() ? -1 : it->second;
+	}
+
+	/// Return the identifier of a name, assigning a new one on first use
+	int intern(const QString &name) {
+		QByteArray key = name.toUtf8();
+		int id = find(key.constData());
+		if (id >= 0)
+			return id;
+
+		QWriteLocker locker(&m_lock);
+		std::map<const char *, int, StringLess>::const_iterator it = m_ids.find(key.constData());
+		if (it != m_ids.end())
+			return it->second;
+
+		/* The deques never move their elements, so the map can refer to them */
+		id = (int) m_names.size();
+		m_keys.push_back(key);
+		m_names.push_back(name);
+		m_ids[m_keys.back().constData()] = id;
+		return id;
+	}
+
+	/// Return the name with the given identifier
+	QString getName(int id) const {
+		QReadLocker locker(&m_lock);
+		return m_names[id];
+	}
+private:
+	struct StringLess {
+		inline bool operator()(const char *a, const char *b) const {
+			return strcmp(a, b) < 0;
+		}
+	};
+
+	PropertyNames() { }
+
+	mutable QReadWriteLock m_lock;
+	std::deque<QByteArray> m_keys;
+	std::deque<QString> m_names;
+	std::map<const char *, int, StringLess> m_ids;
+};
+
+/// Orders property list entries by the identifiers of their names
+struct EntryLess {
+	template <typename Entry> inline bool operator()(const Entry &entry, int id) const {
+		return entry.first < id;
+	}
+};
+
+const PropertyList::Property *PropertyList::find(const char *name) const {
+	int id = PropertyNames::getInstance()->find(name);
+	if (id < 0)
+		return NULL;
+	std::vector<Entry>::const_iterator it = std::lower_bound(
+		m_properties.begin(), m_properties.end(), id, EntryLess());
+	return it != m_properties.end() && it->first == id ? &it->second : NULL;
+}
+
+PropertyList::Property &PropertyList::insert(const QString &name) {
+	int id = PropertyNames::getInstance()->intern(name);
+	std::vector<Entry>::iterator it = std::lower_bound(
+		m_properties.begin(), m_properties.end(), id, EntryLess());
+	if (it != m_properties.end() && it->first == id)
+		cerr << "Property \"" << qPrintable(name) <<  "\" was specified multiple times!" << endl;
+	else
+		it = m_properties.insert(it, Entry(id, Property()));
+	return it->second;
+}
+
+bool PropertyList::remove(const char *name) {
+	int id = PropertyNames::getInstance()->find(name);
+	if (id < 0)
+		return false;
+	std::vector<Entry>::iterator it = std::lower_bound(
+		m_properties.begin(), m_properties.end(), id, EntryLess());
+	if (it == m_properties.end() || it->first != id)
+		return false;
+	m_properties.erase(it);
+	return true;
+}
+
 #define DEFINE_PROPERTY_ACCESSOR(Type, TypeName, XmlName) \
 	void PropertyList::set##TypeName(const QString &name, const Type &value) { \
-		if (m_properties.find(name) != m_properties.end()) \
-			cerr << "Property \"" << qPrintable(name) <<  "\" was specified multiple times!" << endl; \
-		m_properties[name] = value; \
+		insert(name) = value; \
 	} \
 	\
-	Type PropertyList::get##TypeName(const QString &name) const { \
-		std::map<QString, Property>::const_iterator it = m_properties.find(name); \
-		if (it == m_properties.end()) \
+	Type PropertyList::get##TypeName(const char *name) const { \
+		const Property *property = find(name); \
+		if (!property) \
 			throw NoriException(QString("Property '%1' is missing!").arg(name)); \
-		const Type *result = boost::get<Type>(&it->second); \
+		const Type *result = boost::get<Type>(property); \
 		if (!result) \
 			throw NoriException(QString("Property '%1' has the wrong type! " \
 				"(expected <" #XmlName ">)!").arg(name)); \
 		return (Type) *result; \
 	} \
 	\
-	Type PropertyList::get##TypeName(const QString &name, const Type &defVal) const { \
-		std::map<QString, Property>::const_iterator it = m_properties.find(name); \
-		if (it == m_properties.end()) \
+	Type PropertyList::get##TypeName(const char *name, const Type &defVal) const { \
+		const Property *property = find(name); \
+		if (!property) \
 			return defVal; \
-		const Type *result = boost::get<Type>(&it->second); \
+		const Type *result = boost::get<Type>(property); \
 		if (!result) \
 			throw NoriException(QString("Property '%1' has the wrong type! " \
 				"(expected <" #XmlName ">)!").arg(name)); \
@@ -58,5 +160,93 @@ DEFINE_PROPERTY_ACCESSOR(Vector3f, Vector, vector)
 DEFINE_PROPERTY_ACCESSOR(QString, String, string)
 DEFINE_PROPERTY_ACCESSOR(Transform, Transform, transform)
 
+/// Write a fixed-size Eigen type coefficient by coefficient
+template <typename T> static void writeCoeffs(QDataStream &stream, const T &value) {
+	for (int i=0; i<value.size(); ++i)
+		stream << value.coeff(i);
+}
+
+/// Read a fixed-size Eigen type coefficient by coefficient
+template <typename T> static void readCoeffs(QDataStream &stream, T &value) {
+	for (int i=0; i<value.size(); ++i)
+		stream >> value.coeffRef(i);
+}
+
+/// Orders (name, property) pairs by name
+struct NameLess {
+	template <typename T> inline bool operator()(const T &a, const T &b) const {
+		return a.first < b.first;
+	}
+};
+
+/// Writes a property value preceded by the index of its type within \c Property
+struct PropertyWriter : boost::static_visitor<> {
+	QDataStream &stream;
+
+	PropertyWriter(QDataStream &stream) : stream(stream) { }
+
+	void operator()(const bool &value) const { stream << value; }
+	void operator()(const int &value) const { stream << (qint32) value; }
+	void operator()(const float &value) const { stream << value; }
+	void operator()(const QString &value) const { stream << value; }
+	void operator()(const Color3f &value) const { writeCoeffs(stream, value); }
+	void operator()(const Point3f &value) const { writeCoeffs(stream, value); }
+	void operator()(const Transform &value) const {
+		writeCoeffs(stream, value.getMatrix());
+		writeCoeffs(stream, value.getInverseMatrix());
+	}
+};
+
+void PropertyList::write(QDataStream &stream) const {
+	/* Identifiers depend on the order in which names were first seen, 
+	   so write the properties ordered by name for a stable layout */
+	PropertyNames *names = PropertyNames::getInstance();
+	std::vector<std::pair<QString, const Property *> > sorted(m_properties.size());
+	for (size_t i=0; i<m_properties.size(); ++i)
+		sorted[i] = std::make_pair(names->getName(m_properties[i].first),
+			&m_properties[i].second);
+	std::sort(sorted.begin(), sorted.end(), NameLess());
+
+	stream << (quint32) sorted.size();
+	for (size_t i=0; i<sorted.size(); ++i) {
+		stream << sorted[i].first << (qint8) sorted[i].second->which();
+		boost::apply_visitor(PropertyWriter(stream), *sorted[i].second);
+	}
+}
+
+void PropertyList::read(QDataStream &stream) {
+	quint32 count;
+	stream >> count;
+	m_properties.clear();
+
+	for (quint32 i=0; i<count && stream.status() == QDataStream::Ok; ++i) {
+		QString name;
+		qint8 type;
+		stream >> name >> type;
+
+		/* Type indices follow the order of the types in 'Property' */
+		switch (type) {
+			case 0: { bool value; stream >> value; insert(name) = value; } break;
+			case 1: { qint32 value; stream >> value; insert(name) = (int) value; } break;
+			case 2: { float value; stream >> value; insert(name) = value; } break;
+			case 3: { QString value; stream >> value; insert(name) = value; } break;
+			case 4: { Color3f value; readCoeffs(stream, value); insert(name) = value; } break;
+			case 5: { Point3f value; readCoeffs(stream, value); insert(name) = value; } break;
+			case 6: {
+					Eigen::Matrix4f trafo, inv;
+					readCoeffs(stream, trafo);
+					readCoeffs(stream, inv);
+					insert(name) = Transform(trafo, inv);
+				}
+				break;
+			default:
+				throw NoriException(QString("PropertyList::read(): invalid type of property '%1'!").arg(name));
+		}
+	}
+
+	if (stream.status() != QDataStream::Ok)
+		throw NoriException("PropertyList::read(): unexpected end of data!");
+}
+
 NORI_NAMESPACE_END
 
@@ -0,0 +1,429 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/pcg32.h>
+#include <QAtomicInt>
+#include <QThreadStorage>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Sampler whose values are the coordinates of a point in primary
+ * sample space, which is mutated by the \c pssmlt integrator
+ *
+ * Follows the lazy scheme of Kelemen et al.: every coordinate remembers
+ * the iteration in which it was last updated, and the mutations that it
+ * missed in the meantime are applied at once when it is requested again
+ * (a large step replaces it by a uniform value, a small step perturbs it
+ * by a normally distributed offset). This way, paths of any length can
+ * be mutated without knowing the number of dimensions beforehand.
+ */
+class PrimarySampleSpace : public Sampler {
+public:
+	PrimarySampleSpace(const Sampler *settings, float sigma, float largeStepProbability)
+		: m_sigma(sigma), m_largeStepProbability(largeStepProbability),
+		  m_iteration(0), m_lastLargeStep(0), m_largeStep(true), m_index(0) {
+		copySettings(settings);
+	}
+
+	Sampler *clone() {
+		throw NoriException("PrimarySampleSpace::clone(): not supported!");
+	}
+
+	/* The point is chosen by the Markov chain, not by the pixel */
+	void generate(const Point2i &, uint32_t) { }
+	void advance() { }
+
+	float next1D() {
+		return value(m_index++);
+	}
+
+	Point2f next2D() {
+		float x = value(m_index++);
+		float y = value(m_index++);
+		return Point2f(x, y);
+	}
+
+	/**
+	 * \brief Forget the current point and start a new one whose
+	 * coordinates are drawn from a random stream given by \c seed
+	 * (calling it again with the same seed reproduces the point)
+	 */
+	void restart(uint64_t seed, uint64_t stream) {
+		m_random.seed(seed, stream);
+		m_samples.clear();
+		m_iteration = 1;
+		m_lastLargeStep = 0;
+		m_largeStep = true;
+		m_index = 0;
+	}
+
+	/**
+	 * \brief Use another random stream for the following mutations
+	 * (the coordinates of the current point remain unchanged)
+	 */
+	void reseed(uint64_t seed, uint64_t stream) {
+		m_random.seed(seed, stream);
+	}
+
+	/// Start mutating the current point
+	void startIteration() {
+		m_iteration++;
+		m_largeStep = m_random.nextFloat() < m_largeStepProbability;
+		m_index = 0;
+	}
+
+	/// Keep the mutated point
+	void accept() {
+		if (m_largeStep)
+			m_lastLargeStep = m_iteration;
+	}
+
+	/// Return to the point before the last call to \ref startIteration()
+	void reject() {
+		for (size_t i=0; i<m_samples.size(); ++i) {
+			PrimarySample &sample = m_samples[i];
+			if (sample.modify == m_iteration) {
+				sample.value = sample.backup;
+				sample.modify = sample.modifyBackup;
+			}
+		}
+		m_iteration--;
+	}
+
+	/// Return a uniformly distributed value that is not part of the point
+	inline float uniform() { return m_random.nextFloat(); }
+
+	QString toString() const {
+		return QString("PrimarySampleSpace[sigma=%1, largeStepProbability=%2]")
+			.arg(m_sigma).arg(m_largeStepProbability);
+	}
+private:
+	/// Coordinate of the point, along with its value before the current iteration
+	struct PrimarySample {
+		float value, backup;
+		uint64_t modify, modifyBackup;
+
+		inline PrimarySample() : value(0), backup(0), modify(0), modifyBackup(0) { }
+	};
+
+	/// Bring a coordinate up to date with the current iteration, and return it
+	float value(size_t index) {
+		if (index >= m_samples.size())
+			m_samples.resize(index + 1);
+		PrimarySample &sample = m_samples[index];
+
+		/* Coordinates that were not used since the last accepted
+		   large step were replaced by it */
+		if (sample.modify < m_lastLargeStep) {
+			sample.value = m_random.nextFloat();
+			sample.modify = m_lastLargeStep;
+		}
+
+		sample.backup = sample.value;
+		sample.modifyBackup = sample.modify;
+		if (m_largeStep) {
+			sample.value = m_random.nextFloat();
+		} else {
+			/* Apply all small steps that the coordinate missed at once
+			   (their offsets add up to a normal distribution as well) */
+			float sigma = m_sigma * std::sqrt((float) (m_iteration - sample.modify));
+			float r = std::sqrt(-2.0f * std::log(1.0f - m_random.nextFloat()));
+			float phi = 2.0f * (float) M_PI * m_random.nextFloat();
+			sample.value += r * std::cos(phi) * sigma;
+			sample.value -= std::floor(sample.value);
+			sample.value = std::min(sample.value, OneMinusEpsilon);
+		}
+		sample.modify = m_iteration;
+		return sample.value;
+	}
+
+	std::vector<PrimarySample> m_samples;
+	PCG32 m_random;
+	float m_sigma;
+	float m_largeStepProbability;
+	uint64_t m_iteration;
+	uint64_t m_lastLargeStep;
+	bool m_largeStep;
+	size_t m_index;
+};
+
+/**
+ * \brief Primary sample space Metropolis light transport (Kelemen et al. 2002)
+ *
+ * Another integrator (\c path by default) computes the contributions of
+ * paths, but its random numbers come from a \ref PrimarySampleSpace
+ * point that is mutated by a Markov chain, which hence explores paths
+ * in proportion to the luminance of their contribution. Besides the
+ * numbers consumed by the nested integrator, the point determines the
+ * film position of the path (its first two coordinates), the position
+ * on the aperture and the time, so that paths are splatted to arbitrary
+ * pixels (see \ref RenderContext::splats).
+ *
+ * Before the first pass, a number of independent paths are traced to
+ * estimate the average luminance of the image, which normalizes the
+ * splats, and to choose the starting points of the chains (in
+ * proportion to their luminance, which avoids start-up bias). Every
+ * render thread then runs a chain of its own, which needs no
+ * synchronization except for the atomic splats into the shared image.
+ * Each pixel sample advances the chain of its thread by
+ * \c mutationsPerSample steps; both the current and the proposed path
+ * are splatted, weighted by the acceptance probability. The pixel
+ * samples themselves only budget the work: the camera rays of the
+ * render threads are not traced, and AOVs are not supported.
+ */
+class PSSMLT : public Integrator {
+public:
+	PSSMLT(const PropertyList &propList) : m_nested(NULL), m_normalization(0),
+			m_chainCount(0), m_seed(0) {
+		/* Number of independent paths that estimate the brightness of the image */
+		m_bootstrapSamples = propList.getInteger("bootstrapSamples", 100000);
+
+		/* Number of mutations per pixel sample */
+		m_mutationsPerSample = propList.getInteger("mutationsPerSample", 1);
+
+		/* Probability of replacing the whole point instead of perturbing it */
+		m_largeStepProbability = propList.getFloat("largeStepProbability", 0.3f);
+
+		/* Standard deviation of the perturbations of small steps */
+		m_sigma = propList.getFloat("sigma", 0.01f);
+
+		if (m_bootstrapSamples < 1)
+			throw NoriException(QString("PSSMLT: invalid bootstrapSamples %1 (must be >= 1)")
+				.arg(m_bootstrapSamples));
+		if (m_mutationsPerSample < 1)
+			throw NoriException(QString("PSSMLT: invalid mutationsPerSample %1 (must be >= 1)")
+				.arg(m_mutationsPerSample));
+		if (m_largeStepProbability <= 0 || m_largeStepProbability > 1 || m_sigma <= 0)
+			throw NoriException("PSSMLT: invalid mutation parameters!");
+
+		m_splatting = true;
+		m_passes = true;
+	}
+
+	virtual ~PSSMLT() {
+		delete m_nested;
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case EIntegrator:
+				if (m_nested)
+					throw NoriException("PSSMLT: tried to register multiple nested integrators!");
+				m_nested = static_cast<Integrator *>(obj);
+				break;
+
+			default:
+				throw NoriException(QString("PSSMLT::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
+	void activate() {
+		/* If no nested integrator was specified, use a path tracer */
+		if (!m_nested)
+			m_nested = static_cast<Integrator *>(
+				NoriObjectFactory::createInstance("path", PropertyList()));
+
+		if (m_nested->usesSplatting() || m_nested->usesPasses())
+			throw NoriException("PSSMLT: the nested integrator must neither "
+				"splat nor render in passes!");
+	}
+
+	void preprocess(const Scene *scene, int) {
+		/* The chains continue across passes */
+		if (m_bootstrap.size() == 0)
+			bootstrap(scene);
+	}
+
+	Color3f Li(RenderContext &context, const Ray3f &) const {
+		if (!context.splats || m_normalization == 0)
+			return Color3f(0.0f);
+
+		MarkovChain *chain = getChain(context);
+		float scale = m_normalization / m_mutationsPerSample;
+
+		for (int i=0; i<m_mutationsPerSample; ++i) {
+			PrimarySampleSpace &sampler = chain->sampler;
+			sampler.startIteration();
+			Point2f position;
+			Color3f value = evalPath(context, sampler, position);
+			float luminance = getImportance(value);
+
+			float acceptance = chain->luminance > 0 ?
+				std::min(1.0f, luminance / chain->luminance) : 1.0f;
+
+			/* Splat the expected contributions of both paths */
+			if (acceptance < 1)
+				context.splats->putSplat(chain->position, chain->value
+					* ((1 - acceptance) * scale / chain->luminance));
+			if (acceptance > 0 && luminance > 0)
+				context.splats->putSplat(position, value
+					* (acceptance * scale / luminance));
+
+			if (sampler.uniform() < acceptance) {
+				sampler.accept();
+				chain->value = value;
+				chain->position = position;
+				chain->luminance = luminance;
+			} else {
+				sampler.reject();
+			}
+		}
+
+		return Color3f(0.0f);
+	}
+
+	QString toString() const {
+		return QString(
+			"PSSMLT[\n"
+			"  bootstrapSamples = %1,\n"
+			"  mutationsPerSample = %2,\n"
+			"  largeStepProbability = %3,\n"
+			"  sigma = %4,\n"
+			"  nested = %5\n"
+			"]")
+		.arg(m_bootstrapSamples)
+		.arg(m_mutationsPerSample)
+		.arg(m_largeStepProbability)
+		.arg(m_sigma)
+		.arg(indent(m_nested ? m_nested->toString() : QString("null")));
+	}
+private:
+	/// State of the Markov chain of a render thread
+	struct MarkovChain {
+		PrimarySampleSpace sampler;
+		/// Contribution of the current path and its position on the film
+		Color3f value;
+		Point2f position;
+		float luminance;
+
+		MarkovChain(const Sampler *settings, float sigma, float largeStepProbability)
+			: sampler(settings, sigma, largeStepProbability), value(0.0f),
+			  position(0.0f, 0.0f), luminance(0) { }
+	};
+
+	/// Scalar contribution of a path, which the chains sample proportionally to
+	static inline float getImportance(const Color3f &value) {
+		float luminance = value.getLuminance();
+		return (luminance > 0 && luminance < std::numeric_limits<float>::infinity())
+			? luminance : 0.0f;
+	}
+
+	/**
+	 * \brief Compute the contribution of the path given by the current
+	 * point of \c sampler, and return its position on the film
+	 */
+	Color3f evalPath(RenderContext &context, PrimarySampleSpace &sampler,
+			Point2f &position) const {
+		const Camera *camera = context.camera;
+		const Vector2i &size = camera->getOutputSize();
+		Point2f filmSample = sampler.next2D();
+		position = Point2f(filmSample.x() * size.x(), filmSample.y() * size.y());
+
+		Ray3f ray;
+		Color3f value = camera->sampleRay(ray, position, sampler.next2D());
+		if (camera->hasMotionBlur())
+			ray.time = camera->sampleTime(sampler.next1D());
+		if (value.isZero())
+			return value;
+
+		/* Let the nested integrator draw its numbers from the point */
+		RenderContext nested(context);
+		nested.sampler = &sampler;
+		nested.aov = NULL;
+		nested.splats = NULL;
+		nested.primaryHit = NULL;
+		nested.pixel = position;
+		nested.pixelIndex = Point2i(-1, -1);
+		nested.resetStatistics();
+
+		value *= m_nested->Li(nested, ray);
+		context.rayCount += nested.rayCount;
+		context.shadowRayCount += nested.shadowRayCount;
+		return value;
+	}
+
+	/**
+	 * \brief Trace independent paths to estimate the average luminance of
+	 * the image, and keep their luminances to choose the starting points
+	 * of the chains
+	 */
+	void bootstrap(const Scene *scene) {
+		m_seed = scene->getSampler()->getSeed();
+		PrimarySampleSpace sampler(scene->getSampler(), m_sigma, m_largeStepProbability);
+		RenderContext context(scene, &sampler);
+
+		for (int i=0; i<m_bootstrapSamples; ++i) {
+			sampler.restart(m_seed, (uint64_t) i);
+			Point2f position;
+			m_bootstrap.append(getImportance(evalPath(context, sampler, position)));
+			sampler.getArena().reset();
+		}
+
+		m_normalization = m_bootstrap.normalize() / m_bootstrapSamples;
+		if (m_normalization == 0)
+			cerr << "Warning: PSSMLT: none of the bootstrap paths carries "
+				"any light, the image will be black!" << endl;
+	}
+
+	/// Return the chain of the calling thread, starting it if necessary
+	MarkovChain *getChain(RenderContext &context) const {
+		if (m_chains.hasLocalData())
+			return m_chains.localData();
+
+		const Scene *scene = context.scene;
+		MarkovChain *chain = new MarkovChain(scene->getSampler(),
+			m_sigma, m_largeStepProbability);
+		m_chains.setLocalData(chain);
+
+		/* Choose a bootstrap path and reproduce its point */
+		uint64_t index = (uint64_t) m_chainCount.fetchAndAddRelaxed(1);
+		PCG32 random(~m_seed, index);
+		size_t start = m_bootstrap.sample(random.nextFloat());
+		chain->sampler.restart(m_seed, (uint64_t) start);
+		chain->value = evalPath(context, chain->sampler, chain->position);
+		chain->luminance = getImportance(chain->value);
+		chain->sampler.accept();
+
+		/* Mutate it with a stream of its own */
+		chain->sampler.reseed(m_seed, m_bootstrapSamples + index);
+		return chain;
+	}
+
+	Integrator *m_nested;
+	int m_bootstrapSamples;
+	int m_mutationsPerSample;
+	float m_largeStepProbability;
+	float m_sigma;
+	/// Luminances of the bootstrap paths
+	DiscretePDF m_bootstrap;
+	/// Average luminance of the image
+	float m_normalization;
+	mutable QThreadStorage<MarkovChain *> m_chains;
+	mutable QAtomicInt m_chainCount;
+	uint64_t m_seed;
+};
+
+NORI_REGISTER_CLASS(PSSMLT, "pssmlt");
+NORI_NAMESPACE_END
@@ -1,5 +1,6 @@
 #include <nori/quad.h>
 #include <boost/bind.hpp>
+#include <QThread>
 
 /*
  * =======================================================================
@@ -165,33 +166,90 @@ typedef struct {
 	double errmax; /* max ee[k].err */
 } region;
 
-static region make_region(const hypercube *h, unsigned int fdim) {
+/* Pool allocator for the storage of the regions: a block holds the
+   data of a hypercube followed by the error estimates. Regions are cut
+   and discarded all the time, and this avoids a malloc/free pair for
+   each one of them. Freed blocks are kept in a singly linked list */
+typedef struct {
+	size_t block_size; /* in doubles */
+	size_t chunk_blocks; /* number of blocks in the next chunk */
+	double *free_list;
+	std::vector<double *> chunks;
+} region_pool;
+
+static void pool_init(region_pool *pool, unsigned int dim, unsigned int fdim) {
+	pool->block_size = 2 * dim + 2 * fdim;
+	pool->chunk_blocks = 64;
+	pool->free_list = NULL;
+}
+
+static double *pool_alloc(region_pool *pool) {
+	if (!pool->free_list) {
+		double *chunk = (double *) malloc(sizeof(double) *
+			pool->block_size * pool->chunk_blocks);
+		if (!chunk)
+			return NULL;
+		pool->chunks.push_back(chunk);
+		for (size_t i = 0; i < pool->chunk_blocks; ++i) {
+			double *block = chunk + i * pool->block_size;
+			*(double **) block = pool->free_list;
+			pool->free_list = block;
+		}
+		pool->chunk_blocks *= 2;
+	}
+	double *block = pool->free_list;
+	pool->free_list = *(double **) block;
+	return block;
+}
+
+static void pool_free(region_pool *pool, double *block) {
+	*(double **) block = pool->free_list;
+	pool->free_list = block;
+}
+
+/* releases all blocks, including those of regions that weren't destroyed */
+static void pool_destroy(region_pool *pool) {
+	for (size_t i = 0; i < pool->chunks.size(); ++i)
+		free(pool->chunks[i]);
+	pool->chunks.clear();
+	pool->free_list = NULL;
+}
+
+static region make_region(const hypercube *h, unsigned int fdim, region_pool *pool) {
 	region R;
-	R.h = make_hypercube(h->dim, h->data, h->data + h->dim);
+	unsigned int dim = h->dim;
+	R.h.dim = dim;
+	R.h.data = pool_alloc(pool);
+	R.h.vol = h->vol;
 	R.splitDim = 0;
 	R.fdim = fdim;
-	R.ee = R.h.data ? (esterr *) malloc(sizeof(esterr) * fdim) : NULL;
+	R.ee = NULL;
+	if (R.h.data) {
+		memcpy(R.h.data, h->data, sizeof(double) * dim * 2);
+		R.ee = (esterr *) (R.h.data + 2 * dim);
+	}
 	return R;
 }
 
-static void destroy_region(region *R) {
-	destroy_hypercube(&R->h);
-	free(R->ee);
+static void destroy_region(region *R, region_pool *pool) {
+	if (R->h.data)
+		pool_free(pool, R->h.data);
+	R->h.data = NULL;
+	R->h.dim = 0;
 	R->ee = 0;
 }
 
-static bool cut_region(region *R, region *R2) {
+static bool cut_region(region *R, region *R2, region_pool *pool) {
 	unsigned int d = R->splitDim, dim = R->h.dim;
-	*R2 = *R;
 	R->h.data[d + dim] *= 0.5f;
 	R->h.vol *= 0.5f;
-	R2->h = make_hypercube(dim, R->h.data, R->h.data + dim);
+	*R2 = make_region(&R->h, R->fdim, pool);
 	if (!R2->h.data)
 		return NDIntegrator::EFailure;
+	R2->splitDim = R->splitDim;
 	R->h.data[d] -= R->h.data[d + dim];
 	R2->h.data[d] += R->h.data[d + dim];
-	R2->ee = (esterr *) malloc(sizeof(esterr) * R2->fdim);
-	return R2->ee == NULL;
+	return NDIntegrator::ESuccess;
 }
 
 struct rule_s; /* forward declaration */
@@ -839,6 +897,9 @@ static NDIntegrator::EResult ruleadapt_integrate(rule *r, unsigned int fdim,
 	region *R = NULL; /* array of regions to evaluate */
 	unsigned int nR_alloc = 0;
 	esterr *ee = NULL;
+	region_pool pool;
+
+	pool_init(&pool, h->dim, fdim);
 
 	regions = heap_alloc(1, fdim);
 	if (!regions.ee || !regions.items)
@@ -852,7 +913,7 @@ static NDIntegrator::EResult ruleadapt_integrate(rule *r, unsigned int fdim,
 	R = (region *) malloc(sizeof(region) * nR_alloc);
 	if (!R)
 		goto bad;
-	R[0] = make_region(h, fdim);
+	R[0] = make_region(h, fdim, &pool);
 	if (!R[0].ee || eval_regions(1, R, f, r) || heap_push(&regions, R[0]))
 		goto bad;
 	numEval += r->num_points;
@@ -904,7 +965,7 @@ static NDIntegrator::EResult ruleadapt_integrate(rule *r, unsigned int fdim,
 				R[nR] = heap_pop(&regions);
 				for (j = 0; j < fdim; ++j)
 					ee[j].err -= R[nR].ee[j].err;
-				if (cut_region(R+nR, R+nR+1))
+				if (cut_region(R+nR, R+nR+1, &pool))
 					goto bad;
 				numEval += r->num_points * 2;
 				nR += 2;
@@ -918,7 +979,7 @@ static NDIntegrator::EResult ruleadapt_integrate(rule *r, unsigned int fdim,
 				goto bad;
 		} else { /* minimize number of function evaluations */
 			R[0] = heap_pop(&regions); /* get worst region */
-			if (cut_region(R, R+1) || eval_regions(2, R, f, r)
+			if (cut_region(R, R+1, &pool) || eval_regions(2, R, f, r)
 				|| heap_push_many(&regions, 2, R))
 				goto bad;
 			numEval += r->num_points * 2;
@@ -933,19 +994,21 @@ static NDIntegrator::EResult ruleadapt_integrate(rule *r, unsigned int fdim,
 			val[j] += regions.items[i].ee[j].val;
 			err[j] += regions.items[i].ee[j].err;
 		}
-		destroy_region(&regions.items[i]);
+		destroy_region(&regions.items[i], &pool);
 	}
 
 	/* printf("regions.nalloc = %d\n", regions.nalloc); */
 	free(ee);
 	heap_free(&regions);
 	free(R);
+	pool_destroy(&pool);
 	return NDIntegrator::ESuccess;
 
 bad:
 	free(ee);
 	heap_free(&regions);
 	free(R);
+	pool_destroy(&pool);
 	return NDIntegrator::EFailure;
 }
 
@@ -1007,10 +1070,78 @@ private:
 	double *m_temp;
 };
 
+/// Evaluates a part of a batch of points for \ref ParallelAdapter
+class BatchThread : public QThread {
+public:
+	BatchThread(const VectorizedIntegrand &integrand)
+		: m_integrand(integrand), m_nPt(0), m_in(NULL), m_out(NULL) { }
+
+	inline void setBatch(size_t nPt, const double *in, double *out) {
+		m_nPt = nPt; m_in = in; m_out = out;
+	}
+
+	void run() {
+		m_integrand(m_nPt, m_in, m_out);
+	}
+private:
+	const VectorizedIntegrand &m_integrand;
+	size_t m_nPt;
+	const double *m_in;
+	double *m_out;
+};
+
+/// Splits the batches of points of a vectorized integrand across threads
+class ParallelAdapter {
+public:
+	ParallelAdapter(const VectorizedIntegrand &integrand, size_t fdim,
+			size_t dim, int threadCount) : m_integrand(integrand),
+			m_fdim(fdim), m_dim(dim) {
+		for (int i=1; i<threadCount; ++i)
+			m_threads.push_back(new BatchThread(integrand));
+	}
+
+	~ParallelAdapter() {
+		for (size_t i=0; i<m_threads.size(); ++i)
+			delete m_threads[i];
+	}
+
+	void f(size_t nPt, const double *in, double *out) {
+		size_t parts = std::min(m_threads.size() + 1, nPt / NORI_QUAD_MIN_BATCH);
+		if (parts <= 1) {
+			m_integrand(nPt, in, out);
+			return;
+		}
+
+		/* Every part stores its values in the layout of the integrand
+		   (function-major) within its own range of the buffer */
+		m_temp.resize(m_fdim * nPt);
+		for (size_t p = 1; p < parts; ++p) {
+			size_t first = nPt * p / parts, last = nPt * (p+1) / parts;
+			m_threads[p-1]->setBatch(last - first, in + first * m_dim, &m_temp[m_fdim * first]);
+			m_threads[p-1]->start();
+		}
+		m_integrand(nPt / parts, in, &m_temp[0]);
+		for (size_t p = 1; p < parts; ++p)
+			m_threads[p-1]->wait();
+
+		for (size_t p = 0; p < parts; ++p) {
+			size_t first = nPt * p / parts, count = nPt * (p+1) / parts - first;
+			const double *temp = &m_temp[m_fdim * first];
+			for (size_t k = 0; k < m_fdim; ++k)
+				memcpy(out + k*nPt + first, temp + k*count, sizeof(double) * count);
+		}
+	}
+private:
+	const VectorizedIntegrand &m_integrand;
+	size_t m_fdim, m_dim;
+	std::vector<BatchThread *> m_threads;
+	std::vector<double> m_temp;
+};
+
 NDIntegrator::NDIntegrator(size_t fDim, size_t dim,
 			size_t maxEvals, double absError, double relError) 
  : m_fdim(fDim), m_dim(dim), m_maxEvals(maxEvals), m_absError(absError),
-  m_relError(relError) { }
+  m_relError(relError), m_threadCount(1) { }
 
 NDIntegrator::EResult NDIntegrator::integrate(const Integrand &f, const double *min, 
 		const double *max, double *result, double *error, size_t *_evals) const {
@@ -1027,8 +1158,16 @@ NDIntegrator::EResult NDIntegrator::integrate(const Integrand &f, const double *
 NDIntegrator::EResult NDIntegrator::integrateVectorized(const VectorizedIntegrand &f, const double *min, 
 		const double *max, double *result, double *error, size_t *_evals) const {
 	size_t evals = 0;
-	EResult retval = nori::integrate((unsigned int) m_fdim, f, (unsigned int) m_dim,
-		min, max, m_maxEvals, m_absError, m_relError, result, error, evals, true);
+	EResult retval;
+	if (m_threadCount > 1) {
+		ParallelAdapter adapter(f, m_fdim, m_dim, m_threadCount);
+		retval = nori::integrate((unsigned int) m_fdim, boost::bind(
+			&ParallelAdapter::f, &adapter, _1, _2, _3), (unsigned int) m_dim,
+			min, max, m_maxEvals, m_absError, m_relError, result, error, evals, true);
+	} else {
+		retval = nori::integrate((unsigned int) m_fdim, f, (unsigned int) m_dim,
+			min, max, m_maxEvals, m_absError, m_relError, result, error, evals, true);
+	}
 	if (_evals)
 		*_evals = evals;
 	return retval;
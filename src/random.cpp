@@ -102,31 +102,36 @@ void Random::seed(Random *random) {
 	seed(buf, MT_N);
 }
 
-/* generates a random number on [0,0xffffffff]-interval */
-uint32_t Random::nextUInt() {
+/* generates MT_N words at one time */
+void Random::regenerate() {
 	uint32_t y;
 	static uint32_t mag01[2]={0x0UL, MT_MATRIX_A};
 	/* mag01[x] = x * MT_MATRIX_A  for x=0,1 */
+	int kk;
 
-	if (m_mti >= MT_N) { /* generate MT_N words at one time */
-		int kk;
+	if (m_mti == MT_N+1)   /* if seed() has not been called, */
+		seed(5489UL);   /* a default initial seed is used */
 
-		if (m_mti == MT_N+1)   /* if seed() has not been called, */
-			seed(5489UL);   /* a default initial seed is used */
+	for (kk=0;kk<MT_N-MT_M;kk++) {
+		y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
+		m_mt[kk] = m_mt[kk+MT_M] ^ (y >> 1) ^ mag01[y & 0x1UL];
+	}
+	for (;kk<MT_N-1;kk++) {
+		y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
+		m_mt[kk] = m_mt[kk+(MT_M-MT_N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
+	}
+	y = (m_mt[MT_N-1] & MT_UPPER_MASK)|(m_mt[0] & MT_LOWER_MASK);
+	m_mt[MT_N-1] = m_mt[MT_M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
 
-		for (kk=0;kk<MT_N-MT_M;kk++) {
-			y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
-			m_mt[kk] = m_mt[kk+MT_M] ^ (y >> 1) ^ mag01[y & 0x1UL];
-		}
-		for (;kk<MT_N-1;kk++) {
-			y = (m_mt[kk] & MT_UPPER_MASK)|(m_mt[kk+1] & MT_LOWER_MASK);
-			m_mt[kk] = m_mt[kk+(MT_M-MT_N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
-		}
-		y = (m_mt[MT_N-1] & MT_UPPER_MASK)|(m_mt[0] & MT_LOWER_MASK);
-		m_mt[MT_N-1] = m_mt[MT_M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
+	m_mti = 0;
+}
 
-		m_mti = 0;
-	}
+/* generates a random number on [0,0xffffffff]-interval */
+uint32_t Random::nextUInt() {
+	uint32_t y;
+
+	if (m_mti >= MT_N)
+		regenerate();
   
 	y = m_mt[m_mti++];
 
@@ -150,4 +155,34 @@ float Random::nextFloat() {
 	return x.f - 1.0f;
 }
 
+void Random::nextFloat(float *values, size_t count) {
+	while (count > 0) {
+		if (m_mti >= MT_N)
+			regenerate();
+
+		/* Temper a contiguous run of the state (this loop has no
+		   dependencies between iterations and can be vectorized) */
+		int n = (int) std::min(count, (size_t) (MT_N - m_mti));
+		const uint32_t *mt = m_mt + m_mti;
+		for (int i=0; i<n; ++i) {
+			uint32_t y = mt[i];
+			y ^= (y >> 11);
+			y ^= (y << 7) & 0x9d2c5680UL;
+			y ^= (y << 15) & 0xefc60000UL;
+			y ^= (y >> 18);
+
+			union {
+				uint32_t u;
+				float f;
+			} x;
+			x.u = (y >> 9) | 0x3f800000UL;
+			values[i] = x.f - 1.0f;
+		}
+
+		m_mti += n;
+		values += n;
+		count -= n;
+	}
+}
+
 NORI_NAMESPACE_END
@@ -0,0 +1,513 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/random.h>
+#include <nori/kdtree.h>
+#include <boost/scoped_ptr.hpp>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QThread>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/// Traces a contiguous range of a ray set against an acceleration data structure
+class RayBenchmarkWorker : public QThread {
+public:
+	RayBenchmarkWorker(const Accelerator *accel, const std::vector<Ray3f> &rays,
+		size_t start, size_t end, bool occlusion) : m_accel(accel), m_rays(rays),
+		m_start(start), m_end(end), m_occlusion(occlusion), m_time(0), m_hits(0),
+		m_hasStats(false) { }
+
+	void run() {
+		/* Discard the counts of earlier queries by this thread */
+		m_accel->collectTraversalStatistics(m_stats);
+
+		QElapsedTimer timer;
+		timer.start();
+		size_t hits = 0;
+		if (m_occlusion) {
+			for (size_t i=m_start; i<m_end; ++i) {
+				if (m_accel->rayOccluded(m_rays[i]))
+					++hits;
+			}
+		} else {
+			for (size_t i=m_start; i<m_end; ++i) {
+				Intersection its;
+				if (m_accel->rayIntersect(m_rays[i], its))
+					++hits;
+			}
+		}
+		m_time = timer.nsecsElapsed();
+		m_hits = hits;
+		m_hasStats = m_accel->collectTraversalStatistics(m_stats);
+	}
+
+	/// Return the number of traced rays
+	inline size_t getRayCount() const { return m_end - m_start; }
+
+	/// Return the time spent tracing in nanoseconds
+	inline qint64 getTime() const { return m_time; }
+
+	/// Return the number of rays that hit something
+	inline size_t getHits() const { return m_hits; }
+
+	/// Return the traversal counts (or \c false if the accelerator doesn't count)
+	inline bool getStatistics(Accelerator::TraversalStatistics &stats) const {
+		stats = m_stats;
+		return m_hasStats;
+	}
+private:
+	const Accelerator *m_accel;
+	const std::vector<Ray3f> &m_rays;
+	size_t m_start, m_end;
+	bool m_occlusion;
+	qint64 m_time;
+	size_t m_hits;
+	Accelerator::TraversalStatistics m_stats;
+	bool m_hasStats;
+};
+
+/**
+ * \brief Microbenchmark of the ray queries of a scene's acceleration
+ * data structure, without cameras, samplers or films in the way
+ *
+ * The tool loads the scene given by the \c filename property and
+ * generates three fixed ray sets from the seed given by \c seed:
+ *
+ * - \a primary: camera rays through jittered positions of all pixels,
+ *   in scanline order
+ * - \a ao: short rays (\c aoDistance times the scene's bounding box
+ *   diagonal) that leave the hit points of the primary rays in
+ *   cosine-distributed directions, like ambient occlusion samples
+ * - \a incoherent: unbounded rays from a random point of the scene's
+ *   bounding box towards another one
+ *
+ * Each set is traced with closest-hit (\ref Accelerator::rayIntersect())
+ * and occlusion (\ref Accelerator::rayOccluded()) queries on \c threads
+ * threads (one per core by default), which trace equal contiguous parts
+ * of the set. The tool reports the throughput of all threads together
+ * and of the slowest and fastest thread. When the accelerator counts
+ * its traversal work (see \ref Accelerator::collectTraversalStatistics()),
+ * the average numbers of visited interior nodes, leaves and triangle
+ * tests per ray are reported as well, e.g. to compare kd-tree build
+ * settings or node layouts.
+ *
+ * By default, the acceleration data structure of the scene is measured.
+ * The \c accel property instead lists types (comma-separated, e.g.
+ * <tt>"kdtree, bvh4, myplugin"</tt>, see \ref AcceleratorFactory), which
+ * are built one after the other over the meshes of the scene and traced
+ * with the same ray sets.
+ *
+ * When \c tune is set, the tool instead searches for the kd-tree
+ * construction parameters that trace the ray sets the fastest on this
+ * machine. Starting from the scene's settings, it varies the traversal
+ * cost (relative to the query cost), the empty space bonus, the stopping
+ * primitive count, the number of bad refines and the threshold for
+ * the exact O(n log n) builder one at a time over a grid of values, keeps
+ * the best value, and repeats this for \c tuneRounds rounds. Each
+ * candidate tree is built over the meshes of the scene and traced with
+ * the primary and incoherent rays (closest hit) and the AO rays
+ * (occlusion). The best settings are printed as \c kd* properties that
+ * can be pasted into the scene.
+ *
+ * <pre>
+ * &lt;test type="raybench"&gt;
+ *     &lt;string name="filename" value="scenes/ajax/ajax-path.xml"/&gt;
+ * &lt;/test&gt;
+ * </pre>
+ */
+class RayBenchmark : public NoriObject {
+public:
+	RayBenchmark(const PropertyList &propList) {
+		/* Scene whose acceleration data structure is benchmarked */
+		m_filename = propList.getString("filename");
+
+		/* Number of rays per ray set (default: 1M) */
+		m_rayCount = propList.getInteger("rayCount", 1000000);
+
+		/* Seed of the random number generator that creates the rays */
+		m_seed = propList.getInteger("seed", 1);
+
+		/* Length of the AO rays relative to the scene's bounding box diagonal */
+		m_aoDistance = propList.getFloat("aoDistance", 0.05f);
+
+		/* Number of threads (0 = one per core) */
+		m_threadCount = propList.getInteger("threads", 0);
+
+		/* Comma-separated types of acceleration data structures to compare
+		   (empty = the one of the scene) */
+		m_accelTypes = propList.getString("accel", "");
+
+		/* Search for the fastest kd-tree construction parameters */
+		m_tune = propList.getBoolean("tune", false);
+
+		/* Number of coordinate search rounds over all parameters */
+		m_tuneRounds = propList.getInteger("tuneRounds", 2);
+
+		if (m_rayCount < 1)
+			throw NoriException("RayBenchmark: the ray count must be positive!");
+		if (m_threadCount <= 0)
+			m_threadCount = getCoreCount();
+	}
+
+	void activate() {
+		boost::scoped_ptr<NoriObject> root(loadScene(m_filename));
+		if (root->getClassType() != EScene)
+			throw NoriException(QString("RayBenchmark: \"%1\" does not contain a scene!")
+				.arg(m_filename));
+		const Scene *scene = static_cast<const Scene *>(root.get());
+
+		std::vector<Ray3f> primary, ao, incoherent;
+		generateRays(scene, primary, ao, incoherent);
+
+		if (m_tune) {
+			tune(scene, primary, ao, incoherent);
+			return;
+		}
+		if (m_accelTypes.trimmed().isEmpty()) {
+			benchmark(scene->getAccelerator(), primary, ao, incoherent);
+			return;
+		}
+		QStringList types = m_accelTypes.split(",");
+		for (int i=0; i<types.size(); ++i) {
+			QString type = types[i].trimmed();
+			if (i > 0)
+				cout << endl;
+			cout << "Building a " << qPrintable(type) << " .." << endl;
+			boost::scoped_ptr<Accelerator> accel(scene->buildAccelerator(type));
+			benchmark(accel.get(), primary, ao, incoherent);
+		}
+	}
+
+	QString toString() const {
+		return QString(
+			"RayBenchmark[\n"
+			"  filename = \"%1\",\n"
+			"  rayCount = %2,\n"
+			"  seed = %3,\n"
+			"  aoDistance = %4,\n"
+			"  threads = %5,\n"
+			"  accel = \"%6\",\n"
+			"  tune = %7,\n"
+			"  tuneRounds = %8\n"
+			"]")
+			.arg(m_filename)
+			.arg(m_rayCount)
+			.arg(m_seed)
+			.arg(m_aoDistance)
+			.arg(m_threadCount)
+			.arg(m_accelTypes)
+			.arg(m_tune ? "true" : "false")
+			.arg(m_tuneRounds);
+	}
+
+	EClassType getClassType() const { return ETest; }
+protected:
+	/// Create the three ray sets (deterministically, on the calling thread)
+	void generateRays(const Scene *scene, std::vector<Ray3f> &primary,
+			std::vector<Ray3f> &ao, std::vector<Ray3f> &incoherent) const {
+		const Accelerator *accel = scene->getAccelerator();
+		const Camera *camera = scene->getCamera();
+		const BoundingBox3f &bbox = accel->getBoundingBox();
+		Vector3f extents = bbox.getExtents();
+		Vector2i size = camera->getOutputSize();
+		int pixelCount = size.x() * size.y();
+		Random random;
+		random.seed((uint32_t) m_seed);
+
+		primary.resize(m_rayCount);
+		for (int i=0; i<m_rayCount; ++i) {
+			int pixel = i % pixelCount;
+			Point2f samplePosition(
+				pixel % size.x() + random.nextFloat(),
+				pixel / size.x() + random.nextFloat());
+			Point2f apertureSample(random.nextFloat(), random.nextFloat());
+			camera->sampleRay(primary[i], samplePosition, apertureSample);
+		}
+
+		/* Start the AO rays at the primary hits (reusing hits for the misses) */
+		float aoDistance = m_aoDistance * extents.norm();
+		ao.reserve(m_rayCount);
+		for (int i=0; (int) ao.size() < m_rayCount; ++i) {
+			if (i >= m_rayCount && ao.empty())
+				throw NoriException("RayBenchmark: none of the camera rays hit the scene!");
+			Intersection its;
+			if (!accel->rayIntersect(primary[i % m_rayCount], its))
+				continue;
+			its.computeDifferentialGeometry();
+
+			/* Leave the surface on the side of the camera */
+			Vector3f d = its.geoFrame.toWorld(squareToCosineHemisphere(
+				Point2f(random.nextFloat(), random.nextFloat())));
+			if (its.geoFrame.n.dot(primary[i % m_rayCount].d) > 0)
+				d = -d;
+			ao.push_back(Ray3f(its.p, d, Epsilon, aoDistance));
+		}
+
+		incoherent.resize(m_rayCount);
+		for (int i=0; i<m_rayCount; ++i) {
+			Point3f a = bbox.min + extents.cwiseProduct(Vector3f(random.nextFloat(),
+				random.nextFloat(), random.nextFloat()));
+			Point3f b = bbox.min + extents.cwiseProduct(Vector3f(random.nextFloat(),
+				random.nextFloat(), random.nextFloat()));
+			Vector3f d = b - a;
+			if (d.squaredNorm() == 0)
+				d = Vector3f(0, 0, 1);
+			incoherent[i] = Ray3f(a, d.normalized());
+		}
+	}
+
+	/// Trace all ray sets using an acceleration data structure and print the results
+	void benchmark(const Accelerator *accel, const std::vector<Ray3f> &primary,
+			const std::vector<Ray3f> &ao, const std::vector<Ray3f> &incoherent) const {
+		cout << "Benchmarking the " << qPrintable(accel->getName()) << " of \""
+			 << qPrintable(m_filename) << "\" (" << accel->getPrimitiveCount()
+			 << " triangles, " << m_rayCount << " rays per set, " << m_threadCount
+			 << " threads, built in " << accel->getBuildTime() << " ms) .." << endl << endl
+			 << "Rays        Query       Mrays/s  (min/max per thread)   Hits    "
+			 << "Nodes/ray  Leaves/ray  Tris/ray" << endl;
+
+		trace(accel, "primary", primary);
+		trace(accel, "ao", ao);
+		trace(accel, "incoherent", incoherent);
+
+		Accelerator::TraversalStatistics stats;
+		if (!accel->collectTraversalStatistics(stats))
+			cout << endl << "(Traversal counts are unavailable -- they require a kd-tree "
+				"and a build with CONFIG+=travstats)" << endl;
+	}
+
+	/// Trace a ray set with both query types and print the results
+	void trace(const Accelerator *accel, const char *name,
+			const std::vector<Ray3f> &rays) const {
+		const char *queries[] = { "closest-hit", "occlusion" };
+
+		for (int occlusion=0; occlusion<2; ++occlusion) {
+			std::vector<RayBenchmarkWorker *> workers(m_threadCount);
+			for (int i=0; i<m_threadCount; ++i) {
+				size_t start = rays.size() * i / m_threadCount,
+				       end = rays.size() * (i + 1) / m_threadCount;
+				workers[i] = new RayBenchmarkWorker(accel, rays, start, end, occlusion == 1);
+			}
+
+			QElapsedTimer timer;
+			timer.start();
+			for (int i=0; i<m_threadCount; ++i)
+				workers[i]->start();
+			for (int i=0; i<m_threadCount; ++i)
+				workers[i]->wait();
+			qint64 time = std::max(timer.nsecsElapsed(), (qint64) 1);
+
+			double minRate = std::numeric_limits<double>::infinity(), maxRate = 0;
+			size_t hits = 0;
+			bool hasStats = true;
+			Accelerator::TraversalStatistics stats;
+			for (int i=0; i<m_threadCount; ++i) {
+				RayBenchmarkWorker *worker = workers[i];
+				if (worker->getRayCount() > 0) {
+					double rate = worker->getRayCount() * 1000.0
+						/ std::max(worker->getTime(), (qint64) 1);
+					minRate = std::min(minRate, rate);
+					maxRate = std::max(maxRate, rate);
+				}
+				Accelerator::TraversalStatistics threadStats;
+				hasStats &= worker->getStatistics(threadStats);
+				stats += threadStats;
+				hits += worker->getHits();
+				delete worker;
+			}
+
+			QString line = QString("%1 %2 %3  (%4 / %5)  %6%")
+				.arg(name, -11)
+				.arg(queries[occlusion], -11)
+				.arg(rays.size() * 1000.0 / time, 8, 'f', 2)
+				.arg(minRate, 8, 'f', 2)
+				.arg(maxRate, 8, 'f', 2)
+				.arg(100.0 * hits / rays.size(), 5, 'f', 1);
+			if (hasStats) {
+				double n = (double) std::max(stats.queries, (uint64_t) 1);
+				line += QString("  %1  %2  %3")
+					.arg(stats.nodes / n, 9, 'f', 2)
+					.arg(stats.leaves / n, 10, 'f', 2)
+					.arg(stats.triangles / n, 8, 'f', 2);
+			}
+			cout << qPrintable(line) << endl;
+		}
+	}
+
+	/// Trace a ray set on all threads and return the elapsed time in nanoseconds
+	qint64 traceTime(const Accelerator *accel, const std::vector<Ray3f> &rays,
+			bool occlusion, size_t &hits) const {
+		std::vector<RayBenchmarkWorker *> workers(m_threadCount);
+		for (int i=0; i<m_threadCount; ++i)
+			workers[i] = new RayBenchmarkWorker(accel, rays, rays.size() * i / m_threadCount,
+				rays.size() * (i + 1) / m_threadCount, occlusion);
+
+		QElapsedTimer timer;
+		timer.start();
+		for (int i=0; i<m_threadCount; ++i)
+			workers[i]->start();
+		for (int i=0; i<m_threadCount; ++i)
+			workers[i]->wait();
+		qint64 time = std::max(timer.nsecsElapsed(), (qint64) 1);
+
+		hits = 0;
+		for (int i=0; i<m_threadCount; ++i) {
+			hits += workers[i]->getHits();
+			delete workers[i];
+		}
+		return time;
+	}
+
+	/**
+	 * \brief Build a kd-tree over the meshes of the scene with the given
+	 * parameters (see \ref tune()), trace the ray sets twice, and return
+	 * the best throughput in Mrays/s
+	 */
+	double measure(const Scene *scene, const std::vector<float> &params,
+			const std::vector<Ray3f> &primary, const std::vector<Ray3f> &ao,
+			const std::vector<Ray3f> &incoherent, size_t &hits) const {
+		KDTree kdtree;
+		scene->configureKDTree(&kdtree);
+		kdtree.setOwnsMeshes(false);
+		kdtree.setTraversalCost(params[0]);
+		kdtree.setEmptySpaceBonus(params[1]);
+		kdtree.setStopPrims((uint32_t) params[2]);
+		kdtree.setMaxBadRefines((uint32_t) params[3]);
+		kdtree.setExactPrimitiveThreshold((uint32_t) params[4]);
+		const std::vector<Mesh *> &meshes = scene->getMeshes();
+		for (size_t i=0; i<meshes.size(); ++i)
+			kdtree.addMesh(meshes[i]);
+		kdtree.build();
+
+		qint64 best = std::numeric_limits<qint64>::max();
+		for (int k=0; k<2; ++k) {
+			size_t primaryHits, aoHits, incoherentHits;
+			qint64 time = traceTime(&kdtree, primary, false, primaryHits)
+				+ traceTime(&kdtree, ao, true, aoHits)
+				+ traceTime(&kdtree, incoherent, false, incoherentHits);
+			best = std::min(best, time);
+			hits = primaryHits + aoHits + incoherentHits;
+		}
+		return (primary.size() + ao.size() + incoherent.size()) * 1000.0 / best;
+	}
+
+	/// Search for the kd-tree construction parameters that trace the ray sets the fastest
+	void tune(const Scene *scene, const std::vector<Ray3f> &primary,
+			const std::vector<Ray3f> &ao, const std::vector<Ray3f> &incoherent) const {
+		const std::vector<Mesh *> &meshes = scene->getMeshes();
+		if (!scene->getInstances().empty())
+			throw NoriException("RayBenchmark: scenes with instances can't be tuned!");
+		for (size_t i=0; i<meshes.size(); ++i) {
+			if (meshes[i]->isProcedural())
+				throw NoriException("RayBenchmark: scenes with procedural meshes can't be tuned!");
+		}
+
+		/* The heuristic only depends on the ratio of the traversal and query
+		   costs, hence the latter stays fixed */
+		const int paramCount = 5;
+		const char *names[paramCount] = { "kdTraversalCost", "kdEmptySpaceBonus",
+			"kdStopPrims", "kdMaxBadRefines", "kdExactPrimThreshold" };
+		const char *types[paramCount] = { "float", "float", "integer", "integer", "integer" };
+		const float grid[paramCount][7] = {
+			{ 5, 8, 10, 12, 15, 20, 30 },
+			{ 0.5f, 0.6f, 0.7f, 0.8f, 0.85f, 0.9f, 1.0f },
+			{ 1, 2, 3, 4, 6, 8, 12 },
+			{ 0, 1, 2, 3, 4, 6, 8 },
+			{ 0, 4096, 16384, 65536, 262144, 1048576, 4194304 }
+		};
+
+		KDTree defaults;
+		scene->configureKDTree(&defaults);
+		std::vector<float> params(paramCount);
+		params[0] = defaults.getTraversalCost();
+		params[1] = defaults.getEmptySpaceBonus();
+		params[2] = (float) defaults.getStopPrims();
+		params[3] = (float) defaults.getMaxBadRefines();
+		params[4] = (float) std::min(defaults.getExactPrimitiveThreshold(),
+			(uint32_t) 16777216);
+
+		cout << "Tuning the kd-tree construction parameters of \"" << qPrintable(m_filename)
+			 << "\" (" << m_tuneRounds << " rounds, " << m_rayCount << " rays per set, "
+			 << m_threadCount << " threads) .." << endl;
+
+		std::map<std::vector<float>, double> results;
+		size_t referenceHits = 0;
+		double initial = measure(scene, params, primary, ao, incoherent, referenceHits);
+		results[params] = initial;
+		double best = initial;
+
+		for (int round=0; round<m_tuneRounds; ++round) {
+			bool improved = false;
+			for (int p=0; p<paramCount; ++p) {
+				for (int j=0; j<7; ++j) {
+					std::vector<float> candidate(params);
+					candidate[p] = grid[p][j];
+					if (results.find(candidate) != results.end())
+						continue;
+
+					size_t hits = 0;
+					double rate = measure(scene, candidate, primary, ao, incoherent, hits);
+					results[candidate] = rate;
+					if (hits != referenceHits)
+						cout << "Warning: a tree with " << names[p] << "=" << qPrintable(
+							QString::number(grid[p][j], 'g', 8))
+							 << " reported " << hits << " instead of " << referenceHits
+							 << " hits!" << endl;
+
+					QString line;
+					for (int k=0; k<paramCount; ++k)
+						line += QString("%1=%2 ").arg(names[k]).arg(candidate[k], 0, 'g', 8);
+					cout << qPrintable(line) << ": " << qPrintable(QString::number(rate, 'f', 2))
+						 << " Mrays/s" << endl;
+					if (rate > best) {
+						best = rate;
+						params = candidate;
+						improved = true;
+					}
+				}
+			}
+			if (!improved)
+				break;
+		}
+
+		cout << endl << "Best parameters (" << qPrintable(QString::number(best, 'f', 2))
+			 << " Mrays/s, " << qPrintable(QString::number(100.0 * (best / initial - 1.0), 'f', 1))
+			 << "% faster than the scene's settings):" << endl
+			 << "<float name=\"kdQueryCost\" value=\"" << defaults.getQueryCost() << "\"/>" << endl;
+		for (int p=0; p<paramCount; ++p)
+			cout << "<" << types[p] << " name=\"" << names[p] << "\" value=\""
+				 << qPrintable(QString::number(params[p], 'g', 8)) << "\"/>" << endl;
+	}
+private:
+	QString m_filename;
+	int m_rayCount;
+	int m_seed;
+	float m_aoDistance;
+	int m_threadCount;
+	QString m_accelTypes;
+	bool m_tune;
+	int m_tuneRounds;
+};
+
+NORI_REGISTER_CLASS(RayBenchmark, "raybench");
+NORI_NAMESPACE_END
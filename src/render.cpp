@@ -0,0 +1,910 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/render.h>
+#include <nori/rendercache.h>
+#include <nori/film.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/rfilter.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+#include <nori/profiler.h>
+
+NORI_NAMESPACE_BEGIN
+
+RenderJob::RenderJob(const Scene *scene, const Camera *camera,
+		uint32_t sampleCount, const Point2i &offset, const Vector2i &size)
+	: m_scene(scene), m_camera(camera), m_sampleCount(sampleCount),
+	  m_tileIndex(0), m_tileCount(1), m_checkpointInterval(0), m_resume(false), m_cache(NULL), m_samplesPerPass(0), m_cancelled(false), m_output(NULL), m_splats(NULL), m_film(NULL), m_blockGenerator(NULL), m_engine(NULL), m_finished(false), m_users(0),
+	  m_renderTime(0), m_rayCount(0), m_shadowRayCount(0) {
+	if (!m_camera)
+		m_camera = scene->getCamera();
+	if (m_sampleCount == 0)
+		m_sampleCount = (uint32_t) scene->getSampler()->getSampleCount();
+
+	m_offset = offset;
+	m_size = size;
+	if (m_size.x() == 0 || m_size.y() == 0)
+		m_size = m_camera->getOutputSize() - offset;
+	if ((m_size.array() <= 0).any())
+		throw NoriException("RenderJob: the requested region is empty!");
+}
+
+void RenderJob::allocateOutput() {
+	/* Allocate memory for the rendered region, unless it is streamed to a file */
+	if (m_film || m_output)
+		return;
+	m_output = new ImageBlock(m_size, m_camera->getReconstructionFilter());
+	m_output->setOffset(m_offset);
+	m_output->setAOVs(m_scene->getAOVs() != 0 || m_scene->getDenoise());
+	m_output->clear();
+
+	if (m_scene->getIntegrator()->usesSplatting()) {
+		m_splats = new ImageBlock(m_size, m_camera->getReconstructionFilter());
+		m_splats->setOffset(m_offset);
+		m_splats->clear();
+	}
+}
+
+void RenderJob::setTileRange(int index, int count) {
+	if (count < 1 || index < 0 || index >= count)
+		throw NoriException(QString("Invalid tile range %1/%2").arg(index).arg(count));
+	if (m_film && count > 1)
+		throw NoriException("Streaming output can't be combined with a tile range");
+	if (m_cache && count > 1)
+		throw NoriException("A render cache can't be combined with a tile range");
+	m_tileIndex = index;
+	m_tileCount = count;
+}
+
+void RenderJob::setStreamingOutput(const QString &filename, const BitmapSaveOptions &options) {
+	if (m_engine || m_film)
+		throw NoriException("RenderJob::setStreamingOutput(): must be called once, before submitting the job!");
+	if (m_tileCount > 1)
+		throw NoriException("Streaming output can't be combined with a tile range");
+	if (m_cache)
+		throw NoriException("Streaming output can't be combined with a render cache");
+	if (!m_checkpointFilename.isEmpty())
+		throw NoriException("Streaming output can't be combined with checkpoints");
+	if (m_scene->getSamplesPerPass() > 0 || m_scene->getSampler()->getTargetError() > 0
+			|| m_scene->getIntegrator()->usesPasses())
+		throw NoriException("Streaming output doesn't support progressive or adaptive rendering");
+	if (m_scene->getIntegrator()->usesSplatting())
+		throw NoriException("Streaming output doesn't support integrators that splat (e.g. light tracing)");
+	if (m_camera->getReconstructionFilter()->isDeferred())
+		throw NoriException("Streaming output doesn't support deferred filtering");
+
+	/* The blocks are accumulated in the tiles of the file instead. An 
+	   empty image block provides the border size of the camera's filter */
+	ImageBlock empty(Vector2i(0, 0), m_camera->getReconstructionFilter());
+	m_film = new StreamingFilm(filename, m_size, m_offset,
+		empty.getBorderSize(), options);
+}
+
+void RenderJob::setCheckpoint(const QString &filename, float interval, bool resume) {
+	if (m_engine)
+		throw NoriException("RenderJob::setCheckpoint(): must be called before submitting the job!");
+	if (m_film)
+		throw NoriException("Streaming output can't be combined with checkpoints");
+	if (m_cache)
+		throw NoriException("A render cache can't be combined with checkpoints");
+	m_checkpointFilename = filename;
+	m_checkpointInterval = interval;
+	m_resume = resume;
+}
+
+void RenderJob::setRenderCache(const QString &filename) {
+	if (m_engine || m_cache)
+		throw NoriException("RenderJob::setRenderCache(): must be called once, before submitting the job!");
+	if (m_film)
+		throw NoriException("Streaming output can't be combined with a render cache");
+	if (m_tileCount > 1)
+		throw NoriException("A render cache can't be combined with a tile range");
+	if (!m_checkpointFilename.isEmpty())
+		throw NoriException("A render cache can't be combined with checkpoints");
+	const Integrator *integrator = m_scene->getIntegrator();
+	if (integrator->usesSplatting() || integrator->usesPasses())
+		throw NoriException("A render cache doesn't support integrators that splat "
+			"or that render in passes");
+	if (m_camera->getReconstructionFilter()->isDeferred())
+		throw NoriException("A render cache doesn't support deferred filtering");
+	if (m_scene->getAOVs() != 0 || m_scene->getDenoise())
+		throw NoriException("A render cache doesn't support AOVs or denoising");
+	m_cache = new RenderCache(m_scene, m_camera, filename, m_offset, m_size, m_sampleCount);
+}
+
+void RenderJob::setProgressive(uint32_t samplesPerPass) {
+	if (m_engine)
+		throw NoriException("RenderJob::setProgressive(): must be called before submitting the job!");
+	if (m_film)
+		throw NoriException("Streaming output doesn't support progressive rendering");
+	m_samplesPerPass = samplesPerPass;
+}
+
+void RenderJob::cancel() {
+	if (!m_engine)
+		throw NoriException("RenderJob::cancel(): the job was never submitted!");
+
+	/* Jobs that weren't picked up yet are stopped once they start */
+	QMutexLocker locker(&m_engine->m_mutex);
+	m_cancelled = true;
+	if (m_blockGenerator)
+		m_blockGenerator->stop();
+}
+
+RenderJob::~RenderJob() {
+	delete m_blockGenerator;
+	delete m_cache;
+	delete m_output;
+	delete m_splats;
+	delete m_film;
+}
+
+void RenderJob::start(int threadCount) {
+	/* Choose the block size. In progressive mode, each block is
+	   visited once per pass with fewer samples */
+	Vector2i size = m_size;
+	uint32_t samplesPerPass = m_samplesPerPass > 0 ? m_samplesPerPass
+		: m_scene->getSamplesPerPass();
+
+	/* Adaptive sampling proceeds in passes; by default, the first one 
+	   takes a quarter of the average budget */
+	const Sampler *sampler = m_scene->getSampler();
+	float targetError = sampler->getTargetError();
+	if (targetError > 0 && samplesPerPass == 0)
+		samplesPerPass = std::max(m_sampleCount / 4, 2u);
+	if (targetError > 0 && m_splats)
+		cerr << "Warning: adaptive sampling gives the pixels different sample counts, "
+			 "which biases the contributions splatted by the integrator!" << endl;
+
+	/* A time budget is spent in passes; many small ones fit it closely */
+	if (m_scene->getTimeBudget() > 0 && samplesPerPass == 0)
+		samplesPerPass = std::max(m_sampleCount / 16, 1u);
+
+	/* Checkpoints are written between passes. Use at least a few of them */
+	if (!m_checkpointFilename.isEmpty() && samplesPerPass == 0)
+		samplesPerPass = std::max(m_sampleCount / 4, 1u);
+
+	/* Integrators that prepare every pass (e.g. progressive photon
+	   mapping) take one sample per pixel and pass by default */
+	Integrator *integrator = const_cast<Integrator *>(m_scene->getIntegrator());
+	if (integrator->usesPasses() && samplesPerPass == 0)
+		samplesPerPass = 1;
+
+	int blockSize = m_scene->getBlockSize();
+	if (blockSize == 0)
+		blockSize = BlockGenerator::autoBlockSize(size, threadCount,
+			samplesPerPass > 0 ? std::min(samplesPerPass, m_sampleCount) : m_sampleCount);
+	cout << "Rendering using " << threadCount << " threads and blocks of "
+		 << blockSize << "x" << blockSize << " pixels" << endl;
+
+	m_blockGenerator = new BlockGenerator(size, blockSize,
+		m_sampleCount, m_offset, m_scene->getBlockOrder());
+	m_blockGenerator->setRunLength(m_scene->getBlockRunLength());
+	if (m_tileCount > 1)
+		m_blockGenerator->selectTiles(m_tileIndex, m_tileCount);
+	if (m_cache && m_cache->load(m_output))
+		m_blockGenerator->selectDirty(*m_cache);
+	if (samplesPerPass > 0)
+		m_blockGenerator->setProgressive(samplesPerPass,
+			m_scene->getTimeLimit(), m_scene->getTargetNoise());
+	if (targetError > 0)
+		m_blockGenerator->setAdaptive(targetError, (uint32_t) std::max(
+			(size_t) m_sampleCount, sampler->getMaxSampleCount()));
+	if (samplesPerPass > 0)
+		m_blockGenerator->setTimeBudget(m_scene->getTimeBudget());
+
+	if (!m_checkpointFilename.isEmpty()) {
+		m_blockGenerator->setCheckpoint(m_output, m_checkpointFilename,
+			m_checkpointInterval, sampler->getSeed());
+		if (m_resume && !m_blockGenerator->resume())
+			cout << "No checkpoint found, starting from scratch" << endl;
+	}
+
+	/* Cache the first hits of the camera rays for the following samples
+	   and passes, which is only worthwhile when the rays repeat */
+	if (m_scene->getPrimaryHitCache() && !integrator->isWavefront()
+			&& !m_camera->hasMotionBlur()) {
+		m_primaryHits.resize((size_t) m_size.x() * m_size.y());
+		if (m_scene->getPixelJitter())
+			cerr << "Warning: the primary hit cache is only effective when the "
+				"pixel samples aren't jittered (pixelJitter = false)" << endl;
+	}
+
+	if (integrator->usesPasses()) {
+		integrator->preprocess(m_scene, m_blockGenerator->getPass());
+		m_blockGenerator->setPreprocess(integrator, m_scene);
+	}
+	if (m_cancelled)
+		m_blockGenerator->stop();
+
+	m_nodeSamples.resize(getNodeCount(), 0);
+	if (PagedMemory::getInstance()->hasRegions())
+		m_pagingStart = PagedMemory::getInstance()->getStatistics();
+	if (VolumeCache::getInstance()->isUsed())
+		m_volumeCacheStart = VolumeCache::getInstance()->getStatistics();
+	m_timer.start();
+}
+
+void RenderJob::addSamples(int node, uint64_t sampleCount) {
+	QMutexLocker locker(&m_statsMutex);
+	m_nodeSamples[node] += sampleCount;
+}
+
+uint64_t RenderJob::getSampleCount() const {
+	QMutexLocker locker(&m_statsMutex);
+	uint64_t sampleCount = 0;
+	for (size_t i=0; i<m_nodeSamples.size(); ++i)
+		sampleCount += m_nodeSamples[i];
+	return sampleCount;
+}
+
+RenderJob::Status RenderJob::getStatus() const {
+	Status status;
+	memset(&status, 0, sizeof(Status));
+	status.remainingTime = -1;
+	status.totalSampleCount = (uint64_t) m_size.x() * m_size.y() 
+		* m_sampleCount / m_tileCount;
+
+	/* The block generator is created when the first worker picks up the
+	   job, and lives as long as the job */
+	BlockGenerator *blockGenerator = NULL;
+	if (m_engine) {
+		QMutexLocker locker(&m_engine->m_mutex);
+		blockGenerator = m_blockGenerator;
+		status.finished = m_finished;
+	}
+	if (!blockGenerator)
+		return status;
+
+	BlockGenerator::Progress progress = blockGenerator->getProgress();
+	status.started = true;
+	status.pass = progress.pass;
+	status.passCount = progress.passCount;
+	status.finishedBlocks = progress.finishedBlocks;
+	status.remainingBlocks = progress.remainingBlocks;
+
+	{
+		QMutexLocker locker(&m_statsMutex);
+		for (size_t i=0; i<m_nodeSamples.size(); ++i)
+			status.sampleCount += m_nodeSamples[i];
+		status.rayCount = m_rayCount;
+		status.shadowRayCount = m_shadowRayCount;
+		status.elapsed = status.finished ? m_renderTime : m_timer.elapsed();
+	}
+
+	if (status.finished || progress.done) {
+		status.remainingTime = 0;
+	} else if (status.sampleCount > 0) {
+		float progressFraction = status.getProgress();
+		status.remainingTime = status.elapsed * 1e-3f 
+			* (1 - progressFraction) / progressFraction;
+		if (progress.timeLimit > 0)
+			status.remainingTime = std::min(status.remainingTime,
+				std::max(progress.timeLimit - progress.elapsed, (qint64) 0) * 1e-3f);
+	}
+	return status;
+}
+
+void RenderJob::addRays(uint64_t rayCount, uint64_t shadowRayCount) {
+	QMutexLocker locker(&m_statsMutex);
+	m_rayCount += rayCount;
+	m_shadowRayCount += shadowRayCount;
+}
+
+void RenderJob::addTraversalStatistics(const Accelerator::TraversalStatistics &stats) {
+	QMutexLocker locker(&m_statsMutex);
+	m_traversal += stats;
+}
+
+void RenderJob::addPathStatistics(const PathStatistics &stats) {
+	QMutexLocker locker(&m_statsMutex);
+	m_pathStats += stats;
+}
+
+void RenderJob::put(ImageBlock &block) {
+	if (m_film)
+		m_film->put(block);
+	else
+		m_output->put(block);
+}
+
+void RenderJob::addSplats() {
+	if (!m_splats)
+		return;
+
+	/* The light paths were started on behalf of the pixels of this job,
+	   but they are spread over the camera's whole image */
+	const Vector2i &imageSize = m_camera->getOutputSize();
+	float renderedPixels = (float) m_size.x() * m_size.y() / m_tileCount;
+	m_output->addSplats(*m_splats, imageSize.x() * imageSize.y() / renderedPixels);
+}
+
+bool RenderJob::isFinished() const {
+	if (!m_engine)
+		return false;
+	QMutexLocker locker(&m_engine->m_mutex);
+	return m_finished && m_users == 0;
+}
+
+void RenderJob::wait() {
+	if (!m_engine)
+		throw NoriException("RenderJob::wait(): the job was never submitted!");
+	QMutexLocker locker(&m_engine->m_mutex);
+	while (!m_finished || m_users > 0)
+		m_engine->m_finishCond.wait(&m_engine->m_mutex);
+}
+
+RenderEngine::RenderEngine(int threadCount, bool pinThreads) : m_shutdown(false) {
+	if (threadCount <= 0)
+		threadCount = getCoreCount();
+
+	/* Optionally pin the threads to cores, filling one NUMA node after the other */
+	std::vector<std::pair<int, int> > placement;
+	if (pinThreads) {
+		for (int node=0; node<getNodeCount(); ++node) {
+			std::vector<int> cores = getNodeCores(node);
+			for (size_t i=0; i<cores.size(); ++i)
+				placement.push_back(std::make_pair(cores[i], node));
+		}
+	}
+
+	for (int i=0; i<threadCount; ++i) {
+		int core = -1, node = 0;
+		if (!placement.empty()) {
+			core = placement[i % placement.size()].first;
+			node = placement[i % placement.size()].second;
+		}
+		RenderWorker *worker = new RenderWorker(this, core, node);
+		worker->start();
+		m_workers.push_back(worker);
+	}
+}
+
+RenderEngine::~RenderEngine() {
+	m_mutex.lock();
+	m_shutdown = true;
+	m_jobCond.wakeAll();
+	m_mutex.unlock();
+
+	for (size_t i=0; i<m_workers.size(); ++i) {
+		m_workers[i]->wait();
+		delete m_workers[i];
+	}
+}
+
+void RenderEngine::submit(RenderJob *job) {
+	QMutexLocker locker(&m_mutex);
+	if (job->m_engine)
+		throw NoriException("RenderEngine::submit(): the job was already submitted!");
+	job->m_engine = this;
+	job->allocateOutput();
+	m_jobs.push_back(job);
+	m_jobCond.wakeAll();
+}
+
+bool RenderEngine::getJobs(std::vector<RenderJob *> &jobs) {
+	ProfiledMutexLocker locker(&m_mutex, "Wait for render engine");
+	while (m_jobs.empty() && !m_shutdown)
+		m_jobCond.wait(&m_mutex);
+
+	if (m_jobs.empty())
+		return false;
+
+	jobs.clear();
+	for (size_t i=0; i<m_jobs.size(); ++i) {
+		/* Integrators that prepare every pass replace state that is
+		   shared by all jobs of their scene, so such jobs run alone */
+		if (i > 0 && (m_jobs[0]->m_scene->getIntegrator()->usesPasses() ||
+				m_jobs[i]->m_scene->getIntegrator()->usesPasses()))
+			break;
+		if (!m_jobs[i]->m_blockGenerator)
+			m_jobs[i]->start(getThreadCount());
+		m_jobs[i]->m_users++;
+		jobs.push_back(m_jobs[i]);
+	}
+	return true;
+}
+
+void RenderEngine::releaseJobs(const std::vector<RenderJob *> &jobs) {
+	ProfiledMutexLocker locker(&m_mutex, "Wait for render engine");
+	for (size_t i=0; i<jobs.size(); ++i) {
+		if (--jobs[i]->m_users == 0 && jobs[i]->m_finished)
+			m_finishCond.wakeAll();
+	}
+}
+
+void RenderEngine::finished(RenderJob *job) {
+	QMutexLocker locker(&m_mutex);
+	if (job->m_finished)
+		return;
+
+	/* Report the throughput of each NUMA node */
+	job->m_renderTime = job->m_timer.elapsed();
+	float seconds = std::max(job->m_renderTime, (qint64) 1) / 1000.0f;
+	if (job->m_nodeSamples.size() > 1) {
+		for (size_t i=0; i<job->m_nodeSamples.size(); ++i)
+			cout << "NUMA node " << i << ": " << job->m_nodeSamples[i] / seconds / 1e6f
+				 << " M samples/s" << endl;
+	}
+	if (job->m_rayCount > 0)
+		cout << "Traced " << job->m_rayCount / 1e6f << " M rays and "
+			 << job->m_shadowRayCount / 1e6f << " M shadow rays ("
+			 << (job->m_rayCount + job->m_shadowRayCount) / seconds / 1e6f
+			 << " M rays/s)" << endl;
+	if (job->m_traversal.queries > 0)
+		cout << "Traversal: " << qPrintable(job->m_traversal.toString()) << endl;
+	if (job->m_pathStats.samples > 0)
+		cout << qPrintable(job->m_pathStats.toString(job->m_rayCount
+			+ job->m_shadowRayCount)) << endl;
+
+	/* Report the working set of memory-mapped geometry */
+	if (PagedMemory::getInstance()->hasRegions())
+		cout << qPrintable(PagedMemory::toString(job->m_pagingStart,
+			PagedMemory::getInstance()->getStatistics(), seconds)) << endl;
+	if (VolumeCache::getInstance()->isUsed())
+		cout << qPrintable(VolumeCache::toString(job->m_volumeCacheStart,
+			VolumeCache::getInstance()->getStatistics())) << endl;
+
+	job->addSplats();
+	if (job->m_cache && !job->m_cancelled)
+		job->m_cache->save(job->m_output);
+	job->m_finished = true;
+	m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), job));
+}
+
+Sampler *RenderEngine::cloneSampler(Sampler *sampler) {
+	QMutexLocker locker(&m_mutex);
+	return sampler->clone();
+}
+
+RenderWorker::RenderWorker(RenderEngine *engine, int core, int node)
+	: m_engine(engine), m_core(core), m_node(node), m_block(NULL),
+	  m_blockFilter(NULL), m_blockSize(0), m_context(NULL) {
+}
+
+RenderWorker::~RenderWorker() {
+	for (std::map<const Sampler *, Sampler *>::iterator it = m_samplers.begin();
+			it != m_samplers.end(); ++it)
+		delete it->second;
+	delete m_context;
+	delete m_block;
+}
+
+void RenderWorker::run() {
+	if (m_core >= 0 && !setThreadAffinity(std::vector<int>(1, m_core)))
+		cerr << "Warning: could not pin a render thread to core " << m_core << endl;
+	setThreadNode(m_node);
+	Profiler::getInstance()->setThreadName(m_core >= 0
+		? QString("render worker (core %1)").arg(m_core) : QString("render worker"));
+
+	try {
+		std::vector<RenderJob *> jobs;
+		while (m_engine->getJobs(jobs)) {
+			/* Work on the oldest job that has blocks available. Only
+			   take one block at a time from the others, so that the
+			   older jobs are finished first */
+			bool rendered = false;
+			for (size_t i=0; i<jobs.size() && !rendered; ++i)
+				rendered = render(jobs[i], false, i > 0);
+
+			/* Nothing available right now -- wait for the oldest job */
+			if (!rendered)
+				render(jobs[0], true, false);
+
+			m_engine->releaseJobs(jobs);
+		}
+	} catch (const NoriException &ex) {
+		cerr << "Caught a critical exception within a rendering thread: " << qPrintable(ex.getReason()) << endl;
+		exit(-1);
+	}
+}
+
+Sampler *RenderWorker::getSampler(const Scene *scene) {
+	const Sampler *prototype = scene->getSampler();
+	std::map<const Sampler *, Sampler *>::iterator it = m_samplers.find(prototype);
+	if (it != m_samplers.end())
+		return it->second;
+
+	/* Create a new sample generator for the current thread */
+	Sampler *sampler = m_engine->cloneSampler(const_cast<Sampler *>(prototype));
+	m_samplers[prototype] = sampler;
+	return sampler;
+}
+
+void RenderWorker::bindContext(RenderJob *job) {
+	Sampler *sampler = getSampler(job->m_scene);
+	if (m_context && m_context->scene == job->m_scene 
+			&& m_context->camera == job->m_camera
+			&& m_context->sampler == sampler)
+		return;
+
+	delete m_context;
+	m_context = new RenderContext(job->m_scene, sampler, job->m_camera);
+}
+
+bool RenderWorker::render(RenderJob *job, bool wait, bool single) {
+	BlockGenerator *blockGenerator = job->m_blockGenerator;
+	const ReconstructionFilter *filter = job->m_camera->getReconstructionFilter();
+
+	/* Allocate a small image block local to this thread
+	   that will be used to accumulate radiance samples */
+	if (!m_block || m_blockFilter != filter || m_blockSize < blockGenerator->getBlockSize()) {
+		delete m_block;
+		m_block = new ImageBlock(Vector2i(blockGenerator->getBlockSize()), filter);
+		m_blockFilter = filter;
+		m_blockSize = blockGenerator->getBlockSize();
+	}
+	bool aovs = job->m_output && job->m_output->hasAOVs();
+	if (m_block->hasAOVs() != aovs)
+		m_block->setAOVs(aovs);
+	bindContext(job);
+	m_context->splats = job->m_splats;
+	m_context->pathStats = job->m_scene->getPathStatistics() ? &m_pathStats : NULL;
+
+	/* Fetch blocks to be rendered from the block generator */
+	bool rendered = false;
+	uint32_t sampleCount, firstSample;
+	while (blockGenerator->next(*m_block, sampleCount, firstSample, wait,
+			single ? NULL : &m_run)) {
+		job->addSamples(m_node, renderBlock(job, *m_block, sampleCount, firstSample));
+		m_context->arena->reset();
+		rendered = true;
+
+		/* Hand the ray counts over after every block, so that the job's
+		   status reports the current throughput (and before it can finish) */
+		if (m_context->rayCount > 0 || m_context->shadowRayCount > 0) {
+			job->addRays(m_context->rayCount, m_context->shadowRayCount);
+			m_context->resetStatistics();
+		}
+		if (m_pathStats.samples > 0) {
+			job->addPathStatistics(m_pathStats);
+			m_pathStats.reset();
+		}
+		if (single)
+			break;
+	}
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	collectTraversalStatistics();
+	if (m_traversal.queries > 0) {
+		job->addTraversalStatistics(m_traversal);
+		m_traversal = Accelerator::TraversalStatistics();
+	}
+#endif
+
+	if (blockGenerator->isDone())
+		m_engine->finished(job);
+
+	return rendered;
+}
+
+Accelerator::TraversalStatistics RenderWorker::collectTraversalStatistics() {
+	Accelerator::TraversalStatistics stats;
+	m_context->scene->getAccelerator()->collectTraversalStatistics(stats);
+	m_traversal += stats;
+	return stats;
+}
+
+/**
+ * \brief Return the film position of a pixel sample
+ *
+ * The position is uniformly distributed within the pixel, unless the
+ * reconstruction filter is importance sampled: then it is distributed
+ * like the filter around the center of the pixel, and \c weight 
+ * returns the sign of the filter there (see \ref ReconstructionFilter::isSampled()).
+ * Without \c jitter, it is the center of the pixel.
+ */
+static inline Point2f samplePixel(const ReconstructionFilter *filter, const Point2i &pixel,
+		const Point2f &sample, float &weight, bool jitter) {
+	if (!jitter) {
+		weight = 1.0f;
+		return pixel.cast<float>() + Point2f(0.5f, 0.5f);
+	} else if (!filter->isSampled()) {
+		weight = 1.0f;
+		return pixel.cast<float>() + sample;
+	}
+	return pixel.cast<float>() + Point2f(0.5f, 0.5f) + filter->sampleOffset(sample, weight);
+}
+
+uint64_t RenderWorker::renderBlock(RenderJob *job, ImageBlock &block, uint32_t sampleCount,
+		uint32_t firstSample) {
+	RenderContext &context = *m_context;
+	const Integrator *integrator = context.scene->getIntegrator();
+	const Camera *camera = context.camera;
+	const ReconstructionFilter *filter = camera->getReconstructionFilter();
+	Sampler *sampler = context.sampler;
+	BlockGenerator *blockGenerator = job->m_blockGenerator;
+	Point2i offset = block.getOffset();
+	Vector2i size  = block.getSize();
+
+	/* Clear its contents */
+	block.clear();
+
+	ProfileScope scope("Render block", "render");
+	if (scope.isActive())
+		scope.setDetail(QString("%1x%2 pixels at (%3, %4), %5 spp").arg(size.x()).arg(size.y())
+			.arg(offset.x()).arg(offset.y()).arg(sampleCount));
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Record the meshes seen by the block for an incremental rendering */
+	if (job->m_cache) {
+		m_hits.assign(job->m_cache->getWordCount(), 0);
+		job->m_scene->setHitRecord(&m_hits);
+	}
+
+	/* Measure the time of every sample if the scene requests it as an AOV */
+	bool timeAOV = block.hasAOVs() && (job->m_scene->getAOVs() & EAOVRenderTime);
+
+	if (integrator->isWavefront()) {
+		uint64_t rendered = renderBatched(job, block, sampleCount, firstSample);
+		qint64 nsecs = timer.nsecsElapsed();
+		if (timeAOV && rendered > 0)
+			block.putAOVBlockTime(nsecs / (float) rendered);
+		recordHits(job, block);
+		job->put(block);
+		blockGenerator->finished((int) rendered, nsecs);
+		return rendered;
+	}
+
+	/* Time budget of the block, beyond which the remaining
+	   rows are handed to other threads as smaller blocks */
+	qint64 budget = (qint64) (NORI_BLOCK_SPLIT_FACTOR * size.x() * size.y()
+		* sampleCount * blockGenerator->getMedianSampleTime());
+
+	/* Let the integrator describe the first surface hit if AOVs are requested */
+	AOVRecord aov;
+	context.aov = block.hasAOVs() ? &aov : NULL;
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	/* Don't attribute earlier queries (e.g. of another block) to the first sample */
+	collectTraversalStatistics();
+#endif
+
+	/* The footprint of a sample shrinks with the number of samples per pixel */
+	float differentialScale = 1.0f / std::sqrt((float) std::max((size_t) 1,
+		sampler->getSampleCount()));
+	bool jitter = job->m_scene->getPixelJitter();
+
+	/* Let the camera rays of a pinhole camera start their traversal at 
+	   the leaf that contains it (samples of an importance sampled filter
+	   can lie up to its radius outside of the block) */
+	const Accelerator::CameraRaySeed *cameraSeed = NULL;
+	if (job->m_scene->getSeedCameraRays()) {
+		float margin = filter->isSampled() ? filter->getRadius() : 0.0f;
+		Point2f min(offset.x() - margin, offset.y() - margin),
+		        max(offset.x() + size.x() + margin, offset.y() + size.y() + margin);
+		Point3f origin;
+		Vector3f corners[4];
+		if (camera->getFrustum(min, max, origin, corners)
+				&& job->m_scene->prepareCameraRays(origin, corners, m_cameraSeed))
+			cameraSeed = &m_cameraSeed;
+	}
+
+	/* For each pixel and pixel sample sample */
+	uint64_t rendered = 0;
+	int y = 0;
+	while (y < size.y()) {
+		for (int x=0; x<size.x(); ++x) {
+			Point2i pixel(x + offset.x(), y + offset.y());
+			if (blockGenerator->isConverged(pixel))
+				continue;
+
+			/* Samples of an importance sampled filter are recorded at the pixel center */
+			Point2f center = pixel.cast<float>() + Point2f(0.5f, 0.5f);
+
+			/* Cached first hit of the pixel's camera ray (if enabled) */
+			PrimaryHit *primaryHit = job->m_primaryHits.empty() ? NULL
+				: &job->m_primaryHits[(pixel.y() - job->m_offset.y()) * job->m_size.x()
+					+ pixel.x() - job->m_offset.x()];
+
+			sampler->generate(pixel, firstSample);
+			for (uint32_t i=0; i<sampleCount; ++i) {
+				qint64 sampleStart = timeAOV ? timer.nsecsElapsed() : 0;
+				float filterWeight;
+				Point2f pixelSample = samplePixel(filter, pixel, sampler->next2D(), filterWeight, jitter);
+				Point2f apertureSample = sampler->next2D();
+
+				/* Sample a ray from the camera */
+				Ray3f ray;
+				Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+				ray.scaleDifferentials(differentialScale);
+				if (camera->hasMotionBlur())
+					ray.time = camera->sampleTime(sampler->next1D());
+
+				/* Compute the incident radiance */
+				if (context.aov)
+					aov.clear();
+				context.pixel = pixelSample;
+				context.pixelIndex = pixel;
+				context.primaryHit = primaryHit;
+				context.cameraSeed = cameraSeed;
+				if (context.pathStats)
+					context.pathStats->beginSample();
+				value *= integrator->Li(context, ray);
+				if (context.pathStats)
+					context.pathStats->endSample();
+#if defined(NORI_TRAVERSAL_STATISTICS)
+				if (context.aov)
+					aov.cost = (float) collectTraversalStatistics().getCost();
+#endif
+				if (timeAOV)
+					aov.time = (float) (timer.nsecsElapsed() - sampleStart);
+
+				/* Store in the image block */
+				const Point2f &filmPosition = filter->isSampled() ? center : pixelSample;
+				block.put(filmPosition, value, filterWeight);
+				if (context.aov)
+					block.putAOV(filmPosition, value, aov);
+				blockGenerator->recordSample(filmPosition, value * filterWeight);
+				sampler->advance();
+			}
+			rendered += sampleCount;
+		}
+
+		/* Stop early when the job was cancelled */
+		if (++y < size.y() && blockGenerator->isStopped()) {
+			block.setSize(Point2i(size.x(), y));
+			break;
+		}
+
+		/* Unusually expensive block (e.g. caustics)? Let other threads
+		   help with the rest instead of rendering it alone */
+		if (y < size.y() && budget > 0 && timer.nsecsElapsed() > budget) {
+			blockGenerator->split(Point2i(offset.x(), offset.y() + y),
+				Vector2i(size.x(), size.y() - y), sampleCount);
+			block.setSize(Point2i(size.x(), y));
+			break;
+		}
+	}
+
+	context.aov = NULL;
+	context.primaryHit = NULL;
+	context.cameraSeed = NULL;
+
+	/* The image block has been processed. Now add it to the "big"
+	   block that represents the entire image */
+	qint64 nsecs = timer.nsecsElapsed();
+	if (timeAOV && rendered > 0)
+		block.putAOVBlockTime(nsecs / (float) rendered);
+	recordHits(job, block);
+	job->put(block);
+	blockGenerator->finished((int) rendered, nsecs);
+	return rendered;
+}
+
+void RenderWorker::recordHits(RenderJob *job, const ImageBlock &block) {
+	if (!job->m_cache)
+		return;
+	job->m_scene->setHitRecord(NULL);
+	job->m_cache->record(block.getOffset(), block.getSize(), m_hits);
+}
+
+uint64_t RenderWorker::renderBatched(RenderJob *job, ImageBlock &block, uint32_t sampleCount,
+		uint32_t firstSample) {
+	RenderContext &context = *m_context;
+	const Camera *camera = context.camera;
+	const ReconstructionFilter *filter = camera->getReconstructionFilter();
+	Sampler *sampler = context.sampler;
+	BlockGenerator *blockGenerator = job->m_blockGenerator;
+	Point2i offset = block.getOffset();
+	Vector2i size  = block.getSize();
+
+	/* Camera samples of one pixel. Since the radiance is computed 
+	   later, the sampler only stratifies these */
+	Point2f *pixelSamples = context.arena->alloc<Point2f>(sampleCount);
+	float *filterWeights = context.arena->alloc<float>(sampleCount);
+	Point2f *apertureSamples = context.arena->alloc<Point2f>(sampleCount);
+	float *timeSamples = context.arena->alloc<float>(sampleCount);
+	float differentialScale = 1.0f / std::sqrt((float) std::max((size_t) 1,
+		sampler->getSampleCount()));
+
+	uint64_t rendered = 0;
+	for (int y=0; y<size.y(); ++y) {
+		for (int x=0; x<size.x(); ++x) {
+			Point2i pixel(x + offset.x(), y + offset.y());
+			if (blockGenerator->isConverged(pixel))
+				continue;
+
+			sampler->generate(pixel, firstSample);
+			for (uint32_t i=0; i<sampleCount; ++i) {
+				pixelSamples[i] = samplePixel(filter, pixel, sampler->next2D(), filterWeights[i],
+					job->m_scene->getPixelJitter());
+				apertureSamples[i] = sampler->next2D();
+				timeSamples[i] = camera->hasMotionBlur() ? sampler->next1D() : 0.0f;
+				sampler->advance();
+			}
+
+			/* Keep whole pixels together in a batch */
+			if (!m_rays.empty() && m_rays.size() + sampleCount > NORI_RAY_BATCH_SIZE)
+				traceBatch(job, block);
+
+			/* Sample the rays of all samples at once, but defer the radiance computation */
+			size_t start = m_rays.size();
+			m_rays.resize(start + sampleCount);
+			m_weights.resize(start + sampleCount);
+			camera->sampleRays(sampleCount, pixelSamples, apertureSamples,
+				&m_rays[start], &m_weights[start]);
+			for (uint32_t i=0; i<sampleCount; ++i) {
+				Ray3f &ray = m_rays[start + i];
+				ray.scaleDifferentials(differentialScale);
+				ray.time = camera->sampleTime(timeSamples[i]);
+				m_pixelSamples.push_back(filter->isSampled()
+					? pixel.cast<float>() + Point2f(0.5f, 0.5f) : pixelSamples[i]);
+				m_filterWeights.push_back(filterWeights[i]);
+				if (block.hasAOVs())
+					m_aovs.push_back(AOVRecord());
+			}
+			rendered += sampleCount;
+		}
+	}
+
+	if (!m_rays.empty())
+		traceBatch(job, block);
+
+	return rendered;
+}
+
+void RenderWorker::traceBatch(RenderJob *job, ImageBlock &block) {
+	const Integrator *integrator = m_context->scene->getIntegrator();
+	BlockGenerator *blockGenerator = job->m_blockGenerator;
+
+	/* Let the integrator process the whole batch at once */
+	m_values.resize(m_rays.size());
+	m_context->aov = m_aovs.empty() ? NULL : &m_aovs[0];
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	collectTraversalStatistics();
+#endif
+	bool timeAOV = !m_aovs.empty() && (job->m_scene->getAOVs() & EAOVRenderTime);
+	QElapsedTimer timer;
+	if (timeAOV)
+		timer.start();
+	integrator->Li(*m_context, &m_rays[0], &m_values[0],
+		(uint32_t) m_rays.size());
+	m_context->aov = NULL;
+
+	/* The rays are traced together, so only the average time is known as well */
+	if (timeAOV) {
+		float time = timer.nsecsElapsed() / (float) m_rays.size();
+		for (size_t j=0; j<m_aovs.size(); ++j)
+			m_aovs[j].time = time;
+	}
+
+#if defined(NORI_TRAVERSAL_STATISTICS)
+	/* The rays are traced together, so only the average cost is known */
+	float cost = (float) collectTraversalStatistics().getCost() / m_rays.size();
+	for (size_t j=0; j<m_aovs.size(); ++j)
+		m_aovs[j].cost = cost;
+#endif
+
+	for (size_t j=0; j<m_rays.size(); ++j) {
+		Color3f value = m_weights[j] * m_values[j];
+		block.put(m_pixelSamples[j], value, m_filterWeights[j]);
+		blockGenerator->recordSample(m_pixelSamples[j], value * m_filterWeights[j]);
+		if (!m_aovs.empty())
+			block.putAOV(m_pixelSamples[j], value, m_aovs[j]);
+	}
+
+	m_rays.clear();
+	m_aovs.clear();
+	m_pixelSamples.clear();
+	m_filterWeights.clear();
+	m_weights.clear();
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,322 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/rendercache.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <nori/instance.h>
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <boost/static_assert.hpp>
+#include <QFile>
+
+NORI_NAMESPACE_BEGIN
+
+/// Version of the render cache file format (increase when changing the layout)
+#define NORI_RENDER_CACHE_VERSION 1
+
+/**
+ * \brief Header of a file written by \ref RenderCache::save()
+ *
+ * It is followed by the material keys of the meshes (8 bytes each), the
+ * pixels of the output (including its border, 4 floats each), and the
+ * bit sets of the cells (in scanline order)
+ */
+struct RenderCacheHeader {
+	char magic[3];
+	uint8_t version;
+	int32_t offset[2];
+	int32_t size[2];
+	int32_t borderSize;
+	int32_t cellSize;
+	uint32_t meshCount;
+	uint64_t key;
+	uint8_t reserved[8];
+};
+
+BOOST_STATIC_ASSERT(sizeof(RenderCacheHeader) == 48);
+
+/// Continue a 64 bit FNV-1a hash with a buffer
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *bytes = (const uint8_t *) data;
+	for (size_t i=0; i<size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/// Continue a 64 bit FNV-1a hash with a buffer of 32 bit words (faster for large buffers)
+static uint64_t hashWords(uint64_t hash, const void *data, size_t size) {
+	const uint32_t *words = (const uint32_t *) data;
+	for (size_t i=0; i<size / sizeof(uint32_t); ++i) {
+		hash ^= words[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/// Continue a 64 bit FNV-1a hash with the description of an object
+static uint64_t hashObject(uint64_t hash, const NoriObject *object) {
+	QByteArray description = object ? object->toString().toUtf8() : QByteArray("null");
+	return hashBytes(hash, description.constData(), (size_t) description.size() + 1);
+}
+
+/// Continue a 64 bit FNV-1a hash with the geometry of a mesh
+static uint64_t hashGeometry(uint64_t hash, const Mesh *mesh) {
+	uint32_t counts[2] = { mesh->getVertexCount(), mesh->getTriangleCount() };
+	hash = hashBytes(hash, counts, sizeof(counts));
+	QByteArray name = mesh->getName().toUtf8();
+	hash = hashBytes(hash, name.constData(), (size_t) name.size() + 1);
+	if (mesh->getVertexPositions())
+		hash = hashWords(hash, mesh->getVertexPositions(), sizeof(Point3f) * counts[0]);
+	if (mesh->getVertexNormals())
+		hash = hashWords(hash, mesh->getVertexNormals(), sizeof(Normal3f) * counts[0]);
+	if (mesh->getVertexTexCoords())
+		hash = hashWords(hash, mesh->getVertexTexCoords(), sizeof(Point2f) * counts[0]);
+	if (mesh->getIndices())
+		hash = hashWords(hash, mesh->getIndices(), sizeof(uint32_t) * 3 * counts[1]);
+	return hash;
+}
+
+RenderCache::RenderCache(const Scene *scene, const Camera *camera, const QString &filename,
+		const Point2i &offset, const Vector2i &size, uint32_t sampleCount)
+		: m_filename(filename), m_offset(offset), m_size(size), m_globalKey(0) {
+	m_cellCount = Vector2i(
+		(size.x() + NORI_RENDER_CACHE_CELL_SIZE - 1) / NORI_RENDER_CACHE_CELL_SIZE,
+		(size.y() + NORI_RENDER_CACHE_CELL_SIZE - 1) / NORI_RENDER_CACHE_CELL_SIZE);
+	m_wordCount = std::max((size_t) 1, (scene->getMeshes().size() + 31) / 32);
+	m_hits.resize((size_t) m_cellCount.prod() * m_wordCount, 0);
+	computeKeys(scene, camera, sampleCount);
+}
+
+void RenderCache::computeKeys(const Scene *scene, const Camera *camera, uint32_t sampleCount) {
+	const std::vector<Mesh *> &meshes = scene->getMeshes();
+	uint64_t key = 0xcbf29ce484222325ULL;
+	uint32_t counts[2] = { sampleCount, (uint32_t) meshes.size() };
+	key = hashBytes(key, counts, sizeof(counts));
+	key = hashObject(key, scene->getIntegrator());
+	key = hashObject(key, scene->getSampler());
+	key = hashObject(key, camera);
+	key = hashObject(key, scene->getMedium());
+	key = hashObject(key, scene->getEnvironmentLuminaire());
+
+	/* Geometry and luminaires affect any part of the image (e.g. through
+	   shadows), while a material only affects the rays that hit it */
+	m_meshKeys.resize(meshes.size());
+	for (size_t i=0; i<meshes.size(); ++i) {
+		const Mesh *mesh = meshes[i];
+		key = hashGeometry(key, mesh);
+		key = hashObject(key, mesh->getLuminaire());
+
+		uint64_t meshKey = 0xcbf29ce484222325ULL;
+		meshKey = hashObject(meshKey, mesh->getBSDF());
+		meshKey = hashObject(meshKey, mesh->getInteriorMedium());
+		m_meshKeys[i] = meshKey;
+	}
+
+	/* The meshes of instances aren't recorded, hence their materials count as global */
+	const std::vector<Instance *> &instances = scene->getInstances();
+	for (size_t i=0; i<instances.size(); ++i) {
+		key = hashObject(key, instances[i]);
+		const Mesh *mesh = instances[i]->getMesh();
+		if (mesh && mesh->getID() < meshes.size() && meshes[mesh->getID()] == mesh)
+			continue;
+		key = hashGeometry(key, mesh);
+		key = hashObject(key, mesh);
+		for (int level=1; level<instances[i]->getLODCount(); ++level) {
+			key = hashGeometry(key, instances[i]->getLOD(level));
+			key = hashObject(key, instances[i]->getLOD(level));
+		}
+	}
+	m_globalKey = key;
+}
+
+void RenderCache::getCells(const Point2i &offset, const Vector2i &size,
+		Point2i &start, Point2i &end) const {
+	Point2i rel = offset - m_offset;
+	start = (rel / NORI_RENDER_CACHE_CELL_SIZE).cwiseMax(Point2i(0, 0));
+	end = ((rel + size + Point2i::Constant(NORI_RENDER_CACHE_CELL_SIZE - 1))
+		/ NORI_RENDER_CACHE_CELL_SIZE).cwiseMin(m_cellCount);
+}
+
+bool RenderCache::load(ImageBlock *output) {
+	m_dirty.clear();
+	QFile file(m_filename);
+	if (!file.exists())
+		return false;
+
+	RenderCacheHeader header;
+	if (!file.open(QIODevice::ReadOnly) ||
+		file.read((char *) &header, sizeof(RenderCacheHeader)) != sizeof(RenderCacheHeader) ||
+		memcmp(header.magic, "NRC", 3) != 0 || header.version != NORI_RENDER_CACHE_VERSION)
+		throw NoriException(QString("\"%1\" is not a render cache!").arg(m_filename));
+
+	if (Point2i(header.offset[0], header.offset[1]) != m_offset ||
+		Vector2i(header.size[0], header.size[1]) != m_size ||
+		header.borderSize != output->getBorderSize() ||
+		header.cellSize != NORI_RENDER_CACHE_CELL_SIZE ||
+		header.meshCount != m_meshKeys.size() || header.key != m_globalKey) {
+		cout << "The scene changed beyond the materials of its meshes since the "
+			"render cache was written, rendering everything" << endl;
+		return false;
+	}
+
+	std::vector<uint64_t> meshKeys(m_meshKeys.size());
+	qint64 keyBytes = sizeof(uint64_t) * meshKeys.size(),
+	       dataBytes = sizeof(Color4f) * output->rows() * output->cols(),
+	       hitBytes = sizeof(uint32_t) * m_hits.size();
+	if ((keyBytes > 0 && file.read((char *) &meshKeys[0], keyBytes) != keyBytes) ||
+		file.read((char *) output->data(), dataBytes) != dataBytes ||
+		file.read((char *) &m_hits[0], hitBytes) != hitBytes)
+		throw NoriException(QString("The render cache \"%1\" is truncated!").arg(m_filename));
+	output->markDirty();
+
+	/* Meshes whose material has changed */
+	std::vector<uint32_t> changed(m_wordCount, 0);
+	int changedCount = 0;
+	for (size_t i=0; i<meshKeys.size(); ++i) {
+		if (meshKeys[i] != m_meshKeys[i]) {
+			changed[i / 32] |= 1u << (i % 32);
+			++changedCount;
+		}
+	}
+
+	/* Cells that saw a changed mesh, and those that are close enough to
+	   have received filtered samples from them */
+	int cellCount = m_cellCount.prod(),
+	    radius = std::max(1, (output->getBorderSize() + NORI_RENDER_CACHE_CELL_SIZE - 1)
+	        / NORI_RENDER_CACHE_CELL_SIZE);
+	m_dirty.resize(cellCount, 0);
+	for (int y=0; y<m_cellCount.y(); ++y) {
+		for (int x=0; x<m_cellCount.x(); ++x) {
+			const uint32_t *hits = &m_hits[(y * m_cellCount.x() + x) * m_wordCount];
+			bool affected = false;
+			for (size_t k=0; k<m_wordCount && !affected; ++k)
+				affected = (hits[k] & changed[k]) != 0;
+			if (!affected)
+				continue;
+			for (int ny=std::max(y-radius, 0); ny<=std::min(y+radius, m_cellCount.y()-1); ++ny)
+				for (int nx=std::max(x-radius, 0); nx<=std::min(x+radius, m_cellCount.x()-1); ++nx)
+					m_dirty[ny * m_cellCount.x() + nx] = 1;
+		}
+	}
+
+	/* Clear the pixels and hits of the cells to be rendered. Cells at the
+	   edge of the region also clear the adjacent part of the border */
+	int border = output->getBorderSize(), dirtyCount = 0;
+	for (int y=0; y<m_cellCount.y(); ++y) {
+		for (int x=0; x<m_cellCount.x(); ++x) {
+			int cell = y * m_cellCount.x() + x;
+			if (!m_dirty[cell])
+				continue;
+			++dirtyCount;
+			std::fill(m_hits.begin() + cell * m_wordCount,
+				m_hits.begin() + (cell + 1) * m_wordCount, 0u);
+
+			Point2i start(x * NORI_RENDER_CACHE_CELL_SIZE + border,
+				y * NORI_RENDER_CACHE_CELL_SIZE + border);
+			Point2i end = (start + Point2i::Constant(NORI_RENDER_CACHE_CELL_SIZE))
+				.cwiseMin(m_size + Point2i::Constant(border));
+			if (x == 0) start.x() = 0;
+			if (y == 0) start.y() = 0;
+			if (x == m_cellCount.x() - 1) end.x() = m_size.x() + 2*border;
+			if (y == m_cellCount.y() - 1) end.y() = m_size.y() + 2*border;
+			output->block(start.y(), start.x(), end.y() - start.y(),
+				end.x() - start.x()).setConstant(Color4f());
+		}
+	}
+
+	cout << "Render cache: " << changedCount << " of " << meshKeys.size()
+		 << " materials changed, rendering " << dirtyCount << " of " << cellCount
+		 << " cells again" << endl;
+	return true;
+}
+
+bool RenderCache::isDirty(const Point2i &offset, const Vector2i &size) const {
+	if (m_dirty.empty())
+		return true;
+	Point2i start, end;
+	getCells(offset, size, start, end);
+	for (int y=start.y(); y<end.y(); ++y)
+		for (int x=start.x(); x<end.x(); ++x)
+			if (m_dirty[y * m_cellCount.x() + x])
+				return true;
+	return false;
+}
+
+void RenderCache::record(const Point2i &offset, const Vector2i &size,
+		const std::vector<uint32_t> &hits) {
+	Point2i start, end;
+	getCells(offset, size, start, end);
+
+	/* Cells that are partially covered by the block keep the meshes of
+	   their other samples as well */
+	QMutexLocker locker(&m_mutex);
+	for (int y=start.y(); y<end.y(); ++y) {
+		for (int x=start.x(); x<end.x(); ++x) {
+			uint32_t *target = &m_hits[(y * m_cellCount.x() + x) * m_wordCount];
+			for (size_t k=0; k<m_wordCount; ++k)
+				target[k] |= hits[k];
+		}
+	}
+}
+
+void RenderCache::save(const ImageBlock *output) {
+	RenderCacheHeader header;
+	memset(&header, 0, sizeof(RenderCacheHeader));
+	memcpy(header.magic, "NRC", 3);
+	header.version = NORI_RENDER_CACHE_VERSION;
+	for (int i=0; i<2; ++i) {
+		header.offset[i] = m_offset[i];
+		header.size[i] = m_size[i];
+	}
+	header.borderSize = output->getBorderSize();
+	header.cellSize = NORI_RENDER_CACHE_CELL_SIZE;
+	header.meshCount = (uint32_t) m_meshKeys.size();
+	header.key = m_globalKey;
+
+	/* Write to a temporary file first, so that a crash while writing
+	   doesn't destroy the previous cache */
+	QString tempFilename = m_filename + ".tmp";
+	QFile file(tempFilename);
+	qint64 keyBytes = sizeof(uint64_t) * m_meshKeys.size(),
+	       dataBytes = sizeof(Color4f) * output->rows() * output->cols(),
+	       hitBytes = sizeof(uint32_t) * m_hits.size();
+	bool success = file.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+		file.write((const char *) &header, sizeof(RenderCacheHeader)) == sizeof(RenderCacheHeader) &&
+		(keyBytes == 0 || file.write((const char *) &m_meshKeys[0], keyBytes) == keyBytes) &&
+		file.write((const char *) output->data(), dataBytes) == dataBytes &&
+		file.write((const char *) &m_hits[0], hitBytes) == hitBytes;
+	file.close();
+
+	if (success) {
+		QFile::remove(m_filename);
+		success = QFile::rename(tempFilename, m_filename);
+	}
+
+	if (!success)
+		cerr << "Warning: unable to write the render cache \""
+			 << qPrintable(m_filename) << "\"" << endl;
+	else
+		cout << "Wrote render cache \"" << qPrintable(m_filename) << "\"" << endl;
+}
+
+NORI_NAMESPACE_END
@@ -20,6 +20,46 @@
 
 NORI_NAMESPACE_BEGIN
 
+void ReconstructionFilter::activate() {
+	if (!m_sampled)
+		return;
+	if (m_deferred)
+		throw NoriException("A reconstruction filter can't be both deferred and sampled!");
+
+	int count = std::max(1, (int) std::ceil(2 * m_radius * NORI_FILTER_RESOLUTION));
+	float step = 2 * m_radius / count;
+	m_values.resize(count);
+	m_cdf.resize(count + 1);
+	m_cdf[0] = 0.0f;
+	for (int i=0; i<count; ++i) {
+		m_values[i] = eval(-m_radius + (i + 0.5f) * step);
+		m_cdf[i+1] = m_cdf[i] + std::abs(m_values[i]);
+	}
+	if (m_cdf[count] <= 0)
+		throw NoriException("ReconstructionFilter: can't sample a filter that is zero everywhere!");
+}
+
+float ReconstructionFilter::sampleOffset(float sample, float &weight) const {
+	/* Find the interval, and sample uniformly within it */
+	float target = sample * m_cdf.back();
+	int count = (int) m_values.size();
+	int i = (int) (std::upper_bound(m_cdf.begin() + 1, m_cdf.end(), target) - m_cdf.begin()) - 1;
+	i = std::max(0, std::min(i, count - 1));
+	float width = m_cdf[i+1] - m_cdf[i];
+	float t = width > 0 ? std::min((target - m_cdf[i]) / width, 1.0f) : 0.5f;
+	weight = m_values[i] < 0 ? -1.0f : 1.0f;
+	return m_radius * ((2 * (i + t)) / count - 1);
+}
+
+Point2f ReconstructionFilter::sampleOffset(const Point2f &sample, float &weight) const {
+	if (EXPECT_NOT_TAKEN(m_cdf.empty()))
+		throw NoriException("ReconstructionFilter::sampleOffset(): the filter isn't sampled!");
+	float weightX, weightY;
+	Point2f offset(sampleOffset(sample.x(), weightX), sampleOffset(sample.y(), weightY));
+	weight = weightX * weightY;
+	return offset;
+}
+
 /**
  * Windowed Gaussian filter with configurable extent
  * and standard deviation. Often produces pleasing 
@@ -32,6 +72,10 @@ public:
 		m_radius = propList.getFloat("radius", 2.0f);
 		/* Standard deviation of the Gaussian */
 		m_stddev = propList.getFloat("stddev", 0.5f);
+		/* Filter the finished image instead of every sample */
+		m_deferred = propList.getBoolean("deferred", false);
+		/* Distribute the samples like the filter instead */
+		m_sampled = propList.getBoolean("sampled", false);
 	}
 
 	float eval(float x) const {
@@ -42,8 +86,8 @@ public:
 	}
 
 	QString toString() const {
-		return QString("GaussianFilter[radius=%1, stddev=%2]")
-			.arg(m_radius).arg(m_stddev);
+		return QString("GaussianFilter[radius=%1, stddev=%2, deferred=%3, sampled=%4]")
+			.arg(m_radius).arg(m_stddev).arg(m_deferred).arg(m_sampled);
 	}
 protected:
 	float m_stddev;
@@ -64,6 +108,10 @@ public:
 		m_B = propList.getFloat("B", 1.0f / 3.0f);
 		/* C parameter from the paper */
 		m_C = propList.getFloat("C", 1.0f / 3.0f);
+		/* Filter the finished image instead of every sample */
+		m_deferred = propList.getBoolean("deferred", false);
+		/* Distribute the samples like the filter instead */
+		m_sampled = propList.getBoolean("sampled", false);
 	}
 
 	float eval(float x) const {
@@ -82,8 +130,8 @@ public:
 	}
 
 	QString toString() const {
-		return QString("MitchellNetravaliFilter[radius=%1, B=%2, C=%3]")
-			.arg(m_radius).arg(m_B).arg(m_C);
+		return QString("MitchellNetravaliFilter[radius=%1, B=%2, C=%3, deferred=%4, sampled=%5]")
+			.arg(m_radius).arg(m_B).arg(m_C).arg(m_deferred).arg(m_sampled);
 	}
 protected:
 	float m_B, m_C;
@@ -17,29 +17,402 @@
 */
 
 #include <nori/scene.h>
+#include <nori/kdtree.h>
+#include <nori/bvh.h>
+#include <nori/instance.h>
+#include <nori/procedural.h>
 #include <nori/bitmap.h>
 #include <nori/integrator.h>
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/medium.h>
+#include <nori/block.h>
+#include <nori/lightbvh.h>
+#include <QThread>
+#include <QElapsedTimer>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) 
-	: m_integrator(NULL), m_sampler(NULL), m_camera(NULL), m_medium(NULL) {
-	m_kdtree = new KDTree();
+Scene::Scene(const PropertyList &propList) 
+	: m_lightBVH(NULL), m_integrator(NULL), m_sampler(NULL), m_camera(NULL), m_medium(NULL),
+	  m_environment(NULL), m_activeAccel(NULL), m_previewAccel(NULL), m_accelBuild(NULL), 
+	  m_hasNullInterfaces(false), m_hasMedia(false), m_hasVolumeEmission(false),
+	  m_recordHits(false), m_adoptedGeometry(false) {
+	/* Ray intersection acceleration data structure: "kdtree", "bvh",
+	   "bvh4" (a BVH that is collapsed into a 4-wide hierarchy), or
+	   the name of a plug-in (see AcceleratorFactory) */
+	m_accelType = propList.getString("accel", "kdtree");
+	if (m_accelType != "kdtree" && m_accelType != "bvh" && m_accelType != "bvh4"
+			&& !AcceleratorFactory::isRegistered(m_accelType))
+		throw NoriException(QString("Unknown acceleration data structure "
+			"\"%1\" (must be \"kdtree\", \"bvh\", \"bvh4\"%2)").arg(m_accelType)
+			.arg(AcceleratorFactory::getNames().isEmpty() ? QString()
+				: QString(" or a plug-in: %1").arg(AcceleratorFactory::getNames())));
+	m_accelProps = propList;
+
+	/* Tree construction quality: 0 = binned (fast previews),
+	   1 = default, 2 = exact perfect-split builder throughout */
+	m_kdBuildQuality = propList.getInteger("kdBuildQuality", KDTree::EDefault);
+	if (m_kdBuildQuality < KDTree::EBinned || m_kdBuildQuality > KDTree::EExact)
+		throw NoriException(QString("Invalid kdBuildQuality value %1 "
+			"(must be 0, 1, or 2)").arg(m_kdBuildQuality));
+
+	/* Early split clipping: subdivide triangles whose bounding box has more than
+	   'kdSplitThreshold' times their area, adding at most 'kdSplitBudget' times
+	   as many references as there are triangles (disabled by default) */
+	m_kdSplitThreshold = propList.getFloat("kdSplitThreshold", 0.0f);
+	m_kdSplitBudget = propList.getFloat("kdSplitBudget", 0.5f);
+	if (m_kdSplitThreshold < 0 || m_kdSplitBudget < 0)
+		throw NoriException(QString("Invalid early split clipping parameters "
+			"(kdSplitThreshold=%1, kdSplitBudget=%2 must be >= 0)")
+			.arg(m_kdSplitThreshold).arg(m_kdSplitBudget));
+
+	/* Skip triangles that a ray has already tested in another kd-tree leaf */
+	m_kdMailboxing = propList.getBoolean("kdMailboxing", false);
+
+	/* File that collects the quality metrics of every kd-tree build (JSON lines) */
+	m_kdMetrics = propList.getString("kdMetrics", "");
+
+	/* Grid that starts occlusion queries of at most 'kdShortRayLength' times
+	   the scene diameter (e.g. ambient occlusion rays) at a subtree of the
+	   kd-tree, with 'kdShortRayResolution' cells along the longest axis */
+	m_kdShortRayLength = propList.getFloat("kdShortRayLength", 0.0f);
+	m_kdShortRayResolution = propList.getInteger("kdShortRayResolution", 64);
+	if (m_kdShortRayLength < 0 || m_kdShortRayResolution < 1 || m_kdShortRayResolution > 1024)
+		throw NoriException(QString("Invalid short ray grid parameters (kdShortRayLength=%1 "
+			"must be >= 0, kdShortRayResolution=%2 must be in [1, 1024])")
+			.arg(m_kdShortRayLength).arg(m_kdShortRayResolution));
+
+	/* Parameters of the kd-tree's surface area heuristic (see GenericKDTree),
+	   e.g. as found by the tuning mode of 'raybench'. A negative exact
+	   primitive threshold uses the one of the build quality */
+	m_kdTraversalCost = propList.getFloat("kdTraversalCost", 15.0f);
+	m_kdQueryCost = propList.getFloat("kdQueryCost", 20.0f);
+	m_kdEmptySpaceBonus = propList.getFloat("kdEmptySpaceBonus", 0.9f);
+	m_kdStopPrims = propList.getInteger("kdStopPrims", 6);
+	m_kdMaxBadRefines = propList.getInteger("kdMaxBadRefines", 3);
+	m_kdExactPrimThreshold = propList.getInteger("kdExactPrimThreshold", -1);
+	if (m_kdTraversalCost <= 0 || m_kdQueryCost <= 0 || m_kdEmptySpaceBonus <= 0 
+			|| m_kdEmptySpaceBonus > 1 || m_kdStopPrims < 1 || m_kdMaxBadRefines < 0)
+		throw NoriException(QString("Invalid kd-tree heuristic parameters "
+			"(kdTraversalCost=%1, kdQueryCost=%2 must be > 0, kdEmptySpaceBonus=%3 "
+			"must be in (0, 1], kdStopPrims=%4 must be >= 1, kdMaxBadRefines=%5 "
+			"must be >= 0)").arg(m_kdTraversalCost).arg(m_kdQueryCost)
+			.arg(m_kdEmptySpaceBonus).arg(m_kdStopPrims).arg(m_kdMaxBadRefines));
+
+	/* Limit on the temporary memory used while building the kd-tree (MiB, 0 = none) */
+	m_kdMaxBuildMemory = propList.getInteger("kdMaxBuildMemory", 0);
+	if (m_kdMaxBuildMemory < 0)
+		throw NoriException(QString("Invalid kdMaxBuildMemory value %1 "
+			"(must be >= 0)").arg(m_kdMaxBuildMemory));
+
+	/* Allowed growth of the BVH cost before refitting gives way to a rebuild */
+	m_refitThreshold = propList.getFloat("refitThreshold", 1.5f);
+	if (m_refitThreshold < 1)
+		throw NoriException(QString("Invalid refitThreshold value %1 "
+			"(must be >= 1)").arg(m_refitThreshold));
+
+	/* Edge length of the blocks used for parallel rendering (0 = automatic) */
+	m_blockSize = propList.getInteger("blockSize", NORI_BLOCK_SIZE);
+	if (m_blockSize < 0)
+		throw NoriException(QString("Invalid blockSize value %1 "
+			"(must be >= 0)").arg(m_blockSize));
+
+	/* Order of the blocks ("spiral", "scanline", "hilbert" or "morton"), and
+	   the number of consecutive blocks that a thread may reserve at once */
+	m_blockOrder = BlockGenerator::parseBlockOrder(propList.getString("blockOrder", "spiral"));
+	m_blockRunLength = propList.getInteger("blockRunLength", 1);
+	if (m_blockRunLength < 1)
+		throw NoriException(QString("Invalid blockRunLength value %1 "
+			"(must be >= 1)").arg(m_blockRunLength));
+
+	/* Jitter the samples within their pixels (disabling this aliases the
+	   edges, but lets all samples of a pixel share their camera ray), and
+	   cache the first hit of the camera ray of every pixel */
+	m_pixelJitter = propList.getBoolean("pixelJitter", true);
+	m_primaryHitCache = propList.getBoolean("primaryHitCache", false);
+
+	/* Let the camera rays of each block skip the descent to the leaf
+	   of a pinhole camera (the results are the same) */
+	m_seedCameraRays = propList.getBoolean("seedCameraRays", true);
+
+	/* Let the integrators record path depths, interactions, and
+	   the time per stage (adds some overhead, hence disabled) */
+	m_pathStatistics = propList.getBoolean("pathStatistics", false);
+
+	/* Progressive rendering: samples per pixel and pass (0 = disabled), and 
+	   the time limit (seconds) and relative noise level at which to stop */
+	int samplesPerPass = propList.getInteger("samplesPerPass", 0);
+	m_timeLimit = propList.getFloat("timeLimit", 0.0f);
+	m_targetNoise = propList.getFloat("targetNoise", 0.0f);
+	if (samplesPerPass < 0 || m_timeLimit < 0 || m_targetNoise < 0)
+		throw NoriException(QString("Invalid progressive rendering parameters "
+			"(samplesPerPass=%1, timeLimit=%2, targetNoise=%3 must be >= 0)")
+			.arg(samplesPerPass).arg(m_timeLimit).arg(m_targetNoise));
+	if (samplesPerPass == 0 && (m_timeLimit > 0 || m_targetNoise > 0))
+		throw NoriException("The timeLimit and targetNoise parameters "
+			"require progressive rendering (samplesPerPass > 0)");
+	m_samplesPerPass = (uint32_t) samplesPerPass;
+
+	/* Wall-clock budget in seconds, which chooses the number of passes
+	   (the sample count becomes an upper bound, 0 = disabled) */
+	m_timeBudget = propList.getFloat("timeBudget", 0.0f);
+	if (m_timeBudget < 0)
+		throw NoriException(QString("Invalid timeBudget value %1 "
+			"(must be >= 0)").arg(m_timeBudget));
+
+	/* Save the state of a progressive rendering every so many seconds (0 = never) */
+	m_checkpointInterval = propList.getFloat("checkpointInterval", 0.0f);
+	if (m_checkpointInterval < 0)
+		throw NoriException(QString("Invalid checkpointInterval value %1 "
+			"(must be >= 0)").arg(m_checkpointInterval));
+
+	/* Pin render threads to cores, and keep one copy of the acceleration
+	   data structure per NUMA node (both disabled by default). Threads 
+	   are only assigned to nodes when they are pinned */
+	m_pinThreads = propList.getBoolean("pinThreads", false);
+	m_replicateAccel = propList.getBoolean("replicateAccel", false);
+
+	/* Turn meshes that load the same file several times (with different
+	   transformations) into instances of one mesh while loading */
+	m_shareMeshes = propList.getBoolean("shareMeshes", true);
+	if (m_replicateAccel && !m_pinThreads)
+		throw NoriException("replicateAccel requires pinThreads to be enabled");
+
+	/* Give every mesh its own bottom-level structure below a top-level
+	   hierarchy. These are built while the remaining meshes still load,
+	   but tracing is slower when the meshes overlap */
+	m_perMeshAccel = propList.getBoolean("perMeshAccel", false);
+
+	/* Start rendering with a quickly built (binned) kd-tree, and switch to
+	   the full-quality tree once its build has finished in the background */
+	m_usePreviewAccel = propList.getBoolean("previewAccel", false);
+
+	/* Choose emitting triangles using a light BVH ("bvh"), or
+	   whole luminaires proportional to their power ("power") */
+	QString lightSampling = propList.getString("lightSampling", "bvh");
+	if (lightSampling != "bvh" && lightSampling != "power")
+		throw NoriException(QString("Unknown lightSampling value \"%1\" "
+			"(must be \"bvh\" or \"power\")").arg(lightSampling));
+	m_useLightBVH = lightSampling == "bvh";
+
+	/* Output format: half or single precision channels, compression 
+	   method, and tile size of a tiled EXR file (0 = scanlines) */
+	m_outputOptions.half = propList.getBoolean("exrHalf", false);
+	m_outputOptions.compression = propList.getString("exrCompression", "zip");
+	m_outputOptions.tileSize = propList.getInteger("exrTileSize", 0);
+	if (!Bitmap::isSupportedCompression(m_outputOptions.compression))
+		throw NoriException(QString("Unsupported exrCompression value \"%1\"")
+			.arg(m_outputOptions.compression));
+	if (m_outputOptions.tileSize < 0)
+		throw NoriException(QString("Invalid exrTileSize value %1 "
+			"(must be >= 0)").arg(m_outputOptions.tileSize));
+
+	/* Optional tonemapped 8-bit preview next to the EXR file ("png" or "jpg") */
+	m_outputOptions.preview = propList.getString("preview", "");
+	m_outputOptions.previewExposure = propList.getFloat("previewExposure", 0.0f);
+	if (!m_outputOptions.preview.isEmpty() && m_outputOptions.preview != "png"
+			&& m_outputOptions.preview != "jpg")
+		throw NoriException(QString("Unknown preview format \"%1\" "
+			"(must be \"png\" or \"jpg\")").arg(m_outputOptions.preview));
+
+	/* Stream finished blocks to a tiled EXR file (for images that don't fit into memory) */
+	m_streamOutput = propList.getBoolean("streamOutput", false);
+	if (m_streamOutput && (m_samplesPerPass > 0 || m_checkpointInterval > 0))
+		throw NoriException("streamOutput can't be combined with progressive "
+			"rendering or checkpoints");
+
+	/* Auxiliary images (comma-separated, e.g. "depth,normal,albedo,meshID,sampleCount,variance,traversalCost,renderTime") */
+	m_aovs = 0;
+	QStringList aovNames = propList.getString("aovs", "").split(",", QString::SkipEmptyParts);
+	for (int i=0; i<aovNames.size(); ++i) {
+		QString name = aovNames[i].trimmed();
+		int aov = EAOVDepth;
+		while (aov <= EAOVRenderTime && name != getAOVName((EAOV) aov))
+			aov <<= 1;
+		if (aov > EAOVRenderTime)
+			throw NoriException(QString("Unknown AOV \"%1\" (must be one of depth, normal, "
+				"albedo, meshID, sampleCount, variance, traversalCost, renderTime)").arg(name));
+		m_aovs |= aov;
+	}
+#if !defined(NORI_TRAVERSAL_STATISTICS)
+	if (m_aovs & EAOVCost)
+		cerr << "Warning: the traversalCost AOV stays black unless Nori is built "
+			"with CONFIG+=travstats" << endl;
+#endif
+	if (m_aovs != 0 && m_streamOutput)
+		throw NoriException("AOVs can't be combined with streamOutput");
+
+	/* Filter the final image with a bilateral filter guided by the AOVs */
+	m_denoise = propList.getBoolean("denoise", false);
+	m_denoiseRadius = propList.getInteger("denoiseRadius", 3);
+	m_denoiseStrength = propList.getFloat("denoiseStrength", 1.0f);
+	if (m_denoiseRadius < 1 || m_denoiseStrength <= 0)
+		throw NoriException(QString("Invalid denoiser parameters (denoiseRadius=%1 "
+			"must be >= 1, denoiseStrength=%2 must be > 0)")
+			.arg(m_denoiseRadius).arg(m_denoiseStrength));
+	if (m_denoise && m_streamOutput)
+		throw NoriException("denoise can't be combined with streamOutput");
+
+	/* Optional file (e.g. next to the scene) that caches the tree between runs */
+	QString kdCache = propList.getString("kdCache", "");
+
+	/* Serve the kd-tree from the cache file instead of keeping it in
+	   memory (for geometry that exceeds the physical memory) */
+	m_outOfCore = propList.getBoolean("outOfCore", false);
+	if (m_outOfCore && (m_accelType != "kdtree" || kdCache.isEmpty()))
+		throw NoriException("outOfCore requires accel=\"kdtree\" and a kdCache file");
+	if (m_outOfCore && m_replicateAccel)
+		throw NoriException("outOfCore can't be combined with replicateAccel");
+
+	m_accel = createAccelerator(kdCache);
+}
+
+Accelerator *Scene::createAccelerator(const QString &cacheFilename, const QString &_type) const {
+	QString type = _type.isEmpty() ? m_accelType : _type;
+	if (type == "bvh" || type == "bvh4") {
+		BVH *bvh = new BVH();
+		bvh->setRefitThreshold(m_refitThreshold);
+		bvh->setWide(type == "bvh4");
+		return bvh;
+	} else if (type != "kdtree") {
+		return AcceleratorFactory::createInstance(type, m_accelProps);
+	}
+
+	KDTree *kdtree = new KDTree();
+	configureKDTree(kdtree);
+	kdtree->setCacheFilename(cacheFilename);
+	kdtree->setOutOfCore(m_outOfCore && !cacheFilename.isEmpty());
+	return kdtree;
+}
+
+void Scene::configureKDTree(KDTree *kdtree) const {
+	kdtree->setBuildQuality((KDTree::EBuildQuality) m_kdBuildQuality);
+	kdtree->setSplitClipping(m_kdSplitThreshold, m_kdSplitBudget);
+	kdtree->setMaxBuildMemory((size_t) m_kdMaxBuildMemory * 1024 * 1024);
+	kdtree->setMailboxing(m_kdMailboxing);
+	kdtree->setMetricsFilename(m_kdMetrics);
+	kdtree->setShortRayGrid(m_kdShortRayLength, m_kdShortRayResolution);
+	kdtree->setTraversalCost(m_kdTraversalCost);
+	kdtree->setQueryCost(m_kdQueryCost);
+	kdtree->setEmptySpaceBonus(m_kdEmptySpaceBonus);
+	kdtree->setStopPrims((uint32_t) m_kdStopPrims);
+	kdtree->setMaxBadRefines((uint32_t) m_kdMaxBadRefines);
+	if (m_kdExactPrimThreshold >= 0)
+		kdtree->setExactPrimitiveThreshold((uint32_t) m_kdExactPrimThreshold);
 }
 
+/// Only the kd-tree applies the alpha masks of meshes (see \ref Mesh::alphaTest())
+static void checkAlphaMask(const Mesh *mesh, const QString &accelType) {
+	if (mesh->getAlphaMask() && accelType != "kdtree")
+		throw NoriException(QString("The mesh \"%1\" has an alpha mask, which requires "
+			"accel=\"kdtree\" (got \"%2\")").arg(mesh->getName()).arg(accelType));
+}
+
+Accelerator *Scene::buildAccelerator(const QString &type) const {
+	if (!m_instances.empty())
+		throw NoriException("Additional acceleration data structures can't be "
+			"built for scenes with instances!");
+	Accelerator *accel = createAccelerator("", type);
+	accel->setOwnsMeshes(false);
+	bool hasProcedural = false;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		checkAlphaMask(m_meshes[i], type);
+		accel->addMesh(m_meshes[i]);
+		hasProcedural |= m_meshes[i]->isProcedural();
+	}
+	if (hasProcedural)
+		accel = new ProceduralAccelerator(accel);
+	accel->build();
+	return accel;
+}
+
+/**
+ * \brief Builds the bottom-level acceleration data structure of an
+ * instanced mesh in the background
+ */
+class BottomLevelBuildThread : public QThread {
+public:
+	BottomLevelBuildThread(Accelerator *accel, const Mesh *mesh) 
+		: m_accel(accel), m_mesh(mesh) { }
+
+	void run() {
+		try {
+			m_accel->build();
+		} catch (const NoriException &ex) {
+			m_error = ex.getReason();
+		} catch (const std::exception &ex) {
+			m_error = ex.what();
+		}
+	}
+
+	inline Accelerator *getAccelerator() { return m_accel; }
+	inline const Mesh *getMesh() const { return m_mesh; }
+	inline const QString &getError() const { return m_error; }
+private:
+	Accelerator *m_accel;
+	const Mesh *m_mesh;
+	QString m_error;
+};
+
+/**
+ * \brief Builds the full-quality acceleration data structure in the
+ * background, and then makes the scene use it instead of the preview
+ */
+class AccelBuildThread : public QThread {
+public:
+	AccelBuildThread(Accelerator *accel, QAtomicPointer<const Accelerator> &active) 
+		: m_accel(accel), m_active(active) { }
+
+	void run() {
+		try {
+			m_accel->build();
+		} catch (const NoriException &ex) {
+			cerr << "Caught a critical exception while building the acceleration "
+				 << "data structure: " << qPrintable(ex.getReason()) << endl;
+			exit(-1);
+		}
+		m_active.fetchAndStoreOrdered(m_accel);
+		cout << "Switched to the full acceleration data structure: " 
+			 << qPrintable(m_accel->getName()) << " (build time " 
+			 << m_accel->getBuildTime() << " ms, " 
+			 << m_accel->getMemoryUsage() / 1024 << " KiB)" << endl;
+	}
+private:
+	Accelerator *m_accel;
+	QAtomicPointer<const Accelerator> &m_active;
+};
+
 Scene::~Scene() {
-	delete m_kdtree;
+	/* Render threads may still use the preview, so it is only released here */
+	if (m_accelBuild) {
+		m_accelBuild->wait();
+		delete m_accelBuild;
+	}
+	delete m_previewAccel;
+
+	/* Bottom-level structures that were never handed to the top level */
+	for (size_t i=0; i<m_bottomLevelBuilds.size(); ++i) {
+		m_bottomLevelBuilds[i]->wait();
+		delete m_bottomLevelBuilds[i]->getAccelerator();
+		delete m_bottomLevelBuilds[i];
+	}
+	for (size_t i=1; i<m_replicas.size(); ++i)
+		delete m_replicas[i];
+	delete m_accel;
+	for (size_t i=0; i<m_instances.size(); ++i)
+		delete m_instances[i];
 	if (m_sampler)
 		delete m_sampler;
-	if (m_camera)
-		delete m_camera;
+	for (size_t i=0; i<m_cameras.size(); ++i)
+		delete m_cameras[i];
 	if (m_integrator)
 		delete m_integrator;
 	if (m_medium)
 		delete m_medium;
+	if (m_environment)
+		delete m_environment;
+	delete m_lightBVH;
 }
 
 bool Scene::sampleDistance(const Ray3f &ray, Sampler *sampler, float &t, Color3f &weight) const {
@@ -51,6 +424,79 @@ bool Scene::sampleDistance(const Ray3f &ray, Sampler *sampler, float &t, Color3f
 	}
 }
 
+Color3f Scene::sampleLuminaire(LuminaireQueryRecord &lRec, const Point2f &_sample) const {
+	if (m_directLuminaires.empty()) {
+		lRec.pdf = 0.0f;
+		return Color3f(0.0f);
+	}
+
+	/* Reuse the first dimension to choose the luminaire */
+	Point2f sample(_sample);
+	float choicePdf;
+	size_t index = m_directPDF.sampleReuse(sample.x(), choicePdf);
+	const Luminaire *luminaire = m_directLuminaires[index];
+	if (luminaire) {
+		Color3f value = luminaire->sample(lRec, sample);
+		lRec.pdf *= choicePdf;
+		return value / choicePdf;
+	}
+
+	/* Choose one of the emitting triangles, and a position on it */
+	float areaPdf;
+	int emitter = m_lightBVH->sample(lRec.ref, sample, lRec.p, lRec.n, areaPdf);
+	if (emitter < 0) {
+		lRec.pdf = 0.0f;
+		return Color3f(0.0f);
+	}
+	lRec.luminaire = m_lightBVH->getEmitter(emitter).luminaire;
+	lRec.triangle = m_lightBVH->getEmitter(emitter).triangle;
+	lRec.d = lRec.p - lRec.ref;
+	float distSquared = lRec.d.squaredNorm();
+	lRec.dist = std::sqrt(distSquared);
+	lRec.d /= lRec.dist;
+
+	/* Convert the density from area to solid angles */
+	float cosTheta = -lRec.n.dot(lRec.d);
+	if (cosTheta <= 0 || lRec.dist == 0) {
+		lRec.pdf = 0.0f;
+		return Color3f(0.0f);
+	}
+	lRec.pdf = choicePdf * areaPdf * distSquared / cosTheta;
+	return lRec.luminaire->eval(lRec) / lRec.pdf;
+}
+
+Color3f Scene::sampleEmission(LuminaireQueryRecord &lRec, Ray3f &ray,
+		const Point2f &positionSample, const Point2f &directionSample) const {
+	if (m_luminaires.empty()) {
+		lRec.pdf = 0.0f;
+		return Color3f(0.0f);
+	}
+
+	Point2f sample(positionSample);
+	float choicePdf;
+	size_t index = m_luminairePDF.sampleReuse(sample.x(), choicePdf);
+	Color3f value = m_luminaires[index]->sampleRay(lRec, ray, sample, directionSample);
+	lRec.pdf *= choicePdf;
+	return value / choicePdf;
+}
+
+float Scene::pdfLuminaire(const LuminaireQueryRecord &lRec) const {
+	if (!lRec.luminaire || m_directLuminaires.empty())
+		return 0.0f;
+
+	if (m_lightBVH && m_lightBVH->contains(lRec.luminaire)) {
+		float cosTheta = -lRec.n.dot(lRec.d);
+		if (cosTheta <= 0)
+			return 0.0f;
+		float choicePdf = m_lightBVH->getPower() * m_directPDF.getNormalization();
+		return m_lightBVH->pdf(lRec.ref, lRec.luminaire, lRec.triangle)
+			* lRec.dist * lRec.dist / cosTheta * choicePdf;
+	}
+
+	float choicePdf = lRec.luminaire->getPower() * m_directPDF.getNormalization();
+	return lRec.luminaire->pdf(lRec) * choicePdf;
+}
+
 Color3f Scene::evalTransmittance(const Ray3f &ray, Sampler *sampler) const {
 	if (m_medium) {
 		return m_medium->evalTransmittance(ray, sampler);
@@ -59,8 +505,87 @@ Color3f Scene::evalTransmittance(const Ray3f &ray, Sampler *sampler) const {
 	}
 }
 
+/// Evaluates the RGB transmittance of a segment (see \ref evalVisibility())
+struct RGBTransmittance {
+	typedef Color3f Value;
+	const Scene *scene;
+	Sampler *sampler;
+
+	inline Color3f operator()(const Ray3f &ray, const MediumStack &media) const {
+		return scene->evalTransmittance(ray, sampler, media);
+	}
+};
+
+/// Evaluates the spectral transmittance of a segment (see \ref evalVisibility())
+struct SpectralTransmittance {
+	typedef Spectrum4f Value;
+	const Scene *scene;
+	Sampler *sampler;
+	const Wavelengths *wl;
+
+	inline Spectrum4f operator()(const Ray3f &ray, const MediumStack &media) const {
+		return scene->evalSpectralTransmittance(ray, sampler, *wl, media);
+	}
+};
+
+/**
+ * \brief Shared implementation of \ref Scene::evalVisibilityTransmittance()
+ * and its spectral version, which evaluate the transmittance of the
+ * segments between null interfaces using \c transmittance
+ */
+template <typename Transmittance> static typename Transmittance::Value evalVisibility(
+		const Scene *scene, const Ray3f &_ray, const MediumStack &_media,
+		const Transmittance &transmittance) {
+	typedef typename Transmittance::Value Value;
+	if (!scene->hasNullInterfaces()) {
+		if (scene->rayIntersect(_ray))
+			return Value(0.0f);
+		return transmittance(_ray, _media);
+	}
+
+	/* Find the surfaces one after the other, and accumulate the
+	   transmittance of the segments between null interfaces */
+	Ray3f ray(_ray);
+	MediumStack media(_media);
+	Value result(1.0f);
+	Intersection its;
+	while (scene->rayIntersect(ray, its)) {
+		const BSDF *bsdf = its.mesh->getBSDF();
+		if (!bsdf || !bsdf->isNull())
+			return Value(0.0f);
+		Ray3f segment(ray.o, ray.d, ray.mint, its.t);
+		segment.time = ray.time;
+		result *= transmittance(segment, media);
+		if (result.isZero())
+			return result;
+		media.update(its, ray.d);
+		ray.mint = its.t + Epsilon;
+		if (ray.mint >= ray.maxt)
+			return result;
+	}
+	return result * transmittance(ray, media);
+}
+
+Color3f Scene::evalVisibilityTransmittance(const Ray3f &ray, Sampler *sampler,
+		const MediumStack &media) const {
+	RGBTransmittance transmittance = { this, sampler };
+	return evalVisibility(this, ray, media, transmittance);
+}
+
+Spectrum4f Scene::evalSpectralVisibilityTransmittance(const Ray3f &ray, Sampler *sampler,
+		const Wavelengths &wl, const MediumStack &media) const {
+	SpectralTransmittance transmittance = { this, sampler, &wl };
+	return evalVisibility(this, ray, media, transmittance);
+}
+
 void Scene::activate() {
-	m_kdtree->build();
+	if (m_adoptedGeometry) {
+		m_activeAccel = m_accel;
+		cout << "Reusing the meshes and acceleration data structure "
+			 "of the previous scene" << endl;
+	} else {
+		buildAccelerator();
+	}
 
 	if (!m_integrator)
 		throw NoriException("No integrator was specified!");
@@ -73,17 +598,424 @@ void Scene::activate() {
 			NoriObjectFactory::createInstance("independent", PropertyList()));
 	}
 
+	prepareLuminaires();
+	selectInstanceLODs();
+
+	m_hasNullInterfaces = false;
+	m_hasMedia = m_medium != NULL;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const BSDF *bsdf = m_meshes[i]->getBSDF();
+		m_hasNullInterfaces |= bsdf && bsdf->isNull();
+		m_hasMedia |= m_meshes[i]->getInteriorMedium() != NULL;
+	}
+
 	cout << endl;
 	cout << "Configuration: " << qPrintable(toString()) << endl;
 	cout << endl;
+
+	m_memoryReport = MemoryReport();
+	reportMemory(m_memoryReport);
+	cout << "Memory usage:" << endl << qPrintable(m_memoryReport.toString()) << endl;
+	cout << endl;
+}
+
+void Scene::reportMemory(MemoryReport &report) const {
+	/* List the categories in a fixed order, so that reports can be compared */
+	static const char *categories[] = {
+		"meshPositions", "meshNormals", "meshTexCoords", "meshIndices", "meshTriangles",
+		"pdfTables", "kdNodes", "kdIndices", "kdIndirections", "kdTriangles",
+		"bvhNodes", "bvhTriangles", "accel", "lightBVH", "media", "environmentMaps",
+		"film", "threadBlocks", "threadSamplers"
+	};
+	for (size_t i=0; i<sizeof(categories) / sizeof(categories[0]); ++i)
+		report.add(categories[i], 0);
+
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		m_meshes[i]->reportMemory(report);
+	if (m_accel)
+		m_accel->reportMemory(report);
+	for (size_t i=0; i<m_replicas.size(); ++i)
+		m_replicas[i]->reportMemory(report);
+
+	/* Media (which may fill the interiors of several meshes) */
+	std::vector<const Medium *> media;
+	if (m_medium)
+		media.push_back(m_medium);
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Medium *medium = m_meshes[i]->getInteriorMedium();
+		if (medium && std::find(media.begin(), media.end(), medium) == media.end())
+			media.push_back(medium);
+	}
+	for (size_t i=0; i<media.size(); ++i)
+		media[i]->reportMemory(report);
+
+	if (m_environment)
+		m_environment->reportMemory(report);
+	report.add("pdfTables", m_luminairePDF.getMemoryUsage() + m_directPDF.getMemoryUsage());
+	if (m_lightBVH)
+		report.add("lightBVH", m_lightBVH->getMemoryUsage());
+
+	/* Film (with a second one for splats) and the blocks and samplers of
+	   the render threads, as allocated by RenderJob and RenderWorker */
+	if (!m_camera || !m_integrator || !m_sampler)
+		return;
+	const ReconstructionFilter *filter = m_camera->getReconstructionFilter();
+	bool aovs = m_aovs != 0 || m_denoise;
+	size_t threads = (size_t) getCoreCount();
+	if (!m_streamOutput) {
+		const std::vector<Camera *> &views = m_cameras.empty()
+			? std::vector<Camera *>(1, m_camera) : m_cameras;
+		for (size_t i=0; i<views.size(); ++i) {
+			const Vector2i &size = views[i]->getOutputSize();
+			report.add("film", ImageBlock::estimateMemoryUsage(size, filter, aovs));
+			if (m_integrator->usesSplatting())
+				report.add("film", ImageBlock::estimateMemoryUsage(size, filter, false));
+		}
+	}
+	report.add("threadBlocks", threads
+		* ImageBlock::estimateMemoryUsage(Vector2i(m_blockSize), filter, aovs));
+	MemoryReport samplerReport;
+	m_sampler->reportMemory(samplerReport);
+	report.add("threadSamplers", threads * samplerReport.getTotalResident());
+}
+
+void Scene::prepareLuminaires() {
+	/* Choose between the luminaires proportional to their power */
+	m_luminaires.clear();
+	m_luminairePDF.clear();
+	std::vector<const Mesh *> emitters;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Luminaire *luminaire = m_meshes[i]->getLuminaire();
+		if (luminaire && luminaire->getPower() > 0) {
+			m_luminaires.push_back(luminaire);
+			m_luminairePDF.append(luminaire->getPower());
+			emitters.push_back(m_meshes[i]);
+		}
+	}
+	if (m_environment) {
+		m_environment->setSceneBounds(getBoundingBox());
+		if (m_environment->getPower() > 0) {
+			m_luminaires.push_back(m_environment);
+			m_luminairePDF.append(m_environment->getPower());
+		}
+	}
+
+	/* Emitting media (which may fill the interiors of several meshes) */
+	std::vector<const Medium *> media(1, m_medium);
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		media.push_back(m_meshes[i]->getInteriorMedium());
+	m_hasVolumeEmission = false;
+	for (size_t i=0; i<media.size(); ++i) {
+		const Luminaire *luminaire = media[i] ? media[i]->getLuminaire() : NULL;
+		if (!luminaire || std::find(m_luminaires.begin(), m_luminaires.end(),
+				luminaire) != m_luminaires.end())
+			continue;
+		m_luminaires.push_back(luminaire);
+		m_luminairePDF.append(luminaire->getPower());
+		m_hasVolumeEmission = true;
+	}
+	if (!m_luminaires.empty())
+		m_luminairePDF.normalize();
+
+	/* Luminaire sampling treats the triangles in the light BVH as one
+	   luminaire next to the remaining ones (e.g. the environment) */
+	delete m_lightBVH;
+	m_lightBVH = NULL;
+	m_directLuminaires.clear();
+	m_directPDF.clear();
+	if (m_useLightBVH && !emitters.empty()) {
+		QElapsedTimer timer;
+		timer.start();
+		m_lightBVH = new LightBVH(emitters);
+		cout << "Built a light BVH over " << m_lightBVH->getEmitterCount()
+			 << " emitting triangles in " << timer.elapsed() << " ms" << endl;
+		if (m_lightBVH->getPower() > 0) {
+			m_directLuminaires.push_back(NULL);
+			m_directPDF.append(m_lightBVH->getPower());
+		}
+	}
+	for (size_t i=0; i<m_luminaires.size(); ++i) {
+		if (m_lightBVH && m_lightBVH->contains(m_luminaires[i]))
+			continue;
+		m_directLuminaires.push_back(m_luminaires[i]);
+		m_directPDF.append(m_luminaires[i]->getPower());
+	}
+	if (!m_directLuminaires.empty())
+		m_directPDF.normalize();
+}
+
+void Scene::buildAccelerator() {
+	/* Procedural shapes (e.g. curves) are intersected by a separate
+	   hierarchy on top of the triangles */
+	bool hasProcedural = false;
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		hasProcedural |= m_meshes[i]->isProcedural();
+	if (hasProcedural)
+		m_accel = new ProceduralAccelerator(m_accel);
+
+	if (!m_instances.empty()) {
+		/* Collect the bottom-level structures of the instanced meshes,
+		   whose builds were started as the meshes were added */
+		InstanceAccelerator *accel = new InstanceAccelerator(m_accel);
+		m_accel = accel;
+
+		QString error;
+		std::map<const Mesh *, Accelerator *> bottomLevel;
+		for (size_t i=0; i<m_bottomLevelBuilds.size(); ++i) {
+			BottomLevelBuildThread *thread = m_bottomLevelBuilds[i];
+			thread->wait();
+			if (error.isEmpty())
+				error = thread->getError();
+			accel->addBottomLevel(thread->getAccelerator());
+			bottomLevel[thread->getMesh()] = thread->getAccelerator();
+			delete thread;
+		}
+		m_bottomLevelBuilds.clear();
+		if (!error.isEmpty())
+			throw NoriException(QString("Unable to build a bottom-level structure: %1").arg(error));
+
+		for (size_t i=0; i<m_instances.size(); ++i) {
+			const Instance *instance = m_instances[i];
+			const Accelerator *accels[NORI_INSTANCE_MAX_LODS];
+			for (int level=0; level<instance->getLODCount(); ++level)
+				accels[level] = bottomLevel[instance->getLOD(level)];
+			accel->addInstance(instance, accels);
+		}
+	}
+
+	bool preview = m_usePreviewAccel;
+	if (preview && (m_accelType != "kdtree" || m_kdBuildQuality == KDTree::EBinned
+			|| !m_instances.empty() || hasProcedural || m_replicateAccel)) {
+		cerr << "Warning: previewAccel requires a kd-tree with kdBuildQuality > 0 "
+			 "and is not supported for scenes with instances, procedural meshes, or "
+			 "replicateAccel, ignoring." << endl;
+		preview = false;
+	}
+
+	if (preview) {
+		/* Binned kd-tree over the same meshes, which are owned by m_accel */
+		KDTree *kdtree = new KDTree();
+		kdtree->setBuildQuality(KDTree::EBinned);
+		kdtree->setOwnsMeshes(false);
+		for (size_t i=0; i<m_meshes.size(); ++i)
+			kdtree->addMesh(m_meshes[i]);
+		kdtree->build();
+		m_previewAccel = kdtree;
+		m_activeAccel = m_previewAccel;
+		cout << "Preview acceleration data structure: " << qPrintable(kdtree->getName())
+			 << " (build time " << kdtree->getBuildTime() << " ms, "
+			 << kdtree->getMemoryUsage() / 1024 << " KiB), building the full one "
+			 << "in the background .." << endl;
+
+		m_accelBuild = new AccelBuildThread(m_accel, m_activeAccel);
+		m_accelBuild->start();
+	} else {
+		m_accel->build();
+		m_activeAccel = m_accel;
+		cout << "Acceleration data structure: " << qPrintable(m_accel->getName())
+			 << " (build time " << m_accel->getBuildTime() << " ms, "
+			 << m_accel->getMemoryUsage() / 1024 << " KiB)" << endl;
+	}
+
+	if (m_replicateAccel)
+		buildReplicas();
+}
+
+bool Scene::adoptGeometry(Scene *other) {
+	if (m_geometryKey != other->m_geometryKey || m_accelType != other->m_accelType ||
+		m_kdBuildQuality != other->m_kdBuildQuality || 
+		m_kdMaxBuildMemory != other->m_kdMaxBuildMemory ||
+		m_kdMailboxing != other->m_kdMailboxing ||
+		m_kdShortRayLength != other->m_kdShortRayLength ||
+		m_kdShortRayResolution != other->m_kdShortRayResolution ||
+		m_kdTraversalCost != other->m_kdTraversalCost ||
+		m_kdQueryCost != other->m_kdQueryCost ||
+		m_kdEmptySpaceBonus != other->m_kdEmptySpaceBonus ||
+		m_kdStopPrims != other->m_kdStopPrims ||
+		m_kdMaxBadRefines != other->m_kdMaxBadRefines ||
+		m_kdExactPrimThreshold != other->m_kdExactPrimThreshold ||
+		m_kdSplitThreshold != other->m_kdSplitThreshold || 
+		m_kdSplitBudget != other->m_kdSplitBudget ||
+		m_refitThreshold != other->m_refitThreshold ||
+		m_perMeshAccel != other->m_perMeshAccel ||
+		m_replicateAccel != other->m_replicateAccel || !m_meshes.empty() ||
+		!m_instances.empty() || !other->m_bottomLevelBuilds.empty())
+		return false;
+
+	/* Only the full-quality structure is handed over */
+	other->waitForAccel();
+	delete other->m_accelBuild;
+	other->m_accelBuild = NULL;
+	delete other->m_previewAccel;
+	other->m_previewAccel = NULL;
+
+	delete m_accel;
+	m_accel = other->m_accel;
+	other->m_accel = NULL;
+	other->m_activeAccel = NULL;
+	m_meshes.swap(other->m_meshes);
+	m_instances.swap(other->m_instances);
+	m_replicas.swap(other->m_replicas);
+	m_adoptedGeometry = true;
+	return true;
+}
+
+void Scene::waitForAccel() {
+	if (m_accelBuild)
+		m_accelBuild->wait();
+}
+
+void Scene::updateGeometry() {
+	/* Only the full-quality structure is kept up to date */
+	waitForAccel();
+	if (m_previewAccel) {
+		delete m_previewAccel;
+		m_previewAccel = NULL;
+	}
+
+	/* Instance bounds depend on the vertex positions of their meshes */
+	for (size_t i=0; i<m_instances.size(); ++i)
+		m_instances[i]->activate();
+	selectInstanceLODs();
+
+	m_accel->update();
+	for (size_t i=1; i<m_replicas.size(); ++i)
+		m_replicas[i]->update();
+
+	/* The luminaires moved (and their power changed with their area) */
+	prepareLuminaires();
+}
+
+/**
+ * \brief Builds an acceleration data structure on the cores of a NUMA 
+ * node, so that its memory is allocated there (first-touch policy)
+ */
+class ReplicaBuildThread : public QThread {
+public:
+	ReplicaBuildThread(Accelerator *accel, int node) 
+		: m_accel(accel), m_node(node) { }
+
+	void run() {
+		/* Helper threads of the builder inherit the affinity */
+		setThreadAffinity(getNodeCores(m_node));
+		setThreadNode(m_node);
+		try {
+			m_accel->build();
+		} catch (const NoriException &ex) {
+			cerr << "Caught a critical exception while building a replica: " 
+				 << qPrintable(ex.getReason()) << endl;
+			exit(-1);
+		}
+	}
+private:
+	Accelerator *m_accel;
+	int m_node;
+};
+
+void Scene::buildReplicas() {
+	int nodeCount = getNodeCount();
+	if (nodeCount == 1)
+		return;
+
+	if (!m_instances.empty()) {
+		cerr << "Warning: replicateAccel is not supported for scenes "
+			 "with instances, ignoring." << endl;
+		return;
+	}
+
+	/* Node 0 uses the original, which was built by the main thread */
+	m_replicas.push_back(m_accel);
+	std::vector<ReplicaBuildThread *> threads;
+	for (int node=1; node<nodeCount; ++node) {
+		Accelerator *accel = createAccelerator();
+		accel->setOwnsMeshes(false);
+		bool hasProcedural = false;
+		for (size_t i=0; i<m_meshes.size(); ++i) {
+			accel->addMesh(m_meshes[i]);
+			hasProcedural |= m_meshes[i]->isProcedural();
+		}
+		if (hasProcedural)
+			accel = new ProceduralAccelerator(accel);
+		m_replicas.push_back(accel);
+
+		ReplicaBuildThread *thread = new ReplicaBuildThread(accel, node);
+		thread->start();
+		threads.push_back(thread);
+	}
+
+	for (size_t i=0; i<threads.size(); ++i) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+
+	cout << "Replicated the acceleration data structure on " 
+		 << nodeCount << " NUMA nodes" << endl;
+}
+
+void Scene::selectInstanceLODs() {
+	/* Angle covered by the central pixel (only pinhole cameras report
+	   a frustum, otherwise all instances use their full resolution) */
+	float pixelAngle = 0.0f;
+	Point3f origin(0.0f);
+	if (m_camera) {
+		const Vector2i &size = m_camera->getOutputSize();
+		Point2f min((float) (size.x() / 2), (float) (size.y() / 2)),
+		        max(min.x() + 1, min.y() + 1);
+		Vector3f corners[4];
+		if (m_camera->getFrustum(min, max, origin, corners))
+			pixelAngle = (corners[0].normalized() - corners[3].normalized()).norm()
+				* INV_SQRT_TWO;
+	}
+
+	for (size_t i=0; i<m_instances.size(); ++i)
+		m_instances[i]->selectCameraLOD(origin, pixelAngle);
+}
+
+void Scene::buildBottomLevel(Mesh *mesh) {
+	for (size_t i=0; i<m_bottomLevelBuilds.size(); ++i) {
+		if (m_bottomLevelBuilds[i]->getMesh() == mesh)
+			return;
+	}
+
+	/* The bottom-level structure takes ownership of the mesh */
+	Accelerator *accel = createAccelerator();
+	accel->addMesh(mesh);
+	BottomLevelBuildThread *thread = new BottomLevelBuildThread(accel, mesh);
+	thread->start();
+	m_bottomLevelBuilds.push_back(thread);
 }
 
 void Scene::addChild(NoriObject *obj) {
 	switch (obj->getClassType()) {
 		case EMesh: {
 				Mesh *mesh = static_cast<Mesh *>(obj);
-				m_kdtree->addMesh(mesh);
+				checkAlphaMask(mesh, m_accelType);
+				mesh->setID((uint32_t) m_meshes.size());
 				m_meshes.push_back(mesh);
+				if (m_perMeshAccel && !mesh->isProcedural()) {
+					/* Reference the mesh through an instance without transformation */
+					Instance *instance = static_cast<Instance *>(
+						NoriObjectFactory::createInstance("instance", PropertyList()));
+					instance->addChild(mesh);
+					instance->activate();
+					m_instances.push_back(instance);
+					buildBottomLevel(mesh);
+				} else {
+					m_accel->addMesh(mesh);
+				}
+			}
+			break;
+
+		case EInstance: {
+				Instance *instance = static_cast<Instance *>(obj);
+				for (int level=0; level<instance->getLODCount(); ++level) {
+					if (instance->getLOD(level)->isLuminaire())
+						throw NoriException("Luminaires on instanced meshes are not supported!");
+					checkAlphaMask(instance->getLOD(level), m_accelType);
+				}
+				m_instances.push_back(instance);
+				for (int level=0; level<instance->getLODCount(); ++level)
+					buildBottomLevel(instance->getLOD(level));
 			}
 			break;
 
@@ -93,10 +1025,23 @@ void Scene::addChild(NoriObject *obj) {
 			m_sampler = static_cast<Sampler *>(obj);
 			break;
 
-		case ECamera:
-			if (m_camera)
-				throw NoriException("There can only be one camera per scene!");
-			m_camera = static_cast<Camera *>(obj);
+		case ECamera: {
+				/* Further cameras render additional views (e.g. a stereo pair) */
+				Camera *camera = static_cast<Camera *>(obj);
+				if (!m_cameras.empty()) {
+					if (camera->getName().isEmpty() || m_camera->getName().isEmpty())
+						throw NoriException("The cameras of a multi-view scene must be "
+							"named (using their \"name\" property)!");
+					for (size_t i=0; i<m_cameras.size(); ++i) {
+						if (m_cameras[i]->getName() == camera->getName())
+							throw NoriException(QString("There are several cameras "
+								"named \"%1\"!").arg(camera->getName()));
+					}
+				}
+				if (!m_camera)
+					m_camera = camera;
+				m_cameras.push_back(camera);
+			}
 			break;
 		
 		case EMedium:
@@ -105,6 +1050,17 @@ void Scene::addChild(NoriObject *obj) {
 			m_medium = static_cast<Medium *>(obj);
 			break;
 
+		case ELuminaire: {
+				Luminaire *luminaire = static_cast<Luminaire *>(obj);
+				if (!luminaire->isEnvironment())
+					throw NoriException("Only environment luminaires can be added to "
+						"the scene (others must be attached to a mesh)!");
+				if (m_environment)
+					throw NoriException("There can only be one environment luminaire per scene!");
+				m_environment = luminaire;
+			}
+			break;
+
 		case EIntegrator:
 			if (m_integrator)
 				throw NoriException("There can only be one integrator per scene!");
@@ -117,6 +1073,25 @@ void Scene::addChild(NoriObject *obj) {
 	}
 }
 
+void Scene::setHitRecord(std::vector<uint32_t> *hits) const {
+	if (!m_hitRecords.hasLocalData())
+		m_hitRecords.setLocalData(new std::vector<uint32_t> *(NULL));
+	*m_hitRecords.localData() = hits;
+	if (hits)
+		m_recordHits = true;
+}
+
+void Scene::recordHit(const Mesh *mesh) const {
+	if (!mesh || !m_hitRecords.hasLocalData())
+		return;
+	std::vector<uint32_t> *hits = *m_hitRecords.localData();
+
+	/* Meshes of instances aren't part of the scene's list */
+	uint32_t id = mesh->getID();
+	if (hits && id < m_meshes.size() && m_meshes[id] == mesh)
+		(*hits)[id / 32] |= 1u << (id % 32);
+}
+
 QString Scene::toString() const {
 	QString meshes;
 	for (size_t i=0; i<m_meshes.size(); ++i) {
@@ -125,20 +1100,32 @@ QString Scene::toString() const {
 			meshes += ",";
 		meshes += "\n";
 	}
+	QString cameras = m_camera->toString();
+	if (m_cameras.size() > 1) {
+		cameras = "{\n";
+		for (size_t i=0; i<m_cameras.size(); ++i)
+			cameras += QString("  ") + indent(m_cameras[i]->toString(), 2)
+				+ (i + 1 < m_cameras.size() ? ",\n" : "\n");
+		cameras += "}";
+	}
 	return QString(
 		"Scene[\n"
 		"  integrator = %1,\n"
 		"  sampler = %2\n"
 		"  camera = %3,\n"
 		"  medium = %4,\n"
+		"  environment = %5,\n"
 		"  meshes = {\n"
-		"  %5}\n"
+		"  %6},\n"
+		"  instances = %7\n"
 		"]")
 	.arg(indent(m_integrator->toString()))
 	.arg(indent(m_sampler->toString()))
-	.arg(indent(m_camera->toString()))
+	.arg(indent(cameras))
 	.arg(m_medium ? indent(m_medium->toString()) : QString("null"))
-	.arg(indent(meshes, 2));
+	.arg(m_environment ? indent(m_environment->toString()) : QString("null"))
+	.arg(indent(meshes, 2))
+	.arg((int) m_instances.size());
 }
 
 NORI_REGISTER_CLASS(Scene, "scene");
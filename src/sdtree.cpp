@@ -0,0 +1,298 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sdtree.h>
+#include <nori/fastmath.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Return the quadrant of the unit square that contains \c p
+static inline int quadrant(const Point2f &p) {
+	return (p.x() >= 0.5f ? 1 : 0) | (p.y() >= 0.5f ? 2 : 0);
+}
+
+/// Map a point of a quadrant to the unit square
+static inline Point2f toChild(const Point2f &p, int quadrant) {
+	return Point2f(
+		std::min(2 * p.x() - (quadrant & 1), OneMinusEpsilon),
+		std::min(2 * p.y() - (quadrant >> 1), OneMinusEpsilon));
+}
+
+/**
+ * \brief Node to be visited by \ref DTree::refine(): the corresponding
+ * node of the source tree (or -1, when it is a leaf there), the new node,
+ * its depth, and the fraction of the total value in each of its quadrants
+ */
+struct DTreeRefineItem {
+	int source;
+	uint32_t target;
+	int depth;
+	float fraction[4];
+};
+
+DTree::DTree() : m_nodes(1) {
+}
+
+void DTree::record(const Point2f &_p, float value) {
+	Point2f p(_p);
+	uint32_t index = 0;
+	for (int depth=0; depth<NORI_DTREE_MAX_DEPTH; ++depth) {
+		Node &node = m_nodes[index];
+		int c = quadrant(p);
+		atomicAdd(&node.sum[c], value);
+		index = node.children[c];
+		if (!index)
+			break;
+		p = toChild(p, c);
+	}
+}
+
+Point2f DTree::sample(const Point2f &_sample) const {
+	Point2f sample(_sample), origin(0.0f, 0.0f);
+	float size = 1.0f;
+	uint32_t index = 0;
+
+	while (true) {
+		const Node &node = m_nodes[index];
+		float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+		int c;
+		if (total <= 0) {
+			/* Nothing was recorded here: choose uniformly */
+			c = quadrant(sample);
+			sample = toChild(sample, c);
+		} else {
+			/* Choose the column (x) and then the row (y) of the quadrant,
+			   reusing the sample */
+			float left = (node.sum[0] + node.sum[2]) / total;
+			int x = sample.x() < left ? 0 : 1;
+			sample.x() = x == 0 ? sample.x() / left : (sample.x() - left) / (1 - left);
+
+			float bottom = node.sum[x] / (node.sum[x] + node.sum[x + 2]);
+			int y = sample.y() < bottom ? 0 : 1;
+			sample.y() = y == 0 ? sample.y() / bottom : (sample.y() - bottom) / (1 - bottom);
+
+			sample = Point2f(std::min(sample.x(), OneMinusEpsilon),
+				std::min(sample.y(), OneMinusEpsilon));
+			c = x | (y << 1);
+		}
+
+		size *= 0.5f;
+		origin += Vector2f(c & 1, c >> 1) * size;
+		if (!node.children[c])
+			break;
+		index = node.children[c];
+	}
+
+	/* Uniform within the leaf */
+	return Point2f(std::min(origin.x() + sample.x() * size, OneMinusEpsilon),
+		std::min(origin.y() + sample.y() * size, OneMinusEpsilon));
+}
+
+float DTree::pdf(const Point2f &_p) const {
+	Point2f p(_p);
+	float result = 1.0f;
+	uint32_t index = 0;
+	while (true) {
+		const Node &node = m_nodes[index];
+		float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+		if (total <= 0)
+			return result;
+		int c = quadrant(p);
+		result *= 4 * node.sum[c] / total;
+		if (result == 0 || !node.children[c])
+			return result;
+		index = node.children[c];
+		p = toChild(p, c);
+	}
+}
+
+void DTree::refine(float threshold, DTree &result) const {
+	result.m_nodes.clear();
+	result.m_nodes.push_back(Node());
+	float total = getTotal();
+	if (total <= 0)
+		return;
+
+	std::vector<DTreeRefineItem> stack;
+	DTreeRefineItem root;
+	root.source = 0;
+	root.target = 0;
+	root.depth = 1;
+	for (int c=0; c<4; ++c)
+		root.fraction[c] = m_nodes[0].sum[c] / total;
+	stack.push_back(root);
+
+	while (!stack.empty()) {
+		DTreeRefineItem item = stack.back();
+		stack.pop_back();
+		if (item.depth >= NORI_DTREE_MAX_DEPTH)
+			continue;
+
+		for (int c=0; c<4; ++c) {
+			if (item.fraction[c] <= threshold)
+				continue;
+
+			/* Subdivide quadrants with a large share of the total value.
+			   Quadrants that were leaves spread their value evenly */
+			DTreeRefineItem child;
+			child.target = (uint32_t) result.m_nodes.size();
+			child.depth = item.depth + 1;
+			result.m_nodes.push_back(Node());
+			result.m_nodes[item.target].children[c] = child.target;
+
+			if (item.source >= 0 && m_nodes[item.source].children[c]) {
+				child.source = (int) m_nodes[item.source].children[c];
+				for (int i=0; i<4; ++i)
+					child.fraction[i] = m_nodes[child.source].sum[i] / total;
+			} else {
+				child.source = -1;
+				for (int i=0; i<4; ++i)
+					child.fraction[i] = item.fraction[c] / 4;
+			}
+			stack.push_back(child);
+		}
+	}
+}
+
+void SDTreeLeaf::record(const Vector3f &d, float radiance) {
+	if (radiance > 0 && radiance < std::numeric_limits<float>::infinity()) {
+		float cosTheta = clamp(d.z(), -1.0f, 1.0f),
+		      phi = std::atan2(d.y(), d.x());
+		if (phi < 0)
+			phi += 2 * M_PI;
+		building.record(Point2f(
+			std::min((cosTheta + 1) * 0.5f, OneMinusEpsilon),
+			std::min(phi * INV_TWOPI, OneMinusEpsilon)), radiance);
+	}
+	atomicAdd(&sampleCount, 1.0f);
+}
+
+void SDTreeLeaf::recordReflected(float radiance) {
+	if (!(radiance >= 0 && radiance < std::numeric_limits<float>::infinity()))
+		return;
+	atomicAdd(&reflectedSum, radiance);
+	atomicAdd(&reflectedCount, 1.0f);
+}
+
+Vector3f SDTreeLeaf::sample(const Point2f &_sample) const {
+	Point2f p = sampling.sample(_sample);
+	float cosTheta = 2 * p.x() - 1,
+	      sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+	float sinPhi, cosPhi;
+	fastSinCos(2 * M_PI * p.y(), &sinPhi, &cosPhi);
+	return Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+}
+
+float SDTreeLeaf::pdf(const Vector3f &d) const {
+	float cosTheta = clamp(d.z(), -1.0f, 1.0f),
+	      phi = std::atan2(d.y(), d.x());
+	if (phi < 0)
+		phi += 2 * M_PI;
+	return sampling.pdf(Point2f(
+		std::min((cosTheta + 1) * 0.5f, OneMinusEpsilon),
+		std::min(phi * INV_TWOPI, OneMinusEpsilon))) * INV_FOURPI;
+}
+
+SDTree::SDTree(const BoundingBox3f &bbox) {
+	/* Use a cube, so that the regions of the leaves stay well-shaped */
+	Point3f center = bbox.getCenter();
+	float halfSize = 0.5f * bbox.getExtents().maxCoeff() * 1.01f + Epsilon;
+	m_bbox = BoundingBox3f(center - Vector3f::Constant(halfSize),
+		center + Vector3f::Constant(halfSize));
+
+	Node root;
+	root.children[0] = root.children[1] = 0;
+	root.leaf = 0;
+	m_nodes.push_back(root);
+	m_leaves.push_back(SDTreeLeaf());
+}
+
+SDTreeLeaf *SDTree::lookup(const Point3f &pos) {
+	Vector3f p = (pos - m_bbox.min).cwiseQuotient(m_bbox.getExtents());
+	uint32_t index = 0;
+	for (int depth=0; m_nodes[index].children[0]; ++depth) {
+		int axis = depth % 3;
+		int child = p[axis] < 0.5f ? 0 : 1;
+		p[axis] = 2 * p[axis] - child;
+		index = m_nodes[index].children[child];
+	}
+	return &m_leaves[m_nodes[index].leaf];
+}
+
+void SDTree::subdivide(uint32_t index, int depth, float threshold) {
+	uint32_t leaf = m_nodes[index].leaf;
+	if (m_leaves[leaf].sampleCount <= threshold || depth >= NORI_SDTREE_MAX_DEPTH)
+		return;
+
+	/* Both halves start with the distributions of the parent */
+	SDTreeLeaf copy = m_leaves[leaf];
+	copy.sampleCount *= 0.5f;
+	m_leaves[leaf] = copy;
+	m_leaves.push_back(copy);
+
+	Node child;
+	child.children[0] = child.children[1] = 0;
+	for (int i=0; i<2; ++i) {
+		child.leaf = i == 0 ? leaf : (uint32_t) (m_leaves.size() - 1);
+		m_nodes[index].children[i] = (uint32_t) m_nodes.size();
+		m_nodes.push_back(child);
+	}
+
+	uint32_t first = m_nodes[index].children[0], second = m_nodes[index].children[1];
+	subdivide(first, depth + 1, threshold);
+	subdivide(second, depth + 1, threshold);
+}
+
+void SDTree::refine(float spatialThreshold, float directionalThreshold) {
+	/* Split the leaves that received many samples */
+	std::vector<std::pair<uint32_t, int> > stack;
+	stack.push_back(std::make_pair(0u, 0));
+	while (!stack.empty()) {
+		uint32_t index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (m_nodes[index].children[0]) {
+			stack.push_back(std::make_pair(m_nodes[index].children[0], depth + 1));
+			stack.push_back(std::make_pair(m_nodes[index].children[1], depth + 1));
+		} else {
+			subdivide(index, depth, spatialThreshold);
+		}
+	}
+
+	/* Sample from what was recorded, and record into a refined tree */
+	for (size_t i=0; i<m_leaves.size(); ++i) {
+		SDTreeLeaf &leaf = m_leaves[i];
+		DTree refined;
+		leaf.building.refine(directionalThreshold, refined);
+		leaf.sampling = leaf.building;
+		leaf.building = refined;
+		leaf.sampleCount = 0;
+		if (leaf.reflectedCount > 0)
+			leaf.reflected = leaf.reflectedSum / leaf.reflectedCount;
+		leaf.reflectedSum = leaf.reflectedCount = 0;
+	}
+}
+
+size_t SDTree::getDirectionalNodeCount() const {
+	size_t result = 0;
+	for (size_t i=0; i<m_leaves.size(); ++i)
+		result += m_leaves[i].sampling.getNodeCount() + m_leaves[i].building.getNodeCount();
+	return result;
+}
+
+NORI_NAMESPACE_END
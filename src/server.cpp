@@ -0,0 +1,285 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/server.h>
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/render.h>
+#include <nori/block.h>
+#include <nori/denoiser.h>
+#include <nori/status.h>
+#include <boost/scoped_ptr.hpp>
+#include <QCryptographicHash>
+#include <QStringList>
+#include <QThread>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+
+/// Time between two checks for new job files (in milliseconds)
+#define NORI_SERVER_POLL_INTERVAL 200
+
+NORI_NAMESPACE_BEGIN
+
+/// A job file that is being processed
+struct ServerJob {
+	QString filename;
+	QString output;
+	Scene *scene;
+	/// Camera that replaces the scene's camera (or \c NULL)
+	Camera *camera;
+	RenderJob *job;
+	QString error;
+
+	inline ServerJob() : scene(NULL), camera(NULL), job(NULL) { }
+};
+
+/// Gives access to the (protected) sleep function of QThread
+class ServerSleep : public QThread {
+public:
+	static void msleep(unsigned long msecs) { QThread::msleep(msecs); }
+};
+
+/// Parse a vector given as three numbers separated by spaces or commas
+static Vector3f parseVector(const QString &key, const QString &str) {
+	QStringList list = QString(str).replace(',', ' ').split(' ', QString::SkipEmptyParts);
+	bool success = list.size() == 3;
+	Vector3f result;
+	for (int i=0; i<3 && success; ++i)
+		result[i] = list[i].toFloat(&success);
+	if (!success)
+		throw NoriException(QString("Cannot parse the 3-vector '%1' of parameter '%2'!")
+			.arg(str).arg(key));
+	return result;
+}
+
+RenderServer::RenderServer(const QString &directory, int loadFlags, int maxScenes)
+	: m_directory(directory), m_loadFlags(loadFlags), m_maxScenes(maxScenes),
+	  m_monitor(NULL), m_useCounter(0) {
+	if (!QDir(m_directory).exists())
+		throw NoriException(QString("The job directory \"%1\" doesn't exist!").arg(m_directory));
+	if (m_maxScenes < 1)
+		throw NoriException(QString("Invalid number of resident scenes %1 "
+			"(must be >= 1)").arg(m_maxScenes));
+
+	/* One pool of render threads for all jobs */
+	m_engine = new RenderEngine();
+}
+
+RenderServer::~RenderServer() {
+	delete m_engine;
+	for (std::map<QByteArray, CachedScene>::iterator it = m_scenes.begin();
+			it != m_scenes.end(); ++it)
+		delete it->second.scene;
+}
+
+void RenderServer::run() {
+	QDir dir(m_directory);
+	cout << "Waiting for jobs in \"" << qPrintable(m_directory) << "\" .." << endl;
+
+	while (true) {
+		QStringList files = dir.entryList(QStringList() << "*.job", QDir::Files, QDir::Name);
+		if (files.isEmpty()) {
+			if (dir.exists("shutdown")) {
+				dir.remove("shutdown");
+				break;
+			}
+			ServerSleep::msleep(NORI_SERVER_POLL_INTERVAL);
+			continue;
+		}
+
+		/* Queue all jobs before waiting for the first one */
+		std::vector<ServerJob> jobs(files.size());
+		for (int i=0; i<files.size(); ++i) {
+			jobs[i].filename = dir.filePath(files[i]);
+			submit(jobs[i]);
+		}
+		for (size_t i=0; i<jobs.size(); ++i)
+			finish(jobs[i]);
+
+		releaseScenes();
+	}
+
+	cout << "Shutting down the render server." << endl;
+}
+
+void RenderServer::submit(ServerJob &job) {
+	cout << "Starting job \"" << qPrintable(job.filename) << "\"" << endl;
+	try {
+		QFile file(job.filename);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+			throw NoriException(QString("Unable to open the job file \"%1\"").arg(job.filename));
+
+		std::map<QString, QString> params;
+		while (!file.atEnd()) {
+			QString line = QString::fromLocal8Bit(file.readLine()).trimmed();
+			if (line.isEmpty() || line.startsWith("#"))
+				continue;
+			int pos = line.indexOf('=');
+			if (pos < 0)
+				throw NoriException(QString("Invalid line \"%1\" (expected key = value)").arg(line));
+			params[line.left(pos).trimmed()] = line.mid(pos + 1).trimmed();
+		}
+		file.close();
+
+		QDir dir(m_directory);
+		if (params.find("scene") == params.end())
+			throw NoriException("The job doesn't specify a scene!");
+		job.scene = getScene(dir.absoluteFilePath(params["scene"]));
+
+		if (params.find("output") != params.end())
+			job.output = dir.absoluteFilePath(params["output"]);
+		else
+			job.output = job.filename.left(job.filename.length() - 4) + ".exr";
+
+		int sampleCount = 0;
+		if (params.find("spp") != params.end()) {
+			bool success;
+			sampleCount = params["spp"].toInt(&success);
+			if (!success || sampleCount < 0)
+				throw NoriException(QString("Invalid spp value '%1' (must be >= 0)").arg(params["spp"]));
+		}
+
+		if (params.find("origin") != params.end() || params.find("target") != params.end()) {
+			if (params.find("origin") == params.end() || params.find("target") == params.end())
+				throw NoriException("A camera override requires both 'origin' and 'target'!");
+
+			/* Same convention as the <lookat> tag of scene files */
+			Point3f origin = parseVector("origin", params["origin"]);
+			Point3f target = parseVector("target", params["target"]);
+			Vector3f up = params.find("up") != params.end()
+				? parseVector("up", params["up"]).normalized() : Vector3f(0, 1, 0);
+			Vector3f dir = (target - origin).normalized();
+			Vector3f left = up.cross(dir);
+			Vector3f newUp = dir.cross(left);
+
+			Eigen::Matrix4f trafo;
+			trafo << left, newUp, dir, origin,
+				     0, 0, 0, 1;
+
+			float fov = 30.0f;
+			if (params.find("fov") != params.end()) {
+				bool success;
+				fov = params["fov"].toFloat(&success);
+				if (!success || fov <= 0 || fov >= 180)
+					throw NoriException(QString("Invalid fov value '%1'").arg(params["fov"]));
+			}
+
+			PropertyList propList;
+			propList.setInteger("width", job.scene->getCamera()->getOutputSize().x());
+			propList.setInteger("height", job.scene->getCamera()->getOutputSize().y());
+			propList.setTransform("toWorld", Transform(trafo));
+			propList.setFloat("fov", fov);
+			job.camera = static_cast<Camera *>(
+				NoriObjectFactory::createInstance("perspective", propList));
+			job.camera->activate();
+		}
+
+		job.job = new RenderJob(job.scene, job.camera, (uint32_t) sampleCount);
+		m_engine->submit(job.job);
+		if (m_monitor)
+			m_monitor->addJob(job.job, QFileInfo(job.filename).fileName());
+	} catch (const NoriException &ex) {
+		job.error = ex.getReason();
+	} catch (const std::exception &ex) {
+		job.error = ex.what();
+	}
+}
+
+void RenderServer::finish(ServerJob &job) {
+	if (job.job) {
+		job.job->wait();
+		if (m_monitor)
+			m_monitor->removeJob(job.job);
+		try {
+			boost::scoped_ptr<Bitmap> bitmap;
+			if (job.scene->getDenoise()) {
+				Denoiser denoiser(job.scene->getDenoiseRadius(), job.scene->getDenoiseStrength());
+				bitmap.reset(denoiser.denoise(*job.job->getOutput()));
+			} else {
+				bitmap.reset(job.job->getOutput()->toBitmap());
+			}
+			bitmap->save(job.output, job.scene->getOutputOptions());
+		} catch (const NoriException &ex) {
+			job.error = ex.getReason();
+		} catch (const std::exception &ex) {
+			job.error = ex.what();
+		}
+		delete job.job;
+	}
+	delete job.camera;
+
+	/* Replace the job file by one that reports the outcome */
+	QString status = job.filename.left(job.filename.length() - 4)
+		+ (job.error.isEmpty() ? ".done" : ".failed");
+	QFile::remove(job.filename);
+	QFile file(status);
+	if (file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+		file.write((job.error.isEmpty() ? job.output : job.error).toLocal8Bit());
+		file.write("\n");
+		file.close();
+	}
+
+	if (job.error.isEmpty())
+		cout << "Finished job \"" << qPrintable(job.filename) << "\", wrote \""
+			 << qPrintable(job.output) << "\"" << endl;
+	else
+		cerr << "Job \"" << qPrintable(job.filename) << "\" failed: "
+			 << qPrintable(job.error) << endl;
+}
+
+Scene *RenderServer::getScene(const QString &filename) {
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly))
+		throw NoriException(QString("Unable to open the file \"%1\"").arg(filename));
+	QByteArray hash = QCryptographicHash::hash(file.readAll(), QCryptographicHash::Md5);
+	file.close();
+
+	std::map<QByteArray, CachedScene>::iterator it = m_scenes.find(hash);
+	if (it == m_scenes.end()) {
+		NoriObject *root = loadScene(filename, m_loadFlags);
+		if (root->getClassType() != NoriObject::EScene) {
+			delete root;
+			throw NoriException(QString("The file \"%1\" doesn't contain a scene!").arg(filename));
+		}
+		CachedScene cached;
+		cached.scene = static_cast<Scene *>(root);
+		it = m_scenes.insert(std::make_pair(hash, cached)).first;
+	} else {
+		cout << "Using the loaded scene \"" << qPrintable(filename) << "\"" << endl;
+	}
+
+	it->second.lastUse = ++m_useCounter;
+	return it->second.scene;
+}
+
+void RenderServer::releaseScenes() {
+	while ((int) m_scenes.size() > m_maxScenes) {
+		std::map<QByteArray, CachedScene>::iterator oldest = m_scenes.begin();
+		for (std::map<QByteArray, CachedScene>::iterator it = m_scenes.begin();
+				it != m_scenes.end(); ++it) {
+			if (it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		}
+		delete oldest->second.scene;
+		m_scenes.erase(oldest);
+	}
+}
+
+NORI_NAMESPACE_END
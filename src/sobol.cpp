@@ -0,0 +1,154 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+
+NORI_NAMESPACE_BEGIN
+
+/* Generator matrices of the first two Sobol dimensions (one column
+   per bit of the sample index, most significant bit first) */
+static const uint32_t sobolMatrices[2][32] = {
+	{ 0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+	  0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+	  0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+	  0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001 },
+	{ 0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+	  0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+	  0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+	  0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff }
+};
+
+/// Evaluate dimension \c dim of the Sobol sequence (as a 0.32 fixed point value)
+static inline uint32_t sobol(uint32_t index, int dim) {
+	uint32_t result = 0;
+	for (int bit=0; index != 0; ++bit, index >>= 1) {
+		/* Branch-free so that the compiler can unroll/vectorize it */
+		result ^= sobolMatrices[dim][bit] & (0u - (index & 1));
+	}
+	return result;
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/**
+ * Nested uniform (Owen) scrambling of a 0.32 fixed point value, using the
+ * hash-based approach of Burley ("Practical Hash-based Owen Scrambling",
+ * JCGT 2020). Each bit is flipped depending on the seed and all
+ * preceding (more significant) bits.
+ */
+static inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+/// Combine a seed with a value (decorrelates the dimensions of a sample)
+static inline uint32_t hashCombine(uint32_t seed, uint32_t value) {
+	uint32_t h = value * 0x9e3779b9u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return seed ^ (h + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+/// Convert a 0.32 fixed point value to a float on [0, 1)
+static inline float toFloat(uint32_t x) {
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * Sobol sampling with Owen scrambling - generates the samples of a
+ * pixel from the first two dimensions of the Sobol sequence, which are
+ * (0,2)-sequences with excellent stratification at power-of-two sample
+ * counts. Following Burley (JCGT 2020), higher dimensions are "padded":
+ * every 1D or 2D component of a sample draws from an independently
+ * shuffled and Owen-scrambled copy of the sequence, where the seeds
+ * are derived from a hash of the pixel and the component's index.
+ */
+class Sobol : public Sampler {
+public:
+	Sobol(const PropertyList &propList) {
+		configure(propList);
+		if ((m_sampleCount & (m_sampleCount - 1)) != 0)
+			cerr << "Warning: the Sobol sampler works best with power-of-two sample counts" << endl;
+		m_scramble = 0;
+		m_sampleIndex = 0;
+		m_dimension = 0;
+	}
+
+	Sampler *clone() {
+		Sobol *cloned = new Sobol();
+		cloned->copySettings(this);
+		cloned->m_scramble = 0;
+		cloned->m_sampleIndex = 0;
+		cloned->m_dimension = 0;
+		return cloned;
+	}
+
+	void generate(const Point2i &pixel, uint32_t firstSample) {
+		/* The scrambling only depends on the pixel, so that passes of
+		   a progressive rendering continue the same sequence */
+		m_scramble = (uint32_t) hashPixel(pixel);
+		m_sampleIndex = firstSample;
+		m_dimension = 0;
+	}
+
+	void advance() {
+		m_sampleIndex++;
+		m_dimension = 0;
+	}
+
+	float next1D() {
+		uint32_t seed = hashCombine(m_scramble, m_dimension++);
+		uint32_t index = owenScramble(m_sampleIndex, seed);
+		return toFloat(owenScramble(sobol(index, 0), hashCombine(seed, 1)));
+	}
+
+	Point2f next2D() {
+		uint32_t seed = hashCombine(m_scramble, m_dimension++);
+		uint32_t index = owenScramble(m_sampleIndex, seed);
+		return Point2f(
+			toFloat(owenScramble(sobol(index, 0), hashCombine(seed, 1))),
+			toFloat(owenScramble(sobol(index, 1), hashCombine(seed, 2)))
+		);
+	}
+
+	QString toString() const {
+		return QString("Sobol[sampleCount=%1, seed=%2]").arg(m_sampleCount).arg(m_seed);
+	}
+protected:
+	Sobol() { }
+protected:
+	/// Per-pixel scrambling seed
+	uint32_t m_scramble;
+	uint32_t m_sampleIndex;
+	uint32_t m_dimension;
+};
+
+NORI_REGISTER_CLASS(Sobol, "sobol");
+NORI_NAMESPACE_END
@@ -0,0 +1,146 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/camera.h>
+#include <nori/rfilter.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Spherical camera that renders the full sphere of directions
+ * around its position in the equirectangular (latitude-longitude) 
+ * layout, e.g. for 360 degree panoramas and VR
+ *
+ * The horizontal image axis covers 360 degrees of longitude, with the
+ * view direction (the camera's z axis) in the center of the image. The
+ * vertical axis covers 180 degrees of latitude, from the camera's y axis
+ * (the up direction) at the top to its opposite at the bottom. Every 
+ * pixel thus integrates over its own solid angle of the sphere, without
+ * the overlaps and seams of stitched perspective views. An aspect ratio
+ * of 2:1 gives square pixels at the equator.
+ *
+ * The ray interval is given by the \c nearClip and \c farClip distances,
+ * and the shutter interval is specified as for the perspective camera.
+ */
+class SphericalCamera : public Camera {
+public:
+	SphericalCamera(const PropertyList &propList) {
+		/* Width and height in pixels. Default: 2048x1024 */
+		m_outputSize.x() = propList.getInteger("width", 2048);
+		m_outputSize.y() = propList.getInteger("height", 1024);
+
+		/* Name of the view in a multi-view rendering. Default: none */
+		m_name = propList.getString("name", "");
+
+		/* Specifies an optional camera-to-world transformation. Default: none */
+		m_cameraToWorld = propList.getTransform("toWorld", Transform());
+
+		/* Near and far clipping distances in world-space units */
+		m_nearClip = propList.getFloat("nearClip", 1e-4f);
+		m_farClip = propList.getFloat("farClip", 1e4f);
+
+		/* Shutter interval (in the time units of the instance motion keys) */
+		m_shutterOpen = propList.getFloat("shutterOpen", 0.0f);
+		m_shutterClose = propList.getFloat("shutterClose", m_shutterOpen);
+		if (m_shutterClose < m_shutterOpen)
+			throw NoriException(QString("SphericalCamera: the shutter closes (%1) "
+				"before it opens (%2)!").arg(m_shutterClose).arg(m_shutterOpen));
+
+		m_rfilter = NULL;
+	}
+
+	void activate() {
+		/* Longitude and colatitude per pixel */
+		m_scale = Vector2f(2 * M_PI / m_outputSize.x(), M_PI / m_outputSize.y());
+		m_origin = m_cameraToWorld * Point3f(0.0f, 0.0f, 0.0f);
+
+		/* If no reconstruction filter was assigned, instantiate a Gaussian filter */
+		if (!m_rfilter)
+			m_rfilter = static_cast<ReconstructionFilter *>(
+				NoriObjectFactory::createInstance("gaussian", PropertyList()));
+	}
+
+	Color3f sampleRay(Ray3f &ray,
+			const Point2f &samplePosition,
+			const Point2f &apertureSample) const {
+		ray.o = m_origin;
+		ray.d = direction(samplePosition);
+		ray.mint = m_nearClip;
+		ray.maxt = m_farClip;
+		ray.update();
+
+		/* Ray differentials: rays through the neighboring pixels */
+		ray.rxOrigin = ray.ryOrigin = ray.o;
+		ray.rxDirection = direction(samplePosition + Point2f(1.0f, 0.0f));
+		ray.ryDirection = direction(samplePosition + Point2f(0.0f, 1.0f));
+		ray.hasDifferentials = true;
+
+		return Color3f(1.0f);
+	}
+
+	void addChild(NoriObject *obj) {
+		switch (obj->getClassType()) {
+			case EReconstructionFilter:
+				if (m_rfilter)
+					throw NoriException("Camera: tried to register multiple reconstruction filters!");
+				m_rfilter = static_cast<ReconstructionFilter *>(obj);
+				break;
+
+			default:
+				throw NoriException(QString("Camera::addChild(<%1>) is not supported!").arg(
+					classTypeName(obj->getClassType())));
+		}
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString(
+			"SphericalCamera[\n"
+			"  cameraToWorld = %1,\n"
+			"  outputSize = %2,\n"
+			"  clip = [%3, %4],\n"
+			"  shutter = [%5, %6],\n"
+			"  rfilter = %7\n"
+			"]")
+		.arg(indent(m_cameraToWorld.toString(), 18))
+		.arg(m_outputSize.toString())
+		.arg(m_nearClip)
+		.arg(m_farClip)
+		.arg(m_shutterOpen)
+		.arg(m_shutterClose)
+		.arg(indent(m_rfilter->toString()));
+	}
+protected:
+	/// Return the world space direction through a film position
+	Vector3f direction(const Point2f &samplePosition) const {
+		float phi = (samplePosition.x() - 0.5f * m_outputSize.x()) * m_scale.x(),
+		      theta = samplePosition.y() * m_scale.y();
+		float sinTheta = std::sin(theta);
+		Vector3f local(sinTheta * std::sin(phi), std::cos(theta), sinTheta * std::cos(phi));
+		return (m_cameraToWorld * local).normalized();
+	}
+private:
+	Transform m_cameraToWorld;
+	Point3f m_origin;
+	Vector2f m_scale;
+	float m_nearClip;
+	float m_farClip;
+};
+
+NORI_REGISTER_CLASS(SphericalCamera, "spherical");
+NORI_NAMESPACE_END
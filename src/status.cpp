@@ -0,0 +1,299 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/status.h>
+#include <QElapsedTimer>
+
+#if defined(PLATFORM_WINDOWS)
+#include <winsock2.h>
+typedef int socklen_t;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#define closesocket close
+#endif
+
+/// How often the monitoring thread checks for connections and shutdown (ms)
+#define NORI_STATUS_POLL_INTERVAL 100
+
+NORI_NAMESPACE_BEGIN
+
+/// Helper class to access the protected sleep function of QThread
+class StatusSleep : public QThread {
+public:
+	static void msleep(unsigned long msecs) { QThread::msleep(msecs); }
+};
+
+StatusMonitor::StatusMonitor(float interval, int port) : m_interval(interval),
+		m_socket(-1), m_shutdown(false) {
+	if (port < 0 || port > 65535)
+		throw NoriException(QString("Invalid status port %1").arg(port));
+
+	if (port > 0) {
+#if defined(PLATFORM_WINDOWS)
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw NoriException("Unable to initialize Winsock");
+#endif
+		int fd = (int) socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(int));
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((unsigned short) port);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+				|| listen(fd, 4) != 0) {
+			if (fd >= 0)
+				closesocket(fd);
+			throw NoriException(QString("Unable to listen on the status port %1").arg(port));
+		}
+		m_socket = fd;
+		cout << "Serving the render status on port " << port
+			 << " (/metrics, /status)" << endl;
+	}
+
+	start();
+}
+
+StatusMonitor::~StatusMonitor() {
+	m_shutdown = true;
+	wait();
+	if (m_socket >= 0) {
+		closesocket((int) m_socket);
+#if defined(PLATFORM_WINDOWS)
+		WSACleanup();
+#endif
+	}
+}
+
+void StatusMonitor::addJob(const RenderJob *job, const QString &name) {
+	QMutexLocker locker(&m_mutex);
+	MonitoredJob entry;
+	entry.job = job;
+	entry.name = name;
+	m_jobs.push_back(entry);
+}
+
+void StatusMonitor::removeJob(const RenderJob *job) {
+	QMutexLocker locker(&m_mutex);
+	for (size_t i=0; i<m_jobs.size(); ++i) {
+		if (m_jobs[i].job != job)
+			continue;
+		if (m_interval > 0)
+			cout << "NORI_STATUS " << qPrintable(toJSON(m_jobs[i].name,
+				job->getStatus())) << endl;
+		m_jobs.erase(m_jobs.begin() + i);
+		return;
+	}
+}
+
+void StatusMonitor::run() {
+	QElapsedTimer timer;
+	timer.start();
+	qint64 nextStatus = (qint64) (1000 * m_interval);
+
+	while (!m_shutdown) {
+		if (m_socket >= 0) {
+			/* Wait for a connection, but check for shutdown now and then */
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET((int) m_socket, &fds);
+			struct timeval timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_usec = NORI_STATUS_POLL_INTERVAL * 1000;
+			if (select((int) m_socket + 1, &fds, NULL, NULL, &timeout) > 0) {
+				int connection = (int) accept((int) m_socket, NULL, NULL);
+				if (connection >= 0) {
+					serve(connection);
+					closesocket(connection);
+				}
+			}
+		} else {
+			StatusSleep::msleep(NORI_STATUS_POLL_INTERVAL);
+		}
+
+		if (m_interval > 0 && timer.elapsed() >= nextStatus) {
+			QMutexLocker locker(&m_mutex);
+			printStatus();
+			nextStatus = timer.elapsed() + (qint64) (1000 * m_interval);
+		}
+	}
+}
+
+QString StatusMonitor::toJSON(const QString &name, const RenderJob::Status &status) {
+	const char *state = status.finished ? "finished"
+		: (status.started ? "rendering" : "queued");
+	/* The name is appended separately, so that it can't contain placeholders */
+	return "{\"job\": " + toJSONString(name) + QString(", \"state\": \"%1\", "
+		"\"elapsed\": %2, \"pass\": %3, \"passes\": %4, \"finishedBlocks\": %5, "
+		"\"remainingBlocks\": %6, \"samples\": %7, \"totalSamples\": %8, \"progress\": %9, ")
+		.arg(state)
+		.arg(status.elapsed / 1000.0)
+		.arg(status.pass)
+		.arg(status.passCount)
+		.arg(status.finishedBlocks)
+		.arg(status.remainingBlocks)
+		.arg((qulonglong) status.sampleCount)
+		.arg((qulonglong) status.totalSampleCount)
+		.arg(status.getProgress())
+		+ QString("\"samplesPerSecond\": %1, \"rays\": %2, \"shadowRays\": %3, "
+		"\"raysPerSecond\": %4, \"eta\": %5}")
+		.arg(status.getSampleRate(), 0, 'f', 0)
+		.arg((qulonglong) status.rayCount)
+		.arg((qulonglong) status.shadowRayCount)
+		.arg(status.getRayRate(), 0, 'f', 0)
+		.arg(status.remainingTime < 0 ? QString("null")
+			: QString::number(status.remainingTime, 'f', 2));
+}
+
+void StatusMonitor::printStatus() const {
+	for (size_t i=0; i<m_jobs.size(); ++i)
+		cout << "NORI_STATUS " << qPrintable(toJSON(m_jobs[i].name,
+			m_jobs[i].job->getStatus())) << endl;
+}
+
+QString StatusMonitor::toPrometheus() const {
+	/* Metric names, types and descriptions */
+	static const char *metrics[][3] = {
+		{ "nori_render_progress", "gauge", "Fraction of the planned samples that were rendered" },
+		{ "nori_render_elapsed_seconds", "gauge", "Time spent rendering" },
+		{ "nori_render_eta_seconds", "gauge", "Estimated time until the job is finished" },
+		{ "nori_render_pass", "gauge", "Index of the current pass" },
+		{ "nori_render_passes", "gauge", "Number of passes (an upper bound in adaptive mode)" },
+		{ "nori_render_blocks_finished", "gauge", "Number of finished blocks" },
+		{ "nori_render_blocks_remaining", "gauge", "Number of blocks in flight or yet to be rendered" },
+		{ "nori_render_samples_total", "counter", "Pixel samples rendered" },
+		{ "nori_render_samples_planned", "gauge", "Pixel samples planned in total" },
+		{ "nori_render_samples_per_second", "gauge", "Average pixel samples per second" },
+		{ "nori_render_rays_total", "counter", "Rays traced (including shadow rays)" },
+		{ "nori_render_rays_per_second", "gauge", "Average rays per second (including shadow rays)" }
+	};
+	const int metricCount = (int) (sizeof(metrics) / sizeof(metrics[0]));
+
+	std::vector<RenderJob::Status> statuses(m_jobs.size());
+	std::vector<QString> labels(m_jobs.size());
+	for (size_t i=0; i<m_jobs.size(); ++i) {
+		statuses[i] = m_jobs[i].job->getStatus();
+		QString name = m_jobs[i].name;
+		name.replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n");
+		labels[i] = "{job=\"" + name + "\"}";
+	}
+
+	QString result = QString("# HELP nori_render_jobs Number of monitored render jobs\n"
+		"# TYPE nori_render_jobs gauge\nnori_render_jobs %1\n").arg(m_jobs.size());
+	for (int j=0; j<metricCount; ++j) {
+		result += QString("# HELP %1 %2\n# TYPE %1 %3\n")
+			.arg(metrics[j][0]).arg(metrics[j][2]).arg(metrics[j][1]);
+		for (size_t i=0; i<statuses.size(); ++i) {
+			const RenderJob::Status &status = statuses[i];
+			QString value;
+			switch (j) {
+				case 0: value = QString::number(status.getProgress()); break;
+				case 1: value = QString::number(status.elapsed / 1000.0); break;
+				case 2:
+					if (status.remainingTime < 0)
+						continue;
+					value = QString::number(status.remainingTime);
+					break;
+				case 3: value = QString::number(status.pass); break;
+				case 4: value = QString::number(status.passCount); break;
+				case 5: value = QString::number(status.finishedBlocks); break;
+				case 6: value = QString::number(status.remainingBlocks); break;
+				case 7: value = QString::number((qulonglong) status.sampleCount); break;
+				case 8: value = QString::number((qulonglong) status.totalSampleCount); break;
+				case 9: value = QString::number(status.getSampleRate(), 'f', 0); break;
+				case 10: value = QString::number((qulonglong)
+					(status.rayCount + status.shadowRayCount)); break;
+				default: value = QString::number(status.getRayRate(), 'f', 0); break;
+			}
+			result += metrics[j][0] + labels[i] + " " + value + "\n";
+		}
+	}
+	return result;
+}
+
+void StatusMonitor::serve(intptr_t connection) {
+	/* Don't let a client that never sends its request block the monitor */
+#if defined(PLATFORM_WINDOWS)
+	DWORD timeout = 1000;
+#else
+	struct timeval timeout;
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+#endif
+	setsockopt((int) connection, SOL_SOCKET, SO_RCVTIMEO,
+		(const char *) &timeout, sizeof(timeout));
+
+	/* Only the request line matters; read until the end of the header */
+	QByteArray request;
+	char buffer[1024];
+	while (request.size() < 8192 && !request.contains("\r\n\r\n")) {
+		int n = (int) recv((int) connection, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			break;
+		request.append(buffer, n);
+	}
+
+	QList<QByteArray> requestLine = request.left(request.indexOf("\r\n")).split(' ');
+	QByteArray path = requestLine.size() >= 2 ? requestLine[1] : QByteArray();
+	QString status("200 OK"), contentType, body;
+	if (requestLine.isEmpty() || requestLine[0] != "GET") {
+		status = "405 Method Not Allowed";
+		contentType = "text/plain";
+		body = "Only GET requests are supported\n";
+	} else if (path == "/metrics") {
+		QMutexLocker locker(&m_mutex);
+		contentType = "text/plain; version=0.0.4";
+		body = toPrometheus();
+	} else if (path == "/status" || path == "/") {
+		QMutexLocker locker(&m_mutex);
+		contentType = "application/json";
+		body = "{\"jobs\": [";
+		for (size_t i=0; i<m_jobs.size(); ++i)
+			body += (i > 0 ? ",\n  " : "\n  ")
+				+ toJSON(m_jobs[i].name, m_jobs[i].job->getStatus());
+		body += "\n]}\n";
+	} else {
+		status = "404 Not Found";
+		contentType = "text/plain";
+		body = "Not found (try /metrics or /status)\n";
+	}
+
+	QByteArray content = body.toUtf8();
+	QByteArray response = QString("HTTP/1.0 %1\r\nContent-Type: %2\r\n"
+		"Content-Length: %3\r\nConnection: close\r\n\r\n")
+		.arg(status).arg(contentType).arg(content.size()).toLatin1() + content;
+	const char *data = response.constData();
+	int remaining = response.size();
+	while (remaining > 0) {
+		int n = (int) send((int) connection, data, remaining, 0);
+		if (n <= 0)
+			break;
+		data += n;
+		remaining -= n;
+	}
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,155 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+#include <nori/pcg32.h>
+#include <nori/memreport.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Stratified sampling - divides each of the first \c dimension 1D and
+ * 2D components of a pixel's samples into strata and places one sample
+ * in each of them (randomly jittered, and randomly shuffled between the
+ * dimensions). 2D components use a jittered grid when the sample count
+ * is a square number and Latin hypercube sampling otherwise. Further
+ * components are generated independently.
+ */
+class Stratified : public Sampler {
+public:
+	Stratified(const PropertyList &propList) {
+		configure(propList);
+		m_maxDimension = propList.getInteger("dimension", 4);
+		if (m_maxDimension < 0)
+			throw NoriException("Stratified: invalid dimension!");
+
+		m_resolution = (size_t) std::sqrt((float) m_sampleCount);
+		while (m_resolution * m_resolution > m_sampleCount)
+			--m_resolution;
+		while ((m_resolution+1) * (m_resolution+1) <= m_sampleCount)
+			++m_resolution;
+		if (m_resolution * m_resolution != m_sampleCount)
+			m_resolution = 0;
+
+		m_samples1D.resize(m_maxDimension * m_sampleCount);
+		m_samples2D.resize(m_maxDimension * m_sampleCount);
+		m_sampleIndex = 0;
+		m_dimension1D = m_dimension2D = 0;
+	}
+
+	Sampler *clone() {
+		Stratified *cloned = new Stratified();
+		cloned->copySettings(this);
+		cloned->m_maxDimension = m_maxDimension;
+		cloned->m_resolution = m_resolution;
+		cloned->m_samples1D.resize(m_samples1D.size());
+		cloned->m_samples2D.resize(m_samples2D.size());
+		cloned->m_sampleIndex = 0;
+		cloned->m_dimension1D = cloned->m_dimension2D = 0;
+		return cloned;
+	}
+
+	void generate(const Point2i &pixel, uint32_t firstSample) {
+		/* The strata only depend on the pixel, so that passes of a 
+		   progressive rendering continue with the same sample set */
+		m_random.seed(hashPixel(pixel));
+		for (int dim=0; dim<m_maxDimension; ++dim) {
+			float *samples1D = &m_samples1D[dim * m_sampleCount];
+			Point2f *samples2D = &m_samples2D[dim * m_sampleCount];
+			float invCount = 1.0f / m_sampleCount;
+
+			for (size_t i=0; i<m_sampleCount; ++i)
+				samples1D[i] = std::min((i + m_random.nextFloat()) * invCount, OneMinusEpsilon);
+			shuffle(samples1D, m_sampleCount);
+
+			if (m_resolution > 0) {
+				/* Jittered grid */
+				float invResolution = 1.0f / m_resolution;
+				for (size_t y=0, i=0; y<m_resolution; ++y) {
+					for (size_t x=0; x<m_resolution; ++x, ++i) {
+						float jx = m_random.nextFloat(), jy = m_random.nextFloat();
+						samples2D[i] = Point2f(
+							std::min((x + jx) * invResolution, OneMinusEpsilon),
+							std::min((y + jy) * invResolution, OneMinusEpsilon));
+					}
+				}
+			} else {
+				/* Latin hypercube: independently shuffled 1D strata per axis */
+				for (int axis=0; axis<2; ++axis) {
+					for (size_t i=0; i<m_sampleCount; ++i)
+						samples2D[i][axis] = std::min((i + m_random.nextFloat()) * invCount, OneMinusEpsilon);
+					for (size_t i=m_sampleCount-1; i>0; --i)
+						std::swap(samples2D[i][axis], samples2D[m_random.nextUInt() % (i+1)][axis]);
+				}
+			}
+			shuffle(samples2D, m_sampleCount);
+		}
+
+		/* Components beyond the strata are independent for every pass */
+		m_random.seed(hashPixel(pixel, firstSample + 1));
+		m_sampleIndex = firstSample;
+		m_dimension1D = m_dimension2D = 0;
+	}
+
+	void advance() {
+		m_sampleIndex++;
+		m_dimension1D = m_dimension2D = 0;
+	}
+
+	float next1D() {
+		if (m_dimension1D < m_maxDimension && m_sampleIndex < m_sampleCount)
+			return m_samples1D[m_dimension1D++ * m_sampleCount + m_sampleIndex];
+		return m_random.nextFloat();
+	}
+
+	Point2f next2D() {
+		if (m_dimension2D < m_maxDimension && m_sampleIndex < m_sampleCount)
+			return m_samples2D[m_dimension2D++ * m_sampleCount + m_sampleIndex];
+		float x = m_random.nextFloat();
+		return Point2f(x, m_random.nextFloat());
+	}
+
+	void reportMemory(MemoryReport &report) const {
+		report.add("samplerTables", m_samples1D.capacity() * sizeof(float)
+			+ m_samples2D.capacity() * sizeof(Point2f));
+	}
+
+	QString toString() const {
+		return QString("Stratified[sampleCount=%1, dimension=%2, seed=%3]")
+			.arg(m_sampleCount).arg(m_maxDimension).arg(m_seed);
+	}
+protected:
+	Stratified() { }
+
+	/// Randomly permute an array (Fisher-Yates)
+	template <typename T> void shuffle(T *values, size_t count) {
+		for (size_t i=count-1; i>0; --i)
+			std::swap(values[i], values[m_random.nextUInt() % (i+1)]);
+	}
+protected:
+	PCG32 m_random;
+	int m_maxDimension;
+	size_t m_resolution;
+	std::vector<float> m_samples1D;
+	std::vector<Point2f> m_samples2D;
+	size_t m_sampleIndex;
+	int m_dimension1D, m_dimension2D;
+};
+
+NORI_REGISTER_CLASS(Stratified, "stratified");
+NORI_NAMESPACE_END
@@ -0,0 +1,184 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/phase.h>
+#include <nori/frame.h>
+#include <nori/fastmath.h>
+#include <QStringList>
+#include <QRegExp>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tabulated phase function (e.g. measured data or a mixture of
+ * several lobes)
+ *
+ * The phase function is specified by its values at \c n equally spaced
+ * scattering angles from 0 (forward scattering, i.e. \c wo = -\c wi) to
+ * 180 degrees (\c values parameter, a list of numbers separated by
+ * commas or spaces), which are interpolated linearly. They don't need
+ * to be normalized.
+ *
+ * When the phase function is activated, it is resampled on a fine grid
+ * over the cosine of the scattering angle, and the inverse of its
+ * cumulative distribution function is tabulated at \c resolution
+ * equally spaced points. Sampling then is a table lookup with linear
+ * interpolation instead of a numerical inversion, and the sampling
+ * density is piecewise constant between the tabulated points, which
+ * \ref pdf() finds using a binary search.
+ */
+class TabulatedPhaseFunction : public PhaseFunction {
+public:
+	TabulatedPhaseFunction(const PropertyList &propList) {
+		QString values = propList.getString("values");
+		QStringList list = values.split(QRegExp("[\\s,]+"), QString::SkipEmptyParts);
+		for (int i=0; i<list.size(); ++i) {
+			bool success;
+			float value = list[i].toFloat(&success);
+			if (!success || value < 0)
+				throw NoriException(QString("TabulatedPhaseFunction: invalid value '%1' "
+					"(must be a nonnegative number)").arg(list[i]));
+			m_input.push_back(value);
+		}
+		if (m_input.size() < 2)
+			throw NoriException("TabulatedPhaseFunction: at least two values are required!");
+
+		/* Number of entries of the inverse CDF table */
+		m_resolution = propList.getInteger("resolution", 1024);
+		if (m_resolution < 2)
+			throw NoriException(QString("TabulatedPhaseFunction: invalid resolution %1 "
+				"(must be >= 2)").arg(m_resolution));
+	}
+
+	/// Evaluate the input data at a scattering angle (in radians)
+	float evalInput(float theta) const {
+		float x = theta * INV_PI * (m_input.size() - 1);
+		int i = std::min(std::max((int) x, 0), (int) m_input.size() - 2);
+		float w = std::min(std::max(x - i, 0.0f), 1.0f);
+		return (1 - w) * m_input[i] + w * m_input[i+1];
+	}
+
+	void activate() {
+		/* Resample the phase function over the cosine of the scattering angle
+		   (it's piecewise linear there from now on) and integrate it */
+		int n = std::max(4 * m_resolution, 1024);
+		m_values.resize(n + 1);
+		m_cdf.resize(n + 1);
+		for (int j=0; j<=n; ++j)
+			m_values[j] = evalInput(std::acos(clamp(-1.0f + 2.0f * j / n, -1.0f, 1.0f)));
+		m_cdf[0] = 0;
+		for (int j=0; j<n; ++j)
+			m_cdf[j+1] = m_cdf[j] + 0.5f * (m_values[j] + m_values[j+1]) * (2.0f / n);
+
+		float integral = m_cdf[n];
+		if (integral <= 0)
+			throw NoriException("TabulatedPhaseFunction: the phase function is zero everywhere!");
+
+		/* Normalize, so that the phase function integrates to 1 over the sphere */
+		for (int j=0; j<=n; ++j) {
+			m_values[j] *= INV_TWOPI / integral;
+			m_cdf[j] /= integral;
+		}
+
+		/* Tabulate the inverse CDF, inverting the (piecewise quadratic) CDF exactly */
+		m_inverseCDF.resize(m_resolution + 1);
+		m_inverseCDF[0] = -1.0f;
+		m_inverseCDF[m_resolution] = 1.0f;
+		int j = 0;
+		for (int k=1; k<m_resolution; ++k) {
+			float u = (float) k / m_resolution;
+			while (j < n - 1 && m_cdf[j+1] < u)
+				++j;
+
+			/* Solve CDF(mu) = u within the segment [mu_j, mu_j+1] */
+			float dmu = 2.0f / n, f0 = m_values[j] * 2 * M_PI,
+			      f1 = m_values[j+1] * 2 * M_PI, slope = (f1 - f0) / dmu,
+			      target = u - m_cdf[j], x;
+			if (std::abs(slope) < 1e-6f * std::max(f0, f1))
+				x = f0 > 0 ? target / f0 : 0.0f;
+			else
+				x = (std::sqrt(std::max(0.0f, f0 * f0 + 2 * slope * target)) - f0) / slope;
+			m_inverseCDF[k] = clamp(-1.0f + j * dmu + clamp(x, 0.0f, dmu), -1.0f, 1.0f);
+		}
+	}
+
+	/// Evaluate the phase function
+	float eval(const PhaseFunctionQueryRecord &pRec) const {
+		float mu = clamp(-pRec.wi.dot(pRec.wo), -1.0f, 1.0f);
+		int n = (int) m_values.size() - 1;
+		float x = (mu + 1) * 0.5f * n;
+		int j = std::min((int) x, n - 1);
+		float w = x - j;
+		return (1 - w) * m_values[j] + w * m_values[j+1];
+	}
+
+	/// Compute the density of \ref sample() wrt. solid angles
+	float pdf(const PhaseFunctionQueryRecord &pRec) const {
+		float mu = clamp(-pRec.wi.dot(pRec.wo), -1.0f, 1.0f);
+		int k = (int) (std::upper_bound(m_inverseCDF.begin(), m_inverseCDF.end(), mu)
+			- m_inverseCDF.begin()) - 1;
+		k = std::min(std::max(k, 0), m_resolution - 1);
+		float width = m_inverseCDF[k+1] - m_inverseCDF[k];
+		if (width <= 0)
+			return 0.0f;
+		return INV_TWOPI / (m_resolution * width);
+	}
+
+	/// Draw a a sample from the phase function
+	float sample(PhaseFunctionQueryRecord &pRec, const Point2f &sample) const {
+		float x = sample.x() * m_resolution;
+		int k = std::min((int) x, m_resolution - 1);
+		float mu = m_inverseCDF[k] + (x - k) * (m_inverseCDF[k+1] - m_inverseCDF[k]);
+
+		float sinTheta = std::sqrt(std::max(0.0f, 1 - mu * mu)), sinPhi, cosPhi;
+		fastSinCos(2.0f * M_PI * sample.y(), &sinPhi, &cosPhi);
+		pRec.wo = Frame(-pRec.wi).toWorld(
+			Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, mu));
+
+		/* Density of the sample (see pdf()) */
+		float width = m_inverseCDF[k+1] - m_inverseCDF[k];
+		if (width <= 0)
+			return 0.0f;
+		return eval(pRec) * (2.0f * M_PI) * m_resolution * width;
+	}
+
+	/// Return a human-readable summary
+	QString toString() const {
+		return QString(
+			"TabulatedPhaseFunction[\n"
+			"  values = %1,\n"
+			"  resolution = %2\n"
+			"]")
+		.arg(m_input.size())
+		.arg(m_resolution);
+	}
+private:
+	/// Phase function values at equally spaced scattering angles
+	std::vector<float> m_input;
+	int m_resolution;
+
+	/// Normalized phase function and CDF at equally spaced cosines
+	std::vector<float> m_values;
+	std::vector<float> m_cdf;
+
+	/// Cosines at which the CDF reaches 0, 1/resolution, .., 1
+	std::vector<float> m_inverseCDF;
+};
+
+NORI_REGISTER_CLASS(TabulatedPhaseFunction, "tabulated");
+NORI_NAMESPACE_END
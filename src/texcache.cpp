@@ -0,0 +1,286 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/texcache.h>
+#include <ImfTiledInputFile.h>
+#include <ImfChannelList.h>
+#include <ImfTestFile.h>
+#include <QFile>
+#include <QMutexLocker>
+
+NORI_NAMESPACE_BEGIN
+
+/// Key of a tile: 24 bits for the image, 6 for the level and 17 for each coordinate
+static inline uint64_t tileKey(uint32_t image, int level, int x, int y) {
+	return ((uint64_t) image << 40) | ((uint64_t) level << 34)
+		| ((uint64_t) x << 17) | (uint64_t) y;
+}
+
+/// Scramble the bits of a key, so that neighboring tiles use different slots
+static inline uint32_t tileHash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t) key;
+}
+
+TextureCache::TextureCache() : m_budget((size_t) NORI_TEXCACHE_DEFAULT_BUDGET << 20),
+	m_nextID(0) {
+}
+
+TextureCache *TextureCache::getInstance() {
+	static TextureCache cache;
+	return &cache;
+}
+
+void TextureCache::setMemoryBudget(size_t bytes) {
+	m_budget = bytes;
+}
+
+size_t TextureCache::getMemoryUsage() const {
+	size_t result = 0;
+	for (int i=0; i<NORI_TEXCACHE_SHARDS; ++i) {
+		Shard &shard = const_cast<Shard &>(m_shards[i]);
+		QMutexLocker locker(&shard.mutex);
+		result += shard.memory;
+	}
+	return result;
+}
+
+uint32_t TextureCache::registerImage() {
+	/* IDs are never reused, so that stale tiles in the lookup caches
+	   of the threads can't be mistaken for those of a new image */
+	int id = m_nextID.fetchAndAddOrdered(1);
+	if (id >= (1 << 24))
+		throw NoriException("TextureCache: too many images were opened!");
+	return (uint32_t) id;
+}
+
+const TextureTile *TextureCache::getTile(const TiledImage *image, int level, int x, int y) {
+	uint64_t key = tileKey(image->getID(), level, x, y);
+
+	if (!m_threadTiles.hasLocalData())
+		m_threadTiles.setLocalData(new ThreadTiles());
+	TextureTile *&slot = m_threadTiles.localData()->tiles[
+		tileHash(key) & (NORI_TEXCACHE_THREAD_TILES - 1)];
+	if (slot && slot->key == key)
+		return slot;
+
+	TextureTile *tile = fetch(image, key, level, x, y);
+	if (slot)
+		slot->release();
+	slot = tile;
+	return tile;
+}
+
+TextureTile *TextureCache::fetch(const TiledImage *image, uint64_t key,
+		int level, int x, int y) {
+	Shard &shard = m_shards[tileHash(key) % NORI_TEXCACHE_SHARDS];
+	std::map<uint64_t, TextureTile *>::iterator it;
+	{
+		QMutexLocker locker(&shard.mutex);
+		it = shard.tiles.find(key);
+		if (it != shard.tiles.end()) {
+			TextureTile *tile = it->second;
+			unlink(shard, tile);
+			pushFront(shard, tile);
+			tile->refs.ref();
+			return tile;
+		}
+	}
+
+	/* Read the tile without holding the lock */
+	TextureTile *tile = image->readTile(level, x, y);
+	tile->key = key;
+
+	QMutexLocker locker(&shard.mutex);
+	it = shard.tiles.find(key);
+	if (it != shard.tiles.end()) {
+		/* Another thread was faster */
+		delete tile;
+		tile = it->second;
+		unlink(shard, tile);
+	} else {
+		shard.tiles[key] = tile;
+		shard.memory += tile->getMemoryUsage();
+
+		/* Evict the least recently used tiles of the shard */
+		size_t budget = m_budget / NORI_TEXCACHE_SHARDS;
+		while (shard.memory > budget && shard.tail) {
+			TextureTile *victim = shard.tail;
+			unlink(shard, victim);
+			shard.tiles.erase(victim->key);
+			shard.memory -= victim->getMemoryUsage();
+			victim->release();
+		}
+	}
+	pushFront(shard, tile);
+	tile->refs.ref();
+	return tile;
+}
+
+void TextureCache::unlink(Shard &shard, TextureTile *tile) {
+	if (tile->prev)
+		tile->prev->next = tile->next;
+	else
+		shard.head = tile->next;
+	if (tile->next)
+		tile->next->prev = tile->prev;
+	else
+		shard.tail = tile->prev;
+	tile->prev = tile->next = NULL;
+}
+
+void TextureCache::pushFront(Shard &shard, TextureTile *tile) {
+	tile->next = shard.head;
+	tile->prev = NULL;
+	if (shard.head)
+		shard.head->prev = tile;
+	else
+		shard.tail = tile;
+	shard.head = tile;
+}
+
+/// An open tiled OpenEXR file and the names of its color channels
+struct TiledImageFile {
+	Imf::TiledInputFile file;
+	const char *channels[3];
+	/// Serializes the reads, which need to set a frame buffer first
+	QMutex mutex;
+
+	TiledImageFile(const char *filename) : file(filename) { }
+};
+
+/// Find the names of the red, green and blue channels of an OpenEXR file
+static void findChannels(const Imf::ChannelList &channels, const char **result) {
+	result[0] = result[1] = result[2] = NULL;
+	for (Imf::ChannelList::ConstIterator it = channels.begin(); it != channels.end(); ++it) {
+		QString name = QString(it.name()).toLower();
+		if (it.channel().xSampling != 1 || it.channel().ySampling != 1)
+			continue;
+
+		if (!result[0] && (name == "r" || name == "red" ||
+				name.endsWith(".r") || name.endsWith(".red")))
+			result[0] = it.name();
+		else if (!result[1] && (name == "g" || name == "green" ||
+				name.endsWith(".g") || name.endsWith(".green")))
+			result[1] = it.name();
+		else if (!result[2] && (name == "b" || name == "blue" ||
+				name.endsWith(".b") || name.endsWith(".blue")))
+			result[2] = it.name();
+	}
+}
+
+TiledImage::TiledImage(const QString &filename) : m_filename(filename), m_id(0), m_file(NULL) {
+	if (!QFile(filename).exists())
+		throw NoriException(QString("EXR file \"%1\" does not exist!").arg(filename));
+
+	QByteArray filenameUtf8 = filename.toUtf8();
+	bool tiled = false;
+	if (!Imf::isOpenExrFile(filenameUtf8.data(), tiled))
+		throw NoriException(QString("\"%1\" is not an OpenEXR file!").arg(filename));
+
+	if (!tiled) {
+		/* Read the whole image, and compute the mip map */
+		m_levels.push_back(new Bitmap(filename));
+		while (m_levels.back()->cols() > 1 || m_levels.back()->rows() > 1) {
+			const Bitmap &fine = *m_levels.back();
+			Bitmap *coarse = new Bitmap(Vector2i(
+				std::max(1, (int) (fine.cols() + 1) / 2),
+				std::max(1, (int) (fine.rows() + 1) / 2)));
+			for (int y=0; y<coarse->rows(); ++y) {
+				for (int x=0; x<coarse->cols(); ++x) {
+					int x0 = std::min(2*x, (int) fine.cols() - 1), x1 = std::min(2*x + 1, (int) fine.cols() - 1),
+					    y0 = std::min(2*y, (int) fine.rows() - 1), y1 = std::min(2*y + 1, (int) fine.rows() - 1);
+					coarse->coeffRef(y, x) = (fine.coeff(y0, x0) + fine.coeff(y0, x1)
+						+ fine.coeff(y1, x0) + fine.coeff(y1, x1)) * 0.25f;
+				}
+			}
+			m_levels.push_back(coarse);
+		}
+		for (size_t i=0; i<m_levels.size(); ++i)
+			m_levelSizes.push_back(Vector2i(m_levels[i]->cols(), m_levels[i]->rows()));
+		return;
+	}
+
+	try {
+		m_file = new TiledImageFile(filenameUtf8.data());
+	} catch (const std::exception &ex) {
+		throw NoriException(QString("Unable to open \"%1\": %2").arg(filename).arg(ex.what()));
+	}
+	Imf::TiledInputFile &file = m_file->file;
+
+	findChannels(file.header().channels(), m_file->channels);
+	if (!m_file->channels[0] || !m_file->channels[1] || !m_file->channels[2]) {
+		delete m_file;
+		m_file = NULL;
+		throw NoriException("This is not a standard RGB OpenEXR file!");
+	}
+
+	/* Use the levels that are scaled equally in x and y */
+	int levelCount = std::min(file.numXLevels(), file.numYLevels());
+	for (int i=0; i<levelCount; ++i)
+		m_levelSizes.push_back(Vector2i(file.levelWidth(i), file.levelHeight(i)));
+	m_tileSize = Vector2i(file.tileXSize(), file.tileYSize());
+	m_id = TextureCache::getInstance()->registerImage();
+
+	cout << "Opened a " << m_levelSizes[0].x() << "x" << m_levelSizes[0].y()
+		 << " tiled OpenEXR file with " << levelCount << " level(s) from \""
+		 << qPrintable(filename) << "\"" << endl;
+}
+
+TiledImage::~TiledImage() {
+	delete m_file;
+	for (size_t i=0; i<m_levels.size(); ++i)
+		delete m_levels[i];
+}
+
+TextureTile *TiledImage::readTile(int level, int x, int y) const {
+	Imf::TiledInputFile &file = m_file->file;
+	QMutexLocker locker(&m_file->mutex);
+	try {
+		Imath::Box2i dw = file.dataWindowForTile(x, y, level, level);
+		int width = dw.max.x - dw.min.x + 1, height = dw.max.y - dw.min.y + 1;
+		TextureTile *tile = new TextureTile(width, height);
+
+		/* The frame buffer is addressed using absolute pixel coordinates */
+		size_t compStride = sizeof(float),
+		       pixelStride = sizeof(Color3f),
+		       rowStride = pixelStride * width;
+		char *ptr = reinterpret_cast<char *>(tile->pixels)
+			- dw.min.x * pixelStride - dw.min.y * rowStride;
+
+		Imf::FrameBuffer frameBuffer;
+		for (int i=0; i<3; ++i)
+			frameBuffer.insert(m_file->channels[i], Imf::Slice(Imf::FLOAT,
+				ptr + i * compStride, pixelStride, rowStride));
+		file.setFrameBuffer(frameBuffer);
+		try {
+			file.readTile(x, y, level, level);
+		} catch (...) {
+			delete tile;
+			throw;
+		}
+		return tile;
+	} catch (const std::exception &ex) {
+		throw NoriException(QString("Unable to read a tile of \"%1\": %2")
+			.arg(m_filename).arg(ex.what()));
+	}
+}
+
+NORI_NAMESPACE_END
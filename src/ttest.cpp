@@ -24,9 +24,121 @@
 #include <nori/sampler.h>
 #include <boost/math/distributions/students_t.hpp>
 #include <QStringList>
+#include <QThread>
+
+/// Number of camera paths per work unit of \ref PathWorker
+#define NORI_TTEST_CHUNK_SIZE 4096
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Running mean and variance of a sequence of values
+ *
+ * Uses the numerically robust online algorithm by Welford (see Knuth,
+ * TAOCP vol.2, 3rd ed., p.232). Two accumulators can be merged using
+ * the pairwise formula by Chan et al., which is equally stable.
+ */
+struct MomentAccumulator {
+	uint64_t count;
+	double mean, m2;
+
+	inline MomentAccumulator() : count(0), mean(0), m2(0) { }
+
+	/// Add a value
+	inline void add(double value) {
+		++count;
+		double delta = value - mean;
+		mean += delta / (double) count;
+		m2 += delta * (value - mean);
+	}
+
+	/// Add all values of another accumulator
+	inline void merge(const MomentAccumulator &acc) {
+		if (acc.count == 0)
+			return;
+		uint64_t total = count + acc.count;
+		double delta = acc.mean - mean;
+		mean += delta * ((double) acc.count / (double) total);
+		m2 += acc.m2 + delta * delta * ((double) count * (double) acc.count / (double) total);
+		count = total;
+	}
+
+	/// Return the sample variance
+	inline double getVariance() const {
+		return count > 1 ? m2 / (double) (count - 1) : 0.0;
+	}
+};
+
+/**
+ * \brief Generates camera paths for \ref StudentsTTest
+ *
+ * The paths are split into chunks of \ref NORI_TTEST_CHUNK_SIZE,
+ * which the threads take from a shared counter (up to the last chunk
+ * of the current round of the sequential test). The sampler is
+ * restarted at the beginning of every chunk (using the chunk index as
+ * the pixel), and every chunk has its own accumulator. Merging these 
+ * in order makes the result independent of the number of threads.
+ */
+class PathWorker : public QThread {
+public:
+	PathWorker(const Scene *scene, Sampler *sampler, int sampleCount,
+			QAtomicInt &nextChunk, int lastChunk, std::vector<MomentAccumulator> &chunks)
+		: m_scene(scene), m_sampler(sampler), m_sampleCount(sampleCount),
+		  m_nextChunk(nextChunk), m_lastChunk(lastChunk), m_chunks(chunks) { }
+
+	virtual ~PathWorker() {
+		delete m_sampler;
+	}
+
+	void run() {
+		try {
+			const Integrator *integrator = m_scene->getIntegrator();
+			const Camera *camera = m_scene->getCamera();
+			RenderContext context(m_scene, m_sampler);
+
+			while (true) {
+				int chunk = m_nextChunk.fetchAndAddRelaxed(1);
+				if (chunk >= m_lastChunk)
+					break;
+				int first = chunk * NORI_TTEST_CHUNK_SIZE,
+				    last = std::min(first + NORI_TTEST_CHUNK_SIZE, m_sampleCount);
+				MomentAccumulator &acc = m_chunks[chunk];
+				m_sampler->generate(Point2i(chunk, 0));
+
+				for (int i=first; i<last; ++i) {
+					/* Sample a ray from the camera */
+					Ray3f ray;
+					Point2f pixelSample = (m_sampler->next2D().array() 
+						* camera->getOutputSize().cast<float>().array()).matrix();
+					Color3f value = camera->sampleRay(ray, pixelSample, m_sampler->next2D());
+					if (camera->hasMotionBlur())
+						ray.time = camera->sampleTime(m_sampler->next1D());
+					/* Compute the incident radiance */
+					value *= integrator->Li(context, ray);
+					context.arena->reset();
+					m_sampler->advance();
+
+					acc.add((double) value.getLuminance());
+				}
+			}
+		} catch (const NoriException &ex) {
+			m_error = ex.getReason();
+		} catch (const std::exception &ex) {
+			m_error = ex.what();
+		}
+	}
+
+	inline const QString &getError() const { return m_error; }
+private:
+	const Scene *m_scene;
+	Sampler *m_sampler;
+	int m_sampleCount;
+	QAtomicInt &m_nextChunk;
+	int m_lastChunk;
+	std::vector<MomentAccumulator> &m_chunks;
+	QString m_error;
+};
+
 /**
  * Student's t-test for the equality of means
  *
@@ -45,7 +157,12 @@ NORI_NAMESPACE_BEGIN
  *    into a certain direction matches a given value (modulo noise).
  * 
  * 2. that the average radiance received by a camera within some scene
- *    matches a given value (modulo noise).
+ *    matches a given value (modulo noise). The camera paths are
+ *    generated using one \ref PathWorker thread per core.
+ *
+ * The test is sequential: the samples are drawn in several rounds, and
+ * each test stops after a round once its outcome is clear (see
+ * \ref decide()).
  */
 class StudentsTTest : public NoriObject {
 public:
@@ -81,6 +198,16 @@ public:
 
 		/* Number of BSDF samples that should be generated (default: 100K) */
 		m_sampleCount = propList.getInteger("sampleCount", 100000);
+
+		/* Sequential testing: the samples are drawn in this many rounds,
+		   and the test stops after a round once its outcome is clear. The
+		   null hypothesis is accepted early when the p-value exceeds
+		   'acceptLevel' (1 = never). A single round takes all samples. */
+		m_rounds = propList.getInteger("rounds", 8);
+		m_acceptLevel = propList.getFloat("acceptLevel", 0.5f);
+		if (m_rounds < 1 || m_acceptLevel <= 0 || m_acceptLevel > 1)
+			throw NoriException(QString("Invalid sequential test parameters (rounds=%1 "
+				"must be >= 1, acceptLevel=%2 must be in (0, 1])").arg(m_rounds).arg(m_acceptLevel));
 	}
 
 	virtual ~StudentsTTest() {
@@ -106,35 +233,61 @@ public:
 		}
 	}
 
-	/// Conduct a two-sided t-test
-	bool ttest(double mean, double variance, double reference) {
+	/// Compute the p-value of a two-sided t-test
+	float ttest(const MomentAccumulator &acc, double reference) {
 		/* Compute the t statistic */
-		float t = std::abs(mean - reference) * std::sqrt(m_sampleCount / std::max(variance, (double) Epsilon));
+		float t = std::abs(acc.mean - reference) * std::sqrt(acc.count
+			/ std::max(acc.getVariance(), (double) Epsilon));
 
 		/* Determine the degrees of freedom, and instantiate a matching distribution object */
-		int dof = m_sampleCount - 1;
+		int dof = (int) std::max(acc.count, (uint64_t) 2) - 1;
 		boost::math::students_t distr(dof);
 
-		cout << "Sample mean = " << mean << " (reference value = " << reference << ")" << endl;
-		cout << "Sample variance = " << variance << endl;
+		cout << "Sample mean = " << acc.mean << " (reference value = " << reference << ")" << endl;
+		cout << "Sample variance = " << acc.getVariance() << endl;
 		cout << "t-statistic = " << t << " (d.o.f. = " << dof << ")" << endl;
 
 		/* Compute the p-value */
-		float pval = (float) (2*boost::math::cdf(boost::math::complement(distr, t)));
+		return (float) (2*boost::math::cdf(boost::math::complement(distr, t)));
+	}
 
+	/**
+	 * \brief Decide on the null hypothesis after a round of samples
+	 *
+	 * The significance level is spent over the rounds in proportion to
+	 * the square of the fraction of samples drawn so far, which (like
+	 * O'Brien-Fleming boundaries) keeps most of it for the last round.
+	 * The levels of all rounds sum up to the (Sidak-corrected)
+	 * significance level, so the probability of a false rejection
+	 * remains below it.
+	 *
+	 * \param previous
+	 *     Number of samples before this round
+	 * \param done
+	 *     Number of samples after this round
+	 * \return 1 (accepted), -1 (rejected) or 0 (undecided, continue)
+	 */
+	int decide(float pval, int previous, int done) {
 		/* Apply the Sidak correction term, since we'll be conducting multiple independent 
 		   hypothesis tests. This accounts for the fact that the probability of a failure
 		   increases quickly when several hypothesis tests are run in sequence. */
 		float alpha = 1.0f - std::pow(1.0f - m_significanceLevel, 1.0f / m_references.size());
 
-		if (pval < alpha) {
+		float before = (float) previous / m_sampleCount, after = (float) done / m_sampleCount;
+		float level = alpha * (after * after - before * before);
+
+		if (pval < level) {
 			cout << "Rejected the null hypothesis (p-value = " << pval << ", "
-				"significance level = " << alpha << ")" << endl;
-			return false;
-		} else {
+				"significance level = " << level << ", " << done << " samples)" << endl;
+			return -1;
+		} else if (done == m_sampleCount || pval > m_acceptLevel) {
 			cout << "Accepted the null hypothesis (p-value = " << pval << ", "
-				"significance level = " << alpha << ")" << endl;
-			return true;
+				"significance level = " << level << ", " << done << " samples)" << endl;
+			return 1;
+		} else {
+			cout << "Undecided after " << done << " samples (p-value = " << pval << ", "
+				"significance level = " << level << "), continuing .." << endl;
+			return 0;
 		}
 	}
 
@@ -142,6 +295,7 @@ public:
 	void activate() {
 		Random *random = new Random();
 		int total = 0, passed = 0;
+		int64_t samplesUsed = 0;
 
 		if (!m_bsdfs.empty()) {
 			if (m_references.size() != m_angles.size())
@@ -161,20 +315,21 @@ public:
 
 					BSDFQueryRecord bRec(sphericalDirection(degToRad(angle), 0));
 
-					cout << "Drawing " << m_sampleCount << " samples .. " << endl;
-					double mean=0, variance = 0;
-					for (int k=0; k<m_sampleCount; ++k) {
-						Point2f sample(random->nextFloat(), random->nextFloat());
-						double result = (double) bsdf->sample(bRec, sample).getLuminance();
-
-						/* Numerically robust online variance estimation using an
-						algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-						double delta = result - mean;
-						mean += delta / (double) (k+1);
-						variance += delta * (result - mean);
+					cout << "Drawing up to " << m_sampleCount << " samples in " 
+						 << m_rounds << " rounds .. " << endl;
+					MomentAccumulator acc;
+					int decision = 0;
+					for (int round=1; decision == 0; ++round) {
+						int previous = (int) acc.count,
+						    target = (int) ((int64_t) m_sampleCount * round / m_rounds);
+						for (int k=previous; k<target; ++k) {
+							Point2f sample(random->nextFloat(), random->nextFloat());
+							acc.add((double) bsdf->sample(bRec, sample).getLuminance());
+						}
+						decision = decide(ttest(acc, reference), previous, target);
 					}
-					variance /= m_sampleCount - 1;
-					if (ttest(mean, variance, reference))
+					samplesUsed += acc.count;
+					if (decision > 0)
 						++passed;
 					cout << endl;
 				}
@@ -185,43 +340,64 @@ public:
 
 			Sampler *sampler = static_cast<Sampler *>(
 				NoriObjectFactory::createInstance("independent", PropertyList()));
+			int chunkCount = (m_sampleCount + NORI_TTEST_CHUNK_SIZE - 1) / NORI_TTEST_CHUNK_SIZE;
 	
 			for (size_t k=0; k<m_scenes.size(); ++k) {
 				const Scene *scene = m_scenes[k];
-				const Integrator *integrator = scene->getIntegrator();
-				const Camera *camera = scene->getCamera();
 				float reference = m_references[k];
 
 				cout << "------------------------------------------------------" << endl;
 				cout << "Testing scene: " << qPrintable(scene->toString()) << endl;
 				++total;
 
-				cout << "Generating " << m_sampleCount << " paths.. " << endl;
+				cout << "Generating up to " << m_sampleCount << " paths in "
+					 << m_rounds << " rounds .. " << endl;
+
+				/* Rounds consist of whole chunks, so that the paths don't
+				   depend on the number of rounds either */
+				std::vector<MomentAccumulator> chunks(chunkCount);
+				MomentAccumulator acc;
+				int firstChunk = 0, decision = 0;
+				for (int round=1; decision == 0; ++round) {
+					int lastChunk = (int) ((int64_t) chunkCount * round / m_rounds);
+					int threadCount = std::max(1, std::min(getCoreCount(), lastChunk - firstChunk));
+					QAtomicInt nextChunk(firstChunk);
+					std::vector<PathWorker *> workers(threadCount);
+					for (int i=0; i<threadCount; ++i) {
+						workers[i] = new PathWorker(scene, sampler->clone(),
+							m_sampleCount, nextChunk, lastChunk, chunks);
+						workers[i]->start();
+					}
 
-				double mean=0, variance = 0;
-				for (int k=0; k<m_sampleCount; ++k) {
-					/* Sample a ray from the camera */
-					Ray3f ray;
-					Point2f pixelSample = (sampler->next2D().array() 
-						* camera->getOutputSize().cast<float>().array()).matrix();
-					Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
-					/* Compute the incident radiance */
-					value *= integrator->Li(scene, sampler, ray);
-
-					/* Numerically robust online variance estimation using an
-					   algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-					double result = (double) value.getLuminance();
-					double delta = result - mean;
-					mean += delta / (double) (k+1);
-					variance += delta * (result - mean);
+					QString error;
+					for (int i=0; i<threadCount; ++i) {
+						workers[i]->wait();
+						if (error.isEmpty())
+							error = workers[i]->getError();
+						delete workers[i];
+					}
+					if (!error.isEmpty()) {
+						delete sampler;
+						delete random;
+						throw NoriException(QString("StudentsTTest: %1").arg(error));
+					}
+
+					int previous = (int) acc.count;
+					for (int i=firstChunk; i<lastChunk; ++i)
+						acc.merge(chunks[i]);
+					firstChunk = lastChunk;
+					if (acc.count > (uint64_t) previous || round == m_rounds)
+						decision = decide(ttest(acc, reference), previous, (int) acc.count);
 				}
-				variance /= m_sampleCount - 1;
-				if (ttest(mean, variance, reference))
+				samplesUsed += acc.count;
+				if (decision > 0)
 					++passed;
 				cout << endl;
 			}
+			delete sampler;
 		}
-		cout << "Passed " << passed << "/" << total << " tests." << endl;
+		cout << "Passed " << passed << "/" << total << " tests (used " << samplesUsed
+			 << " of " << (int64_t) m_sampleCount * total << " samples)." << endl;
 
 		delete random;
 	}
@@ -230,10 +406,14 @@ public:
 		return QString(
 			"StudentsTTest[\n"
 			"  significanceLevel = %1,\n"
-			"  sampleCount= %2\n"
+			"  sampleCount = %2,\n"
+			"  rounds = %3,\n"
+			"  acceptLevel = %4\n"
 			"]")
 			.arg(m_significanceLevel)
-			.arg(m_sampleCount);
+			.arg(m_sampleCount)
+			.arg(m_rounds)
+			.arg(m_acceptLevel);
 	}
 
 	EClassType getClassType() const { return ETest; }
@@ -244,6 +424,8 @@ private:
 	std::vector<float> m_references;
 	float m_significanceLevel;
 	int m_sampleCount;
+	int m_rounds;
+	float m_acceptLevel;
 };
 
 NORI_REGISTER_CLASS(StudentsTTest, "ttest");
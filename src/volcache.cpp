@@ -0,0 +1,361 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/volcache.h>
+#include <QMutexLocker>
+#include <QThread>
+#include <algorithm>
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_MACOS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Key of a brick: 32 bits for the file and 32 for the brick index
+static inline uint64_t brickKey(uint32_t file, uint32_t index) {
+	return ((uint64_t) file << 32) | (uint64_t) index;
+}
+
+/// Scramble the bits of a key, so that neighboring bricks use different slots
+static inline uint32_t brickHash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t) key;
+}
+
+/// Background thread that reads the bricks requested via \ref VolumeCache::prefetch()
+class PrefetchThread : public QThread {
+public:
+	PrefetchThread(VolumeCache *cache) : m_cache(cache) { }
+
+	void run() { m_cache->runPrefetches(); }
+private:
+	VolumeCache *m_cache;
+};
+
+BrickFile::BrickFile(const QString &filename, uint64_t offset, size_t brickBytes)
+		: m_filename(filename), m_offset(offset), m_brickBytes(brickBytes) {
+	QByteArray name = filename.toLocal8Bit();
+#if defined(PLATFORM_WINDOWS)
+	m_file = CreateFileA(name.data(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		throw NoriException(QString("Could not open \"%1\"!").arg(filename));
+#else
+	m_file = open(name.data(), O_RDONLY);
+	if (m_file == -1)
+		throw NoriException(QString("Could not open \"%1\"!").arg(filename));
+	#if defined(POSIX_FADV_RANDOM)
+		/* Reading ahead of a brick would mostly fetch unrelated ones */
+		posix_fadvise(m_file, 0, 0, POSIX_FADV_RANDOM);
+	#endif
+#endif
+	m_id = VolumeCache::getInstance()->registerFile();
+}
+
+BrickFile::~BrickFile() {
+	VolumeCache::getInstance()->cancelPrefetches(this);
+#if defined(PLATFORM_WINDOWS)
+	CloseHandle(m_file);
+#else
+	close(m_file);
+#endif
+}
+
+VolumeBrick *BrickFile::readBrick(uint32_t index) const {
+	VolumeBrick *brick = new VolumeBrick(m_brickBytes);
+	uint64_t offset = m_offset + (uint64_t) index * m_brickBytes;
+	size_t done = 0;
+	while (done < m_brickBytes) {
+#if defined(PLATFORM_WINDOWS)
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(OVERLAPPED));
+		overlapped.Offset = (DWORD) (offset + done);
+		overlapped.OffsetHigh = (DWORD) ((offset + done) >> 32);
+		DWORD count = 0;
+		if (!ReadFile(m_file, brick->data + done, (DWORD) (m_brickBytes - done), &count, &overlapped))
+			count = 0;
+#else
+		ssize_t count = pread(m_file, brick->data + done, m_brickBytes - done, (off_t) (offset + done));
+		if (count < 0 && errno == EINTR)
+			continue;
+#endif
+		if (count <= 0) {
+			delete brick;
+			throw NoriException(QString("Unable to read brick %1 of \"%2\"!")
+				.arg(index).arg(m_filename));
+		}
+		done += (size_t) count;
+	}
+	return brick;
+}
+
+VolumeCache::ThreadBricks::~ThreadBricks() {
+	for (int i=0; i<NORI_VOLCACHE_THREAD_BRICKS; ++i)
+		if (bricks[i])
+			bricks[i]->release();
+
+	/* Keep the counts of the thread */
+	QMutexLocker locker(&cache->m_statsMutex);
+	cache->m_stats.hits += hits;
+	cache->m_stats.misses += misses;
+	cache->m_threads.erase(std::find(cache->m_threads.begin(), cache->m_threads.end(), this));
+}
+
+VolumeCache::VolumeCache() : m_budget((size_t) NORI_VOLCACHE_DEFAULT_BUDGET << 20),
+	m_nextID(0), m_prefetchFile(NULL), m_prefetchStop(false), m_prefetchThread(NULL) {
+}
+
+VolumeCache::~VolumeCache() {
+	if (!m_prefetchThread)
+		return;
+	m_prefetchMutex.lock();
+	m_prefetchStop = true;
+	m_prefetchPending.wakeAll();
+	m_prefetchMutex.unlock();
+	m_prefetchThread->wait();
+	delete m_prefetchThread;
+}
+
+VolumeCache *VolumeCache::getInstance() {
+	static VolumeCache cache;
+	return &cache;
+}
+
+void VolumeCache::setMemoryBudget(size_t bytes) {
+	m_budget = bytes;
+}
+
+size_t VolumeCache::getMemoryUsage() const {
+	size_t result = 0;
+	for (int i=0; i<NORI_VOLCACHE_SHARDS; ++i) {
+		Shard &shard = const_cast<Shard &>(m_shards[i]);
+		QMutexLocker locker(&shard.mutex);
+		result += shard.memory;
+	}
+	return result;
+}
+
+uint32_t VolumeCache::registerFile() {
+	/* IDs are never reused, so that stale bricks in the lookup caches
+	   of the threads can't be mistaken for those of a new file */
+	return (uint32_t) m_nextID.fetchAndAddOrdered(1);
+}
+
+VolumeCache::ThreadBricks *VolumeCache::getThreadBricks() {
+	if (!m_threadBricks.hasLocalData()) {
+		ThreadBricks *bricks = new ThreadBricks(this);
+		QMutexLocker locker(&m_statsMutex);
+		m_threads.push_back(bricks);
+		m_threadBricks.setLocalData(bricks);
+	}
+	return m_threadBricks.localData();
+}
+
+const VolumeBrick *VolumeCache::getBrick(const BrickFile *file, uint32_t index) {
+	uint64_t key = brickKey(file->getID(), index);
+
+	ThreadBricks *thread = getThreadBricks();
+	VolumeBrick *&slot = thread->bricks[brickHash(key) & (NORI_VOLCACHE_THREAD_BRICKS - 1)];
+	if (slot && slot->key == key) {
+		thread->hits++;
+		return slot;
+	}
+
+	bool wasRead = false;
+	VolumeBrick *brick = fetch(file, key, index, &wasRead);
+	if (wasRead)
+		thread->misses++;
+	else
+		thread->hits++;
+	if (slot)
+		slot->release();
+	slot = brick;
+	return brick;
+}
+
+void VolumeCache::prefetch(const BrickFile *file, uint32_t index) {
+	uint64_t key = brickKey(file->getID(), index);
+	const VolumeBrick *slot = getThreadBricks()->bricks[
+		brickHash(key) & (NORI_VOLCACHE_THREAD_BRICKS - 1)];
+	if (slot && slot->key == key)
+		return;
+
+	QMutexLocker locker(&m_prefetchMutex);
+	if (m_prefetchQueue.size() >= NORI_VOLCACHE_PREFETCH_QUEUE) {
+		QMutexLocker statsLocker(&m_statsMutex);
+		m_stats.droppedPrefetches++;
+		return;
+	}
+	PrefetchRequest request;
+	request.file = file;
+	request.index = index;
+	m_prefetchQueue.push_back(request);
+	if (!m_prefetchThread) {
+		m_prefetchThread = new PrefetchThread(this);
+		m_prefetchThread->start();
+	}
+	m_prefetchPending.wakeOne();
+}
+
+void VolumeCache::cancelPrefetches(const BrickFile *file) {
+	QMutexLocker locker(&m_prefetchMutex);
+	std::deque<PrefetchRequest>::iterator it = m_prefetchQueue.begin();
+	while (it != m_prefetchQueue.end()) {
+		if (it->file == file)
+			it = m_prefetchQueue.erase(it);
+		else
+			++it;
+	}
+	while (m_prefetchFile == file)
+		m_prefetchDone.wait(&m_prefetchMutex);
+}
+
+void VolumeCache::runPrefetches() {
+	QMutexLocker locker(&m_prefetchMutex);
+	while (true) {
+		while (m_prefetchQueue.empty() && !m_prefetchStop)
+			m_prefetchPending.wait(&m_prefetchMutex);
+		if (m_prefetchStop)
+			break;
+		PrefetchRequest request = m_prefetchQueue.front();
+		m_prefetchQueue.pop_front();
+		m_prefetchFile = request.file;
+		locker.unlock();
+
+		try {
+			fetch(request.file, brickKey(request.file->getID(), request.index),
+				request.index, NULL)->release();
+		} catch (const NoriException &ex) {
+			cerr << "Warning: prefetching failed: " << qPrintable(ex.getReason()) << endl;
+		}
+
+		locker.relock();
+		m_prefetchFile = NULL;
+		m_prefetchDone.wakeAll();
+	}
+}
+
+VolumeBrick *VolumeCache::fetch(const BrickFile *file, uint64_t key, uint32_t index, bool *wasRead) {
+	Shard &shard = m_shards[brickHash(key) % NORI_VOLCACHE_SHARDS];
+	std::map<uint64_t, VolumeBrick *>::iterator it;
+	{
+		QMutexLocker locker(&shard.mutex);
+		it = shard.bricks.find(key);
+		if (it != shard.bricks.end()) {
+			VolumeBrick *brick = it->second;
+			unlink(shard, brick);
+			pushFront(shard, brick);
+			brick->refs.ref();
+			return brick;
+		}
+	}
+
+	/* Read the brick without holding the lock */
+	VolumeBrick *brick = file->readBrick(index);
+	brick->key = key;
+
+	uint64_t evictions = 0;
+	{
+		QMutexLocker locker(&shard.mutex);
+		it = shard.bricks.find(key);
+		if (it != shard.bricks.end()) {
+			/* Another thread was faster */
+			delete brick;
+			brick = it->second;
+			unlink(shard, brick);
+		} else {
+			shard.bricks[key] = brick;
+			shard.memory += brick->getMemoryUsage();
+
+			/* Evict the least recently used bricks of the shard */
+			size_t budget = m_budget / NORI_VOLCACHE_SHARDS;
+			while (shard.memory > budget && shard.tail) {
+				VolumeBrick *victim = shard.tail;
+				unlink(shard, victim);
+				shard.bricks.erase(victim->key);
+				shard.memory -= victim->getMemoryUsage();
+				victim->release();
+				evictions++;
+			}
+		}
+		pushFront(shard, brick);
+		brick->refs.ref();
+	}
+
+	QMutexLocker locker(&m_statsMutex);
+	if (wasRead)
+		*wasRead = true;
+	else
+		m_stats.prefetches++;
+	m_stats.evictions += evictions;
+	m_stats.bytesRead += brick->size;
+	return brick;
+}
+
+VolumeCache::Statistics VolumeCache::getStatistics() const {
+	QMutexLocker locker(&m_statsMutex);
+	Statistics stats = m_stats;
+	for (size_t i=0; i<m_threads.size(); ++i) {
+		stats.hits += m_threads[i]->hits;
+		stats.misses += m_threads[i]->misses;
+	}
+	return stats;
+}
+
+QString VolumeCache::toString(const Statistics &start, const Statistics &end) {
+	uint64_t hits = end.hits - start.hits, misses = end.misses - start.misses;
+	return QString("Volume cache: %1 hits, %2 misses (%3% hit rate), %4 prefetched "
+			"(%5 dropped), %6 evicted, %7 MiB read, %8 MiB resident")
+		.arg(hits)
+		.arg(misses)
+		.arg(hits + misses > 0 ? 100.0 * hits / (hits + misses) : 100.0, 0, 'f', 2)
+		.arg(end.prefetches - start.prefetches)
+		.arg(end.droppedPrefetches - start.droppedPrefetches)
+		.arg(end.evictions - start.evictions)
+		.arg((end.bytesRead - start.bytesRead) / (1024.0 * 1024.0), 0, 'f', 1)
+		.arg(getInstance()->getMemoryUsage() / (1024.0 * 1024.0), 0, 'f', 1);
+}
+
+void VolumeCache::unlink(Shard &shard, VolumeBrick *brick) {
+	if (brick->prev)
+		brick->prev->next = brick->next;
+	else
+		shard.head = brick->next;
+	if (brick->next)
+		brick->next->prev = brick->prev;
+	else
+		shard.tail = brick->prev;
+	brick->prev = brick->next = NULL;
+}
+
+void VolumeCache::pushFront(Shard &shard, VolumeBrick *brick) {
+	brick->next = shard.head;
+	brick->prev = NULL;
+	if (shard.head)
+		shard.head->prev = brick;
+	else
+		shard.tail = brick;
+	shard.head = brick;
+}
+
+NORI_NAMESPACE_END